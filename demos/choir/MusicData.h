@@ -7,6 +7,7 @@
 
 #include "zg/ZGPeerID.h"
 #include "zg/IDatabaseObject.h"
+#include "zg/ZGChecksumUtilityFunctions.h"
 #include "ChoirNameSpace.h"
 
 namespace choir {
@@ -36,15 +36,15 @@ void MusicSheet :: SetSongFilePath(const String & songFilePath)
 {
    if (songFilePath != _songFilePath)
    {
-      _checksum -= _songFilePath.CalculateChecksum();
+      _checksum -= CalculateChecksum64(_songFilePath);
       _songFilePath = songFilePath;
-      _checksum += _songFilePath.CalculateChecksum();
+      _checksum += CalculateChecksum64(_songFilePath);
    }
 }
 
-uint32 MusicSheet :: CalculateChecksum() const
+uint64 MusicSheet :: CalculateChecksum() const
 {
-   uint32 ret = _songFilePath.CalculateChecksum();
+   uint64 ret = CalculateChecksum64(_songFilePath);
    for (ConstHashtableIterator<uint32, uint64> iter(_chords); iter.HasData(); iter++) ret += CalculateChecksumForChord(iter.GetKey(), iter.GetValue());
    return ret;
 }
@@ -191,7 +191,7 @@ void MusicSheet :: MoveChordsBackOneStartingAt(uint32 whichChord)
 String MusicSheet :: ToString() const
 {
    String ret;
-   char buf[256]; muscleSprintf(buf, "MusicSheet %p has " UINT32_FORMAT_SPEC " chords, _usedNotes is " XINT64_FORMAT_SPEC ", _checksum is " UINT32_FORMAT_SPEC "\n", this, _chords.GetNumItems(), _usedNotes, _checksum);
+   char buf[256]; muscleSprintf(buf, "MusicSheet %p has " UINT32_FORMAT_SPEC " chords, _usedNotes is " XINT64_FORMAT_SPEC ", _checksum is " XINT64_FORMAT_SPEC "\n", this, _chords.GetNumItems(), _usedNotes, _checksum);
    ret = buf;
    ret += String("_songFilePath is [%1]\n").Arg(_songFilePath);
 
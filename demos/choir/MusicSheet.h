@@ -77,10 +77,10 @@ public:
    uint64 GetAllUsedNotesChord() const {return _usedNotes;}
 
    /** Returns the checksum of this object (which is updated whenever this object's contents change) */
-   virtual uint32 GetCurrentChecksum() const {return _checksum;}
+   virtual uint64 GetCurrentChecksum() const {return _checksum;}
 
    /** Calculates our current checksum from scratch (expensive!) */
-   virtual uint32 CalculateChecksum() const;
+   virtual uint64 CalculateChecksum() const;
 
    /** Updates our state as specified in the (seniorDoMsg).  Will only be called on the instance running on the senior peer.
      * @param seniorDoMsg A Message containing instructions for how to update our state on the senior peer.
@@ -98,7 +98,7 @@ public:
    virtual String ToString() const;
 
 private:
-   uint32 CalculateChecksumForChord(uint32 whichChord, uint64 chordValue) const {return ((whichChord+1)*CalculatePODChecksum(chordValue));}
+   uint64 CalculateChecksumForChord(uint32 whichChord, uint64 chordValue) const {return MixChecksum64(chordValue ^ MixChecksum64(whichChord+1));}
    void MoveChordsBackOneStartingAt(uint32 whichChord);
    void SetToDefaultStateAux();
 
@@ -108,7 +108,7 @@ private:
    Hashtable<uint8, uint32> _noteHistogram;  // how many times each note is used in this song
    uint64 _usedNotes;                        // bit-chord of currently used notes (computed from the histogram)
 
-   uint32 _checksum;    // always kept current, by updating it after each change
+   uint64 _checksum;    // always kept current, by updating it after each change
 };
 DECLARE_REFTYPES(MusicSheet);
 
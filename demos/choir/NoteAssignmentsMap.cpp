@@ -69,19 +69,19 @@ status_t NoteAssignmentsMap :: SaveToArchive(const MessageRef & archiveRef) cons
 // This is just here for debugging -- in actual use it shouldn't be necessary since we keep
 // a running checksum instead (but the running checksum should always be equal to the value returned
 // by this method!)
-uint32 NoteAssignmentsMap :: CalculateChecksum() const
+uint64 NoteAssignmentsMap :: CalculateChecksum() const
 {
-   uint32 ret = _assignmentStrategy;
+   uint64 ret = _assignmentStrategy;
    for (ConstHashtableIterator<ZGPeerID, uint64> iter(_noteAssignments); iter.HasData(); iter++) ret += CalculateChecksumForPeer(iter.GetKey(), iter.GetValue());
    return ret;
 }
 
 void NoteAssignmentsMap :: VerifyRunningChecksum(const char * desc) const
 {
-   uint32 cc = CalculateChecksum();
+   const uint64 cc = CalculateChecksum();
    if (cc != _checksum)
    {
-      LogTime(MUSCLE_LOG_ERROR, "NoteAssignmentsMap(%s):  Checksum verification failed!  Running checksum is " UINT32_FORMAT_SPEC ", should have been " UINT32_FORMAT_SPEC "\n", desc, _checksum, cc);
+      LogTime(MUSCLE_LOG_ERROR, "NoteAssignmentsMap(%s):  Checksum verification failed!  Running checksum is " XINT64_FORMAT_SPEC ", should have been " XINT64_FORMAT_SPEC "\n", desc, _checksum, cc);
    }
 }
 
@@ -300,7 +300,7 @@ void NoteAssignmentsMap :: Print(const OutputPrinter & p) const
 String NoteAssignmentsMap :: ToString() const
 {
    String ret;
-   char buf[512]; muscleSprintf(buf, "NoteAssignmentsMap %p has " UINT32_FORMAT_SPEC " entries, _assignedNotes is " UINT64_FORMAT_SPEC ", _assignmentStrategy is " UINT32_FORMAT_SPEC ", _checksum is " UINT32_FORMAT_SPEC "\n", this, _noteAssignments.GetNumItems(), _assignedNotes, _assignmentStrategy, _checksum);
+   char buf[512]; muscleSprintf(buf, "NoteAssignmentsMap %p has " UINT32_FORMAT_SPEC " entries, _assignedNotes is " UINT64_FORMAT_SPEC ", _assignmentStrategy is " UINT32_FORMAT_SPEC ", _checksum is " XINT64_FORMAT_SPEC "\n", this, _noteAssignments.GetNumItems(), _assignedNotes, _assignmentStrategy, _checksum);
    ret = buf;
 
    for (ConstHashtableIterator<ZGPeerID, uint64> iter(_noteAssignments); iter.HasData(); iter++)
@@ -54,10 +54,10 @@ public:
    uint32 GetAssignmentStrategy() const {return _assignmentStrategy;}
 
    /** Returns the checksum of this object (which is updated whenever this object's contents change) */
-   virtual uint32 GetCurrentChecksum() const {return _checksum;}
+   virtual uint64 GetCurrentChecksum() const {return _checksum;}
 
    /** Recalculates our checksum from scratch (expensive!) */
-   virtual uint32 CalculateChecksum() const;
+   virtual uint64 CalculateChecksum() const;
 
    /** Updates our state as specified in the (seniorDoMsg).  Will only be called on the instance running on the senior peer.
      * @param seniorDoMsg A Message containing instructions for how to update our state on the senior peer.
@@ -87,7 +87,7 @@ public:
    const Hashtable<uint8, uint32> & GetNoteHistogram() const {return _noteHistogram;}
 
 private:
-   uint32 CalculateChecksumForPeer(const ZGPeerID & peerID, uint64 chordValue) const {return peerID.CalculateChecksum()+CalculatePODChecksum(chordValue);}
+   uint64 CalculateChecksumForPeer(const ZGPeerID & peerID, uint64 chordValue) const {return MixChecksum64(peerID.GetHighBits() ^ MixChecksum64(peerID.GetLowBits() ^ MixChecksum64(chordValue)));}
    const ZGPeerID & GetLightestPeer(const Hashtable<ZGPeerID, ConstMessageRef> & onlinePeers, uint32 & retCount) const;
    const ZGPeerID & GetHeaviestPeer(const Hashtable<ZGPeerID, ConstMessageRef> & onlinePeers, uint32 & retCount) const;
    void SetToDefaultStateAux();
@@ -101,7 +101,7 @@ private:
    // metadata
    Hashtable<uint8, uint32> _noteHistogram;  // how many times each note is assigned to a peer
    uint64 _assignedNotes;                    // bit-chord of currently assigned notes (computed from the histogram)
-   uint32 _checksum;                         // running checksum (so we don't have to recalculate it from scratch each time)
+   uint64 _checksum;                         // running checksum (so we don't have to recalculate it from scratch each time)
 };
 DECLARE_REFTYPES(NoteAssignmentsMap);
 
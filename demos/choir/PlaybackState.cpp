@@ -67,11 +67,11 @@ void PlaybackState :: SetMicrosPerChord(uint64 microsPerChord, uint64 optNetwork
    _microsPerChord = microsPerChord;
 }
 
-uint32 PlaybackState :: CalculateChecksum() const
+uint64 PlaybackState :: CalculateChecksum() const
 {
-   return CalculatePODChecksum(_networkStartTimeMicros)
-        + CalculatePODChecksum(_microsPerChord)
-        + _pausedIndex
+   return MixChecksum64(_networkStartTimeMicros)
+        + (3*MixChecksum64(_microsPerChord))
+        + (5*MixChecksum64(_pausedIndex))
         + (_loop?1:0);
 }
 
@@ -32,10 +32,10 @@ public:
    virtual status_t SaveToArchive(const MessageRef & archive) const;
 
    /** Just calls CalculateChecksum(), since this database is very small and thus CalculateChecksum() is still cheap */
-   virtual uint32 GetCurrentChecksum() const {return CalculateChecksum();}
+   virtual uint64 GetCurrentChecksum() const {return CalculateChecksum();}
 
    /** Calculates and returns a checksum for this object */
-   virtual uint32 CalculateChecksum() const;
+   virtual uint64 CalculateChecksum() const;
 
    /** Updates our state as specified in the (seniorDoMsg).  Will only be called on the instance running on the senior peer.
      * @param seniorDoMsg A Message containing instructions for how to update our state on the senior peer.
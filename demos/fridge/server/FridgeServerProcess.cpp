@@ -126,7 +126,13 @@ protected:
    {
       switch(whichDatabase)
       {
-         case FRIDGE_DB_PROJECT: return IDatabaseObjectRef(new MagnetsMessageTreeDatabaseObject(   this, whichDatabase, "project"));
+         case FRIDGE_DB_PROJECT:
+         {
+            IDatabaseObjectRef ret(new MagnetsMessageTreeDatabaseObject(this, whichDatabase, "project"));
+            ret()->SetSpeculativeUpdatesEnabled(true);  // so that a dragged magnet moves right away, rather than after a round-trip through the senior peer
+            return ret;
+         }
+
          case FRIDGE_DB_CHAT:    return IDatabaseObjectRef(new MessageTreeDatabaseObject(          this, whichDatabase, "chat"));
          case FRIDGE_DB_CLIENTS: return IDatabaseObjectRef(new ClientDataMessageTreeDatabaseObject(this, whichDatabase, "clients"));
 
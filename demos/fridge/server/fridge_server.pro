@@ -83,6 +83,8 @@ MUSCLE_SOURCES = \
 
 ZG_SOURCES = $$ZG_DIR/src/ZGPeerSession.cpp                     \
              $$ZG_DIR/src/ZGDatabasePeerSession.cpp             \
+             $$ZG_DIR/src/ZGChecksumUtilityFunctions.cpp        \
+             $$ZG_DIR/src/ZGLatencyHistogram.cpp                \
              $$ZG_DIR/src/ZGStdinSession.cpp                    \
              $$ZG_DIR/src/clocksync/ZGTimeAverager.cpp
 
@@ -91,9 +93,18 @@ PZG_SOURCES = $$ZG_DIR/src/private/PZGCaffeine.cpp              \
               $$ZG_DIR/src/private/PZGThreadedSession.cpp       \
               $$ZG_DIR/src/private/PZGHeartbeatSettings.cpp     \
               $$ZG_DIR/src/private/PZGNetworkIOSession.cpp      \
+              $$ZG_DIR/src/private/PZGMulticastRepair.cpp       \
+              $$ZG_DIR/src/private/PZGFECPacketDataIO.cpp       \
+              $$ZG_DIR/src/private/PZGPacedPacketDataIO.cpp     \
               $$ZG_DIR/src/private/PZGHeartbeatPacket.cpp       \
               $$ZG_DIR/src/private/PZGUnicastSession.cpp        \
               $$ZG_DIR/src/private/PZGDatabaseState.cpp         \
+              $$ZG_DIR/src/private/PZGDatabaseWorkerSession.cpp \
+              $$ZG_DIR/src/private/PZGPersistentUpdateLog.cpp \
+              $$ZG_DIR/src/private/PZGSnapshotTransfer.cpp \
+              $$ZG_DIR/src/private/PZGSnapshotFlattenerSession.cpp \
+              $$ZG_DIR/src/private/PZGSnapshotWriterSession.cpp \
+              $$ZG_DIR/src/private/PZGUpdateLog.cpp \
               $$ZG_DIR/src/private/PZGDatabaseStateInfo.cpp     \
               $$ZG_DIR/src/private/PZGDatabaseUpdate.cpp        \
               $$ZG_DIR/src/private/PZGConstants.cpp             \
@@ -16,13 +16,13 @@ class IDatabaseObject : public RefCountable, public INetworkTimeProvider
 {
 public:
    /** Default constructor for an IDatabaseObject that is to be used outside the context of a ZGDatabasePeerSession */
-   IDatabaseObject() : _session(NULL), _dbIndex(-1) {/* empty */}
+   IDatabaseObject() : _session(NULL), _dbIndex(-1), _speculativeUpdatesEnabled(false) {/* empty */}
 
    /** Constructor for an IDatabaseObject that is created via ZGDatabasePeerSession::CreateDatabaseObject()
      * @param session pointer to the ZGDatabasePeerSession object that created us, or NULL if we weren't created by a ZGDatabasePeerSession
      * @param dbIndex our position within the ZGDatabasePeerSession's databases-list, or -1 if we weren't created by a ZGDatabasePeerSession
      */
-   IDatabaseObject(ZGDatabasePeerSession * session, int32 dbIndex) : _session(session), _dbIndex(dbIndex) {/* empty */}
+   IDatabaseObject(ZGDatabasePeerSession * session, int32 dbIndex) : _session(session), _dbIndex(dbIndex), _speculativeUpdatesEnabled(false) {/* empty */}
 
    /** Destructor */
    virtual ~IDatabaseObject() {/* empty */}
@@ -42,14 +42,26 @@ public:
      */
    virtual status_t SaveToArchive(const MessageRef & archive) const = 0;
 
+   /** May be implemented to return a snapshot of this object's current state, in the same format that
+     * SaveToArchive() would produce.  The returned Message must not be affected by any later changes to this
+     * object, and it must be safe to read (e.g. flatten) from another thread while this object continues to be
+     * updated; that way the senior peer can send a large database to a junior peer without blocking.
+     * Implementations should make this call as cheap as possible, e.g. by sharing immutable sub-Messages with
+     * the live state rather than copying them.
+     * Default implementation returns a NULL reference, meaning snapshots are not supported, in which case
+     * the database will be saved via SaveToArchive() and flattened in the main thread instead.
+     */
+   virtual ConstMessageRef SaveToSnapshot() const {return ConstMessageRef();}
+
    /** Should return the current checksum of this object.  This checksum should always correspond exactly
      * to this object's current state, and unless this object is quite small, it should be implemented as
      * a running checksum so that this call can just return a known value rather than recalculating the
      * checksum from the data during this call.  That is because this method will be called rather often (eg
      * once after any other call that changes this object's state) and therefore it is better if this call
-     * can be made as inexpensive as possible.
+     * can be made as inexpensive as possible.  The CalculateChecksum64() functions in ZGChecksumUtilityFunctions.h
+     * are handy for computing the terms of a running checksum.
      */
-   MUSCLE_NODISCARD virtual uint32 GetCurrentChecksum() const = 0;
+   MUSCLE_NODISCARD virtual uint64 GetCurrentChecksum() const = 0;
 
    /** This method should be implemented to recalculate the database's current checksum from scratch.
      * Note that unlike GetCurrentChecksum(), this method should *not* just returned a precomputed/running
@@ -57,7 +69,7 @@ public:
      * will only be called during debugging sessions (eg to verify that the running checksum is correct)
      * so it is okay if its implementation is relatively expensive.
      */
-   MUSCLE_NODISCARD virtual uint32 CalculateChecksum() const = 0;
+   MUSCLE_NODISCARD virtual uint64 CalculateChecksum() const = 0;
 
    /** Should return this object's state as a human-readable string.
      * This method is only used for debugging purposes (eg printing out the state of the database
@@ -76,6 +88,21 @@ public:
      */
    MUSCLE_NODISCARD int32 GetDatabaseIndex() const {return _dbIndex;}
 
+   /** Call this to enable speculative updates for this object.  When enabled, RequestUpdateDatabaseState() applies the requested
+     * update to this object right away (see ZGDatabasePeerSession::RequestSpeculativeUpdateDatabaseState()), so that interactive
+     * edits made on a junior peer are visible locally without waiting for the round-trip through the senior peer.  Disabled by default.
+     * @param enable true to enable speculative updates, or false to disable them.
+     * @note SpeculativeSeniorUpdate() will be called on the junior peer to apply a speculative update, and UndoSpeculativeSeniorUpdate()
+     *       to roll it back.  If CanUndoSpeculativeUpdates() returns false, SeniorUpdate() and SetFromArchive() are called instead.
+     */
+   void SetSpeculativeUpdatesEnabled(bool enable) {_speculativeUpdatesEnabled = enable;}
+
+   /** Returns true iff speculative updates are enabled for this object.  */
+   MUSCLE_NODISCARD bool AreSpeculativeUpdatesEnabled() const {return _speculativeUpdatesEnabled;}
+
+   /** Returns true iff this object's current state includes speculative updates that the senior peer hasn't confirmed yet. */
+   MUSCLE_NODISCARD bool HasSpeculativeUpdates() const;
+
 protected:
    /** Returns a read-only pointer to the specified IDatabaseObject held by our
      * ZGDatabasePeerSession, or NULL if we don't have a ZGDatabasePeerSession
@@ -146,8 +173,30 @@ protected:
      */
    virtual status_t JuniorUpdate(const ConstMessageRef & juniorDoMsg) = 0;
 
-   /** Called when our ZGDatabasePeerSession becomes the senior peer, or stops being the senior peer.
-     * Call GetDatabasePeerSession()->IsSeniorPeer() to find out which.
+   /** May be implemented to let a junior peer whose copy of this database has diverged from the senior peer's copy
+     * (eg after a checksum mismatch) repair its copy in-place, so that only the parts that actually differ need to be
+     * transferred, rather than the entire database.  The repair proceeds as a conversation:  JuniorRepair() on the
+     * junior peer returns a request Message describing (part of) its state, this method (on the senior peer) answers
+     * that request, and the answer is passed back to JuniorRepair(), which applies the fixes in it and returns the
+     * next request, and so on, until JuniorRepair() has nothing left to ask.
+     * @param repairRequestMsg a request Message that was returned by JuniorRepair() on the junior peer.
+     * @returns on success, a Message to pass back to JuniorRepair() on the junior peer.  On failure, a NULL reference.
+     * @note Default implementation returns B_UNIMPLEMENTED, in which case the junior peer will download the full database instead.
+     */
+   virtual ConstMessageRef SeniorRepair(const ConstMessageRef & repairRequestMsg) const {(void) repairRequestMsg; return B_UNIMPLEMENTED;}
+
+   /** May be implemented to repair this object's state in-place on a junior peer, after it has diverged from the
+     * senior peer's state.  See SeniorRepair() for details.
+     * @param optRepairReplyMsg the senior peer's answer to our previous request, or a NULL reference if a new repair-pass is starting.
+     * @param retNextRequestMsg on success, this should be set to the next request Message to send to the senior peer,
+     *                          or to a NULL reference if there is nothing left to ask during this pass.
+     * @returns B_NO_ERROR on success, or an error code on failure.
+     * @note Default implementation returns B_UNIMPLEMENTED, in which case the full database will be downloaded instead.
+     */
+   virtual status_t JuniorRepair(const ConstMessageRef & optRepairReplyMsg, MessageRef & retNextRequestMsg) {(void) optRepairReplyMsg; (void) retNextRequestMsg; return B_UNIMPLEMENTED;}
+
+   /** Called when our ZGDatabasePeerSession becomes the senior peer of our database, or stops being its senior peer.
+     * Call GetDatabasePeerSession()->IAmTheSeniorPeerForDatabase(GetDatabaseIndex()) to find out which.
      * Default implementation is a no-op.
      */
    virtual void LocalSeniorPeerStatusChanged() {/* empty */}
@@ -166,6 +215,40 @@ protected:
      */
    virtual void PeerHasGoneOffline(const ZGPeerID & peerID, const ConstMessageRef & optPeerInfo) {(void) peerID; (void) optPeerInfo;}
 
+   /** Should return true iff this object implements SpeculativeSeniorUpdate() and UndoSpeculativeSeniorUpdate(), so that its
+     * speculative updates (see SetSpeculativeUpdatesEnabled()) can be rolled back individually, touching only the data they changed.
+     * Default implementation returns false, in which case a copy of this object's entire authoritative state is saved (via
+     * SaveToSnapshot() or SaveToArchive()) before the first speculative update is applied, and restored (via SetFromArchive())
+     * to roll the speculative updates back.
+     */
+   MUSCLE_NODISCARD virtual bool CanUndoSpeculativeUpdates() const {return false;}
+
+   /** Called on a junior peer to apply a speculative update, if CanUndoSpeculativeUpdates() returns true.
+     * Should do the same thing SeniorUpdate() does, but return a Message that UndoSpeculativeSeniorUpdate() can
+     * later use to reverse the update's effects exactly (rather than a Message for the junior peers to apply).
+     * @param seniorDoMsg a Message containing instructions on how to update this object's state.
+     * @returns on success, a reference to a Message describing how to undo the update.  On failure, a NULL
+     *          reference, and this object's state should be left as it was before the call.
+     * @note Default implementation returns B_UNIMPLEMENTED.
+     */
+   virtual ConstMessageRef SpeculativeSeniorUpdate(const ConstMessageRef & seniorDoMsg) {(void) seniorDoMsg; return B_UNIMPLEMENTED;}
+
+   /** Called on a junior peer to roll back a speculative update that was applied by SpeculativeSeniorUpdate().
+     * Speculative updates are always rolled back in the reverse of the order they were applied in.
+     * @param undoMsg the Message that SpeculativeSeniorUpdate() returned when it applied the update.
+     * @returns B_NO_ERROR on success, or an error code on failure.
+     * @note Default implementation returns B_UNIMPLEMENTED.
+     */
+   virtual status_t UndoSpeculativeSeniorUpdate(const ConstMessageRef & undoMsg) {(void) undoMsg; return B_UNIMPLEMENTED;}
+
+   /** Called after a speculative update (see SetSpeculativeUpdatesEnabled()) has been rolled back because the senior peer
+     * couldn't execute it (or because the senior peer went away before telling us whether it did).
+     * @param seniorDoMsg the update-Message that was rolled back
+     * @param why the reason the update was rolled back
+     * Default implementation is a no-op.
+     */
+   virtual void SpeculativeUpdateRejected(const ConstMessageRef & seniorDoMsg, status_t why) {(void) seniorDoMsg; (void) why;}
+
    /** Returns the current state-ID of our local database */
    MUSCLE_NODISCARD uint64 GetCurrentDatabaseStateID() const;
 
@@ -210,6 +293,7 @@ private:
 
    ZGDatabasePeerSession * _session;
    int32 _dbIndex;
+   bool _speculativeUpdatesEnabled;
 };
 DECLARE_REFTYPES(IDatabaseObject);
 
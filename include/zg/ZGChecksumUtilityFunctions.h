@@ -0,0 +1,46 @@
+#ifndef ZGChecksumUtilityFunctions_h
+#define ZGChecksumUtilityFunctions_h
+
+#include "message/Message.h"
+#include "zg/ZGNameSpace.h"
+
+namespace zg {
+
+/** Scrambles the bits of a 64-bit value, so that similar inputs give very different outputs.
+  * Useful for turning a POD value into a 64-bit checksum term.
+  * @param v the value to scramble
+  * @returns the scrambled value
+  */
+MUSCLE_NODISCARD static inline uint64 MixChecksum64(uint64 v)
+{
+   v ^= (v >> 33); v *= 0xff51afd7ed558ccdULL;
+   v ^= (v >> 33); v *= 0xc4ceb9fe1a85ec53ULL;
+   v ^= (v >> 33);
+   return v;
+}
+
+/** Calculates and returns a 64-bit checksum of the specified bytes.  The returned value is the same on every
+  * platform, so it's suitable for computing the terms of an order-independent running database checksum
+  * (i.e. one that is updated by adding the checksum of each item that is added to the database, and
+  * subtracting the checksum of each item that is removed).  The bytes are processed 32 at a time, as four
+  * independent 64-bit lanes, so that the compiler can vectorize the inner loop.
+  * @param bytes pointer to the bytes to checksum
+  * @param numBytes the number of bytes that (bytes) points to
+  * @param seed optional seed value, for when you need several unrelated checksums of the same bytes.  Defaults to 0.
+  * @returns a 64-bit checksum value
+  */
+MUSCLE_NODISCARD uint64 CalculateChecksum64(const uint8 * bytes, uint32 numBytes, uint64 seed = 0);
+
+/** Convenience method:  Returns a 64-bit checksum of the specified String's characters.
+  * @param s the String to checksum
+  */
+MUSCLE_NODISCARD static inline uint64 CalculateChecksum64(const String & s) {return CalculateChecksum64(reinterpret_cast<const uint8 *>(s()), s.Length());}
+
+/** Convenience method:  Returns a 64-bit checksum of the specified Message's flattened bytes.
+  * @param msg the Message to checksum
+  */
+MUSCLE_NODISCARD uint64 CalculateChecksum64(const Message & msg);
+
+}  // end namespace zg
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef ZGCompactCodec_h
+#define ZGCompactCodec_h
+
+#include "message/Message.h"
+#include "zg/ZGNameSpace.h"
+
+namespace zg
+{
+
+/** This template describes how a single field of a given type is encoded into (and decoded from) a compact
+  * fixed-layout binary record.  Unlike a Message field, a compact field has no name and no type code; its
+  * meaning is implied entirely by its position within the record, as given by a ZGCompactRecord schema.
+  * The default implementation handles any fixed-size (pseudo-)flattenable type (e.g. TreeGatewayFlags or ZGPeerID);
+  * the specializations below handle integers, Strings and Messages.
+  */
+template<typename T> class ZGCompactField
+{
+public:
+   /** Returns the number of bytes that Encode() will write for the given value */
+   MUSCLE_NODISCARD static uint32 GetEncodedSize(const T & val) {return val.FlattenedSize();}
+
+   /** Writes the given value into (flat) */
+   static void Encode(DataFlattener & flat, const T & val) {flat.WriteFlat(val);}
+
+   /** Reads a value from (unflat) into (retVal).  Returns B_NO_ERROR on success, or an error code on failure. */
+   static status_t Decode(DataUnflattener & unflat, T & retVal) {return unflat.ReadFlat(retVal);}
+};
+
+/** Specialization for 32-bit integers */
+template<> class ZGCompactField<uint32>
+{
+public:
+   MUSCLE_NODISCARD static uint32 GetEncodedSize(uint32) {return sizeof(uint32);}
+   static void Encode(DataFlattener & flat, uint32 val) {flat.WriteInt32(val);}
+   static status_t Decode(DataUnflattener & unflat, uint32 & retVal) {retVal = unflat.ReadInt32(); return unflat.GetStatus();}
+};
+
+/** Specialization for 64-bit integers */
+template<> class ZGCompactField<uint64>
+{
+public:
+   MUSCLE_NODISCARD static uint32 GetEncodedSize(uint64) {return sizeof(uint64);}
+   static void Encode(DataFlattener & flat, uint64 val) {flat.WriteInt64(val);}
+   static status_t Decode(DataUnflattener & unflat, uint64 & retVal) {retVal = unflat.ReadInt64(); return unflat.GetStatus();}
+};
+
+/** Specialization for Strings:  a 32-bit length-prefix, followed by the string's bytes (not NUL-terminated) */
+template<> class ZGCompactField<String>
+{
+public:
+   MUSCLE_NODISCARD static uint32 GetEncodedSize(const String & val) {return sizeof(uint32)+val.Length();}
+
+   static void Encode(DataFlattener & flat, const String & val)
+   {
+      flat.WriteInt32(val.Length());
+      flat.WriteBytes(reinterpret_cast<const uint8 *>(val()), val.Length());
+   }
+
+   static status_t Decode(DataUnflattener & unflat, String & retVal)
+   {
+      const uint32 numBytes = unflat.ReadInt32();
+      if (unflat.GetNumBytesAvailable() < numBytes) return B_BAD_DATA;
+      MRETURN_ON_ERROR(retVal.SetCstr(reinterpret_cast<const char *>(unflat.GetCurrentReadPointer()), numBytes));
+      return unflat.SeekRelative(numBytes);
+   }
+};
+
+/** Specialization for (optional) Messages:  a 32-bit length-prefix, followed by the flattened Message.
+  * A NULL MessageRef is encoded as a zero length-prefix.
+  */
+template<> class ZGCompactField<ConstMessageRef>
+{
+public:
+   MUSCLE_NODISCARD static uint32 GetEncodedSize(const ConstMessageRef & val) {return sizeof(uint32)+(val() ? val()->FlattenedSize() : 0);}
+
+   static void Encode(DataFlattener & flat, const ConstMessageRef & val)
+   {
+      flat.WriteInt32(val() ? val()->FlattenedSize() : 0);
+      if (val()) flat.WriteFlat(*val());
+   }
+
+   static status_t Decode(DataUnflattener & unflat, ConstMessageRef & retVal)
+   {
+      const uint32 numBytes = unflat.ReadInt32();
+      if (unflat.GetNumBytesAvailable() < numBytes) return B_BAD_DATA;
+      if (numBytes > 0)
+      {
+         MessageRef msg = GetMessageFromPool(unflat.GetCurrentReadPointer(), numBytes);
+         MRETURN_ON_ERROR(msg);
+         retVal = msg;
+      }
+      else retVal.Reset();
+      return unflat.SeekRelative(numBytes);
+   }
+};
+
+/** This template defines the schema of a compact binary record as an ordered list of field types.
+  * The encoder and decoder for the record are generated from that list at compile time, so there are
+  * no field names to hash or look up, and no per-field allocations other than the fields' own contents.
+  * For example:  typedef ZGCompactRecord<String, uint32, String> MyIndexRecord;
+  */
+template<typename... FieldTypes> class ZGCompactRecord
+{
+public:
+   /** Returns the number of bytes that Encode() will write for the given field values */
+   MUSCLE_NODISCARD static uint32 GetEncodedSize(const FieldTypes &... fields) {return (0 + ... + ZGCompactField<FieldTypes>::GetEncodedSize(fields));}
+
+   /** Writes the given field values, in order, into (flat) */
+   static void Encode(DataFlattener & flat, const FieldTypes &... fields) {(ZGCompactField<FieldTypes>::Encode(flat, fields), ...);}
+
+   /** Reads the record's field values, in order, from (unflat).  Stops at the first field that fails to decode.
+     * @returns B_NO_ERROR on success, or an error code on failure.
+     */
+   static status_t Decode(DataUnflattener & unflat, FieldTypes &... retFields)
+   {
+      status_t ret;
+      (void) ((ZGCompactField<FieldTypes>::Decode(unflat, retFields).IsOK(ret)) && ...);
+      return ret;
+   }
+};
+
+}  // end namespace zg
+
+#endif
@@ -10,7 +10,11 @@ namespace zg
 #define ZG_VERSION_STRING "1.20"  /**< The current version of the ZG distribution, expressed as an ASCII string */
 #define ZG_VERSION        (12000) /**< Current version, expressed as decimal Mmmbb, where (M) is the number before the decimal point, (mm) is the number after the decimal point, and (bb) is reserved */
 
-#define ZG_COMPATIBILITY_VERSION (0) /**< I'll increment this value whenever ZG's protocol changes in such a way that it breaks compatibility with older versions of ZG */
+#define ZG_COMPATIBILITY_VERSION (5) /**< I'll increment this value whenever ZG's protocol changes in such a way that it breaks compatibility with older versions of ZG */
+
+#define ZG_DEFAULT_PAYLOAD_COMPRESSION_LEVEL (1) /**< The zlib compression level database-update payloads are compressed with, unless specified otherwise via ZGPeerSettings::SetPayloadCompressionLevelForDatabase() */
+
+#define ZG_ALL_PEERS ((uint32)-1) /**< Pass this to ZGPeerSession::RequestUpdateDatabaseStateWithAcknowledgement() to be acknowledged only after every online peer has applied the update */
 
 #define INVALID_TIME_OFFSET ((int64)(((uint64)-1)/2)) /** Guard value:  Similar to MUSCLE_TIME_NEVER, but for an int64 (relative-offset) time-value rather than an absolute uint64 timestamp */
 
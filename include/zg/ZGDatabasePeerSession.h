@@ -31,6 +31,27 @@ public:
    /** Overridden to notify our IDatabaseObjects about the change */
    virtual void LocalSeniorPeerStatusChanged();
 
+   /** Same as RequestUpdateDatabaseState(), except that (databaseUpdateMsg) is also applied to our local database object right away,
+     * as a speculative update, so that its effects can be seen locally without waiting for the round-trip through the senior peer.
+     * When the senior peer's (authoritative) updates are received, the speculative updates are rolled back, the authoritative updates
+     * are applied, and any speculative updates that the senior peer hasn't executed yet are re-applied on top of them.  That way our
+     * local state always converges to the senior peer's state, even if the senior peer executed other peers' updates before ours.
+     * If the senior peer couldn't execute the update, it is rolled back and IDatabaseObject::SpeculativeUpdateRejected() is called.
+     * @param whichDatabase the index of the database whose state should be updated.
+     * @param databaseUpdateMsg a Message containing instructions/data that SeniorUpdateLocalDatabase() can use to transition the database to a new database state.
+     * @returns B_NO_ERROR if the the update-request was successfully sent to the senior peer, or an error code if the request could not be sent.
+     * @note if we are the senior peer of the database, or if database worker threads are enabled, this method just calls RequestUpdateDatabaseState().
+     */
+   status_t RequestSpeculativeUpdateDatabaseState(uint32 whichDatabase, const MessageRef & databaseUpdateMsg);
+
+   /** Returns true iff the specified database has speculative updates (see RequestSpeculativeUpdateDatabaseState()) that the senior peer hasn't confirmed yet.
+     * @param whichDatabase the index of the database to inquire about
+     */
+   MUSCLE_NODISCARD bool HasSpeculativeUpdates(uint32 whichDatabase) const;
+
+   MUSCLE_NODISCARD virtual uint64 GetPulseTime(const PulseArgs & args);
+   virtual void Pulse(const PulseArgs & args);
+
 protected:
    /** This will be called as part of the startup sequence.  It should create
      * a new IDatabaseObject that will represent the specified database and return
@@ -40,22 +61,86 @@ protected:
    virtual IDatabaseObjectRef CreateDatabaseObject(uint32 whichDatabase) = 0;
 
    // ZGPeerSession API implementation
-   virtual void ResetLocalDatabaseToDefault(uint32 whichDatabase, uint32 & dbChecksum);
-   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & seniorDoMsg);
-   virtual status_t JuniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & juniorDoMsg);
+   virtual void ResetLocalDatabaseToDefault(uint32 whichDatabase, uint64 & dbChecksum);
+   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & seniorDoMsg);
+   virtual status_t JuniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & juniorDoMsg);
    virtual MessageRef SaveLocalDatabaseToMessage(uint32 whichDatabase) const;
-   virtual status_t SetLocalDatabaseFromMessage(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & newDBStateMsg);
-   MUSCLE_NODISCARD virtual uint32 CalculateLocalDatabaseChecksum(uint32 whichDatabase) const;
+   virtual ConstMessageRef SaveLocalDatabaseToSnapshot(uint32 whichDatabase) const;
+   virtual status_t SetLocalDatabaseFromMessage(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & newDBStateMsg);
+   virtual ConstMessageRef SeniorRepairLocalDatabase(uint32 whichDatabase, const ConstMessageRef & repairRequestMsg) const;
+   virtual status_t JuniorRepairLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & optRepairReplyMsg, MessageRef & retNextRequestMsg);
+   MUSCLE_NODISCARD virtual uint64 CalculateLocalDatabaseChecksum(uint32 whichDatabase) const;
    MUSCLE_NODISCARD virtual String GetLocalDatabaseContentsAsString(uint32 whichDatabase) const;
    virtual void PeerHasComeOnline(const ZGPeerID & peerID, const ConstMessageRef & optPeerInfo);
    virtual void PeerHasGoneOffline(const ZGPeerID & peerID, const ConstMessageRef & optPeerInfo);
+   virtual void DatabaseSeniorPeerChanged(uint32 whichDB, const ZGPeerID & oldSeniorPeerID, const ZGPeerID & newSeniorPeerID);
    virtual void MessageReceivedFromPeer(const ZGPeerID & fromPeerID, const MessageRef & msg);
 
+   /** Overridden to reconcile our speculative updates.  Subclasses that override this method must call up to it. */
+   virtual void DatabaseUpdateAcknowledged(uint32 whichDatabase, uint64 ackID, uint64 updateID, uint32 numPeersApplied, status_t result);
+
 private:
    status_t SendMessageToDatabaseObject(const ZGPeerID & targetPeerID, const ConstMessageRef & msg, uint32 targetDBIdx, uint32 sourceDBIdx);
 
+   status_t ApplySpeculativeUpdate(uint32 whichDatabase, uint64 ackID);
+   void RollBackSpeculativeUpdates(uint32 whichDatabase);
+   void ReapplySpeculativeUpdates(uint32 whichDatabase);
+   void ScheduleSpeculativeUpdatesReapply(uint32 whichDatabase);
+   MUSCLE_NODISCARD bool IsInSpeculativeApplyContext(   uint32 whichDatabase) const {return (_speculativeApplyDB    == (int32) whichDatabase);}
+   MUSCLE_NODISCARD bool IsInSpeculativeRollbackContext(uint32 whichDatabase) const {return (_speculativeRollbackDB == (int32) whichDatabase);}
+
    Queue<IDatabaseObjectRef> _databaseObjects;
 
+   class SpeculativeUpdate
+   {
+   public:
+      SpeculativeUpdate() : _whichDatabase(0), _updateID(0), _isApplied(false) {/* empty */}
+      SpeculativeUpdate(uint32 whichDatabase, const ConstMessageRef & seniorDoMsg) : _whichDatabase(whichDatabase), _seniorDoMsg(seniorDoMsg), _updateID(0), _isApplied(false) {/* empty */}
+
+      uint32 GetDatabaseIndex() const {return _whichDatabase;}
+      const ConstMessageRef & GetSeniorDoMessage() const {return _seniorDoMsg;}
+
+      /** Returns the ID of the update the senior peer executed this update as, or 0 if we haven't been told yet */
+      uint64 GetUpdateID() const {return _updateID;}
+      void SetUpdateID(uint64 updateID) {_updateID = updateID;}
+
+      /** Returns true iff this update is currently applied to our local database */
+      bool IsApplied() const {return _isApplied;}
+
+      /** Returns the Message that IDatabaseObject::UndoSpeculativeSeniorUpdate() will need to roll this update back, if any */
+      const ConstMessageRef & GetUndoMessage() const {return _undoMsg;}
+
+      void SetApplied(const ConstMessageRef & undoMsg) {_isApplied = true; _undoMsg = undoMsg;}
+      void SetRolledBack() {_isApplied = false; _undoMsg.Reset();}
+
+   private:
+      uint32 _whichDatabase;
+      ConstMessageRef _seniorDoMsg;
+      uint64 _updateID;
+      bool _isApplied;
+      ConstMessageRef _undoMsg;
+   };
+   Hashtable<uint64, SpeculativeUpdate> _speculativeUpdates;  // ack ID -> speculative update, in the order they were requested
+
+   class SpeculativeBaseState
+   {
+   public:
+      SpeculativeBaseState() : _checksum(0) {/* empty */}
+      SpeculativeBaseState(const ConstMessageRef & state, uint64 checksum) : _state(state), _checksum(checksum) {/* empty */}
+
+      const ConstMessageRef & GetState() const {return _state;}
+      uint64 GetChecksum() const {return _checksum;}
+
+   private:
+      ConstMessageRef _state;
+      uint64 _checksum;
+   };
+   Hashtable<uint32, SpeculativeBaseState> _speculativeBaseStates;  // database index -> authoritative state (NULL if the object undoes its own updates) and checksum, for databases that currently have speculative updates applied
+
+   Hashtable<uint32, Void> _speculativeReapplyPending;  // databases whose speculative updates should be re-applied on our next Pulse()
+   int32 _speculativeApplyDB;     // index of the database we're currently applying speculative updates to, or -1
+   int32 _speculativeRollbackDB;  // index of the database we're currently rolling back speculative updates of, or -1
+
    friend class IDatabaseObject;
 };
 DECLARE_REFTYPES(ZGDatabasePeerSession);
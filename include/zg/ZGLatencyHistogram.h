@@ -0,0 +1,214 @@
+#ifndef ZGLatencyHistogram_h
+#define ZGLatencyHistogram_h
+
+#include "util/Hashtable.h"
+#include "util/OutputPrinter.h"
+#include "util/String.h"
+#include "zg/ZGNameSpace.h"
+
+namespace zg
+{
+
+/** This class records a distribution of latency values (in microseconds) in a fixed amount of memory,
+  * using the log-linear bucketing scheme popularized by HdrHistogram:  every power-of-two range of values
+  * is split into a fixed number of equal-width sub-buckets, so that any recorded value can be recovered to
+  * within about 3% of its actual value, regardless of its magnitude.  Recording a value is O(1) and doesn't
+  * allocate any memory, so it's cheap enough to do for every database update.
+  */
+class ZGLatencyHistogram
+{
+public:
+   /** Default constructor.  Creates an empty histogram. */
+   ZGLatencyHistogram() {Reset();}
+
+   /** Records a latency value into this histogram.
+     * @param micros the latency to record, in microseconds.  Values larger than GetMaxTrackableValue() will be clamped to that value.
+     */
+   void RecordValue(uint64 micros);
+
+   /** Removes all recorded values from this histogram. */
+   void Reset();
+
+   /** Adds all the values recorded in (rhs) into this histogram.
+     * @param rhs the histogram whose recorded values should be added to ours
+     */
+   void Merge(const ZGLatencyHistogram & rhs);
+
+   /** Returns the number of values that have been recorded into this histogram. */
+   MUSCLE_NODISCARD uint64 GetCount() const {return _count;}
+
+   /** Returns the smallest value that was recorded into this histogram, or 0 if the histogram is empty. */
+   MUSCLE_NODISCARD uint64 GetMinValue() const {return (_count > 0) ? _minValue : 0;}
+
+   /** Returns the largest value that was recorded into this histogram, or 0 if the histogram is empty. */
+   MUSCLE_NODISCARD uint64 GetMaxValue() const {return _maxValue;}
+
+   /** Returns the mean of the values that were recorded into this histogram, or 0 if the histogram is empty. */
+   MUSCLE_NODISCARD uint64 GetMeanValue() const {return (_count > 0) ? (_totalValue/_count) : 0;}
+
+   /** Returns the (approximate) value that the given percentage of recorded values are less than or equal to.
+     * @param percentile the percentile to return the value of, in the range [0.0, 100.0], e.g. 99.9
+     * @returns the value at the given percentile, or 0 if the histogram is empty
+     */
+   MUSCLE_NODISCARD uint64 GetValueAtPercentile(double percentile) const;
+
+   /** Returns a one-line human-readable summary of this histogram's contents (count, min, mean, p50, p90, p99, p99.9 and max) */
+   MUSCLE_NODISCARD String ToString() const;
+
+   /** Returns the largest value that this histogram can record without clamping (about 12.7 days' worth of microseconds) */
+   MUSCLE_NODISCARD static uint64 GetMaxTrackableValue() {return (((uint64)1)<<NUM_MAGNITUDE_BITS)-1;}
+
+private:
+   enum {
+      NUM_SUB_BUCKET_BITS = 4,                             // 16 sub-buckets per power of two, for a worst-case error of 1/32
+      NUM_SUB_BUCKETS     = (1<<NUM_SUB_BUCKET_BITS),
+      NUM_MAGNITUDE_BITS  = 40,                            // values up to 2^40 microseconds are tracked
+      NUM_BUCKETS         = (NUM_MAGNITUDE_BITS-NUM_SUB_BUCKET_BITS+1)*NUM_SUB_BUCKETS
+   };
+
+   MUSCLE_NODISCARD static uint32 GetBucketIndex(uint64 value);
+   MUSCLE_NODISCARD static uint64 GetBucketMidpointValue(uint32 bucketIdx);
+
+   uint64 _counts[NUM_BUCKETS];
+   uint64 _count;
+   uint64 _minValue;
+   uint64 _maxValue;
+   uint64 _totalValue;
+};
+
+/** Stages of a database update's journey through the system, for use with ZGUpdateLatencyStats.
+  * All stage times are measured using the network-time clock, so that timestamps taken on
+  * different peers can be meaningfully compared.
+  */
+enum {
+   ZG_UPDATE_LATENCY_STAGE_REQUEST_TO_SENIOR = 0, /**< from when the requesting peer sent the update-request, until the senior peer received it */
+   ZG_UPDATE_LATENCY_STAGE_SENIOR_QUEUE,          /**< from when the senior peer received the update-request, until it started executing it (includes worker-thread and group-commit queueing) */
+   ZG_UPDATE_LATENCY_STAGE_SENIOR_EXECUTE,        /**< time the senior peer spent executing the update */
+   ZG_UPDATE_LATENCY_STAGE_SENIOR_TO_MULTICAST,   /**< from when the senior peer finished executing the update, until it queued the update for multicast (includes any group-commit window) */
+   ZG_UPDATE_LATENCY_STAGE_MULTICAST_TO_JUNIOR,   /**< from when the senior peer queued the update for multicast, until this junior peer received it */
+   ZG_UPDATE_LATENCY_STAGE_JUNIOR_APPLY,          /**< from when this junior peer received the update, until it finished applying it to its local database */
+   ZG_UPDATE_LATENCY_STAGE_END_TO_END,            /**< from when the requesting peer sent the update-request, until this junior peer finished applying the update */
+   NUM_ZG_UPDATE_LATENCY_STAGES                   /**< guard value */
+};
+
+/** Returns a short human-readable name for the given ZG_UPDATE_LATENCY_STAGE_* value, or "???" if the value isn't valid.
+  * @param stage a ZG_UPDATE_LATENCY_STAGE_* value
+  */
+MUSCLE_NODISCARD const char * GetUpdateLatencyStageName(uint32 stage);
+
+/** This class holds one ZGLatencyHistogram for each ZG_UPDATE_LATENCY_STAGE_* value.
+  * The senior peer records only the senior-side stages of each update it executes;
+  * junior peers record every stage of each update they apply.
+  */
+class ZGUpdateLatencyStats
+{
+public:
+   /** Default constructor. */
+   ZGUpdateLatencyStats() {/* empty */}
+
+   /** Records the interval between two network-time timestamps into the histogram for the given stage.
+     * If either timestamp is zero (i.e. unknown), no value is recorded.
+     * @param stage a ZG_UPDATE_LATENCY_STAGE_* value
+     * @param startTime network-time at which the stage started
+     * @param endTime network-time at which the stage ended.  If this is less than (startTime), zero will be recorded.
+     */
+   void RecordInterval(uint32 stage, uint64 startTime, uint64 endTime);
+
+   /** Returns a read-only reference to the histogram of the given stage.
+     * @param stage a ZG_UPDATE_LATENCY_STAGE_* value
+     */
+   MUSCLE_NODISCARD const ZGLatencyHistogram & GetHistogram(uint32 stage) const {return _histograms[(stage < NUM_ZG_UPDATE_LATENCY_STAGES) ? stage : (uint32) ZG_UPDATE_LATENCY_STAGE_END_TO_END];}
+
+   /** Adds all the values recorded in (rhs) into these stats.
+     * @param rhs the stats whose recorded values should be added to ours
+     */
+   void Merge(const ZGUpdateLatencyStats & rhs);
+
+   /** Clears all of our histograms. */
+   void Reset();
+
+   /** Prints one line per non-empty histogram to the given OutputPrinter.
+     * @param p the OutputPrinter to print to
+     */
+   void Print(const OutputPrinter & p) const;
+
+private:
+   ZGLatencyHistogram _histograms[NUM_ZG_UPDATE_LATENCY_STAGES];
+};
+
+/** This class holds the results of replaying a recorded stream of database updates (see ZGPeerSession::ReplayUpdateRecording()):
+  * how many updates (and bytes) were applied, how long it took to apply them, broken down by update type,
+  * and how long it took to verify the updates' record-checksums and the database's checksum along the way.
+  */
+class ZGUpdateReplayStats
+{
+public:
+   /** Default constructor.  Creates an empty stats object. */
+   ZGUpdateReplayStats() : _numUpdates(0), _numBytes(0), _totalApplyMicros(0) {/* empty */}
+
+   /** Records the application of one update.
+     * @param updateTypeName short human-readable name of the update's type (e.g. "update" or "replace")
+     * @param numBytes the size of the update's flattened representation, in bytes
+     * @param applyMicros how long it took to apply the update to the local database, in microseconds
+     */
+   void RecordUpdate(const char * updateTypeName, uint32 numBytes, uint64 applyMicros);
+
+   /** Records how long it took to calculate one update's record-checksum (as is done for every update received over the network)
+     * @param micros the elapsed time, in microseconds
+     */
+   void RecordUpdateChecksumTime(uint64 micros) {_updateChecksumHistogram.RecordValue(micros);}
+
+   /** Records how long it took to recalculate the database's checksum from scratch (as is done when a peer verifies its database)
+     * @param micros the elapsed time, in microseconds
+     */
+   void RecordDatabaseChecksumTime(uint64 micros) {_databaseChecksumHistogram.RecordValue(micros);}
+
+   /** Returns the number of updates that were applied */
+   MUSCLE_NODISCARD uint64 GetNumUpdates() const {return _numUpdates;}
+
+   /** Returns the total size of the updates that were applied, in bytes */
+   MUSCLE_NODISCARD uint64 GetNumBytes() const {return _numBytes;}
+
+   /** Returns the total time spent applying updates, in microseconds (not including any checksum verification) */
+   MUSCLE_NODISCARD uint64 GetTotalApplyMicros() const {return _totalApplyMicros;}
+
+   /** Returns the number of updates applied per second of apply-time, or 0.0 if no time was spent applying updates */
+   MUSCLE_NODISCARD double GetUpdatesPerSecond() const {return (_totalApplyMicros > 0) ? (((double)_numUpdates)*1000000.0/_totalApplyMicros) : 0.0;}
+
+   /** Returns the number of update-bytes applied per second of apply-time, or 0.0 if no time was spent applying updates */
+   MUSCLE_NODISCARD double GetBytesPerSecond() const {return (_totalApplyMicros > 0) ? (((double)_numBytes)*1000000.0/_totalApplyMicros) : 0.0;}
+
+   /** Returns the apply-time histograms of the updates we recorded, keyed by update-type name */
+   MUSCLE_NODISCARD const Hashtable<String, ZGLatencyHistogram> & GetApplyHistograms() const {return _applyHistograms;}
+
+   /** Returns the histogram of the update record-checksum calculation times */
+   MUSCLE_NODISCARD const ZGLatencyHistogram & GetUpdateChecksumHistogram() const {return _updateChecksumHistogram;}
+
+   /** Returns the histogram of the database-checksum recalculation times */
+   MUSCLE_NODISCARD const ZGLatencyHistogram & GetDatabaseChecksumHistogram() const {return _databaseChecksumHistogram;}
+
+   /** Adds all the values recorded in (rhs) into these stats.
+     * @param rhs the stats whose recorded values should be added to ours
+     */
+   void Merge(const ZGUpdateReplayStats & rhs);
+
+   /** Clears all of our counters and histograms. */
+   void Reset();
+
+   /** Prints a human-readable summary of these stats to the given OutputPrinter.
+     * @param p the OutputPrinter to print to
+     */
+   void Print(const OutputPrinter & p) const;
+
+private:
+   uint64 _numUpdates;
+   uint64 _numBytes;
+   uint64 _totalApplyMicros;
+   Hashtable<String, ZGLatencyHistogram> _applyHistograms;  // update-type name -> apply-times of updates of that type
+   ZGLatencyHistogram _updateChecksumHistogram;
+   ZGLatencyHistogram _databaseChecksumHistogram;
+};
+
+}  // end namespace zg
+
+#endif
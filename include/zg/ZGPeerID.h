@@ -102,6 +102,12 @@ public:
    /** Part of the Flattenable pseudo-interface:  Returns 2*sizeof(uint64) */
    MUSCLE_NODISCARD static MUSCLE_CONSTEXPR uint32 FlattenedSize() {return 2*sizeof(uint64);}
 
+   /** Returns the upper 64 bits of this ID. */
+   MUSCLE_NODISCARD uint64 GetHighBits() const {return _highBits;}
+
+   /** Returns the lower 64 bits of this ID. */
+   MUSCLE_NODISCARD uint64 GetLowBits() const {return _lowBits;}
+
    /** Returns a 32-bit checksum for this object. */
    MUSCLE_NODISCARD uint32 CalculateChecksum() const {return CalculatePODChecksum(_highBits) + (3*CalculatePODChecksum(_lowBits));}
 
@@ -10,9 +10,11 @@
 #include "zg/ZGPeerSettings.h"
 #include "zg/ZGStdinSession.h"               // for ITextCommandReceiver
 #include "zg/ZGConstants.h"                  // for INVALID_TIME_CONSTANT
+#include "zg/ZGLatencyHistogram.h"
 #include "zg/discovery/server/IDiscoveryServerSessionController.h"
 
 #include "zg/private/PZGBeaconData.h"
+#include "zg/private/PZGCatchUpOffer.h"
 #include "zg/private/PZGDatabaseState.h"
 #include "zg/private/PZGDatabaseUpdate.h"
 #include "zg/private/PZGUpdateBackOrderKey.h"
@@ -108,6 +110,21 @@ public:
    /** Returns the ZGPeerID of the senior peer of this system, or an invalid ZGPeerID if there currently is no senior peer (that we know of). */
    MUSCLE_NODISCARD const ZGPeerID & GetSeniorPeerID() const {return _seniorPeerID;}
 
+   /** Returns the ZGPeerID of the peer that is currently the senior peer for the specified database, or an invalid ZGPeerID
+     * if there currently is no senior peer (that we know of) or if (whichDB) isn't a valid database index.
+     * Unless per-database senior peers are enabled (see ZGPeerSettings::SetPerDatabaseSeniorPeersEnabled()),
+     * this will always return the same value as GetSeniorPeerID().
+     * @param whichDB index of the database to return the senior peer of
+     */
+   MUSCLE_NODISCARD const ZGPeerID & GetSeniorPeerIDForDatabase(uint32 whichDB) const {return _databaseSeniorPeerIDs.IsIndexValid(whichDB) ? _databaseSeniorPeerIDs[whichDB] : GetDefaultObjectForType<ZGPeerID>();}
+
+   /** Returns true iff this peer is currently the senior peer for the specified database.
+     * Unless per-database senior peers are enabled (see ZGPeerSettings::SetPerDatabaseSeniorPeersEnabled()),
+     * this will always return the same value as IAmTheSeniorPeer().
+     * @param whichDB index of the database to check
+     */
+   MUSCLE_NODISCARD bool IAmTheSeniorPeerForDatabase(uint32 whichDB) const;
+
    /** Returns the current time according to the network-time-clock, in microseconds.
      * The intent of this clock is to be the same on all peers in the system.  However, this means that it may occasionally
      * change (break monotonicity) in order to synchronize with the other peers in the system.
@@ -200,6 +217,30 @@ protected:
      */
    status_t RequestUpdateDatabaseState(uint32 whichDatabase, const MessageRef & databaseUpdateMsg);
 
+   /** Same as RequestUpdateDatabaseState(), except that DatabaseUpdateAcknowledged() will be called on this peer after the
+     * update has been applied on the specified number of peers (or after it has failed).  This lets you wait for an update
+     * to become durable without having to poll the other peers.
+     * @param whichDatabase the index of the database whose state should be updated.
+     * @param databaseUpdateMsg a Message containing instructions/data that SeniorUpdateLocalDatabase() can use later on to transition the database to a new database state.
+     * @param numPeers how many peers (counting the senior peer) must have applied the update before it is acknowledged, or ZG_ALL_PEERS
+     *                 to wait for every online peer.  Peers that go offline while the update is pending are not waited for.
+     * @param optRetAckID if non-NULL, on success the ID that will be passed to DatabaseUpdateAcknowledged() for this update is written here.
+     * @returns B_NO_ERROR if the the update-request was successfully sent to the senior peer, or an error code if the request could not be sent.
+     * @note if (numPeers) is greater than 1, this method requires ZGPeerSettings::SetUpdateAcknowledgementsEnabled(true), and returns B_BAD_OBJECT otherwise.
+     */
+   status_t RequestUpdateDatabaseStateWithAcknowledgement(uint32 whichDatabase, const MessageRef & databaseUpdateMsg, uint32 numPeers, uint64 * optRetAckID = NULL);
+
+   /** Called on the requesting peer when an update requested via RequestUpdateDatabaseStateWithAcknowledgement() has been
+     * applied on enough peers, or has failed.  Default implementation is a no-op.
+     * @param whichDatabase the index of the database the update was requested for
+     * @param ackID the acknowledgement-ID that RequestUpdateDatabaseStateWithAcknowledgement() returned for the update
+     * @param updateID on success, the state ID the update moved the database to.  On failure, 0.
+     * @param numPeersApplied on success, how many online peers (counting the senior peer) had applied the update when it was acknowledged
+     * @param result B_NO_ERROR if the update was applied on enough peers, or an error code if it failed.  Note that if the senior peer
+     *               changed while the update was pending, the update is reported as failed even though it may still have been applied.
+     */
+   virtual void DatabaseUpdateAcknowledged(uint32 whichDatabase, uint64 ackID, uint64 updateID, uint32 numPeersApplied, status_t result) {(void) whichDatabase; (void) ackID; (void) updateID; (void) numPeersApplied; (void) result;}
+
    /** This method will be called when a message is sent to us by another peer.
      * A subclass may override this method to catch any user-defined Messages that other
      * peers might want to send it.  The default implementation of this method just prints
@@ -213,7 +254,7 @@ protected:
      * @param whichDatabase The index of the database to reset (eg 0 for the first database, 1 for the second, and so on)
      * @param dbChecksum Passed in as the database's current checksum value.  On return, this should be set to the database's new checksum value.
      */
-   virtual void ResetLocalDatabaseToDefault(uint32 whichDatabase, uint32 & dbChecksum) = 0;
+   virtual void ResetLocalDatabaseToDefault(uint32 whichDatabase, uint64 & dbChecksum) = 0;
 
    /** This method will only be called on the senior peer.  It must be implemented to update the senior peer's local database
      * and return a MessageRef that the system can later use to update same database on the various junior peers in the same way later on.
@@ -226,7 +267,7 @@ protected:
      *          Returning (seniorDoMsg) is acceptable if that is a Message that will cause the junior peers to do the right thing.
      *          On failure (or refusal-to-handle-the-update), a NULL MessageRef() should be returned.
      */
-   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & seniorDoMsg) = 0;
+   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & seniorDoMsg) = 0;
 
    /** This method will only be called on junior peers.  It must be implemented to update the junior peer's local database
      * according to the instructions contained in (juniorDoMsg).
@@ -236,7 +277,7 @@ protected:
      *                    will be determined by logic in the subclass of this class; they are not specified by the ZGPeerSession class itself)
      * @returns on success, returns B_NO_ERROR.  On failure (or refusal-to-update), returns an error code.
      */
-   virtual status_t JuniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & juniorDoMsg) = 0;
+   virtual status_t JuniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & juniorDoMsg) = 0;
 
    /** This method should be implemented to save the state of the specified local database into a Message.
      * @param whichDatabase The index of the database to save (eg 0 for the first database, 1 for the second, and so on)
@@ -244,6 +285,16 @@ protected:
      */
    virtual MessageRef SaveLocalDatabaseToMessage(uint32 whichDatabase) const = 0;
 
+   /** This method may be implemented to return a snapshot of the specified local database's current state, in the same
+     * format that SaveLocalDatabaseToMessage() returns.  Unlike SaveLocalDatabaseToMessage()'s return value, the returned
+     * Message must not be affected by any later changes to the database, and must be safe to flatten from another thread.
+     * When available, this allows the senior peer to flatten and compress the database for a full-database-resend to
+     * a junior peer in a helper thread, rather than blocking its main thread while it does so.
+     * The default implementation returns a NULL reference, meaning that snapshots aren't supported.
+     * @param whichDatabase The index of the database to save (eg 0 for the first database, 1 for the second, and so on)
+     */
+   virtual ConstMessageRef SaveLocalDatabaseToSnapshot(uint32 whichDatabase) const {(void) whichDatabase; return ConstMessageRef();}
+
    /** This method should be implemented to replace the current state of the specified local database with the
      * new state represented by the passed-in Message.
      * @param whichDatabase The index of the database to replace (eg 0 for the first database, 1 for the second, and so on)
@@ -251,14 +302,37 @@ protected:
      * @param newDBStateMsg A Message holding the contents of the new database we want to replace the current database with.
      * @returns B_NO_ERROR on success, or an error code on failure.
      */
-   virtual status_t SetLocalDatabaseFromMessage(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & newDBStateMsg) = 0;
+   virtual status_t SetLocalDatabaseFromMessage(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & newDBStateMsg) = 0;
+
+   /** This method will only be called on the senior peer.  It may be implemented to help a junior peer whose copy of the
+     * specified database has diverged from ours to repair its copy in-place, so that only the parts of the database that
+     * differ need to be sent to it.  The repair proceeds as a conversation between this method and JuniorRepairLocalDatabase().
+     * @param whichDatabase The index of the database to be repaired (eg 0 for the first database, 1 for the second, and so on)
+     * @param repairRequestMsg A request Message that JuniorRepairLocalDatabase() returned on the junior peer.
+     * @returns on success, a Message to pass to JuniorRepairLocalDatabase() on the junior peer.  On failure, a NULL reference.
+     * The default implementation returns B_UNIMPLEMENTED, in which case the junior peer will download the full database instead.
+     */
+   virtual ConstMessageRef SeniorRepairLocalDatabase(uint32 whichDatabase, const ConstMessageRef & repairRequestMsg) const {(void) whichDatabase; (void) repairRequestMsg; return B_UNIMPLEMENTED;}
+
+   /** This method will only be called on junior peers.  It may be implemented to repair the specified local database in-place,
+     * after its state has diverged from the senior peer's state.
+     * @param whichDatabase The index of the database to repair (eg 0 for the first database, 1 for the second, and so on)
+     * @param dbChecksum Passed in as the database's current checksum value.  On return, this should be set to the database's new (post-repair) checksum value.
+     * @param optRepairReplyMsg The senior peer's answer to our previous request, as returned by SeniorRepairLocalDatabase(), or a NULL
+     *                          reference if a new repair-pass is starting.
+     * @param retNextRequestMsg On success, this should be set to the next request to send to the senior peer's SeniorRepairLocalDatabase()
+     *                          method, or to a NULL reference if there is nothing left to ask during this repair-pass.
+     * @returns B_NO_ERROR on success, or an error code on failure.
+     * The default implementation returns B_UNIMPLEMENTED, in which case the full database will be downloaded instead.
+     */
+   virtual status_t JuniorRepairLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & optRepairReplyMsg, MessageRef & retNextRequestMsg) {(void) whichDatabase; (void) dbChecksum; (void) optRepairReplyMsg; (void) retNextRequestMsg; return B_UNIMPLEMENTED;}
 
    /** This method is used for sanity-checking.  It should be implemented to scan the specified local database
      * and return a checksum representing all of the data in the database.  This checksum should match the
      * checksums returned/updated by the SeniorUpdateLocalDatabase() and JuniorUpdateLocalDatabase() functions for
      * the same database state.
      */
-   MUSCLE_NODISCARD virtual uint32 CalculateLocalDatabaseChecksum(uint32 whichDatabase) const = 0;
+   MUSCLE_NODISCARD virtual uint64 CalculateLocalDatabaseChecksum(uint32 whichDatabase) const = 0;
 
    /** This method may be implemented to return a human-readable representation of the specified database's current contents
      * as a String.  This string will be printed to stdout after a checksum error has occurred, to make it easier to debug
@@ -289,6 +363,15 @@ protected:
      */
    virtual void SeniorPeerChanged(const ZGPeerID & oldSeniorPeerID, const ZGPeerID & newSeniorPeerID);
 
+   /** Called when the senior peer of one of our databases has changed.  Only called when per-database
+     * senior peers are enabled (see ZGPeerSettings::SetPerDatabaseSeniorPeersEnabled()); otherwise
+     * SeniorPeerChanged() is the only notification.  Default implementation just logs the change.
+     * @param whichDB index of the database whose senior peer has changed
+     * @param oldSeniorPeerID The unique ID of the peer who was the database's senior peer but no longer is.  (May be invalid)
+     * @param newSeniorPeerID The unique ID of the peer who is now the database's senior peer.  (May be invalid)
+     */
+   virtual void DatabaseSeniorPeerChanged(uint32 whichDB, const ZGPeerID & oldSeniorPeerID, const ZGPeerID & newSeniorPeerID);
+
    /** Tries to send the given Message to all peers (except this one) via UDP multicast.
      * The PacketTunnelIOGateway mechanism is used so that large Messages can
      * be transmitted as well as small ones.  Delivery is not guaranteed, however.
@@ -321,6 +404,69 @@ protected:
      */
    void PrintDatabaseUpdateLog(int32 whichDatabase = -1) const;
 
+   /** Prints this peer's commit-latency histograms to stdout (one line per stage of an update's journey, from
+     * the requesting peer through the senior peer to this peer).  Useful for finding out where update-latency is being spent.
+     * @param whichDatabase Index of the database to print out the histograms of, or leave set to -1 to print out the histograms of all databases.
+     */
+   void PrintUpdateLatencyStats(int32 whichDatabase = -1) const;
+
+   /** Returns a pointer to the commit-latency histograms this peer has recorded for the given database, or NULL if (whichDB) isn't a valid database index.
+     * On the senior peer, only the senior-side stages are recorded; junior peers record every stage of each update they apply.
+     * Since the stages are timed using the network-time clock, the cross-peer stages are only as accurate as our network-time synchronization.
+     * @param whichDB index of the database to return the histograms of
+     */
+   MUSCLE_NODISCARD const ZGUpdateLatencyStats * GetUpdateLatencyStats(uint32 whichDB) const;
+
+   /** Clears this peer's commit-latency histograms.
+     * @param whichDatabase Index of the database to clear the histograms of, or leave set to -1 to clear the histograms of all databases.
+     */
+   void ResetUpdateLatencyStats(int32 whichDatabase = -1);
+
+   /** Prints how far each junior peer's copy of the database(s) is lagging behind the senior peer's, to stdout.
+     * Only the senior peer tracks this information (see ZGPeerSettings::SetMaximumJuniorLagForDatabase()).
+     * @param whichDatabase Index of the database to print out the lag of, or leave set to -1 to print out the lag of all databases.
+     */
+   void PrintJuniorPeerLags(int32 whichDatabase = -1) const;
+
+   /** Called on the senior peer:  Returns how far the specified junior peer's copy of the specified database is lagging behind ours.
+     * Junior peers only report their state if flow-control (or update-acknowledgement) is enabled in the ZGPeerSettings.
+     * @param whichDB index of the database to inquire about
+     * @param peerID ID of the junior peer to inquire about
+     * @param retLagUpdates on success, the number of updates the junior peer hasn't applied yet is written here
+     * @param retLagBytes on success, the number of update-payload bytes (still in our update-log) that the junior peer hasn't applied yet is written here
+     * @returns B_NO_ERROR on success, or an error code if (whichDB) is invalid or that peer hasn't reported its state to us.
+     */
+   status_t GetJuniorPeerLag(uint32 whichDB, const ZGPeerID & peerID, uint64 & retLagUpdates, uint64 & retLagBytes) const;
+
+   /** Called on the senior peer:  Returns the number of update-requests for the specified database that we are currently
+     * deferring because a junior peer is lagging too far behind (see ZGPeerSettings::SetMaximumJuniorLagForDatabase()).
+     * @param whichDB index of the database to inquire about
+     */
+   MUSCLE_NODISCARD uint32 GetNumDeferredUpdateRequests(uint32 whichDB) const;
+
+   /** Returns how often back-order requests for individual updates of the specified database were (or weren't)
+     * able to be served from our local update-log.  Useful for tuning the update-log memory budget(s).
+     * @param whichDB index of the database to inquire about
+     * @param retHits on success, the number of back-orders we served from our update-log is written here
+     * @param retMisses on success, the number of back-orders we couldn't serve (because the update had already been trimmed) is written here
+     * @returns B_NO_ERROR on success, or B_BAD_ARGUMENT if (whichDB) is invalid.
+     */
+   status_t GetBackOrderStats(uint32 whichDB, uint64 & retHits, uint64 & retMisses) const;
+
+   /** Benchmarking aid:  Replaces the specified database's local contents with the starting snapshot of an update-recording
+     * (see ZGPeerSettings::SetUpdateRecordingDirectory()), and then applies each of the recorded updates to it, as fast as
+     * possible, via the same code path a junior peer uses to apply the updates it receives from the senior peer.
+     * @param whichDB index of the database to replay the recording into
+     * @param recordingDir the directory the recording was written into
+     * @param verifyInterval if non-zero, the database's checksum will be recalculated from scratch (and verified) after every
+     *                       (verifyInterval) updates.  It is always recalculated and verified after the last update.
+     * @param retStats on return, throughput and timing statistics about the replay will have been added to this object.
+     * @returns B_NO_ERROR on success, or an error code if the recording couldn't be read or one of its updates couldn't be applied.
+     * @note this method modifies the local database without coordinating with any other peers, so it should only be called
+     *       on a peer that isn't part of a running system (e.g. one that uses a system name that no other peer uses).
+     */
+   status_t ReplayUpdateRecording(uint32 whichDB, const String & recordingDir, uint32 verifyInterval, ZGUpdateReplayStats & retStats);
+
    /** From the IDiscoveryServerSessionController API:  Given an incoming discovery-ping, returns a
      * useful output discovery-pong to go back to the client.
      * @param pingMsg containing the incoming ping
@@ -359,21 +505,54 @@ protected:
 private:
    void ScheduleSetBeaconData();
    void ShutdownChildSessions();
-   status_t SendRequestToSeniorPeer(uint32 whichDatabase, uint32 whatCode, const ConstMessageRef & userMsg);
+   status_t SendRequestToSeniorPeer(uint32 whichDatabase, uint32 whatCode, const ConstMessageRef & userMsg, uint64 ackID = 0, uint32 numPeers = 0);
    status_t HandleDatabaseUpdateRequest(const ZGPeerID & fromPeerID, const ConstMessageRef & msg, bool isMessageMeantForSeniorPeer);
    status_t SendDatabaseUpdateViaMulticast(const zg_private::ConstPZGDatabaseUpdateRef  & dbUp);
-   status_t RequestBackOrderFromSeniorPeer(const zg_private::PZGUpdateBackOrderKey & ubok, bool dueToChecksumError);
+   status_t RequestBackOrderFromPeer(const zg_private::PZGUpdateBackOrderKey & ubok, bool dueToChecksumError);
    zg_private::ConstPZGBeaconDataRef GetNewSeniorBeaconData() const;
+
+   // These methods let junior peers back-fill missing updates from any up-to-date peer, not just the senior peer
+   void SendCatchUpOffer();
+   void CatchUpOfferReceived(const ZGPeerID & fromPeerID, const ConstMessageRef & msg);
+   void CatchUpSourceFailed(const ZGPeerID & peerID) {(void) _catchUpOffers.Remove(peerID);}
+   ZGPeerID GetBackOrderSourcePeerID(uint32 whichDB, uint64 firstUpdateID, uint64 & lastUpdateID) const;
+   ZGPeerID GetFullDatabaseResendSourcePeerID(uint32 whichDB, uint64 minimumStateID) const;
+   MUSCLE_NODISCARD uint64 GetCatchUpCost(const ZGPeerID & peerID, const zg_private::PZGCatchUpOffer * optOffer) const;
+   MUSCLE_NODISCARD bool IsAnyPeerBehindDatabaseState(uint32 whichDB, uint64 stateID) const;
+
+   // Enforces the shared update-log memory budget (see ZGPeerSettings::SetSharedUpdateLogBudget())
+   void TrimSharedUpdateLogs();
+
    status_t SendUnicastInternalMessageToAllPeers(const ConstMessageRef & msg, bool sendToSelf = true);
    status_t SendUnicastInternalMessageToPeer(const ZGPeerID & destinationPeerID, const ConstMessageRef & msg);
    status_t SendMulticastInternalMessageToAllPeers(const ConstMessageRef & internalMsg);
+   status_t SendUnicastInternalMessageToSeniorPeer(uint32 whichDB, const ConstMessageRef & internalMsg);
    void VerifyOrFixLocalDatabaseChecksum(uint32 whichDB);
 
+   // These methods implement acknowledged database updates (see ZGPeerSettings::SetUpdateAcknowledgementsEnabled())
+   void ScheduleAppliedStateReport();
+   void SendAppliedStateReport();
+   void AppliedStateReportReceived(const ZGPeerID & fromPeerID, const ConstMessageRef & msg);
+   void UpdateAcknowledgementReceived(const ZGPeerID & fromPeerID, const ConstMessageRef & msg);
+   void FailPendingUpdateAcknowledgements(uint32 whichDB, status_t why);
+
+   // These methods implement per-database senior peers (see ZGPeerSettings::SetPerDatabaseSeniorPeersEnabled())
+   void UpdateDatabaseSeniorPeerIDs();
+   void UpdateLocalPeerIsCaughtUp();
+   MUSCLE_NODISCARD bool IAmTheSeniorPeerOfAnyDatabase() const;
+   MUSCLE_NODISCARD bool IAmAJuniorPeerOfAnyDatabase() const;
+
+   // These methods support the per-database worker threads (see ZGPeerSettings::SetDatabaseWorkerThreadsEnabled())
+   zg_private::PZGDatabaseState * GetDatabaseStateForCallingWorkerThread();
+   void DatabaseWorkerCallReceived(const MessageRef & callMsg);
+
    // These methods are called from the PZGNetworkIOSession code
    void PrivateMessageReceivedFromPeer(const ZGPeerID & peerID, const MessageRef & msg);
-   void BeaconDataChanged(const zg_private::ConstPZGBeaconDataRef & beaconData);
+   void BeaconDataChanged(const ZGPeerID & fromPeerID, const zg_private::ConstPZGBeaconDataRef & beaconData);
    void BackOrderResultReceived(const zg_private::PZGUpdateBackOrderKey & ubok, const zg_private::ConstPZGDatabaseUpdateRef & optUpdateData);
    zg_private::ConstPZGDatabaseUpdateRef GetDatabaseUpdateByID(uint32 whichDatabase, uint64 updateID) const;
+   void BackOrderLookupCompleted(uint32 whichDatabase, bool wasInUpdateLog);
+   zg_private::ConstPZGDatabaseUpdateRef GetFullDatabaseUpdateForTransfer(uint32 whichDatabase, bool & retCanFlattenAsynchronously);
 
    const ZGPeerSettings _peerSettings;
 
@@ -392,6 +571,16 @@ private:
    bool _setBeaconDataPending;
 
    Hashtable<ZGPeerID, ConstMessageRef> _onlinePeers;
+
+   uint64 _nextCatchUpOfferTime;                                      // when we should next multicast our catch-up offer
+   Hashtable<ZGPeerID, zg_private::PZGCatchUpOffer> _catchUpOffers;  // most recent catch-up offer received from each peer
+
+   bool _appliedStateReportPending;                                   // true iff we should send our database state IDs to the senior peer on our next Pulse()
+   uint64 _nextAckID;                                                 // used to generate IDs for RequestUpdateDatabaseStateWithAcknowledgement()
+   Hashtable<uint64, uint32> _pendingUpdateAcks;                      // ack ID -> database index, for our updates that haven't been acknowledged yet
+
+   Queue<ZGPeerID> _databaseSeniorPeerIDs;                            // database index -> ID of that database's current senior peer
+   Hashtable<ZGPeerID, zg_private::ConstPZGBeaconDataRef> _databaseSeniorBeaconDatas;  // most recent beacon data received from each remote database-senior peer
 };
 DECLARE_REFTYPES(ZGPeerSession);
 
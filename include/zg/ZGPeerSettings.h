@@ -16,7 +16,7 @@ namespace zg
 /** The different types of peer that ZG supports */
 enum {
    PEER_TYPE_FULL_PEER = 0,  ///< a full peer is one that is able to become senior peer if necessary
-   PEER_TYPE_JUNIOR_ONLY,    ///< a junior-only peer is one that wants to follow along as a junior peer but doesn't want to be senior
+   PEER_TYPE_JUNIOR_ONLY,    ///< a junior-only (observer) peer follows along as a junior peer, but never becomes senior and isn't part of the senior-peer election
    NUM_PEER_TYPES            ///< Guard value
 };
 
@@ -40,7 +40,8 @@ public:
      * @param numDatabases The number of replicated databases this system should maintain.
      * @param systemIsOnLocalhostOnly If true, we'll send/receive multicast packets on loopback interfaces only.  If false, we'll use all interfaces.
      * @param peerType One of the PEER_TYPE_* values.  Defaults to PEER_TYPE_FULL_PEER, meaning that this peer is willing to handle
-     *                 both junior-peer and senior-peer duties, if necessary.
+     *                 both junior-peer and senior-peer duties, if necessary.  Pass PEER_TYPE_JUNIOR_ONLY for an observer peer
+     *                 that only wants to follow along; lots of observers can be added without adding to the full peers' heartbeat load.
      */
    ZGPeerSettings(const String & signature, const String & systemName, uint8 numDatabases, bool systemIsOnLocalhostOnly, uint16 peerType = PEER_TYPE_FULL_PEER)
       : _signature(signature)
@@ -53,7 +54,17 @@ public:
       , _heartbeatsBeforeFullyAttached(4)
       , _maxMissingHeartbeats(4)
       , _beaconsPerSecond(4)
+      , _minBeaconIntervalMicros(MillisToMicros(10))
+      , _maxBeaconIntervalMicros(SecondsToMicros(2))
       , _multicastBehavior(ZG_MULTICAST_BEHAVIOR_AUTO)
+      , _multicastFECGroupSize(0)
+      , _multicastPacingBytesPerSecond(0)
+      , _multicastPacingPacketsPerSecond(0)
+      , _sharedUpdateLogBudgetBytes(0)
+      , _databaseWorkerThreadsEnabled(false)
+      , _updateAcknowledgementsEnabled(false)
+      , _perDatabaseSeniorPeersEnabled(false)
+      , _updatesPerSnapshot(1000)
       , _outgoingHeartbeatPacketIDCounter(0)
    {
       // empty
@@ -76,7 +87,7 @@ public:
      */
    MUSCLE_NODISCARD const ConstMessageRef & GetPeerAttributes() const {return _optPeerAttributes;}
 
-   /** Returns the PEER_TYPE_* value of this peer (currently only PEER_TYPE_FULL_PEER is supported) */
+   /** Returns the PEER_TYPE_* value of this peer */
    MUSCLE_NODISCARD uint16 GetPeerType()                        const {return _peerType;}
 
    /** Returns the heartbeats-per-second value for htis peer (currently defaults to 6) */
@@ -91,6 +102,12 @@ public:
    /** Returns the number-of-beacon-packets-to-send-per-second value for this peer (currently defaults to 4) */
    MUSCLE_NODISCARD uint32 GetBeaconsPerSecond()                const {return _beaconsPerSecond;}
 
+   /** Returns the minimum number of microseconds the senior peer will wait between beacon packets (currently defaults to 10 milliseconds) */
+   MUSCLE_NODISCARD uint64 GetMinimumBeaconInterval()           const {return _minBeaconIntervalMicros;}
+
+   /** Returns the maximum number of microseconds the senior peer will wait between beacon packets (currently defaults to 2 seconds) */
+   MUSCLE_NODISCARD uint64 GetMaximumBeaconInterval()           const {return _maxBeaconIntervalMicros;}
+
    /** Return the Application Peer Compatibility code specified for this peer.  Default value is 0.
      * @see SetApplicationPeerCompatibilityVersion() for details.
      */
@@ -148,6 +165,23 @@ public:
      */
    void SetBeaconsPerSecond(uint32 bps) {_beaconsPerSecond = bps;}
 
+   /** Sets the minimum amount of time the senior peer will wait between beacon packets.
+     * Whenever the state of one of the senior peer's databases changes, the senior peer sends out a beacon right away
+     * (containing only the databases that changed), rather than waiting for its next periodic beacon; but it will never
+     * send beacons more often than this, so that a burst of updates doesn't turn into a burst of beacons.
+     * Default value is 10 milliseconds.
+     * @param micros the minimum beacon interval, in microseconds
+     */
+   void SetMinimumBeaconInterval(uint64 micros) {_minBeaconIntervalMicros = micros;}
+
+   /** Sets the maximum amount of time the senior peer will wait between beacon packets.
+     * The first periodic beacon after a database-state change is sent 1/GetBeaconsPerSecond() seconds later (in case
+     * the change-triggered beacon was lost), and then while nothing changes, the interval doubles after each beacon,
+     * until it reaches this value.  Default value is 2 seconds.
+     * @param micros the maximum beacon interval, in microseconds.  A value no greater than 1/GetBeaconsPerSecond() seconds disables the back-off.
+     */
+   void SetMaximumBeaconInterval(uint64 micros) {_maxBeaconIntervalMicros = micros;}
+
    /** Specify what kind of multicast behavior ZG should use
      * @param whichBehavior a ZG_MULTICAST_BEHAVIOR_* value.  (Default state is ZG_MULTICAST_BEHAVIOR_AUTO)
      */
@@ -156,6 +190,35 @@ public:
    /** Returns the current ZG_MULTICAST_BEHAVIOR_* value */
    MUSCLE_NODISCARD uint32 GetMulticastBehavior() const {return _multicastBehavior;}
 
+   /** Call this to have the peer send a forward-error-correction parity packet after every few multicast data packets,
+     * so that a junior peer that loses one packet of a group can reconstruct it locally, instead of having to NACK it or
+     * back-order the update it contained.  The junior peers periodically report the packet-loss rate they're seeing,
+     * and the more loss they report, the fewer data packets each parity packet covers (but never more than specified here).
+     * Peers can always decode parity packets, regardless of this setting.  Default value is 0 (i.e. no parity packets are sent).
+     * @param maxGroupSize the maximum number of multicast data packets per parity packet (up to 32), or 0 to disable sending parity.
+     *                     For example, a value of 8 costs (at most) one extra packet per 8 packets sent.
+     */
+   void SetMulticastFECGroupSize(uint32 maxGroupSize) {_multicastFECGroupSize = muscleMin(maxGroupSize, (uint32)32);}
+
+   /** Returns the maximum number of multicast data packets the peer will send per parity packet, or 0 if it sends none. */
+   MUSCLE_NODISCARD uint32 GetMulticastFECGroupSize() const {return _multicastFECGroupSize;}
+
+   /** Call this to limit the rate at which the peer sends multicast packets on each network interface.  Without a limit,
+     * a large database-update (or a burst of them) is sent as fast as the socket allows, which can overflow the buffers
+     * of switches and Wi-Fi access points, so that many of the packets get dropped and have to be re-requested.
+     * With a limit, the outgoing packets are spread out over time instead, and beacons, NACKs, and retransmissions
+     * are sent ahead of any database-updates that are still waiting to go out.  Default values are 0 (i.e. no limit).
+     * @param maxBytesPerSecond the maximum number of bytes per second to send on each interface, or 0 for no limit.
+     * @param maxPacketsPerSecond the maximum number of packets per second to send on each interface, or 0 for no limit.
+     */
+   void SetMulticastPacingRate(uint64 maxBytesPerSecond, uint32 maxPacketsPerSecond) {_multicastPacingBytesPerSecond = maxBytesPerSecond; _multicastPacingPacketsPerSecond = maxPacketsPerSecond;}
+
+   /** Returns the maximum number of bytes per second the peer will send on each interface, or 0 if there is no limit. */
+   MUSCLE_NODISCARD uint64 GetMulticastPacingBytesPerSecond() const {return _multicastPacingBytesPerSecond;}
+
+   /** Returns the maximum number of packets per second the peer will send on each interface, or 0 if there is no limit. */
+   MUSCLE_NODISCARD uint32 GetMulticastPacingPacketsPerSecond() const {return _multicastPacingPacketsPerSecond;}
+
    /** Call this to set the maximum number of bytes of RAM the specified database should be allowed
      * to use for its database-update-log records.  If not specified for a given database, a default
      * limit of two megabytes will be used.
@@ -169,6 +232,171 @@ public:
      */
    MUSCLE_NODISCARD uint64 GetMaximumUpdateLogSizeForDatabase(uint32 whichDB) const {return _maxUpdateLogSizeBytes.GetWithDefault(whichDB, 2*1024*1024);}
 
+   /** Call this to have all of the databases' update-logs share a single memory budget, instead of each database
+     * having its own budget.  That way a busy database can use the memory that idle databases aren't using.
+     * When the total exceeds the budget, the oldest update of whichever database's update-log it is cheapest
+     * to give up is removed, weighing how long ago the update was executed, how large its payload is, and whether
+     * any online peer is still likely to need it (e.g. to catch up).  Disabled by default.
+     * @param maxNumBytes The total number of bytes of update-payloads to keep in RAM across all databases,
+     *                    or 0 to have each database use its own GetMaximumUpdateLogSizeForDatabase() budget instead.
+     */
+   void SetSharedUpdateLogBudget(uint64 maxNumBytes) {_sharedUpdateLogBudgetBytes = maxNumBytes;}
+
+   /** Returns the shared update-log memory budget, in bytes, or 0 if each database uses its own budget. */
+   MUSCLE_NODISCARD uint64 GetSharedUpdateLogBudget() const {return _sharedUpdateLogBudgetBytes;}
+
+   /** Call this to enable group-commit mode for the specified database.  In group-commit mode, the senior peer
+     * still executes each update-request as soon as it receives it, but rather than creating a separate
+     * database-update (with its own update-log entry, beacon and multicast packet) for every request, it gathers
+     * all the update-requests it executes within the group-commit window into a single database-update.
+     * Junior peers will still apply the gathered updates one at a time, in the order the senior peer executed them.
+     * Group-commit mode is disabled by default.
+     * @param whichDB The database you want to specify a group-commit window for
+     * @param windowMicros How long (in microseconds) a group may remain open after its first update-request was executed.
+     *                     If 0, all update-requests that arrive during the same event-loop iteration will be grouped together.
+     *                     If MUSCLE_TIME_NEVER, group-commit mode will be disabled for that database (this is the default).
+     * @note all peers in the system must be running a version of ZG that supports group-commit mode before you enable it.
+     */
+   void SetGroupCommitWindowForDatabase(uint32 whichDB, uint64 windowMicros) {if (windowMicros == MUSCLE_TIME_NEVER) (void) _groupCommitWindowMicros.Remove(whichDB); else (void) _groupCommitWindowMicros.Put(whichDB, windowMicros);}
+
+   /** Returns the group-commit window (in microseconds) of the specified database, or MUSCLE_TIME_NEVER if group-commit mode is disabled for that database.
+     * @param whichDB The database you want to retrieve the group-commit window for
+     */
+   MUSCLE_NODISCARD uint64 GetGroupCommitWindowForDatabase(uint32 whichDB) const {return _groupCommitWindowMicros.GetWithDefault(whichDB, MUSCLE_TIME_NEVER);}
+
+   /** Call this to enable flow-control for the specified database.  When enabled, junior peers report the state IDs of
+     * their databases to the senior peer as they apply updates, and whenever the slowest online junior peer lags behind
+     * the senior peer by more than the specified number of updates (or payload-bytes), the senior peer defers executing
+     * any further update-requests for this database until that junior peer has caught up to within the limits again.
+     * This keeps a flood of update-requests from pushing slow junior peers out of the update-log (and into full-database resends).
+     * @param whichDB The database to enable flow-control for
+     * @param maxLagUpdates The maximum number of updates a junior peer may lag behind by, or MUSCLE_NO_LIMIT.
+     * @param maxLagBytes The maximum number of update-payload bytes a junior peer may lag behind by, or MUSCLE_NO_LIMIT.
+     *                    This should be smaller than the database's GetMaximumUpdateLogSizeForDatabase() value.
+     *                    Passing MUSCLE_NO_LIMIT for both limits disables flow-control for the database (which is the default).
+     * @note this setting should be the same on every peer in the system, since junior peers only report their state when it is enabled.
+     */
+   void SetMaximumJuniorLagForDatabase(uint32 whichDB, uint64 maxLagUpdates, uint64 maxLagBytes = MUSCLE_NO_LIMIT)
+   {
+      if (maxLagUpdates == MUSCLE_NO_LIMIT) (void) _maxJuniorLagUpdates.Remove(whichDB); else (void) _maxJuniorLagUpdates.Put(whichDB, maxLagUpdates);
+      if (maxLagBytes   == MUSCLE_NO_LIMIT) (void) _maxJuniorLagBytes.Remove(whichDB);   else (void) _maxJuniorLagBytes.Put(whichDB, maxLagBytes);
+   }
+
+   /** Returns the maximum number of updates a junior peer may lag behind the senior peer by, for the specified database, or MUSCLE_NO_LIMIT.
+     * @param whichDB The database you want to retrieve the limit for
+     */
+   MUSCLE_NODISCARD uint64 GetMaximumJuniorLagUpdatesForDatabase(uint32 whichDB) const {return _maxJuniorLagUpdates.GetWithDefault(whichDB, MUSCLE_NO_LIMIT);}
+
+   /** Returns the maximum number of update-payload bytes a junior peer may lag behind the senior peer by, for the specified database, or MUSCLE_NO_LIMIT.
+     * @param whichDB The database you want to retrieve the limit for
+     */
+   MUSCLE_NODISCARD uint64 GetMaximumJuniorLagBytesForDatabase(uint32 whichDB) const {return _maxJuniorLagBytes.GetWithDefault(whichDB, MUSCLE_NO_LIMIT);}
+
+   /** Returns true iff flow-control has been enabled for at least one database */
+   MUSCLE_NODISCARD bool IsFlowControlEnabled() const {return ((_maxJuniorLagUpdates.HasItems())||(_maxJuniorLagBytes.HasItems()));}
+
+   /** Call this to specify how the payloads of the specified database's updates should be compressed.
+     * Payloads are compressed using zlib, except for small payloads (and payloads that don't compress
+     * at all), which are sent as-is, since compressing them costs CPU time on the senior peer without saving
+     * any meaningful bandwidth.  Higher levels make the update-log more compact, at the cost of more CPU time
+     * on the senior peer for every update.
+     * @param whichDB The database you want to specify a compression level for
+     * @param compressionLevel A zlib compression level, from 0 (no compression) to 9 (maximum compression).
+     *                         Defaults to ZG_DEFAULT_PAYLOAD_COMPRESSION_LEVEL (1, i.e. fast).
+     */
+   void SetPayloadCompressionLevelForDatabase(uint32 whichDB, uint8 compressionLevel) {(void) _payloadCompressionLevels.Put(whichDB, muscleMin(compressionLevel, (uint8)9));}
+
+   /** Returns the zlib compression level that payloads of the specified database's updates will be compressed with.
+     * @param whichDB The database you want to retrieve the compression level for
+     */
+   MUSCLE_NODISCARD uint8 GetPayloadCompressionLevelForDatabase(uint32 whichDB) const {return _payloadCompressionLevels.GetWithDefault(whichDB, ZG_DEFAULT_PAYLOAD_COMPRESSION_LEVEL);}
+
+   /** Call this to enable per-database worker threads.  When enabled, each database gets its own worker thread,
+     * and all senior and junior updates of that database are executed in that thread, in order, so that updates
+     * to different databases can execute in parallel.  Calls made from within a worker thread to send Messages
+     * to other peers are forwarded to the main thread automatically.  Disabled by default.
+     * @param enable true to enable per-database worker threads, or false to execute all updates in the main thread.
+     * @note When enabled, your SeniorUpdateLocalDatabase(), JuniorUpdateLocalDatabase(), ResetLocalDatabaseToDefault(),
+     *       SetLocalDatabaseFromMessage() and CalculateLocalDatabaseChecksum() methods may be called from the worker thread of the database being updated,
+     *       so they must not access anything that is shared with the main thread or with other databases.
+     *       In particular, this mode can't be used with MessageTreeDatabaseObjects, since they share the main thread's node-tree
+     *       (MessageTreeDatabasePeerSession::AttachedToServer() returns B_BAD_ARGUMENT if it is enabled).
+     */
+   void SetDatabaseWorkerThreadsEnabled(bool enable) {_databaseWorkerThreadsEnabled = enable;}
+
+   /** Returns true iff per-database worker threads are enabled.  Default value is false. */
+   MUSCLE_NODISCARD bool AreDatabaseWorkerThreadsEnabled() const {return _databaseWorkerThreadsEnabled;}
+
+   /** Call this to enable acknowledged database updates (see ZGPeerSession::RequestUpdateDatabaseStateWithAcknowledgement()).
+     * When enabled, each junior peer reports the state IDs of its databases to the senior peer shortly after applying
+     * database updates (coalesced into at most one small unicast Message per event-loop cycle), so that the senior peer
+     * can tell the requesting peer when its update has been applied on enough peers.  Disabled by default.
+     * @param enable true to enable update-acknowledgements, or false to disable them.
+     * @note this setting should be the same on every peer in the system, since an update that was requested to be
+     *       acknowledged by all peers won't be acknowledged while any online peer isn't reporting its state.
+     */
+   void SetUpdateAcknowledgementsEnabled(bool enable) {_updateAcknowledgementsEnabled = enable;}
+
+   /** Returns true iff acknowledged database updates are enabled.  Default value is false. */
+   MUSCLE_NODISCARD bool AreUpdateAcknowledgementsEnabled() const {return _updateAcknowledgementsEnabled;}
+
+   /** Call this to let each database have its own senior peer, so that the work of executing senior updates
+     * (and of multicasting them to the junior peers) is spread across the peers instead of all being done by the
+     * senior peer of the system.  When enabled, a database keeps its senior peer for as long as that peer stays online
+     * (each senior peer advertises its databases in its heartbeats, so that all peers agree on who holds what).  When a
+     * database has no senior peer, or its senior peer goes offline, its new senior peer is chosen by hashing the database's
+     * index together with the IDs of the eligible peers (rendezvous hashing).  The eligible peers are the senior peer of the
+     * system, plus any other full peers whose databases are all currently caught up with their senior peers' databases.
+     * Disabled by default.
+     * @param enable true to give each database its own senior peer, or false to have the senior peer of the system be
+     *               the senior peer of every database.
+     * @note this setting must be the same on every peer in the system.
+     * @see ZGPeerSession::GetSeniorPeerIDForDatabase() and ZGPeerSession::IAmTheSeniorPeerForDatabase()
+     */
+   void SetPerDatabaseSeniorPeersEnabled(bool enable) {_perDatabaseSeniorPeersEnabled = enable;}
+
+   /** Returns true iff each database may have its own senior peer.  Default value is false. */
+   MUSCLE_NODISCARD bool ArePerDatabaseSeniorPeersEnabled() const {return _perDatabaseSeniorPeersEnabled;}
+
+   /** Call this to have the peer keep a copy of its databases on disk, so that it can restart quickly.
+     * For each database, the peer will keep a snapshot file (written every so often, using SaveLocalDatabaseToMessage())
+     * plus an append-only log of the database-updates it has applied since that snapshot was written.  At startup,
+     * the peer will load the snapshot and replay the log, so that it will only need to get the updates it missed
+     * while it was offline from the senior peer, rather than the entire database.  Disabled by default.
+     * @param dirPath path to an existing directory to keep the files in, or an empty string to disable persistence.
+     *                Each peer (and each ZG system) should use its own directory.
+     * @note update-log records are flushed as they are written, so they will survive the process crashing, but only
+     *       snapshots are synced to disk; after a power failure the most recent updates may need to be re-fetched
+     *       from the senior peer, as usual.
+     */
+   void SetPersistenceDirectory(const String & dirPath) {_persistenceDirectory = dirPath;}
+
+   /** Returns the directory the peer keeps its on-disk database files in, or an empty string if persistence is disabled. */
+   MUSCLE_NODISCARD const String & GetPersistenceDirectory() const {return _persistenceDirectory;}
+
+   /** Sets how many database-updates should be appended to a database's on-disk log before a new snapshot of that
+     * database is written (and the log is emptied).  Only relevant if SetPersistenceDirectory() was called.
+     * @param numUpdates the new number of updates per snapshot.  Defaults to 1000.
+     */
+   void SetUpdatesPerSnapshot(uint32 numUpdates) {_updatesPerSnapshot = muscleMax(numUpdates, (uint32)1);}
+
+   /** Returns how many database-updates will be logged to disk between snapshots. */
+   MUSCLE_NODISCARD uint32 GetUpdatesPerSnapshot() const {return _updatesPerSnapshot;}
+
+   /** Call this to have the peer record every database-update it applies (whether as the senior peer or as a junior peer)
+     * into files in the specified directory, so that the recorded updates can later be replayed offline, e.g. to benchmark
+     * a JuniorUpdateLocalDatabase() implementation (see ZGPeerSession::ReplayUpdateRecording()).  For each database, the
+     * recording consists of a snapshot of the database's state at startup, plus a log of the updates applied after that.
+     * Recording stops if the database ever changes in a way that can't be recorded as an update (e.g. an in-place repair).
+     * Disabled by default.
+     * @param dirPath path to an existing directory to write the recording into, or an empty string to disable recording.
+     *                Any previous recording in that directory will be overwritten.  This shouldn't be the persistence directory.
+     */
+   void SetUpdateRecordingDirectory(const String & dirPath) {_updateRecordingDirectory = dirPath;}
+
+   /** Returns the directory the peer records its applied database-updates into, or an empty string if recording is disabled. */
+   MUSCLE_NODISCARD const String & GetUpdateRecordingDirectory() const {return _updateRecordingDirectory;}
+
 private:
 #ifndef DOXYGEN_SHOULD_IGNORE_THIS
    friend class zg_private::PZGHeartbeatThreadState;
@@ -185,8 +413,24 @@ private:
    uint32 _heartbeatsBeforeFullyAttached;  // how many heartbeat-periods we should allow to elapse before declaring ourselves fully part of the system.
    uint32 _maxMissingHeartbeats;       // how many heartbeat-periods must go by without receiving a heartbeat from a peer, before we declare him offline
    uint32 _beaconsPerSecond;           // how many beacon-packets we should send out per second if we are the senior peer
+   uint64 _minBeaconIntervalMicros;    // change-triggered beacons are never sent more often than this
+   uint64 _maxBeaconIntervalMicros;    // periodic beacons back off to this interval while nothing changes
    uint32 _multicastBehavior;          // our ZG_MULTICAST_BEHAVIOR_* value
+   uint32 _multicastFECGroupSize;      // max number of multicast data packets per parity packet (0 means we don't send parity packets)
+   uint64 _multicastPacingBytesPerSecond;    // max multicast bytes per second per interface (0 means no limit)
+   uint32 _multicastPacingPacketsPerSecond;  // max multicast packets per second per interface (0 means no limit)
    Hashtable<uint32, uint64> _maxUpdateLogSizeBytes;
+   uint64 _sharedUpdateLogBudgetBytes; // if non-zero, the update-log memory budget shared by all databases
+   Hashtable<uint32, uint64> _groupCommitWindowMicros;  // databases that aren't in this table don't use group-commit mode
+   Hashtable<uint32, uint64> _maxJuniorLagUpdates;      // databases that aren't in this table have no limit on how many updates a junior peer may lag by
+   Hashtable<uint32, uint64> _maxJuniorLagBytes;        // databases that aren't in this table have no limit on how many payload-bytes a junior peer may lag by
+   Hashtable<uint32, uint8> _payloadCompressionLevels;  // databases that aren't in this table use ZG_DEFAULT_PAYLOAD_COMPRESSION_LEVEL
+   bool _databaseWorkerThreadsEnabled; // true iff each database should execute its updates in its own worker thread
+   bool _updateAcknowledgementsEnabled; // true iff junior peers should report their applied database states to the senior peer
+   bool _perDatabaseSeniorPeersEnabled; // true iff each database's senior peer is chosen separately
+   String _persistenceDirectory;       // directory to keep our on-disk database snapshots and update-logs in (empty if persistence is disabled)
+   uint32 _updatesPerSnapshot;         // how many updates to log to disk before writing a new snapshot
+   String _updateRecordingDirectory;   // directory to record our applied database-updates into (empty if recording is disabled)
    mutable uint32 _outgoingHeartbeatPacketIDCounter;
 };
 
@@ -34,8 +34,9 @@ public:
    virtual void SetToDefaultState();
    virtual status_t SetFromArchive(const ConstMessageRef & archive);
    virtual status_t SaveToArchive(const MessageRef & archive) const;
-   MUSCLE_NODISCARD virtual uint32 GetCurrentChecksum() const {return _checksum;}
-   MUSCLE_NODISCARD virtual uint32 CalculateChecksum() const;
+   virtual ConstMessageRef SaveToSnapshot() const;
+   MUSCLE_NODISCARD virtual uint64 GetCurrentChecksum() const {return _checksum;}
+   MUSCLE_NODISCARD virtual uint64 CalculateChecksum() const;
    MUSCLE_NODISCARD virtual String ToString() const;
 
    /** Returns a pointer to the MessageTreeDatabasePeerSession object that created us, or NULL
@@ -148,6 +149,11 @@ protected:
    // IDatabaseObject API
    virtual ConstMessageRef SeniorUpdate(const ConstMessageRef & seniorDoMsg);
    virtual status_t JuniorUpdate(const ConstMessageRef & juniorDoMsg);
+   virtual ConstMessageRef SeniorRepair(const ConstMessageRef & repairRequestMsg) const;
+   virtual status_t JuniorRepair(const ConstMessageRef & optRepairReplyMsg, MessageRef & retNextRequestMsg);
+   MUSCLE_NODISCARD virtual bool CanUndoSpeculativeUpdates() const {return true;}
+   virtual ConstMessageRef SpeculativeSeniorUpdate(const ConstMessageRef & seniorDoMsg);
+   virtual status_t UndoSpeculativeSeniorUpdate(const ConstMessageRef & undoMsg);
 
    /** Called by SeniorUpdate() when it wants to add a set/remove-node action to the Junior-Message it is assembling for junior peers to act on when they update their databases.
      * Default implementation just adds the appropriate update-Message to (assemblingMessage), but subclasses can
@@ -203,6 +209,15 @@ protected:
      */
    MUSCLE_NODISCARD bool IsHandlingInterimUpdate() const {return _interimUpdateNestCount.IsInBatch();}
 
+   /** Returns the 64-bit hash of the given bytes.  Every term of our database checksum (node names, flattened node payloads
+     * and index entries) is computed by this method, so subclasses can override it to use a different hash function.
+     * Note that all peers in the system must use the same hash function, or their checksums won't match.
+     * Default implementation returns CalculateChecksum64(bytes, numBytes).
+     * @param bytes pointer to the bytes to hash
+     * @param numBytes the number of bytes that (bytes) points to
+     */
+   MUSCLE_NODISCARD virtual uint64 CalculateBytesChecksum(const uint8 * bytes, uint32 numBytes) const;
+
    /**
     * Returns a pointer to the first DataNode object that mactches the given node-path.
     * @param nodePath The node's path, relative to this database object's root-path.  Wildcarding is okay.
@@ -349,25 +364,49 @@ private:
    MUSCLE_NODISCARD bool IsNodeInThisDatabase(const DataNode & node) const;
    MUSCLE_NODISCARD String DatabaseSubpathToSessionRelativePath(const String & subPath, TreeGatewayFlags flags) const;
    void DumpDescriptionToString(const DataNode & node, String & s, uint32 indentLevel) const;
+   MUSCLE_NODISCARD uint64 CalculateNodeChecksum(const DataNode & node) const;
+   MUSCLE_NODISCARD uint64 CalculateNodeLocalChecksum(const DataNode & node) const;
+   MUSCLE_NODISCARD uint64 CalculateStringChecksum(const String & s) const {return CalculateBytesChecksum(reinterpret_cast<const uint8 *>(s()), s.Length());}
+   MUSCLE_NODISCARD uint64 CalculateMessageChecksum(const Message & msg) const;
+   MUSCLE_NODISCARD uint64 GetRepairPayloadChecksum(const DataNode & node) const;
+   MUSCLE_NODISCARD uint64 GetRepairIndexChecksum(const DataNode & node) const;
+   MUSCLE_NODISCARD uint64 GetSubtreeChecksum(const DataNode & node) const;
+   MUSCLE_NODISCARD uint64 GetSubtreeChecksumAux(const DataNode & node) const;
+   void SubtreeChecksumsChanged(const DataNode & node, bool isBeingRemoved);
+   void ForgetSubtreeChecksums(const DataNode & node);
+
+   status_t JuniorAddRepairUnit(Message & requestMsg, const String & path, uint32 numBits, uint64 prefix) const;
+   status_t JuniorApplyRepairUnit(const Message & answerMsg);
+   status_t JuniorAddFollowUpRepairUnits(const Message & answerMsg, Message & requestMsg) const;
+   status_t SeniorAnswerRepairUnit(const Message & unitMsg, Message & answerMsg) const;
+   status_t SeniorAddRepairChild(const DataNode & parent, const DataNode & child, Message & answerMsg) const;
 
    MessageRef CreateNodeUpdateMessage(const String & path, const ConstMessageRef & optPayload, TreeGatewayFlags flags, const String & optBefore, const String & optOpTag) const;
    MessageRef CreateNodeIndexUpdateMessage(const String & relativePath, char op, uint32 index, const String & key, const String & optOpTag);
    MessageRef CreateSubtreeUpdateMessage(const String & path, const ConstMessageRef & payload, TreeGatewayFlags flags, const String & optOpTag) const;
 
    status_t HandleNodeUpdateMessage(const Message & msg);
-   status_t HandleNodeUpdateMessageAux(const Message & msg, TreeGatewayFlags flags);
+   status_t HandleNodeUpdate(const String & path, const ConstMessageRef & optPayload, TreeGatewayFlags flags, const String & optBefore, const String & optOpTag);
+   status_t HandleNodeUpdateAux(const String & path, const ConstMessageRef & optPayload, TreeGatewayFlags flags, const String & optBefore, const String & optOpTag);
    status_t HandleNodeIndexUpdateMessage(const Message & msg);
+   status_t HandleNodeIndexUpdate(uint32 whatCode, const String & path, TreeGatewayFlags flags, int32 index, const String & key, const String & optOpTag);
+   status_t HandleCompactBatchMessage(const Message & msg);
    status_t HandleSubtreeUpdateMessage(const Message & msg);
 
    status_t UploadUndoRedoRequestToSeniorPeer(uint32 whatCode, const String & optSequenceLabel, uint32 whichDB);
 
    MessageRef _assembledJuniorMessage;
+   MessageRef _assembledSpeculativeUndoMessage;  // while a speculative update is being applied, the actions that will undo it, most-recent first
+   bool _isAssemblingSpeculativeUndo;
    NestCount _interimUpdateNestCount;
 
    const String _rootNodePathWithoutSlash;
    const String _rootNodePathWithSlash;
    const uint32 _rootNodeDepth;
-   uint32 _checksum;  // running checksum
+   uint64 _checksum;  // running checksum
+   mutable ByteBuffer _checksumScratchBuf;  // node payloads are flattened into this buffer to be checksummed, so we don't need to allocate a buffer for each one
+
+   mutable Hashtable<const DataNode *, uint64> _subtreeChecksums;  // lazily-computed cache of per-node subtree checksums, used when repairing a junior peer's database (size-limited, see GetSubtreeChecksum())
 
    Queue<const String *> _opTagStack;
 
@@ -125,8 +125,8 @@ protected:
    virtual void NodeIndexChanged(DataNode & node, char op, uint32 index, const String & key);
 
    // ZGPeerSession API implementation
-   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & seniorDoMsg);
-   virtual status_t JuniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & juniorDoMsg);
+   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & seniorDoMsg);
+   virtual status_t JuniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & juniorDoMsg);
    virtual void MessageReceivedFromPeer(const ZGPeerID & fromPeerID, const MessageRef & msg);
 
 private:
@@ -15,15 +15,19 @@ enum {
 
 /** This class holds all the data that the senior peer will send out periodically to keep
   * the junior peers informed about the state of the senior databases.
+  * A full beacon holds one PZGDatabaseStateInfo per database, in database-index order.
+  * A delta beacon holds only the PZGDatabaseStateInfos of the databases that changed since the
+  * previous beacon, each tagged with the index of its database; it can only be interpreted by
+  * applying it to a copy of the previous full beacon (see ApplyDelta()).
   */
 class PZGBeaconData : public FlatCountable
 {
 public:
-   PZGBeaconData() {/* empty */}
+   PZGBeaconData() : _isDelta(false) {/* empty */}
 
    MUSCLE_NODISCARD virtual bool IsFixedSize()     const   {return false;}
    MUSCLE_NODISCARD virtual uint32 TypeCode()      const   {return PZG_BEACON_DATA;}
-   MUSCLE_NODISCARD virtual uint32 FlattenedSize() const   {return sizeof(uint32) + SaturatingUnsignedMultiply(_dbis.GetNumItems(),PZGDatabaseStateInfo::FlattenedSize());}
+   MUSCLE_NODISCARD virtual uint32 FlattenedSize() const   {return sizeof(uint32) + SaturatingUnsignedMultiply(_dbis.GetNumItems(),PZGDatabaseStateInfo::FlattenedSize()+(_isDelta?sizeof(uint32):0));}
 
    virtual void Flatten(DataFlattener flat) const;
    virtual status_t Unflatten(DataUnflattener & unflat);
@@ -36,13 +40,34 @@ public:
    MUSCLE_NODISCARD const Queue<PZGDatabaseStateInfo> & GetDatabaseStateInfos() const {return _dbis;}
    MUSCLE_NODISCARD Queue<PZGDatabaseStateInfo> & GetDatabaseStateInfos() {return _dbis;}
 
-   void SetDatabaseStateInfos(const Queue<PZGDatabaseStateInfo> & dbis) {_dbis = dbis;}
+   void SetDatabaseStateInfos(const Queue<PZGDatabaseStateInfo> & dbis) {_dbis = dbis; _isDelta = false; _dbIndices.Clear();}
+
+   /** Returns true iff this is a delta beacon */
+   MUSCLE_NODISCARD bool IsDelta() const {return _isDelta;}
+
+   /** Returns the database indices of our PZGDatabaseStateInfos (only valid if this is a delta beacon) */
+   MUSCLE_NODISCARD const Queue<uint32> & GetDatabaseIndices() const {return _dbIndices;}
+
+   /** Makes this object into a delta beacon holding only the PZGDatabaseStateInfos of (newData) that differ from those of (oldData).
+     * @param oldData the full beacon that was sent previously
+     * @param newData the full beacon that we want the receivers to end up with
+     * @returns B_NO_ERROR on success, or B_BAD_ARGUMENT if the two beacons don't describe the same number of databases.
+     */
+   status_t SetToDelta(const PZGBeaconData & oldData, const PZGBeaconData & newData);
+
+   /** Updates this full beacon with the PZGDatabaseStateInfos contained in the given delta beacon.
+     * @param delta the delta beacon to apply
+     * @returns B_NO_ERROR on success, or B_BAD_DATA if (delta) isn't a delta beacon or refers to a database we don't know about.
+     */
+   status_t ApplyDelta(const PZGBeaconData & delta);
 
    void Print(const OutputPrinter & p) const;
    MUSCLE_NODISCARD String ToString() const;
 
 private:
    Queue<PZGDatabaseStateInfo> _dbis;
+   bool _isDelta;             // true iff we hold only the state-infos of the databases that changed
+   Queue<uint32> _dbIndices;  // if (_isDelta) is true, this holds the database index of each entry in (_dbis)
 };
 DECLARE_REFTYPES(PZGBeaconData);
 
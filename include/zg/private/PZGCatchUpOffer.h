@@ -0,0 +1,79 @@
+#ifndef PZGCatchUpOffer_h
+#define PZGCatchUpOffer_h
+
+#include "zg/private/PZGConstants.h"
+#include "zg/private/PZGDatabaseStateInfo.h"
+#include "util/Queue.h"
+#include "util/TimeUtilityFunctions.h"
+
+namespace zg_private
+{
+
+static const uint64 PZG_CATCH_UP_OFFER_INTERVAL_MICROS     = SecondsToMicros(1);                     // how often each peer multicasts its catch-up offer
+static const uint64 PZG_CATCH_UP_OFFER_MAX_AGE_MICROS      = PZG_CATCH_UP_OFFER_INTERVAL_MICROS*3;   // offers older than this are ignored
+static const uint64 PZG_CATCH_UP_COST_PER_QUEUED_MESSAGE   = 1000;  // microseconds of latency we consider equivalent to one Message waiting in a peer's outgoing queues
+
+/** This class holds the most recent catch-up offer we received from another peer.  Every peer periodically
+  * advertises which database updates it can resend (and how busy it currently is), so that a junior peer that
+  * has fallen behind can back-fill from whichever up-to-date peer is closest and least loaded, rather than
+  * having to get everything from the senior peer.
+  */
+class PZGCatchUpOffer
+{
+public:
+   /** Default constructor */
+   PZGCatchUpOffer() : _load(0), _receiveTime(0) {/* empty */}
+
+   /** Constructor
+     * @param dbis For each database, the state that database is in on the offering peer, and the oldest update still in its update-log.
+     * @param load the number of Messages the offering peer currently has waiting in its outgoing TCP queues
+     * @param receiveTime the local time at which we received this offer
+     */
+   PZGCatchUpOffer(const Queue<PZGDatabaseStateInfo> & dbis, uint32 load, uint64 receiveTime) : _dbis(dbis), _load(load), _receiveTime(receiveTime) {/* empty */}
+
+   /** Returns true iff the offering peer can resend the first of the specified updates, and also writes into (lastUpdateID)
+     * the ID of the last update in the range that it can resend.
+     * @param whichDB index of the database we need updates for
+     * @param firstUpdateID ID of the first update we need
+     * @param lastUpdateID on entry, the ID of the last update we need.  On successful return, it may have been reduced
+     *                     to the ID of the last update the offering peer has.
+     */
+   MUSCLE_NODISCARD bool CanResendUpdates(uint32 whichDB, uint64 firstUpdateID, uint64 & lastUpdateID) const
+   {
+      if (_dbis.IsIndexValid(whichDB) == false) return false;
+
+      const PZGDatabaseStateInfo & dbi = _dbis[whichDB];
+      if ((firstUpdateID < dbi.GetOldestDatabaseIDInLog())||(firstUpdateID > dbi.GetCurrentDatabaseStateID())) return false;
+      lastUpdateID = muscleMin(lastUpdateID, dbi.GetCurrentDatabaseStateID());
+      return true;
+   }
+
+   /** Returns true iff the offering peer can send us its full database state, and that state is at least as new as we need.
+     * @param whichDB index of the database we need
+     * @param minimumStateID the oldest database state that would be useful to us
+     */
+   MUSCLE_NODISCARD bool CanResendFullDatabase(uint32 whichDB, uint64 minimumStateID) const
+   {
+      if (_dbis.IsIndexValid(whichDB) == false) return false;
+
+      const uint64 stateID = _dbis[whichDB].GetCurrentDatabaseStateID();
+      return ((stateID > 0)&&(stateID >= minimumStateID));
+   }
+
+   /** Returns the state ID the offering peer's copy of the specified database was in, or 0 if that isn't known.
+     * @param whichDB index of the database to inquire about
+     */
+   MUSCLE_NODISCARD uint64 GetDatabaseStateID(uint32 whichDB) const {return _dbis.IsIndexValid(whichDB) ? _dbis[whichDB].GetCurrentDatabaseStateID() : 0;}
+
+   MUSCLE_NODISCARD uint32 GetLoad()        const {return _load;}
+   MUSCLE_NODISCARD uint64 GetReceiveTime() const {return _receiveTime;}
+
+private:
+   Queue<PZGDatabaseStateInfo> _dbis;
+   uint32 _load;
+   uint64 _receiveTime;
+};
+
+}  // end namespace zg_private
+
+#endif
@@ -16,6 +16,20 @@ enum {
    PZG_PEER_COMMAND_UPDATE_JUNIOR_DATABASE,   // contains a PZGDatabaseUpdate object which will handle all cases
    PZG_PEER_COMMAND_USER_MESSAGE,             // contains an arbitrary user-specified Message
    PZG_PEER_COMMAND_USER_TEXT_MESSAGE,        // eg for "all peers echo hi"
+   PZG_PEER_COMMAND_UPDATE_JUNIOR_DATABASE_GROUP, // payload of a group-commit database update:  holds the junior-update Messages, in execution order
+   PZG_PEER_COMMAND_CATCH_UP_OFFER,           // multicast periodically by every peer, to advertise which database updates it can resend to junior peers that need them
+   PZG_PEER_COMMAND_DATABASE_REPAIR_REQUEST,  // sent by a junior peer whose database has diverged from the senior peer's, to compare (part of) it with the senior peer's
+   PZG_PEER_COMMAND_DATABASE_REPAIR_REPLY,    // the senior peer's answer to a PZG_PEER_COMMAND_DATABASE_REPAIR_REQUEST
+   PZG_PEER_COMMAND_APPLIED_STATE_REPORT,     // sent by a junior peer to the senior peer:  the state IDs its databases are currently in (see ZGPeerSettings::SetUpdateAcknowledgementsEnabled())
+   PZG_PEER_COMMAND_UPDATE_ACKNOWLEDGED,      // sent by the senior peer to a requesting peer when its acknowledged update has been applied on enough peers (or has failed)
+};
+
+// Command codes used when a database's worker thread forwards a call to the main thread (see ZGPeerSettings::SetDatabaseWorkerThreadsEnabled())
+enum {
+   PZG_WORKER_CALL_SEND_TO_SENIOR_PEER = 2054646627, // 'zwkc'
+   PZG_WORKER_CALL_SEND_UNICAST_TO_PEER,
+   PZG_WORKER_CALL_SEND_UNICAST_TO_ALL_PEERS,
+   PZG_WORKER_CALL_SEND_MULTICAST_TO_ALL_PEERS,
 };
 
 extern const String PZG_PEER_NAME_USER_MESSAGE;
@@ -25,6 +39,13 @@ extern const String PZG_PEER_NAME_DATABASE_UPDATE_ID;
 extern const String PZG_PEER_NAME_TEXT;
 extern const String PZG_PEER_NAME_CHECKSUM_MISMATCH;
 extern const String PZG_PEER_NAME_BACK_ORDER;
+extern const String PZG_PEER_NAME_PEER_ID;
+extern const String PZG_PEER_NAME_SEND_TO_SELF;
+extern const String PZG_PEER_NAME_DATABASE_STATE_INFO;
+extern const String PZG_PEER_NAME_LOAD;
+extern const String PZG_PEER_NAME_REQUEST_TIME;
+extern const String PZG_PEER_NAME_ACK_ID;
+extern const String PZG_PEER_NAME_NUM_PEERS;
 
 // This is a special/magic database-update-ID value that represents a request for a resend of the entire database
 #define DATABASE_UPDATE_ID_FULL_UPDATE ((uint64)-1)
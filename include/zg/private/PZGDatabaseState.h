@@ -1,10 +1,16 @@
 #ifndef PZGDatabaseState_h
 #define PZGDatabaseState_h
 
+#include "zg/ZGLatencyHistogram.h"
 #include "zg/private/PZGNameSpace.h"
 #include "zg/private/PZGDatabaseStateInfo.h"
 #include "zg/private/PZGDatabaseUpdate.h"
+#include "zg/private/PZGDatabaseWorkerSession.h"
+#include "zg/private/PZGPersistentUpdateLog.h"
+#include "zg/private/PZGSnapshotWriterSession.h"
+#include "zg/private/PZGUpdateAckRequest.h"
 #include "zg/private/PZGUpdateBackOrderKey.h"
+#include "zg/private/PZGUpdateLog.h"
 #include "util/NestCount.h"
 #include "util/PulseNode.h"
 
@@ -19,41 +25,139 @@ class ZGPeerSession;
 namespace zg_private
 {
 
+/** An update-request that the senior peer has deferred executing because a junior peer is lagging too far behind (see ZGPeerSettings::SetMaximumJuniorLagForDatabase()) */
+class PZGDeferredUpdateRequest
+{
+public:
+   PZGDeferredUpdateRequest() : _receiveTime(0) {/* empty */}
+   PZGDeferredUpdateRequest(const ZGPeerID & fromPeerID, const ConstMessageRef & msg, uint64 receiveTime) : _fromPeerID(fromPeerID), _msg(msg), _receiveTime(receiveTime) {/* empty */}
+
+   MUSCLE_NODISCARD const ZGPeerID & GetFromPeerID() const {return _fromPeerID;}
+   MUSCLE_NODISCARD const ConstMessageRef & GetMessage() const {return _msg;}
+   MUSCLE_NODISCARD uint64 GetReceiveTime() const {return _receiveTime;}
+
+private:
+   ZGPeerID _fromPeerID;
+   ConstMessageRef _msg;
+   uint64 _receiveTime;   // network-time at which we received the request
+};
+
+/** Keeps track of which kind of database update (if any) one thread is currently executing for a PZGDatabaseState.
+  * The main thread and the database's worker thread each have their own, so that neither thread ever reads the other's.
+  */
+class PZGDatabaseUpdateContext
+{
+public:
+   PZGDatabaseUpdateContext() : _seniorUpdateTimeForJuniorUpdate(0) {/* empty */}
+
+   MUSCLE_NODISCARD NestCount & GetJuniorUpdateNestCount() {return _inJuniorDatabaseUpdate;}
+   MUSCLE_NODISCARD NestCount & GetSeniorUpdateNestCount() {return _inSeniorDatabaseUpdate;}
+
+   MUSCLE_NODISCARD bool IsInJuniorDatabaseUpdate() const {return _inJuniorDatabaseUpdate.IsInBatch();}
+   MUSCLE_NODISCARD bool IsInSeniorDatabaseUpdate() const {return _inSeniorDatabaseUpdate.IsInBatch();}
+
+   void SetSeniorUpdateTimeForJuniorUpdate(uint64 t) {_seniorUpdateTimeForJuniorUpdate = t;}
+   MUSCLE_NODISCARD uint64 GetSeniorUpdateTimeForJuniorUpdate() const {return _seniorUpdateTimeForJuniorUpdate;}
+
+private:
+   NestCount _inJuniorDatabaseUpdate;
+   NestCount _inSeniorDatabaseUpdate;
+   uint64 _seniorUpdateTimeForJuniorUpdate;  // only meaningful while we're inside JuniorExecuteDatabaseUpdateAux()
+};
+
 /** This class represents the current state of a single replicated database.  */
 class PZGDatabaseState : public PulseNode
 {
 public:
    PZGDatabaseState();
 
-   void SetParameters(ZGPeerSession * master, uint32 whichDatabase, uint64 maxPayloadBytesInLog);
+   void SetParameters(ZGPeerSession * master, uint32 whichDatabase, uint64 maxPayloadBytesInLog, uint64 groupCommitWindowMicros, uint8 payloadCompressionLevel);
 
    status_t HandleDatabaseUpdateRequest(const ZGPeerID & fromPeerID, const ConstMessageRef & msg, const ConstPZGDatabaseUpdateRef & optDBUp, const INetworkTimeProvider & networkTimeProvider);
 
-   MUSCLE_NODISCARD virtual uint64 GetPulseTime(const PulseArgs & args) {return muscleMin(_rescanLogPending?0:MUSCLE_TIME_NEVER, PulseNode::GetPulseTime(args));}
+   MUSCLE_NODISCARD virtual uint64 GetPulseTime(const PulseArgs & args) {return muscleMin((_rescanLogPending||IsSnapshotDue()||_deferredUpdateRequestsCheckPending)?0:MUSCLE_TIME_NEVER, muscleMin(_groupCommitDeadline, _backOrderHoldoffDeadline, GetRepublishPulseTime()), PulseNode::GetPulseTime(args));}
    virtual void Pulse(const PulseArgs & args);
 
    void PrintDatabaseStateInfo() const;
    void PrintDatabaseUpdateLog() const;
+   void PrintUpdateLatencyStats() const;
+
+   /** Returns the latency histograms we've recorded for the updates executed on this database so far */
+   MUSCLE_NODISCARD const ZGUpdateLatencyStats & GetUpdateLatencyStats() const {return _latencyStats;}
+
+   /** Clears our latency histograms */
+   void ResetUpdateLatencyStats() {_latencyStats.Reset();}
 
    PZGDatabaseStateInfo GetDatabaseStateInfo() const;
 
+   /** Returns the info we should advertise in our catch-up offer:  our current state ID, and the oldest update
+     * ID from which our update-log is contiguous up to that state.  If our local state can't be trusted yet
+     * (e.g. it hasn't been verified against the senior peer, or we're waiting for a full resend), the returned
+     * info will indicate that we can't resend anything.
+     */
+   PZGDatabaseStateInfo GetCatchUpOfferInfo() const;
+
+   /** Returns true iff our local copy of this database has been verified against the senior peer's, and is
+     * at least as up-to-date as the senior peer's most recently advertised state.  Always returns true on the senior peer.
+     */
+   MUSCLE_NODISCARD bool IsCaughtUpWithSeniorPeer() const;
+
    void SeniorDatabaseStateInfoChanged(const PZGDatabaseStateInfo & seniorDBInfo);
 
+   /** Called on the senior peer when a junior peer has reported the state ID its copy of this database is currently in.
+     * Sends out any update-acknowledgements that the report has made due.
+     * @param fromPeerID ID of the junior peer that sent the report
+     * @param appliedStateID the state ID the junior peer's database is in
+     */
+   void AppliedStateReportReceived(const ZGPeerID & fromPeerID, uint64 appliedStateID);
+
+   /** Called when a peer has gone offline, so that we won't wait for it to acknowledge any more updates.
+     * @param peerID ID of the peer that went offline
+     */
+   void PeerHasGoneOffline(const ZGPeerID & peerID);
+
+   /** Called when the senior peer has changed.  Discards our update-acknowledgement state, since it is only
+     * meaningful on the senior peer that received the requests (the requesting peers will fail them on their end).
+     */
+   void SeniorPeerChanged();
+
    void ScheduleLogContentsRescan();
    void RescanUpdateLogIfNecessary();
 
    void BackOrderResultReceived(const PZGUpdateBackOrderKey & ubok, const ConstPZGDatabaseUpdateRef & optUpdateData);
-   ConstPZGDatabaseUpdateRef GetDatabaseUpdateByID(uint64 updateID, const INetworkTimeProvider & networkTimeProvider) const;
+
+   /** Called on the senior peer when a junior peer has sent us a PZG_PEER_COMMAND_DATABASE_REPAIR_REQUEST for this database.
+     * @param fromPeerID ID of the junior peer that sent the request
+     * @param msg the request Message
+     */
+   void DatabaseRepairRequestReceived(const ZGPeerID & fromPeerID, const ConstMessageRef & msg);
+
+   /** Called on a junior peer when the senior peer has answered our PZG_PEER_COMMAND_DATABASE_REPAIR_REQUEST for this database.
+     * @param fromPeerID ID of the peer that sent the answer
+     * @param msg the PZG_PEER_COMMAND_DATABASE_REPAIR_REPLY Message
+     */
+   void DatabaseRepairReplyReceived(const ZGPeerID & fromPeerID, const ConstMessageRef & msg);
+
+   ConstPZGDatabaseUpdateRef GetDatabaseUpdateByID(uint64 updateID) const {return _updateLog.GetWithDefault(updateID);}
+
+   /** Returns a PZGDatabaseUpdate (of type PZG_DATABASE_UPDATE_TYPE_REPLACE) holding our database's full current state.
+     * @param networkTimeProvider used to timestamp the returned update
+     * @param allowSnapshot if true, we'll try to save the database's state via SaveLocalDatabaseToSnapshot() first.
+     * @param retIsSnapshot on return, set to true iff the returned update's payload is a snapshot, i.e. if it's safe
+     *                      to flatten the returned update from another thread.
+     */
+   ConstPZGDatabaseUpdateRef GetFullDatabaseUpdate(const INetworkTimeProvider & networkTimeProvider, bool allowSnapshot, bool & retIsSnapshot);
    ConstMessageRef GetDatabaseUpdatePayloadByID(uint64 updateID) const;
 
    MUSCLE_NODISCARD bool IsInJuniorDatabaseUpdateContext(uint64 * optRetSeniorNetworkTime64) const
    {
-      const bool ret = _inJuniorDatabaseUpdate.IsInBatch();
-      if (optRetSeniorNetworkTime64) *optRetSeniorNetworkTime64 = ret ? _seniorUpdateTimeForJuniorUpdate : 0;
+      const PZGDatabaseUpdateContext & context = GetUpdateContextForCallingThread();
+      const bool ret = context.IsInJuniorDatabaseUpdate();
+      if (optRetSeniorNetworkTime64) *optRetSeniorNetworkTime64 = ret ? context.GetSeniorUpdateTimeForJuniorUpdate() : 0;
       return ret;
    }
 
-   MUSCLE_NODISCARD bool IsInSeniorDatabaseUpdateContext() const {return _inSeniorDatabaseUpdate.IsInBatch();}
+   MUSCLE_NODISCARD bool IsInSeniorDatabaseUpdateContext() const {return GetUpdateContextForCallingThread().IsInSeniorDatabaseUpdate();}
 
    MUSCLE_NODISCARD bool UpdateLogContainsUpdate(uint64 tid) const {return _updateLog.ContainsKey(tid);}
    MUSCLE_NODISCARD uint64 GetCurrentDatabaseStateID() const {return _localDatabaseStateID;}
@@ -61,46 +165,273 @@ public:
    void ResetLocalDatabaseToDefaultState();
    void VerifyOrFixLocalDatabaseChecksum();
 
+   /** If we have a group-commit in progress, closes it and adds it to our update-log now. */
+   void CommitPendingGroupUpdate();
+
+   /** Tells this database to keep a copy of its state on disk, in the specified directory.
+     * @param dirPath the directory to keep our files in, or an empty string to disable persistence.
+     * @param updatesPerSnapshot how many updates to append to our on-disk log before writing a new snapshot.
+     */
+   void SetPersistenceParameters(const String & dirPath, uint32 updatesPerSnapshot);
+
+   /** Tells this database how far junior peers may lag behind the senior peer before the senior peer starts deferring update-requests.
+     * @param maxLagUpdates maximum number of updates a junior peer may lag by, or MUSCLE_NO_LIMIT
+     * @param maxLagBytes maximum number of update-payload bytes a junior peer may lag by, or MUSCLE_NO_LIMIT
+     */
+   void SetFlowControlParameters(uint64 maxLagUpdates, uint64 maxLagBytes) {_maxJuniorLagUpdates = maxLagUpdates; _maxJuniorLagBytes = maxLagBytes;}
+
+   /** Called on the senior peer:  Returns how far the specified junior peer's copy of this database is lagging behind ours.
+     * @param peerID ID of the junior peer to inquire about
+     * @param retLagUpdates on success, the number of updates the junior peer hasn't applied yet is written here
+     * @param retLagBytes on success, the number of update-payload bytes the junior peer hasn't applied yet is written here
+     * @returns B_NO_ERROR on success, or B_DATA_NOT_FOUND if that peer hasn't reported its state to us.
+     */
+   status_t GetJuniorPeerLag(const ZGPeerID & peerID, uint64 & retLagUpdates, uint64 & retLagBytes) const;
+
+   /** Returns the number of update-requests we are currently deferring because a junior peer is lagging too far behind */
+   MUSCLE_NODISCARD uint32 GetNumDeferredUpdateRequests() const {return _deferredUpdateRequests.GetNumItems();}
+
+   void PrintJuniorPeerLags() const;
+
+   /** Returns the total number of payload-bytes currently held in our update-log */
+   MUSCLE_NODISCARD uint64 GetUpdateLogPayloadBytes() const {return _totalPayloadBytesInLog;}
+
+   /** Called when the update-logs of all databases share a single memory budget (see ZGPeerSettings::SetSharedUpdateLogBudget()):
+     * Describes how costly it would be to evict the oldest update from our update-log.
+     * @param now the current network-time, in microseconds
+     * @param retLikelyNeeded on return, set to true iff some online peer is still likely to need that update
+     * @param retWeight on return, set to a weight that grows with the update's age and payload size (higher means cheaper to evict)
+     * @returns true iff we have an update that may be evicted, or false if we don't.
+     */
+   MUSCLE_NODISCARD bool GetEvictionCandidate(uint64 now, bool & retLikelyNeeded, double & retWeight) const;
+
+   /** Removes the oldest update from our update-log.  Should only be called after GetEvictionCandidate() has returned true. */
+   void EvictOldestUpdate() {RemoveDatabaseUpdateFromUpdateLog(_updateLog.GetFirstValue());}
+
+   /** Called when a junior peer's back-order request for an individual update has been looked up in our update-log.
+     * @param wasInUpdateLog true iff the requested update was found in our update-log (i.e. the back-order could be served)
+     */
+   void BackOrderLookupCompleted(bool wasInUpdateLog) {if (wasInUpdateLog) _backOrderHits++; else _backOrderMisses++;}
+
+   /** Returns the number of back-order requests for individual updates that we were able to serve from our update-log */
+   MUSCLE_NODISCARD uint64 GetNumBackOrderHits() const {return _backOrderHits;}
+
+   /** Returns the number of back-order requests for individual updates that we couldn't serve, because the update was no longer in our update-log */
+   MUSCLE_NODISCARD uint64 GetNumBackOrderMisses() const {return _backOrderMisses;}
+
+   /** Loads our most recent on-disk snapshot (if any) into our local database, and replays the on-disk update-log on top of it.
+     * Should be called at startup, right after ResetLocalDatabaseToDefaultState().
+     */
+   void LoadPersistentState();
+
+   /** Tells this database to record every update it applies to disk (see ZGPeerSettings::SetUpdateRecordingDirectory()).
+     * @param dirPath the directory to write the recording into, or an empty string to disable recording.
+     */
+   void SetUpdateRecordingDirectory(const String & dirPath);
+
+   /** Writes the starting snapshot of our update-recording, if we are recording.  Should be called at startup, right after LoadPersistentState(). */
+   void StartUpdateRecording();
+
+   /** Replaces our local database's contents with the starting snapshot of an update-recording, and then applies
+     * each of the recording's updates to it, as fast as possible, via our junior-update code path.
+     * @param dirPath the directory the recording was written into
+     * @param verifyInterval if non-zero, our database's checksum will be recalculated from scratch (and verified) after
+     *                       every (verifyInterval) updates.  It is always recalculated and verified after the last update.
+     * @param retStats on return, statistics about the replay will have been added to this object.
+     * @returns B_NO_ERROR on success, or an error code if the recording couldn't be read or one of its updates couldn't be applied.
+     */
+   status_t ReplayUpdateRecording(const String & dirPath, uint32 verifyInterval, ZGUpdateReplayStats & retStats);
+
+   /** Tells this database to execute its updates in the specified worker thread (or in the main thread, if (workerSession) is a NULL reference) */
+   void SetWorkerSession(const PZGDatabaseWorkerSessionRef & workerSession) {_workerSession = workerSession;}
+
+   /** Ends our worker session (if we have one), blocking until its thread has exited. */
+   void ShutdownWorkerSession();
+
+   /** Tells this database to write its on-disk snapshots in the specified helper thread (or in the main thread, if (writerSession) is a NULL reference) */
+   void SetSnapshotWriterSession(const PZGSnapshotWriterSessionRef & writerSession) {_snapshotWriterSession = writerSession;}
+
+   /** Ends our snapshot-writer session (if we have one), blocking until its thread has written any snapshots it was given and exited. */
+   void ShutdownSnapshotWriterSession();
+
+   /** Called by our PZGSnapshotWriterSession when it has finished writing a snapshot to disk.
+     * @param stateID the state ID of the snapshot that was written
+     * @param result B_NO_ERROR if the snapshot is now safely on disk, or an error code if it couldn't be written.
+     */
+   void PersistentSnapshotWritten(uint64 stateID, status_t result);
+
+   /** Returns true iff this method is being called from within this database's worker thread. */
+   MUSCLE_NODISCARD bool IsCallerWorkerThread() const {return (PZGDatabaseWorkerSession::GetDatabaseStateForCallingThread() == this);}
+
+   /** Called from within our worker thread:  Passes the specified call back to the main thread, for the ZGPeerSession to execute there.
+     * @param callCode one of the PZG_WORKER_CALL_* values
+     * @param internalMsg the Message argument of the call
+     * @param optPeerID the peer ID argument of the call, if any
+     * @param sendToSelf the send-to-self argument of the call, if any
+     */
+   status_t ForwardCallToMainThread(uint32 callCode, const ConstMessageRef & internalMsg, const ZGPeerID & optPeerID, bool sendToSelf);
+
+   /** Called from within our worker thread:  Executes the specified job and returns a Message describing the results.
+     * Never returns a NULL reference, since the main thread waits for a reply to every job it sends (see DrainWorkerThread()).
+     */
+   MessageRef WorkerThreadExecuteJob(const MessageRef & jobMsg);
+
+   /** Called in the main thread, when our worker thread has sent us a Message. */
+   void WorkerThreadMessageReceived(const MessageRef & msg);
+
 private:
    void RescanUpdateLog();
+   MUSCLE_NODISCARD bool IsMulticastRepairGracePeriodOver();  // returns true iff missing updates have been missing long enough that we should back-order them
+   void TrimUpdateLog();
+   MUSCLE_NODISCARD bool IsOldestUpdateEvictable() const;
+   MUSCLE_NODISCARD bool IsUpdateLikelyNeededByAnyPeer(uint64 updateID) const;
    status_t AddDatabaseUpdateToUpdateLog(const ConstPZGDatabaseUpdateRef & dbUp);
    void RemoveDatabaseUpdateFromUpdateLog(const ConstPZGDatabaseUpdateRef & dbUp);
    void ClearUpdateLog();
-   void SeniorUpdateCompleted(const PZGDatabaseUpdateRef & dbUp, uint64 startTime, const ConstMessageRef & payloadMsg, const INetworkTimeProvider & networkTimeProvider);
+   void SeniorUpdateCompleted(const PZGDatabaseUpdateRef & dbUp, uint64 requestTime, uint64 receiveTime, uint64 startTime, uint64 elapsedMicros, const ConstMessageRef & payloadMsg, const INetworkTimeProvider & networkTimeProvider);
+   status_t ExecuteDatabaseUpdateRequest(const ZGPeerID & fromPeerID, const ConstMessageRef & msg, const ConstPZGDatabaseUpdateRef & optDBUp, uint64 receiveTime, const INetworkTimeProvider & networkTimeProvider);
+   status_t HandleDatabaseUpdateRequestAux(const ZGPeerID & fromPeerID, const ConstMessageRef & msg, const ConstPZGDatabaseUpdateRef & optDBUp, const PZGUpdateAckRequest & ackReq, uint64 receiveTime, const INetworkTimeProvider & networkTimeProvider);
+   status_t SeniorGroupUpdateLocalDatabase(const ZGPeerID & fromPeerID, const ConstMessageRef & userDBUpdateMsg, uint64 requestTime, uint64 receiveTime, const PZGUpdateAckRequest & ackReq);
+   void AddUpdateToGroupCommit(const ZGPeerID & fromPeerID, const ConstMessageRef & juniorMsg, uint64 requestTime, uint64 receiveTime, const PZGUpdateAckRequest & ackReq, uint64 preUpdateDBChecksum, uint64 startTime, uint64 elapsedMicros);
+   void RecordSeniorUpdateLatencies(const PZGDatabaseUpdate & dbUp);
+   void RecordJuniorUpdateLatencies(const PZGDatabaseUpdate & dbUp);
+   void DiscardUnpublishedSeniorUpdates(uint32 numUpdates);
+
+   // These methods publish our senior database's full state, when it contains changes that couldn't be published as updates
+   void ScheduleSeniorDatabaseRepublish(uint64 publishedDBChecksum, uint32 numUpdates);
+   void AddRepublishAckRequest(const PZGUpdateAckRequest & ackReq);
+   status_t RepublishSeniorDatabaseIfPending();
+   status_t PublishSeniorDatabaseState();
+   MUSCLE_NODISCARD bool IsRepublishPending() const {return (_numUnpublishedSeniorUpdates > 0);}
+   MUSCLE_NODISCARD uint64 GetRepublishPulseTime() const {return ((IsRepublishPending())&&(GetNumWorkerJobsInFlight() == 0)) ? _republishRetryTime : MUSCLE_TIME_NEVER;}
+
+   // These methods implement update-acknowledgements on the senior peer (see ZGPeerSettings::SetUpdateAcknowledgementsEnabled())
+   void RegisterUpdateAck(const PZGUpdateAckRequest & ackReq, uint64 updateID);
+   void SendUpdateAck(const PZGUpdateAckRequest & ackReq, uint64 updateID, uint32 numPeersApplied);  // (updateID) of 0 indicates failure
+   void CheckPendingUpdateAcks();
+   MUSCLE_NODISCARD uint32 GetNumPeersThatHaveApplied(uint64 updateID) const;
+
+   // These methods implement flow-control on the senior peer (see ZGPeerSettings::SetMaximumJuniorLagForDatabase())
+   MUSCLE_NODISCARD bool IsFlowControlEnabled() const {return ((_maxJuniorLagUpdates != MUSCLE_NO_LIMIT)||(_maxJuniorLagBytes != MUSCLE_NO_LIMIT));}
+   MUSCLE_NODISCARD bool IsJuniorLagExcessive() const;
+   MUSCLE_NODISCARD uint64 GetSeniorTargetStateID() const {return _localDatabaseStateID+_numSeniorWorkerJobsInFlight+(_groupCommitPayload()?1:0);}
+   MUSCLE_NODISCARD uint64 GetPayloadBytesSince(uint64 stateID, uint64 maxBytes) const;  // stops counting once the total exceeds (maxBytes)
+   void ProcessDeferredUpdateRequests();
+   void PersistDatabaseUpdate(const PZGDatabaseUpdate & dbUp);
+   void WritePersistentSnapshot();
+   void DiscardRestoredState();
+   void RecordDatabaseUpdate(const PZGDatabaseUpdate & dbUp);
+   void StopUpdateRecording(const char * why);
+   status_t VerifyReplayedDatabaseChecksum(ZGUpdateReplayStats & retStats);
+   MUSCLE_NODISCARD bool IsGroupCommitEnabled() const {return (_groupCommitWindowMicros != MUSCLE_TIME_NEVER);}
 
-   status_t RequestBackOrderFromSeniorPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError);
+   status_t RequestBackOrderFromPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError);
+   status_t RequestBackOrderRangeFromPeer(const ZGPeerID & sourcePeerID, uint64 firstUpdateID, uint64 lastUpdateID);
+   MUSCLE_NODISCARD bool IsUpdateOnBackOrder(uint64 updateID) const;
+   MUSCLE_NODISCARD bool IsUpdateMissingAndNotOnBackOrder(uint64 updateID) const {return ((_updateLog.ContainsKey(updateID) == false)&&(IsUpdateOnBackOrder(updateID) == false));}
+   MUSCLE_NODISCARD uint64 GetMinimumUsefulFullResendStateID() const;
    MUSCLE_NODISCARD uint64 GetTargetDatabaseStateID() const {return muscleMax(_updateLog.GetLastKeyWithDefault(), _seniorDatabaseStateID);}
    MUSCLE_NODISCARD bool IsDatabaseUpdateStillNeededToAdvanceJuniorPeerState(uint64 databaseUpdateID) const;
 
    status_t JuniorExecuteDatabaseReplace(const PZGDatabaseUpdate & dbUp);
    status_t JuniorExecuteDatabaseUpdate(const PZGDatabaseUpdate & dbUp);
-   status_t JuniorExecuteDatabaseUpdateAux(const PZGDatabaseUpdate & dbUp);
+   status_t JuniorVerifyAndExecuteDatabaseUpdate(const PZGDatabaseUpdate & dbUp, uint64 & dbChecksum);
+   status_t JuniorExecuteDatabaseUpdateAux(const PZGDatabaseUpdate & dbUp, uint64 & dbChecksum);
    void JuniorPeerNeedsMissingUpdate(uint64 missingStateID);
-   status_t RequestFullDatabaseResendFromSeniorPeer(bool dueToChecksumError);
+   status_t RequestFullDatabaseResend(bool dueToChecksumError);
    MUSCLE_NODISCARD bool IsAwaitingFullDatabaseResendReply() const;
 
+   // These methods let a junior peer repair just the diverged parts of its database, rather than downloading the whole thing
+   status_t RequestDatabaseRepair();
+   status_t StartDatabaseRepairPass();
+   status_t SendDatabaseRepairRequest(const ConstMessageRef & repairRequestMsg);
+   void DatabaseRepairFailed(const char * why);
+   MUSCLE_NODISCARD bool IsDatabaseRepairInProgress() const;
+
+   status_t SendJobToWorkerThread(uint32 whatCode, const ZGPeerID & fromPeerID, const ConstMessageRef & optUserMsg, const ConstPZGDatabaseUpdateRef & optDBUp, uint64 requestTime = 0, uint64 receiveTime = 0, const PZGUpdateAckRequest & ackReq = PZGUpdateAckRequest());
+   void SeniorWorkerJobCompleted(const MessageRef & resultMsg);
+   void JuniorWorkerJobCompleted(const MessageRef & resultMsg);
+   void WorkerJobFinished();
+   void DrainWorkerThread();
+   void PrintLocalDatabaseContents(const char * desc) const;
+   MUSCLE_NODISCARD uint32 GetNumWorkerJobsInFlight() const {return _numSeniorWorkerJobsInFlight+_numJuniorWorkerJobsInFlight;}
+   MUSCLE_NODISCARD bool MustWaitForWorkerThread(const Message & requestMsg) const;
+   MUSCLE_NODISCARD bool IsSnapshotDue() const {return ((_snapshotPending)&&(_snapshotWriteInFlight == false)&&(GetNumWorkerJobsInFlight() == 0));}  // we won't block waiting for our worker thread just to write a snapshot
+   MUSCLE_NODISCARD const PZGDatabaseUpdateContext & GetUpdateContextForCallingThread() const {return IsCallerWorkerThread() ? _workerThreadUpdateContext : _mainThreadUpdateContext;}
+   MUSCLE_NODISCARD       PZGDatabaseUpdateContext & GetUpdateContextForCallingThread()       {return IsCallerWorkerThread() ? _workerThreadUpdateContext : _mainThreadUpdateContext;}
+   MUSCLE_NODISCARD uint64 GetJuniorDispatchedStateID() const {return (_numJuniorWorkerJobsInFlight > 0) ? _workerTargetStateID : _localDatabaseStateID;}
+
    ZGPeerSession * _master;
    uint32 _whichDatabase;
 
-   OrderedKeysHashtable<uint64, ConstPZGDatabaseUpdateRef> _updateLog;  // update ID -> update date, for recent updates
+   PZGUpdateLog _updateLog;          // update ID -> update data, for recent updates
    uint64 _maxPayloadBytesInLog;     // we should start trimming the log when (_totalPayloadBytesInLog > _maxPayloadBytesInLog)
+   uint8 _payloadCompressionLevel;   // zlib compression level to use for the payloads of the updates we create
    uint64 _totalPayloadBytesInLog;   // always set to be equal to the total number of message-bytes in the log
    uint64 _totalElapsedMillisInLog;  // always set to be equal to the total milliseconds of all updates currently in the _updateLog
    uint64 _localDatabaseStateID;     // ID of the state our own local copy of the database is currently in
    uint64 _seniorDatabaseStateID;    // the senior peer's current database state ID (according to the most recent beacon packet we received from him)
    uint64 _seniorOldestIDInLog;      // the lowest database state update ID that the senior peer still has in his update log
    bool _seniorDatabaseStateReceived;  // true iff we've received at least one beacon (used by juniors only)
-   uint32 _dbChecksum;               // running checksum of the contents of this database
+   uint64 _dbChecksum;               // running checksum of the contents of this database
    uint64 _firstUnsentUpdateID;      // ID of the first update in our log that we haven't sent out to multicast yet
    bool _rescanLogPending;           // dirty-flag, true iff the _updateLog's contents have changed and we need to act on the new contents
    bool _printDatabaseStatesComparisonOnNextReplace;  // for easier debugging
 
-   Hashtable<PZGUpdateBackOrderKey, Void> _backorders;  // update-resends we have on order from the senior peer
+   Hashtable<uint64, ZGPeerID> _backorders;  // update ID (or DATABASE_UPDATE_ID_FULL_UPDATE) -> ID of the peer we have that update on back-order from
+   uint64 _missingUpdatesNoticedTime;        // run-time at which we noticed that the next update we need is missing from our log, or 0 if it isn't
+   uint64 _backOrderHoldoffDeadline;         // run-time at which we should rescan our log to back-order any still-missing updates, or MUSCLE_TIME_NEVER
 
-   NestCount _inJuniorDatabaseUpdate;
-   NestCount _inSeniorDatabaseUpdate;
+   PZGDatabaseUpdateContext _mainThreadUpdateContext;
+   PZGDatabaseUpdateContext _workerThreadUpdateContext;  // only ever accessed from within our worker thread
+
+   uint64 _groupCommitWindowMicros;          // MUSCLE_TIME_NEVER if group-commit mode is disabled for this database
+   MessageRef _groupCommitPayload;           // junior-update Messages of the group-commit currently in progress (NULL if there isn't one)
+   ZGPeerID _groupCommitSourcePeerID;        // ID of the peer that requested the first update in the current group
+   uint64 _groupCommitPreUpdateDBChecksum;   // our database's checksum as it was before the first update in the current group
+   uint64 _groupCommitRequestTime;           // network-time at which the first update in the current group was requested
+   uint64 _groupCommitReceiveTime;           // network-time at which we received the request for the first update in the current group
+   uint64 _groupCommitStartTime;             // run-time at which the first update in the current group was executed
+   uint64 _groupCommitElapsedMicros;         // total time spent executing the updates in the current group
+   uint64 _groupCommitDeadline;              // run-time at which the current group should be committed, or MUSCLE_TIME_NEVER
+   Queue<PZGUpdateAckRequest> _groupCommitAckRequests;  // acknowledgement-requests of the updates in the current group
+
+   uint32 _numUnpublishedSeniorUpdates;      // number of executed senior updates that couldn't be published, and will be published as part of our full database state instead
+   uint64 _republishPreUpdateDBChecksum;     // the checksum of our last published state (i.e. of the junior peers' databases) while _numUnpublishedSeniorUpdates is non-zero
+   uint64 _republishRetryTime;               // run-time at which we should (re)try publishing our full database state
+   Queue<PZGUpdateAckRequest> _republishAckRequests;  // acknowledgement-requests of the unpublished updates
+
+   PZGDatabaseWorkerSessionRef _workerSession;  // non-NULL only if this database executes its updates in a worker thread
+   uint32 _numSeniorWorkerJobsInFlight;      // number of senior-update jobs our worker thread hasn't returned results for yet
+   uint32 _numJuniorWorkerJobsInFlight;      // number of junior-update jobs our worker thread hasn't returned results for yet
+   uint64 _workerTargetStateID;              // the state ID our database will be in after all in-flight junior-update jobs have completed
+   bool _workerJobFailed;                    // set when a junior-update job fails; the results of the remaining in-flight jobs are then ignored
+   uint64 _workerDBChecksum;                 // running checksum of this database, as seen by the worker thread (only the worker thread may access this while jobs are in flight)
+
+   PZGPersistentUpdateLogRef _persistentLog; // non-NULL only if we are keeping a copy of this database on disk
+   uint32 _updatesPerSnapshot;               // how many updates to append to our on-disk log before writing a new snapshot
+   bool _snapshotPending;                    // true iff our Pulse() method should write a new snapshot to disk
+   bool _snapshotWriteInFlight;              // true iff our snapshot-writer thread is currently writing a snapshot for us
+   PZGSnapshotWriterSessionRef _snapshotWriterSession;  // non-NULL only if this database's snapshots are written by a helper thread
+   bool _restoredStateUnverified;            // true iff our state was loaded from disk and hasn't yet been compared against the senior peer's
+   PZGPersistentUpdateLogRef _recordingLog;  // non-NULL only if we are recording the updates we apply (for later replay by a benchmark)
+
+   ZGPeerID _repairSourcePeerID;             // the senior peer we are currently repairing our database from, or invalid if we aren't doing a repair
+   uint32 _repairPassCount;                  // how many repair-passes we've completed so far without our database matching the senior peer's
+
+   ZGUpdateLatencyStats _latencyStats;       // per-stage latency histograms of the updates we've executed
+
+   Hashtable<ZGPeerID, uint64> _peerAppliedStateIDs;  // senior peer only:  junior peer ID -> the state ID that peer most recently reported being in
+   Queue<PZGUpdateAckRequest> _pendingUpdateAcks;     // senior peer only:  acknowledgement-requests of executed updates that haven't been applied on enough peers yet
+
+   uint64 _backOrderHits;                    // number of single-update back-orders we were able to serve from our update-log
+   uint64 _backOrderMisses;                  // number of single-update back-orders we couldn't serve because the update had already been trimmed from our update-log
 
-   uint64 _seniorUpdateTimeForJuniorUpdate;  // only meaningful when we're inside JuniorExecuteDatabaseUpdateAux()
+   uint64 _maxJuniorLagUpdates;              // we defer update-requests while a junior peer lags by more than this many updates (MUSCLE_NO_LIMIT if there's no limit)
+   uint64 _maxJuniorLagBytes;                // we defer update-requests while a junior peer lags by more than this many payload-bytes (MUSCLE_NO_LIMIT if there's no limit)
+   Queue<PZGDeferredUpdateRequest> _deferredUpdateRequests;  // senior peer only:  update-requests we'll execute once the lagging junior peers have caught up
+   NestCount _processingDeferredUpdateRequests;              // so that executing a deferred request can't cause the requests after it to be executed ahead of it
+   bool _deferredUpdateRequestsCheckPending;                 // true iff our next Pulse() should call ProcessDeferredUpdateRequests()
 };
 
 }  // end namespace zg_private
@@ -19,7 +19,7 @@ class PZGDatabaseStateInfo : public PseudoFlattenable<PZGDatabaseStateInfo>
 public:
    PZGDatabaseStateInfo();
    PZGDatabaseStateInfo(const PZGDatabaseStateInfo & stateInfo);
-   PZGDatabaseStateInfo(uint64 currentDatabaseID, uint64 oldestDatabaseIDInLog, uint32 dbChecksum);
+   PZGDatabaseStateInfo(uint64 currentDatabaseID, uint64 oldestDatabaseIDInLog, uint64 dbChecksum);
 
    PZGDatabaseStateInfo & operator=(const PZGDatabaseStateInfo & rhs);
 
@@ -35,7 +35,7 @@ public:
 
    MUSCLE_NODISCARD uint64 GetCurrentDatabaseStateID() const {return _currentDatabaseStateID;}
    MUSCLE_NODISCARD uint64 GetOldestDatabaseIDInLog()  const {return _oldestDatabaseIDInLog;}
-   MUSCLE_NODISCARD uint32 GetDBChecksum()             const {return _dbChecksum;}
+   MUSCLE_NODISCARD uint64 GetDBChecksum()             const {return _dbChecksum;}
 
    /** Calculates and returns a 32-bit checksum based on all the current contents of this object; not to be confused with the DBChecksum field! */
    MUSCLE_NODISCARD uint32 CalculateChecksum() const;
@@ -46,7 +46,7 @@ public:
 private:
    uint64 _currentDatabaseStateID; // ID of the state this database is currently in, on the machine that created this PZGDatabaseStateInfo
    uint64 _oldestDatabaseIDInLog;  // ID of the oldest database update that is still in the update log, on the machine that created this PZGDatabaseStateInfo
-   uint32 _dbChecksum;             // 32-bit checksum computed from the current state of the database
+   uint64 _dbChecksum;             // 64-bit checksum computed from the current state of the database
 };
 
 }  // end namespace zg_private
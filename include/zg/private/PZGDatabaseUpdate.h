@@ -14,9 +14,18 @@ enum {
    PZG_DATABASE_UPDATE_TYPE_RESET,    // resets the database's state to its well-known default state
    PZG_DATABASE_UPDATE_TYPE_REPLACE,  // fully replaces the database's state with the state contained in the attached data
    PZG_DATABASE_UPDATE_TYPE_UPDATE,   // uses the attached data to incrementally update the database's state
+   PZG_DATABASE_UPDATE_TYPE_GROUP_UPDATE, // like PZG_DATABASE_UPDATE_TYPE_UPDATE, but the attached data holds several incremental updates to apply in order
    NUM_PZG_DATABASE_UPDATE_TYPES,     // guard value
 };
 
+enum {
+   PZG_PAYLOAD_CODEC_ZLIB = 0,        // the payload is a zlib-deflated flattened Message (this is what older versions of ZG always sent)
+   PZG_PAYLOAD_CODEC_NONE,            // the payload is a flattened Message, uncompressed
+   NUM_PZG_PAYLOAD_CODECS,            // guard value
+};
+
+static const uint32 PZG_MIN_PAYLOAD_BYTES_TO_COMPRESS = 256;  // flattened payload Messages smaller than this are sent uncompressed, since compressing them wouldn't save much
+
 /** This class represents an update (full or incremental) to an existing database. */
 class PZGDatabaseUpdate : public FlatCountable
 {
@@ -36,27 +45,53 @@ public:
    MUSCLE_NODISCARD String ToString() const;
 
    MUSCLE_NODISCARD uint8 GetUpdateType()               const {return _updateType;}
+   MUSCLE_NODISCARD const char * GetUpdateTypeName()    const;  // returns a short human-readable name for our PZG_DATABASE_UPDATE_TYPE_* value
    MUSCLE_NODISCARD uint16 GetDatabaseIndex()           const {return _databaseIndex;}
    MUSCLE_NODISCARD uint16 GetSeniorElapsedTimeMillis() const {return _seniorElapsedTimeMillis;}
    MUSCLE_NODISCARD uint64 GetSeniorStartTimeMicros()   const {return _seniorStartTimeMicros;}
    MUSCLE_NODISCARD const ZGPeerID & GetSourcePeerID()  const {return _sourcePeerID;}
    MUSCLE_NODISCARD uint64 GetUpdateID()                const {return _updateID;}
-   MUSCLE_NODISCARD uint32 GetPreUpdateDBChecksum()     const {return _preUpdateDBChecksum;}
-   MUSCLE_NODISCARD uint32 GetPostUpdateDBChecksum()    const {return _postUpdateDBChecksum;}
+   MUSCLE_NODISCARD uint64 GetPreUpdateDBChecksum()     const {return _preUpdateDBChecksum;}
+   MUSCLE_NODISCARD uint64 GetPostUpdateDBChecksum()    const {return _postUpdateDBChecksum;}
+   MUSCLE_NODISCARD uint8 GetPayloadCodec()             const {(void) GetPayloadBuffer(); return _payloadCodec;}  // returns a PZG_PAYLOAD_CODEC_* value
+   MUSCLE_NODISCARD uint64 GetRequestTimeMicros()       const {return _requestTimeMicros;}
+   MUSCLE_NODISCARD uint64 GetSeniorReceiveTimeMicros() const {return _seniorReceiveTimeMicros;}
+   MUSCLE_NODISCARD uint64 GetSeniorFinishTimeMicros()  const {return _seniorFinishTimeMicros;}
+   MUSCLE_NODISCARD uint64 GetMulticastTimeMicros()     const {return _multicastTimeMicros;}
+   MUSCLE_NODISCARD uint64 GetLocalReceiveTimeMicros()  const {return _localReceiveTimeMicros;}
 
    MUSCLE_NODISCARD const ConstMessageRef & GetPayloadBufferAsMessage() const;
    MUSCLE_NODISCARD const ConstByteBufferRef & GetPayloadBuffer() const;
 
-   void SetUpdateType(uint8 updateType)                {_updateType              = updateType;}
-   void SetDatabaseIndex(uint16 databaseIndex)         {_databaseIndex           = databaseIndex;}
-   void SetSeniorStartTimeMicros(uint64 micros)        {_seniorStartTimeMicros   = micros;}  // expressed as a timestamp of the GetNetworkTime64() clock
-   void SetSeniorElapsedTimeMicros(uint64 micros)      {_seniorElapsedTimeMillis = (uint16) muscleMin((uint64)65535, (uint64) MicrosToMillis(micros));}
-   void SetSourcePeerID(const ZGPeerID & peerID)       {_sourcePeerID            = peerID;}
-   void SetUpdateID(uint64 updateID)                   {_updateID                = updateID;}
-   void SetPreUpdateDBChecksum(uint32 preDBChecksum)   {_preUpdateDBChecksum     = preDBChecksum;}
-   void SetSeniorElapsedTimeMillis(uint16 millis)      {_seniorElapsedTimeMillis = millis;}
-   void SetPostUpdateDBChecksum(uint32 postDBChecksum) {_postUpdateDBChecksum    = postDBChecksum;}
-   void SetPayloadMessage(const ConstMessageRef & payloadMsg);
+   /** Returns this update's flattened representation, demand-calculating and caching it on the first call.
+     * The multicast path, the back-order path and the persistent update-log all flatten the same update, so
+     * caching the flattened bytes here means the update gets serialized (and checksummed) only once, and the
+     * returned buffer can be shared by all of them.  Calling any of the Set*() methods invalidates the cache.
+     */
+   MUSCLE_NODISCARD const ConstByteBufferRef & GetWireImage() const;
+
+   void SetUpdateType(uint8 updateType)                {_updateType              = updateType; InvalidateWireImage();}
+   void SetDatabaseIndex(uint16 databaseIndex)         {_databaseIndex           = databaseIndex; InvalidateWireImage();}
+   void SetSeniorStartTimeMicros(uint64 micros)        {_seniorStartTimeMicros   = micros; InvalidateWireImage();}  // expressed as a timestamp of the GetNetworkTime64() clock
+   void SetSeniorElapsedTimeMicros(uint64 micros)      {_seniorElapsedTimeMillis = (uint16) muscleMin((uint64)65535, (uint64) MicrosToMillis(micros)); InvalidateWireImage();}
+   void SetSourcePeerID(const ZGPeerID & peerID)       {_sourcePeerID            = peerID; InvalidateWireImage();}
+   void SetUpdateID(uint64 updateID)                   {_updateID                = updateID; InvalidateWireImage();}
+   void SetPreUpdateDBChecksum(uint64 preDBChecksum)   {_preUpdateDBChecksum     = preDBChecksum; InvalidateWireImage();}
+   void SetSeniorElapsedTimeMillis(uint16 millis)      {_seniorElapsedTimeMillis = millis; InvalidateWireImage();}
+   void SetPostUpdateDBChecksum(uint64 postDBChecksum) {_postUpdateDBChecksum    = postDBChecksum; InvalidateWireImage();}
+   void SetRequestTimeMicros(uint64 micros)            {_requestTimeMicros       = micros; InvalidateWireImage();}  // expressed as a timestamp of the GetNetworkTime64() clock
+   void SetSeniorReceiveTimeMicros(uint64 micros)      {_seniorReceiveTimeMicros = micros; InvalidateWireImage();}  // expressed as a timestamp of the GetNetworkTime64() clock
+   void SetSeniorFinishTimeMicros(uint64 micros)       {_seniorFinishTimeMicros  = micros; InvalidateWireImage();}  // expressed as a timestamp of the GetNetworkTime64() clock
+   void SetMulticastTimeMicros(uint64 micros)          {_multicastTimeMicros     = micros; InvalidateWireImage();}  // expressed as a timestamp of the GetNetworkTime64() clock
+   void SetLocalReceiveTimeMicros(uint64 micros)       {_localReceiveTimeMicros  = micros;}  // expressed as a timestamp of the GetNetworkTime64() clock (not flattened, so the wire image stays valid)
+
+   /** Sets the payload Message of this update.
+     * @param payloadMsg the new payload Message
+     * @param compressionLevel the zlib compression level (0-9) to use when this Message is later flattened into our payload buffer.
+     *                         If 0, or if the flattened Message is smaller than PZG_MIN_PAYLOAD_BYTES_TO_COMPRESS bytes,
+     *                         (or compressing it doesn't make it any smaller) the payload buffer will be left uncompressed.
+     */
+   void SetPayloadMessage(const ConstMessageRef & payloadMsg, uint8 compressionLevel = ZG_DEFAULT_PAYLOAD_COMPRESSION_LEVEL);
    void UncachePayloadBufferAsMessage() const;
 
    MUSCLE_NODISCARD uint32 CalculateChecksum() const;
@@ -66,6 +101,7 @@ protected:
 
 private:
    MUSCLE_NODISCARD uint32 FlattenedSizeNotIncludingPayload() const;
+   void InvalidateWireImage() {_wireImage.Reset();}
 
    uint8 _updateType;                 // PZG_DATABASE_UPDATE_TYPE_*
    uint16 _databaseIndex;             // Index of the database (within this replicated-database-arena) that this update is intended for
@@ -73,11 +109,19 @@ private:
    uint64 _seniorStartTimeMicros;     // when SeniorUpdated() started executing on the senior peer, expressed as a timestamp of the GetNetworkTime64() clock
    ZGPeerID _sourcePeerID;            // ID of the peer that requested this update
    uint64 _updateID;                  // State-ID that this update will place the database into when applied.
-   uint32 _preUpdateDBChecksum;       // 32-bit checksum of our database as it was before this update was applied
-   uint32 _postUpdateDBChecksum;      // 32-bit checksum of our database as it was after this update was applied
+   uint64 _preUpdateDBChecksum;       // 64-bit checksum of our database as it was before this update was applied
+   uint64 _postUpdateDBChecksum;      // 64-bit checksum of our database as it was after this update was applied
+   uint64 _requestTimeMicros;         // when the requesting peer sent its update-request to the senior peer (GetNetworkTime64() clock), or 0 if unknown
+   uint64 _seniorReceiveTimeMicros;   // when the senior peer received the update-request (GetNetworkTime64() clock), or 0 if unknown
+   uint64 _seniorFinishTimeMicros;    // when the senior peer finished executing this update (GetNetworkTime64() clock), or 0 if unknown
+   uint64 _multicastTimeMicros;       // when the senior peer first queued this update for multicast to the junior peers (GetNetworkTime64() clock), or 0 if unknown
+   uint64 _localReceiveTimeMicros;    // when this update was received from the network by the local (junior) peer (GetNetworkTime64() clock), or 0 if unknown (not flattened)
+   uint8 _compressionLevel;           // zlib compression level to use when demand-allocating _updateBuf from _updateMsg (not flattened)
+   mutable uint8 _payloadCodec;       // PZG_PAYLOAD_CODEC_* value indicating how _updateBuf is encoded
 
    mutable ConstByteBufferRef _updateBuf; // demand-allocated from _updateMsg
    mutable ConstMessageRef _updateMsg;    // demand-allocated from _updateBuf
+   mutable ConstByteBufferRef _wireImage; // demand-allocated by GetWireImage(); when set, Flatten() just copies these bytes out
 };
 DECLARE_REFTYPES(PZGDatabaseUpdate);
 
@@ -85,7 +129,7 @@ DECLARE_REFTYPES(PZGDatabaseUpdate);
 PZGDatabaseUpdateRef GetPZGDatabaseUpdateFromPool();
 
 /** Returns a partially-populated reference to a newly allocated PZGDatabaseUpdate object */
-PZGDatabaseUpdateRef GetPZGDatabaseUpdateFromPool(uint8 updateType, uint16 databaseIndex, uint64 updateID, const ZGPeerID & sourcePeerID, uint32 preUpdateDBChecksum);
+PZGDatabaseUpdateRef GetPZGDatabaseUpdateFromPool(uint8 updateType, uint16 databaseIndex, uint64 updateID, const ZGPeerID & sourcePeerID, uint64 preUpdateDBChecksum);
 
 }  // end namespace zg_private
 
@@ -0,0 +1,53 @@
+#ifndef PZGDatabaseWorkerSession_h
+#define PZGDatabaseWorkerSession_h
+
+#include "zg/private/PZGThreadedSession.h"
+
+namespace zg_private
+{
+
+class PZGDatabaseState;
+
+/** This session manages the worker thread of a single database, when ZG has been configured
+  * (via ZGPeerSettings::SetDatabaseWorkerThreadsEnabled()) to execute database updates in per-database threads.
+  * Jobs sent to the worker thread are executed in the order they were sent, and their results are
+  * passed back to the PZGDatabaseState object in the main thread, in that same order.
+  */
+class PZGDatabaseWorkerSession : public PZGThreadedSession
+{
+public:
+   PZGDatabaseWorkerSession(PZGDatabaseState * dbState);
+
+   virtual void EndSession();
+
+   MUSCLE_NODISCARD virtual const char * GetTypeName() const {return "Database Worker";}
+
+   /** Called from the main thread:  Enqueues the given job-Message for execution by the worker thread. */
+   status_t SendJobToWorkerThread(const MessageRef & jobMsg) {return SendMessageToInternalThread(jobMsg);}
+
+   /** Called from the main thread:  Blocks until the worker thread has returned its next Message, and then handles that Message. */
+   status_t WaitForNextMessageFromWorkerThread();
+
+   /** Called from within the worker thread:  Passes the given Message back to the main thread. */
+   status_t SendMessageToMainThread(const MessageRef & msg) {return SendMessageToOwner(msg);}
+
+   /** Returns true iff this method is being called from within our worker thread. */
+   MUSCLE_NODISCARD bool IsCallerWorkerThread() const {return IsCallerInternalThread();}
+
+   /** Returns the PZGDatabaseState whose worker thread is calling this method, or NULL if it's being called from any other thread.
+     * This is a thread-local lookup, so it's cheap enough to call on every Message-send.
+     */
+   MUSCLE_NODISCARD static PZGDatabaseState * GetDatabaseStateForCallingThread();
+
+protected:
+   virtual void InternalThreadEntry();
+   virtual void MessageReceivedFromInternalThread(const MessageRef & msg, uint32 numLeft);
+
+private:
+   PZGDatabaseState * _dbState;
+};
+DECLARE_REFTYPES(PZGDatabaseWorkerSession);
+
+}  // end namespace zg_private
+
+#endif
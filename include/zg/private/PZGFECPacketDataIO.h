@@ -0,0 +1,208 @@
+#ifndef PZGFECPacketDataIO_h
+#define PZGFECPacketDataIO_h
+
+#include "dataio/PacketDataIO.h"
+#include "util/ByteBuffer.h"
+#include "util/Hashtable.h"
+#include "util/Queue.h"
+#include "util/TimeUtilityFunctions.h"
+#include "zg/ZGPeerID.h"
+#include "zg/private/PZGNameSpace.h"
+
+namespace zg_private
+{
+
+static const uint32 PZG_FEC_MAX_GROUP_SIZE                = 32;                  // max number of data packets covered by a single parity packet
+static const uint32 PZG_FEC_MIN_ADAPTIVE_GROUP_SIZE       = 2;                   // the most parity we'll ever send is one parity packet per this many data packets
+static const float  PZG_FEC_TARGET_LOSSES_PER_GROUP       = 0.1f;                // groups are sized so that (on average) this many of their packets get lost
+static const uint64 PZG_FEC_PARITY_FLUSH_DELAY_MICROS     = MillisToMicros(5);   // a partially-filled group gets its parity packet after this long without being filled
+static const uint64 PZG_FEC_LOSS_REPORT_INTERVAL_MICROS   = SecondsToMicros(1);  // how often receivers report the packet-loss rate they've measured
+static const uint64 PZG_FEC_LOSS_REPORT_MAX_AGE_MICROS    = SecondsToMicros(5);  // loss reports older than this are ignored by the senders
+static const uint32 PZG_FEC_MAX_GROUPS_PER_SOURCE         = 8;                   // how many recent parity groups we track for each packet source
+static const uint32 PZG_FEC_MAX_SOURCES                   = 64;                  // how many packet sources we track (least-recently-heard ones are dropped first)
+static const uint32 PZG_FEC_SINGLETON_PROBE_INTERVAL      = 8;                   // while no loss is reported, every Nth one-packet group still gets a parity packet, so that receivers can measure loss
+
+/** This PacketDataIO wraps another PacketDataIO (e.g. the UDP multicast DataIO of one network interface) and adds
+  * XOR-parity forward error correction to the packets that pass through it.  Each outgoing packet gets a small header
+  * identifying its sender, its parity group and its position within that group, and after each group of data packets, a parity packet
+  * (the XOR of the group's payloads) is sent.  A receiver that gets all but one of a group's data packets, plus the parity
+  * packet, reconstructs the missing packet locally, without any round trip to the sender.
+  *
+  * Parity is only sent if a non-zero maximum group size was passed to our constructor, but every PZGFECPacketDataIO
+  * can decode parity, so peers with different settings still interoperate.  The group size adapts to the packet-loss
+  * rates that receivers report (see LossReportReceived()):  the more loss is reported, the smaller the groups get.
+  * This object isn't thread-safe; it's meant to be used only by the network I/O thread.
+  */
+class PZGFECPacketDataIO : public PacketDataIO
+{
+public:
+   /** Constructor
+     * @param childIO the PacketDataIO that our (FEC-framed) packets should actually be sent and received through.
+     * @param maxGroupSize the maximum number of data packets to send per parity packet, or 0 if we shouldn't send any parity packets.
+     *                     Values greater than PZG_FEC_MAX_GROUP_SIZE will be treated as PZG_FEC_MAX_GROUP_SIZE.
+     * @param senderID a value that identifies us among the other senders on the network (e.g. the HashCode() of our ZGPeerID).
+     *                 Receivers track parity groups per (packet source, sender ID), since peers running on the same host
+     *                 all send their multicast packets from the same IP address and port.
+     */
+   PZGFECPacketDataIO(const PacketDataIORef & childIO, uint32 maxGroupSize, uint32 senderID);
+
+   // DataIO/PacketDataIO interface
+   virtual io_status_t Read(void * buffer, uint32 size);
+   virtual io_status_t ReadFrom(void * buffer, uint32 size, IPAddressAndPort & retPacketSource);
+   virtual io_status_t Write(const void * buffer, uint32 size);
+   virtual io_status_t WriteTo(const void * buffer, uint32 size, const IPAddressAndPort & packetDest);
+   virtual void FlushOutput() {_childIO()->FlushOutput();}
+   virtual void Shutdown() {_childIO()->Shutdown();}
+   MUSCLE_NODISCARD virtual const ConstSocketRef & GetReadSelectSocket()  const {return _childIO()->GetReadSelectSocket();}
+   MUSCLE_NODISCARD virtual const ConstSocketRef & GetWriteSelectSocket() const {return _childIO()->GetWriteSelectSocket();}
+   MUSCLE_NODISCARD virtual uint32 GetMaximumPacketSize() const;
+   MUSCLE_NODISCARD virtual const IPAddressAndPort & GetSourceOfLastReadPacket() const {return _sourceOfLastReadPacket;}
+   MUSCLE_NODISCARD virtual const IPAddressAndPort & GetPacketSendDestination() const {return _childIO()->GetPacketSendDestination();}
+   virtual status_t SetPacketSendDestination(const IPAddressAndPort & iap) {return _childIO()->SetPacketSendDestination(iap);}
+
+   /** Returns the run-time at which FlushParity() should next be called, or MUSCLE_TIME_NEVER if there's no partially-filled parity group. */
+   MUSCLE_NODISCARD uint64 GetParityFlushTime() const {return _parityFlushTime;}
+
+   /** Sends the parity packet for the current (partially-filled) parity group right away, and starts a new group.
+     * This should be called when GetParityFlushTime() is reached, so that the last packets of a burst are protected too.
+     * If our child PacketDataIO can't accept the parity packet yet, the group is left as is, and this should be called again later.
+     */
+   void FlushParity();
+
+   /** Called when another peer has reported the packet-loss rate it is seeing on this network interface.
+     * @param reporterPeerID the ID of the peer that sent the report
+     * @param lossRate the fraction of packets that peer has been losing (0.0 = none, 1.0 = all)
+     * @param now the current run-time, in microseconds
+     */
+   void LossReportReceived(const ZGPeerID & reporterPeerID, float lossRate, uint64 now);
+
+   /** Returns the highest packet-loss rate that any peer has reported to us recently, or 0.0f if none has.
+     * @param now the current run-time, in microseconds
+     */
+   MUSCLE_NODISCARD float GetReportedLossRate(uint64 now) const;
+
+   /** Returns the number of data packets we expected to receive (in parity groups whose parity packet we received) and
+     * the number of those that were lost (including the ones we recovered) since this method was last called, and resets those counts.
+     * @param retNumExpected on return, the number of data packets we expected to receive
+     * @param retNumLost on return, the number of those data packets that were lost in transit
+     */
+   void GetAndResetLossStatistics(uint32 & retNumExpected, uint32 & retNumLost);
+
+   /** Returns the number of lost packets we have reconstructed from parity packets so far. */
+   MUSCLE_NODISCARD uint64 GetNumRecoveredPackets() const {return _numRecoveredPackets;}
+
+   /** Returns the PacketDataIO our packets are sent and received through, as passed to our constructor */
+   MUSCLE_NODISCARD const PacketDataIORef & GetChildIO() const {return _childIO;}
+
+private:
+   class ReceiveGroup
+   {
+   public:
+      ReceiveGroup() : _receivedMask(0), _numOriginalsReceived(0), _numDataPackets(0), _lengthXor(0), _parityReceived(false), _xorIsValid(true) {/* empty */}
+
+      MUSCLE_NODISCARD bool HasDataPacket(uint32 index) const {return ((_receivedMask & (((uint32)1)<<index)) != 0);}
+      MUSCLE_NODISCARD bool HasParityPacket() const {return _parityReceived;}
+      MUSCLE_NODISCARD uint32 GetNumDataPackets() const {return _numDataPackets;}
+      MUSCLE_NODISCARD uint32 GetNumOriginalsReceived() const {return _numOriginalsReceived;}
+
+      void DataPacketReceived(uint32 index, const uint8 * payload, uint32 payloadSize);
+      void ParityPacketReceived(uint32 numDataPackets, uint16 lengthXor, const uint8 * payload, uint32 payloadSize);
+
+      /** If exactly one of our data packets is missing and we have the parity packet, reconstructs the missing
+        * packet, marks it as received, and returns it.  Otherwise returns a NULL reference.
+        */
+      ByteBufferRef RecoverMissingPacket();
+
+   private:
+      void FoldPayload(const uint8 * payload, uint32 payloadSize);
+
+      uint32 _receivedMask;          // bit N is set iff data packet #N was received (or recovered)
+      uint32 _numOriginalsReceived;  // how many data packets were actually received (i.e. not recovered)
+      uint32 _numDataPackets;        // number of data packets in this group (only known once the parity packet arrives)
+      uint16 _lengthXor;             // XOR of the lengths of the data packets received so far, and of the parity packet's length-XOR field
+      bool _parityReceived;          // true iff we have received this group's parity packet
+      bool _xorIsValid;              // false if we ran out of memory while updating (_payloadXor)
+      ByteBuffer _payloadXor;        // XOR of the payloads of the data packets received so far, and of the parity packet's payload
+   };
+
+   class LossReport
+   {
+   public:
+      LossReport() : _lossRate(0.0f), _receiveTime(0) {/* empty */}
+      LossReport(float lossRate, uint64 receiveTime) : _lossRate(lossRate), _receiveTime(receiveTime) {/* empty */}
+
+      MUSCLE_NODISCARD float GetLossRate() const {return _lossRate;}
+      MUSCLE_NODISCARD uint64 GetReceiveTime() const {return _receiveTime;}
+
+   private:
+      float _lossRate;
+      uint64 _receiveTime;
+   };
+
+   class ReceiveSourceKey
+   {
+   public:
+      ReceiveSourceKey() : _senderID(0) {/* empty */}
+      ReceiveSourceKey(const IPAddressAndPort & source, uint32 senderID) : _source(source), _senderID(senderID) {/* empty */}
+
+      bool operator == (const ReceiveSourceKey & rhs) const {return ((_source == rhs._source)&&(_senderID == rhs._senderID));}
+      bool operator != (const ReceiveSourceKey & rhs) const {return !(*this==rhs);}
+
+      MUSCLE_NODISCARD uint32 HashCode() const {return _source.HashCode()+CalculateHashCode(_senderID);}
+
+   private:
+      IPAddressAndPort _source;
+      uint32 _senderID;
+   };
+
+   class RecoveredPacket
+   {
+   public:
+      RecoveredPacket() {/* empty */}
+      RecoveredPacket(const ByteBufferRef & payload, const IPAddressAndPort & source) : _payload(payload), _source(source) {/* empty */}
+
+      MUSCLE_NODISCARD const ByteBufferRef & GetPayload() const {return _payload;}
+      MUSCLE_NODISCARD const IPAddressAndPort & GetSource() const {return _source;}
+
+   private:
+      ByteBufferRef _payload;
+      IPAddressAndPort _source;
+   };
+
+   io_status_t WritePacket(uint8 packetType, uint8 indexOrCount, const void * payload, uint32 payloadSize, const IPAddressAndPort & packetDest);
+   io_status_t ReturnPayload(const uint8 * payload, uint32 payloadSize, const IPAddressAndPort & source, void * buffer, uint32 size, IPAddressAndPort & retPacketSource);
+   void StartNewSendGroup();
+   MUSCLE_NODISCARD uint32 CalculateGroupSize(uint64 now) const;
+   ReceiveGroup * GetReceiveGroup(const ReceiveSourceKey & sourceKey, uint16 groupID);
+   void RecoverMissingPacketIfPossible(const IPAddressAndPort & source, ReceiveGroup & group);
+
+   PacketDataIORef _childIO;
+   const uint32 _maxGroupSize;
+   const uint32 _senderID;
+   IPAddressAndPort _sourceOfLastReadPacket;
+   ByteBuffer _scratchBuf;  // for assembling outgoing packets and receiving incoming ones
+
+   // sender-side state
+   uint16 _sendGroupID;           // starts at a random value, so that a restarted sender's groups won't be mistaken for its old ones
+   uint32 _sendGroupSize;         // number of data packets the current send-group will have, if it gets filled
+   uint32 _numPacketsInSendGroup;
+   uint16 _sendLengthXor;
+   ByteBuffer _sendPayloadXor;
+   uint32 _sendPayloadXorSize;    // number of valid bytes in (_sendPayloadXor)
+   uint32 _numUnprotectedSingletons;  // one-packet groups we've sent without a parity packet since our last probe
+   IPAddressAndPort _sendGroupDest;
+   uint64 _parityFlushTime;
+   Hashtable<ZGPeerID, LossReport> _lossReports;  // reporter peer ID -> the most recent loss report we received from that peer
+
+   // receiver-side state
+   Hashtable<ReceiveSourceKey, Hashtable<uint16, ReceiveGroup> > _sources;  // (packet source, sender ID) -> group ID -> what we've received of that group (oldest groups first)
+   Queue<RecoveredPacket> _recoveredPackets;  // reconstructed packets that are waiting to be read
+   uint64 _numRecoveredPackets;
+   uint32 _numExpectedPackets;    // data packets in groups whose parity packet we received, since the last GetAndResetLossStatistics() call
+   uint32 _numLostPackets;        // how many of those data packets didn't arrive (whether or not we were able to recover them)
+};
+DECLARE_REFTYPES(PZGFECPacketDataIO);
+
+}  // end namespace zg_private
+
+#endif
@@ -17,9 +17,9 @@ class PZGHeartbeatPacket : public FlatCountable
 {
 public:
    PZGHeartbeatPacket();
-   PZGHeartbeatPacket(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, uint32 packetID);
+   PZGHeartbeatPacket(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, bool isCaughtUp, uint32 packetID);
 
-   void Initialize(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, uint32 packetID);
+   void Initialize(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, bool isCaughtUp, uint32 packetID);
 
    MUSCLE_NODISCARD virtual bool IsFixedSize() const {return false;}
    MUSCLE_NODISCARD virtual uint32 TypeCode() const {return PZG_HEARTBEAT_PACKET_TYPE_CODE;}
@@ -33,6 +33,7 @@ public:
    MUSCLE_NODISCARD uint32 CalculateChecksum() const;
 
    MUSCLE_NODISCARD bool IsFullyAttached()        const {return _isFullyAttached;}
+   MUSCLE_NODISCARD bool IsCaughtUp()             const {return _isCaughtUp;}  // true iff the sending peer's databases have all caught up with their senior peers
    MUSCLE_NODISCARD uint32 GetHeartbeatPacketID() const {return _heartbeatPacketID;}
    MUSCLE_NODISCARD uint32 GetVersionCode()       const {return _versionCode;}
    MUSCLE_NODISCARD uint64 GetSystemKey()         const {return _systemKey;}
@@ -44,6 +45,14 @@ public:
    MUSCLE_NODISCARD const Queue<ConstPZGHeartbeatPeerInfoRef> & GetOrderedPeersList() const {return _orderedPeersList;}
    MUSCLE_NODISCARD       Queue<ConstPZGHeartbeatPeerInfoRef> & GetOrderedPeersList()       {return _orderedPeersList;}
 
+   // Timing-replies for a few junior-only peers, which (unlike full peers) aren't included in the ordered-peers-list
+   MUSCLE_NODISCARD const Queue<ConstPZGHeartbeatPeerInfoRef> & GetObserverTimingReplies() const {return _observerTimingReplies;}
+   MUSCLE_NODISCARD       Queue<ConstPZGHeartbeatPeerInfoRef> & GetObserverTimingReplies()       {return _observerTimingReplies;}
+
+   // Indices of the databases that the sending peer is currently acting as the senior peer of (see ZGPeerSettings::SetPerDatabaseSeniorPeersEnabled())
+   MUSCLE_NODISCARD const Queue<uint32> & GetSeniorDatabaseIndices() const {return _seniorDatabaseIndices;}
+   MUSCLE_NODISCARD       Queue<uint32> & GetSeniorDatabaseIndices()       {return _seniorDatabaseIndices;}
+
    ConstMessageRef GetPeerAttributesAsMessage() const;
 
    // The current network-time (according to the sender) at the moment this packet was sent.
@@ -61,6 +70,9 @@ protected:
 
 private:
    MUSCLE_NODISCARD uint32 FlattenedSizeNotIncludingVariableLengthData() const;
+   MUSCLE_NODISCARD uint32 GetNumObserverTimingRepliesToSend() const {return muscleMin(_observerTimingReplies.GetNumItems(), (uint32)255);}  // since the count is sent in 8 bits
+   MUSCLE_NODISCARD uint32 GetNumSeniorDatabaseIndicesToSend() const {return muscleMin(_seniorDatabaseIndices.GetNumItems(), (uint32)65535);}  // since the count (and each index) is sent in 16 bits
+   static status_t UnflattenPeerInfos(DataUnflattener & unflat, uint32 numPeerInfos, Queue<ConstPZGHeartbeatPeerInfoRef> & retPeerInfos);
 
    uint32 _heartbeatPacketID;
    uint32 _versionCode;
@@ -71,7 +83,10 @@ private:
    uint32 _peerUptimeSeconds;
    ZGPeerID _sourcePeerID;
    Queue<ConstPZGHeartbeatPeerInfoRef> _orderedPeersList;
+   Queue<ConstPZGHeartbeatPeerInfoRef> _observerTimingReplies;  // sent after the peer-attributes, so that older peers will ignore them
+   Queue<uint32> _seniorDatabaseIndices;                        // sent last, so that older peers will ignore them
    bool _isFullyAttached;
+   bool _isCaughtUp;              // true iff the sending peer is eligible to be made the senior peer of a database (see ZGPeerSettings::SetPerDatabaseSeniorPeersEnabled())
 
    ConstByteBufferRef _peerAttributesBuf; // flattened version of _peerAttributesMsg
    mutable MessageRef _peerAttributesMsg; // unflattened version of _peerAttributesBuf (demand-allocated)
@@ -86,7 +101,7 @@ class PZGHeartbeatPacketWithMetaData : public PZGHeartbeatPacket
 {
 public:
    PZGHeartbeatPacketWithMetaData();
-   PZGHeartbeatPacketWithMetaData(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, uint32 packetID);
+   PZGHeartbeatPacketWithMetaData(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, bool isCaughtUp, uint32 packetID);
 
    // Time at which we received this packet (as reported by GetRunTime64())
    MUSCLE_NODISCARD uint64 GetLocalReceiveTimeMicros() const {return _localReceiveTimeMicros;}
@@ -35,6 +35,9 @@ public:
    MUSCLE_NODISCARD int64 MainThreadGetToNetworkTimeOffset() const {return _hbtState.MainThreadGetToNetworkTimeOffset();}
    MUSCLE_NODISCARD uint16 MainThreadGetTimeSyncUDPPort()    const {return _timeSyncUDPPort;}
 
+   /** Sets whether our outgoing heartbeats should advertise that our databases have all caught up with their senior peers */
+   void MainThreadSetIsCaughtUp(bool isCaughtUp) {_hbtState.MainThreadSetIsCaughtUp(isCaughtUp);}
+
    /** Returns the current estimated one-way network latency to the specified peer, in microseconds */
    MUSCLE_NODISCARD uint64 GetEstimatedLatencyToPeer(const ZGPeerID & peerID) const;
 
@@ -30,6 +30,8 @@ public:
    void ReceiveMulticastTraffic(PacketDataIO & dio);
 
    MUSCLE_NODISCARD int64 MainThreadGetToNetworkTimeOffset() const {return _mainThreadToNetworkTimeOffset;} // this will be called from the main thread
+   void MainThreadSetIsCaughtUp(bool isCaughtUp) {_mainThreadIsCaughtUp = isCaughtUp;}                       // this will be called from the main thread
+   void MainThreadSetSeniorDatabaseIndices(const Queue<uint32> & seniorDatabaseIndices);                   // this will be called from the main thread
 
    MUSCLE_NODISCARD uint64 GetEstimatedLatencyToPeer(const ZGPeerID & peerID) const;
 
@@ -51,7 +53,7 @@ private:
    void ScheduleUpdateToNetworkTimeOffset() {_updateToNetworkTimeOffsetPending = true;}
    void UpdateToNetworkTimeOffset();
    status_t SendHeartbeatPackets();
-   MUSCLE_NODISCARD const ZGPeerID & GetSeniorPeerID() const {return _lastSourcesSentToMaster.GetFirstKeyWithDefault().GetPeerID();}
+   MUSCLE_NODISCARD const ZGPeerID & GetSeniorPeerID() const {const ZGPeerID & pid = _lastSourcesSentToMaster.GetFirstKeyWithDefault().GetPeerID(); return _peerIDToIPAddresses.ContainsKey(pid) ? pid : GetDefaultObjectForType<ZGPeerID>();}  // junior-only peers can never be senior
    MUSCLE_NODISCARD bool IAmTheSeniorPeer() const {return GetSeniorPeerID() == _hbSettings()->GetLocalPeerID();}
    MessageRef UpdateOfficialPeersList(bool forceUpdate);
    MUSCLE_NODISCARD bool IsAtLeastHalfAttached() const {return (_now >= _halfAttachedTime);}
@@ -61,6 +63,11 @@ private:
    void IntroduceSource(const PZGHeartbeatSourceKey & source, const PZGHeartbeatPacketWithMetaDataRef & newHB, uint64 localExpirationTimeMicros);
    void ExpireSource(const PZGHeartbeatSourceKey & source);
 
+   void AddObserverTimingReplies(PZGHeartbeatPacketWithMetaData & hb);
+   MUSCLE_NODISCARD const PZGHeartbeatPeerInfo * GetLocalPeerInfo(const Queue<ConstPZGHeartbeatPeerInfoRef> & infoQ) const;
+   MUSCLE_NODISCARD const Queue<IPAddressAndPort> * GetPeerSources(const ZGPeerID & pid) const {const Queue<IPAddressAndPort> * ret = _peerIDToIPAddresses.Get(pid); return ret ? ret : _observerPeerIDToIPAddresses.Get(pid);}
+   MUSCLE_NODISCARD Hashtable<ZGPeerID, Queue<IPAddressAndPort> > & GetPeerTableForType(uint16 peerType) {return (peerType == PEER_TYPE_FULL_PEER) ? _peerIDToIPAddresses : _observerPeerIDToIPAddresses;}
+
    void PrintTimeSynchronizationDeltas() const;
    void EnsureHeartbeatSourceTagsTableUpdated();
 
@@ -82,6 +89,7 @@ private:
 
    int64 _toNetworkTimeOffset;  // microseconds we need to add to our GetRunTime64() value to get the current network time
    std::atomic<int64> _mainThreadToNetworkTimeOffset;  // this is the same as _toNetworkTimeOffset except safe for the main thread to read atomically
+   std::atomic<bool> _mainThreadIsCaughtUp;             // set by the main thread; advertised in our heartbeats so other peers will know we can be a database's senior peer
    bool _updateToNetworkTimeOffsetPending;
 
    Queue<PacketDataIORef> _multicastDataIOs;
@@ -92,7 +100,9 @@ private:
    Hashtable<uint32, uint64> _recentlySentHeartbeatLocalSendTimes;  // hbPacket ID -> local-send-time
 
    Hashtable<PZGHeartbeatSourceKey, PZGHeartbeatSourceStateRef> _onlineSources;
-   Hashtable<ZGPeerID, Queue<IPAddressAndPort> > _peerIDToIPAddresses;
+   Hashtable<ZGPeerID, Queue<IPAddressAndPort> > _peerIDToIPAddresses;          // full peers only; these are the peers that take part in the senior-peer election
+   Hashtable<ZGPeerID, Queue<IPAddressAndPort> > _observerPeerIDToIPAddresses;  // junior-only peers; these are kept out of our heartbeats' ordered-peers-lists, sorted by peer ID
+   uint32 _nextObserverTimingReplyIndex;  // round-robin index into _observerPeerIDToIPAddresses
 
    bool _updateOfficialPeersListPending;
    bool _forceOfficialPeersUpdate;
@@ -108,6 +118,9 @@ private:
    Mutex _mainThreadLatenciesLock;
    Hashtable<ZGPeerID, uint64> _mainThreadLatencies;
 
+   Mutex _mainThreadSeniorDatabaseIndicesLock;
+   Queue<uint32> _mainThreadSeniorDatabaseIndices;  // set by the main thread; advertised in our heartbeats so other peers will agree on who each database's senior peer is
+
    Hashtable<ZGPeerID, uint64> _lastMismatchedVersionLogTimes;
 };
 
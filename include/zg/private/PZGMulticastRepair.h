@@ -0,0 +1,205 @@
+#ifndef PZGMulticastRepair_h
+#define PZGMulticastRepair_h
+
+#include "message/Message.h"
+#include "util/Hashtable.h"
+#include "util/TimeUtilityFunctions.h"
+#include "zg/ZGPeerID.h"
+#include "zg/private/PZGNameSpace.h"
+
+namespace zg_private
+{
+
+static const uint64 PZG_MULTICAST_NACK_DELAY_MICROS           = MillisToMicros(2);   // min time a receiver waits (plus random jitter of up to the same amount) before NACK-ing a gap
+static const uint64 PZG_MULTICAST_NACK_RETRY_MICROS           = MillisToMicros(20);  // time a receiver waits for a repair before NACK-ing the same sequence number again
+static const uint32 PZG_MULTICAST_MAX_NACKS_PER_MESSAGE       = 3;                   // after this many unanswered NACKs, the receiver leaves the gap to the back-order mechanism
+static const uint32 PZG_MULTICAST_MAX_TRACKED_GAP             = 1024;                // max number of missing sequence numbers we'll NACK per source peer
+static const uint32 PZG_MULTICAST_MAX_NACK_RANGES_PER_MESSAGE = 64;                  // max number of (first, last) ranges in a single NACK Message
+static const uint64 PZG_MULTICAST_RETRANSMIT_HOLDOFF_MICROS   = MillisToMicros(1);   // sender waits this long after a NACK, so that NACKs from several receivers share one retransmission
+static const uint32 PZG_MULTICAST_RETRANSMIT_BUFFER_SIZE      = 1024;                // max number of sent Messages the sender keeps around for retransmission
+static const uint64 PZG_MULTICAST_RETRANSMIT_BUFFER_MAX_AGE   = SecondsToMicros(2);  // sent Messages older than this aren't retransmitted (the junior will back-order them instead)
+static const uint64 PZG_MULTICAST_SOURCE_EXPIRATION_MICROS    = SecondsToMicros(60); // receiver forgets about a source peer that hasn't sent anything for this long
+static const uint64 PZG_MULTICAST_REPAIR_GRACE_MICROS         = PZG_MULTICAST_NACK_DELAY_MICROS*2 + PZG_MULTICAST_NACK_RETRY_MICROS*PZG_MULTICAST_MAX_NACKS_PER_MESSAGE;  // how long a junior lets NACK-repair work before back-ordering a missing update
+
+/** This class implements a NACK-based reliability layer for the sequenced Messages (i.e. database updates)
+  * that the network I/O thread multicasts.  Each sender numbers its sequenced Messages consecutively and keeps
+  * the most recent ones in a retransmit buffer.  Each receiver tracks the highest sequence number it has
+  * received from each sender, and when it notices a gap, it multicasts a (batched) NACK after a short random delay.
+  * Since NACKs are multicast, a receiver that overhears another receiver's NACK for the same sequence numbers
+  * holds off on sending its own, and the sender answers each NACK-ed sequence number with a single multicast
+  * retransmission, no matter how many receivers missed it.  Losses that can't be repaired this way (e.g. because
+  * the sender no longer has the Message) are still recovered by the junior peer's back-orders, as before.
+  * This object is meant to be used only by the network I/O thread, so it isn't thread-safe.
+  */
+class PZGMulticastRepair
+{
+public:
+   /** Constructor */
+   PZGMulticastRepair();
+
+   // Sender-side methods
+
+   /** Assigns the next sequence number to (msg), and adds (msg) to our retransmit buffer.
+     * @param msg the Message that is about to be queued for multicast.  Its sequence-number field will be added here.
+     * @returns B_NO_ERROR on success, or an error code on failure.
+     * @note (msg) won't be retransmitted (and won't start to age out of our retransmit buffer) until
+     *       MessagesWritten() tells us that it has actually been written to the network.
+     */
+   status_t MessageSent(const MessageRef & msg);
+
+   /** Tells us that all of our sequenced Messages before (firstUnwrittenSeqNum) have now been written to the network
+     * (as opposed to still waiting in an outgoing-Message queue, e.g. because our output is being paced).
+     * @param firstUnwrittenSeqNum the sequence number of the first sequenced Message that is still queued,
+     *                             or (GetLastSentSequenceNumber()+1) if none of them are.
+     * @param now the current run-time, in microseconds
+     */
+   void MessagesWritten(uint32 firstUnwrittenSeqNum, uint64 now);
+
+   /** Returns the sequence number of the most recent sequenced Message we sent, or 0 if we haven't sent any yet. */
+   MUSCLE_NODISCARD uint32 GetLastSentSequenceNumber() const {return _lastSentSeqNum;}
+
+   /** Returns the sequence number of the most recent sequenced Message that has been written to the network, or 0 if none has been yet. */
+   MUSCLE_NODISCARD uint32 GetLastWrittenSequenceNumber() const {return _lastWrittenSeqNum;}
+
+   /** Returns the sequence number that MessageSent() added to (msg), or 0 if (msg) isn't a sequenced Message. */
+   MUSCLE_NODISCARD static uint32 GetSequenceNumber(const Message & msg);
+
+   /** Adds our last-sent sequence number to the given outgoing beacon Message, so that receivers
+     * can detect the loss of our most recent sequenced Messages too.  Does nothing if we haven't sent any yet.
+     * @param beaconMsg the beacon Message to add the sequence number to
+     * @returns B_NO_ERROR on success, or an error code on failure.
+     */
+   status_t AddLastSentSequenceNumberToBeacon(Message & beaconMsg) const;
+
+   /** Called when a NACK that is addressed to us has been received.  Schedules retransmission of any NACK-ed
+     * Messages that we still have in our retransmit buffer (and that aren't still waiting to be written).
+     * @param nackMsg the NACK Message
+     * @param now the current run-time, in microseconds
+     */
+   void NackReceived(const Message & nackMsg, uint64 now);
+
+   /** Removes and returns the Messages that are due to be retransmitted, in sequence-number order.
+     * @param now the current run-time, in microseconds
+     * @param retMsgs on return, the Messages to retransmit are appended to this Queue
+     */
+   void GetMessagesToRetransmit(uint64 now, Queue<MessageRef> & retMsgs);
+
+   // Receiver-side methods
+
+   /** Called when a sequenced Message has been received from a remote peer.  Notes any gap in that peer's sequence numbers.
+     * @param sourcePeerID the ID of the peer who sent the Message
+     * @param msg the received Message.  If it doesn't contain a sequence number, this method does nothing.
+     * @param now the current run-time, in microseconds
+     */
+   void MessageReceived(const ZGPeerID & sourcePeerID, const Message & msg, uint64 now);
+
+   /** Called when a remote peer's beacon has been received, so that we can detect the loss of that peer's most recent Messages.
+     * @param sourcePeerID the ID of the peer who sent the beacon
+     * @param beaconMsg the beacon Message.  If it doesn't contain a last-sent sequence number, this method does nothing.
+     * @param now the current run-time, in microseconds
+     */
+   void BeaconReceived(const ZGPeerID & sourcePeerID, const Message & beaconMsg, uint64 now);
+
+   /** Called when another receiver's NACK (addressed to some other peer) has been received.  Any sequence numbers it covers that we are
+     * also missing won't be NACK-ed by us until the sender has had time to answer it.
+     * @param nackMsg the NACK Message
+     * @param now the current run-time, in microseconds
+     */
+   void NackOverheard(const Message & nackMsg, uint64 now);
+
+   /** Returns the NACK Messages that are due to be sent (one per source peer), and updates our state to reflect that they were sent.
+     * @param now the current run-time, in microseconds
+     * @param retMsgs on return, the NACK Messages are appended to this Queue.  The caller should tag and multicast them.
+     */
+   void GetNacksToSend(uint64 now, Queue<MessageRef> & retMsgs);
+
+   /** Returns the run-time at which GetNacksToSend() or GetMessagesToRetransmit() will next have something to return,
+     * or MUSCLE_TIME_NEVER if there is nothing pending.
+     */
+   MUSCLE_NODISCARD uint64 GetNextWakeupTime() const;
+
+   /** Returns true iff (msg) is a NACK Message */
+   MUSCLE_NODISCARD static bool IsNackMessage(const Message & msg);
+
+   /** Returns true iff (nackMsg) is a NACK Message that is addressed to the specified peer.
+     * @param nackMsg the NACK Message to check
+     * @param peerID the ID of the peer to check for
+     */
+   MUSCLE_NODISCARD static bool IsNackAddressedTo(const Message & nackMsg, const ZGPeerID & peerID);
+
+private:
+   class MissingMessageInfo
+   {
+   public:
+      MissingMessageInfo() : _nextNackTime(MUSCLE_TIME_NEVER), _numNacksSent(0) {/* empty */}
+      MissingMessageInfo(uint64 nextNackTime) : _nextNackTime(nextNackTime), _numNacksSent(0) {/* empty */}
+
+      MUSCLE_NODISCARD uint64 GetNextNackTime() const {return _nextNackTime;}
+      MUSCLE_NODISCARD uint32 GetNumNacksSent() const {return _numNacksSent;}
+
+      void NackSent(uint64 now)       {_numNacksSent++; _nextNackTime = now+PZG_MULTICAST_NACK_RETRY_MICROS;}
+      void NackOverheard(uint64 now)  {_nextNackTime = muscleMax(_nextNackTime, now+PZG_MULTICAST_NACK_RETRY_MICROS);}
+
+   private:
+      uint64 _nextNackTime;
+      uint32 _numNacksSent;
+   };
+
+   class SourceState
+   {
+   public:
+      SourceState() : _highestSeqNum(0), _lastHeardTime(0) {/* empty */}
+
+      MUSCLE_NODISCARD uint32 GetHighestSequenceNumber() const {return _highestSeqNum;}
+      void SetHighestSequenceNumber(uint32 seqNum) {_highestSeqNum = seqNum;}
+
+      MUSCLE_NODISCARD uint64 GetLastHeardTime() const {return _lastHeardTime;}
+      void SetLastHeardTime(uint64 t) {_lastHeardTime = t;}
+
+      MUSCLE_NODISCARD Hashtable<uint32, MissingMessageInfo> & GetMissingMessages() {return _missing;}
+      MUSCLE_NODISCARD const Hashtable<uint32, MissingMessageInfo> & GetMissingMessages() const {return _missing;}
+
+   private:
+      uint32 _highestSeqNum;  // highest sequence number we've received (or know to have been sent) from this source, or 0 if none yet
+      uint64 _lastHeardTime;  // run-time at which we last heard from this source
+      Hashtable<uint32, MissingMessageInfo> _missing;  // sequence number -> NACK state, for each sequence number we're still missing
+   };
+
+   class SentMessageInfo
+   {
+   public:
+      SentMessageInfo() : _sendTime(0), _lastRetransmitTime(0) {/* empty */}
+      SentMessageInfo(const MessageRef & msg) : _msg(msg), _sendTime(0), _lastRetransmitTime(0) {/* empty */}
+
+      MUSCLE_NODISCARD const MessageRef & GetSentMessage() const {return _msg;}
+      MUSCLE_NODISCARD uint64 GetSendTime() const {return _sendTime;}  // 0 means it hasn't been written to the network yet
+      void SetSendTime(uint64 t) {_sendTime = t;}
+      MUSCLE_NODISCARD uint64 GetLastRetransmitTime() const {return _lastRetransmitTime;}
+      void SetLastRetransmitTime(uint64 t) {_lastRetransmitTime = t;}
+
+   private:
+      MessageRef _msg;
+      uint64 _sendTime;
+      uint64 _lastRetransmitTime;
+   };
+
+   void SequenceNumberSeen(const ZGPeerID & sourcePeerID, uint32 seqNum, bool isMessageReceived, uint64 now);
+   void TrimRetransmitBuffer(uint64 now);
+   void ExpireIdleSources(uint64 now);
+   MUSCLE_NODISCARD uint64 GetRandomNackTime(uint64 now);
+
+   // sender-side state
+   uint32 _lastSentSeqNum;
+   uint32 _lastWrittenSeqNum;
+   Hashtable<uint32, SentMessageInfo> _retransmitBuffer;  // sequence number -> recently sent Message, in sequence-number order
+   Hashtable<uint32, Void> _pendingRetransmits;           // sequence numbers that have been NACK-ed and are waiting to be retransmitted
+   uint64 _retransmitTime;                                 // run-time at which the (_pendingRetransmits) should be retransmitted
+
+   // receiver-side state
+   Hashtable<ZGPeerID, SourceState> _sources;  // source peer ID -> what we know about that peer's sequence numbers
+   unsigned int _randomSeed;
+};
+
+}  // end namespace zg_private
+
+#endif
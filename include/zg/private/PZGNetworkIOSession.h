@@ -13,6 +13,8 @@
 #include "zg/private/PZGUnicastSession.h"
 #include "zg/private/PZGHeartbeatSession.h"
 #include "zg/private/PZGHeartbeatSettings.h"
+#include "zg/private/PZGSnapshotFlattenerSession.h"
+#include "zg/private/PZGSnapshotTransfer.h"
 #include "zg/private/PZGUpdateBackOrderKey.h"
 
 namespace zg_private
@@ -55,8 +57,32 @@ public:
      */
    status_t SetBeaconData(const ConstPZGBeaconDataRef & optBeaconData);
 
-   /** Request that the senior peer send us the specified database update via unicast. */
-   status_t RequestBackOrderFromSeniorPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError);
+   /** Tells us (and the multicast I/O thread) who the senior peer of each database currently is, so that we'll know whose beacon data to accept.
+     * @param databaseSeniorPeerIDs the ID of the senior peer of each database (invalid ZGPeerIDs are ignored)
+     */
+   void SetDatabaseSeniorPeerIDs(const Queue<ZGPeerID> & databaseSeniorPeerIDs);
+
+   /** Sets whether our heartbeats should advertise that all of our databases have caught up with their senior peers' databases.
+     * @param isCaughtUp true iff this peer should now be considered eligible to be made the senior peer of a database
+     */
+   void SetLocalPeerIsCaughtUp(bool isCaughtUp);
+
+   /** Returns the value most recently passed to SetLocalPeerIsCaughtUp() */
+   MUSCLE_NODISCARD bool IsLocalPeerCaughtUp() const {return _localPeerIsCaughtUp;}
+
+   /** Sets the list of databases that our heartbeats should advertise this peer as being the senior peer of.
+     * @param seniorDatabaseIndices the indices of the databases this peer is currently the senior peer of
+     */
+   void SetLocalSeniorDatabaseIndices(const Queue<uint32> & seniorDatabaseIndices);
+
+   /** Request that the peer specified in (ubok) send us the specified database update via unicast. */
+   status_t RequestBackOrderFromPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError);
+
+   /** Returns a rough measure of how busy we currently are sending data to other peers (i.e. the number of Messages
+     * waiting in our unicast sessions' outgoing queues, plus the number of snapshots still being flattened).
+     * This is advertised in our catch-up offers, so that junior peers can avoid back-ordering from busy peers.
+     */
+   MUSCLE_NODISCARD uint32 GetCatchUpLoad() const;
 
    /** Returns true iff the specified peer is currently online */
    MUSCLE_NODISCARD bool IsPeerOnline(const ZGPeerID & id) const {return GetMainThreadPeers().ContainsKey(id);}
@@ -90,6 +116,8 @@ public:
    MUSCLE_NODISCARD const ZGPeerID & GetLocalPeerID() const {return _localPeerID;}
 
    ConstPZGDatabaseUpdateRef GetDatabaseUpdateByID(uint32 whichDB, uint64 updateID) const;
+   ConstPZGDatabaseUpdateRef GetFullDatabaseUpdate(uint32 whichDB);
+   void BackOrderLookupCompleted(uint32 whichDB, bool wasInUpdateLog);
    void VerifyOrFixLocalDatabaseChecksum(uint32 whichDB);
 
    MUSCLE_NODISCARD int64 GetToNetworkTimeOffset() const;
@@ -105,11 +133,13 @@ protected:
 private:
    friend class PZGUnicastSession;
    friend class PZGHeartbeatSession;
+   friend class PZGSnapshotFlattenerSession;
 
    // These methods are called by the PZGHeartbeatSession
    void PeerHasComeOnline(const ZGPeerID & peerID, const ConstMessageRef & optPeerInfo);
    void PeerHasGoneOffline(const ZGPeerID & peerID, const ConstMessageRef & optPeerInfo);
    void SeniorPeerChanged(const ZGPeerID & oldSeniorPeerID, const ZGPeerID & newSeniorPeerID);
+   void PeersListUpdated();
 
    PZGUnicastSessionRef GetUnicastSessionForPeerID(const ZGPeerID & peerID, bool allocIfNecessary);
 
@@ -123,19 +153,38 @@ private:
    void BackOrderResultReceived(const PZGUpdateBackOrderKey & ubok, const ConstPZGDatabaseUpdateRef & optUpdateData);
    status_t SetupHeartbeatSession();
 
+   // These methods are called by our PZGUnicastSessions, to manage chunked transfers of full-database-states
+   PZGOutgoingSnapshotRef GetOutgoingSnapshot(uint32 whichDB, uint64 snapshotID, bool dueToChecksumError);
+   PZGIncomingSnapshotRef GetIncomingSnapshot(const PZGUpdateBackOrderKey & ubok, bool allocIfNecessary);
+   void RemoveIncomingSnapshot(const PZGUpdateBackOrderKey & ubok) {(void) _incomingSnapshots.Remove(ubok);}
+   void ExpireIdleSnapshots();
+   MUSCLE_NODISCARD uint64 GetNextSnapshotExpirationTime() const;
+
+   // Called by our PZGSnapshotFlattenerSession when it has finished flattening a snapshot
+   void OutgoingSnapshotFlattened(uint64 snapshotID, const ConstByteBufferRef & optFlattenedUpdate);
+
    const ZGPeerSettings _peerSettings;
    const ZGPeerID _localPeerID;
-   const uint64 _beaconIntervalMicros;
+   const uint64 _beaconIntervalMicros;     // interval between periodic beacons, right after a database-state change
+   const uint64 _minBeaconIntervalMicros;  // change-triggered beacons are never sent more often than this
+   const uint64 _maxBeaconIntervalMicros;  // periodic beacons back off to this interval while nothing changes
    ConstPZGHeartbeatSettingsRef _hbSettings;
 
    // all the stuff below should be accessed from the main thread only
    ZGPeerSession * _master;
    DetectNetworkConfigChangesSessionRef _dnccSession;  // notifies us when network interfaces have come online or gone offline
    PZGHeartbeatSessionRef _hbSession;       // handles sending/receiving of heartbeat packets and updates the ordered-online-peers-list for us
+   PZGSnapshotFlattenerSessionRef _snapshotFlattenerSession;  // flattens full-database-state snapshots for us in a helper thread
    Hashtable<ZGPeerID, Queue<PZGUnicastSessionRef> > _namedUnicastSessions;  // unicast sessions whose remote endpoint we do know
    Hashtable<PZGUnicastSessionRef, Void> _registeredUnicastSessions;         // all unicast sessions (whether we know their endpoint or not)
    Queue<ConstMessageRef> _messagesSentToSelf;  // just because I think it's silly to serialize and then deserialize a MessageRef to myself
+   Hashtable<uint64, PZGOutgoingSnapshotRef> _outgoingSnapshots;                        // snapshot ID -> full-database-state we are sending to junior peers
+   Hashtable<PZGUpdateBackOrderKey, PZGIncomingSnapshotRef> _incomingSnapshots;         // full-database-states we are receiving from other peers
+   uint64 _nextSnapshotID;                                                              // ID to give the next PZGOutgoingSnapshot we create
    ZGPeerID _seniorPeerID;
+   Hashtable<ZGPeerID, Void> _beaconSourcePeerIDs;  // the peers that are currently the senior peer of at least one database
+   bool _localPeerIsCaughtUp;                      // cached here so that we can pass it on to any new heartbeat session
+   Queue<uint32> _localSeniorDatabaseIndices;      // ditto
    std::atomic<bool> _computerIsAsleep;
 
    Mutex _hbSessionPtrMutex;
@@ -0,0 +1,73 @@
+#ifndef PZGPacedPacketDataIO_h
+#define PZGPacedPacketDataIO_h
+
+#include "dataio/PacketDataIO.h"
+#include "util/TimeUtilityFunctions.h"
+#include "zg/private/PZGNameSpace.h"
+
+namespace zg_private
+{
+
+static const uint64 PZG_PACING_BURST_MICROS    = MillisToMicros(5);  // the token buckets hold this many microseconds' worth of sending
+static const uint32 PZG_PACING_MIN_BURST_BYTES = 2*1024;             // but always at least enough to send one full-size packet
+
+/** This PacketDataIO wraps another PacketDataIO (e.g. the UDP multicast DataIO of one network interface) and limits
+  * the rate at which packets are written to it, using a bytes-per-second token bucket and a packets-per-second token
+  * bucket.  When either bucket is empty, WriteTo() returns 0 (as a full non-blocking socket would), and the caller
+  * (typically a PacketTunnelIOGateway) should try again at GetNextSendTime().  This spreads a large burst of outgoing
+  * multicast traffic out over time, so that it doesn't overflow the buffers of the switches and Wi-Fi access points along the way.
+  * This object isn't thread-safe; it's meant to be used only by the network I/O thread.
+  */
+class PZGPacedPacketDataIO : public PacketDataIO
+{
+public:
+   /** Constructor
+     * @param childIO the PacketDataIO that our packets should actually be sent and received through.
+     * @param maxBytesPerSecond the maximum number of bytes per second to write to (childIO), or 0 for no limit.
+     * @param maxPacketsPerSecond the maximum number of packets per second to write to (childIO), or 0 for no limit.
+     */
+   PZGPacedPacketDataIO(const PacketDataIORef & childIO, uint64 maxBytesPerSecond, uint32 maxPacketsPerSecond);
+
+   // DataIO/PacketDataIO interface
+   virtual io_status_t Read(void * buffer, uint32 size) {return _childIO()->Read(buffer, size);}
+   virtual io_status_t ReadFrom(void * buffer, uint32 size, IPAddressAndPort & retPacketSource) {return _childIO()->ReadFrom(buffer, size, retPacketSource);}
+   virtual io_status_t Write(const void * buffer, uint32 size) {return WriteTo(buffer, size, _childIO()->GetPacketSendDestination());}
+   virtual io_status_t WriteTo(const void * buffer, uint32 size, const IPAddressAndPort & packetDest);
+   virtual void FlushOutput() {_childIO()->FlushOutput();}
+   virtual void Shutdown() {_childIO()->Shutdown();}
+   MUSCLE_NODISCARD virtual const ConstSocketRef & GetReadSelectSocket()  const {return _childIO()->GetReadSelectSocket();}
+   MUSCLE_NODISCARD virtual const ConstSocketRef & GetWriteSelectSocket() const {return _childIO()->GetWriteSelectSocket();}
+   MUSCLE_NODISCARD virtual uint32 GetMaximumPacketSize() const {return _childIO()->GetMaximumPacketSize();}
+   MUSCLE_NODISCARD virtual const IPAddressAndPort & GetSourceOfLastReadPacket() const {return _childIO()->GetSourceOfLastReadPacket();}
+   MUSCLE_NODISCARD virtual const IPAddressAndPort & GetPacketSendDestination() const {return _childIO()->GetPacketSendDestination();}
+   virtual status_t SetPacketSendDestination(const IPAddressAndPort & iap) {return _childIO()->SetPacketSendDestination(iap);}
+
+   /** Returns the earliest run-time at which WriteTo() will accept another packet.  If that's now (or earlier), returns (now).
+     * @param now the current run-time, in microseconds
+     */
+   MUSCLE_NODISCARD uint64 GetNextSendTime(uint64 now);
+
+   /** Returns true iff we are limiting the rate of outgoing packets at all */
+   MUSCLE_NODISCARD bool IsPacingEnabled() const {return ((_maxBytesPerSecond > 0)||(_maxPacketsPerSecond > 0));}
+
+   /** Returns the PacketDataIO our packets are sent and received through, as passed to our constructor */
+   MUSCLE_NODISCARD const PacketDataIORef & GetChildIO() const {return _childIO;}
+
+private:
+   void RefillTokens(uint64 now);
+
+   PacketDataIORef _childIO;
+   const uint64 _maxBytesPerSecond;
+   const uint32 _maxPacketsPerSecond;
+   const double _maxByteTokens;    // capacity of our bytes-bucket
+   const double _maxPacketTokens;  // capacity of our packets-bucket
+
+   double _byteTokens;    // may go negative, since we'll send a packet whenever the bucket isn't empty
+   double _packetTokens;
+   uint64 _lastRefillTime;
+};
+DECLARE_REFTYPES(PZGPacedPacketDataIO);
+
+}  // end namespace zg_private
+
+#endif
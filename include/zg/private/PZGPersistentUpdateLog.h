@@ -0,0 +1,118 @@
+#ifndef PZGPersistentUpdateLog_h
+#define PZGPersistentUpdateLog_h
+
+#include <stdio.h>
+
+#include "zg/private/PZGDatabaseUpdate.h"
+#include "util/Queue.h"
+#include "util/RefCount.h"
+
+namespace zg_private
+{
+
+/** This class manages the on-disk copy of a single database's state:  a snapshot file holding the
+  * full contents of the database as of a given state ID, plus an append-only log file holding the
+  * PZGDatabaseUpdates that were applied after that snapshot was written.
+  *
+  * Each log record starts at an 8-byte-aligned file offset, with a fixed-size little-endian header
+  * (a magic number, the size of the record's data, and the record's update ID) followed by the
+  * flattened PZGDatabaseUpdate and zero-padding.  That way the log can be replayed with sequential
+  * reads (or walked in a memory-mapped file) without having to unflatten any records it wants to skip.
+  * A torn or corrupt record at the end of the log (e.g. due to a crash) ends the replay.
+  *
+  * While a new snapshot is being written (possibly by a helper thread; see BeginSnapshot()), the log
+  * records that it will cover are kept in a separate "previous log" file, and new records go into a
+  * fresh log file.  The previous log is deleted once the snapshot is safely on disk, or merged back
+  * into the log if writing the snapshot failed.
+  */
+class PZGPersistentUpdateLog : public RefCountable
+{
+public:
+   /** Constructor
+     * @param dirPath path to the (already existing) directory to keep our files in.
+     * @param whichDatabase index of the database whose state we will be saving.
+     */
+   PZGPersistentUpdateLog(const String & dirPath, uint32 whichDatabase);
+   virtual ~PZGPersistentUpdateLog();
+
+   /** Reads in our snapshot file.
+     * @param retStateID on success, the state ID of the database at the time the snapshot was written is written here.
+     * @param retDBChecksum on success, the checksum of the database at the time the snapshot was written is written here.
+     * @param retDBStateMsg on success, the saved database state (as returned by SaveLocalDatabaseToMessage()) is written here.
+     * @returns B_NO_ERROR on success, B_FILE_NOT_FOUND if there is no snapshot file, or some other error code on failure.
+     */
+   status_t LoadSnapshot(uint64 & retStateID, uint64 & retDBChecksum, MessageRef & retDBStateMsg) const;
+
+   /** Reads in the records of our previous-log file (if any) and our log file, in the order they were written.
+     * @param afterUpdateID only records with update IDs greater than this value will be returned.
+     * @param retUpdates on return, the read records will have been appended to this Queue.
+     * @param retLogIsClean on return, this will be set to false if the log ended with a torn or corrupt record.
+     * @returns B_NO_ERROR on success (including when there is no log file), or an error code on failure.
+     */
+   status_t LoadLogRecords(uint64 afterUpdateID, Queue<PZGDatabaseUpdateRef> & retUpdates, bool & retLogIsClean) const;
+
+   /** Opens our log file for appending.  Any records already in the log file are kept. */
+   status_t OpenLogFile();
+
+   /** Appends the given PZGDatabaseUpdate as a record at the end of our log file.
+     * @note the log file is flushed after each record, so the record will survive the process crashing,
+     *       but it is not synced to disk (that only happens when a snapshot is written).
+     */
+   status_t AppendUpdate(const PZGDatabaseUpdate & dbUp);
+
+   /** Replaces our snapshot file with one containing the given database state, and then empties our log file.
+     * This is a synchronous convenience wrapper around BeginSnapshot(), WriteSnapshotFile() and EndSnapshot().
+     * @param stateID the database's current state ID
+     * @param dbChecksum the database's current checksum
+     * @param dbStateMsg the database's current state, as returned by SaveLocalDatabaseToMessage()
+     */
+   status_t WriteSnapshot(uint64 stateID, uint64 dbChecksum, const ConstMessageRef & dbStateMsg);
+
+   /** Starts a new snapshot:  moves the records in our log file into our previous-log file, and starts an empty log file
+     * for the records that will come after the snapshot.  Call WriteSnapshotFile() next (in any thread), and then EndSnapshot().
+     * @note even on failure, our log file will be open for appending afterwards, if at all possible.
+     */
+   status_t BeginSnapshot();
+
+   /** Writes the given database state to a temporary file, syncs it to disk, and renames it into place as our snapshot file,
+     * so that a crash while the snapshot is being written will leave the previous snapshot (and logs) intact.
+     * This method is thread-safe, since it doesn't touch any PZGPersistentUpdateLog object.
+     * @param snapshotFilePath the path of the snapshot file to replace (as returned by GetSnapshotFilePath())
+     * @param stateID the database's state ID
+     * @param dbChecksum the database's checksum
+     * @param flatDBState the flattened Message holding the database's state.  It will be compressed before it is written.
+     */
+   static status_t WriteSnapshotFile(const String & snapshotFilePath, uint64 stateID, uint64 dbChecksum, const ConstByteBufferRef & flatDBState);
+
+   /** Finishes the snapshot that was started by BeginSnapshot().
+     * @param snapshotWritten true iff WriteSnapshotFile() succeeded.  If true, our previous-log file is deleted;
+     *                        otherwise its records are merged back into our log file, so that they won't be lost.
+     */
+   void EndSnapshot(bool snapshotWritten);
+
+   /** Returns the path of our snapshot file. */
+   MUSCLE_NODISCARD const String & GetSnapshotFilePath() const {return _snapshotFilePath;}
+
+   /** Closes our log file, if it is open. */
+   void Close();
+
+   /** Returns the number of records we have appended to the log since our last snapshot was written. */
+   MUSCLE_NODISCARD uint32 GetNumUpdatesSinceSnapshot() const {return _numUpdatesSinceSnapshot;}
+
+private:
+   PZGPersistentUpdateLog(const PZGPersistentUpdateLog &);  // deliberately unimplemented
+   PZGPersistentUpdateLog & operator=(const PZGPersistentUpdateLog &);  // deliberately unimplemented
+
+   status_t MergePreviousLogFile();
+
+   String _logFilePath;
+   String _prevLogFilePath;
+   String _snapshotFilePath;
+   FILE * _logFile;
+   uint32 _numUpdatesSinceSnapshot;
+};
+DECLARE_REFTYPES(PZGPersistentUpdateLog);
+
+}  // end namespace zg_private
+
+#endif
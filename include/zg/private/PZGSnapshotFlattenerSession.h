@@ -0,0 +1,45 @@
+#ifndef PZGSnapshotFlattenerSession_h
+#define PZGSnapshotFlattenerSession_h
+
+#include "zg/private/PZGThreadedSession.h"
+#include "zg/private/PZGDatabaseUpdate.h"
+
+namespace zg_private
+{
+
+class PZGNetworkIOSession;
+
+/** This session manages a helper thread that flattens (and compresses) full-database-state snapshots on behalf
+  * of the senior peer, so that sending a large database to a junior peer doesn't block the senior peer's main thread.
+  * Snapshots are flattened in the order they were submitted, and each result is passed back to the
+  * PZGNetworkIOSession via its OutgoingSnapshotFlattened() method.
+  */
+class PZGSnapshotFlattenerSession : public PZGThreadedSession
+{
+public:
+   PZGSnapshotFlattenerSession(PZGNetworkIOSession * master);
+
+   virtual void EndSession();
+
+   MUSCLE_NODISCARD virtual const char * GetTypeName() const {return "Snapshot Flattener";}
+
+   /** Called from the main thread:  Asks our helper thread to flatten the given snapshot.
+     * @param snapshotID the ID of the PZGOutgoingSnapshot the flattened bytes are intended for.
+     * @param dbUp the PZGDatabaseUpdate to flatten.  Its payload must be safe to access from another thread
+     *             (i.e. it must have been created by SaveLocalDatabaseToSnapshot()).
+     * @returns B_NO_ERROR if the job was sent to the helper thread, or an error code on failure.
+     */
+   status_t FlattenSnapshot(uint64 snapshotID, const ConstPZGDatabaseUpdateRef & dbUp);
+
+protected:
+   virtual void InternalThreadEntry();
+   virtual void MessageReceivedFromInternalThread(const MessageRef & msg, uint32 numLeft);
+
+private:
+   PZGNetworkIOSession * _master;
+};
+DECLARE_REFTYPES(PZGSnapshotFlattenerSession);
+
+}  // end namespace zg_private
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef PZGSnapshotTransfer_h
+#define PZGSnapshotTransfer_h
+
+#include "zg/private/PZGDatabaseUpdate.h"
+#include "util/ByteBuffer.h"
+#include "util/RefCount.h"
+#include "util/TimeUtilityFunctions.h"
+
+namespace zg_private
+{
+
+static const uint32 PZG_SNAPSHOT_CHUNK_SIZE                = 64*1024;             // max number of bytes of snapshot data to send in a single chunk-reply
+static const uint32 PZG_MAX_SNAPSHOT_CHUNKS_IN_FLIGHT      = 4;                   // max number of chunk-requests a junior peer will have outstanding at once
+static const uint64 PZG_SNAPSHOT_TRANSFER_TIMEOUT_MICROS   = SecondsToMicros(60); // how long an unused snapshot (or partially received snapshot) is kept around for
+
+/** This class holds the flattened full-database-state that a senior peer is sending to one or more junior peers,
+  * chunk by chunk.  It is kept around for a while after it was last used, so that a junior peer whose TCP
+  * connection got dropped can resume its download where it left off.  If the database supports snapshots,
+  * the state is flattened by a helper thread, and this object isn't ready to serve chunks until that is done.
+  */
+class PZGOutgoingSnapshot : public RefCountable
+{
+public:
+   /** Constructor
+     * @param snapshotID a unique ID for this snapshot (unique within the senior peer's process, that is)
+     * @param whichDatabase index of the database this snapshot is of
+     * @param databaseStateID the state ID of the database when this snapshot was taken
+     * @param flattenedUpdate a flattened PZGDatabaseUpdate (of type PZG_DATABASE_UPDATE_TYPE_REPLACE) holding the database's state,
+     *                        or a NULL reference if the state is still being flattened (see SetFlattenedUpdate()).
+     */
+   PZGOutgoingSnapshot(uint64 snapshotID, uint32 whichDatabase, uint64 databaseStateID, const ConstByteBufferRef & flattenedUpdate)
+      : _snapshotID(snapshotID)
+      , _whichDatabase(whichDatabase)
+      , _databaseStateID(databaseStateID)
+      , _flattenedUpdate(flattenedUpdate)
+      , _isReady(flattenedUpdate() != NULL)
+      , _lastAccessTime(GetRunTime64())
+   {
+      // empty
+   }
+
+   MUSCLE_NODISCARD uint64 GetSnapshotID()                            const {return _snapshotID;}
+   MUSCLE_NODISCARD uint32 GetDatabaseIndex()                         const {return _whichDatabase;}
+   MUSCLE_NODISCARD uint64 GetDatabaseStateID()                       const {return _databaseStateID;}
+   MUSCLE_NODISCARD const ConstByteBufferRef & GetFlattenedUpdate()   const {return _flattenedUpdate;}
+   MUSCLE_NODISCARD uint32 GetTotalNumBytes()                         const {return _flattenedUpdate() ? _flattenedUpdate()->GetNumBytes() : 0;}
+
+   /** Returns true iff our flattened state is available (or we've given up on it because flattening failed) */
+   MUSCLE_NODISCARD bool IsReady() const {return _isReady;}
+
+   /** Returns true iff our helper thread tried to flatten our state but failed, i.e. this snapshot can't ever be served */
+   MUSCLE_NODISCARD bool HasFailed() const {return ((_isReady)&&(_flattenedUpdate() == NULL));}
+
+   /** Called when our helper thread has finished flattening the database state.
+     * @param optFlattenedUpdate the flattened PZGDatabaseUpdate, or a NULL reference if flattening failed.
+     */
+   void SetFlattenedUpdate(const ConstByteBufferRef & optFlattenedUpdate) {_flattenedUpdate = optFlattenedUpdate; _isReady = true; Touch();}
+
+   /** Returns the time at which this snapshot was last used, or created */
+   MUSCLE_NODISCARD uint64 GetLastAccessTime() const {return _lastAccessTime;}
+
+   /** Records that this snapshot was just used, so that it won't expire for a while yet */
+   void Touch() {_lastAccessTime = GetRunTime64();}
+
+private:
+   const uint64 _snapshotID;
+   const uint32 _whichDatabase;
+   const uint64 _databaseStateID;
+   ConstByteBufferRef _flattenedUpdate;
+   bool _isReady;
+   uint64 _lastAccessTime;
+};
+DECLARE_REFTYPES(PZGOutgoingSnapshot);
+
+/** This class holds the state of a junior peer's download of a full-database-state from the senior peer.
+  * The chunks are requested in order, with no more than PZG_MAX_SNAPSHOT_CHUNKS_IN_FLIGHT requests outstanding
+  * at any time, and are copied into a pre-allocated buffer as they arrive.  If the TCP connection is dropped,
+  * the download can be resumed from the first byte we haven't yet received.
+  */
+class PZGIncomingSnapshot : public RefCountable
+{
+public:
+   PZGIncomingSnapshot();
+
+   /** Discards any data we've received so far, so that the next download will start over with a fresh snapshot. */
+   void Reset();
+
+   /** Should be called when the TCP connection to the senior peer has been dropped or recreated.  Forgets about
+     * any requests we had outstanding, so that the download will resume from the first byte we haven't yet received.
+     */
+   void ConnectionReset();
+
+   /** If it's time to request another chunk, writes the offset of that chunk into (retOffset), records the request
+     * as outstanding, and returns true.  Otherwise returns false.
+     */
+   bool GetNextChunkRequestOffset(uint32 & retOffset);
+
+   /** Called when a chunk-reply has been received from the senior peer.  If the chunk is the one we need next,
+     * its data is added to our buffer; otherwise it is ignored.
+     * @param snapshotID the ID of the snapshot the chunk came from.  If this doesn't match the ID of the snapshot
+     *                   we've been receiving, we'll discard what we have and start over with the new snapshot.
+     * @param offset the offset of the chunk's data within the snapshot
+     * @param totalNumBytes the total size of the snapshot
+     * @param data pointer to the chunk's data
+     * @param numBytes number of bytes that (data) points to
+     * @returns B_NO_ERROR on success, or an error code if the chunk was invalid, or we ran out of memory.
+     */
+   status_t ChunkReceived(uint64 snapshotID, uint32 offset, uint32 totalNumBytes, const uint8 * data, uint32 numBytes);
+
+   /** Returns true iff we've received every byte of the snapshot */
+   MUSCLE_NODISCARD bool IsComplete() const {return ((_snapshotID != 0)&&(_numBytesReceived == GetTotalNumBytes()));}
+
+   /** Unflattens and returns the PZGDatabaseUpdate we've received.  Only valid if IsComplete() returns true. */
+   PZGDatabaseUpdateRef GetReceivedUpdate() const;
+
+   /** Returns the ID of the snapshot we are receiving, or 0 if we don't know yet. */
+   MUSCLE_NODISCARD uint64 GetSnapshotID() const {return _snapshotID;}
+
+   MUSCLE_NODISCARD uint32 GetTotalNumBytes()       const {return _buf() ? _buf()->GetNumBytes() : 0;}
+   MUSCLE_NODISCARD uint32 GetNumBytesReceived()    const {return _numBytesReceived;}
+   MUSCLE_NODISCARD uint32 GetNumRequestsInFlight() const {return _numRequestsInFlight;}
+   MUSCLE_NODISCARD uint64 GetLastAccessTime()      const {return _lastAccessTime;}
+
+private:
+   uint64 _snapshotID;          // ID of the snapshot we're receiving, or 0 if we don't know yet
+   ByteBufferRef _buf;          // where we assemble the flattened PZGDatabaseUpdate (pre-allocated to its full size)
+   uint32 _numBytesReceived;    // how many bytes at the front of (_buf) are valid
+   uint32 _nextRequestOffset;   // offset of the next chunk we will request
+   uint32 _numRequestsInFlight; // how many chunk-requests we have outstanding
+   uint64 _lastAccessTime;      // when we last sent a request or received a reply
+};
+DECLARE_REFTYPES(PZGIncomingSnapshot);
+
+}  // end namespace zg_private
+
+#endif
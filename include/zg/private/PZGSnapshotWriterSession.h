@@ -0,0 +1,47 @@
+#ifndef PZGSnapshotWriterSession_h
+#define PZGSnapshotWriterSession_h
+
+#include "zg/private/PZGThreadedSession.h"
+#include "util/ByteBuffer.h"
+
+namespace zg_private
+{
+
+class PZGDatabaseState;
+
+/** This session manages a helper thread that compresses a database's on-disk snapshots and writes (and syncs)
+  * them to disk, when ZG has been configured (via ZGPeerSettings::SetPersistenceDirectory()) to keep a copy
+  * of its databases on disk.  That way a large database's periodic snapshot doesn't block the main thread.
+  * Snapshots are written in the order they were submitted, and each result is passed back to the
+  * PZGDatabaseState via its PersistentSnapshotWritten() method.
+  */
+class PZGSnapshotWriterSession : public PZGThreadedSession
+{
+public:
+   PZGSnapshotWriterSession(PZGDatabaseState * dbState);
+
+   virtual void EndSession();
+
+   MUSCLE_NODISCARD virtual const char * GetTypeName() const {return "Snapshot Writer";}
+
+   /** Called from the main thread:  Asks our helper thread to write the given database state as a snapshot file.
+     * @param snapshotFilePath the path of the snapshot file to replace
+     * @param stateID the database's state ID
+     * @param dbChecksum the database's checksum
+     * @param flatDBState the flattened Message holding the database's state
+     * @returns B_NO_ERROR if the job was sent to the helper thread, or an error code on failure.
+     */
+   status_t WriteSnapshot(const String & snapshotFilePath, uint64 stateID, uint64 dbChecksum, const ConstByteBufferRef & flatDBState);
+
+protected:
+   virtual void InternalThreadEntry();
+   virtual void MessageReceivedFromInternalThread(const MessageRef & msg, uint32 numLeft);
+
+private:
+   PZGDatabaseState * _dbState;
+};
+DECLARE_REFTYPES(PZGSnapshotWriterSession);
+
+}  // end namespace zg_private
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "reflector/AbstractReflectSession.h"
 #include "zg/ZGPeerID.h"
+#include "zg/private/PZGSnapshotTransfer.h"
 #include "zg/private/PZGUpdateBackOrderKey.h"
 
 namespace zg_private
@@ -28,16 +29,27 @@ public:
    /** Note that this may return an invalid Peer ID if we don't know who is calling us yet */
    MUSCLE_NODISCARD const ZGPeerID & GetRemotePeerID() const {return _remotePeerID;}
 
-   status_t RequestBackOrderFromSeniorPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError);
+   status_t RequestBackOrderFromPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError);
+
+   /** Called when a snapshot has finished being flattened:  handles any chunk-requests we had deferred until then. */
+   void HandleDeferredSnapshotChunkRequests();
 
 private:
    void RegisterMyself();
    void UnregisterMyself(bool forGood);
+   void BackOrderRangeRequestReceived(const PZGUpdateBackOrderKey & ubok);
+   void BackOrderRangeReplyReceived(const MessageRef & msg);
+   void RangeBackOrderResultReceived(const PZGUpdateBackOrderKey & rangeKey, uint64 updateID, const ConstPZGDatabaseUpdateRef & optDBUp);
+   void SnapshotChunkRequestReceived(const MessageRef & msg);
+   void SnapshotChunkReplyReceived(const MessageRef & msg);
+   status_t SendSnapshotChunkRequests(const PZGUpdateBackOrderKey & ubok, PZGIncomingSnapshot & snap, bool dueToChecksumError);
+   void SnapshotTransferFinished(const PZGUpdateBackOrderKey & ubok, const ConstPZGDatabaseUpdateRef & optDBUp);
 
    ZGPeerID _remotePeerID;
    PZGNetworkIOSession * _master;
 
-   Hashtable<PZGUpdateBackOrderKey, Void> _backorders;
+   Hashtable<PZGUpdateBackOrderKey, uint64> _backorders;  // back-orders we have outstanding -> ID of the next update we expect for that back-order
+   Queue<MessageRef> _deferredSnapshotChunkRequests;  // chunk-requests for snapshots that are still being flattened
 };
 DECLARE_REFTYPES(PZGUnicastSession);
 
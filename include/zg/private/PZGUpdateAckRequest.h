@@ -0,0 +1,63 @@
+#ifndef PZGUpdateAckRequest_h
+#define PZGUpdateAckRequest_h
+
+#include "zg/ZGPeerID.h"
+#include "zg/private/PZGConstants.h"
+
+namespace zg_private
+{
+
+/** This class holds the senior peer's record of a peer's request to be told when a database update has been applied on
+  * a given number of peers (see ZGPeerSession::RequestUpdateDatabaseStateWithAcknowledgement()).
+  */
+class PZGUpdateAckRequest
+{
+public:
+   PZGUpdateAckRequest() : _ackID(0), _numPeersWanted(0), _updateID(0) {/* empty */}
+
+   /** Constructor:  Reads the acknowledgement-request fields (if any) out of an update-request Message.
+     * @param requesterID ID of the peer that sent (msg)
+     * @param msg the update-request Message (or a worker-thread job Message that the fields were copied into)
+     */
+   PZGUpdateAckRequest(const ZGPeerID & requesterID, const Message & msg)
+      : _requesterID(requesterID)
+      , _ackID((uint64) msg.GetInt64(PZG_PEER_NAME_ACK_ID))
+      , _numPeersWanted((uint32) msg.GetInt32(PZG_PEER_NAME_NUM_PEERS))
+      , _updateID(0)
+   {
+      // empty
+   }
+
+   /** Returns true iff the requesting peer asked to be acknowledged */
+   MUSCLE_NODISCARD bool IsValid() const {return (_ackID != 0);}
+
+   MUSCLE_NODISCARD const ZGPeerID & GetRequesterID() const {return _requesterID;}
+   MUSCLE_NODISCARD uint64 GetAckID() const {return _ackID;}
+
+   /** Returns how many peers (including the senior peer) must have applied the update before it is acknowledged, or ZG_ALL_PEERS */
+   MUSCLE_NODISCARD uint32 GetNumPeersWanted() const {return _numPeersWanted;}
+
+   /** Returns the ID of the database update this acknowledgement is waiting on, or 0 if it isn't known yet */
+   MUSCLE_NODISCARD uint64 GetUpdateID() const {return _updateID;}
+   void SetUpdateID(uint64 updateID) {_updateID = updateID;}
+
+   /** Copies our acknowledgement-request fields into (msg), so that a PZGUpdateAckRequest can be re-created from it later.
+     * @param msg the Message to add the fields to
+     */
+   status_t SaveToMessage(Message & msg) const
+   {
+      if (IsValid() == false) return B_NO_ERROR;
+      MRETURN_ON_ERROR(msg.AddInt64(PZG_PEER_NAME_ACK_ID,    _ackID));
+      return           msg.AddInt32(PZG_PEER_NAME_NUM_PEERS, _numPeersWanted);
+   }
+
+private:
+   ZGPeerID _requesterID;
+   uint64 _ackID;
+   uint32 _numPeersWanted;
+   uint64 _updateID;
+};
+
+}  // end namespace zg_private
+
+#endif
@@ -11,32 +11,43 @@ enum {PZG_UPDATE_BACKORDER_KEY_TYPE = 1969385323}; /**< 'ubok' -- the type code
 
 /** This key represents a request to the senior peer to resend a PZGDatabaseUpdate to us, since we need it and don't have it.
   * That way the junior peer can keep track of what it has on order so as not to send orders for a given update more than once.
+  * A key may also represent a contiguous range of PZGDatabaseUpdates, so that a run of missing updates can be requested in a single round trip.
   */
 class PZGUpdateBackOrderKey : public PseudoFlattenable<PZGUpdateBackOrderKey>
 {
 public:
-   PZGUpdateBackOrderKey() : _whichDatabase(0), _updateID(0) {/* empty */}
-   PZGUpdateBackOrderKey(const ZGPeerID & targetPeerID, uint32 whichDatabase, uint64 updateID) : _targetPeerID(targetPeerID), _whichDatabase(whichDatabase), _updateID(updateID) {/* empty */}
+   PZGUpdateBackOrderKey() : _whichDatabase(0), _updateID(0), _lastUpdateID(0) {/* empty */}
+   PZGUpdateBackOrderKey(const ZGPeerID & targetPeerID, uint32 whichDatabase, uint64 updateID) : _targetPeerID(targetPeerID), _whichDatabase(whichDatabase), _updateID(updateID), _lastUpdateID(updateID) {/* empty */}
+   PZGUpdateBackOrderKey(const ZGPeerID & targetPeerID, uint32 whichDatabase, uint64 firstUpdateID, uint64 lastUpdateID) : _targetPeerID(targetPeerID), _whichDatabase(whichDatabase), _updateID(firstUpdateID), _lastUpdateID(lastUpdateID) {/* empty */}
 
    MUSCLE_NODISCARD const ZGPeerID & GetTargetPeerID() const {return _targetPeerID;}
    MUSCLE_NODISCARD uint32 GetDatabaseIndex() const {return _whichDatabase;}
+
+   /** Returns the ID of the requested update (or of the first requested update, if this key represents a range) */
    MUSCLE_NODISCARD uint64 GetDatabaseUpdateID() const {return _updateID;}
 
-   bool operator == (const PZGUpdateBackOrderKey & rhs) const {return ((_targetPeerID == rhs._targetPeerID)&&(_whichDatabase == rhs._whichDatabase)&&(_updateID == rhs._updateID));}
+   /** Returns the ID of the last requested update (which is the same as GetDatabaseUpdateID() unless this key represents a range) */
+   MUSCLE_NODISCARD uint64 GetLastDatabaseUpdateID() const {return _lastUpdateID;}
+
+   /** Returns true iff this key represents a request for more than one update */
+   MUSCLE_NODISCARD bool IsRange() const {return (_lastUpdateID > _updateID);}
+
+   bool operator == (const PZGUpdateBackOrderKey & rhs) const {return ((_targetPeerID == rhs._targetPeerID)&&(_whichDatabase == rhs._whichDatabase)&&(_updateID == rhs._updateID)&&(_lastUpdateID == rhs._lastUpdateID));}
    bool operator != (const PZGUpdateBackOrderKey & rhs) const {return !(*this==rhs);}
 
-   MUSCLE_NODISCARD uint32 HashCode() const {return _targetPeerID.HashCode()+(_whichDatabase*333)+CalculateHashCode(_updateID);}
-   MUSCLE_NODISCARD String ToString() const {return String("UBOK:  [%1] db=%2 updateID=%3").Arg(_targetPeerID).Arg(_whichDatabase).Arg(_updateID);}
+   MUSCLE_NODISCARD uint32 HashCode() const {return _targetPeerID.HashCode()+(_whichDatabase*333)+CalculateHashCode(_updateID)+(IsRange()?CalculateHashCode(_lastUpdateID):0);}
+   MUSCLE_NODISCARD String ToString() const {return IsRange() ? String("UBOK:  [%1] db=%2 updateIDs=%3-%4").Arg(_targetPeerID).Arg(_whichDatabase).Arg(_updateID).Arg(_lastUpdateID) : String("UBOK:  [%1] db=%2 updateID=%3").Arg(_targetPeerID).Arg(_whichDatabase).Arg(_updateID);}
 
    MUSCLE_NODISCARD static MUSCLE_CONSTEXPR bool IsFixedSize()     {return true;}
    MUSCLE_NODISCARD static MUSCLE_CONSTEXPR uint32 TypeCode()      {return PZG_UPDATE_BACKORDER_KEY_TYPE;}
-   MUSCLE_NODISCARD static MUSCLE_CONSTEXPR uint32 FlattenedSize() {return ZGPeerID::FlattenedSize() + sizeof(_whichDatabase) + sizeof(_updateID);}
+   MUSCLE_NODISCARD static MUSCLE_CONSTEXPR uint32 FlattenedSize() {return ZGPeerID::FlattenedSize() + sizeof(_whichDatabase) + sizeof(_updateID) + sizeof(_lastUpdateID);}
 
    void Flatten(DataFlattener flat) const
    {
       flat.WriteFlat(_targetPeerID);
       flat.WriteInt32(_whichDatabase);
       flat.WriteInt64(_updateID);
+      flat.WriteInt64(_lastUpdateID);
    }
 
    status_t Unflatten(DataUnflattener & unflat)
@@ -44,6 +55,7 @@ public:
       MRETURN_ON_ERROR(unflat.ReadFlat(_targetPeerID));
       _whichDatabase = unflat.ReadInt32();
       _updateID      = unflat.ReadInt64();
+      _lastUpdateID  = unflat.ReadInt64();
       return unflat.GetStatus();
    }
 
@@ -51,6 +63,7 @@ private:
    ZGPeerID _targetPeerID;
    uint32 _whichDatabase;
    uint64 _updateID;
+   uint64 _lastUpdateID;
 };
 
 }  // end namespace zg_private
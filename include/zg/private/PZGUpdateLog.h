@@ -0,0 +1,105 @@
+#ifndef PZGUpdateLog_h
+#define PZGUpdateLog_h
+
+#include "zg/private/PZGDatabaseUpdate.h"
+#include "util/Hashtable.h"
+#include "util/Queue.h"
+
+namespace zg_private
+{
+
+static const uint32 PZG_UPDATE_LOG_MAX_GAP = 64*1024;  // max number of empty slots we'll add to our ring to store an update past its end (or before its start)
+
+/** This class holds a database's recent PZGDatabaseUpdates, indexed by update ID.  Since update IDs are dense and
+  * increasing, the updates are kept in a ring buffer where slot #i holds the update whose ID is (GetFirstKeyWithDefault()+i),
+  * so that lookups, appends and trimming of the oldest update are all O(1) and don't allocate per update.
+  * Missing updates (e.g. multicast packets a junior peer didn't receive) are represented by empty slots.
+  * An update whose ID is too far past the end of the ring (e.g. one that a junior peer received while it is still
+  * far behind) is held in a small overflow table instead, until the ring catches up to it.
+  */
+class PZGUpdateLog
+{
+public:
+   /** Default constructor; creates an empty update-log */
+   PZGUpdateLog() : _firstID(0), _numItemsInRing(0) {/* empty */}
+
+   /** Adds (dbUp) to the log, replacing any update that was already in the log with the same ID.
+     * @param updateID the update's ID
+     * @param dbUp the update to add.  Must be non-NULL.
+     * @returns B_NO_ERROR on success, or an error code on failure.  B_RESOURCE_LIMIT is returned if (updateID) is
+     *          more than PZG_UPDATE_LOG_MAX_GAP before the oldest update in the log.
+     */
+   status_t Put(uint64 updateID, const ConstPZGDatabaseUpdateRef & dbUp);
+
+   /** Removes the update with the specified ID from the log.
+     * @param updateID the ID of the update to remove
+     * @param retRemoved on success, the removed update is written here
+     * @returns B_NO_ERROR on success, or B_DATA_NOT_FOUND if there was no such update in the log.
+     */
+   status_t Remove(uint64 updateID, ConstPZGDatabaseUpdateRef & retRemoved);
+
+   /** Removes all updates from the log */
+   void Clear();
+
+   /** Returns a pointer to the update with the specified ID, or NULL if there is no such update in the log. */
+   MUSCLE_NODISCARD const ConstPZGDatabaseUpdateRef * Get(uint64 updateID) const
+   {
+      if ((updateID >= _firstID)&&(updateID < GetRingEndID()))
+      {
+         const ConstPZGDatabaseUpdateRef & slot = _ring[(uint32)(updateID-_firstID)];
+         return slot() ? &slot : NULL;
+      }
+      return _overflow.Get(updateID);
+   }
+
+   /** Returns the update with the specified ID, or a NULL reference if there is no such update in the log. */
+   MUSCLE_NODISCARD const ConstPZGDatabaseUpdateRef & GetWithDefault(uint64 updateID) const
+   {
+      const ConstPZGDatabaseUpdateRef * ret = Get(updateID);
+      return ret ? *ret : GetDefaultObjectForType<ConstPZGDatabaseUpdateRef>();
+   }
+
+   /** Returns true iff the log contains an update with the specified ID */
+   MUSCLE_NODISCARD bool ContainsKey(uint64 updateID) const {return (Get(updateID) != NULL);}
+
+   MUSCLE_NODISCARD uint32 GetNumItems() const {return _numItemsInRing+_overflow.GetNumItems();}
+   MUSCLE_NODISCARD bool IsEmpty()       const {return ((_ring.IsEmpty())&&(_overflow.IsEmpty()));}
+   MUSCLE_NODISCARD bool HasItems()      const {return !IsEmpty();}
+
+   /** Returns the ID of the oldest update in the log, or (defaultID) if the log is empty */
+   MUSCLE_NODISCARD uint64 GetFirstKeyWithDefault(uint64 defaultID = 0) const {return _ring.HasItems() ? _firstID : _overflow.GetFirstKeyWithDefault(defaultID);}
+
+   /** Returns the ID of the newest update in the log, or (defaultID) if the log is empty */
+   MUSCLE_NODISCARD uint64 GetLastKeyWithDefault(uint64 defaultID = 0) const {return _overflow.HasItems() ? *_overflow.GetLastKey() : (_ring.HasItems() ? (GetRingEndID()-1) : defaultID);}
+
+   /** Returns the oldest update in the log, or a NULL reference if the log is empty */
+   MUSCLE_NODISCARD const ConstPZGDatabaseUpdateRef & GetFirstValue() const
+   {
+      if (_ring.HasItems()) return _ring.Head();
+      return _overflow.HasItems() ? *_overflow.GetFirstValue() : GetDefaultObjectForType<ConstPZGDatabaseUpdateRef>();
+   }
+
+   /** Returns the ID of the oldest update in the unbroken run of updates that ends with the specified update,
+     * or (uint64)-1 if the log doesn't contain the specified update.
+     * @param updateID ID of the last update in the run
+     */
+   MUSCLE_NODISCARD uint64 GetFirstKeyOfRunEndingAt(uint64 updateID) const;
+
+   /** Prints a line of text describing each update in the log, in ascending-ID order */
+   void Print(const OutputPrinter & p) const;
+
+private:
+   MUSCLE_NODISCARD uint64 GetRingEndID() const {return _firstID+_ring.GetNumItems();}  // ID one past our last ring slot
+   status_t AppendToRing(uint64 updateID, const ConstPZGDatabaseUpdateRef & dbUp);
+   void TrimEmptyRingSlots();
+   void AbsorbOverflowUpdates();
+
+   Queue<ConstPZGDatabaseUpdateRef> _ring;  // slot #i holds the update whose ID is (_firstID+i), or a NULL reference if we don't have that one
+   uint64 _firstID;                         // ID of the update in our first slot (our first and last slots are never empty)
+   uint32 _numItemsInRing;                  // number of non-empty slots in (_ring)
+   OrderedKeysHashtable<uint64, ConstPZGDatabaseUpdateRef> _overflow;  // updates whose IDs are more than PZG_UPDATE_LOG_MAX_GAP past the end of (_ring)
+};
+
+}  // end namespace zg_private
+
+#endif
@@ -0,0 +1,48 @@
+#include "zg/ZGChecksumUtilityFunctions.h"
+
+namespace zg {
+
+static const uint64 CHECKSUM64_PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64 CHECKSUM64_PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+
+static inline uint64 ReadChecksum64Word(const uint8 * p) {uint64 v; memcpy(&v, p, sizeof(v)); return B_LENDIAN_TO_HOST_INT64(v);}
+
+// Folds one 32-byte block into our four lanes.  Only 32x32->64-bit multiplies are used, since those vectorize well on all SIMD instruction sets.
+static inline void AccumulateChecksum64Block(uint64 * lanes, const uint8 * block)
+{
+   for (uint32 i=0; i<4; i++)
+   {
+      const uint64 v = ReadChecksum64Word(&block[i*sizeof(uint64)]);
+      const uint64 k = v ^ (CHECKSUM64_PRIME1*(i+1));
+      lanes[i] += v + ((k & 0xFFFFFFFF) * (k >> 32));
+   }
+}
+
+uint64 CalculateChecksum64(const uint8 * bytes, uint32 numBytes, uint64 seed)
+{
+   uint64 lanes[4] = {seed+CHECKSUM64_PRIME1, seed+CHECKSUM64_PRIME2, seed, seed-CHECKSUM64_PRIME1};
+
+   const uint32 numFullBlocks = numBytes/32;
+   for (uint32 i=0; i<numFullBlocks; i++) AccumulateChecksum64Block(lanes, &bytes[i*32]);
+
+   const uint32 numTailBytes = numBytes%32;
+   if (numTailBytes > 0)
+   {
+      uint8 tail[32]; memset(tail, 0, sizeof(tail));
+      memcpy(tail, &bytes[numFullBlocks*32], numTailBytes);
+      AccumulateChecksum64Block(lanes, tail);
+   }
+
+   // Combine the lanes (order-dependently, so that swapping two blocks changes the result)
+   uint64 ret = ((uint64)numBytes)*CHECKSUM64_PRIME2;
+   for (uint32 i=0; i<4; i++) ret = (ret ^ MixChecksum64(lanes[i])) * CHECKSUM64_PRIME1;
+   return MixChecksum64(ret);
+}
+
+uint64 CalculateChecksum64(const Message & msg)
+{
+   ConstByteBufferRef flatBuf = msg.FlattenToByteBuffer();
+   return flatBuf() ? CalculateChecksum64(flatBuf()->GetBuffer(), flatBuf()->GetNumBytes()) : 0;
+}
+
+}  // end namespace zg
@@ -11,7 +11,10 @@ static const String DBPEERSESSION_NAME_PAYLOAD     = "pay";  // Message field-na
 static const String DBPEERSESSION_NAME_TARGETDBIDX = "tdb";  // int32 field-name
 static const String DBPEERSESSION_NAME_SOURCEDBIDX = "sdb";  // int32 field-name
 
-ZGDatabasePeerSession :: ZGDatabasePeerSession(const ZGPeerSettings & zgPeerSettings) : ZGPeerSession(zgPeerSettings)
+ZGDatabasePeerSession :: ZGDatabasePeerSession(const ZGPeerSettings & zgPeerSettings)
+   : ZGPeerSession(zgPeerSettings)
+   , _speculativeApplyDB(-1)
+   , _speculativeRollbackDB(-1)
 {
    // empty
 }
@@ -34,8 +37,10 @@ status_t ZGDatabasePeerSession :: AttachedToServer()
    return ZGPeerSession::AttachedToServer();  // must be done last!
 }
 
-void ZGDatabasePeerSession :: ResetLocalDatabaseToDefault(uint32 whichDatabase, uint32 & dbChecksum)
+void ZGDatabasePeerSession :: ResetLocalDatabaseToDefault(uint32 whichDatabase, uint64 & dbChecksum)
 {
+   RollBackSpeculativeUpdates(whichDatabase);  // authoritative changes must be applied to the authoritative state
+
    IDatabaseObject * db = GetDatabaseObject(whichDatabase);
    if (db)
    {
@@ -44,8 +49,10 @@ void ZGDatabasePeerSession :: ResetLocalDatabaseToDefault(uint32 whichDatabase,
    }
 }
 
-ConstMessageRef ZGDatabasePeerSession :: SeniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & seniorDoMsg)
+ConstMessageRef ZGDatabasePeerSession :: SeniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & seniorDoMsg)
 {
+   RollBackSpeculativeUpdates(whichDatabase);  // in case we just became the senior peer
+
    IDatabaseObject * db = GetDatabaseObject(whichDatabase);
    if (db == NULL) return B_BAD_ARGUMENT;
 
@@ -54,8 +61,10 @@ ConstMessageRef ZGDatabasePeerSession :: SeniorUpdateLocalDatabase(uint32 whichD
    return ret;
 }
 
-status_t ZGDatabasePeerSession :: JuniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & juniorDoMsg)
+status_t ZGDatabasePeerSession :: JuniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & juniorDoMsg)
 {
+   RollBackSpeculativeUpdates(whichDatabase);
+
    IDatabaseObject * db = GetDatabaseObject(whichDatabase);
    if (db == NULL) return B_BAD_ARGUMENT;
 
@@ -69,14 +78,39 @@ MessageRef ZGDatabasePeerSession :: SaveLocalDatabaseToMessage(uint32 whichDatab
    IDatabaseObject * db = GetDatabaseObject(whichDatabase);
    if (db == NULL) return B_BAD_ARGUMENT;
 
+   // Our speculative updates mustn't leak out to other peers (or to disk), so we hand out the authoritative state instead
+   const SpeculativeBaseState * baseState = _speculativeBaseStates.Get(whichDatabase);
+   if (baseState)
+   {
+      if (baseState->GetState()()) return GetMessageFromPool(*baseState->GetState()());
+
+      // The object undoes its own speculative updates, so we have to undo them to get at the authoritative state (they'll be re-applied on our next Pulse())
+      const_cast<ZGDatabasePeerSession *>(this)->RollBackSpeculativeUpdates(whichDatabase);
+   }
+
    MessageRef msg = GetMessageFromPool();
    MRETURN_ON_ERROR(msg);
    MRETURN_ON_ERROR(db->SaveToArchive(msg));
    return msg;
 }
 
-status_t ZGDatabasePeerSession :: SetLocalDatabaseFromMessage(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & newDBStateMsg)
+ConstMessageRef ZGDatabasePeerSession :: SaveLocalDatabaseToSnapshot(uint32 whichDatabase) const
 {
+   const SpeculativeBaseState * baseState = _speculativeBaseStates.Get(whichDatabase);
+   if (baseState)
+   {
+      if (baseState->GetState()()) return baseState->GetState();  // never modified, so it's as good as a snapshot
+      const_cast<ZGDatabasePeerSession *>(this)->RollBackSpeculativeUpdates(whichDatabase);  // see SaveLocalDatabaseToMessage()
+   }
+
+   const IDatabaseObject * db = GetDatabaseObject(whichDatabase);
+   return db ? db->SaveToSnapshot() : ConstMessageRef();
+}
+
+status_t ZGDatabasePeerSession :: SetLocalDatabaseFromMessage(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & newDBStateMsg)
+{
+   RollBackSpeculativeUpdates(whichDatabase);
+
    IDatabaseObject * db = GetDatabaseObject(whichDatabase);
    if (db == NULL) return B_BAD_ARGUMENT;
 
@@ -85,8 +119,29 @@ status_t ZGDatabasePeerSession :: SetLocalDatabaseFromMessage(uint32 whichDataba
    return ret;
 }
 
-uint32 ZGDatabasePeerSession :: CalculateLocalDatabaseChecksum(uint32 whichDatabase) const
+ConstMessageRef ZGDatabasePeerSession :: SeniorRepairLocalDatabase(uint32 whichDatabase, const ConstMessageRef & repairRequestMsg) const
 {
+   const IDatabaseObject * db = GetDatabaseObject(whichDatabase);
+   return db ? db->SeniorRepair(repairRequestMsg) : ConstMessageRef(B_BAD_ARGUMENT);
+}
+
+status_t ZGDatabasePeerSession :: JuniorRepairLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & optRepairReplyMsg, MessageRef & retNextRequestMsg)
+{
+   RollBackSpeculativeUpdates(whichDatabase);
+
+   IDatabaseObject * db = GetDatabaseObject(whichDatabase);
+   if (db == NULL) return B_BAD_ARGUMENT;
+
+   const status_t ret = db->JuniorRepair(optRepairReplyMsg, retNextRequestMsg);
+   dbChecksum = db->GetCurrentChecksum();
+   return ret;
+}
+
+uint64 ZGDatabasePeerSession :: CalculateLocalDatabaseChecksum(uint32 whichDatabase) const
+{
+   const SpeculativeBaseState * baseState = _speculativeBaseStates.Get(whichDatabase);
+   if (baseState) return baseState->GetChecksum();  // the ZG layer only knows about the authoritative state
+
    IDatabaseObject * db = GetDatabaseObject(whichDatabase);
    return db ? db->CalculateChecksum() : 0;
 }
@@ -116,11 +171,190 @@ void ZGDatabasePeerSession :: PeerHasComeOnline(const ZGPeerID & peerID, const C
 void ZGDatabasePeerSession :: LocalSeniorPeerStatusChanged()
 {
    ZGPeerSession::LocalSeniorPeerStatusChanged();
+   if (GetPeerSettings().ArePerDatabaseSeniorPeersEnabled()) return;  // in that case, DatabaseSeniorPeerChanged() notifies each object separately
 
    const uint32 numDBs = _databaseObjects.GetNumItems();
    for (uint32 i=0; i<numDBs; i++) _databaseObjects[i]()->LocalSeniorPeerStatusChanged();
 }
 
+void ZGDatabasePeerSession :: DatabaseSeniorPeerChanged(uint32 whichDB, const ZGPeerID & oldSeniorPeerID, const ZGPeerID & newSeniorPeerID)
+{
+   ZGPeerSession::DatabaseSeniorPeerChanged(whichDB, oldSeniorPeerID, newSeniorPeerID);
+
+   const ZGPeerID & localPeerID = GetLocalPeerID();
+   if (((oldSeniorPeerID == localPeerID) != (newSeniorPeerID == localPeerID))&&(_databaseObjects.IsIndexValid(whichDB))) _databaseObjects[whichDB]()->LocalSeniorPeerStatusChanged();
+}
+
+status_t ZGDatabasePeerSession :: RequestSpeculativeUpdateDatabaseState(uint32 whichDatabase, const MessageRef & databaseUpdateMsg)
+{
+   if ((GetDatabaseObject(whichDatabase) == NULL)||(databaseUpdateMsg() == NULL)) return B_BAD_ARGUMENT;
+
+   // The senior peer applies its updates right away anyway, and a worker thread could be modifying the database while we speculate
+   if ((IAmTheSeniorPeerForDatabase(whichDatabase))||(GetPeerSettings().AreDatabaseWorkerThreadsEnabled())) return RequestUpdateDatabaseState(whichDatabase, databaseUpdateMsg);
+
+   uint64 ackID = 0;
+   MRETURN_ON_ERROR(RequestUpdateDatabaseStateWithAcknowledgement(whichDatabase, databaseUpdateMsg, 1, &ackID));  // the acknowledgement will tell us which update our request became
+   MRETURN_ON_ERROR(_speculativeUpdates.Put(ackID, SpeculativeUpdate(whichDatabase, databaseUpdateMsg)));
+
+   if (_speculativeReapplyPending.ContainsKey(whichDatabase)) return B_NO_ERROR;  // it'll be applied along with the others, on our next Pulse()
+
+   const status_t ret = ApplySpeculativeUpdate(whichDatabase, ackID);
+   if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "RequestSpeculativeUpdateDatabaseState:  Unable to apply speculative update to database #" UINT32_FORMAT_SPEC ", it will be seen when the senior peer executes it. [%s]\n", whichDatabase, ret());
+   return B_NO_ERROR;  // the request was sent, which is what matters
+}
+
+bool ZGDatabasePeerSession :: HasSpeculativeUpdates(uint32 whichDatabase) const
+{
+   for (ConstHashtableIterator<uint64, SpeculativeUpdate> iter(_speculativeUpdates); iter.HasData(); iter++) if (iter.GetValue().GetDatabaseIndex() == whichDatabase) return true;
+   return false;
+}
+
+status_t ZGDatabasePeerSession :: ApplySpeculativeUpdate(uint32 whichDatabase, uint64 ackID)
+{
+   IDatabaseObject * db = GetDatabaseObject(whichDatabase);
+   const SpeculativeUpdate * su = _speculativeUpdates.Get(ackID);
+   if ((db == NULL)||(su == NULL)) return B_BAD_ARGUMENT;
+
+   const ConstMessageRef seniorDoMsg = su->GetSeniorDoMessage();  // (su) might not stay valid while the update is being applied
+
+   // Before the first speculative update is applied, we note the authoritative state's checksum, and (unless the
+   // object can undo its own updates) save the authoritative state itself, so that we can roll back to it later
+   const SpeculativeBaseState * baseState = _speculativeBaseStates.Get(whichDatabase);
+   if (baseState == NULL)
+   {
+      ConstMessageRef stateMsg;
+      if (db->CanUndoSpeculativeUpdates() == false)
+      {
+         stateMsg = db->SaveToSnapshot();
+         if (stateMsg() == NULL)
+         {
+            MessageRef archiveMsg = GetMessageFromPool();
+            MRETURN_OOM_ON_NULL(archiveMsg());
+            MRETURN_ON_ERROR(db->SaveToArchive(archiveMsg));
+            stateMsg = archiveMsg;
+         }
+      }
+
+      baseState = _speculativeBaseStates.PutAndGet(whichDatabase, SpeculativeBaseState(stateMsg, db->GetCurrentChecksum()));
+      MRETURN_OOM_ON_NULL(baseState);
+   }
+
+   const bool undoBySavedState = (baseState->GetState()() != NULL);
+
+   _speculativeApplyDB = whichDatabase;
+   const ConstMessageRef resultMsg = undoBySavedState ? db->SeniorUpdate(seniorDoMsg) : db->SpeculativeSeniorUpdate(seniorDoMsg);
+   _speculativeApplyDB = -1;
+   MRETURN_ON_ERROR(resultMsg.GetStatus());
+
+   SpeculativeUpdate * appliedSU = _speculativeUpdates.Get(ackID);
+   if (appliedSU) appliedSU->SetApplied(undoBySavedState ? ConstMessageRef() : resultMsg);  // a junior-Message from SeniorUpdate() is of no use to us, since only the senior peer's version counts
+   return B_NO_ERROR;
+}
+
+void ZGDatabasePeerSession :: RollBackSpeculativeUpdates(uint32 whichDatabase)
+{
+   SpeculativeBaseState baseState;
+   if (_speculativeBaseStates.Remove(whichDatabase, baseState).IsError()) return;  // nothing to roll back
+
+   IDatabaseObject * db = GetDatabaseObject(whichDatabase);
+   if (db)
+   {
+      status_t ret;
+      _speculativeRollbackDB = whichDatabase;
+      if (baseState.GetState()()) ret = db->SetFromArchive(baseState.GetState());
+      else
+      {
+         // Undo our applied updates, most-recently-applied first, so that only the data they changed gets touched
+         for (HashtableIterator<uint64, SpeculativeUpdate> iter(_speculativeUpdates, HTIT_FLAG_BACKWARDS); iter.HasData(); iter++)
+         {
+            const SpeculativeUpdate & su = iter.GetValue();
+            if ((su.GetDatabaseIndex() == whichDatabase)&&(su.IsApplied())) ret |= db->UndoSpeculativeSeniorUpdate(su.GetUndoMessage());
+         }
+      }
+      _speculativeRollbackDB = -1;
+      if (ret.IsError()) LogTime(MUSCLE_LOG_CRITICALERROR, "RollBackSpeculativeUpdates:  Unable to restore the authoritative state of database #" UINT32_FORMAT_SPEC "! [%s]\n", whichDatabase, ret());
+      else if (db->GetCurrentChecksum() != baseState.GetChecksum()) LogTime(MUSCLE_LOG_CRITICALERROR, "RollBackSpeculativeUpdates:  Restored state of database #" UINT32_FORMAT_SPEC " has checksum " XINT64_FORMAT_SPEC ", expected " XINT64_FORMAT_SPEC "!\n", whichDatabase, db->GetCurrentChecksum(), baseState.GetChecksum());
+   }
+
+   bool hasUpdates = false;
+   for (HashtableIterator<uint64, SpeculativeUpdate> iter(_speculativeUpdates); iter.HasData(); iter++)
+   {
+      SpeculativeUpdate & su = iter.GetValue();
+      if (su.GetDatabaseIndex() == whichDatabase)
+      {
+         su.SetRolledBack();
+         hasUpdates = true;
+      }
+   }
+   if (hasUpdates) ScheduleSpeculativeUpdatesReapply(whichDatabase);  // whatever the senior peer hasn't executed yet still needs to be visible
+}
+
+void ZGDatabasePeerSession :: ReapplySpeculativeUpdates(uint32 whichDatabase)
+{
+   // Updates that the senior peer has executed are now part of our authoritative state, so they're done being speculative
+   const uint64 curStateID = GetCurrentDatabaseStateID(whichDatabase);
+   for (HashtableIterator<uint64, SpeculativeUpdate> iter(_speculativeUpdates); iter.HasData(); iter++)
+   {
+      const SpeculativeUpdate & su = iter.GetValue();
+      if ((su.GetDatabaseIndex() != whichDatabase)||(su.IsApplied())) continue;
+
+      if ((su.GetUpdateID() > 0)&&(su.GetUpdateID() <= curStateID)) (void) _speculativeUpdates.Remove(iter.GetKey());
+      else
+      {
+         const status_t ret = ApplySpeculativeUpdate(whichDatabase, iter.GetKey());
+         if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "ReapplySpeculativeUpdates:  Unable to re-apply speculative update to database #" UINT32_FORMAT_SPEC " [%s]\n", whichDatabase, ret());
+      }
+   }
+}
+
+void ZGDatabasePeerSession :: ScheduleSpeculativeUpdatesReapply(uint32 whichDatabase)
+{
+   // Deferred until our next Pulse(), so that all the authoritative updates we receive in the meantime can be applied first,
+   // and so that by then our database's state ID will tell us which of our speculative updates the senior peer has executed
+   if (_speculativeReapplyPending.PutWithDefault(whichDatabase).IsOK()) InvalidatePulseTime();
+}
+
+uint64 ZGDatabasePeerSession :: GetPulseTime(const PulseArgs & args)
+{
+   return _speculativeReapplyPending.HasItems() ? 0 : ZGPeerSession::GetPulseTime(args);
+}
+
+void ZGDatabasePeerSession :: Pulse(const PulseArgs & args)
+{
+   ZGPeerSession::Pulse(args);
+
+   Hashtable<uint32, Void> dbs;
+   dbs.SwapContents(_speculativeReapplyPending);
+   for (HashtableIterator<uint32, Void> iter(dbs); iter.HasData(); iter++) ReapplySpeculativeUpdates(iter.GetKey());
+}
+
+void ZGDatabasePeerSession :: DatabaseUpdateAcknowledged(uint32 whichDatabase, uint64 ackID, uint64 updateID, uint32 numPeersApplied, status_t result)
+{
+   SpeculativeUpdate * su = _speculativeUpdates.Get(ackID);
+   if (su == NULL)
+   {
+      ZGPeerSession::DatabaseUpdateAcknowledged(whichDatabase, ackID, updateID, numPeersApplied, result);
+      return;
+   }
+
+   if ((result.IsOK())&&(updateID > GetCurrentDatabaseStateID(whichDatabase))) su->SetUpdateID(updateID);  // it'll retire when we receive update #(updateID)
+   else
+   {
+      // Either the senior peer rejected our update, or we've already applied its authoritative version (on top of our
+      // speculative one).  Either way, our current state is wrong, so we'll roll back and re-apply the others without it.
+      // Note that (su) has to stay in the table until the roll-back is done, since it may need to be undone along with the others.
+      const ConstMessageRef seniorDoMsg = su->GetSeniorDoMessage();
+      RollBackSpeculativeUpdates(whichDatabase);
+      (void) _speculativeUpdates.Remove(ackID);
+
+      if (result.IsError())
+      {
+         IDatabaseObject * db = GetDatabaseObject(whichDatabase);
+         if (db) db->SpeculativeUpdateRejected(seniorDoMsg, result);
+      }
+   }
+}
+
 status_t ZGDatabasePeerSession :: SendMessageToDatabaseObject(const ZGPeerID & targetPeerID, const ConstMessageRef & msg, uint32 targetDBIdx, uint32 sourceDBIdx)
 {
    MessageRef wrapperMsg = GetMessageFromPool(DBPEERSESSION_COMMAND_MESSAGEFORDBOBJECT);
@@ -218,19 +452,32 @@ status_t IDatabaseObject :: RequestReplaceDatabaseState(const MessageRef & newDa
 status_t IDatabaseObject :: RequestUpdateDatabaseState(const MessageRef & databaseUpdateMsg)
 {
    ZGDatabasePeerSession * dbps = GetDatabasePeerSession();
-   return dbps ? dbps->RequestUpdateDatabaseState(_dbIndex, databaseUpdateMsg) : B_BAD_OBJECT;
+   if (dbps == NULL) return B_BAD_OBJECT;
+   return _speculativeUpdatesEnabled ? dbps->RequestSpeculativeUpdateDatabaseState(_dbIndex, databaseUpdateMsg) : dbps->RequestUpdateDatabaseState(_dbIndex, databaseUpdateMsg);
+}
+
+bool IDatabaseObject :: HasSpeculativeUpdates() const
+{
+   const ZGDatabasePeerSession * dbps = GetDatabasePeerSession();
+   return dbps ? dbps->HasSpeculativeUpdates(_dbIndex) : false;
 }
 
+// Note that applying a speculative update counts as a senior-update context, since SeniorUpdate() is what applies it
 bool IDatabaseObject :: IsInSeniorDatabaseUpdateContext() const
 {
    ZGDatabasePeerSession * dbps = GetDatabasePeerSession();
-   return dbps ? dbps->IsInSeniorDatabaseUpdateContext(_dbIndex) : false;
+   return dbps ? ((dbps->IsInSeniorDatabaseUpdateContext(_dbIndex))||(dbps->IsInSpeculativeApplyContext(_dbIndex))) : false;
 }
 
+// Note that rolling back speculative updates counts as a junior-update context, since it restores the senior peer's state
 bool IDatabaseObject :: IsInJuniorDatabaseUpdateContext(uint64 * optRetSeniorNetworkTime64) const
 {
    ZGDatabasePeerSession * dbps = GetDatabasePeerSession();
-   return dbps ? dbps->IsInJuniorDatabaseUpdateContext(_dbIndex, optRetSeniorNetworkTime64) : false;
+   if (dbps == NULL) return false;
+   if (dbps->IsInJuniorDatabaseUpdateContext(_dbIndex, optRetSeniorNetworkTime64)) return true;
+   if (dbps->IsInSpeculativeRollbackContext(_dbIndex) == false) return false;
+   if (optRetSeniorNetworkTime64) *optRetSeniorNetworkTime64 = 0;  // unknown
+   return true;
 }
 
 status_t IDatabaseObject :: SendMessageToDatabaseObject(const ZGPeerID & targetPeerID, const ConstMessageRef & msg, int32 optWhichDB)
@@ -0,0 +1,170 @@
+#include "zg/ZGLatencyHistogram.h"
+
+namespace zg {
+
+// Returns the index of the highest set bit in (v), or 0 if (v) is zero
+static inline uint32 GetHighestBitIndex(uint64 v)
+{
+   uint32 ret = 0;
+   if (v >= (((uint64)1)<<32)) {v >>= 32; ret += 32;}
+   if (v >= (((uint64)1)<<16)) {v >>= 16; ret += 16;}
+   if (v >= (((uint64)1)<<8))  {v >>= 8;  ret += 8;}
+   if (v >= (((uint64)1)<<4))  {v >>= 4;  ret += 4;}
+   if (v >= (((uint64)1)<<2))  {v >>= 2;  ret += 2;}
+   if (v >= (((uint64)1)<<1))  {          ret += 1;}
+   return ret;
+}
+
+uint32 ZGLatencyHistogram :: GetBucketIndex(uint64 value)
+{
+   if (value < NUM_SUB_BUCKETS) return (uint32) value;  // small values each get their own bucket
+
+   const uint32 magnitude = GetHighestBitIndex(value);  // >= NUM_SUB_BUCKET_BITS
+   const uint32 subBucket = (uint32) ((value >> (magnitude-NUM_SUB_BUCKET_BITS)) & (NUM_SUB_BUCKETS-1));
+   return ((magnitude-NUM_SUB_BUCKET_BITS+1)*NUM_SUB_BUCKETS) + subBucket;
+}
+
+uint64 ZGLatencyHistogram :: GetBucketMidpointValue(uint32 bucketIdx)
+{
+   if (bucketIdx < NUM_SUB_BUCKETS) return bucketIdx;
+
+   const uint32 shift      = (bucketIdx/NUM_SUB_BUCKETS)-1;  // i.e. (magnitude-NUM_SUB_BUCKET_BITS)
+   const uint64 lowerBound = ((uint64)(NUM_SUB_BUCKETS+(bucketIdx%NUM_SUB_BUCKETS))) << shift;
+   return lowerBound + ((((uint64)1)<<shift)/2);
+}
+
+void ZGLatencyHistogram :: RecordValue(uint64 micros)
+{
+   micros = muscleMin(micros, GetMaxTrackableValue());
+
+   _counts[GetBucketIndex(micros)]++;
+   _count++;
+   _totalValue += micros;
+   _minValue = muscleMin(_minValue, micros);
+   _maxValue = muscleMax(_maxValue, micros);
+}
+
+void ZGLatencyHistogram :: Reset()
+{
+   memset(_counts, 0, sizeof(_counts));
+   _count      = 0;
+   _minValue   = (uint64) -1;
+   _maxValue   = 0;
+   _totalValue = 0;
+}
+
+void ZGLatencyHistogram :: Merge(const ZGLatencyHistogram & rhs)
+{
+   for (uint32 i=0; i<ARRAYITEMS(_counts); i++) _counts[i] += rhs._counts[i];
+   _count      += rhs._count;
+   _totalValue += rhs._totalValue;
+   _minValue    = muscleMin(_minValue, rhs._minValue);
+   _maxValue    = muscleMax(_maxValue, rhs._maxValue);
+}
+
+uint64 ZGLatencyHistogram :: GetValueAtPercentile(double percentile) const
+{
+   if (_count == 0) return 0;
+
+   const double clampedPercentile = muscleClamp(percentile, 0.0, 100.0);
+   const uint64 targetCount       = muscleMax((uint64)1, (uint64)((((double)_count)*clampedPercentile/100.0)+0.5));
+
+   uint64 countSoFar = 0;
+   for (uint32 i=0; i<ARRAYITEMS(_counts); i++)
+   {
+      countSoFar += _counts[i];
+      if (countSoFar >= targetCount) return muscleClamp(GetBucketMidpointValue(i), GetMinValue(), GetMaxValue());
+   }
+   return GetMaxValue();
+}
+
+String ZGLatencyHistogram :: ToString() const
+{
+   char buf[256];
+   muscleSprintf(buf, "n=" UINT64_FORMAT_SPEC " min=" UINT64_FORMAT_SPEC "uS mean=" UINT64_FORMAT_SPEC "uS p50=" UINT64_FORMAT_SPEC "uS p90=" UINT64_FORMAT_SPEC "uS p99=" UINT64_FORMAT_SPEC "uS p99.9=" UINT64_FORMAT_SPEC "uS max=" UINT64_FORMAT_SPEC "uS", GetCount(), GetMinValue(), GetMeanValue(), GetValueAtPercentile(50.0), GetValueAtPercentile(90.0), GetValueAtPercentile(99.0), GetValueAtPercentile(99.9), GetMaxValue());
+   return buf;
+}
+
+static const char * _updateLatencyStageNames[] = {
+   "request->senior",
+   "senior queue",
+   "senior execute",
+   "senior->multicast",
+   "multicast->junior",
+   "junior apply",
+   "end-to-end",
+};
+MUSCLE_STATIC_ASSERT_ARRAY_LENGTH(_updateLatencyStageNames, NUM_ZG_UPDATE_LATENCY_STAGES);
+
+const char * GetUpdateLatencyStageName(uint32 stage)
+{
+   return (stage < ARRAYITEMS(_updateLatencyStageNames)) ? _updateLatencyStageNames[stage] : "???";
+}
+
+void ZGUpdateLatencyStats :: RecordInterval(uint32 stage, uint64 startTime, uint64 endTime)
+{
+   if ((stage < NUM_ZG_UPDATE_LATENCY_STAGES)&&(startTime > 0)&&(endTime > 0)) _histograms[stage].RecordValue((endTime > startTime) ? (endTime-startTime) : 0);
+}
+
+void ZGUpdateLatencyStats :: Merge(const ZGUpdateLatencyStats & rhs)
+{
+   for (uint32 i=0; i<NUM_ZG_UPDATE_LATENCY_STAGES; i++) _histograms[i].Merge(rhs._histograms[i]);
+}
+
+void ZGUpdateLatencyStats :: Reset()
+{
+   for (uint32 i=0; i<NUM_ZG_UPDATE_LATENCY_STAGES; i++) _histograms[i].Reset();
+}
+
+void ZGUpdateLatencyStats :: Print(const OutputPrinter & p) const
+{
+   for (uint32 i=0; i<NUM_ZG_UPDATE_LATENCY_STAGES; i++)
+   {
+      const ZGLatencyHistogram & h = _histograms[i];
+      if (h.GetCount() > 0) p.printf("   %-18s %s\n", GetUpdateLatencyStageName(i), h.ToString()());
+   }
+}
+
+void ZGUpdateReplayStats :: RecordUpdate(const char * updateTypeName, uint32 numBytes, uint64 applyMicros)
+{
+   _numUpdates++;
+   _numBytes         += numBytes;
+   _totalApplyMicros += applyMicros;
+
+   ZGLatencyHistogram * h = _applyHistograms.GetOrPut(updateTypeName);
+   if (h) h->RecordValue(applyMicros);
+}
+
+void ZGUpdateReplayStats :: Merge(const ZGUpdateReplayStats & rhs)
+{
+   _numUpdates       += rhs._numUpdates;
+   _numBytes         += rhs._numBytes;
+   _totalApplyMicros += rhs._totalApplyMicros;
+   for (ConstHashtableIterator<String, ZGLatencyHistogram> iter(rhs._applyHistograms); iter.HasData(); iter++)
+   {
+      ZGLatencyHistogram * h = _applyHistograms.GetOrPut(iter.GetKey());
+      if (h) h->Merge(iter.GetValue());
+   }
+   _updateChecksumHistogram.Merge(rhs._updateChecksumHistogram);
+   _databaseChecksumHistogram.Merge(rhs._databaseChecksumHistogram);
+}
+
+void ZGUpdateReplayStats :: Reset()
+{
+   _numUpdates       = 0;
+   _numBytes         = 0;
+   _totalApplyMicros = 0;
+   _applyHistograms.Clear();
+   _updateChecksumHistogram.Reset();
+   _databaseChecksumHistogram.Reset();
+}
+
+void ZGUpdateReplayStats :: Print(const OutputPrinter & p) const
+{
+   p.printf("   Applied " UINT64_FORMAT_SPEC " updates (" UINT64_FORMAT_SPEC " bytes) in " UINT64_FORMAT_SPEC "uS:  %.1f updates/sec, %.1f bytes/sec\n", _numUpdates, _numBytes, _totalApplyMicros, GetUpdatesPerSecond(), GetBytesPerSecond());
+   for (ConstHashtableIterator<String, ZGLatencyHistogram> iter(_applyHistograms); iter.HasData(); iter++) p.printf("   %-18s %s\n", iter.GetKey()(), iter.GetValue().ToString()());
+   if (_updateChecksumHistogram.GetCount()   > 0) p.printf("   %-18s %s\n", "update checksum",   _updateChecksumHistogram.ToString()());
+   if (_databaseChecksumHistogram.GetCount() > 0) p.printf("   %-18s %s\n", "database checksum", _databaseChecksumHistogram.ToString()());
+}
+
+}  // end namespace zg
@@ -1,6 +1,8 @@
 #include "zg/ZGPeerSession.h"
 #include "zg/discovery/common/DiscoveryUtilityFunctions.h"  // for ZG_DISCOVERY_NAME_*
 #include "zg/private/PZGConstants.h"
+#include "zg/private/PZGDatabaseWorkerSession.h"
+#include "zg/private/PZGSnapshotWriterSession.h"
 #include "zg/private/PZGHeartbeatSession.h"
 #include "zg/private/PZGNetworkIOSession.h"
 #include "reflector/StorageReflectSession.h"  // for PrintFactoriesInfo(), PrintSessionsInfo()
@@ -79,12 +81,15 @@ static ZGPeerID GenerateLocalPeerID()
    return ZGPeerID((macAddress<<16)|((uint64)GetNextUniqueObjectID()), (((uint64)processID)<<32)|((uint64)salt));
 }
 
-ZGPeerSession :: ZGPeerSession(const ZGPeerSettings & zgPeerSettings) : _peerSettings(zgPeerSettings), _localPeerID(GenerateLocalPeerID()), _iAmFullyAttached(false), _setBeaconDataPending(false)
+ZGPeerSession :: ZGPeerSession(const ZGPeerSettings & zgPeerSettings) : _peerSettings(zgPeerSettings), _localPeerID(GenerateLocalPeerID()), _iAmFullyAttached(false), _setBeaconDataPending(false), _nextCatchUpOfferTime(MUSCLE_TIME_NEVER), _appliedStateReportPending(false), _nextAckID(0)
 {
    (void) _databases.EnsureSize(_peerSettings.GetNumDatabases(), true);
    for (uint32 i=0; i<_databases.GetNumItems(); i++)
    {
-      _databases[i].SetParameters(this, i, zgPeerSettings.GetMaximumUpdateLogSizeForDatabase(i));
+      _databases[i].SetParameters(this, i, zgPeerSettings.GetMaximumUpdateLogSizeForDatabase(i), zgPeerSettings.GetGroupCommitWindowForDatabase(i), zgPeerSettings.GetPayloadCompressionLevelForDatabase(i));
+      _databases[i].SetPersistenceParameters(zgPeerSettings.GetPersistenceDirectory(), zgPeerSettings.GetUpdatesPerSnapshot());
+      _databases[i].SetUpdateRecordingDirectory(zgPeerSettings.GetUpdateRecordingDirectory());
+      _databases[i].SetFlowControlParameters(zgPeerSettings.GetMaximumJuniorLagUpdatesForDatabase(i), zgPeerSettings.GetMaximumJuniorLagBytesForDatabase(i));
       (void) PutPulseChild(&_databases[i]);  // So the PZGDatabaseState objects can use GetPulseTime() and Pulse() directly
    }
 }
@@ -102,12 +107,38 @@ status_t ZGPeerSession :: AttachedToServer()
    MRETURN_ON_ERROR(AddNewSession(ioSessionRef));
    _networkIOSession = ioSessionRef;
 
+   if (_peerSettings.AreDatabaseWorkerThreadsEnabled())
+   {
+      for (uint32 i=0; i<_databases.GetNumItems(); i++)
+      {
+         PZGDatabaseWorkerSessionRef workerSessionRef(new PZGDatabaseWorkerSession(&_databases[i]));
+         MRETURN_ON_ERROR(AddNewSession(workerSessionRef));
+         _databases[i].SetWorkerSession(workerSessionRef);
+      }
+   }
+
+   if (_peerSettings.GetPersistenceDirectory().HasChars())
+   {
+      for (uint32 i=0; i<_databases.GetNumItems(); i++)
+      {
+         PZGSnapshotWriterSessionRef writerSessionRef(new PZGSnapshotWriterSession(&_databases[i]));
+         MRETURN_ON_ERROR(AddNewSession(writerSessionRef));
+         _databases[i].SetSnapshotWriterSession(writerSessionRef);
+      }
+   }
+
    ScheduleSetBeaconData();
 
    LogTime(MUSCLE_LOG_INFO, "Starting up as peer [%s]\n", GetLocalPeerID().ToString()());
 
    // Make sure all of our databases are in their expected default states
-   for (uint32 i=0; i<_databases.GetNumItems(); i++) _databases[i].ResetLocalDatabaseToDefaultState();
+   // (and then bring them forward to whatever states we saved on disk before, if any)
+   for (uint32 i=0; i<_databases.GetNumItems(); i++)
+   {
+      _databases[i].ResetLocalDatabaseToDefaultState();
+      _databases[i].LoadPersistentState();
+      _databases[i].StartUpdateRecording();
+   }
 
    return B_NO_ERROR;
 }
@@ -118,6 +149,8 @@ void ZGPeerSession :: AboutToDetachFromServer()
    StorageReflectSession::AboutToDetachFromServer();
    _iAmFullyAttached = false;
    _onlinePeers.Clear();
+   _catchUpOffers.Clear();
+   _nextCatchUpOfferTime = MUSCLE_TIME_NEVER;
 }
 
 void ZGPeerSession :: EndSession()
@@ -128,6 +161,12 @@ void ZGPeerSession :: EndSession()
 
 void ZGPeerSession :: ShutdownChildSessions()
 {
+   for (uint32 i=0; i<_databases.GetNumItems(); i++)
+   {
+      _databases[i].ShutdownWorkerSession();
+      _databases[i].ShutdownSnapshotWriterSession();
+   }
+
    if (_networkIOSession())
    {
       _networkIOSession()->EndSession();
@@ -205,6 +244,22 @@ bool ZGPeerSession :: TextCommandReceived(const String & s)
       }
       else printf("Can't print peers list, network I/O session is missing!\n");
    }
+   else if (s.StartsWith("print latencies"))
+   {
+      const String dbStr = s.Substring(15).Trimmed();
+      PrintUpdateLatencyStats(dbStr.HasChars() ? atol(dbStr()) : -1);
+   }
+   else if (s.StartsWith("print lag"))
+   {
+      const String dbStr = s.Substring(9).Trimmed();
+      PrintJuniorPeerLags(dbStr.HasChars() ? atol(dbStr()) : -1);
+   }
+   else if (s.StartsWith("reset latencies"))
+   {
+      const String dbStr = s.Substring(15).Trimmed();
+      ResetUpdateLatencyStats(dbStr.HasChars() ? atol(dbStr()) : -1);
+      LogTime(MUSCLE_LOG_INFO, "Update-latency histograms have been reset.\n");
+   }
    else if (s == "die")
    {
       LogTime(MUSCLE_LOG_INFO, "Requesting controlled process shutdown.\n");
@@ -227,12 +282,17 @@ void ZGPeerSession :: PeerHasComeOnline(const ZGPeerID & peerID, const ConstMess
    {
       _iAmFullyAttached = true;
       for (uint32 i=0; i<_databases.GetNumItems(); i++) _databases[i].ScheduleLogContentsRescan();
+
+      _nextCatchUpOfferTime = 0;  // start advertising what we can resend to other peers
+      InvalidatePulseTime();
    }
 }
 
 void ZGPeerSession :: PeerHasGoneOffline(const ZGPeerID & peerID, const ConstMessageRef & /*peerInfo*/)
 {
    (void) _onlinePeers.Remove(peerID);
+   (void) _catchUpOffers.Remove(peerID);
+   for (uint32 i=0; i<_databases.GetNumItems(); i++) if (IAmTheSeniorPeerForDatabase(i)) _databases[i].PeerHasGoneOffline(peerID);
 }
 
 void ZGPeerSession :: SeniorPeerChanged(const ZGPeerID & oldSeniorPeerID, const ZGPeerID & newSeniorPeerID)
@@ -248,6 +308,9 @@ void ZGPeerSession :: SeniorPeerChanged(const ZGPeerID & oldSeniorPeerID, const
    _seniorPeerID = newSeniorPeerID;
    const bool iAmSeniorPeer = IAmTheSeniorPeer();
 
+   // Done before LocalSeniorPeerStatusChanged() is called, so that IAmTheSeniorPeerForDatabase() will already return the new values
+   UpdateDatabaseSeniorPeerIDs();
+
    if (iWasSeniorPeer != iAmSeniorPeer)
    {
       LogTime(MUSCLE_LOG_INFO, "I am %s the senior peer of %s system [%s]!\n", IAmTheSeniorPeer()?"now":"no longer", GetPeerSettings().GetSignature()(), GetPeerSettings().GetSystemName()());
@@ -256,6 +319,171 @@ void ZGPeerSession :: SeniorPeerChanged(const ZGPeerID & oldSeniorPeerID, const
    }
 }
 
+bool ZGPeerSession :: IAmTheSeniorPeerForDatabase(uint32 whichDB) const
+{
+   return ((_networkIOSession())&&(GetSeniorPeerIDForDatabase(whichDB) == _localPeerID));
+}
+
+void ZGPeerSession :: DatabaseSeniorPeerChanged(uint32 whichDB, const ZGPeerID & oldSeniorPeerID, const ZGPeerID & newSeniorPeerID)
+{
+   if (newSeniorPeerID.IsValid())
+   {
+      if (oldSeniorPeerID.IsValid()) LogTime(MUSCLE_LOG_INFO, "Senior peer of database #" UINT32_FORMAT_SPEC " has changed from [%s] to [%s]%s\n", whichDB, oldSeniorPeerID.ToString()(), newSeniorPeerID.ToString()(), (newSeniorPeerID==_localPeerID)?" (this peer)":"");
+                                else LogTime(MUSCLE_LOG_INFO, "Senior peer of database #" UINT32_FORMAT_SPEC " has been set to [%s]%s\n", whichDB, newSeniorPeerID.ToString()(), (newSeniorPeerID==_localPeerID)?" (this peer)":"");
+   }
+   else LogTime(MUSCLE_LOG_DEBUG, "There is no longer any senior peer for database #" UINT32_FORMAT_SPEC "\n", whichDB);
+}
+
+// Rendezvous-hashing score of the given peer for the given database.  When a database needs a new senior
+// peer, the candidate with the highest score gets it, so that a failed peer's databases get spread evenly.
+static uint64 GetDatabaseSeniorPeerScore(const ZGPeerID & peerID, uint32 whichDB)
+{
+   // The finalizer of the SplitMix64 generator, to spread the bits of the (peer, database) pair evenly
+   uint64 x = (((uint64)peerID.CalculateChecksum())<<32)|((uint64)whichDB);
+   x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+   return x ^ (x >> 31);
+}
+
+void ZGPeerSession :: UpdateDatabaseSeniorPeerIDs()
+{
+   PZGNetworkIOSession * nios = static_cast<PZGNetworkIOSession *>(_networkIOSession());
+   const uint32 numDBs = _databases.GetNumItems();
+   const bool perDBEnabled = ((_peerSettings.ArePerDatabaseSeniorPeersEnabled())&&(nios)&&(_seniorPeerID.IsValid()));
+
+   // The peers that may keep a database they already hold are the system's senior peer plus any other full peers.  New
+   // candidates (for databases whose senior peer has gone away) must also have told us their databases are caught up.
+   Hashtable<ZGPeerID, Void> holders;
+   Queue<ZGPeerID> candidates;
+   Hashtable<uint32, Queue<ZGPeerID> > claims;  // database index -> remote peers that say they are its senior peer
+   if (perDBEnabled)
+   {
+      for (ConstHashtableIterator<ZGPeerID, Queue<ConstPZGHeartbeatPacketWithMetaDataRef> > iter(nios->GetMainThreadPeers()); iter.HasData(); iter++)
+      {
+         const ZGPeerID & pid = iter.GetKey();
+         const PZGHeartbeatPacketWithMetaData * hb = iter.GetValue().HasItems() ? iter.GetValue().Head()() : NULL;
+         if ((pid != _seniorPeerID)&&((hb == NULL)||(hb->GetPeerType() != PEER_TYPE_FULL_PEER))) continue;
+
+         (void) holders.PutWithDefault(pid);
+         if ((pid == _seniorPeerID)||(hb->IsCaughtUp())) (void) candidates.AddTail(pid);
+         if ((hb)&&(pid != _localPeerID))
+         {
+            const Queue<uint32> & sdis = hb->GetSeniorDatabaseIndices();
+            for (uint32 j=0; j<sdis.GetNumItems(); j++)
+            {
+               Queue<ZGPeerID> * q = (sdis[j] < numDBs) ? claims.GetOrPut(sdis[j]) : NULL;
+               if (q) (void) q->AddTail(pid);
+            }
+         }
+      }
+   }
+
+   Queue<ZGPeerID> newSeniorPeerIDs;
+   if (newSeniorPeerIDs.EnsureSize(numDBs, true).IsError()) return;
+   for (uint32 i=0; i<numDBs; i++)
+   {
+      if (perDBEnabled == false) {newSeniorPeerIDs[i] = _seniorPeerID; continue;}
+
+      // A database's senior peer keeps it for as long as it stays online, so that databases never move between two live peers
+      // (which would need a handoff); a database only moves when its senior peer has failed.  Each senior peer advertises its databases in its heartbeats; if some other peer says it has one of ours
+      // (e.g. because we joined after it was assigned, or because two peers picked from different views of the peers list), then
+      // every peer resolves the conflict the same way, by keeping the claimant with the highest score.
+      const Queue<ZGPeerID> * otherClaimants = claims.Get(i);
+      Queue<ZGPeerID> claimants; if (otherClaimants) claimants = *otherClaimants;
+      const ZGPeerID & oldID = _databaseSeniorPeerIDs.IsIndexValid(i) ? _databaseSeniorPeerIDs[i] : GetDefaultObjectForType<ZGPeerID>();
+      if ((oldID == _localPeerID)&&(holders.ContainsKey(oldID))) (void) claimants.AddTail(oldID);
+      if ((claimants.IsEmpty())&&(holders.ContainsKey(oldID))) (void) claimants.AddTail(oldID);  // its heartbeats may not be advertising the database yet
+      const Queue<ZGPeerID> & pool = claimants.HasItems() ? claimants : candidates;  // if nobody holds the database, we'll assign it anew
+
+      if (pool.IsEmpty()) newSeniorPeerIDs[i] = _seniorPeerID;
+      else
+      {
+         uint64 bestScore = 0;
+         for (uint32 j=0; j<pool.GetNumItems(); j++)
+         {
+            const uint64 score = GetDatabaseSeniorPeerScore(pool[j], i);
+            if ((j == 0)||(score > bestScore)) {newSeniorPeerIDs[i] = pool[j]; bestScore = score;}  // ties go to the more-senior peer
+         }
+      }
+   }
+
+   Queue<ZGPeerID> oldSeniorPeerIDs;
+   if (_databaseSeniorPeerIDs.GetNumItems() != numDBs) (void) _databaseSeniorPeerIDs.EnsureSize(numDBs, true);
+   oldSeniorPeerIDs.SwapContents(_databaseSeniorPeerIDs);
+   _databaseSeniorPeerIDs.SwapContents(newSeniorPeerIDs);  // must be done before any callbacks below, so that they will see the new values
+
+   bool anyChanged = false;
+   for (uint32 i=0; i<numDBs; i++)
+   {
+      const ZGPeerID & oldID = oldSeniorPeerIDs[i];
+      const ZGPeerID & newID = _databaseSeniorPeerIDs[i];
+      if (newID == oldID) continue;
+
+      anyChanged = true;
+
+      // Acknowledgements are tracked by the senior peer that received the requests, so a new senior peer can't deliver them
+      _databases[i].SeniorPeerChanged();
+      FailPendingUpdateAcknowledgements(i, B_ERROR("Senior peer changed"));
+      if (_peerSettings.ArePerDatabaseSeniorPeersEnabled()) DatabaseSeniorPeerChanged(i, oldID, newID);
+
+      // If we've already heard from the new senior peer, there's no need to wait for its next beacon
+      const ConstPZGBeaconDataRef * bdRef = ((newID.IsValid())&&(newID != _localPeerID)) ? _databaseSeniorBeaconDatas.Get(newID) : NULL;
+      const PZGBeaconData * bd = bdRef ? bdRef->GetItemPointer() : NULL;
+      if ((bd)&&(bd->GetDatabaseStateInfos().IsIndexValid(i))) _databases[i].SeniorDatabaseStateInfoChanged(bd->GetDatabaseStateInfos()[i]);
+   }
+
+   if (anyChanged)
+   {
+      ScheduleSetBeaconData();       // since the set of databases we speak for may have changed
+      ScheduleAppliedStateReport();  // so the new senior peers will know what state we're in
+   }
+
+   if (nios)
+   {
+      nios->SetDatabaseSeniorPeerIDs(_databaseSeniorPeerIDs);
+
+      Queue<uint32> localSeniorDBs;
+      if (perDBEnabled) for (uint32 i=0; i<numDBs; i++) if (_databaseSeniorPeerIDs[i] == _localPeerID) (void) localSeniorDBs.AddTail(i);
+      nios->SetLocalSeniorDatabaseIndices(localSeniorDBs);  // so that all the other peers will agree that these databases are ours
+   }
+
+   // Forget any beacon data from peers that aren't the senior peer of any database anymore
+   for (HashtableIterator<ZGPeerID, ConstPZGBeaconDataRef> iter(_databaseSeniorBeaconDatas); iter.HasData(); iter++) if (_databaseSeniorPeerIDs.Contains(iter.GetKey()) == false) (void) _databaseSeniorBeaconDatas.Remove(iter.GetKey());
+
+   UpdateLocalPeerIsCaughtUp();
+}
+
+void ZGPeerSession :: UpdateLocalPeerIsCaughtUp()
+{
+   PZGNetworkIOSession * nios = static_cast<PZGNetworkIOSession *>(_networkIOSession());
+   if (nios == NULL) return;
+
+   bool isCaughtUp = ((_peerSettings.ArePerDatabaseSeniorPeersEnabled())&&(_peerSettings.GetPeerType() == PEER_TYPE_FULL_PEER)&&(_iAmFullyAttached));
+   for (uint32 i=0; ((isCaughtUp)&&(i<_databases.GetNumItems())); i++) if (_databases[i].IsCaughtUpWithSeniorPeer() == false) isCaughtUp = false;
+   if (isCaughtUp == nios->IsLocalPeerCaughtUp()) return;
+
+   // Not sticky:  a lagging peer must not be picked to take over a database.  (Databases we already hold stay with us
+   // regardless, so this flag only matters when some other database's senior peer has gone offline)
+   LogTime(MUSCLE_LOG_DEBUG, "This peer is %s eligible to be the senior peer of a database.\n", isCaughtUp?"now":"no longer");
+   nios->SetLocalPeerIsCaughtUp(isCaughtUp);
+}
+
+bool ZGPeerSession :: IAmTheSeniorPeerOfAnyDatabase() const
+{
+   for (uint32 i=0; i<_databases.GetNumItems(); i++) if (IAmTheSeniorPeerForDatabase(i)) return true;
+   return false;
+}
+
+bool ZGPeerSession :: IAmAJuniorPeerOfAnyDatabase() const
+{
+   for (uint32 i=0; i<_databases.GetNumItems(); i++)
+   {
+      const ZGPeerID & seniorPeerID = GetSeniorPeerIDForDatabase(i);
+      if ((seniorPeerID.IsValid())&&(seniorPeerID != _localPeerID)) return true;
+   }
+   return false;
+}
+
 bool ZGPeerSession :: IAmTheSeniorPeer() const
 {
    const PZGNetworkIOSession * nios = static_cast<const PZGNetworkIOSession *>(_networkIOSession());
@@ -302,6 +530,28 @@ void ZGPeerSession :: PrivateMessageReceivedFromPeer(const ZGPeerID & fromPeerID
       }
       break;
 
+      case PZG_PEER_COMMAND_CATCH_UP_OFFER:
+         CatchUpOfferReceived(fromPeerID, msg);
+      break;
+
+      case PZG_PEER_COMMAND_APPLIED_STATE_REPORT:
+         AppliedStateReportReceived(fromPeerID, msg);
+      break;
+
+      case PZG_PEER_COMMAND_UPDATE_ACKNOWLEDGED:
+         UpdateAcknowledgementReceived(fromPeerID, msg);
+      break;
+
+      case PZG_PEER_COMMAND_DATABASE_REPAIR_REQUEST:
+      case PZG_PEER_COMMAND_DATABASE_REPAIR_REPLY:
+      {
+         const uint32 whichDB = msg()->GetInt32(PZG_PEER_NAME_DATABASE_ID);
+         if (_databases.IsIndexValid(whichDB) == false) LogTime(MUSCLE_LOG_ERROR, "ZGPeerSession::PrivateMessageReceivedFromPeer:  Database repair Message from [%s] has invalid database ID " UINT32_FORMAT_SPEC "\n", fromPeerID.ToString()(), whichDB);
+         else if (msg()->what == PZG_PEER_COMMAND_DATABASE_REPAIR_REQUEST) _databases[whichDB].DatabaseRepairRequestReceived(fromPeerID, msg);
+         else                                                              _databases[whichDB].DatabaseRepairReplyReceived(  fromPeerID, msg);
+      }
+      break;
+
       default:
          LogTime(MUSCLE_LOG_ERROR, "ZGPeerSession::PrivateMessageReceivedFromPeer:  Received unknown Message from [%s]:\n", fromPeerID.ToString()());
          msg()->Print(stdout);
@@ -311,18 +561,6 @@ void ZGPeerSession :: PrivateMessageReceivedFromPeer(const ZGPeerID & fromPeerID
 
 status_t ZGPeerSession :: HandleDatabaseUpdateRequest(const ZGPeerID & fromPeerID, const ConstMessageRef & msg, bool isMessageMeantForSeniorPeer)
 {
-   const bool iAmSenior = IAmTheSeniorPeer();
-   if (isMessageMeantForSeniorPeer != iAmSenior)
-   {
-      LogTime(MUSCLE_LOG_ERROR, "HandleDatabaseUpdateRequest:  Message " UINT32_FORMAT_SPEC " from peer [%s] was intended for %s peer, but I am %s\n", msg()->what, fromPeerID.ToString()(), isMessageMeantForSeniorPeer?"the senior":"a junior", iAmSenior?"the senior peer":"a junior peer");
-      return B_BAD_DATA;
-   }
-   if ((isMessageMeantForSeniorPeer == false)&&(fromPeerID != GetSeniorPeerID()))
-   {
-      if (_iAmFullyAttached) LogTime(MUSCLE_LOG_ERROR, "HandleDatabaseUpdateRequest:  Message " UINT32_FORMAT_SPEC " was received from [%s], but the senior peer is [%s]\n", msg()->what, fromPeerID.ToString()(), GetSeniorPeerID().ToString()());
-      return B_BAD_DATA;
-   }
-
    uint32 whichDatabase;
    PZGDatabaseUpdateRef dbUp;
    if (msg()->what == PZG_PEER_COMMAND_UPDATE_JUNIOR_DATABASE)
@@ -333,6 +571,7 @@ status_t ZGPeerSession :: HandleDatabaseUpdateRequest(const ZGPeerID & fromPeerI
          LogTime(MUSCLE_LOG_ERROR, "HandleDatabaseUpdateRequest:  Couldn't get PZGDatabaseUpdate from junior-update Message!\n");
          return B_BAD_DATA;
       }
+      dbUp()->SetLocalReceiveTimeMicros(GetNetworkTime64());
       whichDatabase = dbUp()->GetDatabaseIndex();
    }
    else whichDatabase = msg()->GetInt32(PZG_PEER_NAME_DATABASE_ID);
@@ -343,6 +582,20 @@ status_t ZGPeerSession :: HandleDatabaseUpdateRequest(const ZGPeerID & fromPeerI
       return B_BAD_ARGUMENT;
    }
 
+   const bool iAmSenior = IAmTheSeniorPeerForDatabase(whichDatabase);
+   if (isMessageMeantForSeniorPeer != iAmSenior)
+   {
+      LogTime(MUSCLE_LOG_ERROR, "HandleDatabaseUpdateRequest:  Message " UINT32_FORMAT_SPEC " from peer [%s] was intended for %s peer of database #" UINT32_FORMAT_SPEC ", but I am %s\n", msg()->what, fromPeerID.ToString()(), isMessageMeantForSeniorPeer?"the senior":"a junior", whichDatabase, iAmSenior?"its senior peer":"one of its junior peers");
+      return B_BAD_DATA;
+   }
+
+   const ZGPeerID & seniorPeerID = GetSeniorPeerIDForDatabase(whichDatabase);
+   if ((isMessageMeantForSeniorPeer == false)&&(fromPeerID != seniorPeerID))
+   {
+      if (_iAmFullyAttached) LogTime(MUSCLE_LOG_ERROR, "HandleDatabaseUpdateRequest:  Message " UINT32_FORMAT_SPEC " was received from [%s], but the senior peer of database #" UINT32_FORMAT_SPEC " is [%s]\n", msg()->what, fromPeerID.ToString()(), whichDatabase, seniorPeerID.ToString()());
+      return B_BAD_DATA;
+   }
+
    return _databases[whichDatabase].HandleDatabaseUpdateRequest(fromPeerID, msg, dbUp, *this);
 }
 
@@ -363,26 +616,76 @@ status_t ZGPeerSession :: RequestUpdateDatabaseState(uint32 whichDatabase, const
    return SendRequestToSeniorPeer(whichDatabase, PZG_PEER_COMMAND_UPDATE_SENIOR_DATABASE, databaseUpdateMsg);
 }
 
-status_t ZGPeerSession :: SendRequestToSeniorPeer(uint32 whichDatabase, uint32 whatCode, const ConstMessageRef & userMsg)
+status_t ZGPeerSession :: RequestUpdateDatabaseStateWithAcknowledgement(uint32 whichDatabase, const MessageRef & databaseUpdateMsg, uint32 numPeers, uint64 * optRetAckID)
+{
+   if (databaseUpdateMsg() == NULL) return B_BAD_ARGUMENT;  // user's gotta specify something for us to base the new state on!
+   if ((numPeers > 1)&&(_peerSettings.AreUpdateAcknowledgementsEnabled() == false)) return B_BAD_OBJECT;  // junior peers won't tell the senior peer what they've applied (but the senior peer can always vouch for itself)
+   if (whichDatabase >= _peerSettings.GetNumDatabases()) return B_BAD_ARGUMENT;  // invalid database index!
+
+   const uint64 ackID = ++_nextAckID;
+   MRETURN_ON_ERROR(_pendingUpdateAcks.Put(ackID, whichDatabase));
+
+   const status_t ret = SendRequestToSeniorPeer(whichDatabase, PZG_PEER_COMMAND_UPDATE_SENIOR_DATABASE, databaseUpdateMsg, ackID, muscleMax(numPeers, (uint32)1));
+   if (ret.IsError()) {(void) _pendingUpdateAcks.Remove(ackID); return ret;}
+
+   if (optRetAckID) *optRetAckID = ackID;
+   return B_NO_ERROR;
+}
+
+status_t ZGPeerSession :: SendRequestToSeniorPeer(uint32 whichDatabase, uint32 whatCode, const ConstMessageRef & userMsg, uint64 ackID, uint32 numPeers)
 {
    if (whichDatabase >= _peerSettings.GetNumDatabases()) return B_BAD_ARGUMENT;  // invalid database index!
-   if (_seniorPeerID.IsValid() == false) return B_BAD_OBJECT;  // can't send to senior peer if we don't know who he is!
 
    MessageRef sendMsg = GetMessageFromPool(whatCode);
    MRETURN_OOM_ON_NULL(sendMsg());
 
    MRETURN_ON_ERROR(sendMsg()->CAddInt32(  PZG_PEER_NAME_DATABASE_ID,  whichDatabase));
    MRETURN_ON_ERROR(sendMsg()->CAddMessage(PZG_PEER_NAME_USER_MESSAGE, CastAwayConstFromRef(userMsg)));
+   MRETURN_ON_ERROR(sendMsg()->CAddInt64(  PZG_PEER_NAME_REQUEST_TIME, GetNetworkTime64()));  // so the senior peer can trace this update's commit-latency
+   MRETURN_ON_ERROR(sendMsg()->CAddInt64(  PZG_PEER_NAME_ACK_ID,       ackID));     // so the senior peer will tell us when our update has been applied
+   MRETURN_ON_ERROR(sendMsg()->CAddInt32(  PZG_PEER_NAME_NUM_PEERS,    numPeers));
 
-   return SendUnicastInternalMessageToPeer(_seniorPeerID, sendMsg);
+   return SendUnicastInternalMessageToSeniorPeer(whichDatabase, sendMsg);
 }
 
-status_t ZGPeerSession :: RequestBackOrderFromSeniorPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError)
+status_t ZGPeerSession :: SendUnicastInternalMessageToSeniorPeer(uint32 whichDB, const ConstMessageRef & internalMsg)
+{
+   PZGDatabaseState * workerDB = GetDatabaseStateForCallingWorkerThread();
+   if (workerDB) return workerDB->ForwardCallToMainThread(PZG_WORKER_CALL_SEND_TO_SENIOR_PEER, internalMsg, ZGPeerID(), false);  // (internalMsg) says which database it's for
+
+   const ZGPeerID & seniorPeerID = GetSeniorPeerIDForDatabase(whichDB);
+   if (seniorPeerID.IsValid() == false) return B_BAD_OBJECT;  // can't send to senior peer if we don't know who he is!
+   return SendUnicastInternalMessageToPeer(seniorPeerID, internalMsg);
+}
+
+PZGDatabaseState * ZGPeerSession :: GetDatabaseStateForCallingWorkerThread()
+{
+   return PZGDatabaseWorkerSession::GetDatabaseStateForCallingThread();  // a thread-local lookup, rather than asking each of our databases
+}
+
+void ZGPeerSession :: DatabaseWorkerCallReceived(const MessageRef & callMsg)
+{
+   const MessageRef internalMsg = callMsg()->GetMessage(PZG_PEER_NAME_USER_MESSAGE);
+   ZGPeerID peerID; (void) callMsg()->FindFlat(PZG_PEER_NAME_PEER_ID, peerID);
+
+   status_t ret;
+   switch(callMsg()->what)
+   {
+      case PZG_WORKER_CALL_SEND_TO_SENIOR_PEER:         ret = internalMsg() ? SendUnicastInternalMessageToSeniorPeer(internalMsg()->GetInt32(PZG_PEER_NAME_DATABASE_ID), internalMsg) : B_BAD_ARGUMENT; break;
+      case PZG_WORKER_CALL_SEND_UNICAST_TO_PEER:        ret = SendUnicastInternalMessageToPeer(peerID, internalMsg);                                                   break;
+      case PZG_WORKER_CALL_SEND_UNICAST_TO_ALL_PEERS:   ret = SendUnicastInternalMessageToAllPeers(internalMsg, callMsg()->GetBool(PZG_PEER_NAME_SEND_TO_SELF));       break;
+      case PZG_WORKER_CALL_SEND_MULTICAST_TO_ALL_PEERS: ret = SendMulticastInternalMessageToAllPeers(internalMsg);                                                     break;
+      default:                                          ret = B_UNIMPLEMENTED;                                                                                          break;
+   }
+   if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "ZGPeerSession::DatabaseWorkerCallReceived:  Unable to execute call " UINT32_FORMAT_SPEC " forwarded from a database worker thread [%s]\n", callMsg()->what, ret());
+}
+
+status_t ZGPeerSession :: RequestBackOrderFromPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError)
 {
    PZGNetworkIOSession * nios = static_cast<PZGNetworkIOSession *>(_networkIOSession());
    if (nios == NULL) return B_LOGIC_ERROR;  // paranoia?
 
-   return nios->RequestBackOrderFromSeniorPeer(ubok, dueToChecksumError);
+   return nios->RequestBackOrderFromPeer(ubok, dueToChecksumError);
 }
 
 status_t ZGPeerSession :: SendDatabaseUpdateViaMulticast(const ConstPZGDatabaseUpdateRef & dbUp)
@@ -390,6 +693,8 @@ status_t ZGPeerSession :: SendDatabaseUpdateViaMulticast(const ConstPZGDatabaseU
    PZGNetworkIOSession * nios = static_cast<PZGNetworkIOSession *>(_networkIOSession());
    if (nios == NULL) return B_LOGIC_ERROR;
 
+   MRETURN_ON_ERROR(dbUp()->GetWireImage());  // flatten the update now, so that any later back-order replies can re-use the same bytes
+
    MessageRef wrapMsg = GetMessageFromPool(PZG_PEER_COMMAND_UPDATE_JUNIOR_DATABASE);
    MRETURN_OOM_ON_NULL(wrapMsg());
    MRETURN_ON_ERROR(wrapMsg()->AddFlat(PZG_PEER_NAME_DATABASE_UPDATE, FlatCountableRef(CastAwayConstFromRef(dbUp))));
@@ -413,6 +718,9 @@ status_t ZGPeerSession :: SendMulticastInternalMessageToAllPeers(const ConstMess
 {
    if (internalMsg() == NULL) return B_BAD_ARGUMENT;
 
+   PZGDatabaseState * workerDB = GetDatabaseStateForCallingWorkerThread();
+   if (workerDB) return workerDB->ForwardCallToMainThread(PZG_WORKER_CALL_SEND_MULTICAST_TO_ALL_PEERS, internalMsg, ZGPeerID(), false);
+
    PZGNetworkIOSession * nios = static_cast<PZGNetworkIOSession *>(_networkIOSession());
    return nios ? nios->SendMulticastMessageToAllPeers(internalMsg) : B_BAD_OBJECT;
 }
@@ -426,6 +734,9 @@ status_t ZGPeerSession :: SendUnicastInternalMessageToAllPeers(const ConstMessag
 {
    if (internalMsg() == NULL) return B_BAD_ARGUMENT;
 
+   PZGDatabaseState * workerDB = GetDatabaseStateForCallingWorkerThread();
+   if (workerDB) return workerDB->ForwardCallToMainThread(PZG_WORKER_CALL_SEND_UNICAST_TO_ALL_PEERS, internalMsg, ZGPeerID(), sendToSelf);
+
    PZGNetworkIOSession * nios = static_cast<PZGNetworkIOSession *>(_networkIOSession());
    return nios ? nios->SendUnicastMessageToAllPeers(internalMsg, sendToSelf) : B_BAD_OBJECT;
 }
@@ -439,6 +750,9 @@ status_t ZGPeerSession :: SendUnicastInternalMessageToPeer(const ZGPeerID & dest
 {
    if (internalMsg() == NULL) return B_BAD_ARGUMENT;
 
+   PZGDatabaseState * workerDB = GetDatabaseStateForCallingWorkerThread();
+   if (workerDB) return workerDB->ForwardCallToMainThread(PZG_WORKER_CALL_SEND_UNICAST_TO_PEER, internalMsg, destinationPeerID, false);
+
    PZGNetworkIOSession * nios = static_cast<PZGNetworkIOSession *>(_networkIOSession());
    return nios ? nios->SendUnicastMessageToPeer(destinationPeerID, internalMsg) : B_BAD_OBJECT;
 }
@@ -461,6 +775,101 @@ void ZGPeerSession :: PrintDatabaseUpdateLog(int32 whichDatabase) const
    }
 }
 
+void ZGPeerSession :: PrintUpdateLatencyStats(int32 whichDatabase) const
+{
+   if (_databases.IsIndexValid(whichDatabase)) _databases[whichDatabase].PrintUpdateLatencyStats();
+   else
+   {
+      for (uint32 i=0; i<_databases.GetNumItems(); i++) _databases[i].PrintUpdateLatencyStats();
+   }
+}
+
+const ZGUpdateLatencyStats * ZGPeerSession :: GetUpdateLatencyStats(uint32 whichDB) const
+{
+   return _databases.IsIndexValid(whichDB) ? &_databases[whichDB].GetUpdateLatencyStats() : NULL;
+}
+
+void ZGPeerSession :: PrintJuniorPeerLags(int32 whichDatabase) const
+{
+   if (IAmTheSeniorPeerOfAnyDatabase() == false) {printf("Junior peer lag is only tracked by the senior peer.\n"); return;}
+
+   if (_databases.IsIndexValid(whichDatabase))
+   {
+      if (IAmTheSeniorPeerForDatabase(whichDatabase)) _databases[whichDatabase].PrintJuniorPeerLags();
+                                                 else printf("Junior peer lag for database #" INT32_FORMAT_SPEC " is only tracked by its senior peer [%s].\n", whichDatabase, GetSeniorPeerIDForDatabase(whichDatabase).ToString()());
+   }
+   else
+   {
+      for (uint32 i=0; i<_databases.GetNumItems(); i++) if (IAmTheSeniorPeerForDatabase(i)) _databases[i].PrintJuniorPeerLags();
+   }
+}
+
+status_t ZGPeerSession :: GetJuniorPeerLag(uint32 whichDB, const ZGPeerID & peerID, uint64 & retLagUpdates, uint64 & retLagBytes) const
+{
+   return _databases.IsIndexValid(whichDB) ? _databases[whichDB].GetJuniorPeerLag(peerID, retLagUpdates, retLagBytes) : B_BAD_ARGUMENT;
+}
+
+uint32 ZGPeerSession :: GetNumDeferredUpdateRequests(uint32 whichDB) const
+{
+   return _databases.IsIndexValid(whichDB) ? _databases[whichDB].GetNumDeferredUpdateRequests() : 0;
+}
+
+status_t ZGPeerSession :: GetBackOrderStats(uint32 whichDB, uint64 & retHits, uint64 & retMisses) const
+{
+   if (_databases.IsIndexValid(whichDB) == false) return B_BAD_ARGUMENT;
+
+   retHits   = _databases[whichDB].GetNumBackOrderHits();
+   retMisses = _databases[whichDB].GetNumBackOrderMisses();
+   return B_NO_ERROR;
+}
+
+status_t ZGPeerSession :: ReplayUpdateRecording(uint32 whichDB, const String & recordingDir, uint32 verifyInterval, ZGUpdateReplayStats & retStats)
+{
+   return _databases.IsIndexValid(whichDB) ? _databases[whichDB].ReplayUpdateRecording(recordingDir, verifyInterval, retStats) : B_BAD_ARGUMENT;
+}
+
+void ZGPeerSession :: TrimSharedUpdateLogs()
+{
+   const uint64 budget = _peerSettings.GetSharedUpdateLogBudget();
+
+   uint64 totalBytes = 0;
+   for (uint32 i=0; i<_databases.GetNumItems(); i++) totalBytes += _databases[i].GetUpdateLogPayloadBytes();
+
+   const uint64 now = GetNetworkTime64();
+   while(totalBytes > budget)
+   {
+      // Evict updates that no peer is likely to back-order first; within each group, prefer the oldest and largest updates
+      PZGDatabaseState * victim = NULL;
+      bool victimLikelyNeeded   = true;
+      double victimWeight       = 0.0;
+      for (uint32 i=0; i<_databases.GetNumItems(); i++)
+      {
+         bool likelyNeeded;
+         double weight;
+         if ((_databases[i].GetEvictionCandidate(now, likelyNeeded, weight))&&((victim == NULL)||((likelyNeeded == false)&&(victimLikelyNeeded))||((likelyNeeded == victimLikelyNeeded)&&(weight > victimWeight))))
+         {
+            victim             = &_databases[i];
+            victimLikelyNeeded = likelyNeeded;
+            victimWeight       = weight;
+         }
+      }
+      if (victim == NULL) break;  // nothing left that we're allowed to evict
+
+      const uint64 bytesBefore = victim->GetUpdateLogPayloadBytes();
+      victim->EvictOldestUpdate();
+      totalBytes -= muscleMin(totalBytes, bytesBefore-victim->GetUpdateLogPayloadBytes());
+   }
+}
+
+void ZGPeerSession :: ResetUpdateLatencyStats(int32 whichDatabase)
+{
+   if (_databases.IsIndexValid(whichDatabase)) _databases[whichDatabase].ResetUpdateLatencyStats();
+   else
+   {
+      for (uint32 i=0; i<_databases.GetNumItems(); i++) _databases[i].ResetUpdateLatencyStats();
+   }
+}
+
 void ZGPeerSession :: ScheduleSetBeaconData()
 {
    if (_setBeaconDataPending == false)
@@ -472,8 +881,8 @@ void ZGPeerSession :: ScheduleSetBeaconData()
 
 uint64 ZGPeerSession :: GetPulseTime(const PulseArgs & args)
 {
-   if (_setBeaconDataPending) return 0;
-   return StorageReflectSession::GetPulseTime(args);
+   if ((_setBeaconDataPending)||(_appliedStateReportPending)) return 0;
+   return muscleMin(_nextCatchUpOfferTime, StorageReflectSession::GetPulseTime(args));
 }
 
 ConstPZGBeaconDataRef ZGPeerSession :: GetNewSeniorBeaconData() const
@@ -487,7 +896,7 @@ ConstPZGBeaconDataRef ZGPeerSession :: GetNewSeniorBeaconData() const
    Queue<PZGDatabaseStateInfo> & q = beaconDataRef()->GetDatabaseStateInfos();
    if (q.EnsureSize(numDBs).IsError()) return ConstPZGBeaconDataRef();
 
-   for (uint32 i=0; i<numDBs; i++) (void) q.AddTail(_databases[i].GetDatabaseStateInfo());
+   for (uint32 i=0; i<numDBs; i++) (void) q.AddTail(IAmTheSeniorPeerForDatabase(i) ? _databases[i].GetDatabaseStateInfo() : PZGDatabaseStateInfo());  // we only speak for the databases we are the senior peer of
    return AddConstToRef(beaconDataRef);
 }
 
@@ -508,20 +917,192 @@ void ZGPeerSession :: Pulse(const PulseArgs & args)
       if (nios)
       {
          ConstPZGBeaconDataRef beaconData;
-         if (IAmTheSeniorPeer()) beaconData = GetNewSeniorBeaconData();
+         if (IAmTheSeniorPeerOfAnyDatabase()) beaconData = GetNewSeniorBeaconData();
          if (nios->SetBeaconData(beaconData).IsError()) LogTime(MUSCLE_LOG_ERROR, "ZGPeerSession:  Couldn't set beacon data!\n");
       }
    }
+
+   if (_appliedStateReportPending)
+   {
+      _appliedStateReportPending = false;
+      SendAppliedStateReport();  // one report covers all of the updates we've applied since the last one
+   }
+
+   if (args.GetScheduledTime() >= _nextCatchUpOfferTime)
+   {
+      SendCatchUpOffer();
+      _nextCatchUpOfferTime = args.GetCallbackTime()+PZG_CATCH_UP_OFFER_INTERVAL_MICROS;
+   }
+}
+
+void ZGPeerSession :: ScheduleAppliedStateReport()
+{
+   UpdateLocalPeerIsCaughtUp();  // since our databases' states may have just changed
+
+   if ((_appliedStateReportPending == false)&&((_peerSettings.AreUpdateAcknowledgementsEnabled())||(_peerSettings.IsFlowControlEnabled()))&&(IAmAJuniorPeerOfAnyDatabase()))
+   {
+      _appliedStateReportPending = true;
+      InvalidatePulseTime();
+   }
+}
+
+void ZGPeerSession :: SendAppliedStateReport()
+{
+   // Each remote senior peer gets the same report; it will only look at the entries for the databases it is the senior peer of
+   Hashtable<ZGPeerID, Void> seniorPeerIDs;
+   for (uint32 i=0; i<_databaseSeniorPeerIDs.GetNumItems(); i++)
+   {
+      const ZGPeerID & seniorPeerID = _databaseSeniorPeerIDs[i];
+      if ((seniorPeerID.IsValid())&&(seniorPeerID != _localPeerID)) (void) seniorPeerIDs.PutWithDefault(seniorPeerID);  // the senior peer knows its own state
+   }
+   if (seniorPeerIDs.IsEmpty()) return;
+
+   status_t ret;
+   MessageRef reportMsg = GetMessageFromPool(PZG_PEER_COMMAND_APPLIED_STATE_REPORT);
+   if (reportMsg() == NULL) ret = B_OUT_OF_MEMORY;
+   for (uint32 i=0; ((ret.IsOK())&&(i<_databases.GetNumItems())); i++) ret = reportMsg()->AddInt64(PZG_PEER_NAME_DATABASE_UPDATE_ID, _databases[i].GetCurrentDatabaseStateID());
+   for (HashtableIterator<ZGPeerID, Void> iter(seniorPeerIDs); ((ret.IsOK())&&(iter.HasData())); iter++) ret = SendUnicastInternalMessageToPeer(iter.GetKey(), reportMsg);
+   if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "ZGPeerSession:  Couldn't send applied-state report to senior peer! [%s]\n", ret());
+}
+
+void ZGPeerSession :: AppliedStateReportReceived(const ZGPeerID & fromPeerID, const ConstMessageRef & msg)
+{
+   if ((IAmTheSeniorPeerOfAnyDatabase() == false)||(IsPeerOnline(fromPeerID) == false)) return;  // reports are only meaningful to the senior peer
+
+   uint64 stateID;
+   for (uint32 i=0; ((i<_databases.GetNumItems())&&(msg()->FindInt64(PZG_PEER_NAME_DATABASE_UPDATE_ID, i, stateID).IsOK())); i++) if (IAmTheSeniorPeerForDatabase(i)) _databases[i].AppliedStateReportReceived(fromPeerID, stateID);
+}
+
+void ZGPeerSession :: UpdateAcknowledgementReceived(const ZGPeerID & fromPeerID, const ConstMessageRef & msg)
+{
+   const uint64 ackID = (uint64) msg()->GetInt64(PZG_PEER_NAME_ACK_ID);
+   const uint32 * optWhichDB = _pendingUpdateAcks.Get(ackID);
+   if ((optWhichDB == NULL)||(fromPeerID != GetSeniorPeerIDForDatabase(*optWhichDB))) return;  // stale acknowledgement (e.g. from a previous senior peer), so ignore it
+
+   const uint32 whichDB = *optWhichDB;
+   (void) _pendingUpdateAcks.Remove(ackID);
+
+   const uint64 updateID = (uint64) msg()->GetInt64(PZG_PEER_NAME_DATABASE_UPDATE_ID);
+   DatabaseUpdateAcknowledged(whichDB, ackID, updateID, (uint32) msg()->GetInt32(PZG_PEER_NAME_NUM_PEERS), (updateID > 0) ? B_NO_ERROR : B_ERROR("Senior peer couldn't execute the update"));
+}
+
+void ZGPeerSession :: FailPendingUpdateAcknowledgements(uint32 whichDB, status_t why)
+{
+   Hashtable<uint64, uint32> failedAcks;  // collected first, in case DatabaseUpdateAcknowledged() requests more updates
+   for (HashtableIterator<uint64, uint32> iter(_pendingUpdateAcks); iter.HasData(); iter++)
+   {
+      if ((iter.GetValue() == whichDB)&&(failedAcks.Put(iter.GetKey(), whichDB).IsOK())) (void) _pendingUpdateAcks.Remove(iter.GetKey());
+   }
+   for (HashtableIterator<uint64, uint32> iter(failedAcks); iter.HasData(); iter++) DatabaseUpdateAcknowledged(iter.GetValue(), iter.GetKey(), 0, 0, why);
+}
+
+void ZGPeerSession :: SendCatchUpOffer()
+{
+   PZGNetworkIOSession * nios = static_cast<PZGNetworkIOSession *>(_networkIOSession());
+   if (nios == NULL) return;
+
+   status_t ret;
+   MessageRef offerMsg = GetMessageFromPool(PZG_PEER_COMMAND_CATCH_UP_OFFER);
+   if (offerMsg() == NULL) ret = B_OUT_OF_MEMORY;
+   for (uint32 i=0; ((ret.IsOK())&&(i<_databases.GetNumItems())); i++) ret = offerMsg()->AddFlat(PZG_PEER_NAME_DATABASE_STATE_INFO, _databases[i].GetCatchUpOfferInfo());
+   if ((ret.IsError())||(offerMsg()->AddInt32(PZG_PEER_NAME_LOAD, nios->GetCatchUpLoad()).IsError(ret))||(nios->SendMulticastMessageToAllPeers(offerMsg).IsError(ret))) LogTime(MUSCLE_LOG_ERROR, "ZGPeerSession:  Couldn't send catch-up offer! [%s]\n", ret());
+}
+
+void ZGPeerSession :: CatchUpOfferReceived(const ZGPeerID & fromPeerID, const ConstMessageRef & msg)
+{
+   if (IsPeerOnline(fromPeerID) == false) return;  // offers from peers we don't know about yet (or anymore) are of no use to us
+
+   Queue<PZGDatabaseStateInfo> dbis;
+   PZGDatabaseStateInfo dbi;
+   for (uint32 i=0; msg()->FindFlat(PZG_PEER_NAME_DATABASE_STATE_INFO, i, dbi).IsOK(); i++) if (dbis.AddTail(dbi).IsError()) return;
+
+   if (dbis.GetNumItems() == _databases.GetNumItems()) (void) _catchUpOffers.Put(fromPeerID, PZGCatchUpOffer(dbis, (uint32) msg()->GetInt32(PZG_PEER_NAME_LOAD), GetRunTime64()));
+   else LogTime(MUSCLE_LOG_ERROR, "ZGPeerSession::CatchUpOfferReceived:  Wrong number of DBIs in offer from [%s]!  (Expected " UINT32_FORMAT_SPEC ", got " UINT32_FORMAT_SPEC ")\n", fromPeerID.ToString()(), _databases.GetNumItems(), dbis.GetNumItems());
+}
+
+uint64 ZGPeerSession :: GetCatchUpCost(const ZGPeerID & peerID, const PZGCatchUpOffer * optOffer) const
+{
+   const uint64 latency = GetEstimatedLatencyToPeer(peerID);
+   if (latency == MUSCLE_TIME_NEVER) return MUSCLE_TIME_NEVER;
+   return latency + (optOffer ? (optOffer->GetLoad()*PZG_CATCH_UP_COST_PER_QUEUED_MESSAGE) : 0);
+}
+
+bool ZGPeerSession :: IsAnyPeerBehindDatabaseState(uint32 whichDB, uint64 stateID) const
+{
+   const uint64 now = GetRunTime64();
+   for (ConstHashtableIterator<ZGPeerID, PZGCatchUpOffer> iter(_catchUpOffers); iter.HasData(); iter++)
+   {
+      const PZGCatchUpOffer & offer = iter.GetValue();
+      if ((iter.GetKey() == GetLocalPeerID())||(now > (offer.GetReceiveTime()+PZG_CATCH_UP_OFFER_MAX_AGE_MICROS))) continue;
+
+      const uint64 peerStateID = offer.GetDatabaseStateID(whichDB);
+      if ((peerStateID > 0)&&(peerStateID < stateID)) return true;
+   }
+   return false;
+}
+
+ZGPeerID ZGPeerSession :: GetBackOrderSourcePeerID(uint32 whichDB, uint64 firstUpdateID, uint64 & lastUpdateID) const
+{
+   // The database's senior peer is our fallback, since its log holds everything a junior peer could still be missing
+   const ZGPeerID & seniorPeerID = GetSeniorPeerIDForDatabase(whichDB);
+   ZGPeerID bestPeerID = seniorPeerID;
+   uint64 bestCost     = GetCatchUpCost(bestPeerID, _catchUpOffers.Get(bestPeerID));
+   uint64 bestLastID   = lastUpdateID;
+
+   const uint64 now = GetRunTime64();
+   for (ConstHashtableIterator<ZGPeerID, PZGCatchUpOffer> iter(_catchUpOffers); iter.HasData(); iter++)
+   {
+      const PZGCatchUpOffer & offer = iter.GetValue();
+      uint64 offerLastID = lastUpdateID;
+      if ((iter.GetKey() == seniorPeerID)||(now > (offer.GetReceiveTime()+PZG_CATCH_UP_OFFER_MAX_AGE_MICROS))||(offer.CanResendUpdates(whichDB, firstUpdateID, offerLastID) == false)) continue;
+
+      const uint64 cost = GetCatchUpCost(iter.GetKey(), &offer);
+      if (cost < bestCost)
+      {
+         bestPeerID = iter.GetKey();
+         bestCost   = cost;
+         bestLastID = offerLastID;
+      }
+   }
+
+   lastUpdateID = bestLastID;
+   return bestPeerID;
+}
+
+ZGPeerID ZGPeerSession :: GetFullDatabaseResendSourcePeerID(uint32 whichDB, uint64 minimumStateID) const
+{
+   const ZGPeerID & seniorPeerID = GetSeniorPeerIDForDatabase(whichDB);
+   ZGPeerID bestPeerID = seniorPeerID;
+   uint64 bestCost     = GetCatchUpCost(bestPeerID, _catchUpOffers.Get(bestPeerID));
+
+   const uint64 now = GetRunTime64();
+   for (ConstHashtableIterator<ZGPeerID, PZGCatchUpOffer> iter(_catchUpOffers); iter.HasData(); iter++)
+   {
+      const PZGCatchUpOffer & offer = iter.GetValue();
+      if ((iter.GetKey() == seniorPeerID)||(now > (offer.GetReceiveTime()+PZG_CATCH_UP_OFFER_MAX_AGE_MICROS))||(offer.CanResendFullDatabase(whichDB, minimumStateID) == false)) continue;
+
+      const uint64 cost = GetCatchUpCost(iter.GetKey(), &offer);
+      if (cost < bestCost)
+      {
+         bestPeerID = iter.GetKey();
+         bestCost   = cost;
+      }
+   }
+   return bestPeerID;
 }
 
-void ZGPeerSession :: BeaconDataChanged(const ConstPZGBeaconDataRef & beaconData)
+void ZGPeerSession :: BeaconDataChanged(const ZGPeerID & fromPeerID, const ConstPZGBeaconDataRef & beaconData)
 {
    const uint32 numDBIs = beaconData() ? beaconData()->GetDatabaseStateInfos().GetNumItems() : 0;
    if (numDBIs == _databases.GetNumItems())
    {
-      for (uint32 i=0; i<numDBIs; i++) _databases[i].SeniorDatabaseStateInfoChanged(beaconData()->GetDatabaseStateInfos()[i]);
+      (void) _databaseSeniorBeaconDatas.Put(fromPeerID, beaconData);  // in case (fromPeerID) becomes the senior peer of more databases later on
+
+      // (fromPeerID) only speaks for the databases it is the senior peer of
+      for (uint32 i=0; i<numDBIs; i++) if (GetSeniorPeerIDForDatabase(i) == fromPeerID) _databases[i].SeniorDatabaseStateInfoChanged(beaconData()->GetDatabaseStateInfos()[i]);
+      UpdateLocalPeerIsCaughtUp();
    }
-   else LogTime(MUSCLE_LOG_ERROR, "ZGPeerSession::BeaconDataChanged:  Wrong number of DBIs in update!  (Expected " UINT32_FORMAT_SPEC ", got " UINT32_FORMAT_SPEC ")\n", _databases.GetNumItems(),  numDBIs);
+   else LogTime(MUSCLE_LOG_ERROR, "ZGPeerSession::BeaconDataChanged:  Wrong number of DBIs in update from [%s]!  (Expected " UINT32_FORMAT_SPEC ", got " UINT32_FORMAT_SPEC ")\n", fromPeerID.ToString()(), _databases.GetNumItems(),  numDBIs);
 }
 
 
@@ -545,7 +1126,24 @@ ConstPZGDatabaseUpdateRef ZGPeerSession :: GetDatabaseUpdateByID(uint32 whichDB,
       return ConstPZGDatabaseUpdateRef();
    }
 
-   return _databases[whichDB].GetDatabaseUpdateByID(updateID, *this);
+   return _databases[whichDB].GetDatabaseUpdateByID(updateID);
+}
+
+void ZGPeerSession :: BackOrderLookupCompleted(uint32 whichDB, bool wasInUpdateLog)
+{
+   if (_databases.IsIndexValid(whichDB)) _databases[whichDB].BackOrderLookupCompleted(wasInUpdateLog);
+}
+
+ConstPZGDatabaseUpdateRef ZGPeerSession :: GetFullDatabaseUpdateForTransfer(uint32 whichDB, bool & retCanFlattenAsynchronously)
+{
+   retCanFlattenAsynchronously = false;
+   if (_databases.IsIndexValid(whichDB) == false)
+   {
+      LogTime(MUSCLE_LOG_ERROR, "ZGPeerSession::GetFullDatabaseUpdateForTransfer:  Unknown database ID #" UINT32_FORMAT_SPEC "\n", whichDB);
+      return B_BAD_ARGUMENT;
+   }
+
+   return _databases[whichDB].GetFullDatabaseUpdate(*this, true, retCanFlattenAsynchronously);
 }
 
 int64 ZGPeerSession :: GetToNetworkTimeOffset() const
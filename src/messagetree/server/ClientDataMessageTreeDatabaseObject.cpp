@@ -112,7 +112,7 @@ static Message _uploadLocalDataRequestMsg(CLIENTDATA_COMMAND_UPLOADLOCALDATA);
 void ClientDataMessageTreeDatabaseObject :: LocalSeniorPeerStatusChanged()
 {
    MessageTreeDatabaseObject::LocalSeniorPeerStatusChanged();
-   if (GetDatabasePeerSession()->IAmTheSeniorPeer())
+   if (GetDatabasePeerSession()->IAmTheSeniorPeerForDatabase(GetDatabaseIndex()))
    {
       // Delete any peerID-nodes for peer-IDs that are not currently on line
       String nodesToDelete;
@@ -142,13 +142,13 @@ void ClientDataMessageTreeDatabaseObject :: LocalSeniorPeerStatusChanged()
 void ClientDataMessageTreeDatabaseObject :: PeerHasComeOnline(const ZGPeerID & peerID, const ConstMessageRef & peerInfo)
 {
    MessageTreeDatabaseObject::PeerHasComeOnline(peerID, peerInfo);
-   if (GetDatabasePeerSession()->IAmTheSeniorPeer()) (void) SendMessageToDatabaseObject(peerID, DummyMessageRef(_uploadLocalDataRequestMsg));
+   if (GetDatabasePeerSession()->IAmTheSeniorPeerForDatabase(GetDatabaseIndex())) (void) SendMessageToDatabaseObject(peerID, DummyMessageRef(_uploadLocalDataRequestMsg));
 }
 
 void ClientDataMessageTreeDatabaseObject :: PeerHasGoneOffline(const ZGPeerID & peerID, const ConstMessageRef & peerInfo)
 {
    MessageTreeDatabaseObject::PeerHasGoneOffline(peerID, peerInfo);
-   if (GetDatabasePeerSession()->IAmTheSeniorPeer()) (void) MessageTreeDatabaseObject::RequestDeleteNodes(peerID.ToString(), ConstQueryFilterRef(), TreeGatewayFlags(), GetEmptyString());
+   if (GetDatabasePeerSession()->IAmTheSeniorPeerForDatabase(GetDatabaseIndex())) (void) MessageTreeDatabaseObject::RequestDeleteNodes(peerID.ToString(), ConstQueryFilterRef(), TreeGatewayFlags(), GetEmptyString());
 }
 
 void ClientDataMessageTreeDatabaseObject :: MessageReceivedFromMessageTreeDatabaseObject(const MessageRef & msg, const ZGPeerID & sourcePeer, uint32 sourceDBIdx)
@@ -203,7 +203,7 @@ void ClientDataMessageTreeDatabaseObject :: MessageReceivedFromMessageTreeDataba
 
       case CLIENTDATA_COMMAND_LOCALDATA:
       {
-         if (GetDatabasePeerSession()->IAmTheSeniorPeer())
+         if (GetDatabasePeerSession()->IAmTheSeniorPeerForDatabase(GetDatabaseIndex()))
          {
             const String * nextPath;
             MessageRef nextPayload;
@@ -1,5 +1,7 @@
 #include "zg/messagetree/server/MessageTreeDatabasePeerSession.h"
 #include "zg/messagetree/server/MessageTreeDatabaseObject.h"
+#include "zg/ZGChecksumUtilityFunctions.h"
+#include "zg/ZGCompactCodec.h"
 #include "zg/messagetree/gateway/SymlinkLogicMuxTreeGateway.h"  // just for SYMLINK_FIELD_NAME
 #include "reflector/StorageReflectSession.h"  // for NODE_DEPTH_USER
 #include "regex/SegmentedStringMatcher.h"
@@ -15,6 +17,7 @@ enum {
    MTDO_COMMAND_UPDATESUBTREE,
    MTDO_COMMAND_INSERTINDEXENTRY,
    MTDO_COMMAND_REMOVEINDEXENTRY,
+   MTDO_COMMAND_COMPACT_BATCH,  // holds a MessageTreeCompactBatch (see below) in its MTDO_NAME_COMPACT field
 };
 
 // Command-codes that can be used only in SeniorUpdate()
@@ -28,6 +31,12 @@ enum {
    MTDO_JUNIOR_COMMAND_UNUSED = 1836345955, // 'mtjc'
 };
 
+// Command-codes used by JuniorRepair() and SeniorRepair()
+enum {
+   MTDO_REPAIR_COMMAND_REQUEST = 1836348016, // 'mtrp'
+   MTDO_REPAIR_COMMAND_REPLY,
+};
+
 static const String MTDO_NAME_PATH    = "pth";
 static const String MTDO_NAME_PAYLOAD = "pay";
 static const String MTDO_NAME_FLAGS   = "flg";
@@ -36,9 +45,222 @@ static const String MTDO_NAME_FILTER  = "fil";
 static const String MTDO_NAME_INDEX   = "idx";
 static const String MTDO_NAME_KEY     = "key";
 static const String MTDO_NAME_TAG     = "tag";
+static const String MTDO_NAME_COMPACT = "cmp";
+
+// Field names used in repair-Messages only
+static const String MTDO_NAME_UNIT             = "unt";  // a sub-Message describing (or answering a description of) one node, or one subset of a node's children
+static const String MTDO_NAME_PREFIX           = "pfx";  // which subset of a node's children the unit covers (by the top bits of the hashes of their names)
+static const String MTDO_NAME_NUMBITS          = "nbt";  // how many bits of name-hash are in (MTDO_NAME_PREFIX); 0 means the unit covers the whole node
+static const String MTDO_NAME_MISSING          = "mis";  // the junior peer doesn't have this node at all
+static const String MTDO_NAME_PAYLOAD_CHECKSUM = "pck";
+static const String MTDO_NAME_INDEX_CHECKSUM   = "ick";
+static const String MTDO_NAME_CHECKSUM         = "cks";  // subtree-checksums of the children listed under MTDO_NAME_KEY
+static const String MTDO_NAME_HAS_CHILDREN     = "hkd";
+static const String MTDO_NAME_BUCKET           = "bkt";  // sums of the subtree-checksums of the children in each bucket
+static const String MTDO_NAME_REMOVE           = "rmv";
+static const String MTDO_NAME_REMOVE_KEY       = "rmk";
+static const String MTDO_NAME_ARCHIVE          = "arc";
+static const String MTDO_NAME_CHILD            = "kid";
+static const String MTDO_NAME_INDEXED          = "ixd";
+static const String MTDO_NAME_FIX_INDEX        = "ifx";
+static const String MTDO_NAME_INDEX_KEYS       = "ixk";
+static const String MTDO_NAME_DESCEND          = "dsc";
+static const String MTDO_NAME_DESCEND_PREFIX   = "dpx";
+
+static const uint32 MTDO_MAX_REPAIR_LISTED_CHILDREN = 64;  // a node (or subset) with more children than this has them summarized in buckets instead
+static const uint32 MTDO_REPAIR_BITS_PER_LEVEL      = 6;
+static const uint32 MTDO_NUM_REPAIR_BUCKETS         = (1<<MTDO_REPAIR_BITS_PER_LEVEL);
+static const uint32 MTDO_MAX_CACHED_SUBTREE_CHECKSUMS = 256*1024;  // beyond this many cached subtree-checksums, we start the cache over rather than growing it further
+
+enum {MTDO_COMPACT_BATCH_TYPE_CODE = 1836344162}; // 'mtcb'
+
+// Schemas of the compact records that MTDO_COMMAND_UPDATENODEVALUE, MTDO_COMMAND_INSERTINDEXENTRY and MTDO_COMMAND_REMOVEINDEXENTRY Messages are encoded as
+typedef ZGCompactRecord<String, ConstMessageRef, TreeGatewayFlags, String, String> MTDONodeUpdateRecord;   // path, optPayload, flags, optBefore, optOpTag
+typedef ZGCompactRecord<String, TreeGatewayFlags, uint32, String, String>          MTDOIndexUpdateRecord;  // path, flags, index, key, optOpTag
+
+static const String _nodeUpdateFieldNames[]  = {MTDO_NAME_PATH, MTDO_NAME_PAYLOAD, MTDO_NAME_FLAGS, MTDO_NAME_BEFORE, MTDO_NAME_TAG};
+static const String _indexUpdateFieldNames[] = {MTDO_NAME_PATH, MTDO_NAME_FLAGS, MTDO_NAME_INDEX, MTDO_NAME_KEY, MTDO_NAME_TAG};
+
+// Returns true iff every field in (msg) has one of the given names (i.e. a subclass hasn't added any fields of its own)
+static bool HasOnlyTheseFields(const Message & msg, const String * names, uint32 numNames)
+{
+   for (MessageFieldNameIterator iter = msg.GetFieldNameIterator(); iter.HasData(); iter++)
+   {
+      bool isKnown = false;
+      for (uint32 i=0; ((isKnown == false)&&(i<numNames)); i++) isKnown = (iter.GetFieldName() == names[i]);
+      if (isKnown == false) return false;
+   }
+   return true;
+}
+
+/** One command from a junior-update Message, in decoded form */
+class MessageTreeCompactCommand
+{
+public:
+   MessageTreeCompactCommand() : _what(0), _index(0) {/* empty */}
+
+   uint32 _what;               // MTDO_COMMAND_UPDATENODEVALUE, MTDO_COMMAND_INSERTINDEXENTRY or MTDO_COMMAND_REMOVEINDEXENTRY
+   String _path;
+   ConstMessageRef _payload;   // node-updates only
+   TreeGatewayFlags _flags;
+   String _before;             // node-updates only
+   uint32 _index;              // index-updates only
+   String _key;                // index-updates only
+   String _tag;
+};
+
+/** A list of junior-update commands, flattened as a sequence of compact fixed-layout records rather than
+  * as a PR_COMMAND_BATCH of Messages.  That way a junior peer doesn't have to unflatten a Message (and look
+  * up its fields by name) for every node it updates; only the node-payload Messages themselves are unflattened.
+  */
+class MessageTreeCompactBatch : public FlatCountable
+{
+public:
+   MessageTreeCompactBatch() {/* empty */}
+
+   MUSCLE_NODISCARD virtual bool IsFixedSize() const {return false;}
+   MUSCLE_NODISCARD virtual uint32 TypeCode() const {return MTDO_COMPACT_BATCH_TYPE_CODE;}
+
+   MUSCLE_NODISCARD virtual uint32 FlattenedSize() const
+   {
+      uint32 ret = sizeof(uint32);  // number of commands
+      for (uint32 i=0; i<_commands.GetNumItems(); i++)
+      {
+         const MessageTreeCompactCommand & c = _commands[i];
+         ret += sizeof(uint32);  // command code
+         if (c._what == MTDO_COMMAND_UPDATENODEVALUE) ret += MTDONodeUpdateRecord::GetEncodedSize(c._path, c._payload, c._flags, c._before, c._tag);
+                                                 else ret += MTDOIndexUpdateRecord::GetEncodedSize(c._path, c._flags, c._index, c._key, c._tag);
+      }
+      return ret;
+   }
+
+   virtual void Flatten(DataFlattener flat) const
+   {
+      flat.WriteInt32(_commands.GetNumItems());
+      for (uint32 i=0; i<_commands.GetNumItems(); i++)
+      {
+         const MessageTreeCompactCommand & c = _commands[i];
+         flat.WriteInt32(c._what);
+         if (c._what == MTDO_COMMAND_UPDATENODEVALUE) MTDONodeUpdateRecord::Encode(flat, c._path, c._payload, c._flags, c._before, c._tag);
+                                                 else MTDOIndexUpdateRecord::Encode(flat, c._path, c._flags, c._index, c._key, c._tag);
+      }
+   }
+
+   virtual status_t Unflatten(DataUnflattener & unflat)
+   {
+      const uint32 numCommands = unflat.ReadInt32();
+      MRETURN_ON_ERROR(unflat.GetStatus());
+      if (numCommands > unflat.GetNumBytesAvailable()) return B_BAD_DATA;  // every command takes at least one byte, so this can't be right
+
+      _commands.Clear();
+      MRETURN_ON_ERROR(_commands.EnsureSize(numCommands, true));
+      for (uint32 i=0; i<numCommands; i++)
+      {
+         MessageTreeCompactCommand & c = _commands[i];
+         c._what = unflat.ReadInt32();
+         switch(c._what)
+         {
+            case MTDO_COMMAND_UPDATENODEVALUE:
+               MRETURN_ON_ERROR(MTDONodeUpdateRecord::Decode(unflat, c._path, c._payload, c._flags, c._before, c._tag));
+            break;
+
+            case MTDO_COMMAND_INSERTINDEXENTRY: case MTDO_COMMAND_REMOVEINDEXENTRY:
+               MRETURN_ON_ERROR(MTDOIndexUpdateRecord::Decode(unflat, c._path, c._flags, c._index, c._key, c._tag));
+            break;
+
+            default:
+               LogTime(MUSCLE_LOG_ERROR, "MessageTreeCompactBatch::Unflatten():  Unknown command code " UINT32_FORMAT_SPEC "\n", c._what);
+            return B_BAD_DATA;
+         }
+      }
+      return unflat.GetStatus();
+   }
+
+   /** Appends the commands in (msg) to our list, recursing into any PR_COMMAND_BATCH Messages.
+     * @param msg a junior-update Message, as assembled by MessageTreeDatabaseObject::SeniorUpdate()
+     * @returns B_NO_ERROR on success, or B_UNIMPLEMENTED if (msg) contains anything that we can't represent
+     *          (e.g. commands or fields added by a subclass), in which case (msg) should be sent as-is instead.
+     */
+   status_t AddCommands(const Message & msg)
+   {
+      switch(msg.what)
+      {
+         case PR_COMMAND_BATCH:
+         {
+            ConstMessageRef subMsg;
+            for (int32 i=0; msg.FindMessage(PR_NAME_KEYS, i, subMsg).IsOK(); i++) MRETURN_ON_ERROR(AddCommands(*subMsg()));
+            return (msg.GetNumNames() == 1) ? B_NO_ERROR : B_UNIMPLEMENTED;
+         }
+
+         case MTDO_COMMAND_NOOP:
+            return B_NO_ERROR;
+
+         case MTDO_COMMAND_UPDATENODEVALUE:
+         {
+            if (HasOnlyTheseFields(msg, _nodeUpdateFieldNames, ARRAYITEMS(_nodeUpdateFieldNames)) == false) return B_UNIMPLEMENTED;
+
+            MessageTreeCompactCommand c;
+            c._what    = msg.what;
+            c._path    = msg.GetStringReference(MTDO_NAME_PATH);
+            c._payload = msg.GetMessage(MTDO_NAME_PAYLOAD);
+            c._flags   = msg.GetFlat<TreeGatewayFlags>(MTDO_NAME_FLAGS);
+            c._before  = msg.GetStringReference(MTDO_NAME_BEFORE);
+            c._tag     = msg.GetStringReference(MTDO_NAME_TAG);
+            return _commands.AddTail(c);
+         }
+
+         case MTDO_COMMAND_INSERTINDEXENTRY: case MTDO_COMMAND_REMOVEINDEXENTRY:
+         {
+            if (HasOnlyTheseFields(msg, _indexUpdateFieldNames, ARRAYITEMS(_indexUpdateFieldNames)) == false) return B_UNIMPLEMENTED;
+
+            MessageTreeCompactCommand c;
+            c._what  = msg.what;
+            c._path  = msg.GetStringReference(MTDO_NAME_PATH);
+            c._flags = msg.GetFlat<TreeGatewayFlags>(MTDO_NAME_FLAGS);
+            c._index = (uint32) msg.GetInt32(MTDO_NAME_INDEX);
+            c._key   = msg.GetStringReference(MTDO_NAME_KEY);
+            c._tag   = msg.GetStringReference(MTDO_NAME_TAG);
+            return _commands.AddTail(c);
+         }
+
+         default:
+            return B_UNIMPLEMENTED;
+      }
+   }
+
+   MUSCLE_NODISCARD const Queue<MessageTreeCompactCommand> & GetCommands() const {return _commands;}
+
+protected:
+   virtual status_t CopyFromImplementation(const Flattenable & copyFrom)
+   {
+      const MessageTreeCompactBatch * b = dynamic_cast<const MessageTreeCompactBatch *>(&copyFrom);
+      if (b) {_commands = b->_commands; return B_NO_ERROR;}
+        else return FlatCountable::CopyFromImplementation(copyFrom);
+   }
+
+private:
+   Queue<MessageTreeCompactCommand> _commands;
+};
+DECLARE_REFTYPES(MessageTreeCompactBatch);
+
+static MessageTreeCompactBatchRef::ItemPool _compactBatchPool;
+
+// Converts an assembled junior-update Message into an MTDO_COMMAND_COMPACT_BATCH Message, if possible.
+// If (juniorMsg) holds anything the compact encoding doesn't cover, it's returned unchanged.
+static ConstMessageRef CompileJuniorMessage(const ConstMessageRef & juniorMsg)
+{
+   if (juniorMsg()->what == MTDO_COMMAND_NOOP) return juniorMsg;  // nothing to gain
+
+   MessageTreeCompactBatchRef batch(_compactBatchPool.ObtainObject());
+   if ((batch() == NULL)||(batch()->AddCommands(*juniorMsg()).IsError())||(batch()->GetCommands().IsEmpty())) return juniorMsg;
+
+   MessageRef compactMsg = GetMessageFromPool(MTDO_COMMAND_COMPACT_BATCH);
+   return ((compactMsg())&&(compactMsg()->AddFlat(MTDO_NAME_COMPACT, FlatCountableRef(batch)).IsOK())) ? AddConstToRef(compactMsg) : juniorMsg;
+}
 
 MessageTreeDatabaseObject :: MessageTreeDatabaseObject(MessageTreeDatabasePeerSession * session, int32 dbIndex, const String & rootNodePath)
    : IDatabaseObject(session, dbIndex)
+   , _isAssemblingSpeculativeUndo(false)
    , _rootNodePathWithoutSlash(rootNodePath.WithoutSuffix("/"))
    , _rootNodePathWithSlash(rootNodePath.WithSuffix("/"))
    , _rootNodeDepth(GetPathDepth(rootNodePath()))
@@ -49,6 +271,7 @@ MessageTreeDatabaseObject :: MessageTreeDatabaseObject(MessageTreeDatabasePeerSe
 
 void MessageTreeDatabaseObject :: SetToDefaultState()
 {
+   _subtreeChecksums.Clear();
    (void) RemoveDataNodes(_rootNodePathWithoutSlash);
 }
 
@@ -57,6 +280,7 @@ status_t MessageTreeDatabaseObject :: SetFromArchive(const ConstMessageRef & arc
    MessageTreeDatabasePeerSession * zsh = GetMessageTreeDatabasePeerSession();
    if (zsh == NULL) return B_BAD_OBJECT;
 
+   _subtreeChecksums.Clear();  // since our entire node-tree is about to be replaced
    return zsh->RestoreNodeTreeFromMessage(*archive(), _rootNodePathWithoutSlash, true);
 }
 
@@ -69,13 +293,98 @@ status_t MessageTreeDatabaseObject :: SaveToArchive(const MessageRef & archive)
    return rootNode ? zsh->SaveNodeTreeToMessage(*archive(), rootNode, GetEmptyString(), true) : B_NO_ERROR;
 }
 
-uint32 MessageTreeDatabaseObject :: CalculateChecksum() const
+ConstMessageRef MessageTreeDatabaseObject :: SaveToSnapshot() const
+{
+   // The archive is just a skeleton of per-node Messages that references our nodes' payload Messages.
+   // Since those payloads are always replaced rather than modified in-place, the archive shares them
+   // with our live node-tree and will remain valid (and unchanging) no matter what happens to us later.
+   MessageRef archive = GetMessageFromPool();
+   MRETURN_ON_ERROR(archive);
+   MRETURN_ON_ERROR(SaveToArchive(archive));
+   return AddConstToRef(archive);
+}
+
+uint64 MessageTreeDatabaseObject :: CalculateChecksum() const
 {
    const MessageTreeDatabasePeerSession * zsh = GetMessageTreeDatabasePeerSession();
    if (zsh == NULL) return 0;
 
    const DataNode * rootNode = zsh->GetDataNode(_rootNodePathWithoutSlash);
-   return rootNode ? rootNode->CalculateChecksum() : 0;
+   return rootNode ? CalculateNodeChecksum(*rootNode) : 0;
+}
+
+// Returns the 64-bit checksum of (node) and all of its descendants.  This must stay in sync with the
+// running-checksum updates in MessageTreeNodeUpdated() and MessageTreeNodeIndexChanged(), below.
+uint64 MessageTreeDatabaseObject :: CalculateNodeChecksum(const DataNode & node) const
+{
+   uint64 ret = CalculateNodeLocalChecksum(node);
+   for (DataNodeRefIterator iter(node.GetChildIterator()); iter.HasData(); iter++) ret += CalculateNodeChecksum(*iter.GetValue()());
+   return ret;
+}
+
+// Returns the 64-bit checksum of (node)'s name, payload, and index, but not of its children
+uint64 MessageTreeDatabaseObject :: CalculateNodeLocalChecksum(const DataNode & node) const
+{
+   uint64 ret = CalculateStringChecksum(node.GetNodeName());
+   if (node.GetData()()) ret += CalculateMessageChecksum(*node.GetData()());
+
+   const Queue<DataNodeRef> * index = node.GetIndex();
+   if (index) for (uint32 i=0; i<index->GetNumItems(); i++) ret += CalculateStringChecksum((*index)[i]()->GetNodeName());
+   return ret;
+}
+
+uint64 MessageTreeDatabaseObject :: CalculateBytesChecksum(const uint8 * bytes, uint32 numBytes) const
+{
+   return CalculateChecksum64(bytes, numBytes);
+}
+
+// Flattens (msg) into our scratch buffer (rather than into a newly allocated one) and returns the checksum of its bytes
+uint64 MessageTreeDatabaseObject :: CalculateMessageChecksum(const Message & msg) const
+{
+   if (_checksumScratchBuf.SetNumBytes(msg.FlattenedSize(), false).IsError()) return 0;
+   (void) msg.FlattenToByteBuffer(_checksumScratchBuf);
+   return CalculateBytesChecksum(_checksumScratchBuf.GetBuffer(), _checksumScratchBuf.GetNumBytes());
+}
+
+// Same result as CalculateNodeChecksum(), but cached, so that repeatedly comparing subtrees during a repair
+// only costs us a full traversal once.  Note that whenever a node is cached, all of its descendants are too.
+uint64 MessageTreeDatabaseObject :: GetSubtreeChecksum(const DataNode & node) const
+{
+   const uint64 * cached = _subtreeChecksums.Get(&node);
+   if (cached) return *cached;
+
+   // Starting over is the only way to shrink the cache that keeps the descendants-are-cached invariant intact
+   if (_subtreeChecksums.GetNumItems() >= MTDO_MAX_CACHED_SUBTREE_CHECKSUMS) _subtreeChecksums.Clear();
+   return GetSubtreeChecksumAux(node);
+}
+
+uint64 MessageTreeDatabaseObject :: GetSubtreeChecksumAux(const DataNode & node) const
+{
+   const uint64 * cached = _subtreeChecksums.Get(&node);
+   if (cached) return *cached;
+
+   uint64 ret = CalculateNodeLocalChecksum(node);
+   for (DataNodeRefIterator iter(node.GetChildIterator()); iter.HasData(); iter++) ret += GetSubtreeChecksumAux(*iter.GetValue()());
+   (void) _subtreeChecksums.Put(&node, ret);  // if this fails, we'll just have to recalculate it next time
+   return ret;
+}
+
+// Called whenever (node) is created, modified, or removed, to invalidate the cached subtree-checksums that it contributed to
+void MessageTreeDatabaseObject :: SubtreeChecksumsChanged(const DataNode & node, bool isBeingRemoved)
+{
+   if (_subtreeChecksums.IsEmpty()) return;  // nothing to invalidate
+
+   if (isBeingRemoved) ForgetSubtreeChecksums(node);  // since a new node could be allocated at the same address later on
+                  else (void) _subtreeChecksums.Remove(&node);
+
+   // Since a cached node's descendants are always cached, once we reach an uncached ancestor we can stop
+   for (const DataNode * p = node.GetParent(); ((p)&&(_subtreeChecksums.Remove(p).IsOK())); p = p->GetParent()) {/* empty */}
+}
+
+void MessageTreeDatabaseObject :: ForgetSubtreeChecksums(const DataNode & node)
+{
+   (void) _subtreeChecksums.Remove(&node);
+   for (DataNodeRefIterator iter(node.GetChildIterator()); iter.HasData(); iter++) ForgetSubtreeChecksums(*iter.GetValue()());
 }
 
 ConstMessageRef MessageTreeDatabaseObject :: SeniorUpdate(const ConstMessageRef & seniorDoMsg)
@@ -94,7 +403,37 @@ ConstMessageRef MessageTreeDatabaseObject :: SeniorUpdate(const ConstMessageRef
 
    ConstMessageRef juniorMsg = _assembledJuniorMessage;
    _assembledJuniorMessage.Reset();
-   return juniorMsg;
+   return CompileJuniorMessage(juniorMsg);
+}
+
+ConstMessageRef MessageTreeDatabaseObject :: SpeculativeSeniorUpdate(const ConstMessageRef & seniorDoMsg)
+{
+   // While this flag is set, MessageTreeNodeUpdated() and MessageTreeNodeIndexChanged() also file the equal-and-opposite
+   // action of each change into _assembledSpeculativeUndoMessage, so that we can undo just the nodes this update touches
+   _isAssemblingSpeculativeUndo = true;
+   const ConstMessageRef juniorMsg = SeniorUpdate(seniorDoMsg);  // (juniorMsg) is of no use to us, since only the senior peer's version counts
+   _isAssemblingSpeculativeUndo = false;
+
+   MessageRef undoMsg = _assembledSpeculativeUndoMessage;
+   _assembledSpeculativeUndoMessage.Reset();
+   if (undoMsg() == NULL) undoMsg = GetMessageFromPool(MTDO_COMMAND_NOOP);
+   MRETURN_OOM_ON_NULL(undoMsg());
+
+   if (juniorMsg() == NULL)
+   {
+      // The update failed part-way through, so we'll undo whatever part of it did get done
+      const status_t ret = MessageTreeDatabaseObject::JuniorUpdate(undoMsg);
+      _assembledJuniorMessage.Reset();  // since we're still in the speculative-update context, our undo-actions were filed here too
+      if (ret.IsError()) LogTime(MUSCLE_LOG_CRITICALERROR, "MessageTreeDatabaseObject::SpeculativeSeniorUpdate():  Unable to undo failed speculative update! [%s]\n", ret());
+      return juniorMsg.GetStatus();
+   }
+
+   return undoMsg;
+}
+
+status_t MessageTreeDatabaseObject :: UndoSpeculativeSeniorUpdate(const ConstMessageRef & undoMsg)
+{
+   return undoMsg() ? MessageTreeDatabaseObject::JuniorUpdate(undoMsg) : B_BAD_ARGUMENT;  // the undo-actions are in the same format as a junior-update Message's
 }
 
 String MessageTreeDatabaseObject :: DatabaseSubpathToSessionRelativePath(const String & subPath, TreeGatewayFlags flags) const
@@ -135,6 +474,10 @@ status_t MessageTreeDatabaseObject :: SeniorMessageTreeUpdate(const ConstMessage
          return HandleSubtreeUpdateMessage(*msg());
       break;
 
+      case MTDO_COMMAND_COMPACT_BATCH:  // e.g. when redoing a previous update, see UndoStackMessageTreeDatabaseObject
+         return HandleCompactBatchMessage(*msg());
+      break;
+
       case MTDO_COMMAND_INSERTINDEXENTRY:
       case MTDO_COMMAND_REMOVEINDEXENTRY:
          return HandleNodeIndexUpdateMessage(*msg());
@@ -215,6 +558,10 @@ status_t MessageTreeDatabaseObject :: JuniorMessageTreeUpdate(const ConstMessage
          return HandleNodeIndexUpdateMessage(*msg());
       break;
 
+      case MTDO_COMMAND_COMPACT_BATCH:
+         return HandleCompactBatchMessage(*msg());
+      break;
+
       default:
          LogTime(MUSCLE_LOG_ERROR, "MessageTreeDatabaseObject::JuniorMessageTreeUpdate():  Unknown Message code " UINT32_FORMAT_SPEC "\n", msg()->what);
          msg()->Print(stdout);
@@ -234,7 +581,9 @@ void MessageTreeDatabaseObject :: MessageTreeNodeUpdated(const String & relative
 {
    if (IsInSeniorDatabaseUpdateContext())
    {
-      const status_t ret = SeniorRecordNodeUpdateMessage(relativePath, oldPayload, isBeingRemoved?GetDefaultObjectForType<ConstMessageRef>():node.GetData(), _assembledJuniorMessage, false, GetCurrentOpTag());
+      const ConstMessageRef & newPayload = isBeingRemoved ? GetDefaultObjectForType<ConstMessageRef>() : node.GetData();
+      status_t ret = SeniorRecordNodeUpdateMessage(relativePath, oldPayload, newPayload, _assembledJuniorMessage, false, GetCurrentOpTag());
+      if ((ret.IsOK())&&(_isAssemblingSpeculativeUndo)) ret = MessageTreeDatabaseObject::SeniorRecordNodeUpdateMessage(relativePath, newPayload, oldPayload, _assembledSpeculativeUndoMessage, true, GetCurrentOpTag());
       if (ret.IsError()) LogTime(MUSCLE_LOG_CRITICALERROR, "MessageTreeNodeUpdated %p:  Error assembling junior message for %s node [%s]!  [%s]\n", this, isBeingRemoved?"removed":"updated", relativePath(), ret());
    }
    else if ((IsInJuniorDatabaseUpdateContext() == false)&&(IsInSetupOrTeardown() == false))
@@ -243,14 +592,16 @@ void MessageTreeDatabaseObject :: MessageTreeNodeUpdated(const String & relative
       (void) PrintStackTrace();
    }
 
+   SubtreeChecksumsChanged(node, isBeingRemoved);
+
    // Update our running database-checksum to account for the changes being made to our subtree
-        if (isBeingRemoved) _checksum -= node.CalculateChecksum();
+        if (isBeingRemoved) _checksum -= CalculateNodeChecksum(node);
    else if (oldPayload())
    {
-      _checksum -= oldPayload()->CalculateChecksum();
-      if (node.GetData()()) _checksum += node.GetData()()->CalculateChecksum();
+      _checksum -= CalculateMessageChecksum(*oldPayload());
+      if (node.GetData()()) _checksum += CalculateMessageChecksum(*node.GetData()());
    }
-   else _checksum += node.CalculateChecksum();
+   else _checksum += CalculateNodeChecksum(node);
 }
 
 status_t MessageTreeDatabaseObject :: SeniorRecordNodeUpdateMessage(const String & relativePath, const ConstMessageRef & /*oldPayload*/, const ConstMessageRef & newPayload, MessageRef & assemblingMessage, bool prepend, const String & optOpTag)
@@ -261,11 +612,12 @@ status_t MessageTreeDatabaseObject :: SeniorRecordNodeUpdateMessage(const String
    return AssembleBatchMessage(assemblingMessage, msg, prepend);
 }
 
-void MessageTreeDatabaseObject :: MessageTreeNodeIndexChanged(const String & relativePath, DataNode & /*node*/, char op, uint32 index, const String & key)
+void MessageTreeDatabaseObject :: MessageTreeNodeIndexChanged(const String & relativePath, DataNode & node, char op, uint32 index, const String & key)
 {
    if (IsInSeniorDatabaseUpdateContext())
    {
-      const status_t ret = SeniorRecordNodeIndexUpdateMessage(relativePath, op, index, key, _assembledJuniorMessage, false, GetCurrentOpTag());
+      status_t ret = SeniorRecordNodeIndexUpdateMessage(relativePath, op, index, key, _assembledJuniorMessage, false, GetCurrentOpTag());
+      if ((ret.IsOK())&&(_isAssemblingSpeculativeUndo)) ret = MessageTreeDatabaseObject::SeniorRecordNodeIndexUpdateMessage(relativePath, (op == (char)INDEX_OP_ENTRYINSERTED) ? INDEX_OP_ENTRYREMOVED : INDEX_OP_ENTRYINSERTED, index, key, _assembledSpeculativeUndoMessage, true, GetCurrentOpTag());
       if (ret.IsError()) LogTime(MUSCLE_LOG_CRITICALERROR, "MessageTreeNodeIndexChanged %p:  Error assembling junior message for node-index-update to [%s]!  [%s]\n", this, relativePath(), ret());
    }
    else if ((IsInJuniorDatabaseUpdateContext() == false)&&(IsInSetupOrTeardown() == false))
@@ -274,11 +626,13 @@ void MessageTreeDatabaseObject :: MessageTreeNodeIndexChanged(const String & rel
       (void) PrintStackTrace();
    }
 
+   SubtreeChecksumsChanged(node, false);
+
    // Update our running database-checksum to account for the changes being made to our subtree
    switch(op)
    {
-      case INDEX_OP_ENTRYINSERTED: _checksum += key.CalculateChecksum(); break;
-      case INDEX_OP_ENTRYREMOVED:  _checksum -= key.CalculateChecksum(); break;
+      case INDEX_OP_ENTRYINSERTED: _checksum += CalculateStringChecksum(key); break;
+      case INDEX_OP_ENTRYREMOVED:  _checksum -= CalculateStringChecksum(key); break;
       case INDEX_OP_CLEARED:       LogTime(MUSCLE_LOG_CRITICALERROR, "MessageTreeNodeIndexChanged():  checksum-update for INDEX_OP_CLEARED is not implemented!  (%s)\n", relativePath()); break;  // Dunno how to handle this, and it never gets called anyway
    }
 }
@@ -291,6 +645,300 @@ status_t MessageTreeDatabaseObject :: SeniorRecordNodeIndexUpdateMessage(const S
    return AssembleBatchMessage(assemblingMessage, msg, prepend);
 }
 
+// Returns true iff a child node with the given name belongs to the subset of children described by (numBits) and (prefix)
+static bool IsNodeNameInRepairSubset(const String & name, uint32 numBits, uint64 prefix)
+{
+   return ((numBits == 0)||((CalculateChecksum64(name) >> (64-numBits)) == prefix));
+}
+
+// Returns the bucket that a child node with the given name falls into, within the subset of children described by (numBits)
+static uint32 GetRepairBucketForNodeName(const String & name, uint32 numBits)
+{
+   return (uint32) ((CalculateChecksum64(name) >> (64-(numBits+MTDO_REPAIR_BITS_PER_LEVEL))) & (MTDO_NUM_REPAIR_BUCKETS-1));
+}
+
+uint64 MessageTreeDatabaseObject :: GetRepairPayloadChecksum(const DataNode & node) const
+{
+   return node.GetData()() ? CalculateMessageChecksum(*node.GetData()()) : 0;
+}
+
+// Unlike the checksums we use elsewhere, this one depends on the order of the index's entries
+uint64 MessageTreeDatabaseObject :: GetRepairIndexChecksum(const DataNode & node) const
+{
+   uint64 ret = 0;
+   const Queue<DataNodeRef> * index = node.GetIndex();
+   if (index) for (uint32 i=0; i<index->GetNumItems(); i++) ret = MixChecksum64(ret + CalculateStringChecksum((*index)[i]()->GetNodeName()));
+   return ret;
+}
+
+static String GetRepairChildPath(const String & path, const String & childName)
+{
+   return path.HasChars() ? path.WithAppendedWord(childName, "/") : childName;
+}
+
+status_t MessageTreeDatabaseObject :: JuniorRepair(const ConstMessageRef & optRepairReplyMsg, MessageRef & retNextRequestMsg)
+{
+   GatewaySubscriberCommandBatchGuard<ITreeGateway> batchGuard(GetMessageTreeDatabasePeerSession());  // so that MessageTreeDatabasePeerSession::CommandBatchEnds() will call PushSubscriptionMessages() when we're done
+
+   MessageRef requestMsg = GetMessageFromPool(MTDO_REPAIR_COMMAND_REQUEST);
+   MRETURN_OOM_ON_NULL(requestMsg());
+
+   if (optRepairReplyMsg())
+   {
+      if (optRepairReplyMsg()->what != MTDO_REPAIR_COMMAND_REPLY) return B_BAD_ARGUMENT;
+
+      // Apply all of the senior peer's fixes first, so that the follow-up units we send describe our post-fix state
+      ConstMessageRef answerMsg;
+      for (int32 i=0; optRepairReplyMsg()->FindMessage(MTDO_NAME_UNIT, i, answerMsg).IsOK(); i++) MRETURN_ON_ERROR(JuniorApplyRepairUnit(*answerMsg()));
+      for (int32 i=0; optRepairReplyMsg()->FindMessage(MTDO_NAME_UNIT, i, answerMsg).IsOK(); i++) MRETURN_ON_ERROR(JuniorAddFollowUpRepairUnits(*answerMsg(), *requestMsg()));
+   }
+   else MRETURN_ON_ERROR(JuniorAddRepairUnit(*requestMsg(), GetEmptyString(), 0, 0));  // a new pass starts by comparing our root nodes
+
+   retNextRequestMsg = requestMsg()->HasName(MTDO_NAME_UNIT) ? requestMsg : MessageRef();
+   return B_NO_ERROR;
+}
+
+// Adds to (requestMsg) a unit describing our node at (path), or (if numBits is non-zero) just the subset of its children described by (prefix)
+status_t MessageTreeDatabaseObject :: JuniorAddRepairUnit(Message & requestMsg, const String & path, uint32 numBits, uint64 prefix) const
+{
+   MessageRef unitMsg = GetMessageFromPool();
+   MRETURN_OOM_ON_NULL(unitMsg());
+
+   MRETURN_ON_ERROR(unitMsg()->AddString(MTDO_NAME_PATH,    path));
+   MRETURN_ON_ERROR(unitMsg()->AddInt32( MTDO_NAME_NUMBITS, numBits));
+   MRETURN_ON_ERROR(unitMsg()->AddInt64( MTDO_NAME_PREFIX,  prefix));
+
+   const DataNode * node = GetDataNode(path);
+   if (node)
+   {
+      if (numBits == 0)
+      {
+         MRETURN_ON_ERROR(unitMsg()->AddInt64(MTDO_NAME_PAYLOAD_CHECKSUM, GetRepairPayloadChecksum(*node)));
+         MRETURN_ON_ERROR(unitMsg()->AddInt64(MTDO_NAME_INDEX_CHECKSUM,   GetRepairIndexChecksum(*node)));
+      }
+
+      uint32 numChildren = 0;
+      for (DataNodeRefIterator iter(node->GetChildIterator()); iter.HasData(); iter++) if (IsNodeNameInRepairSubset(*iter.GetKey(), numBits, prefix)) numChildren++;
+
+      if ((numChildren > MTDO_MAX_REPAIR_LISTED_CHILDREN)&&((numBits+MTDO_REPAIR_BITS_PER_LEVEL) <= 64))
+      {
+         // Too many children to list individually, so we'll just summarize them by bucket
+         uint64 buckets[MTDO_NUM_REPAIR_BUCKETS]; memset(buckets, 0, sizeof(buckets));
+         for (DataNodeRefIterator iter(node->GetChildIterator()); iter.HasData(); iter++) if (IsNodeNameInRepairSubset(*iter.GetKey(), numBits, prefix)) buckets[GetRepairBucketForNodeName(*iter.GetKey(), numBits)] += GetSubtreeChecksum(*iter.GetValue()());
+         for (uint32 i=0; i<ARRAYITEMS(buckets); i++) MRETURN_ON_ERROR(unitMsg()->AddInt64(MTDO_NAME_BUCKET, buckets[i]));
+      }
+      else
+      {
+         for (DataNodeRefIterator iter(node->GetChildIterator()); iter.HasData(); iter++)
+         {
+            const DataNode & child = *iter.GetValue()();
+            if (IsNodeNameInRepairSubset(child.GetNodeName(), numBits, prefix))
+            {
+               MRETURN_ON_ERROR(unitMsg()->AddString(MTDO_NAME_KEY,          child.GetNodeName()));
+               MRETURN_ON_ERROR(unitMsg()->AddInt64( MTDO_NAME_CHECKSUM,     GetSubtreeChecksum(child)));
+               MRETURN_ON_ERROR(unitMsg()->AddBool(  MTDO_NAME_HAS_CHILDREN, child.GetNumChildren() > 0));
+            }
+         }
+      }
+   }
+   else MRETURN_ON_ERROR(unitMsg()->AddBool(MTDO_NAME_MISSING, true));
+
+   return requestMsg.AddMessage(MTDO_NAME_UNIT, unitMsg);
+}
+
+// Applies the fixes in one unit of the senior peer's answer to our local database
+status_t MessageTreeDatabaseObject :: JuniorApplyRepairUnit(const Message & answerMsg)
+{
+   MessageTreeDatabasePeerSession * zsh = GetMessageTreeDatabasePeerSession();
+   if (zsh == NULL) return B_BAD_OBJECT;
+
+   const String & path = answerMsg.GetStringReference(MTDO_NAME_PATH);
+   DataNode * node = GetDataNode(path);
+
+   ConstMessageRef archive;
+   if (answerMsg.FindMessage(MTDO_NAME_ARCHIVE, archive).IsOK()) return RestoreNodeTreeFromMessage(*archive(), path, true);  // we didn't have this node, so here's all of it
+   if (answerMsg.GetBool(MTDO_NAME_REMOVE))
+   {
+      if ((node)&&(node->GetParent())) (void) node->GetParent()->RemoveChild(node->GetNodeName(), zsh, true, NULL);  // the senior peer doesn't have this node, so we shouldn't either
+      return B_NO_ERROR;
+   }
+   if (node == NULL) return B_DATA_NOT_FOUND;  // shouldn't happen, since we only ask about nodes that we have
+
+   String key;
+   for (int32 i=0; answerMsg.FindString(MTDO_NAME_REMOVE_KEY, i, key).IsOK(); i++) (void) node->RemoveChild(key, zsh, true, NULL);
+
+   // Children that are to be replaced outright (along with their entire subtrees)
+   ConstMessageRef childMsg;
+   for (int32 i=0; answerMsg.FindMessage(MTDO_NAME_CHILD, i, childMsg).IsOK(); i++)
+   {
+      const String & childName = childMsg()->GetStringReference(MTDO_NAME_KEY);
+      ConstMessageRef childArchive;
+      MRETURN_ON_ERROR(childMsg()->FindMessage(MTDO_NAME_ARCHIVE, childArchive));
+
+      (void) node->RemoveChild(childName, zsh, true, NULL);  // so that nothing of our version of the child's subtree survives
+      MRETURN_ON_ERROR(RestoreNodeTreeFromMessage(*childArchive(), GetRepairChildPath(path, childName), true));
+
+      if (childMsg()->GetBool(MTDO_NAME_INDEXED))
+      {
+         const String & optBefore = childMsg()->GetStringReference(MTDO_NAME_BEFORE);
+         const Queue<DataNodeRef> * index = node->GetIndex();
+         uint32 insertAt = index ? index->GetNumItems() : 0;
+         if ((index)&&(optBefore.HasChars())) for (uint32 j=0; j<index->GetNumItems(); j++) if ((*index)[j]()->GetNodeName() == optBefore) {insertAt = j; break;}
+         MRETURN_ON_ERROR(node->InsertIndexEntryAt(insertAt, zsh, childName));
+      }
+   }
+
+   ConstMessageRef payload;
+   if (answerMsg.FindMessage(MTDO_NAME_PAYLOAD, payload).IsOK()) node->SetData(payload, zsh);
+
+   if (answerMsg.GetBool(MTDO_NAME_FIX_INDEX))
+   {
+      // Rebuild our index from scratch, in the same order as the senior peer's
+      const Queue<DataNodeRef> * index = node->GetIndex();
+      for (uint32 i=index?index->GetNumItems():0; i>0; i--) (void) node->RemoveIndexEntryAt(i-1, zsh);
+
+      uint32 insertAt = 0;
+      for (int32 i=0; answerMsg.FindString(MTDO_NAME_INDEX_KEYS, i, key).IsOK(); i++) if (node->InsertIndexEntryAt(insertAt, zsh, key).IsOK()) insertAt++;
+   }
+
+   return B_NO_ERROR;
+}
+
+// Adds to (requestMsg) a unit for each part of the database that the senior peer's answer says we need to look at more closely
+status_t MessageTreeDatabaseObject :: JuniorAddFollowUpRepairUnits(const Message & answerMsg, Message & requestMsg) const
+{
+   const String & path   = answerMsg.GetStringReference(MTDO_NAME_PATH);
+   const uint32 numBits  = answerMsg.GetInt32(MTDO_NAME_NUMBITS);
+
+   String childName;
+   for (int32 i=0; answerMsg.FindString(MTDO_NAME_DESCEND, i, childName).IsOK(); i++) MRETURN_ON_ERROR(JuniorAddRepairUnit(requestMsg, GetRepairChildPath(path, childName), 0, 0));
+
+   int64 prefix;
+   for (int32 i=0; answerMsg.FindInt64(MTDO_NAME_DESCEND_PREFIX, i, prefix).IsOK(); i++) MRETURN_ON_ERROR(JuniorAddRepairUnit(requestMsg, path, numBits+MTDO_REPAIR_BITS_PER_LEVEL, (uint64) prefix));
+
+   return B_NO_ERROR;
+}
+
+ConstMessageRef MessageTreeDatabaseObject :: SeniorRepair(const ConstMessageRef & repairRequestMsg) const
+{
+   if ((repairRequestMsg() == NULL)||(repairRequestMsg()->what != MTDO_REPAIR_COMMAND_REQUEST)) return B_BAD_ARGUMENT;
+
+   MessageRef replyMsg = GetMessageFromPool(MTDO_REPAIR_COMMAND_REPLY);
+   MRETURN_OOM_ON_NULL(replyMsg());
+
+   ConstMessageRef unitMsg;
+   for (int32 i=0; repairRequestMsg()->FindMessage(MTDO_NAME_UNIT, i, unitMsg).IsOK(); i++)
+   {
+      MessageRef answerMsg = GetMessageFromPool();
+      MRETURN_OOM_ON_NULL(answerMsg());
+      MRETURN_ON_ERROR(SeniorAnswerRepairUnit(*unitMsg(), *answerMsg()));
+      MRETURN_ON_ERROR(replyMsg()->AddMessage(MTDO_NAME_UNIT, answerMsg));
+   }
+   return AddConstToRef(replyMsg);
+}
+
+// Compares the junior peer's description of one of its nodes (or a subset of that node's children) against our own, and
+// writes into (answerMsg) the fixes the junior peer should apply, and the parts of the subtree it should describe to us next
+status_t MessageTreeDatabaseObject :: SeniorAnswerRepairUnit(const Message & unitMsg, Message & answerMsg) const
+{
+   const String & path  = unitMsg.GetStringReference(MTDO_NAME_PATH);
+   const uint32 numBits = unitMsg.GetInt32(MTDO_NAME_NUMBITS);
+   const uint64 prefix  = unitMsg.GetInt64(MTDO_NAME_PREFIX);
+   if (numBits > 64) return B_BAD_DATA;
+
+   MRETURN_ON_ERROR(answerMsg.AddString(MTDO_NAME_PATH,    path));
+   MRETURN_ON_ERROR(answerMsg.AddInt32( MTDO_NAME_NUMBITS, numBits));
+
+   const DataNode * node = GetDataNode(path);
+   if (node == NULL) return answerMsg.AddBool(MTDO_NAME_REMOVE, true);
+   if (unitMsg.GetBool(MTDO_NAME_MISSING))
+   {
+      MessageRef archive = GetMessageFromPool();
+      MRETURN_OOM_ON_NULL(archive());
+      MRETURN_ON_ERROR(SaveNodeTreeToMessage(*archive(), *node, GetEmptyString(), true));
+      return answerMsg.AddMessage(MTDO_NAME_ARCHIVE, archive);
+   }
+
+   if (numBits == 0)
+   {
+      if (((uint64)unitMsg.GetInt64(MTDO_NAME_PAYLOAD_CHECKSUM) != GetRepairPayloadChecksum(*node))&&(node->GetData()())) MRETURN_ON_ERROR(answerMsg.AddMessage(MTDO_NAME_PAYLOAD, CastAwayConstFromRef(node->GetData())));
+      if ((uint64)unitMsg.GetInt64(MTDO_NAME_INDEX_CHECKSUM) != GetRepairIndexChecksum(*node))
+      {
+         MRETURN_ON_ERROR(answerMsg.AddBool(MTDO_NAME_FIX_INDEX, true));
+
+         const Queue<DataNodeRef> * index = node->GetIndex();
+         if (index) for (uint32 i=0; i<index->GetNumItems(); i++) MRETURN_ON_ERROR(answerMsg.AddString(MTDO_NAME_INDEX_KEYS, (*index)[i]()->GetNodeName()));
+      }
+   }
+
+   if (unitMsg.HasName(MTDO_NAME_BUCKET))
+   {
+      if ((numBits+MTDO_REPAIR_BITS_PER_LEVEL) > 64) return B_BAD_DATA;
+
+      uint64 buckets[MTDO_NUM_REPAIR_BUCKETS]; memset(buckets, 0, sizeof(buckets));
+      for (DataNodeRefIterator iter(node->GetChildIterator()); iter.HasData(); iter++) if (IsNodeNameInRepairSubset(*iter.GetKey(), numBits, prefix)) buckets[GetRepairBucketForNodeName(*iter.GetKey(), numBits)] += GetSubtreeChecksum(*iter.GetValue()());
+
+      // The junior peer will need to take a closer look at any bucket whose contents don't match ours
+      for (uint32 i=0; i<ARRAYITEMS(buckets); i++) if ((uint64)unitMsg.GetInt64(MTDO_NAME_BUCKET, 0, i) != buckets[i]) MRETURN_ON_ERROR(answerMsg.AddInt64(MTDO_NAME_DESCEND_PREFIX, (int64) ((prefix<<MTDO_REPAIR_BITS_PER_LEVEL)|i)));
+   }
+   else
+   {
+      Hashtable<String, uint32> juniorChildren;  // child-name -> index within the junior peer's listing
+      String key;
+      for (int32 i=0; unitMsg.FindString(MTDO_NAME_KEY, i, key).IsOK(); i++) MRETURN_ON_ERROR(juniorChildren.Put(key, i));
+
+      for (DataNodeRefIterator iter(node->GetChildIterator()); iter.HasData(); iter++)
+      {
+         const DataNode & child = *iter.GetValue()();
+         if (IsNodeNameInRepairSubset(child.GetNodeName(), numBits, prefix) == false) continue;
+
+         uint32 juniorIdx;
+         if (juniorChildren.Remove(child.GetNodeName(), juniorIdx).IsError()) MRETURN_ON_ERROR(SeniorAddRepairChild(*node, child, answerMsg));  // junior peer doesn't have it
+         else if ((uint64)unitMsg.GetInt64(MTDO_NAME_CHECKSUM, 0, juniorIdx) != GetSubtreeChecksum(child))
+         {
+            // Only worth drilling down into the child if both sides' versions of it have children to compare; otherwise we'll just send it
+            if ((child.GetNumChildren() > 0)&&(unitMsg.GetBool(MTDO_NAME_HAS_CHILDREN, false, juniorIdx))) MRETURN_ON_ERROR(answerMsg.AddString(MTDO_NAME_DESCEND, child.GetNodeName()));
+                                                                                                       else MRETURN_ON_ERROR(SeniorAddRepairChild(*node, child, answerMsg));
+         }
+      }
+
+      // Whatever's left over are children that we don't have
+      for (ConstHashtableIterator<String, uint32> iter(juniorChildren); iter.HasData(); iter++) MRETURN_ON_ERROR(answerMsg.AddString(MTDO_NAME_REMOVE_KEY, iter.GetKey()));
+   }
+
+   return B_NO_ERROR;
+}
+
+// Adds to (answerMsg) a complete copy of (child) and its subtree, along with where it belongs in (parent)'s index, if anywhere
+status_t MessageTreeDatabaseObject :: SeniorAddRepairChild(const DataNode & parent, const DataNode & child, Message & answerMsg) const
+{
+   MessageRef childMsg = GetMessageFromPool();
+   MRETURN_OOM_ON_NULL(childMsg());
+
+   MessageRef archive = GetMessageFromPool();
+   MRETURN_OOM_ON_NULL(archive());
+
+   MRETURN_ON_ERROR(SaveNodeTreeToMessage(*archive(), child, GetEmptyString(), true));
+   MRETURN_ON_ERROR(childMsg()->AddString( MTDO_NAME_KEY,     child.GetNodeName()));
+   MRETURN_ON_ERROR(childMsg()->AddMessage(MTDO_NAME_ARCHIVE, archive));
+
+   const Queue<DataNodeRef> * index = parent.GetIndex();
+   if (index)
+   {
+      for (uint32 i=0; i<index->GetNumItems(); i++)
+      {
+         if ((*index)[i]() == &child)
+         {
+            MRETURN_ON_ERROR(childMsg()->AddBool(MTDO_NAME_INDEXED, true));
+            if ((i+1) < index->GetNumItems()) MRETURN_ON_ERROR(childMsg()->AddString(MTDO_NAME_BEFORE, (*index)[i+1]()->GetNodeName()));
+            break;
+         }
+      }
+   }
+
+   return answerMsg.AddMessage(MTDO_NAME_CHILD, childMsg);
+}
+
 String MessageTreeDatabaseObject :: ToString() const
 {
    const MessageTreeDatabasePeerSession * zsh = GetMessageTreeDatabasePeerSession();
@@ -450,30 +1098,29 @@ MessageRef MessageTreeDatabaseObject :: CreateNodeIndexUpdateMessage(const Strin
 // Handles MTDO_COMMAND_UPDATENODEVALUE Messages
 status_t MessageTreeDatabaseObject :: HandleNodeUpdateMessage(const Message & msg)
 {
-   const TreeGatewayFlags flags = msg.GetFlat<TreeGatewayFlags>(MTDO_NAME_FLAGS);
-   if (IsOkayToHandleUpdateMessage(msg.GetString(MTDO_NAME_PATH), flags) == false) return B_NO_ERROR;
+   return HandleNodeUpdate(msg.GetStringReference(MTDO_NAME_PATH), msg.GetMessage(MTDO_NAME_PAYLOAD), msg.GetFlat<TreeGatewayFlags>(MTDO_NAME_FLAGS), msg.GetStringReference(MTDO_NAME_BEFORE), msg.GetStringReference(MTDO_NAME_TAG));
+}
+
+status_t MessageTreeDatabaseObject :: HandleNodeUpdate(const String & path, const ConstMessageRef & optPayload, TreeGatewayFlags flags, const String & optBefore, const String & optOpTag)
+{
+   if (IsOkayToHandleUpdateMessage(path, flags) == false) return B_NO_ERROR;
 
    const bool isInterimUpdate = flags.IsBitSet(TREE_GATEWAY_FLAG_INTERIM);
    if (isInterimUpdate) _interimUpdateNestCount.Increment();
-   const status_t ret = HandleNodeUpdateMessageAux(msg, flags);
+   const status_t ret = HandleNodeUpdateAux(path, optPayload, flags, optBefore, optOpTag);
    if (isInterimUpdate) _interimUpdateNestCount.Decrement();
 
    return ret;
 }
 
-status_t MessageTreeDatabaseObject :: HandleNodeUpdateMessageAux(const Message & msg, TreeGatewayFlags flags)
+status_t MessageTreeDatabaseObject :: HandleNodeUpdateAux(const String & path, const ConstMessageRef & optPayload, TreeGatewayFlags flags, const String & optBefore, const String & optOpTag)
 {
    MessageTreeDatabasePeerSession * zsh = GetMessageTreeDatabasePeerSession();
 
-   MessageRef optPayload        = msg.GetMessage(MTDO_NAME_PAYLOAD);
-   const String & path          = msg.GetStringReference(MTDO_NAME_PATH);
-   const String & optOpTag      = msg.GetStringReference(MTDO_NAME_TAG);
-
    DECLARE_OP_TAG_GUARD;
 
    if (optPayload())
    {
-      const String & optBefore   = msg.GetStringReference(MTDO_NAME_BEFORE);
       String sessionRelativePath = DatabaseSubpathToSessionRelativePath(path, flags);
       if ((IsInSeniorDatabaseUpdateContext())&&(sessionRelativePath.EndsWith('/')))
       {
@@ -497,8 +1144,11 @@ status_t MessageTreeDatabaseObject :: HandleNodeUpdateMessageAux(const Message &
 // Handles MTDO_COMMAND_INSERTINDEXENTRY and MTDO_COMMAND_REMOVEINDEXENTRY Messages
 status_t MessageTreeDatabaseObject :: HandleNodeIndexUpdateMessage(const Message & msg)
 {
-   const String &          path = msg.GetStringReference(MTDO_NAME_PATH);
-   const TreeGatewayFlags flags = msg.GetFlat<TreeGatewayFlags>(MTDO_NAME_FLAGS);
+   return HandleNodeIndexUpdate(msg.what, msg.GetStringReference(MTDO_NAME_PATH), msg.GetFlat<TreeGatewayFlags>(MTDO_NAME_FLAGS), msg.GetInt32(MTDO_NAME_INDEX), msg.GetStringReference(MTDO_NAME_KEY), msg.GetStringReference(MTDO_NAME_TAG));
+}
+
+status_t MessageTreeDatabaseObject :: HandleNodeIndexUpdate(uint32 whatCode, const String & path, TreeGatewayFlags flags, int32 index, const String & key, const String & optOpTag)
+{
    if (IsOkayToHandleUpdateMessage(path, TreeGatewayFlags()) == false) return B_NO_ERROR;
 
    MessageTreeDatabasePeerSession * zsh = GetMessageTreeDatabasePeerSession();
@@ -506,15 +1156,10 @@ status_t MessageTreeDatabaseObject :: HandleNodeIndexUpdateMessage(const Message
    DataNode * node = zsh->GetDataNode(sessionRelativePath);
    if (node)
    {
-      const String & key      = msg.GetStringReference(MTDO_NAME_KEY);
-      const String & optOpTag = msg.GetStringReference(MTDO_NAME_TAG);
-      const int32 index       = msg.GetInt32(          MTDO_NAME_INDEX);
-
       DECLARE_OP_TAG_GUARD;
 
-      if (msg.what == MTDO_COMMAND_INSERTINDEXENTRY) (void) node->InsertIndexEntryAt(index, zsh, key);
+      if (whatCode == MTDO_COMMAND_INSERTINDEXENTRY) (void) node->InsertIndexEntryAt(index, zsh, key);
                                                 else (void) node->RemoveIndexEntryAt(index, zsh);
-//printf("   %s (path=[%s]) index=%u key=[%s] indexLength=%u\n", (msg.what == MTDO_COMMAND_INSERTINDEXENTRY)?"INSERT":"REMOVE", sessionRelativePath(), index, key?key->Cstr():"(null)", node?node->GetIndex()->GetNumItems():666);
       return B_NO_ERROR;
    }
    else
@@ -524,6 +1169,22 @@ status_t MessageTreeDatabaseObject :: HandleNodeIndexUpdateMessage(const Message
    }
 }
 
+// Handles MTDO_COMMAND_COMPACT_BATCH Messages
+status_t MessageTreeDatabaseObject :: HandleCompactBatchMessage(const Message & msg)
+{
+   MessageTreeCompactBatch batch;
+   MRETURN_ON_ERROR(msg.FindFlat(MTDO_NAME_COMPACT, batch));
+
+   const Queue<MessageTreeCompactCommand> & commands = batch.GetCommands();
+   for (uint32 i=0; i<commands.GetNumItems(); i++)
+   {
+      const MessageTreeCompactCommand & c = commands[i];
+      if (c._what == MTDO_COMMAND_UPDATENODEVALUE) MRETURN_ON_ERROR(HandleNodeUpdate(c._path, c._payload, c._flags, c._before, c._tag));
+                                              else MRETURN_ON_ERROR(HandleNodeIndexUpdate(c._what, c._path, c._flags, (int32) c._index, c._key, c._tag));
+   }
+   return B_NO_ERROR;
+}
+
 // Handles MTDO_COMMAND_UPDATESUBTREE Messages
 status_t MessageTreeDatabaseObject :: HandleSubtreeUpdateMessage(const Message & msg)
 {
@@ -33,6 +33,13 @@ status_t MessageTreeDatabasePeerSession :: AttachedToServer()
 {
    NestCountGuard ncd(_inPeerSessionSetupOrTeardown);
 
+   // Our databases all share our node-tree (and our subscribers), so their updates mustn't be executed in per-database worker threads
+   if (GetPeerSettings().AreDatabaseWorkerThreadsEnabled())
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "MessageTreeDatabasePeerSession::AttachedToServer:  Database worker threads can't be used with MessageTreeDatabaseObjects!\n");
+      return B_BAD_ARGUMENT;
+   }
+
    MRETURN_ON_ERROR(ZGDatabasePeerSession::AttachedToServer());
 
    // Check for duplicate mount-points
@@ -187,7 +194,7 @@ status_t MessageTreeDatabasePeerSession :: TreeGateway_PingLocalPeer(ITreeGatewa
 
 status_t MessageTreeDatabasePeerSession :: TreeGateway_PingSeniorPeer(ITreeGatewaySubscriber * /*calledBy*/, const String & tag, uint32 whichDB, TreeGatewayFlags flags)
 {
-   if (GetSeniorPeerID().IsValid() == false) return B_ERROR("PingSeniorPeer:  Senior peer not available");
+   if (GetSeniorPeerIDForDatabase(whichDB).IsValid() == false) return B_ERROR("PingSeniorPeer:  Senior peer not available");
 
    MessageRef seniorPingMsg = GetMessageFromPool(MTDPS_COMMAND_PINGSENIORPEER);
    MRETURN_OOM_ON_NULL(seniorPingMsg());
@@ -200,7 +207,8 @@ status_t MessageTreeDatabasePeerSession :: TreeGateway_PingSeniorPeer(ITreeGatew
 
 status_t MessageTreeDatabasePeerSession :: TreeGateway_SendMessageToSeniorPeer(ITreeGatewaySubscriber * /*calledBy*/, const ConstMessageRef & msg, uint32 whichDB, const String & tag)
 {
-   if (GetSeniorPeerID().IsValid() == false) return B_ERROR("SendMessageToSeniorPeer:  Senior peer not available");
+   const ZGPeerID & seniorPeerID = GetSeniorPeerIDForDatabase(whichDB);
+   if (seniorPeerID.IsValid() == false) return B_ERROR("SendMessageToSeniorPeer:  Senior peer not available");
 
    MessageRef seniorCommandMsg = GetMessageFromPool(MTDPS_COMMAND_MESSAGETOSENIORPEER);
    MRETURN_OOM_ON_NULL(seniorCommandMsg());
@@ -209,7 +217,7 @@ status_t MessageTreeDatabasePeerSession :: TreeGateway_SendMessageToSeniorPeer(I
    MRETURN_ON_ERROR(seniorCommandMsg()->CAddFlat(  MTDPS_NAME_SOURCE,  GetLocalPeerID()));
    MRETURN_ON_ERROR(seniorCommandMsg()->CAddInt32( MTDPS_NAME_WHICHDB, whichDB));
    MRETURN_ON_ERROR(seniorCommandMsg()->CAddString(MTDPS_NAME_TAG,     tag));
-   return SendUnicastUserMessageToPeer(GetSeniorPeerID(), seniorCommandMsg);
+   return SendUnicastUserMessageToPeer(seniorPeerID, seniorCommandMsg);
 }
 
 ZGPeerID MessageTreeDatabasePeerSession :: GetPerClientPeerIDForNode(const DataNode & node) const
@@ -444,7 +452,7 @@ Hashtable<MessageTreeDatabaseObject *, String> MessageTreeDatabasePeerSession ::
    return ret;
 }
 
-ConstMessageRef MessageTreeDatabasePeerSession :: SeniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & seniorDoMsg)
+ConstMessageRef MessageTreeDatabasePeerSession :: SeniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & seniorDoMsg)
 {
    switch(seniorDoMsg()->what)
    {
@@ -457,7 +465,7 @@ ConstMessageRef MessageTreeDatabasePeerSession :: SeniorUpdateLocalDatabase(uint
    }
 }
 
-status_t MessageTreeDatabasePeerSession :: JuniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & juniorDoMsg)
+status_t MessageTreeDatabasePeerSession :: JuniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & juniorDoMsg)
 {
    switch(juniorDoMsg()->what)
    {
@@ -549,11 +557,12 @@ void MessageTreeDatabasePeerSession :: MessageReceivedFromPeer(const ZGPeerID &
    switch(msg()->what)
    {
       case MTDPS_COMMAND_MESSAGETOSENIORPEER:
-         if (IAmTheSeniorPeer())
+      {
+         const uint32 whichDB = msg()->GetInt32(MTDPS_NAME_WHICHDB);
+         if (IAmTheSeniorPeerForDatabase(whichDB))
          {
             MessageRef payload          = msg()->GetMessage(MTDPS_NAME_PAYLOAD);
             const ZGPeerID sourcePeerID = msg()->GetFlat<ZGPeerID>(MTDPS_NAME_SOURCE);
-            const uint32 whichDB        = msg()->GetInt32(MTDPS_NAME_WHICHDB);
             const String & tag          = msg()->GetStringReference(MTDPS_NAME_TAG);
             if (payload())
             {
@@ -561,7 +570,8 @@ void MessageTreeDatabasePeerSession :: MessageReceivedFromPeer(const ZGPeerID &
             }
             else LogTime(MUSCLE_LOG_ERROR, "Peer [%s] Received MTDPS_COMMAND_MESSAGETOSENIORPEER, but it has no payload!\n", GetLocalPeerID().ToString()());
          }
-         else LogTime(MUSCLE_LOG_ERROR, "Peer [%s] Received MTDPS_COMMAND_MESSAGETOSENIORPEER, but I am not the senior peer!\n", GetLocalPeerID().ToString()());
+         else LogTime(MUSCLE_LOG_ERROR, "Peer [%s] Received MTDPS_COMMAND_MESSAGETOSENIORPEER for database #" UINT32_FORMAT_SPEC ", but I am not its senior peer!\n", GetLocalPeerID().ToString()(), whichDB);
+      }
       break;
 
       case MTDPS_COMMAND_MESSAGEFROMSENIORPEER:
@@ -3,22 +3,69 @@
 namespace zg_private
 {
 
+static const uint32 PZG_BEACON_DATA_DELTA_BIT = (((uint32)1)<<31);  // set in the flattened item-count of a delta beacon
+
 void PZGBeaconData :: Flatten(DataFlattener flat) const
 {
-   flat.WriteInt32(_dbis.GetNumItems());
-   for (uint32 i=0; i<_dbis.GetNumItems(); i++) flat.WriteFlat(_dbis[i]);
+   flat.WriteInt32(_dbis.GetNumItems() | (_isDelta ? PZG_BEACON_DATA_DELTA_BIT : 0));
+   for (uint32 i=0; i<_dbis.GetNumItems(); i++)
+   {
+      if (_isDelta) flat.WriteInt32(_dbIndices[i]);
+      flat.WriteFlat(_dbis[i]);
+   }
 }
 
 status_t PZGBeaconData :: Unflatten(DataUnflattener & unflat)
 {
-   const uint32 newNumItems = unflat.ReadInt32();
-   if (unflat.GetNumBytesAvailable() < SaturatingUnsignedMultiply(newNumItems, PZGDatabaseStateInfo::FlattenedSize())) return B_BAD_DATA;
+   const uint32 header      = unflat.ReadInt32();
+   const uint32 newNumItems = header & ~PZG_BEACON_DATA_DELTA_BIT;
+   _isDelta = ((header & PZG_BEACON_DATA_DELTA_BIT) != 0);
+   if (unflat.GetNumBytesAvailable() < SaturatingUnsignedMultiply(newNumItems, PZGDatabaseStateInfo::FlattenedSize()+(_isDelta?sizeof(uint32):0))) return B_BAD_DATA;
 
    MRETURN_ON_ERROR(_dbis.EnsureSize(newNumItems, true));
-   for (uint32 i=0; i<newNumItems; i++) MRETURN_ON_ERROR(unflat.ReadFlat(_dbis[i]));
+   MRETURN_ON_ERROR(_dbIndices.EnsureSize(_isDelta ? newNumItems : 0, true));
+   for (uint32 i=0; i<newNumItems; i++)
+   {
+      if (_isDelta) _dbIndices[i] = unflat.ReadInt32();
+      MRETURN_ON_ERROR(unflat.ReadFlat(_dbis[i]));
+   }
    return unflat.GetStatus();
 }
 
+status_t PZGBeaconData :: SetToDelta(const PZGBeaconData & oldData, const PZGBeaconData & newData)
+{
+   const Queue<PZGDatabaseStateInfo> & oldDBIs = oldData.GetDatabaseStateInfos();
+   const Queue<PZGDatabaseStateInfo> & newDBIs = newData.GetDatabaseStateInfos();
+   if ((oldData.IsDelta())||(newData.IsDelta())||(oldDBIs.GetNumItems() != newDBIs.GetNumItems())) return B_BAD_ARGUMENT;
+
+   _isDelta = true;
+   _dbis.Clear();
+   _dbIndices.Clear();
+   for (uint32 i=0; i<newDBIs.GetNumItems(); i++)
+   {
+      if (newDBIs[i] != oldDBIs[i])
+      {
+         MRETURN_ON_ERROR(_dbis.AddTail(newDBIs[i]));
+         MRETURN_ON_ERROR(_dbIndices.AddTail(i));
+      }
+   }
+   return B_NO_ERROR;
+}
+
+status_t PZGBeaconData :: ApplyDelta(const PZGBeaconData & delta)
+{
+   if ((_isDelta)||(delta.IsDelta() == false)) return B_BAD_DATA;
+
+   const Queue<PZGDatabaseStateInfo> & deltaDBIs = delta.GetDatabaseStateInfos();
+   const Queue<uint32> & deltaIndices = delta.GetDatabaseIndices();
+   for (uint32 i=0; i<deltaDBIs.GetNumItems(); i++)
+   {
+      if (_dbis.IsIndexValid(deltaIndices[i]) == false) return B_BAD_DATA;
+      _dbis[deltaIndices[i]] = deltaDBIs[i];
+   }
+   return B_NO_ERROR;
+}
+
 PZGBeaconDataRef GetBeaconDataFromPool()
 {
    static ObjectPool<PZGBeaconData> _infoListPool;
@@ -29,8 +76,8 @@ uint32 PZGBeaconData :: CalculateChecksum() const
 {
    const uint32 numItems = _dbis.GetNumItems();
 
-   uint32 ret = numItems;
-   for (uint32 i=0; i<numItems; i++) ret += (i+1)*(_dbis[i].CalculateChecksum());
+   uint32 ret = numItems + (_isDelta ? 1 : 0);
+   for (uint32 i=0; i<numItems; i++) ret += (i+1)*(_dbis[i].CalculateChecksum()+(_isDelta ? _dbIndices[i] : 0));
    return ret;
 }
 
@@ -46,7 +93,7 @@ String PZGBeaconData :: ToString() const
    char buf[128];
    for (uint32 i=0; i<_dbis.GetNumItems(); i++)
    {
-      muscleSprintf(buf, "   DBI #" UINT32_FORMAT_SPEC ": ", i);
+      muscleSprintf(buf, "   DBI #" UINT32_FORMAT_SPEC ": ", _isDelta ? _dbIndices[i] : i);
       ret += buf;
       ret += _dbis[i].ToString();
       ret += '\n';
@@ -56,7 +103,7 @@ String PZGBeaconData :: ToString() const
 
 bool PZGBeaconData :: operator == (const PZGBeaconData & rhs) const
 {
-   return (_dbis == rhs._dbis);
+   return ((_isDelta == rhs._isDelta)&&(_dbis == rhs._dbis)&&(_dbIndices == rhs._dbIndices));
 }
 
 }  // end namespace zg_private
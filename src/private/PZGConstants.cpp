@@ -11,6 +11,13 @@ const String PZG_PEER_NAME_DATABASE_UPDATE_ID  = "dui";
 const String PZG_PEER_NAME_TEXT                = "txt";
 const String PZG_PEER_NAME_CHECKSUM_MISMATCH   = "chk";
 const String PZG_PEER_NAME_BACK_ORDER          = "ubok";
+const String PZG_PEER_NAME_PEER_ID             = "pid";
+const String PZG_PEER_NAME_SEND_TO_SELF        = "sts";
+const String PZG_PEER_NAME_DATABASE_STATE_INFO = "dsi";
+const String PZG_PEER_NAME_LOAD                = "lod";
+const String PZG_PEER_NAME_REQUEST_TIME        = "rqt";
+const String PZG_PEER_NAME_ACK_ID              = "aid";
+const String PZG_PEER_NAME_NUM_PEERS           = "npr";
 
 /** Return a brief description of the peerInfo data that we can display easily on a single line */
 String PeerInfoToString(const ConstMessageRef & peerInfo)
@@ -1,14 +1,36 @@
 #include "zg/private/PZGDatabaseState.h"
 #include "zg/private/PZGConstants.h"
+#include "zg/private/PZGMulticastRepair.h"  // for PZG_MULTICAST_REPAIR_GRACE_MICROS
 #include "zg/ZGPeerSession.h"
 
 namespace zg_private
 {
 
+// Command codes of the jobs we send to our worker thread (if we have one)
+enum {
+   PZG_DATABASE_WORKER_JOB_SENIOR_UPDATE = 1885626999, // 'pdbw' -- execute a senior update of our local database
+   PZG_DATABASE_WORKER_JOB_JUNIOR_UPDATE,              // execute a junior update (from our update-log) on our local database
+};
+
+static const String PZG_WORKER_NAME_PRE_UPDATE_CHECKSUM  = "pre";  // uint64: the database's checksum before the job executed
+static const String PZG_WORKER_NAME_POST_UPDATE_CHECKSUM = "pst";  // uint64: the database's checksum after the job executed
+static const String PZG_WORKER_NAME_START_TIME           = "stt";  // uint64: run-time at which the job started executing
+static const String PZG_WORKER_NAME_ELAPSED_MICROS       = "elt";  // uint64: how many microseconds the job took to execute
+static const String PZG_WORKER_NAME_ERROR                = "err";  // String: present only if the job failed
+static const String PZG_WORKER_NAME_REQUEST_TIME         = "rqt";  // uint64: network-time at which the update was requested (senior jobs only)
+static const String PZG_WORKER_NAME_RECEIVE_TIME         = "rct";  // uint64: network-time at which we received the update-request (senior jobs only)
+static const String PZG_WORKER_NAME_FAILURE_REPLY        = "frp";  // Message: returned by the worker thread in place of the job Message, if it can't add the job's results to it
+
+static const uint64 PZG_MAX_UPDATES_PER_BACK_ORDER = 4096;  // max number of consecutive missing updates we'll request from the senior peer in a single back-order
+static const uint32 PZG_MAX_DATABASE_REPAIR_PASSES = 3;     // if our database still doesn't match the senior peer's after this many repair-passes, we'll download the whole thing instead
+static const uint32 PZG_MAX_DEFERRED_UPDATE_REQUESTS = 10000;  // if a lagging junior peer has caused us to defer this many update-requests, we'll reject any more of them
+static const uint64 PZG_REPUBLISH_RETRY_MICROS = MillisToMicros(250);  // if we couldn't publish our senior database's full state, we'll try again after this long
+
 PZGDatabaseState :: PZGDatabaseState()
    : _master(NULL)
    , _whichDatabase((uint32)-1)
    , _maxPayloadBytesInLog(0)
+   , _payloadCompressionLevel(ZG_DEFAULT_PAYLOAD_COMPRESSION_LEVEL)
    , _totalPayloadBytesInLog(0)
    , _totalElapsedMillisInLog(0)
    , _localDatabaseStateID(0)
@@ -19,16 +41,51 @@ PZGDatabaseState :: PZGDatabaseState()
    , _firstUnsentUpdateID(0)
    , _rescanLogPending(false)
    , _printDatabaseStatesComparisonOnNextReplace(false)
-   , _seniorUpdateTimeForJuniorUpdate(0)
+   , _missingUpdatesNoticedTime(0)
+   , _backOrderHoldoffDeadline(MUSCLE_TIME_NEVER)
+   , _groupCommitWindowMicros(MUSCLE_TIME_NEVER)
+   , _groupCommitPreUpdateDBChecksum(0)
+   , _groupCommitRequestTime(0)
+   , _groupCommitReceiveTime(0)
+   , _groupCommitStartTime(0)
+   , _groupCommitElapsedMicros(0)
+   , _groupCommitDeadline(MUSCLE_TIME_NEVER)
+   , _numUnpublishedSeniorUpdates(0)
+   , _republishPreUpdateDBChecksum(0)
+   , _republishRetryTime(MUSCLE_TIME_NEVER)
+   , _numSeniorWorkerJobsInFlight(0)
+   , _numJuniorWorkerJobsInFlight(0)
+   , _workerTargetStateID(0)
+   , _workerJobFailed(false)
+   , _workerDBChecksum(0)
+   , _updatesPerSnapshot(0)
+   , _snapshotPending(false)
+   , _snapshotWriteInFlight(false)
+   , _restoredStateUnverified(false)
+   , _repairPassCount(0)
+   , _backOrderHits(0)
+   , _backOrderMisses(0)
+   , _maxJuniorLagUpdates(MUSCLE_NO_LIMIT)
+   , _maxJuniorLagBytes(MUSCLE_NO_LIMIT)
+   , _deferredUpdateRequestsCheckPending(false)
 {
    // empty
 }
 
-void PZGDatabaseState :: SetParameters(ZGPeerSession * master, uint32 whichDatabase, uint64 maxPayloadBytesInLog)
+void PZGDatabaseState :: SetParameters(ZGPeerSession * master, uint32 whichDatabase, uint64 maxPayloadBytesInLog, uint64 groupCommitWindowMicros, uint8 payloadCompressionLevel)
+{
+   _master                  = master;
+   _whichDatabase           = whichDatabase;
+   _maxPayloadBytesInLog    = maxPayloadBytesInLog;
+   _groupCommitWindowMicros = groupCommitWindowMicros;
+   _payloadCompressionLevel = payloadCompressionLevel;
+}
+
+void PZGDatabaseState :: SetPersistenceParameters(const String & dirPath, uint32 updatesPerSnapshot)
 {
-   _master               = master;
-   _whichDatabase        = whichDatabase;
-   _maxPayloadBytesInLog = maxPayloadBytesInLog;
+   _persistentLog.Reset();
+   if (dirPath.HasChars()) _persistentLog.SetRef(new PZGPersistentUpdateLog(dirPath, _whichDatabase));
+   _updatesPerSnapshot = updatesPerSnapshot;
 }
 
 void PZGDatabaseState :: ScheduleLogContentsRescan()
@@ -53,7 +110,7 @@ status_t PZGDatabaseState :: AddDatabaseUpdateToUpdateLog(const ConstPZGDatabase
 
    _totalElapsedMillisInLog += dbUp()->GetSeniorElapsedTimeMillis();
 
-   if ((logWasEmpty)&&(_master->IAmTheSeniorPeer())) _seniorOldestIDInLog = dbUp()->GetUpdateID();  // probably not necessary but I like to keep it correct
+   if ((logWasEmpty)&&(_master->IAmTheSeniorPeerForDatabase(_whichDatabase))) _seniorOldestIDInLog = dbUp()->GetUpdateID();  // probably not necessary but I like to keep it correct
    ScheduleLogContentsRescan();
    return B_NO_ERROR;
 }
@@ -68,7 +125,7 @@ void PZGDatabaseState :: RemoveDatabaseUpdateFromUpdateLog(const ConstPZGDatabas
 
       _totalElapsedMillisInLog -= temp()->GetSeniorElapsedTimeMillis();
 
-      if ((_updateLog.IsEmpty())&&(_master->IAmTheSeniorPeer())) _seniorOldestIDInLog = (uint64)-1;  // probably not necessary but I like to keep it correct
+      if ((_updateLog.IsEmpty())&&(_master->IAmTheSeniorPeerForDatabase(_whichDatabase))) _seniorOldestIDInLog = (uint64)-1;  // probably not necessary but I like to keep it correct
    }
 }
 
@@ -79,14 +136,19 @@ void PZGDatabaseState :: ClearUpdateLog()
    _totalElapsedMillisInLog = 0;
 }
 
-void PZGDatabaseState :: SeniorUpdateCompleted(const PZGDatabaseUpdateRef & dbUp, uint64 startTime, const ConstMessageRef & payloadMsg, const INetworkTimeProvider & networkTimeProvider)
+void PZGDatabaseState :: SeniorUpdateCompleted(const PZGDatabaseUpdateRef & dbUp, uint64 requestTime, uint64 receiveTime, uint64 startTime, uint64 elapsedMicros, const ConstMessageRef & payloadMsg, const INetworkTimeProvider & networkTimeProvider)
 {
    // Gotta update our running time and byte tallies as we update dbUp
    _totalElapsedMillisInLog -= dbUp()->GetSeniorElapsedTimeMillis();
    dbUp()->SetSeniorStartTimeMicros(networkTimeProvider.GetNetworkTime64ForRunTime64(startTime));
-   dbUp()->SetSeniorElapsedTimeMicros(GetRunTime64()-startTime);
+   dbUp()->SetSeniorElapsedTimeMicros(elapsedMicros);
    _totalElapsedMillisInLog += dbUp()->GetSeniorElapsedTimeMillis();
 
+   // Timestamps for latency-tracing (see RecordSeniorUpdateLatencies() and RecordJuniorUpdateLatencies())
+   dbUp()->SetRequestTimeMicros(requestTime);
+   dbUp()->SetSeniorReceiveTimeMicros(receiveTime);
+   dbUp()->SetSeniorFinishTimeMicros(networkTimeProvider.GetNetworkTime64ForRunTime64(startTime+elapsedMicros));
+
    dbUp()->SetPostUpdateDBChecksum(_dbChecksum);
 
    if (payloadMsg() != dbUp()->GetPayloadBufferAsMessage()())
@@ -94,7 +156,7 @@ void PZGDatabaseState :: SeniorUpdateCompleted(const PZGDatabaseUpdateRef & dbUp
       const ConstByteBufferRef & oldPayloadBuf = dbUp()->GetPayloadBuffer();
       if (oldPayloadBuf()) _totalPayloadBytesInLog -= oldPayloadBuf()->GetNumBytes();
 
-      dbUp()->SetPayloadMessage(payloadMsg);
+      dbUp()->SetPayloadMessage(payloadMsg, _payloadCompressionLevel);
 
       const ConstByteBufferRef & newPayloadBuf = dbUp()->GetPayloadBuffer();
       if (newPayloadBuf()) _totalPayloadBytesInLog += newPayloadBuf()->GetNumBytes();
@@ -102,10 +164,14 @@ void PZGDatabaseState :: SeniorUpdateCompleted(const PZGDatabaseUpdateRef & dbUp
 
    _seniorDatabaseStateID = ++_localDatabaseStateID;
    _master->ScheduleSetBeaconData();
+
+   // Note that (dbUp) isn't persisted until RescanUpdateLog() multicasts it, since it doesn't get its multicast-timestamp until then,
+   // and stamping it after it was persisted would throw away the wire image that the persisting created
 }
 
 void PZGDatabaseState :: ResetLocalDatabaseToDefaultState()
 {
+   DrainWorkerThread();
    _master->ResetLocalDatabaseToDefault(_whichDatabase, _dbChecksum);
 }
 
@@ -115,20 +181,53 @@ void PZGDatabaseState :: ResetLocalDatabaseToDefaultState()
 // So we don't do that checking here.
 status_t PZGDatabaseState :: HandleDatabaseUpdateRequest(const ZGPeerID & fromPeerID, const ConstMessageRef & msg, const ConstPZGDatabaseUpdateRef & optDBUp, const INetworkTimeProvider & networkTimeProvider)
 {
+   const uint64 receiveTime = networkTimeProvider.GetNetworkTime64();
+   if ((msg()->what != PZG_PEER_COMMAND_UPDATE_JUNIOR_DATABASE)&&((_deferredUpdateRequests.HasItems())||(IsJuniorLagExcessive())||(IsRepublishPending())||(MustWaitForWorkerThread(*msg()))))
+   {
+      // A junior peer is lagging too far behind (or our worker thread is still busy, or we have changes to publish first), so we'll hold off on this request until it catches up (see ProcessDeferredUpdateRequests())
+      status_t ret;
+      if (_deferredUpdateRequests.GetNumItems() >= PZG_MAX_DEFERRED_UPDATE_REQUESTS) ret = B_RESOURCE_LIMIT;
+      else if (_deferredUpdateRequests.AddTail(PZGDeferredUpdateRequest(fromPeerID, msg, receiveTime)).IsOK(ret)) return B_NO_ERROR;
+
+      LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseState:  Unable to defer update-request from [%s] for database #" UINT32_FORMAT_SPEC "! [%s]\n", fromPeerID.ToString()(), _whichDatabase, ret());
+      const PZGUpdateAckRequest ackReq(fromPeerID, *msg());
+      if (ackReq.IsValid()) SendUpdateAck(ackReq, 0, 0);
+      return ret;
+   }
+
+   return ExecuteDatabaseUpdateRequest(fromPeerID, msg, optDBUp, receiveTime, networkTimeProvider);
+}
+
+status_t PZGDatabaseState :: ExecuteDatabaseUpdateRequest(const ZGPeerID & fromPeerID, const ConstMessageRef & msg, const ConstPZGDatabaseUpdateRef & optDBUp, uint64 receiveTime, const INetworkTimeProvider & networkTimeProvider)
+{
+   const PZGUpdateAckRequest ackReq(fromPeerID, *msg());
+   const status_t ret = HandleDatabaseUpdateRequestAux(fromPeerID, msg, optDBUp, ackReq, receiveTime, networkTimeProvider);
+   if ((ret.IsError())&&(ackReq.IsValid())) SendUpdateAck(ackReq, 0, 0);  // let the requesting peer know it shouldn't wait for its update
+   return ret;
+}
+
+status_t PZGDatabaseState :: HandleDatabaseUpdateRequestAux(const ZGPeerID & fromPeerID, const ConstMessageRef & msg, const ConstPZGDatabaseUpdateRef & optDBUp, const PZGUpdateAckRequest & ackReq, uint64 receiveTime, const INetworkTimeProvider & networkTimeProvider)
+{
+   const uint64 requestTime = (uint64) msg()->GetInt64(PZG_PEER_NAME_REQUEST_TIME);  // 0 if the requesting peer didn't tell us
+
    switch(msg()->what)
    {
       case PZG_PEER_COMMAND_RESET_SENIOR_DATABASE:
       {
+         DrainWorkerThread();         // so that any updates still being executed will be applied before the reset, not after it
+         CommitPendingGroupUpdate();  // so that the grouped updates will be applied before the reset, not after it
+
          PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool(PZG_DATABASE_UPDATE_TYPE_RESET, (uint16) _whichDatabase, _localDatabaseStateID+1, fromPeerID, _dbChecksum);
          MRETURN_OOM_ON_NULL(dbUp());
          MRETURN_ON_ERROR(AddDatabaseUpdateToUpdateLog(dbUp));
 
          const uint64 startTime = GetRunTime64();
          {
-            NestCountGuard ncg(_inSeniorDatabaseUpdate);
+            NestCountGuard ncg(_mainThreadUpdateContext.GetSeniorUpdateNestCount());
             _master->ResetLocalDatabaseToDefault(_whichDatabase, _dbChecksum);
          }
-         SeniorUpdateCompleted(dbUp, startTime, ConstMessageRef(), networkTimeProvider);
+         SeniorUpdateCompleted(dbUp, requestTime, receiveTime, startTime, GetRunTime64()-startTime, ConstMessageRef(), networkTimeProvider);
+         RegisterUpdateAck(ackReq, dbUp()->GetUpdateID());
          return B_NO_ERROR;
       }
       break;
@@ -142,6 +241,9 @@ status_t PZGDatabaseState :: HandleDatabaseUpdateRequest(const ZGPeerID & fromPe
             return B_BAD_DATA;
          }
 
+         DrainWorkerThread();         // so that any updates still being executed will be applied before the replace, not after it
+         CommitPendingGroupUpdate();  // so that the grouped updates will be applied before the replace, not after it
+
          PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool(PZG_DATABASE_UPDATE_TYPE_REPLACE, (uint16) _whichDatabase, _localDatabaseStateID+1, fromPeerID, _dbChecksum);
          MRETURN_OOM_ON_NULL(dbUp());
 
@@ -150,11 +252,15 @@ status_t PZGDatabaseState :: HandleDatabaseUpdateRequest(const ZGPeerID & fromPe
          status_t ret;
          const uint64 startTime = GetRunTime64();
          {
-            NestCountGuard ncg(_inSeniorDatabaseUpdate);
+            NestCountGuard ncg(_mainThreadUpdateContext.GetSeniorUpdateNestCount());
             ret = _master->SetLocalDatabaseFromMessage(_whichDatabase, _dbChecksum, userDBStateMsg);
          }
 
-         if (ret.IsOK()) SeniorUpdateCompleted(dbUp, startTime, userDBStateMsg, networkTimeProvider);
+         if (ret.IsOK())
+         {
+            SeniorUpdateCompleted(dbUp, requestTime, receiveTime, startTime, GetRunTime64()-startTime, userDBStateMsg, networkTimeProvider);
+            RegisterUpdateAck(ackReq, dbUp()->GetUpdateID());
+         }
          else
          {
             LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseUpdateState:  Error setting senior database #" UINT32_FORMAT_SPEC " to state! [%s]\n", _whichDatabase, ret());
@@ -173,6 +279,16 @@ status_t PZGDatabaseState :: HandleDatabaseUpdateRequest(const ZGPeerID & fromPe
             return B_BAD_DATA;
          }
 
+         if (_workerSession())
+         {
+            // Our worker thread will execute the update; we'll add it to our update-log when it tells us it's done
+            const status_t ret = SendJobToWorkerThread(PZG_DATABASE_WORKER_JOB_SENIOR_UPDATE, fromPeerID, userDBUpdateMsg, ConstPZGDatabaseUpdateRef(), requestTime, receiveTime, ackReq);
+            if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseUpdateState:  Unable to send update for senior database #" UINT32_FORMAT_SPEC " to worker thread! [%s]\n", _whichDatabase, ret());
+            return ret;
+         }
+
+         if (IsGroupCommitEnabled()) return SeniorGroupUpdateLocalDatabase(fromPeerID, userDBUpdateMsg, requestTime, receiveTime, ackReq);
+
          PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool(PZG_DATABASE_UPDATE_TYPE_UPDATE, (uint16) _whichDatabase, _localDatabaseStateID+1, fromPeerID, _dbChecksum);
          MRETURN_OOM_ON_NULL(dbUp());
          MRETURN_ON_ERROR(AddDatabaseUpdateToUpdateLog(dbUp));
@@ -180,13 +296,14 @@ status_t PZGDatabaseState :: HandleDatabaseUpdateRequest(const ZGPeerID & fromPe
          const uint64 startTime = GetRunTime64();
          ConstMessageRef juniorMsg;
          {
-            NestCountGuard ncg(_inSeniorDatabaseUpdate);
+            NestCountGuard ncg(_mainThreadUpdateContext.GetSeniorUpdateNestCount());
             juniorMsg = _master->SeniorUpdateLocalDatabase(_whichDatabase, _dbChecksum, userDBUpdateMsg);
          }
 
          if (juniorMsg())
          {
-            SeniorUpdateCompleted(dbUp, startTime, juniorMsg, networkTimeProvider);
+            SeniorUpdateCompleted(dbUp, requestTime, receiveTime, startTime, GetRunTime64()-startTime, juniorMsg, networkTimeProvider);
+            RegisterUpdateAck(ackReq, dbUp()->GetUpdateID());
             return B_NO_ERROR;
          }
          else
@@ -218,12 +335,419 @@ status_t PZGDatabaseState :: HandleDatabaseUpdateRequest(const ZGPeerID & fromPe
    return B_UNIMPLEMENTED;
 }
 
+status_t PZGDatabaseState :: SeniorGroupUpdateLocalDatabase(const ZGPeerID & fromPeerID, const ConstMessageRef & userDBUpdateMsg, uint64 requestTime, uint64 receiveTime, const PZGUpdateAckRequest & ackReq)
+{
+   const uint64 preUpdateDBChecksum = _dbChecksum;
+   const uint64 startTime = GetRunTime64();
+   ConstMessageRef juniorMsg;
+   {
+      NestCountGuard ncg(_mainThreadUpdateContext.GetSeniorUpdateNestCount());
+      juniorMsg = _master->SeniorUpdateLocalDatabase(_whichDatabase, _dbChecksum, userDBUpdateMsg);
+   }
+
+   if (juniorMsg() == NULL)
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseUpdateState:  Error applying grouped update to senior database #" UINT32_FORMAT_SPEC "!\n", _whichDatabase);
+      return B_LOGIC_ERROR;
+   }
+
+   AddUpdateToGroupCommit(fromPeerID, juniorMsg, requestTime, receiveTime, ackReq, preUpdateDBChecksum, startTime, GetRunTime64()-startTime);
+   return B_NO_ERROR;
+}
+
+void PZGDatabaseState :: AddUpdateToGroupCommit(const ZGPeerID & fromPeerID, const ConstMessageRef & juniorMsg, uint64 requestTime, uint64 receiveTime, const PZGUpdateAckRequest & ackReq, uint64 preUpdateDBChecksum, uint64 startTime, uint64 elapsedMicros)
+{
+   if (IsRepublishPending())
+   {
+      // (juniorMsg)'s changes are already in our database, so they'll be published along with the rest of it
+      ScheduleSeniorDatabaseRepublish(preUpdateDBChecksum, 1);
+      AddRepublishAckRequest(ackReq);
+      return;
+   }
+
+   if (_groupCommitPayload() == NULL)
+   {
+      // Start a new group; it will be committed by our Pulse() method when the group-commit window closes
+      _groupCommitPayload = GetMessageFromPool(PZG_PEER_COMMAND_UPDATE_JUNIOR_DATABASE_GROUP);
+      if (_groupCommitPayload() == NULL)
+      {
+         MWARN_OUT_OF_MEMORY;
+         ScheduleSeniorDatabaseRepublish(preUpdateDBChecksum, 1);  // since (juniorMsg)'s changes are already in our database
+         AddRepublishAckRequest(ackReq);
+         return;
+      }
+
+      _groupCommitSourcePeerID        = fromPeerID;
+      _groupCommitPreUpdateDBChecksum = preUpdateDBChecksum;
+      _groupCommitRequestTime         = requestTime;  // the group's latency is traced from its first (i.e. longest-waiting) update
+      _groupCommitReceiveTime         = receiveTime;
+      _groupCommitStartTime           = startTime;
+      _groupCommitElapsedMicros       = 0;
+      _groupCommitDeadline            = _groupCommitStartTime+_groupCommitWindowMicros;
+      InvalidatePulseTime();
+   }
+   _groupCommitElapsedMicros += elapsedMicros;
+
+   status_t ret;
+   if (_groupCommitPayload()->AddMessage(PZG_PEER_NAME_USER_MESSAGE, CastAwayConstFromRef(juniorMsg)).IsError(ret))
+   {
+      // (juniorMsg)'s changes are already in our database, so we'll have to publish them as part of our full database state instead
+      LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseUpdateState:  Unable to add update to group-commit for senior database #" UINT32_FORMAT_SPEC "! [%s]\n", _whichDatabase, ret());
+      ScheduleSeniorDatabaseRepublish(_groupCommitPreUpdateDBChecksum, 1);
+      AddRepublishAckRequest(ackReq);
+      return;
+   }
+
+   if ((ackReq.IsValid())&&(_groupCommitAckRequests.AddTail(ackReq).IsError(ret)))  // it'll be registered when the group gets its update ID
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseUpdateState:  Unable to register acknowledgement for grouped update to senior database #" UINT32_FORMAT_SPEC "! [%s]\n", _whichDatabase, ret());
+      SendUpdateAck(ackReq, 0, 0);
+   }
+}
+
+void PZGDatabaseState :: CommitPendingGroupUpdate()
+{
+   if (_groupCommitPayload() == NULL) return;  // nothing to commit
+
+   MessageRef groupMsg = _groupCommitPayload;
+   _groupCommitPayload.Reset();
+   _groupCommitDeadline = MUSCLE_TIME_NEVER;
+
+   Queue<PZGUpdateAckRequest> ackReqs;
+   ackReqs.SwapContents(_groupCommitAckRequests);
+
+   const uint32 numUpdates = groupMsg()->GetNumValuesInName(PZG_PEER_NAME_USER_MESSAGE);
+   if (numUpdates == 0) return;  // every update in the group failed, so there's nothing for the juniors to do
+
+   if (_master->IAmTheSeniorPeerForDatabase(_whichDatabase) == false)
+   {
+      DiscardUnpublishedSeniorUpdates(numUpdates);
+      return;  // no need to fail (ackReqs), since the requesting peers will fail them when they see the senior peer change
+   }
+
+   // A group of just one update is sent as an ordinary update, since there's no benefit to wrapping it
+   const bool isGroup = (numUpdates > 1);
+   const ConstMessageRef payloadMsg = isGroup ? AddConstToRef(groupMsg) : AddConstToRef(groupMsg()->GetMessage(PZG_PEER_NAME_USER_MESSAGE));
+
+   PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool(isGroup ? PZG_DATABASE_UPDATE_TYPE_GROUP_UPDATE : PZG_DATABASE_UPDATE_TYPE_UPDATE, (uint16) _whichDatabase, _localDatabaseStateID+1, _groupCommitSourcePeerID, _groupCommitPreUpdateDBChecksum);
+   status_t ret = dbUp() ? AddDatabaseUpdateToUpdateLog(dbUp) : B_OUT_OF_MEMORY;
+   if (ret.IsOK())
+   {
+      SeniorUpdateCompleted(dbUp, _groupCommitRequestTime, _groupCommitReceiveTime, _groupCommitStartTime, _groupCommitElapsedMicros, payloadMsg, *_master);
+      for (uint32 i=0; i<ackReqs.GetNumItems(); i++) RegisterUpdateAck(ackReqs[i], dbUp()->GetUpdateID());
+   }
+   else
+   {
+      // The grouped changes are already in our database, so rather than leaving our database out of step with (_localDatabaseStateID)
+      // (and with every junior peer's database), we'll publish our full database state in their place
+      LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseUpdateState:  Unable to commit " UINT32_FORMAT_SPEC " grouped updates to senior database #" UINT32_FORMAT_SPEC "! [%s]\n", numUpdates, _whichDatabase, ret());
+      ScheduleSeniorDatabaseRepublish(_groupCommitPreUpdateDBChecksum, numUpdates);
+      for (uint32 i=0; i<ackReqs.GetNumItems(); i++) AddRepublishAckRequest(ackReqs[i]);
+   }
+
+   if (_deferredUpdateRequests.HasItems())
+   {
+      // Our senior state has changed, so the deferral decision may have too.  We don't execute the deferred requests right
+      // here, since our caller might be about to save the database, which must not contain another uncommitted group then.
+      _deferredUpdateRequestsCheckPending = true;
+      InvalidatePulseTime();
+   }
+}
+
+void PZGDatabaseState :: DiscardUnpublishedSeniorUpdates(uint32 numUpdates)
+{
+   // We lost our seniority before we could publish these updates, so our local database now contains changes
+   // that nobody else will ever see.  Best we can do is repair our database to match the new senior peer's state.
+   LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  Discarding " UINT32_FORMAT_SPEC " unpublished updates because we are no longer the senior peer.\n", _whichDatabase, numUpdates);
+   if (_master->GetSeniorPeerIDForDatabase(_whichDatabase).IsValid())
+   {
+      const status_t ret = RequestDatabaseRepair();
+      if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "Request for database repair failed! [%s]\n", ret());
+   }
+}
+
+void PZGDatabaseState :: ScheduleSeniorDatabaseRepublish(uint64 publishedDBChecksum, uint32 numUpdates)
+{
+   // Our local database now contains changes that the junior peers will never receive as updates.  Since we're the senior
+   // peer, our database is the authoritative one, so we'll publish its full state (as a replace-update) to get everyone back in step.
+   if (IsRepublishPending() == false)
+   {
+      LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  Executed updates couldn't be published, so our full database state will be published in their place.\n", _whichDatabase);
+      _republishPreUpdateDBChecksum = _groupCommitPayload() ? _groupCommitPreUpdateDBChecksum : publishedDBChecksum;
+      _republishRetryTime           = 0;  // as soon as our worker thread is idle
+   }
+
+   if (_groupCommitPayload())
+   {
+      // The updates in the current group are already in our database too, so they'll be published along with it
+      _numUnpublishedSeniorUpdates += _groupCommitPayload()->GetNumValuesInName(PZG_PEER_NAME_USER_MESSAGE);
+      _groupCommitPayload.Reset();
+      _groupCommitDeadline = MUSCLE_TIME_NEVER;
+
+      Queue<PZGUpdateAckRequest> ackReqs;
+      ackReqs.SwapContents(_groupCommitAckRequests);
+      for (uint32 i=0; i<ackReqs.GetNumItems(); i++) AddRepublishAckRequest(ackReqs[i]);
+   }
+
+   _numUnpublishedSeniorUpdates += numUpdates;
+   InvalidatePulseTime();
+}
+
+void PZGDatabaseState :: AddRepublishAckRequest(const PZGUpdateAckRequest & ackReq)
+{
+   if (ackReq.IsValid() == false) return;  // the requesting peer didn't ask to be acknowledged
+
+   status_t ret;
+   if (_republishAckRequests.AddTail(ackReq).IsError(ret))  // it'll be registered when our full database state gets its update ID
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseState:  Unable to hold acknowledgement #" UINT64_FORMAT_SPEC " for database #" UINT32_FORMAT_SPEC "! [%s]\n", ackReq.GetAckID(), _whichDatabase, ret());
+      SendUpdateAck(ackReq, 0, 0);
+   }
+}
+
+status_t PZGDatabaseState :: RepublishSeniorDatabaseIfPending()
+{
+   if (IsRepublishPending() == false) return B_NO_ERROR;
+
+   DrainWorkerThread();  // so that our database won't be modified while we're saving it (the drained updates will be published along with it)
+
+   status_t ret;
+   if (PublishSeniorDatabaseState().IsError(ret))
+   {
+      LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to publish our full database state, will try again later. [%s]\n", _whichDatabase, ret());
+      _republishRetryTime = GetRunTime64()+PZG_REPUBLISH_RETRY_MICROS;
+      InvalidatePulseTime();
+   }
+   return ret;
+}
+
+status_t PZGDatabaseState :: PublishSeniorDatabaseState()
+{
+   const uint64 startTime = GetRunTime64();
+   _dbChecksum = _master->CalculateLocalDatabaseChecksum(_whichDatabase);  // in case a failed worker job couldn't tell us what our checksum became
+
+   MessageRef savedDBMsg = _master->SaveLocalDatabaseToMessage(_whichDatabase);
+   MRETURN_ON_ERROR(savedDBMsg);
+
+   PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool(PZG_DATABASE_UPDATE_TYPE_REPLACE, (uint16) _whichDatabase, _localDatabaseStateID+1, _master->GetLocalPeerID(), _republishPreUpdateDBChecksum);
+   MRETURN_ON_ERROR(dbUp);
+   MRETURN_ON_ERROR(AddDatabaseUpdateToUpdateLog(dbUp));
+
+   SeniorUpdateCompleted(dbUp, 0, _master->GetNetworkTime64(), startTime, GetRunTime64()-startTime, savedDBMsg, *_master);
+   LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  Published our full database state as update #" UINT64_FORMAT_SPEC ", in place of " UINT32_FORMAT_SPEC " unpublished updates.\n", _whichDatabase, dbUp()->GetUpdateID(), _numUnpublishedSeniorUpdates);
+
+   _numUnpublishedSeniorUpdates = 0;
+   _republishRetryTime          = MUSCLE_TIME_NEVER;
+
+   Queue<PZGUpdateAckRequest> ackReqs;
+   ackReqs.SwapContents(_republishAckRequests);
+   for (uint32 i=0; i<ackReqs.GetNumItems(); i++) RegisterUpdateAck(ackReqs[i], dbUp()->GetUpdateID());  // their changes are part of the published state
+
+   if (_deferredUpdateRequests.HasItems())
+   {
+      // As in CommitPendingGroupUpdate(), our caller might be about to save the database, so we execute the deferred requests later
+      _deferredUpdateRequestsCheckPending = true;
+      InvalidatePulseTime();
+   }
+   return B_NO_ERROR;
+}
+
+void PZGDatabaseState :: RegisterUpdateAck(const PZGUpdateAckRequest & ackReq, uint64 updateID)
+{
+   if (ackReq.IsValid() == false) return;  // the requesting peer didn't ask to be acknowledged
+
+   PZGUpdateAckRequest newAck(ackReq);
+   newAck.SetUpdateID(updateID);
+
+   status_t ret;
+   if (_pendingUpdateAcks.AddTail(newAck).IsOK(ret)) CheckPendingUpdateAcks();  // the update might already have been applied on enough peers (e.g. if only the senior peer was wanted)
+   else
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseState:  Unable to register acknowledgement #" UINT64_FORMAT_SPEC " for database #" UINT32_FORMAT_SPEC "! [%s]\n", ackReq.GetAckID(), _whichDatabase, ret());
+      SendUpdateAck(ackReq, 0, 0);
+   }
+}
+
+void PZGDatabaseState :: SendUpdateAck(const PZGUpdateAckRequest & ackReq, uint64 updateID, uint32 numPeersApplied)
+{
+   MessageRef ackMsg = GetMessageFromPool(PZG_PEER_COMMAND_UPDATE_ACKNOWLEDGED);
+   status_t ret = ackMsg() ? B_NO_ERROR : B_OUT_OF_MEMORY;
+   if ((ret.IsError())
+     ||(ackMsg()->AddInt32(PZG_PEER_NAME_DATABASE_ID,        _whichDatabase).IsError(ret))
+     ||(ackMsg()->AddInt64(PZG_PEER_NAME_ACK_ID,             ackReq.GetAckID()).IsError(ret))
+     ||(ackMsg()->AddInt64(PZG_PEER_NAME_DATABASE_UPDATE_ID, updateID).IsError(ret))
+     ||(ackMsg()->AddInt32(PZG_PEER_NAME_NUM_PEERS,          numPeersApplied).IsError(ret))
+     ||(_master->SendUnicastInternalMessageToPeer(ackReq.GetRequesterID(), ackMsg).IsError(ret))) LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseState:  Unable to send acknowledgement #" UINT64_FORMAT_SPEC " for database #" UINT32_FORMAT_SPEC " to peer [%s]! [%s]\n", ackReq.GetAckID(), _whichDatabase, ackReq.GetRequesterID().ToString()(), ret());
+}
+
+uint32 PZGDatabaseState :: GetNumPeersThatHaveApplied(uint64 updateID) const
+{
+   uint32 ret = 0;
+   const ZGPeerID & localPeerID = _master->GetLocalPeerID();
+   for (ConstHashtableIterator<ZGPeerID, ConstMessageRef> iter(_master->GetOnlinePeers()); iter.HasData(); iter++)
+   {
+      const ZGPeerID & pid = iter.GetKey();
+      if (((pid == localPeerID) ? _localDatabaseStateID : _peerAppliedStateIDs.GetWithDefault(pid)) >= updateID) ret++;
+   }
+   return ret;
+}
+
+void PZGDatabaseState :: CheckPendingUpdateAcks()
+{
+   const uint32 numOnlinePeers = _master->GetOnlinePeers().GetNumItems();
+   for (int32 i=_pendingUpdateAcks.GetNumItems()-1; i>=0; i--)
+   {
+      const PZGUpdateAckRequest & ackReq = _pendingUpdateAcks[i];
+      const uint32 numApplied = GetNumPeersThatHaveApplied(ackReq.GetUpdateID());
+      if (numApplied >= muscleMin(ackReq.GetNumPeersWanted(), numOnlinePeers))  // peers that went offline can't be waited for
+      {
+         SendUpdateAck(ackReq, ackReq.GetUpdateID(), numApplied);
+         (void) _pendingUpdateAcks.RemoveItemAt(i);
+      }
+   }
+}
+
+void PZGDatabaseState :: AppliedStateReportReceived(const ZGPeerID & fromPeerID, uint64 appliedStateID)
+{
+   if (_peerAppliedStateIDs.Put(fromPeerID, appliedStateID).IsOK())
+   {
+      CheckPendingUpdateAcks();
+      ProcessDeferredUpdateRequests();
+   }
+}
+
+void PZGDatabaseState :: PeerHasGoneOffline(const ZGPeerID & peerID)
+{
+   (void) _peerAppliedStateIDs.Remove(peerID);
+   CheckPendingUpdateAcks();         // since there is now one less peer to wait for
+   ProcessDeferredUpdateRequests();  // ditto
+}
+
+void PZGDatabaseState :: SeniorPeerChanged()
+{
+   _peerAppliedStateIDs.Clear();
+   _pendingUpdateAcks.Clear();
+
+   if (IsRepublishPending())
+   {
+      // We lost our seniority before we could publish our database's state, so our database has to be repaired instead
+      const uint32 numUpdates = _numUnpublishedSeniorUpdates;
+      _numUnpublishedSeniorUpdates = 0;
+      _republishRetryTime          = MUSCLE_TIME_NEVER;
+      _republishAckRequests.Clear();  // no need to fail these, since the requesting peers will fail them when they see the senior peer change
+      DiscardUnpublishedSeniorUpdates(numUpdates);
+   }
+
+   if (_deferredUpdateRequests.HasItems())
+   {
+      // We're no longer the senior peer, so we can't execute these anymore.  Their requesters will have to re-send them to the new senior peer.
+      LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  Discarding " UINT32_FORMAT_SPEC " deferred update-requests because the senior peer has changed.\n", _whichDatabase, _deferredUpdateRequests.GetNumItems());
+      _deferredUpdateRequests.Clear();
+   }
+}
+
+bool PZGDatabaseState :: IsJuniorLagExcessive() const
+{
+   if ((IsFlowControlEnabled() == false)||(_peerAppliedStateIDs.IsEmpty())) return false;
+
+   // Only the slowest junior peer matters, since if it's within our limits, all the others are too
+   uint64 slowestStateID = (uint64) -1;
+   for (ConstHashtableIterator<ZGPeerID, uint64> iter(_peerAppliedStateIDs); iter.HasData(); iter++) slowestStateID = muscleMin(slowestStateID, iter.GetValue());
+
+   const uint64 targetStateID = GetSeniorTargetStateID();
+   if ((targetStateID > slowestStateID)&&((targetStateID-slowestStateID) > _maxJuniorLagUpdates)) return true;
+   return ((_maxJuniorLagBytes != MUSCLE_NO_LIMIT)&&(GetPayloadBytesSince(slowestStateID, _maxJuniorLagBytes) > _maxJuniorLagBytes));
+}
+
+uint64 PZGDatabaseState :: GetPayloadBytesSince(uint64 stateID, uint64 maxBytes) const
+{
+   // Note that updates that have already been trimmed from our update-log aren't counted
+   uint64 ret = 0;
+   const uint64 firstIDInLog = _updateLog.GetFirstKeyWithDefault();
+   for (uint64 updateID=_updateLog.GetLastKeyWithDefault(); ((updateID > stateID)&&(updateID >= firstIDInLog)&&(ret <= maxBytes)); updateID--)
+   {
+      const ConstPZGDatabaseUpdateRef & dbUp = _updateLog.GetWithDefault(updateID);
+      if ((dbUp())&&(dbUp()->GetPayloadBuffer()())) ret += dbUp()->GetPayloadBuffer()()->GetNumBytes();
+   }
+   return ret;
+}
+
+// A full reset or replace of our database can't be done while our worker thread is still executing updates, so rather
+// than blocking the main thread until the worker thread is done, we defer such requests until it has finished them.
+bool PZGDatabaseState :: MustWaitForWorkerThread(const Message & requestMsg) const
+{
+   return ((GetNumWorkerJobsInFlight() > 0)&&((requestMsg.what == PZG_PEER_COMMAND_RESET_SENIOR_DATABASE)||(requestMsg.what == PZG_PEER_COMMAND_REPLACE_SENIOR_DATABASE)));
+}
+
+void PZGDatabaseState :: ProcessDeferredUpdateRequests()
+{
+   if (_processingDeferredUpdateRequests.IsInBatch()) return;  // e.g. a deferred reset-request called CommitPendingGroupUpdate(), which called us
+   NestCountGuard ncg(_processingDeferredUpdateRequests);
+
+   while((_deferredUpdateRequests.HasItems())&&(IsJuniorLagExcessive() == false)&&(IsRepublishPending() == false)&&(MustWaitForWorkerThread(*_deferredUpdateRequests.Head().GetMessage()()) == false))
+   {
+      PZGDeferredUpdateRequest dur;
+      (void) _deferredUpdateRequests.RemoveHead(dur);
+      (void) ExecuteDatabaseUpdateRequest(dur.GetFromPeerID(), dur.GetMessage(), ConstPZGDatabaseUpdateRef(), dur.GetReceiveTime(), *_master);  // errors are logged (and acknowledged) by ExecuteDatabaseUpdateRequest()
+   }
+}
+
+status_t PZGDatabaseState :: GetJuniorPeerLag(const ZGPeerID & peerID, uint64 & retLagUpdates, uint64 & retLagBytes) const
+{
+   const uint64 * appliedStateID = _peerAppliedStateIDs.Get(peerID);
+   if (appliedStateID == NULL) return B_DATA_NOT_FOUND;
+
+   retLagUpdates = (_localDatabaseStateID > *appliedStateID) ? (_localDatabaseStateID-*appliedStateID) : 0;
+   retLagBytes   = GetPayloadBytesSince(*appliedStateID, (uint64)-1);
+   return B_NO_ERROR;
+}
+
+void PZGDatabaseState :: PrintJuniorPeerLags() const
+{
+   printf("Junior peer lag for database #" UINT32_FORMAT_SPEC " (state=" UINT64_FORMAT_SPEC ", " UINT32_FORMAT_SPEC " deferred update-requests):\n", _whichDatabase, _localDatabaseStateID, _deferredUpdateRequests.GetNumItems());
+   for (ConstHashtableIterator<ZGPeerID, uint64> iter(_peerAppliedStateIDs); iter.HasData(); iter++)
+   {
+      uint64 lagUpdates = 0, lagBytes = 0;
+      (void) GetJuniorPeerLag(iter.GetKey(), lagUpdates, lagBytes);
+      printf("   [%s] state=" UINT64_FORMAT_SPEC " lag=" UINT64_FORMAT_SPEC " updates (" UINT64_FORMAT_SPEC " bytes)\n", iter.GetKey().ToString()(), iter.GetValue(), lagUpdates, lagBytes);
+   }
+}
+
 void PZGDatabaseState :: Pulse(const PulseArgs & args)
 {
    PulseNode::Pulse(args);
+   if (args.GetScheduledTime() >= _groupCommitDeadline) CommitPendingGroupUpdate();
+   if (args.GetScheduledTime() >= GetRepublishPulseTime()) (void) RepublishSeniorDatabaseIfPending();  // errors are logged by RepublishSeniorDatabaseIfPending()
+   if (_deferredUpdateRequestsCheckPending)
+   {
+      _deferredUpdateRequestsCheckPending = false;
+      ProcessDeferredUpdateRequests();
+   }
+   if (IsSnapshotDue()) WritePersistentSnapshot();
+   if (args.GetScheduledTime() >= _backOrderHoldoffDeadline)
+   {
+      _backOrderHoldoffDeadline = MUSCLE_TIME_NEVER;
+      _rescanLogPending         = true;  // so that any updates that are still missing will be back-ordered now
+   }
    RescanUpdateLogIfNecessary();
 }
 
+bool PZGDatabaseState :: IsMulticastRepairGracePeriodOver()
+{
+   const uint64 now = GetRunTime64();
+   if (_missingUpdatesNoticedTime == 0) _missingUpdatesNoticedTime = now;
+
+   const uint64 graceEndTime = _missingUpdatesNoticedTime+PZG_MULTICAST_REPAIR_GRACE_MICROS;
+   if (now >= graceEndTime) return true;
+
+   if (_backOrderHoldoffDeadline == MUSCLE_TIME_NEVER)
+   {
+      _backOrderHoldoffDeadline = graceEndTime;
+      InvalidatePulseTime();
+   }
+   return false;
+}
+
 void PZGDatabaseState :: RescanUpdateLogIfNecessary()
 {
    if (_rescanLogPending)
@@ -235,40 +759,51 @@ void PZGDatabaseState :: RescanUpdateLogIfNecessary()
 
 void PZGDatabaseState :: RescanUpdateLog()
 {
-   if (_master->IAmTheSeniorPeer())
+   if (_master->IAmTheSeniorPeerForDatabase(_whichDatabase))
    {
       if (_updateLog.HasItems())
       {
-         // Start iterating backwards from the end of the table (i.e. the most recent updates) until we get past all the unsent ones
-         const uint64 oldestUpdateID = *_updateLog.GetFirstKey();
-         for (ConstHashtableIterator<uint64, ConstPZGDatabaseUpdateRef> iter(_updateLog, HTIT_FLAG_BACKWARDS); iter.HasData(); iter++)
+         // Since the log is indexed by update ID, we can go straight to the first unsent update and send every update from there on
+         const uint64 lastUpdateID = _updateLog.GetLastKeyWithDefault();
+         for (uint64 nextUpdateID=muscleMax(_firstUnsentUpdateID, _updateLog.GetFirstKeyWithDefault()); nextUpdateID<=lastUpdateID; nextUpdateID++)
          {
-            const uint64 nextUpdateID = iter.GetKey();
-
-            // Stage 1: When we get to the first already-sent update, then we'll re-reverse the iterator so that it iterates forwards again
-            if ((iter.IsBackwards())&&((nextUpdateID <= _firstUnsentUpdateID)||(nextUpdateID == oldestUpdateID))) iter.SetBackwards(false);
-
-            // Stage 2: When iterating forwards, we'll send every unsent-update we encounter
-            if ((!iter.IsBackwards())&&(nextUpdateID >= _firstUnsentUpdateID)&&(_master->SendDatabaseUpdateViaMulticast(iter.GetValue()).IsOK())) _firstUnsentUpdateID = nextUpdateID+1;
+            const ConstPZGDatabaseUpdateRef & dbUp = _updateLog.GetWithDefault(nextUpdateID);
+            if (dbUp())
+            {
+               if (dbUp()->GetMulticastTimeMicros() == 0)  // i.e. unless we already tried to send it, and failed
+               {
+                  // The timestamp must be set before the update is flattened for the first time, so that the wire image created
+                  // by persisting it will also be the one that is multicast (and re-used for back-orders and resends)
+                  CastAwayConstFromRef(dbUp)()->SetMulticastTimeMicros(_master->GetNetworkTime64());  // safe, since nobody else has seen this update yet
+                  PersistDatabaseUpdate(*dbUp());
+               }
+               if (_master->SendDatabaseUpdateViaMulticast(dbUp).IsOK())
+               {
+                  _firstUnsentUpdateID = nextUpdateID+1;
+                  RecordSeniorUpdateLatencies(*dbUp());
+               }
+            }
          }
 
          // Finally, let's trim old ConstPZGDatabaseUpdates from our _updateLog if necessary, until it again fits within our memory budget
-         while((_totalPayloadBytesInLog > _maxPayloadBytesInLog)&&(_updateLog.GetNumItems() > 1)) RemoveDatabaseUpdateFromUpdateLog(*_updateLog.GetFirstValue());
+         TrimUpdateLog();
       }
    }
    else if (_seniorDatabaseStateReceived)  // no point trying to scan if we don't know where we want to scan to!
    {
+      if (_numSeniorWorkerJobsInFlight > 0) DrainWorkerThread();  // we were senior until recently; let those updates finish before we act as a junior
+
       _firstUnsentUpdateID = _localDatabaseStateID+1; // as a junior we don't really use this, but update it anyway, in case we become senior later
 
-      if (IsAwaitingFullDatabaseResendReply() == false)  // no point replaying our log if we're waiting for the full DB anyway
+      if ((IsAwaitingFullDatabaseResendReply() == false)&&(IsDatabaseRepairInProgress() == false))  // no point replaying our log if we're waiting for the full DB (or a repair) anyway
       {
          const uint64 targetDatabaseStateID = GetTargetDatabaseStateID();
-         if ((_localDatabaseStateID == 0)&&(targetDatabaseStateID > 1))
+         if ((GetJuniorDispatchedStateID() == 0)&&(targetDatabaseStateID > 1))
          {
             // per discussions with Ruurd -- if we're just starting out in the world, it's better to force a
             // download of the full current state of the database from the senior peer than to reconstuct it
             // locally by replaing the entire transaction-log, so we'll do that.
-            const status_t ret = RequestFullDatabaseResendFromSeniorPeer(false);
+            const status_t ret = RequestFullDatabaseResend(false);
             if (ret.IsOK()) LogTime(MUSCLE_LOG_DEBUG, "Database #" UINT32_FORMAT_SPEC " successfully requested the full/initial database state from senior peer.\n", _whichDatabase);
                        else LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC " was unable to request the full/initial database state from senior peer. [%s]\n", _whichDatabase, ret());
          }
@@ -280,60 +815,84 @@ void PZGDatabaseState :: RescanUpdateLog()
             // receive the multicast packets for whatever reason), we may have to request a resend of
             // the missing PZGDatabaseUpdates from the senior peer, and if that doesn't work, our
             // ultimate fallback will be to request the full state of the current database from the senior peer.
-            NestCountGuard ncg(_inJuniorDatabaseUpdate);
-            while(_localDatabaseStateID < targetDatabaseStateID)
+            while(GetJuniorDispatchedStateID() < targetDatabaseStateID)
             {
-               const uint64 nextStateID = _localDatabaseStateID+1;
-               ConstPZGDatabaseUpdateRef dbUp = _updateLog[nextStateID];
-               if (dbUp())
+               const uint64 nextStateID = GetJuniorDispatchedStateID()+1;
+               ConstPZGDatabaseUpdateRef dbUp = _updateLog.GetWithDefault(nextStateID);
+               if (dbUp()) _missingUpdatesNoticedTime = 0;  // we're making progress, so any later gap gets its own repair grace period
+               if ((dbUp())&&(_workerSession()))
+               {
+                  if (_workerJobFailed) break;  // we'll wait for the remaining in-flight jobs to come back before trying anything else
+
+                  status_t ret;
+                  if (SendJobToWorkerThread(PZG_DATABASE_WORKER_JOB_JUNIOR_UPDATE, ZGPeerID(), ConstMessageRef(), dbUp).IsOK(ret)) _workerTargetStateID = nextStateID;
+                  else
+                  {
+                     LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC " was unable to send junior update #" UINT64_FORMAT_SPEC " to its worker thread! [%s]\n", _whichDatabase, nextStateID, ret());
+                     break;
+                  }
+               }
+               else if (dbUp())
                {
+                  NestCountGuard ncg(_mainThreadUpdateContext.GetJuniorUpdateNestCount());
                   status_t ret;
                   if (JuniorExecuteDatabaseUpdate(*dbUp()).IsOK(ret))
                   {
+                     PersistDatabaseUpdate(*dbUp());
+                     RecordJuniorUpdateLatencies(*dbUp());
                      LogTime(MUSCLE_LOG_DEBUG, "Database #" UINT32_FORMAT_SPEC " successfully executed junior update to state #" UINT64_FORMAT_SPEC "\n", _whichDatabase, nextStateID);
                   }
                   else
                   {
-                     LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC " was unable to execute junior update #" UINT64_FORMAT_SPEC " (%s), will try to recover by requesting full database resend.\n", _whichDatabase, nextStateID, ret());
-                     if (RequestFullDatabaseResendFromSeniorPeer(true).IsError(ret)) LogTime(MUSCLE_LOG_ERROR, "Request for full database resend failed! [%s]\n", ret());
+                     LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC " was unable to execute junior update #" UINT64_FORMAT_SPEC " (%s), will try to recover by repairing our database.\n", _whichDatabase, nextStateID, ret());
+                     if (RequestDatabaseRepair().IsError(ret)) LogTime(MUSCLE_LOG_ERROR, "Request for database repair failed! [%s]\n", ret());
                      break;
                   }
                }
                else
                {
-                  const ZGPeerID & seniorPeerID = _master->GetSeniorPeerID();
+                  const ZGPeerID & seniorPeerID = _master->GetSeniorPeerIDForDatabase(_whichDatabase);
                   if (seniorPeerID.IsValid())
                   {
                      if (nextStateID < _seniorOldestIDInLog)
                      {
                         LogTime(MUSCLE_LOG_DEBUG, "Next required state ID " UINT64_FORMAT_SPEC " is no longer in senior peer's log (oldest he has is " UINT64_FORMAT_SPEC "), so we'll request a full DB #" UINT32_FORMAT_SPEC " resend instead.\n", nextStateID, _seniorOldestIDInLog, _whichDatabase);
-                        const status_t ret = RequestFullDatabaseResendFromSeniorPeer(false);
+                        const status_t ret = RequestFullDatabaseResend(false);
                         if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "Request for full database resend failed! [%s]\n", ret());
                      }
+                     else if (IsMulticastRepairGracePeriodOver() == false)
+                     {
+                        // The multicast layer NACKs any updates it notices are missing, and that usually recovers
+                        // them much sooner (and more cheaply for the senior peer) than a back-order would, so we'll
+                        // give it a chance to work before we place any back-orders.  We'll rescan when it has had its chance.
+                     }
                      else
                      {
                         // Oops, we can't update our local DB any further (for now), but we can at least make sure
-                        // that the PZGDatabaseUpdates we need are on back-order from the senior peer
+                        // that the PZGDatabaseUpdates we need are on back-order.  Each run of consecutive missing
+                        // updates is requested with a single back-order, to save round trips, from whichever
+                        // up-to-date peer is closest and least busy (or from the senior peer, if no other peer has them).
                         for (uint64 updateID=nextStateID; updateID<=targetDatabaseStateID; updateID++)
                         {
-                           if (_updateLog.ContainsKey(updateID) == false)
+                           if (IsUpdateMissingAndNotOnBackOrder(updateID))
                            {
-                              const PZGUpdateBackOrderKey ubok(seniorPeerID, _whichDatabase, updateID);
-                              if (_backorders.ContainsKey(ubok) == false)
+                              uint64 lastUpdateID = updateID;
+                              while((lastUpdateID < targetDatabaseStateID)&&((lastUpdateID-updateID) < (PZG_MAX_UPDATES_PER_BACK_ORDER-1))&&(IsUpdateMissingAndNotOnBackOrder(lastUpdateID+1))) lastUpdateID++;
+
+                              const ZGPeerID sourcePeerID = _master->GetBackOrderSourcePeerID(_whichDatabase, updateID, lastUpdateID);  // may reduce (lastUpdateID)
+                              status_t ret;
+                              if (RequestBackOrderRangeFromPeer(sourcePeerID, updateID, lastUpdateID).IsOK(ret))
+                              {
+                                 LogTime(MUSCLE_LOG_DEBUG, "Database " UINT32_FORMAT_SPEC ":  Placed updates #" UINT64_FORMAT_SPEC "-#" UINT64_FORMAT_SPEC " on back-order from %s peer [%s]\n", _whichDatabase, updateID, lastUpdateID, (sourcePeerID == seniorPeerID)?"senior":"junior", sourcePeerID.ToString()());
+                              }
+                              else
                               {
-                                 status_t ret;
-                                 if (RequestBackOrderFromSeniorPeer(ubok, false).IsOK(ret))
-                                 {
-                                    LogTime(MUSCLE_LOG_DEBUG, "Database " UINT32_FORMAT_SPEC ":  Placed update #" UINT64_FORMAT_SPEC " on back-order from senior peer [%s]\n", ubok.GetDatabaseIndex(), ubok.GetDatabaseUpdateID(), ubok.GetTargetPeerID().ToString()());
-                                 }
-                                 else
-                                 {
-                                    LogTime(MUSCLE_LOG_ERROR, "Database " UINT32_FORMAT_SPEC ":  Requested back order of update #" UINT64_FORMAT_SPEC " failed (%s), requesting full resend\n", ubok.GetDatabaseIndex(), ubok.GetDatabaseUpdateID(), ret());
-                                    ret = RequestFullDatabaseResendFromSeniorPeer(false);
-                                    if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "Request for full database resend failed! [%s]\n", ret());
-                                    break;
-                                 }
+                                 LogTime(MUSCLE_LOG_ERROR, "Database " UINT32_FORMAT_SPEC ":  Requested back order of updates #" UINT64_FORMAT_SPEC "-#" UINT64_FORMAT_SPEC " failed (%s), requesting full resend\n", _whichDatabase, updateID, lastUpdateID, ret());
+                                 ret = RequestFullDatabaseResend(false);
+                                 if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "Request for full database resend failed! [%s]\n", ret());
+                                 break;
                               }
+                              updateID = lastUpdateID;
                            }
                         }
                      }
@@ -345,82 +904,304 @@ void PZGDatabaseState :: RescanUpdateLog()
       }
 
       // Finally, let's trim old/unneeded ConstPZGDatabaseUpdates from our _updateLog if necessary, until it again fits within our memory budget
-      while((_totalPayloadBytesInLog > _maxPayloadBytesInLog)&&(_updateLog.GetNumItems() > 1)&&(IsDatabaseUpdateStillNeededToAdvanceJuniorPeerState(*_updateLog.GetFirstKey()) == false)) RemoveDatabaseUpdateFromUpdateLog(*_updateLog.GetFirstValue());
+      TrimUpdateLog();
    }
 }
 
-status_t PZGDatabaseState :: RequestBackOrderFromSeniorPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError)
+void PZGDatabaseState :: TrimUpdateLog()
 {
-   if (_backorders.ContainsKey(ubok)) return B_NO_ERROR;  // paranoia:  it's already on order, no need to ask again
-
-   status_t ret;
-   if (_backorders.PutWithDefault(ubok).IsOK(ret))
-   {
-      if (_master->RequestBackOrderFromSeniorPeer(ubok, dueToChecksumError).IsOK(ret)) return B_NO_ERROR;
-      (void) _backorders.Remove(ubok);  // roll back!
-   }
-   return ret;
+   if (_master->GetPeerSettings().GetSharedUpdateLogBudget() > 0) _master->TrimSharedUpdateLogs();  // the budget is shared, so the update to evict might not even be one of ours
+   else while((_totalPayloadBytesInLog > _maxPayloadBytesInLog)&&(IsOldestUpdateEvictable())) RemoveDatabaseUpdateFromUpdateLog(_updateLog.GetFirstValue());
 }
 
-status_t PZGDatabaseState :: RequestFullDatabaseResendFromSeniorPeer(bool dueToChecksumError)
+bool PZGDatabaseState :: IsOldestUpdateEvictable() const
 {
-   return RequestBackOrderFromSeniorPeer(PZGUpdateBackOrderKey(_master->GetSeniorPeerID(), _whichDatabase, DATABASE_UPDATE_ID_FULL_UPDATE), dueToChecksumError);
+   if (_updateLog.GetNumItems() <= 1) return false;  // we always keep our most recent update
+
+   const uint64 oldestUpdateID = _updateLog.GetFirstKeyWithDefault();
+   if (_master->IAmTheSeniorPeerForDatabase(_whichDatabase)) return (oldestUpdateID < _firstUnsentUpdateID);  // updates we haven't multicast yet must stay
+   return (IsDatabaseUpdateStillNeededToAdvanceJuniorPeerState(oldestUpdateID) == false);
 }
 
-bool PZGDatabaseState :: IsAwaitingFullDatabaseResendReply() const
+bool PZGDatabaseState :: IsUpdateLikelyNeededByAnyPeer(uint64 updateID) const
 {
-   return (_backorders.ContainsKey(PZGUpdateBackOrderKey(_master->GetSeniorPeerID(), _whichDatabase, DATABASE_UPDATE_ID_FULL_UPDATE)));
+   for (ConstHashtableIterator<ZGPeerID, uint64> iter(_peerAppliedStateIDs); iter.HasData(); iter++) if (iter.GetValue() < updateID) return true;
+   return _master->IsAnyPeerBehindDatabaseState(_whichDatabase, updateID);
 }
 
-status_t PZGDatabaseState :: JuniorExecuteDatabaseUpdate(const PZGDatabaseUpdate & dbUp)
+bool PZGDatabaseState :: GetEvictionCandidate(uint64 now, bool & retLikelyNeeded, double & retWeight) const
 {
-   const uint64 newDatabaseStateID = dbUp.GetUpdateID();
-   if ((_localDatabaseStateID+1) != newDatabaseStateID)
-   {
-      // This should be unnecessary since the calling code's logic should have already guaranteed this, but I'm paranoid
-      LogTime(MUSCLE_LOG_ERROR, "Error, junior update #" UINT64_FORMAT_SPEC " isn't the right update to advance current state " UINT64_FORMAT_SPEC " of database #" UINT32_FORMAT_SPEC "\n", newDatabaseStateID, _localDatabaseStateID, _whichDatabase);
-      return B_BAD_OBJECT;
-   }
-   if (_dbChecksum != dbUp.GetPreUpdateDBChecksum())
-   {
-      LogTime(MUSCLE_LOG_ERROR, "Error, DB checksum " UINT32_FORMAT_SPEC " of database #" UINT32_FORMAT_SPEC " doesn't match required pre-update DB checksum " UINT32_FORMAT_SPEC " for junior update #" UINT64_FORMAT_SPEC "\n", _dbChecksum, _whichDatabase, dbUp.GetPreUpdateDBChecksum(), newDatabaseStateID);
-      const String dbContents = _master->GetLocalDatabaseContentsAsString(_whichDatabase);
-      if (dbContents.HasChars()) printf("Mismatched Local pre-update state was:\n%s\n", dbContents());
-      return B_BAD_OBJECT;
-   }
+   if (IsOldestUpdateEvictable() == false) return false;
 
-   MRETURN_ON_ERROR(JuniorExecuteDatabaseUpdateAux(dbUp));
+   // Older and larger updates are cheaper to give up:  an old update is less likely to be back-ordered, and a large one frees up more memory
+   const ConstPZGDatabaseUpdateRef & dbUp = _updateLog.GetFirstValue();
+   const uint64 startTime    = dbUp()->GetSeniorStartTimeMicros();
+   const double ageSeconds   = ((startTime > 0)&&(now > startTime)) ? (((double)(now-startTime))/1000000.0) : 0.0;
+   const uint32 payloadBytes = dbUp()->GetPayloadBuffer()() ? dbUp()->GetPayloadBuffer()()->GetNumBytes() : 0;
 
-   if (_dbChecksum != dbUp.GetPostUpdateDBChecksum())
+   retWeight       = (((double)payloadBytes)+1.0)*(ageSeconds+1.0);
+   retLikelyNeeded = IsUpdateLikelyNeededByAnyPeer(_updateLog.GetFirstKeyWithDefault());
+   return true;
+}
+
+status_t PZGDatabaseState :: RequestBackOrderFromPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError)
+{
+   const uint64 updateID = ubok.GetDatabaseUpdateID();
+   const ZGPeerID * oldSourcePeerID = _backorders.Get(updateID);
+   if ((oldSourcePeerID)&&(*oldSourcePeerID == ubok.GetTargetPeerID())) return B_NO_ERROR;  // paranoia:  it's already on order, no need to ask again
+
+   const ZGPeerID oldSource = oldSourcePeerID ? *oldSourcePeerID : ZGPeerID();
+   status_t ret;
+   if (_backorders.Put(updateID, ubok.GetTargetPeerID()).IsOK(ret))
    {
-      LogTime(MUSCLE_LOG_ERROR, "Error, DB checksum " UINT32_FORMAT_SPEC " of database #" UINT32_FORMAT_SPEC " doesn't match required post-update DB checksum " UINT32_FORMAT_SPEC " for junior update #" UINT64_FORMAT_SPEC "\n", _dbChecksum, _whichDatabase, dbUp.GetPostUpdateDBChecksum(), newDatabaseStateID);
-      const String dbContents = _master->GetLocalDatabaseContentsAsString(_whichDatabase);
-      if (dbContents.HasChars()) printf("Mismatched Local post-update state was:\n%s\n", dbContents());
+      if (_master->RequestBackOrderFromPeer(ubok, dueToChecksumError).IsOK(ret)) return B_NO_ERROR;
 
-      _printDatabaseStatesComparisonOnNextReplace = true;  // so we can more easily debug what went wrong
-      return B_BAD_OBJECT;
+      // roll back!
+      if (oldSource.IsValid()) (void) _backorders.Put(updateID, oldSource);
+                          else (void) _backorders.Remove(updateID);
    }
-
-   _localDatabaseStateID = newDatabaseStateID;
-   return B_NO_ERROR;  // success!
+   return ret;
 }
 
-status_t PZGDatabaseState :: JuniorExecuteDatabaseReplace(const PZGDatabaseUpdate & dbUp)
+status_t PZGDatabaseState :: RequestBackOrderRangeFromPeer(const ZGPeerID & sourcePeerID, uint64 firstUpdateID, uint64 lastUpdateID)
 {
-   const bool doPrints = _printDatabaseStatesComparisonOnNextReplace;
-   _printDatabaseStatesComparisonOnNextReplace = false;  // clear this now so that if we return early it will still be cleared
+   if (firstUpdateID == lastUpdateID) return RequestBackOrderFromPeer(PZGUpdateBackOrderKey(sourcePeerID, _whichDatabase, firstUpdateID), false);
+
+   // Each update in the range is recorded as being on back-order individually, since the results will be delivered to us individually
+   status_t ret;
+   uint64 updateID = firstUpdateID;
+   for (; updateID<=lastUpdateID; updateID++) if (_backorders.Put(updateID, sourcePeerID).IsError(ret)) break;
+   if ((ret.IsOK())&&(_master->RequestBackOrderFromPeer(PZGUpdateBackOrderKey(sourcePeerID, _whichDatabase, firstUpdateID, lastUpdateID), false).IsOK(ret))) return B_NO_ERROR;
+
+   while(updateID > firstUpdateID) (void) _backorders.Remove(--updateID);  // roll back!
+   return ret;
+}
+
+status_t PZGDatabaseState :: RequestFullDatabaseResend(bool dueToChecksumError)
+{
+   // If our own database is suspect, only the senior peer's state is authoritative enough to repair it.
+   // Otherwise, any peer whose state is recent enough for us to catch up from will do.
+   const ZGPeerID sourcePeerID = dueToChecksumError ? _master->GetSeniorPeerIDForDatabase(_whichDatabase) : _master->GetFullDatabaseResendSourcePeerID(_whichDatabase, GetMinimumUsefulFullResendStateID());
+   return RequestBackOrderFromPeer(PZGUpdateBackOrderKey(sourcePeerID, _whichDatabase, DATABASE_UPDATE_ID_FULL_UPDATE), dueToChecksumError);
+}
+
+uint64 PZGDatabaseState :: GetMinimumUsefulFullResendStateID() const
+{
+   // A full database state is only useful to us if the senior peer's update-log still has the updates that come after it
+   return ((_seniorOldestIDInLog > 0)&&(_seniorOldestIDInLog <= _seniorDatabaseStateID)) ? (_seniorOldestIDInLog-1) : _seniorDatabaseStateID;
+}
+
+bool PZGDatabaseState :: IsAwaitingFullDatabaseResendReply() const
+{
+   return IsUpdateOnBackOrder(DATABASE_UPDATE_ID_FULL_UPDATE);
+}
+
+bool PZGDatabaseState :: IsUpdateOnBackOrder(uint64 updateID) const
+{
+   // A back-order from a peer that has since gone offline is never going to be filled
+   const ZGPeerID * sourcePeerID = _backorders.Get(updateID);
+   return ((sourcePeerID)&&(_master->IsPeerOnline(*sourcePeerID)));
+}
+
+bool PZGDatabaseState :: IsDatabaseRepairInProgress() const
+{
+   // Likewise, a repair that the senior peer went offline in the middle of is never going to be finished
+   return ((_repairSourcePeerID.IsValid())&&(_master->IsPeerOnline(_repairSourcePeerID)));
+}
+
+status_t PZGDatabaseState :: RequestDatabaseRepair()
+{
+   if (IsDatabaseRepairInProgress()) return B_NO_ERROR;  // we're already on it
+
+   // Rather than downloading the entire database, we'll first try comparing ours against the senior peer's (which is the
+   // only one authoritative enough to repair ours from), so that only the parts that actually differ have to be sent to us.
+   const ZGPeerID & seniorPeerID = _master->GetSeniorPeerIDForDatabase(_whichDatabase);
+   if ((seniorPeerID.IsValid())&&(_master->IAmTheSeniorPeerForDatabase(_whichDatabase) == false))
+   {
+      DrainWorkerThread();  // our worker thread mustn't modify the database while we're comparing it
+
+      _repairSourcePeerID = seniorPeerID;
+      _repairPassCount    = 0;
+
+      status_t ret;
+      if (StartDatabaseRepairPass().IsOK(ret))
+      {
+         LogTime(MUSCLE_LOG_INFO, "Database #" UINT32_FORMAT_SPEC ":  Comparing our database against the senior peer's, to repair the parts that differ.\n", _whichDatabase);
+         return B_NO_ERROR;
+      }
+
+      _repairSourcePeerID = ZGPeerID();
+      if (ret != B_UNIMPLEMENTED) LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to start database repair [%s], requesting full database resend instead.\n", _whichDatabase, ret());
+   }
+
+   return RequestFullDatabaseResend(true);
+}
+
+status_t PZGDatabaseState :: StartDatabaseRepairPass()
+{
+   MessageRef repairRequestMsg;
+   MRETURN_ON_ERROR(_master->JuniorRepairLocalDatabase(_whichDatabase, _dbChecksum, ConstMessageRef(), repairRequestMsg));
+   return repairRequestMsg() ? SendDatabaseRepairRequest(repairRequestMsg) : B_BAD_OBJECT;  // a new pass must always have something to compare
+}
+
+status_t PZGDatabaseState :: SendDatabaseRepairRequest(const ConstMessageRef & repairRequestMsg)
+{
+   MessageRef msg = GetMessageFromPool(PZG_PEER_COMMAND_DATABASE_REPAIR_REQUEST);
+   MRETURN_OOM_ON_NULL(msg());
+
+   MRETURN_ON_ERROR(msg()->AddInt32(  PZG_PEER_NAME_DATABASE_ID,  _whichDatabase));
+   MRETURN_ON_ERROR(msg()->AddMessage(PZG_PEER_NAME_USER_MESSAGE, CastAwayConstFromRef(repairRequestMsg)));
+   return _master->SendUnicastInternalMessageToPeer(_repairSourcePeerID, msg);
+}
+
+void PZGDatabaseState :: DatabaseRepairFailed(const char * why)
+{
+   LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  Database repair failed (%s), requesting full database resend instead.\n", _whichDatabase, why);
+   _repairSourcePeerID = ZGPeerID();
+
+   const status_t ret = RequestFullDatabaseResend(true);
+   if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "Request for full database resend failed! [%s]\n", ret());
+}
+
+void PZGDatabaseState :: DatabaseRepairRequestReceived(const ZGPeerID & fromPeerID, const ConstMessageRef & msg)
+{
+   MessageRef replyMsg = GetMessageFromPool(PZG_PEER_COMMAND_DATABASE_REPAIR_REPLY);
+   if (replyMsg() == NULL) {MWARN_OUT_OF_MEMORY; return;}
+
+   // Note that a reply without an answer in it tells the junior peer to request a full database resend instead
+   status_t ret = replyMsg()->AddInt32(PZG_PEER_NAME_DATABASE_ID, _whichDatabase);
+   if ((ret.IsOK())&&(_master->IAmTheSeniorPeerForDatabase(_whichDatabase)))
+   {
+      DrainWorkerThread();         // otherwise we'd be examining the database while our worker thread is modifying it
+      CommitPendingGroupUpdate();  // otherwise our answer would reflect grouped updates that (_localDatabaseStateID) doesn't
+      (void) RepublishSeniorDatabaseIfPending();  // ditto for changes we haven't been able to publish yet (if this fails, the junior peer will just repair its database again later)
+
+      const ConstMessageRef repairReplyMsg = _master->SeniorRepairLocalDatabase(_whichDatabase, msg()->GetMessage(PZG_PEER_NAME_USER_MESSAGE));
+      if (repairReplyMsg()) ret = replyMsg()->AddMessage(PZG_PEER_NAME_USER_MESSAGE, CastAwayConstFromRef(repairReplyMsg))
+                                | replyMsg()->AddFlat(PZG_PEER_NAME_DATABASE_STATE_INFO, GetDatabaseStateInfo());
+      else if (repairReplyMsg.GetStatus() != B_UNIMPLEMENTED) LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to answer repair request from junior peer [%s] [%s]\n", _whichDatabase, fromPeerID.ToString()(), repairReplyMsg.GetStatus()());
+   }
+
+   if ((ret.IsError())||(_master->SendUnicastInternalMessageToPeer(fromPeerID, replyMsg).IsError(ret))) LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to send repair reply to junior peer [%s] [%s]\n", _whichDatabase, fromPeerID.ToString()(), ret());
+}
+
+void PZGDatabaseState :: DatabaseRepairReplyReceived(const ZGPeerID & fromPeerID, const ConstMessageRef & msg)
+{
+   if ((fromPeerID != _repairSourcePeerID)||(IsDatabaseRepairInProgress() == false)) return;  // not an answer we're waiting for
+   if (_master->IAmTheSeniorPeerForDatabase(_whichDatabase))
+   {
+      _repairSourcePeerID = ZGPeerID();  // our database is the authoritative one now, so there's nothing left to repair it from
+      return;
+   }
+
+   PZGDatabaseStateInfo seniorDBInfo;
+   const ConstMessageRef repairReplyMsg = msg()->GetMessage(PZG_PEER_NAME_USER_MESSAGE);
+   if ((repairReplyMsg() == NULL)||(msg()->FindFlat(PZG_PEER_NAME_DATABASE_STATE_INFO, seniorDBInfo).IsError())) {DatabaseRepairFailed("senior peer didn't answer our repair request"); return;}
+
+   const uint64 seniorStateID = seniorDBInfo.GetCurrentDatabaseStateID();
+   if (seniorStateID < _localDatabaseStateID) {DatabaseRepairFailed("senior peer's database state is older than ours"); return;}
+
+   status_t ret;
+   MessageRef nextRequestMsg;
+   {
+      NestCountGuard ncg(_mainThreadUpdateContext.GetJuniorUpdateNestCount());  // since applying the senior peer's fixes will modify our local database
+      ret = _master->JuniorRepairLocalDatabase(_whichDatabase, _dbChecksum, repairReplyMsg, nextRequestMsg);
+   }
+
+   if (ret.IsError()) {DatabaseRepairFailed(ret()); return;}
+   if (nextRequestMsg()) ret = SendDatabaseRepairRequest(nextRequestMsg);  // keep narrowing down the parts of the database that differ
+   else if (_dbChecksum == seniorDBInfo.GetDBChecksum())
+   {
+      // Our database now matches the senior peer's database as of its most recent answer, so we're in that state too now
+      LogTime(MUSCLE_LOG_INFO, "Database #" UINT32_FORMAT_SPEC ":  Repaired database now matches the senior peer's state #" UINT64_FORMAT_SPEC " (after " UINT32_FORMAT_SPEC " repair-passes)\n", _whichDatabase, seniorStateID, _repairPassCount+1);
+      _repairSourcePeerID   = ZGPeerID();
+      _localDatabaseStateID = seniorStateID;
+      StopUpdateRecording("the database was repaired in-place");  // since the repair isn't a PZGDatabaseUpdate, the recording can't reproduce it
+      _snapshotPending      = (_persistentLog() != NULL);  // our on-disk update-log no longer leads to our current state, so we'll need a new snapshot
+      if (_snapshotPending) InvalidatePulseTime();
+      _master->ScheduleAppliedStateReport();
+      ScheduleLogContentsRescan();
+      return;
+   }
+   else if (++_repairPassCount < PZG_MAX_DATABASE_REPAIR_PASSES) ret = StartDatabaseRepairPass();  // the senior peer's database changed while we were comparing, so go around again
+   else {DatabaseRepairFailed("database still differs after the maximum number of repair-passes"); return;}
+
+   if (ret.IsError()) DatabaseRepairFailed(ret());
+}
+
+status_t PZGDatabaseState :: JuniorExecuteDatabaseUpdate(const PZGDatabaseUpdate & dbUp)
+{
+   const uint64 newDatabaseStateID = dbUp.GetUpdateID();
+   if ((_localDatabaseStateID+1) != newDatabaseStateID)
+   {
+      // This should be unnecessary since the calling code's logic should have already guaranteed this, but I'm paranoid
+      LogTime(MUSCLE_LOG_ERROR, "Error, junior update #" UINT64_FORMAT_SPEC " isn't the right update to advance current state " UINT64_FORMAT_SPEC " of database #" UINT32_FORMAT_SPEC "\n", newDatabaseStateID, _localDatabaseStateID, _whichDatabase);
+      return B_BAD_OBJECT;
+   }
+
+   const status_t ret = JuniorVerifyAndExecuteDatabaseUpdate(dbUp, _dbChecksum);
+   dbUp.UncachePayloadBufferAsMessage();  // might as well free up the memory, now that we've executed it we won't need the Message again
+   MRETURN_ON_ERROR(ret);
+
+   _localDatabaseStateID = newDatabaseStateID;
+   _master->ScheduleAppliedStateReport();
+   return B_NO_ERROR;  // success!
+}
+
+// Note that this method may be called from within our worker thread, so it shouldn't access any of our main-thread-only state
+status_t PZGDatabaseState :: JuniorVerifyAndExecuteDatabaseUpdate(const PZGDatabaseUpdate & dbUp, uint64 & dbChecksum)
+{
+   const uint64 newDatabaseStateID = dbUp.GetUpdateID();
+   if (dbChecksum != dbUp.GetPreUpdateDBChecksum())
+   {
+      LogTime(MUSCLE_LOG_ERROR, "Error, DB checksum " XINT64_FORMAT_SPEC " of database #" UINT32_FORMAT_SPEC " doesn't match required pre-update DB checksum " XINT64_FORMAT_SPEC " for junior update #" UINT64_FORMAT_SPEC "\n", dbChecksum, _whichDatabase, dbUp.GetPreUpdateDBChecksum(), newDatabaseStateID);
+      PrintLocalDatabaseContents("pre-update");
+      return B_BAD_OBJECT;
+   }
+
+   MRETURN_ON_ERROR(JuniorExecuteDatabaseUpdateAux(dbUp, dbChecksum));
+
+   if (dbChecksum != dbUp.GetPostUpdateDBChecksum())
+   {
+      LogTime(MUSCLE_LOG_ERROR, "Error, DB checksum " XINT64_FORMAT_SPEC " of database #" UINT32_FORMAT_SPEC " doesn't match required post-update DB checksum " XINT64_FORMAT_SPEC " for junior update #" UINT64_FORMAT_SPEC "\n", dbChecksum, _whichDatabase, dbUp.GetPostUpdateDBChecksum(), newDatabaseStateID);
+      PrintLocalDatabaseContents("post-update");
+      if (IsCallerWorkerThread() == false) _printDatabaseStatesComparisonOnNextReplace = true;  // so we can more easily debug what went wrong (JuniorWorkerJobCompleted() sets it for our worker thread)
+      return B_BAD_OBJECT;
+   }
+
+   return B_NO_ERROR;
+}
+
+void PZGDatabaseState :: PrintLocalDatabaseContents(const char * desc) const
+{
+   // Our worker thread mustn't call GetLocalDatabaseContentsAsString(), since the main thread may be reading our database
+   // at the same time; the database-states comparison printed on our next full replace will have to do instead.
+   if (IsCallerWorkerThread()) return;
+
+   const String dbContents = _master->GetLocalDatabaseContentsAsString(_whichDatabase);
+   if (dbContents.HasChars()) printf("Mismatched Local %s state was:\n%s\n", desc, dbContents());
+}
+
+status_t PZGDatabaseState :: JuniorExecuteDatabaseReplace(const PZGDatabaseUpdate & dbUp)
+{
+   DrainWorkerThread();  // the replace must be applied after any updates that are still executing, not concurrently with them
+
+   const bool doPrints = _printDatabaseStatesComparisonOnNextReplace;
+   _printDatabaseStatesComparisonOnNextReplace = false;  // clear this now so that if we return early it will still be cleared
    if (doPrints)
    {
-      LogTime(MUSCLE_LOG_WARNING, "JuniorExecuteDatabaseReplace(#" UINT32_FORMAT_SPEC "):  pre-update local checksum is " UINT32_FORMAT_SPEC " (recalc=" UINT32_FORMAT_SPEC "), dbUp=[%s]\n", _whichDatabase, _dbChecksum, _master->CalculateLocalDatabaseChecksum(_whichDatabase), dbUp.ToString()());
+      LogTime(MUSCLE_LOG_WARNING, "JuniorExecuteDatabaseReplace(#" UINT32_FORMAT_SPEC "):  pre-update local checksum is " XINT64_FORMAT_SPEC " (recalc=" XINT64_FORMAT_SPEC "), dbUp=[%s]\n", _whichDatabase, _dbChecksum, _master->CalculateLocalDatabaseChecksum(_whichDatabase), dbUp.ToString()());
       const String dbStr = _master->GetLocalDatabaseContentsAsString(_whichDatabase);
       if (dbStr.HasChars()) printf("Contents of database #" UINT32_FORMAT_SPEC " before the DB-replace are:\n\n%s\n", _whichDatabase, dbStr());
    }
 
-   MRETURN_ON_ERROR(JuniorExecuteDatabaseUpdateAux(dbUp));
+   const status_t ret = JuniorExecuteDatabaseUpdateAux(dbUp, _dbChecksum);
+   dbUp.UncachePayloadBufferAsMessage();  // might as well free up the memory, now that we've executed it we won't need the Message again
+   MRETURN_ON_ERROR(ret);
 
    if (doPrints)
    {
-      LogTime(MUSCLE_LOG_WARNING, "JuniorExecuteDatabaseReplace(#" UINT32_FORMAT_SPEC "):  post-update local checksum is " UINT32_FORMAT_SPEC " (recalc=" UINT32_FORMAT_SPEC "), dbUp=[%s]\n", _whichDatabase, _dbChecksum, _master->CalculateLocalDatabaseChecksum(_whichDatabase), dbUp.ToString()());
+      LogTime(MUSCLE_LOG_WARNING, "JuniorExecuteDatabaseReplace(#" UINT32_FORMAT_SPEC "):  post-update local checksum is " XINT64_FORMAT_SPEC " (recalc=" XINT64_FORMAT_SPEC "), dbUp=[%s]\n", _whichDatabase, _dbChecksum, _master->CalculateLocalDatabaseChecksum(_whichDatabase), dbUp.ToString()());
       const String dbStr = _master->GetLocalDatabaseContentsAsString(_whichDatabase);
       if (dbStr.HasChars()) printf("Contents of database #" UINT32_FORMAT_SPEC " after the DB-replace are:\n\n%s\n", _whichDatabase, dbStr());
    }
@@ -428,25 +1209,30 @@ status_t PZGDatabaseState :: JuniorExecuteDatabaseReplace(const PZGDatabaseUpdat
    const uint64 newDatabaseStateID = dbUp.GetUpdateID();
    if (_dbChecksum != dbUp.GetPostUpdateDBChecksum())
    {
-      LogTime(MUSCLE_LOG_ERROR, "Error, DB checksum " UINT32_FORMAT_SPEC " of database #" UINT32_FORMAT_SPEC " doesn't match required post-replace DB checksum " UINT32_FORMAT_SPEC " for junior replace #" UINT64_FORMAT_SPEC "\n", _dbChecksum, _whichDatabase, dbUp.GetPostUpdateDBChecksum(), newDatabaseStateID);
+      LogTime(MUSCLE_LOG_ERROR, "Error, DB checksum " XINT64_FORMAT_SPEC " of database #" UINT32_FORMAT_SPEC " doesn't match required post-replace DB checksum " XINT64_FORMAT_SPEC " for junior replace #" UINT64_FORMAT_SPEC "\n", _dbChecksum, _whichDatabase, dbUp.GetPostUpdateDBChecksum(), newDatabaseStateID);
       return B_BAD_OBJECT;
    }
 
    _localDatabaseStateID = newDatabaseStateID;
+   _repairSourcePeerID   = ZGPeerID();  // if we were in the middle of repairing our database, there's no longer any need to
+   RecordDatabaseUpdate(dbUp);
+   _snapshotPending      = (_persistentLog() != NULL);  // our on-disk update-log no longer leads to our current state, so we'll need a new snapshot
+   if (_snapshotPending) InvalidatePulseTime();
+   _master->ScheduleAppliedStateReport();
    LogTime(MUSCLE_LOG_DEBUG, "Junior database #" UINT32_FORMAT_SPEC " is now replaced by the senior database at state #" UINT64_FORMAT_SPEC "\n", _whichDatabase, _localDatabaseStateID);
    return B_NO_ERROR;
 }
 
-status_t PZGDatabaseState :: JuniorExecuteDatabaseUpdateAux(const PZGDatabaseUpdate & dbUp)
+status_t PZGDatabaseState :: JuniorExecuteDatabaseUpdateAux(const PZGDatabaseUpdate & dbUp, uint64 & dbChecksum)
 {
-   _seniorUpdateTimeForJuniorUpdate = dbUp.GetSeniorStartTimeMicros();
+   GetUpdateContextForCallingThread().SetSeniorUpdateTimeForJuniorUpdate(dbUp.GetSeniorStartTimeMicros());
    switch(dbUp.GetUpdateType())
    {
       case PZG_DATABASE_UPDATE_TYPE_NOOP:
          return B_NO_ERROR;  // that was easy!
 
       case PZG_DATABASE_UPDATE_TYPE_RESET:
-         (void) _master->ResetLocalDatabaseToDefault(_whichDatabase, _dbChecksum);
+         (void) _master->ResetLocalDatabaseToDefault(_whichDatabase, dbChecksum);
          return B_NO_ERROR;
 
       case PZG_DATABASE_UPDATE_TYPE_REPLACE:
@@ -458,9 +1244,7 @@ status_t PZGDatabaseState :: JuniorExecuteDatabaseUpdateAux(const PZGDatabaseUpd
             return B_BAD_OBJECT;
          }
 
-         const status_t ret = _master->SetLocalDatabaseFromMessage(_whichDatabase, _dbChecksum, userDBStateMsg);
-         dbUp.UncachePayloadBufferAsMessage();  // might as well free up the memory, now that we've executed it we won't need the Message again
-         return ret;
+         return _master->SetLocalDatabaseFromMessage(_whichDatabase, dbChecksum, userDBStateMsg);
       }
 
       case PZG_DATABASE_UPDATE_TYPE_UPDATE:
@@ -472,8 +1256,24 @@ status_t PZGDatabaseState :: JuniorExecuteDatabaseUpdateAux(const PZGDatabaseUpd
             return B_BAD_OBJECT;
          }
 
-         const status_t ret = _master->JuniorUpdateLocalDatabase(_whichDatabase, _dbChecksum, userDBUpdateMsg);
-         dbUp.UncachePayloadBufferAsMessage();  // might as well free up the memory, now that we've executed it we won't need the Message again
+         return _master->JuniorUpdateLocalDatabase(_whichDatabase, dbChecksum, userDBUpdateMsg);
+      }
+
+      case PZG_DATABASE_UPDATE_TYPE_GROUP_UPDATE:
+      {
+         const ConstMessageRef & groupMsg = dbUp.GetPayloadBufferAsMessage();
+         if (groupMsg() == NULL)
+         {
+            LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseUpdateState:  Error, no group message to update junior database #" UINT32_FORMAT_SPEC "!\n", _whichDatabase);
+            return B_BAD_OBJECT;
+         }
+
+         // Apply the grouped updates in the same order the senior peer executed them
+         status_t ret;
+         MessageRef nextMsg;
+         for (uint32 i=0; groupMsg()->FindMessage(PZG_PEER_NAME_USER_MESSAGE, i, nextMsg).IsOK(); i++)
+            if (_master->JuniorUpdateLocalDatabase(_whichDatabase, dbChecksum, nextMsg).IsError(ret)) break;
+
          return ret;
       }
 
@@ -485,29 +1285,97 @@ status_t PZGDatabaseState :: JuniorExecuteDatabaseUpdateAux(const PZGDatabaseUpd
 
 void PZGDatabaseState :: PrintDatabaseStateInfo() const
 {
-   const uint32 recalculatedChecksum = _master->CalculateLocalDatabaseChecksum(_whichDatabase);
    char buf[128] = "";
-   if (recalculatedChecksum == _dbChecksum) muscleSprintf(buf, "checksum=" UINT32_FORMAT_SPEC, _dbChecksum);
-                                       else muscleSprintf(buf, "[[[ERROR running DB checksum is " UINT32_FORMAT_SPEC ", but recalculated checksum is " UINT32_FORMAT_SPEC "]]]", _dbChecksum, recalculatedChecksum);
+   const uint32 numJobsInFlight = GetNumWorkerJobsInFlight();
+   if (numJobsInFlight > 0) muscleSprintf(buf, "checksum=" XINT64_FORMAT_SPEC " (not verified, " UINT32_FORMAT_SPEC " worker jobs in flight)", _dbChecksum, numJobsInFlight);  // can't safely recalculate while our worker thread is modifying the database
+   else
+   {
+      const uint64 recalculatedChecksum = _master->CalculateLocalDatabaseChecksum(_whichDatabase);
+      if (recalculatedChecksum == _dbChecksum) muscleSprintf(buf, "checksum=" XINT64_FORMAT_SPEC, _dbChecksum);
+                                          else muscleSprintf(buf, "[[[ERROR running DB checksum is " XINT64_FORMAT_SPEC ", but recalculated checksum is " XINT64_FORMAT_SPEC "]]]", _dbChecksum, recalculatedChecksum);
+   }
 
    printf("DB #" UINT32_FORMAT_SPEC ":  UpdateLog has " UINT32_FORMAT_SPEC " items (" UINT64_FORMAT_SPEC "/" UINT64_FORMAT_SPEC " bytes, " UINT64_FORMAT_SPEC " millis), %s, state=" UINT64_FORMAT_SPEC ", FirstUnsentID=" UINT64_FORMAT_SPEC "\n", _whichDatabase, _updateLog.GetNumItems(), _totalPayloadBytesInLog, _maxPayloadBytesInLog, _totalElapsedMillisInLog, buf, _localDatabaseStateID, _firstUnsentUpdateID);
+
+   const uint64 numBackOrders = _backOrderHits+_backOrderMisses;
+   if (numBackOrders > 0) printf("DB #" UINT32_FORMAT_SPEC ":  Served " UINT64_FORMAT_SPEC " of " UINT64_FORMAT_SPEC " back-orders from the update-log (%.1f%% hit rate, " UINT64_FORMAT_SPEC " misses)\n", _whichDatabase, _backOrderHits, numBackOrders, (100.0*_backOrderHits)/numBackOrders, _backOrderMisses);
 }
 
 void PZGDatabaseState :: PrintDatabaseUpdateLog() const
 {
    printf("Update log for database #" UINT32_FORMAT_SPEC " has " UINT32_FORMAT_SPEC " items (" UINT64_FORMAT_SPEC "/" UINT64_FORMAT_SPEC " bytes, " UINT64_FORMAT_SPEC " milliseconds):\n", _whichDatabase, _updateLog.GetNumItems(), _totalPayloadBytesInLog, _maxPayloadBytesInLog, _totalElapsedMillisInLog);
-   for (ConstHashtableIterator<uint64, ConstPZGDatabaseUpdateRef> iter(_updateLog); iter.HasData(); iter++) printf("  %s\n", iter.GetValue()()->ToString()());
+   _updateLog.Print(stdout);
+}
+
+void PZGDatabaseState :: PrintUpdateLatencyStats() const
+{
+   printf("Update latencies for database #" UINT32_FORMAT_SPEC " (as seen by this %s peer):\n", _whichDatabase, _master->IAmTheSeniorPeerForDatabase(_whichDatabase)?"senior":"junior");
+   _latencyStats.Print(stdout);
+}
+
+// Called on the senior peer when it multicasts an update, and on junior peers when they apply one
+void PZGDatabaseState :: RecordSeniorUpdateLatencies(const PZGDatabaseUpdate & dbUp)
+{
+   _latencyStats.RecordInterval(ZG_UPDATE_LATENCY_STAGE_REQUEST_TO_SENIOR,   dbUp.GetRequestTimeMicros(),       dbUp.GetSeniorReceiveTimeMicros());
+   _latencyStats.RecordInterval(ZG_UPDATE_LATENCY_STAGE_SENIOR_QUEUE,        dbUp.GetSeniorReceiveTimeMicros(), dbUp.GetSeniorStartTimeMicros());
+   _latencyStats.RecordInterval(ZG_UPDATE_LATENCY_STAGE_SENIOR_EXECUTE,      dbUp.GetSeniorStartTimeMicros(),   dbUp.GetSeniorFinishTimeMicros());
+   _latencyStats.RecordInterval(ZG_UPDATE_LATENCY_STAGE_SENIOR_TO_MULTICAST, dbUp.GetSeniorFinishTimeMicros(),  dbUp.GetMulticastTimeMicros());
+}
+
+void PZGDatabaseState :: RecordJuniorUpdateLatencies(const PZGDatabaseUpdate & dbUp)
+{
+   const uint64 localReceiveTime = dbUp.GetLocalReceiveTimeMicros();
+   if (localReceiveTime == 0) return;  // e.g. an update replayed from our on-disk log; its timestamps wouldn't tell us anything useful
+
+   const uint64 now = _master->GetNetworkTime64();
+   RecordSeniorUpdateLatencies(dbUp);
+   _latencyStats.RecordInterval(ZG_UPDATE_LATENCY_STAGE_MULTICAST_TO_JUNIOR, dbUp.GetMulticastTimeMicros(), localReceiveTime);
+   _latencyStats.RecordInterval(ZG_UPDATE_LATENCY_STAGE_JUNIOR_APPLY,        localReceiveTime,               now);
+   _latencyStats.RecordInterval(ZG_UPDATE_LATENCY_STAGE_END_TO_END,          dbUp.GetRequestTimeMicros(),    now);
 }
 
 PZGDatabaseStateInfo PZGDatabaseState :: GetDatabaseStateInfo() const
 {
-   return PZGDatabaseStateInfo(_localDatabaseStateID, _updateLog.GetFirstKeyWithDefault((uint64)-1), _dbChecksum);
+   // While a group-commit (or a republish) is pending, our database already contains changes that (_localDatabaseStateID)
+   // doesn't include yet, so we advertise the checksum our database had as of (_localDatabaseStateID) instead
+   const uint64 dbChecksum = IsRepublishPending() ? _republishPreUpdateDBChecksum : (_groupCommitPayload() ? _groupCommitPreUpdateDBChecksum : _dbChecksum);
+   return PZGDatabaseStateInfo(_localDatabaseStateID, _updateLog.GetFirstKeyWithDefault((uint64)-1), dbChecksum);
+}
+
+PZGDatabaseStateInfo PZGDatabaseState :: GetCatchUpOfferInfo() const
+{
+   if (_master->IAmTheSeniorPeerForDatabase(_whichDatabase)) return GetDatabaseStateInfo();
+
+   const uint64 localStateID = _localDatabaseStateID;
+   if ((_restoredStateUnverified)||(_seniorDatabaseStateReceived == false)||(_workerJobFailed)||(IsAwaitingFullDatabaseResendReply())||(IsDatabaseRepairInProgress())||(_updateLog.IsEmpty())) return PZGDatabaseStateInfo(0, (uint64)-1, 0);
+
+   // Our update-log may also hold some not-yet-executed updates past our current state, and (after a full
+   // resend) some holes before it, so we only offer the contiguous run of updates that leads up to our state.
+   return PZGDatabaseStateInfo(localStateID, _updateLog.GetFirstKeyOfRunEndingAt(localStateID), _dbChecksum);
+}
+
+bool PZGDatabaseState :: IsCaughtUpWithSeniorPeer() const
+{
+   if (_master->IAmTheSeniorPeerForDatabase(_whichDatabase)) return true;
+   if ((_restoredStateUnverified)||(_seniorDatabaseStateReceived == false)||(_workerJobFailed)||(IsAwaitingFullDatabaseResendReply())||(IsDatabaseRepairInProgress())) return false;
+   return (_localDatabaseStateID >= _seniorDatabaseStateID);
 }
 
 void PZGDatabaseState :: SeniorDatabaseStateInfoChanged(const PZGDatabaseStateInfo & seniorDBInfo)
 {
    const uint64 seniorState         = seniorDBInfo.GetCurrentDatabaseStateID();
    const uint64 seniorOldestIDInLog = seniorDBInfo.GetOldestDatabaseIDInLog();
+   if (_restoredStateUnverified)
+   {
+      // If the state we loaded from disk can't be part of the senior peer's history, then we can't use it
+      _restoredStateUnverified = false;
+      if ((_master->IAmTheSeniorPeerForDatabase(_whichDatabase) == false)&&((seniorState < _localDatabaseStateID)||((seniorState == _localDatabaseStateID)&&(seniorDBInfo.GetDBChecksum() != _dbChecksum))))
+      {
+         LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  State #" UINT64_FORMAT_SPEC " loaded from disk doesn't match senior peer's state #" UINT64_FORMAT_SPEC ", discarding it.\n", _whichDatabase, _localDatabaseStateID, seniorState);
+         DiscardRestoredState();
+      }
+   }
+
    if ((seniorState != _seniorDatabaseStateID)||(seniorOldestIDInLog != _seniorOldestIDInLog))
    {
       _seniorDatabaseStateReceived = true;
@@ -519,34 +1387,55 @@ void PZGDatabaseState :: SeniorDatabaseStateInfoChanged(const PZGDatabaseStateIn
 
 void PZGDatabaseState :: BackOrderResultReceived(const PZGUpdateBackOrderKey & ubok, const ConstPZGDatabaseUpdateRef & optUpdateData)
 {
-   const ZGPeerID & seniorPeerID = _master->GetSeniorPeerID();
-   if ((_backorders.Remove(ubok).IsOK())&&(ubok.GetTargetPeerID() == seniorPeerID)&&(_master->IAmTheSeniorPeer() == false))
+   const uint64 updateID         = ubok.GetDatabaseUpdateID();
+   const ZGPeerID & sourcePeerID = ubok.GetTargetPeerID();
+   const ZGPeerID * orderedFrom  = _backorders.Get(updateID);
+   if ((orderedFrom == NULL)||(*orderedFrom != sourcePeerID)) return;  // not a result we're waiting for (e.g. we've since re-ordered it from a different peer)
+
+   (void) _backorders.Remove(updateID);
+   if (_master->IAmTheSeniorPeerForDatabase(_whichDatabase)) return;
+
+   const bool fromSeniorPeer = (sourcePeerID == _master->GetSeniorPeerIDForDatabase(_whichDatabase));
+   const char * sourceDesc   = fromSeniorPeer ? "senior" : "junior";
+   if (updateID == DATABASE_UPDATE_ID_FULL_UPDATE)
    {
-      if (ubok.GetDatabaseUpdateID() == DATABASE_UPDATE_ID_FULL_UPDATE)
+      if (optUpdateData())
       {
-         if (optUpdateData())
-         {
-            LogTime(MUSCLE_LOG_DEBUG, "Database #" UINT32_FORMAT_SPEC ":  Received full-database-state from senior peer (%s)\n", _whichDatabase, seniorPeerID.ToString()());
-            NestCountGuard ncg(_inJuniorDatabaseUpdate);
-            if (JuniorExecuteDatabaseReplace(*optUpdateData()).IsOK()) ScheduleLogContentsRescan();
-         }
-         else LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Senior peer (%s) failed to send full-database-state to us!\n", _whichDatabase, seniorPeerID.ToString()());  // now what do we do?
+         LogTime(MUSCLE_LOG_DEBUG, "Database #" UINT32_FORMAT_SPEC ":  Received full-database-state from %s peer (%s)\n", _whichDatabase, sourceDesc, sourcePeerID.ToString()());
+         DrainWorkerThread();  // the replace must be applied after any updates that are still executing, not concurrently with them
+         NestCountGuard ncg(_mainThreadUpdateContext.GetJuniorUpdateNestCount());
+         if (JuniorExecuteDatabaseReplace(*optUpdateData()).IsOK()) ScheduleLogContentsRescan();
       }
+      else if (fromSeniorPeer) LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Senior peer (%s) failed to send full-database-state to us!\n", _whichDatabase, sourcePeerID.ToString()());  // now what do we do?
       else
       {
-         status_t ret;
-         if ((optUpdateData())&&(AddDatabaseUpdateToUpdateLog(optUpdateData).IsOK(ret)))
-         {
-            LogTime(MUSCLE_LOG_DEBUG, "Database #" UINT32_FORMAT_SPEC ":  Back-order of database update #" UINT64_FORMAT_SPEC " received from senior peer (%s)\n", _whichDatabase, ubok.GetDatabaseUpdateID(), seniorPeerID.ToString()());
-            ScheduleLogContentsRescan();
-         }
-         else
-         {
-            LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  Back-order of database update #" UINT64_FORMAT_SPEC " from senior peer (%s) failed [%s], requesting full database to recover.\n", _whichDatabase, ubok.GetDatabaseUpdateID(), seniorPeerID.ToString()(), ret());
+         LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  Junior peer (%s) failed to send full-database-state to us, will ask another peer.\n", _whichDatabase, sourcePeerID.ToString()());
+         _master->CatchUpSourceFailed(sourcePeerID);
+         ScheduleLogContentsRescan();  // the rescan will re-request the full-database-state, from someone else this time
+      }
+   }
+   else
+   {
+      status_t ret;
+      if ((optUpdateData())&&(optUpdateData()->GetLocalReceiveTimeMicros() == 0)) CastAwayConstFromRef(optUpdateData)()->SetLocalReceiveTimeMicros(_master->GetNetworkTime64());
+      if ((optUpdateData())&&(AddDatabaseUpdateToUpdateLog(optUpdateData).IsOK(ret)))
+      {
+         LogTime(MUSCLE_LOG_DEBUG, "Database #" UINT32_FORMAT_SPEC ":  Back-order of database update #" UINT64_FORMAT_SPEC " received from %s peer (%s)\n", _whichDatabase, updateID, sourceDesc, sourcePeerID.ToString()());
+         ScheduleLogContentsRescan();
+      }
+      else if (fromSeniorPeer)
+      {
+         LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  Back-order of database update #" UINT64_FORMAT_SPEC " from senior peer (%s) failed [%s], requesting full database to recover.\n", _whichDatabase, updateID, sourcePeerID.ToString()(), ret());
 
-            ret = RequestFullDatabaseResendFromSeniorPeer(false);
-            if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "Request to senior peer (%s) for full-database-resend failed! [%s]\n", seniorPeerID.ToString()(), ret());
-         }
+         ret = RequestFullDatabaseResend(false);
+         if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "Request for full-database-resend failed! [%s]\n", ret());
+      }
+      else
+      {
+         // The junior peer didn't have it after all; we'll stop asking it for updates until it sends us a new offer
+         LogTime(MUSCLE_LOG_DEBUG, "Database #" UINT32_FORMAT_SPEC ":  Back-order of database update #" UINT64_FORMAT_SPEC " from junior peer (%s) failed [%s], will ask another peer.\n", _whichDatabase, updateID, sourcePeerID.ToString()(), ret());
+         _master->CatchUpSourceFailed(sourcePeerID);
+         ScheduleLogContentsRescan();
       }
    }
 }
@@ -561,45 +1450,584 @@ bool PZGDatabaseState :: IsDatabaseUpdateStillNeededToAdvanceJuniorPeerState(uin
 
 void PZGDatabaseState :: VerifyOrFixLocalDatabaseChecksum()
 {
-   const uint32 recalculatedChecksum = _master->CalculateLocalDatabaseChecksum(_whichDatabase);
+   DrainWorkerThread();  // so that the checksum won't be recalculated while our worker thread is modifying the database
+
+   const uint64 recalculatedChecksum = _master->CalculateLocalDatabaseChecksum(_whichDatabase);
    if (recalculatedChecksum != _dbChecksum)
    {
-      LogTime(MUSCLE_LOG_CRITICALERROR, "VerifyOrFixLocalDatabaseChecksum:  Running database checksum for database #" UINT32_FORMAT_SPEC " was " UINT32_FORMAT_SPEC ", recalculated as " UINT32_FORMAT_SPEC ", correcting (but this shouldn't happen!)\n", _whichDatabase, _dbChecksum, recalculatedChecksum);
+      LogTime(MUSCLE_LOG_CRITICALERROR, "VerifyOrFixLocalDatabaseChecksum:  Running database checksum for database #" UINT32_FORMAT_SPEC " was " XINT64_FORMAT_SPEC ", recalculated as " XINT64_FORMAT_SPEC ", correcting (but this shouldn't happen!)\n", _whichDatabase, _dbChecksum, recalculatedChecksum);
       _dbChecksum = recalculatedChecksum;
    }
 }
 
-ConstPZGDatabaseUpdateRef PZGDatabaseState :: GetDatabaseUpdateByID(uint64 updateID, const INetworkTimeProvider & networkTimeProvider) const
+ConstPZGDatabaseUpdateRef PZGDatabaseState :: GetFullDatabaseUpdate(const INetworkTimeProvider & networkTimeProvider, bool allowSnapshot, bool & retIsSnapshot)
 {
-   if (updateID == DATABASE_UPDATE_ID_FULL_UPDATE)
+   retIsSnapshot = false;
+
+   DrainWorkerThread();         // otherwise the database would be saved while our worker thread is modifying it
+   CommitPendingGroupUpdate();  // otherwise the saved state would include grouped updates that (_localDatabaseStateID) doesn't
+   MRETURN_ON_ERROR(RepublishSeniorDatabaseIfPending());  // ditto for changes we haven't been able to publish yet
+
+   const uint64 startTime = GetRunTime64();
+   ConstMessageRef savedDBMsg;
+   if (allowSnapshot)
+   {
+      savedDBMsg    = _master->SaveLocalDatabaseToSnapshot(_whichDatabase);
+      retIsSnapshot = (savedDBMsg() != NULL);
+   }
+   if (savedDBMsg() == NULL) savedDBMsg = _master->SaveLocalDatabaseToMessage(_whichDatabase);
+
+   if (savedDBMsg())
+   {
+      PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool(PZG_DATABASE_UPDATE_TYPE_REPLACE, (uint16) _whichDatabase, _localDatabaseStateID, _master->GetLocalPeerID(), _dbChecksum);
+      MRETURN_ON_ERROR(dbUp);
+
+      dbUp()->SetSeniorStartTimeMicros(networkTimeProvider.GetNetworkTime64ForRunTime64(startTime));
+      dbUp()->SetSeniorElapsedTimeMicros(GetRunTime64()-startTime);
+      dbUp()->SetPostUpdateDBChecksum(_dbChecksum);
+      dbUp()->SetPayloadMessage(savedDBMsg, _payloadCompressionLevel);
+      return AddConstToRef(dbUp);
+   }
+   else
+   {
+      LogTime(MUSCLE_LOG_ERROR, "Unable to save state #" UINT64_FORMAT_SPEC " of local database #" UINT32_FORMAT_SPEC " to a Message to satisfy external request! [%s]\n", _localDatabaseStateID, _whichDatabase, savedDBMsg.GetStatus()());
+      retIsSnapshot = false;
+      return savedDBMsg.GetStatus();
+   }
+}
+
+ConstMessageRef PZGDatabaseState :: GetDatabaseUpdatePayloadByID(uint64 updateID) const
+{
+   const ConstPZGDatabaseUpdateRef * dbur = _updateLog.Get(updateID);
+   return dbur ? dbur->GetItemPointer()->GetPayloadBufferAsMessage() : ConstMessageRef();
+}
+
+void PZGDatabaseState :: ShutdownSnapshotWriterSession()
+{
+   if (_snapshotWriterSession())
+   {
+      _snapshotWriterSession()->EndSession();  // blocks until the writer thread has exited
+      _snapshotWriterSession.Reset();
+
+      // The result of the in-flight snapshot (if any) won't reach us now, so we merge its previous-log file back in, just in case
+      if ((_snapshotWriteInFlight)&&(_persistentLog())) _persistentLog()->EndSnapshot(false);
+      _snapshotWriteInFlight = false;
+   }
+}
+
+void PZGDatabaseState :: ShutdownWorkerSession()
+{
+   if (_workerSession())
+   {
+      _workerSession()->EndSession();  // blocks until the worker thread has exited
+      _workerSession.Reset();
+      _numSeniorWorkerJobsInFlight = _numJuniorWorkerJobsInFlight = 0;
+      _workerJobFailed = false;
+   }
+}
+
+status_t PZGDatabaseState :: SendJobToWorkerThread(uint32 whatCode, const ZGPeerID & fromPeerID, const ConstMessageRef & optUserMsg, const ConstPZGDatabaseUpdateRef & optDBUp, uint64 requestTime, uint64 receiveTime, const PZGUpdateAckRequest & ackReq)
+{
+   MessageRef jobMsg = GetMessageFromPool(whatCode);
+   MRETURN_OOM_ON_NULL(jobMsg());
+   MRETURN_ON_ERROR(jobMsg()->AddFlat(PZG_PEER_NAME_PEER_ID, fromPeerID));
+   MRETURN_ON_ERROR(jobMsg()->CAddMessage(PZG_PEER_NAME_USER_MESSAGE, CastAwayConstFromRef(optUserMsg)));
+   MRETURN_ON_ERROR(jobMsg()->CAddInt64(PZG_WORKER_NAME_REQUEST_TIME, requestTime));
+   MRETURN_ON_ERROR(jobMsg()->CAddInt64(PZG_WORKER_NAME_RECEIVE_TIME, receiveTime));
+   MRETURN_ON_ERROR(ackReq.SaveToMessage(*jobMsg()));
+   if (optDBUp())
+   {
+      MRETURN_ON_ERROR(jobMsg()->AddFlat(PZG_PEER_NAME_DATABASE_UPDATE, CastAwayConstFromRef(optDBUp)));
+      (void) optDBUp()->GetPayloadBufferAsMessage();  // cache the payload Message here, so that the worker thread will only need to read it
+   }
+
+   // Every job must get a reply (or DrainWorkerThread() would wait forever), so we allocate the reply to a job whose
+   // results couldn't be recorded here, where we can still fail to send the job, rather than in the worker thread
+   MessageRef failureReplyMsg = GetMessageFromPool(whatCode);
+   MRETURN_OOM_ON_NULL(failureReplyMsg());
+   MRETURN_ON_ERROR(failureReplyMsg()->AddFlat(PZG_PEER_NAME_PEER_ID, fromPeerID));
+   MRETURN_ON_ERROR(failureReplyMsg()->AddString(PZG_WORKER_NAME_ERROR, "Unable to record job results"));
+   MRETURN_ON_ERROR(ackReq.SaveToMessage(*failureReplyMsg()));
+   if (optDBUp()) MRETURN_ON_ERROR(failureReplyMsg()->AddFlat(PZG_PEER_NAME_DATABASE_UPDATE, CastAwayConstFromRef(optDBUp)));
+   MRETURN_ON_ERROR(jobMsg()->AddMessage(PZG_WORKER_NAME_FAILURE_REPLY, failureReplyMsg));
+
+   // When our worker thread is idle, its view of our checksum must be re-synchronized with ours, since
+   // the main thread may have modified the database (e.g. via a reset or replace) in the meantime.
+   // This is safe because the worker thread doesn't touch (_workerDBChecksum) while it's waiting for a job.
+   if (GetNumWorkerJobsInFlight() == 0) _workerDBChecksum = _dbChecksum;
+
+   MRETURN_ON_ERROR(_workerSession()->SendJobToWorkerThread(jobMsg));
+   if (whatCode == PZG_DATABASE_WORKER_JOB_SENIOR_UPDATE) _numSeniorWorkerJobsInFlight++;
+                                                     else _numJuniorWorkerJobsInFlight++;
+   return B_NO_ERROR;
+}
+
+// Note:  This method is called from within our worker thread!
+MessageRef PZGDatabaseState :: WorkerThreadExecuteJob(const MessageRef & jobMsg)
+{
+   const uint64 preUpdateDBChecksum = _workerDBChecksum;
+   const uint64 startTime = GetRunTime64();
+
+   status_t ret;
+   switch(jobMsg()->what)
+   {
+      case PZG_DATABASE_WORKER_JOB_SENIOR_UPDATE:
+      {
+         ConstMessageRef juniorMsg;
+         {
+            NestCountGuard ncg(_workerThreadUpdateContext.GetSeniorUpdateNestCount());
+            juniorMsg = _master->SeniorUpdateLocalDatabase(_whichDatabase, _workerDBChecksum, jobMsg()->GetMessage(PZG_PEER_NAME_USER_MESSAGE));
+         }
+
+         // Replace the user's senior-update Message with the junior-update Message it generated
+         (void) jobMsg()->RemoveName(PZG_PEER_NAME_USER_MESSAGE);
+         if (juniorMsg() == NULL) ret = B_LOGIC_ERROR;
+                             else ret = jobMsg()->AddMessage(PZG_PEER_NAME_USER_MESSAGE, CastAwayConstFromRef(juniorMsg));
+      }
+      break;
+
+      case PZG_DATABASE_WORKER_JOB_JUNIOR_UPDATE:
+      {
+         PZGDatabaseUpdateRef dbUp;
+         if (jobMsg()->FindFlat(PZG_PEER_NAME_DATABASE_UPDATE, dbUp).IsOK(ret))
+         {
+            NestCountGuard ncg(_workerThreadUpdateContext.GetJuniorUpdateNestCount());
+            ret = JuniorVerifyAndExecuteDatabaseUpdate(*dbUp(), _workerDBChecksum);
+         }
+      }
+      break;
+
+      default:
+         ret = B_UNIMPLEMENTED;
+      break;
+   }
+
+   // We return the job Message itself, with the results added to it
+   if ((jobMsg()->AddInt64(PZG_WORKER_NAME_PRE_UPDATE_CHECKSUM,  preUpdateDBChecksum).IsError())
+     ||(jobMsg()->AddInt64(PZG_WORKER_NAME_POST_UPDATE_CHECKSUM, _workerDBChecksum).IsError())
+     ||(jobMsg()->AddInt64(PZG_WORKER_NAME_START_TIME,           startTime).IsError())
+     ||(jobMsg()->AddInt64(PZG_WORKER_NAME_ELAPSED_MICROS,       GetRunTime64()-startTime).IsError())
+     ||((ret.IsError())&&(jobMsg()->AddString(PZG_WORKER_NAME_ERROR, ret()).IsError())))
+   {
+      // Our owner is still waiting for a reply to this job, so we'll send back the one that was allocated for this case
+      MessageRef failureReplyMsg = jobMsg()->GetMessage(PZG_WORKER_NAME_FAILURE_REPLY);
+      if (failureReplyMsg()) return failureReplyMsg;
+   }
+
+   return jobMsg;
+}
+
+// Returns NULL if the job whose results are in (resultMsg) succeeded, or a description of why it didn't
+static const char * GetWorkerJobError(const Message & resultMsg)
+{
+   const char * errStr;
+   if (resultMsg.FindString(PZG_WORKER_NAME_ERROR, &errStr).IsOK()) return errStr;
+   return resultMsg.HasName(PZG_WORKER_NAME_POST_UPDATE_CHECKSUM) ? NULL : "job results are missing";
+}
+
+void PZGDatabaseState :: WorkerThreadMessageReceived(const MessageRef & msg)
+{
+   switch(msg()->what)
+   {
+      case PZG_DATABASE_WORKER_JOB_SENIOR_UPDATE: SeniorWorkerJobCompleted(msg); WorkerJobFinished(); ProcessDeferredUpdateRequests(); break;  // our senior state has changed, so the deferral decision may have too
+      case PZG_DATABASE_WORKER_JOB_JUNIOR_UPDATE: JuniorWorkerJobCompleted(msg); WorkerJobFinished(); break;
+      default:                                    _master->DatabaseWorkerCallReceived(msg);            break;
+   }
+}
+
+void PZGDatabaseState :: WorkerJobFinished()
+{
+   if (GetNumWorkerJobsInFlight() > 0) return;
+
+   // Now that our worker thread is idle, we can do the things we were waiting for it to finish before doing
+   if ((_snapshotPending)||(IsRepublishPending())) InvalidatePulseTime();
+   if (_deferredUpdateRequests.HasItems()) ProcessDeferredUpdateRequests();
+}
+
+void PZGDatabaseState :: SeniorWorkerJobCompleted(const MessageRef & resultMsg)
+{
+   if (_numSeniorWorkerJobsInFlight > 0) _numSeniorWorkerJobsInFlight--;
+
+   const bool checksumKnown = resultMsg()->HasName(PZG_WORKER_NAME_POST_UPDATE_CHECKSUM);
+   if (checksumKnown) _dbChecksum = (uint64) resultMsg()->GetInt64(PZG_WORKER_NAME_POST_UPDATE_CHECKSUM);  // the worker thread's view of our checksum is authoritative
+
+   ZGPeerID fromPeerID; (void) resultMsg()->FindFlat(PZG_PEER_NAME_PEER_ID, fromPeerID);
+   const PZGUpdateAckRequest ackReq(fromPeerID, *resultMsg());
+
+   const char * errStr = GetWorkerJobError(*resultMsg());
+   if (errStr)
    {
-      // For this special value we'll save our full current database state and return that
-      const uint64 startTime = GetRunTime64();
-      MessageRef savedDBMsg = _master->SaveLocalDatabaseToMessage(_whichDatabase);
-      if (savedDBMsg())
+      LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseUpdateState:  Error setting senior database #" UINT32_FORMAT_SPEC " to state! [%s]\n", _whichDatabase, errStr);
+      if (ackReq.IsValid()) SendUpdateAck(ackReq, 0, 0);
+      if (checksumKnown == false)
       {
-         PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool(PZG_DATABASE_UPDATE_TYPE_REPLACE, (uint16) _whichDatabase, _localDatabaseStateID, _master->GetLocalPeerID(), _dbChecksum);
-         MRETURN_ON_ERROR(dbUp);
-
-         dbUp()->SetSeniorStartTimeMicros(networkTimeProvider.GetNetworkTime64ForRunTime64(startTime));
-         dbUp()->SetSeniorElapsedTimeMicros(GetRunTime64()-startTime);
-         dbUp()->SetPostUpdateDBChecksum(_dbChecksum);
-         dbUp()->SetPayloadMessage(savedDBMsg);
-         return AddConstToRef(dbUp);
+         // We don't know whether the job changed our database or not, so we'll have to get it back in step with the junior peers' databases
+         if (_master->IAmTheSeniorPeerForDatabase(_whichDatabase)) ScheduleSeniorDatabaseRepublish(_dbChecksum, 1);
+                                                              else DiscardUnpublishedSeniorUpdates(1);
       }
+      return;
+   }
+
+   if (_master->IAmTheSeniorPeerForDatabase(_whichDatabase) == false)
+   {
+      DiscardUnpublishedSeniorUpdates(1);
+      return;
+   }
+
+   const ConstMessageRef juniorMsg     = resultMsg()->GetMessage(PZG_PEER_NAME_USER_MESSAGE);
+   const uint64 preUpdateDBChecksum    = (uint64) resultMsg()->GetInt64(PZG_WORKER_NAME_PRE_UPDATE_CHECKSUM);
+   const uint64 startTime              = (uint64) resultMsg()->GetInt64(PZG_WORKER_NAME_START_TIME);
+   const uint64 elapsedMicros          = (uint64) resultMsg()->GetInt64(PZG_WORKER_NAME_ELAPSED_MICROS);
+   const uint64 requestTime            = (uint64) resultMsg()->GetInt64(PZG_WORKER_NAME_REQUEST_TIME);
+   const uint64 receiveTime            = (uint64) resultMsg()->GetInt64(PZG_WORKER_NAME_RECEIVE_TIME);
+
+   if (IsRepublishPending())
+   {
+      // This update's changes are already in our database, so they'll be published along with the rest of it
+      ScheduleSeniorDatabaseRepublish(preUpdateDBChecksum, 1);
+      AddRepublishAckRequest(ackReq);
+      return;
+   }
+
+   if (IsGroupCommitEnabled())
+   {
+      AddUpdateToGroupCommit(fromPeerID, juniorMsg, requestTime, receiveTime, ackReq, preUpdateDBChecksum, startTime, elapsedMicros);
+      return;
+   }
+
+   PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool(PZG_DATABASE_UPDATE_TYPE_UPDATE, (uint16) _whichDatabase, _localDatabaseStateID+1, fromPeerID, preUpdateDBChecksum);
+   status_t ret = dbUp() ? AddDatabaseUpdateToUpdateLog(dbUp) : B_OUT_OF_MEMORY;
+   if (ret.IsOK())
+   {
+      SeniorUpdateCompleted(dbUp, requestTime, receiveTime, startTime, elapsedMicros, juniorMsg, *_master);
+      RegisterUpdateAck(ackReq, dbUp()->GetUpdateID());
+   }
+   else
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseUpdateState:  Unable to add executed update to the update-log of senior database #" UINT32_FORMAT_SPEC "! [%s]\n", _whichDatabase, ret());
+      ScheduleSeniorDatabaseRepublish(preUpdateDBChecksum, 1);  // since the update's changes are already in our database
+      AddRepublishAckRequest(ackReq);
+   }
+}
+
+void PZGDatabaseState :: JuniorWorkerJobCompleted(const MessageRef & resultMsg)
+{
+   if (_numJuniorWorkerJobsInFlight > 0) _numJuniorWorkerJobsInFlight--;
+
+   _dbChecksum = (uint64) resultMsg()->GetInt64(PZG_WORKER_NAME_POST_UPDATE_CHECKSUM, (int64) _dbChecksum);  // the worker thread's view of our checksum is authoritative (if it could tell us)
+
+   PZGDatabaseUpdateRef dbUp;
+   if (resultMsg()->FindFlat(PZG_PEER_NAME_DATABASE_UPDATE, dbUp).IsOK())
+   {
+      dbUp()->UncachePayloadBufferAsMessage();  // might as well free up the memory, now that we've executed it we won't need the Message again
+
+      if (_workerJobFailed == false)
+      {
+         const char * errStr = GetWorkerJobError(*resultMsg());
+         if (errStr)
+         {
+            // Any jobs still in flight were based on this one, so we'll ignore their results and repair our database instead
+            _workerJobFailed = true;
+            _printDatabaseStatesComparisonOnNextReplace = true;  // our worker thread couldn't print our database's contents, so we'll do it then
+            LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC " was unable to execute junior update #" UINT64_FORMAT_SPEC " (%s), will try to recover by repairing our database.\n", _whichDatabase, dbUp()->GetUpdateID(), errStr);
+
+            status_t ret;
+            if (RequestDatabaseRepair().IsError(ret)) LogTime(MUSCLE_LOG_ERROR, "Request for database repair failed! [%s]\n", ret());
+         }
+         else
+         {
+            _localDatabaseStateID = dbUp()->GetUpdateID();
+            _master->ScheduleAppliedStateReport();
+            PersistDatabaseUpdate(*dbUp());
+            RecordJuniorUpdateLatencies(*dbUp());
+            LogTime(MUSCLE_LOG_DEBUG, "Database #" UINT32_FORMAT_SPEC " successfully executed junior update to state #" UINT64_FORMAT_SPEC "\n", _whichDatabase, _localDatabaseStateID);
+         }
+      }
+   }
+
+   if (_numJuniorWorkerJobsInFlight == 0)
+   {
+      _workerJobFailed = false;
+      ScheduleLogContentsRescan();  // in case there is more work for us to do now
+   }
+}
+
+void PZGDatabaseState :: DrainWorkerThread()
+{
+   while((_workerSession())&&(GetNumWorkerJobsInFlight() > 0))
+   {
+      const status_t ret = _workerSession()->WaitForNextMessageFromWorkerThread();
+      if (ret.IsError())
+      {
+         LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Error waiting for worker thread to complete its jobs! [%s]\n", _whichDatabase, ret());
+         _numSeniorWorkerJobsInFlight = _numJuniorWorkerJobsInFlight = 0;
+         _workerJobFailed = false;
+         break;
+      }
+   }
+}
+
+void PZGDatabaseState :: LoadPersistentState()
+{
+   if (_persistentLog() == NULL) return;
+
+   uint64 snapshotStateID = 0;
+   uint64 snapshotDBChecksum = 0;
+   MessageRef snapshotMsg;
+   status_t ret;
+   if (_persistentLog()->LoadSnapshot(snapshotStateID, snapshotDBChecksum, snapshotMsg).IsOK(ret))
+   {
+      {
+         NestCountGuard ncg(_mainThreadUpdateContext.GetJuniorUpdateNestCount());
+         ret = _master->SetLocalDatabaseFromMessage(_whichDatabase, _dbChecksum, snapshotMsg);
+      }
+      if ((ret.IsOK())&&(_dbChecksum == snapshotDBChecksum)) _localDatabaseStateID = snapshotStateID;
       else
       {
-         LogTime(MUSCLE_LOG_ERROR, "Unable to save state #" UINT64_FORMAT_SPEC " of local database #" UINT32_FORMAT_SPEC " to a Message to satisfy external request! [%s]\n", _localDatabaseStateID, _whichDatabase, savedDBMsg.GetStatus()());
-         return savedDBMsg.GetStatus();
+         LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to restore snapshot state #" UINT64_FORMAT_SPEC " from disk (checksum " XINT64_FORMAT_SPEC ", expected " XINT64_FORMAT_SPEC ") [%s]\n", _whichDatabase, snapshotStateID, _dbChecksum, snapshotDBChecksum, ret());
+         ResetLocalDatabaseToDefaultState();
+         _localDatabaseStateID = 0;
+      }
+   }
+   else if (ret != B_FILE_NOT_FOUND) LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to load snapshot from disk, starting from the default state. [%s]\n", _whichDatabase, ret());
+
+   // Replay whatever updates were logged after the snapshot was written
+   Queue<PZGDatabaseUpdateRef> loggedUpdates;
+   bool logIsClean = true;
+   if (_persistentLog()->LoadLogRecords(_localDatabaseStateID, loggedUpdates, logIsClean).IsError(ret)) LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Error reading update-log from disk [%s]\n", _whichDatabase, ret());
+   if (logIsClean == false) LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  On-disk update-log ended with an incomplete record; any updates after it will be fetched from the senior peer.\n", _whichDatabase);
+
+   uint32 numReplayed = 0;
+   for (uint32 i=0; i<loggedUpdates.GetNumItems(); i++)
+   {
+      const PZGDatabaseUpdateRef & dbUp = loggedUpdates[i];
+      if (dbUp()->GetUpdateID() != _localDatabaseStateID+1) break;  // gap in the log (e.g. due to a full-database replace that wasn't snapshotted yet)
+
+      {
+         NestCountGuard ncg(_mainThreadUpdateContext.GetJuniorUpdateNestCount());
+         ret = JuniorExecuteDatabaseUpdate(*dbUp());
       }
+      if (ret.IsError())
+      {
+         // The update may have been partially applied, so our database's contents can't be trusted anymore
+         LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to replay logged update #" UINT64_FORMAT_SPEC " from disk, starting from the default state. [%s]\n", _whichDatabase, dbUp()->GetUpdateID(), ret());
+         ClearUpdateLog();
+         ResetLocalDatabaseToDefaultState();
+         _localDatabaseStateID = 0;
+         numReplayed = 0;
+         logIsClean  = false;  // so that we'll write a fresh snapshot below
+         break;
+      }
+
+      (void) AddDatabaseUpdateToUpdateLog(dbUp);  // so we can serve back-orders of it, should we become the senior peer
+      numReplayed++;
    }
-   else return _updateLog[updateID];
+
+   _firstUnsentUpdateID     = _localDatabaseStateID+1;
+   _restoredStateUnverified = (_localDatabaseStateID > 0);
+   if (_restoredStateUnverified) LogTime(MUSCLE_LOG_INFO, "Database #" UINT32_FORMAT_SPEC ":  Restored state #" UINT64_FORMAT_SPEC " from disk (" UINT32_FORMAT_SPEC " updates replayed from the update-log)\n", _whichDatabase, _localDatabaseStateID, numReplayed);
+
+   // If we replayed anything (or the log was damaged), we'll start over with a fresh snapshot, so the log doesn't need to be replayed again next time
+   if ((numReplayed > 0)||(logIsClean == false)||(loggedUpdates.GetNumItems() > numReplayed)) WritePersistentSnapshot();
+   else if (_persistentLog()->OpenLogFile().IsError(ret)) LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to open on-disk update-log, updates will not be persisted! [%s]\n", _whichDatabase, ret());
 }
 
-ConstMessageRef PZGDatabaseState :: GetDatabaseUpdatePayloadByID(uint64 updateID) const
+void PZGDatabaseState :: PersistDatabaseUpdate(const PZGDatabaseUpdate & dbUp)
 {
-   const ConstPZGDatabaseUpdateRef * dbur = _updateLog.Get(updateID);
-   return dbur ? dbur->GetItemPointer()->GetPayloadBufferAsMessage() : ConstMessageRef();
+   RecordDatabaseUpdate(dbUp);
+   if (_persistentLog() == NULL) return;
+
+   _restoredStateUnverified = false;  // we've moved on from the restored state, so there's no point checking it anymore
+
+   const status_t ret = _persistentLog()->AppendUpdate(dbUp);
+   if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to append update #" UINT64_FORMAT_SPEC " to the on-disk update-log! [%s]\n", _whichDatabase, dbUp.GetUpdateID(), ret());
+
+   if ((_snapshotPending == false)&&((ret.IsError())||(_persistentLog()->GetNumUpdatesSinceSnapshot() >= _updatesPerSnapshot)))
+   {
+      _snapshotPending = true;  // we'll write the snapshot from Pulse(), so that we don't do it in the middle of an update
+      InvalidatePulseTime();
+   }
+}
+
+void PZGDatabaseState :: WritePersistentSnapshot()
+{
+   _snapshotPending = false;
+   if (_persistentLog() == NULL) return;
+   if ((_master->IAmTheSeniorPeerForDatabase(_whichDatabase) == false)&&(IsAwaitingFullDatabaseResendReply())) return;  // our database is known to be bad; we'll snapshot it after it's been replaced
+
+   DrainWorkerThread();         // so that the saved state won't be modified while we're saving it
+   CommitPendingGroupUpdate();  // so that the saved state won't include grouped updates that (_localDatabaseStateID) doesn't
+
+   status_t ret;
+   if (RepublishSeniorDatabaseIfPending().IsError(ret)) return;  // ditto for changes we haven't been able to publish yet (the error has been logged)
+
+   MessageRef savedDBMsg = _master->SaveLocalDatabaseToMessage(_whichDatabase);
+   ConstByteBufferRef flatDBState = savedDBMsg() ? savedDBMsg()->FlattenToByteBuffer() : ConstByteBufferRef(savedDBMsg.GetStatus());
+   if ((flatDBState())&&(_persistentLog()->BeginSnapshot().IsOK(ret)))
+   {
+      // The compressing and the syncing-to-disk are the expensive parts, so we let our helper thread do them if we can
+      if ((_snapshotWriterSession())&&(_snapshotWriterSession()->WriteSnapshot(_persistentLog()->GetSnapshotFilePath(), _localDatabaseStateID, _dbChecksum, flatDBState).IsOK()))
+      {
+         _snapshotWriteInFlight = true;
+         return;
+      }
+
+      ret = PZGPersistentUpdateLog::WriteSnapshotFile(_persistentLog()->GetSnapshotFilePath(), _localDatabaseStateID, _dbChecksum, flatDBState);
+      _snapshotWriteInFlight = true;  // so that PersistentSnapshotWritten() will accept the result
+      PersistentSnapshotWritten(_localDatabaseStateID, ret);
+   }
+   else LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to write snapshot of state #" UINT64_FORMAT_SPEC " to disk! [%s]\n", _whichDatabase, _localDatabaseStateID, (flatDBState.GetStatus()|ret)());
+}
+
+void PZGDatabaseState :: PersistentSnapshotWritten(uint64 stateID, status_t result)
+{
+   if ((_snapshotWriteInFlight == false)||(_persistentLog() == NULL)) return;  // paranoia
+
+   _snapshotWriteInFlight = false;
+   _persistentLog()->EndSnapshot(result.IsOK());
+   if (result.IsOK()) LogTime(MUSCLE_LOG_DEBUG, "Database #" UINT32_FORMAT_SPEC ":  Wrote snapshot of state #" UINT64_FORMAT_SPEC " to disk.\n", _whichDatabase, stateID);
+                 else LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to write snapshot of state #" UINT64_FORMAT_SPEC " to disk! [%s]\n", _whichDatabase, stateID, result());
+
+   if (_snapshotPending) InvalidatePulseTime();  // another snapshot became due while this one was being written
+}
+
+void PZGDatabaseState :: DiscardRestoredState()
+{
+   ClearUpdateLog();  // the updates we replayed from disk aren't part of the senior peer's history either
+   ResetLocalDatabaseToDefaultState();
+   _localDatabaseStateID = 0;
+   _firstUnsentUpdateID  = 1;
+   StopUpdateRecording("the state restored from disk was discarded");
+   if (_persistentLog())
+   {
+      _snapshotPending = true;  // so that the discarded state won't be loaded from disk again next time
+      InvalidatePulseTime();
+   }
+}
+
+void PZGDatabaseState :: SetUpdateRecordingDirectory(const String & dirPath)
+{
+   _recordingLog.Reset();
+   if (dirPath.HasChars()) _recordingLog.SetRef(new PZGPersistentUpdateLog(dirPath, _whichDatabase));
+}
+
+void PZGDatabaseState :: StartUpdateRecording()
+{
+   if (_recordingLog() == NULL) return;
+
+   // The recording starts with a snapshot of our current state, so that the recorded updates can be replayed on top of it
+   MessageRef savedDBMsg = _master->SaveLocalDatabaseToMessage(_whichDatabase);
+   status_t ret = savedDBMsg() ? _recordingLog()->WriteSnapshot(_localDatabaseStateID, _dbChecksum, savedDBMsg) : savedDBMsg.GetStatus();
+   if (ret.IsOK()) LogTime(MUSCLE_LOG_INFO, "Database #" UINT32_FORMAT_SPEC ":  Recording applied updates to disk, starting from state #" UINT64_FORMAT_SPEC "\n", _whichDatabase, _localDatabaseStateID);
+   else
+   {
+      LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to write the starting snapshot of the update-recording, updates will not be recorded! [%s]\n", _whichDatabase, ret());
+      _recordingLog.Reset();
+   }
+}
+
+void PZGDatabaseState :: RecordDatabaseUpdate(const PZGDatabaseUpdate & dbUp)
+{
+   status_t ret;
+   if ((_recordingLog())&&(_recordingLog()->AppendUpdate(dbUp).IsError(ret))) StopUpdateRecording(ret());
+}
+
+void PZGDatabaseState :: StopUpdateRecording(const char * why)
+{
+   if (_recordingLog() == NULL) return;
+
+   LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  Update-recording stopped at state #" UINT64_FORMAT_SPEC ", because %s.\n", _whichDatabase, _localDatabaseStateID, why);
+   _recordingLog()->Close();
+   _recordingLog.Reset();
+}
+
+status_t PZGDatabaseState :: ReplayUpdateRecording(const String & dirPath, uint32 verifyInterval, ZGUpdateReplayStats & retStats)
+{
+   const PZGPersistentUpdateLog recording(dirPath, _whichDatabase);
+
+   uint64 snapshotStateID    = 0;
+   uint64 snapshotDBChecksum = 0;
+   MessageRef snapshotMsg;
+   MRETURN_ON_ERROR(recording.LoadSnapshot(snapshotStateID, snapshotDBChecksum, snapshotMsg));
+
+   Queue<PZGDatabaseUpdateRef> recordedUpdates;
+   bool recordingIsClean = true;
+   MRETURN_ON_ERROR(recording.LoadLogRecords(snapshotStateID, recordedUpdates, recordingIsClean));
+   if (recordingIsClean == false) LogTime(MUSCLE_LOG_WARNING, "Database #" UINT32_FORMAT_SPEC ":  Update-recording ended with an incomplete record; only the updates before it will be replayed.\n", _whichDatabase);
+
+   DrainWorkerThread();
+   ClearUpdateLog();
+
+   status_t ret;
+   {
+      NestCountGuard ncg(_mainThreadUpdateContext.GetJuniorUpdateNestCount());
+      ret = _master->SetLocalDatabaseFromMessage(_whichDatabase, _dbChecksum, snapshotMsg);
+   }
+   if ((ret.IsOK())&&(_dbChecksum != snapshotDBChecksum)) ret = B_BAD_DATA;
+   if (ret.IsError())
+   {
+      LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to restore the update-recording's starting snapshot (state #" UINT64_FORMAT_SPEC ") [%s]\n", _whichDatabase, snapshotStateID, ret());
+      ResetLocalDatabaseToDefaultState();
+      _localDatabaseStateID = 0;
+      return ret;
+   }
+   _localDatabaseStateID = snapshotStateID;
+
+   for (uint32 i=0; i<recordedUpdates.GetNumItems(); i++)
+   {
+      const PZGDatabaseUpdate & dbUp = *recordedUpdates[i]();
+
+      // Every update received over the network has its record-checksum verified, so we'll time that too
+      const uint64 checksumStartTime = GetRunTime64();
+      (void) dbUp.CalculateChecksum();
+      const uint64 applyStartTime = GetRunTime64();
+      {
+         NestCountGuard ncg(_mainThreadUpdateContext.GetJuniorUpdateNestCount());
+         if (dbUp.GetUpdateID() == _localDatabaseStateID+1) ret = JuniorExecuteDatabaseUpdate(dbUp);
+         else if (dbUp.GetUpdateType() == PZG_DATABASE_UPDATE_TYPE_REPLACE) ret = JuniorExecuteDatabaseReplace(dbUp);  // full-database resends can skip ahead
+         else ret = B_BAD_DATA;  // gap in the recording
+      }
+      const uint64 applyEndTime = GetRunTime64();
+      if (ret.IsError())
+      {
+         LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Unable to replay recorded update #" UINT64_FORMAT_SPEC " on top of state #" UINT64_FORMAT_SPEC " [%s]\n", _whichDatabase, dbUp.GetUpdateID(), _localDatabaseStateID, ret());
+         return ret;
+      }
+
+      retStats.RecordUpdateChecksumTime(applyStartTime-checksumStartTime);
+      retStats.RecordUpdate(dbUp.GetUpdateTypeName(), dbUp.FlattenedSize(), applyEndTime-applyStartTime);
+      if ((verifyInterval > 0)&&(((i+1)%verifyInterval) == 0)) MRETURN_ON_ERROR(VerifyReplayedDatabaseChecksum(retStats));
+   }
+
+   _firstUnsentUpdateID = _localDatabaseStateID+1;
+   return VerifyReplayedDatabaseChecksum(retStats);
+}
+
+status_t PZGDatabaseState :: VerifyReplayedDatabaseChecksum(ZGUpdateReplayStats & retStats)
+{
+   const uint64 startTime = GetRunTime64();
+   const uint64 calculatedChecksum = _master->CalculateLocalDatabaseChecksum(_whichDatabase);
+   retStats.RecordDatabaseChecksumTime(GetRunTime64()-startTime);
+
+   if (calculatedChecksum != _dbChecksum)
+   {
+      LogTime(MUSCLE_LOG_ERROR, "Database #" UINT32_FORMAT_SPEC ":  Recalculated checksum " XINT64_FORMAT_SPEC " doesn't match running checksum " XINT64_FORMAT_SPEC " at replayed state #" UINT64_FORMAT_SPEC "\n", _whichDatabase, calculatedChecksum, _dbChecksum, _localDatabaseStateID);
+      return B_BAD_DATA;
+   }
+   return B_NO_ERROR;
+}
+
+// Note:  This method is called from within our worker thread!
+status_t PZGDatabaseState :: ForwardCallToMainThread(uint32 callCode, const ConstMessageRef & internalMsg, const ZGPeerID & optPeerID, bool sendToSelf)
+{
+   if (internalMsg() == NULL) return B_BAD_ARGUMENT;
+
+   MessageRef callMsg = GetMessageFromPool(callCode);
+   MRETURN_OOM_ON_NULL(callMsg());
+   MRETURN_ON_ERROR(callMsg()->AddMessage(PZG_PEER_NAME_USER_MESSAGE, CastAwayConstFromRef(internalMsg)));
+   MRETURN_ON_ERROR(callMsg()->AddFlat(PZG_PEER_NAME_PEER_ID, optPeerID));
+   MRETURN_ON_ERROR(callMsg()->AddBool(PZG_PEER_NAME_SEND_TO_SELF, sendToSelf));
+   return _workerSession()->SendMessageToMainThread(callMsg);
 }
 
 }  // end namespace zg_private
@@ -20,7 +20,7 @@ PZGDatabaseStateInfo :: PZGDatabaseStateInfo(const PZGDatabaseStateInfo & stateI
    // empty
 }
 
-PZGDatabaseStateInfo :: PZGDatabaseStateInfo(uint64 dbID, uint64 oldestDatabaseIDInLog, uint32 dbChecksum)
+PZGDatabaseStateInfo :: PZGDatabaseStateInfo(uint64 dbID, uint64 oldestDatabaseIDInLog, uint64 dbChecksum)
    : _currentDatabaseStateID(dbID)
    , _oldestDatabaseIDInLog(oldestDatabaseIDInLog)
    , _dbChecksum(dbChecksum)
@@ -40,14 +40,14 @@ void PZGDatabaseStateInfo :: Flatten(DataFlattener flat) const
 {
    flat.WriteInt64(_currentDatabaseStateID);
    flat.WriteInt64(_oldestDatabaseIDInLog);
-   flat.WriteInt32(_dbChecksum);
+   flat.WriteInt64(_dbChecksum);
 }
 
 status_t PZGDatabaseStateInfo :: Unflatten(DataUnflattener & unflat)
 {
    _currentDatabaseStateID = unflat.ReadInt64();
    _oldestDatabaseIDInLog  = unflat.ReadInt64();
-   _dbChecksum             = unflat.ReadInt32();
+   _dbChecksum             = unflat.ReadInt64();
    return unflat.GetStatus();
 }
 
@@ -63,7 +63,7 @@ String PZGDatabaseStateInfo :: ToString() const
 
 uint32 PZGDatabaseStateInfo :: CalculateChecksum() const
 {
-   return CalculatePODChecksum(_currentDatabaseStateID) + (CalculatePODChecksum(_oldestDatabaseIDInLog)*3) + (_dbChecksum*7);
+   return CalculatePODChecksum(_currentDatabaseStateID) + (CalculatePODChecksum(_oldestDatabaseIDInLog)*3) + (CalculatePODChecksum(_dbChecksum)*7);
 }
 
 bool PZGDatabaseStateInfo :: operator == (const PZGDatabaseStateInfo & rhs) const
@@ -6,7 +6,7 @@ namespace zg_private
 
 static PZGDatabaseUpdateRef::ItemPool _dbUpdatePool;
 
-PZGDatabaseUpdateRef GetPZGDatabaseUpdateFromPool(uint8 updateType, uint16 databaseIndex, uint64 updateID, const ZGPeerID & sourcePeerID, uint32 preUpdateDBChecksum)
+PZGDatabaseUpdateRef GetPZGDatabaseUpdateFromPool(uint8 updateType, uint16 databaseIndex, uint64 updateID, const ZGPeerID & sourcePeerID, uint64 preUpdateDBChecksum)
 {
    PZGDatabaseUpdateRef ret(_dbUpdatePool.ObtainObject());
    if (ret())
@@ -33,6 +33,13 @@ PZGDatabaseUpdate :: PZGDatabaseUpdate()
    , _updateID(0)
    , _preUpdateDBChecksum(0)
    , _postUpdateDBChecksum(0)
+   , _requestTimeMicros(0)
+   , _seniorReceiveTimeMicros(0)
+   , _seniorFinishTimeMicros(0)
+   , _multicastTimeMicros(0)
+   , _localReceiveTimeMicros(0)
+   , _compressionLevel(ZG_DEFAULT_PAYLOAD_COMPRESSION_LEVEL)
+   , _payloadCodec(PZG_PAYLOAD_CODEC_NONE)
 {
    // empty
 }
@@ -46,8 +53,16 @@ PZGDatabaseUpdate :: PZGDatabaseUpdate(const PZGDatabaseUpdate & rhs)
    , _updateID(rhs._updateID)
    , _preUpdateDBChecksum(rhs._preUpdateDBChecksum)
    , _postUpdateDBChecksum(rhs._postUpdateDBChecksum)
+   , _requestTimeMicros(rhs._requestTimeMicros)
+   , _seniorReceiveTimeMicros(rhs._seniorReceiveTimeMicros)
+   , _seniorFinishTimeMicros(rhs._seniorFinishTimeMicros)
+   , _multicastTimeMicros(rhs._multicastTimeMicros)
+   , _localReceiveTimeMicros(rhs._localReceiveTimeMicros)
+   , _compressionLevel(rhs._compressionLevel)
+   , _payloadCodec(rhs._payloadCodec)
    , _updateBuf(rhs._updateBuf)
    , _updateMsg(rhs._updateMsg)
+   , _wireImage(rhs._wireImage)
 {
    // empty
 }
@@ -62,19 +77,30 @@ PZGDatabaseUpdate & PZGDatabaseUpdate :: operator=(const PZGDatabaseUpdate & rhs
    _updateID                = rhs._updateID;
    _preUpdateDBChecksum     = rhs._preUpdateDBChecksum;
    _postUpdateDBChecksum    = rhs._postUpdateDBChecksum;
+   _requestTimeMicros       = rhs._requestTimeMicros;
+   _seniorReceiveTimeMicros = rhs._seniorReceiveTimeMicros;
+   _seniorFinishTimeMicros  = rhs._seniorFinishTimeMicros;
+   _multicastTimeMicros     = rhs._multicastTimeMicros;
+   _localReceiveTimeMicros  = rhs._localReceiveTimeMicros;
+   _compressionLevel        = rhs._compressionLevel;
+   _payloadCodec            = rhs._payloadCodec;
    _updateBuf               = rhs._updateBuf;
    _updateMsg               = rhs._updateMsg;
+   _wireImage               = rhs._wireImage;
    return *this;
 }
 
 uint32 PZGDatabaseUpdate :: CalculateChecksum() const
 {
-   return CalculatePODChecksums(_updateType, _databaseIndex, _seniorElapsedTimeMillis, _seniorStartTimeMicros, _sourcePeerID, _updateID, _preUpdateDBChecksum, _postUpdateDBChecksum, GetPayloadBuffer());  // we're deliberately using GetPayloadBuffer() version here, rather than the Message version
+   const ConstByteBufferRef & payloadBuf = GetPayloadBuffer();  // we're deliberately using GetPayloadBuffer() version here, rather than the Message version (and calling it first, since it sets _payloadCodec)
+   return CalculatePODChecksums(_updateType, _payloadCodec, _databaseIndex, _seniorElapsedTimeMillis, _seniorStartTimeMicros, _sourcePeerID, _updateID, _preUpdateDBChecksum, _postUpdateDBChecksum, _requestTimeMicros, _seniorReceiveTimeMicros, _seniorFinishTimeMicros, _multicastTimeMicros, payloadBuf);
 }
 
 uint32 PZGDatabaseUpdate :: FlattenedSize() const
 {
    /** Note that the payload Message is deliberately NOT part of the FlattenedSize! */
+   if (_wireImage()) return _wireImage()->GetNumBytes();
+
    const ConstByteBufferRef & updateBuf = GetPayloadBuffer();
    return FlattenedSizeNotIncludingPayload() + (updateBuf() ? updateBuf()->FlattenedSize() : 0);
 }
@@ -83,7 +109,7 @@ uint32 PZGDatabaseUpdate :: FlattenedSizeNotIncludingPayload() const
 {
    return sizeof(uint32)                   + /* will be the PZG_DATABASE_UPDATE_TYPE_CODE header */
           sizeof(_updateType)              +
-          sizeof(uint8)                    + /* this is a reserved byte for now */
+          sizeof(_payloadCodec)            +
           sizeof(_databaseIndex)           +
           sizeof(_seniorElapsedTimeMillis) +
           sizeof(_seniorStartTimeMicros)   +
@@ -92,26 +118,41 @@ uint32 PZGDatabaseUpdate :: FlattenedSizeNotIncludingPayload() const
           sizeof(_updateID)                +
           sizeof(_preUpdateDBChecksum)     +
           sizeof(_postUpdateDBChecksum)    +
+          sizeof(_requestTimeMicros)       +
+          sizeof(_seniorReceiveTimeMicros) +
+          sizeof(_seniorFinishTimeMicros)  +
+          sizeof(_multicastTimeMicros)     +
           sizeof(uint32)                   + /* this will be this object's checksum */
           sizeof(uint32)                   ; /* this will be updateBuf.FlattenedSize() */
 }
 
 void PZGDatabaseUpdate :: Flatten(DataFlattener flat) const
 {
+   if (_wireImage())
+   {
+      flat.WriteBytes(*_wireImage());  // already flattened and checksummed once, so no need to do it again
+      return;
+   }
+
    flat.WriteInt32(PZG_DATABASE_UPDATE_TYPE_CODE);
+   const ConstByteBufferRef & updateBuf = GetPayloadBuffer();  // called first, since it sets _payloadCodec
+
    flat.WriteInt8(_updateType);
-   flat.WriteInt8(0);  /* this field is reserved for now */
+   flat.WriteInt8(_payloadCodec);
    flat.WriteInt16(_databaseIndex);
    flat.WriteInt16(_seniorElapsedTimeMillis);
    flat.WriteInt16(0);  /* this field is reserved */
    flat.WriteInt64(_seniorStartTimeMicros);
    flat.WriteFlat(_sourcePeerID);
    flat.WriteInt64(_updateID);
-   flat.WriteInt32(_preUpdateDBChecksum);
-   flat.WriteInt32(_postUpdateDBChecksum);
+   flat.WriteInt64(_preUpdateDBChecksum);
+   flat.WriteInt64(_postUpdateDBChecksum);
+   flat.WriteInt64(_requestTimeMicros);
+   flat.WriteInt64(_seniorReceiveTimeMicros);
+   flat.WriteInt64(_seniorFinishTimeMicros);
+   flat.WriteInt64(_multicastTimeMicros);
    flat.WriteInt32(CalculateChecksum());
 
-   const ConstByteBufferRef & updateBuf = GetPayloadBuffer();
    flat.WriteInt32(updateBuf() ? updateBuf()->GetNumBytes() : 0);
    if (updateBuf()) flat.WriteBytes(*updateBuf());
 
@@ -129,20 +170,31 @@ status_t PZGDatabaseUpdate :: Unflatten(DataUnflattener & unflat)
 
    _updateBuf.Reset();
    _updateMsg.Reset();
+   _wireImage.Reset();
 
    _updateType                          = unflat.ReadInt8();
-   (void)                                 unflat.ReadInt8();   // skip the reserved/padding byte
+   _payloadCodec                        = unflat.ReadInt8();
    _databaseIndex                       = unflat.ReadInt16();
    _seniorElapsedTimeMillis             = unflat.ReadInt16();
    (void)                                 unflat.ReadInt16();  // reserved 16-bit field is here; maybe we'll do something with it someday
    _seniorStartTimeMicros               = unflat.ReadInt64();
    MRETURN_ON_ERROR(unflat.ReadFlat(_sourcePeerID));
    _updateID                            = unflat.ReadInt64();
-   _preUpdateDBChecksum                 = unflat.ReadInt32();
-   _postUpdateDBChecksum                = unflat.ReadInt32();
+   _preUpdateDBChecksum                 = unflat.ReadInt64();
+   _postUpdateDBChecksum                = unflat.ReadInt64();
+   _requestTimeMicros                   = unflat.ReadInt64();
+   _seniorReceiveTimeMicros             = unflat.ReadInt64();
+   _seniorFinishTimeMicros              = unflat.ReadInt64();
+   _multicastTimeMicros                 = unflat.ReadInt64();
+   _localReceiveTimeMicros              = 0;  // not part of the flattened data; the receiving peer will set it
    const uint32 chk                     = unflat.ReadInt32();
    const uint32 dataSize                = unflat.ReadInt32();
    if (unflat.GetNumBytesAvailable() < dataSize) return B_BAD_DATA;  // truncated buffer, oh no!
+   if (_payloadCodec >= NUM_PZG_PAYLOAD_CODECS)
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGDatabaseUpdate::Unflatten():  Unknown payload codec %u\n", _payloadCodec);
+      return B_BAD_DATA;
+   }
 
    if (dataSize > 0)  // 0 data is taken to mean a NULL/empty buffer (we don't distinguish between the two)
    {
@@ -163,11 +215,25 @@ status_t PZGDatabaseUpdate :: Unflatten(DataUnflattener & unflat)
 
 String PZGDatabaseUpdate :: ToString() const
 {
-   char buf[512];
-   muscleSprintf(buf, "UpdateID=" UINT64_FORMAT_SPEC " Type=%u db=%u elapsed=%umS seniorTime=" UINT64_FORMAT_SPEC " sourcePeerID=%s preChk=" UINT32_FORMAT_SPEC " postChk=" UINT32_FORMAT_SPEC " _updateBuf=" INT32_FORMAT_SPEC " _updateMsg=" INT32_FORMAT_SPEC, _updateID, _updateType, _databaseIndex, _seniorElapsedTimeMillis, _seniorStartTimeMicros, _sourcePeerID.ToString()(), _preUpdateDBChecksum, _postUpdateDBChecksum, _updateBuf()?_updateBuf()->GetNumBytes():0, _updateMsg()?_updateMsg()->FlattenedSize():0);
+   char buf[768];
+   muscleSprintf(buf, "UpdateID=" UINT64_FORMAT_SPEC " Type=%u codec=%u db=%u elapsed=%umS seniorTime=" UINT64_FORMAT_SPEC " sourcePeerID=%s preChk=" XINT64_FORMAT_SPEC " postChk=" XINT64_FORMAT_SPEC " requestTime=" UINT64_FORMAT_SPEC " seniorRecvTime=" UINT64_FORMAT_SPEC " seniorFinishTime=" UINT64_FORMAT_SPEC " mcastTime=" UINT64_FORMAT_SPEC " _updateBuf=" INT32_FORMAT_SPEC " _updateMsg=" INT32_FORMAT_SPEC, _updateID, _updateType, _payloadCodec, _databaseIndex, _seniorElapsedTimeMillis, _seniorStartTimeMicros, _sourcePeerID.ToString()(), _preUpdateDBChecksum, _postUpdateDBChecksum, _requestTimeMicros, _seniorReceiveTimeMicros, _seniorFinishTimeMicros, _multicastTimeMicros, _updateBuf()?_updateBuf()->GetNumBytes():0, _updateMsg()?_updateMsg()->FlattenedSize():0);
    return buf;
 }
 
+static const char * _updateTypeNames[] = {
+   "noop",
+   "reset",
+   "replace",
+   "update",
+   "group-update",
+};
+MUSCLE_STATIC_ASSERT_ARRAY_LENGTH(_updateTypeNames, NUM_PZG_DATABASE_UPDATE_TYPES);
+
+const char * PZGDatabaseUpdate :: GetUpdateTypeName() const
+{
+   return (_updateType < ARRAYITEMS(_updateTypeNames)) ? _updateTypeNames[_updateType] : "???";
+}
+
 void PZGDatabaseUpdate :: Print(const OutputPrinter & p) const
 {
    p.puts(ToString()());
@@ -190,21 +256,50 @@ void PZGDatabaseUpdate :: UncachePayloadBufferAsMessage() const
 const ConstMessageRef & PZGDatabaseUpdate :: GetPayloadBufferAsMessage() const
 {
    if (_updateMsg()) return _updateMsg;  // re-use the prevously-constructed Message, if we have one
-   if (_updateBuf()) _updateMsg = GetMessageFromPool(InflateByteBuffer(_updateBuf));  // demand-calculate and cache one if we don't
+   if (_updateBuf())  // demand-calculate and cache one if we don't
+   {
+      if (_payloadCodec == PZG_PAYLOAD_CODEC_ZLIB) _updateMsg = GetMessageFromPool(InflateByteBuffer(_updateBuf));
+                                              else _updateMsg = GetMessageFromPool(*_updateBuf());
+   }
    return _updateMsg;
 }
 
 const ConstByteBufferRef & PZGDatabaseUpdate :: GetPayloadBuffer() const
 {
    if (_updateBuf()) return _updateBuf;  // re-use the prevously-constructed buffer, if we have one
-   if (_updateMsg()) _updateBuf = DeflateByteBuffer(_updateMsg()->FlattenToByteBuffer(), 9);  // demand-calculate and cache one if we don't
+   if (_updateMsg())  // demand-calculate and cache one if we don't
+   {
+      ByteBufferRef flatBuf = _updateMsg()->FlattenToByteBuffer();
+      if ((flatBuf())&&(_compressionLevel > 0)&&(flatBuf()->GetNumBytes() >= PZG_MIN_PAYLOAD_BYTES_TO_COMPRESS))
+      {
+         ByteBufferRef deflatedBuf = DeflateByteBuffer(flatBuf, _compressionLevel);
+         if ((deflatedBuf())&&(deflatedBuf()->GetNumBytes() < flatBuf()->GetNumBytes()))
+         {
+            _payloadCodec = PZG_PAYLOAD_CODEC_ZLIB;
+            _updateBuf    = deflatedBuf;
+            return _updateBuf;
+         }
+      }
+
+      // Small (or incompressible) payloads are cheaper to send as-is
+      _payloadCodec = PZG_PAYLOAD_CODEC_NONE;
+      _updateBuf    = flatBuf;
+   }
    return _updateBuf;
 }
 
-void PZGDatabaseUpdate :: SetPayloadMessage(const ConstMessageRef & updateMsg)
+const ConstByteBufferRef & PZGDatabaseUpdate :: GetWireImage() const
+{
+   if (_wireImage() == NULL) _wireImage = FlattenToByteBuffer();
+   return _wireImage;
+}
+
+void PZGDatabaseUpdate :: SetPayloadMessage(const ConstMessageRef & updateMsg, uint8 compressionLevel)
 {
+   _wireImage.Reset();
    _updateBuf.Reset();  // this may be demand-calculated later; for now make sure we dump any now-inappropriate older version
-   _updateMsg = updateMsg;
+   _updateMsg        = updateMsg;
+   _compressionLevel = compressionLevel;
 }
 
 }  // end namespace zg_private
@@ -0,0 +1,52 @@
+#include "zg/private/PZGDatabaseWorkerSession.h"
+#include "zg/private/PZGDatabaseState.h"
+
+namespace zg_private
+{
+
+static thread_local PZGDatabaseState * _workerThreadDatabaseState = NULL;  // set only within a database's worker thread
+
+PZGDatabaseState * PZGDatabaseWorkerSession :: GetDatabaseStateForCallingThread()
+{
+   return _workerThreadDatabaseState;
+}
+
+PZGDatabaseWorkerSession :: PZGDatabaseWorkerSession(PZGDatabaseState * dbState) : _dbState(dbState)
+{
+   // empty
+}
+
+void PZGDatabaseWorkerSession :: EndSession()
+{
+   PZGThreadedSession::EndSession();  // this will block until the worker thread has exited
+   _dbState = NULL;
+}
+
+void PZGDatabaseWorkerSession :: InternalThreadEntry()
+{
+   _workerThreadDatabaseState = _dbState;
+
+   while(1)
+   {
+      MessageRef jobMsg;
+      if (WaitForNextMessageFromOwner(jobMsg).IsError()) break;
+      if (jobMsg() == NULL) break;  // NULL jobMsg means it is time for this thread to exit!
+
+      if (SendMessageToOwner(_dbState->WorkerThreadExecuteJob(jobMsg)).IsError()) LogTime(MUSCLE_LOG_ERROR, "Database worker thread:  Unable to send job result to main thread!\n");
+   }
+}
+
+void PZGDatabaseWorkerSession :: MessageReceivedFromInternalThread(const MessageRef & msg, uint32 /*numLeft*/)
+{
+   if (_dbState) _dbState->WorkerThreadMessageReceived(msg);
+}
+
+status_t PZGDatabaseWorkerSession :: WaitForNextMessageFromWorkerThread()
+{
+   MessageRef msg;
+   MRETURN_ON_ERROR(GetNextReplyFromInternalThread(msg, MUSCLE_TIME_NEVER));
+   MessageReceivedFromInternalThread(msg, 0);
+   return B_NO_ERROR;
+}
+
+}  // end namespace zg_private
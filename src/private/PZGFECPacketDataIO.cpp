@@ -0,0 +1,330 @@
+#include "zg/ZGConstants.h"  // for GetRandomNumber()
+#include "zg/private/PZGFECPacketDataIO.h"
+
+namespace zg_private
+{
+
+// Every packet we send starts with a one-byte packet type, a one-byte index-or-count field, a two-byte parity-group ID, and a four-byte sender ID.
+// Parity packets also carry the XOR of their group's data-packet lengths, so that the receiver can trim a recovered packet to its proper size.
+enum {
+   PZG_FEC_PACKET_TYPE_UNPROTECTED = 0xF0,  // a data packet that isn't covered by any parity packet
+   PZG_FEC_PACKET_TYPE_DATA,                // a data packet; index-or-count is its position within its parity group
+   PZG_FEC_PACKET_TYPE_PARITY               // a parity packet; index-or-count is the number of data packets in its parity group
+};
+
+static const uint32 PZG_FEC_HEADER_SIZE        = sizeof(uint8)+sizeof(uint8)+sizeof(uint16)+sizeof(uint32);
+static const uint32 PZG_FEC_PARITY_HEADER_SIZE = PZG_FEC_HEADER_SIZE+sizeof(uint16);
+
+static status_t XorIntoBuffer(ByteBuffer & xorBuf, uint32 & xorBufSize, const uint8 * payload, uint32 payloadSize)
+{
+   if (payloadSize > xorBufSize)
+   {
+      if (payloadSize > xorBuf.GetNumBytes()) MRETURN_ON_ERROR(xorBuf.SetNumBytes(payloadSize, true));
+      memset(xorBuf.GetBuffer()+xorBufSize, 0, payloadSize-xorBufSize);  // shorter payloads are treated as zero-padded
+      xorBufSize = payloadSize;
+   }
+
+   uint8 * x = xorBuf.GetBuffer();
+   for (uint32 i=0; i<payloadSize; i++) x[i] ^= payload[i];
+   return B_NO_ERROR;
+}
+
+PZGFECPacketDataIO :: PZGFECPacketDataIO(const PacketDataIORef & childIO, uint32 maxGroupSize, uint32 senderID)
+   : _childIO(childIO)
+   , _maxGroupSize(muscleMin(maxGroupSize, PZG_FEC_MAX_GROUP_SIZE))
+   , _senderID(senderID)
+   , _sendGroupID(0)
+   , _sendGroupSize(0)
+   , _numPacketsInSendGroup(0)
+   , _sendLengthXor(0)
+   , _sendPayloadXorSize(0)
+   , _numUnprotectedSingletons(0)
+   , _parityFlushTime(MUSCLE_TIME_NEVER)
+   , _numRecoveredPackets(0)
+   , _numExpectedPackets(0)
+   , _numLostPackets(0)
+{
+   unsigned int seed = (unsigned int) (GetRunTime64()+GetCurrentTime64()+(uintptr)this);
+   _sendGroupID = (uint16) GetRandomNumber(&seed);
+}
+
+uint32 PZGFECPacketDataIO :: GetMaximumPacketSize() const
+{
+   // Our parity packets are as large as the largest data packet in their group, plus the parity header
+   const uint32 childMax = _childIO()->GetMaximumPacketSize();
+   return (childMax > PZG_FEC_PARITY_HEADER_SIZE) ? (childMax-PZG_FEC_PARITY_HEADER_SIZE) : 0;
+}
+
+io_status_t PZGFECPacketDataIO :: Read(void * buffer, uint32 size)
+{
+   IPAddressAndPort junk;
+   return ReadFrom(buffer, size, junk);
+}
+
+io_status_t PZGFECPacketDataIO :: Write(const void * buffer, uint32 size)
+{
+   return WriteTo(buffer, size, _childIO()->GetPacketSendDestination());
+}
+
+io_status_t PZGFECPacketDataIO :: WriteTo(const void * buffer, uint32 size, const IPAddressAndPort & packetDest)
+{
+   if (_maxGroupSize == 0)
+   {
+      const io_status_t ret = WritePacket(PZG_FEC_PACKET_TYPE_UNPROTECTED, 0, buffer, size, packetDest);
+      return (ret.GetByteCount() > 0) ? io_status_t(size) : ret;
+   }
+
+   if ((_numPacketsInSendGroup > 0)&&((_numPacketsInSendGroup >= _sendGroupSize)||(packetDest != _sendGroupDest)))  // all of a group's packets have to go to the same place
+   {
+      FlushParity();
+      if (_numPacketsInSendGroup > 0) return 0;  // our child couldn't take the parity packet yet, so it can't take this packet either
+   }
+   if (_numPacketsInSendGroup == 0)
+   {
+      const uint64 now = GetRunTime64();
+      _sendGroupSize   = CalculateGroupSize(now);
+      _sendGroupDest   = packetDest;
+      _parityFlushTime = now+PZG_FEC_PARITY_FLUSH_DELAY_MICROS;
+   }
+
+   const io_status_t ret = WritePacket(PZG_FEC_PACKET_TYPE_DATA, (uint8) _numPacketsInSendGroup, buffer, size, packetDest);
+   if (ret.GetByteCount() <= 0) return ret;  // the packet wasn't sent, so it isn't part of the group; our caller will try again later
+
+   _sendLengthXor ^= (uint16) size;
+   if (XorIntoBuffer(_sendPayloadXor, _sendPayloadXorSize, (const uint8 *) buffer, size).IsError())
+   {
+      StartNewSendGroup();  // without a valid parity, this group can't be protected anymore
+      return size;
+   }
+
+   if (++_numPacketsInSendGroup >= _sendGroupSize) FlushParity();
+   return size;
+}
+
+void PZGFECPacketDataIO :: FlushParity()
+{
+   if (_numPacketsInSendGroup > 0)
+   {
+      // A parity packet for a one-packet group is just a copy of that packet, so we usually only bother sending it if peers are
+      // reporting loss.  But receivers can only measure loss on groups that have a parity packet, so if all of our traffic is
+      // sparse single-packet updates, we still send one occasionally as a probe; otherwise FEC would never get turned on.
+      const bool sendParity = ((_numPacketsInSendGroup > 1)||(GetReportedLossRate(GetRunTime64()) > 0.0f)||(_numUnprotectedSingletons+1 >= PZG_FEC_SINGLETON_PROBE_INTERVAL));
+      if (sendParity)
+      {
+         if (_scratchBuf.SetNumBytes(PZG_FEC_PARITY_HEADER_SIZE+_sendPayloadXorSize, false).IsOK())
+         {
+            uint8 * p = _scratchBuf.GetBuffer();
+            p[0] = PZG_FEC_PACKET_TYPE_PARITY;
+            p[1] = (uint8) _numPacketsInSendGroup;
+            DefaultEndianConverter::Export(_sendGroupID,   p+sizeof(uint16));
+            DefaultEndianConverter::Export(_senderID,      p+(2*sizeof(uint16)));
+            DefaultEndianConverter::Export(_sendLengthXor, p+PZG_FEC_HEADER_SIZE);
+            memcpy(p+PZG_FEC_PARITY_HEADER_SIZE, _sendPayloadXor.GetBuffer(), _sendPayloadXorSize);
+
+            // If our child can't take the parity packet right now (e.g. because it's pacing its output), we'll try again later.
+            // If it failed outright, the receivers will just have to NACK or back-order any lost packets, as before.
+            if (_childIO()->WriteTo(p, _scratchBuf.GetNumBytes(), _sendGroupDest).GetByteCount() == 0) return;
+         }
+      }
+      _numUnprotectedSingletons = sendParity ? 0 : (_numUnprotectedSingletons+1);
+      StartNewSendGroup();
+   }
+}
+
+void PZGFECPacketDataIO :: StartNewSendGroup()
+{
+   _sendGroupID++;
+   _numPacketsInSendGroup = 0;
+   _sendLengthXor         = 0;
+   _sendPayloadXorSize    = 0;
+   _parityFlushTime       = MUSCLE_TIME_NEVER;
+}
+
+io_status_t PZGFECPacketDataIO :: WritePacket(uint8 packetType, uint8 indexOrCount, const void * payload, uint32 payloadSize, const IPAddressAndPort & packetDest)
+{
+   MRETURN_ON_ERROR(_scratchBuf.SetNumBytes(PZG_FEC_HEADER_SIZE+payloadSize, false));
+
+   uint8 * p = _scratchBuf.GetBuffer();
+   p[0] = packetType;
+   p[1] = indexOrCount;
+   DefaultEndianConverter::Export(_sendGroupID, p+sizeof(uint16));
+   DefaultEndianConverter::Export(_senderID,    p+(2*sizeof(uint16)));
+   memcpy(p+PZG_FEC_HEADER_SIZE, payload, payloadSize);
+   return _childIO()->WriteTo(p, _scratchBuf.GetNumBytes(), packetDest);
+}
+
+uint32 PZGFECPacketDataIO :: CalculateGroupSize(uint64 now) const
+{
+   // Smaller groups cost more bandwidth, but they're less likely to lose two packets (which a single parity packet can't repair)
+   const float lossRate = GetReportedLossRate(now);
+   if (lossRate*_maxGroupSize <= PZG_FEC_TARGET_LOSSES_PER_GROUP) return _maxGroupSize;
+   return muscleMin(_maxGroupSize, muscleMax((uint32) (PZG_FEC_TARGET_LOSSES_PER_GROUP/lossRate), PZG_FEC_MIN_ADAPTIVE_GROUP_SIZE));
+}
+
+void PZGFECPacketDataIO :: LossReportReceived(const ZGPeerID & reporterPeerID, float lossRate, uint64 now)
+{
+   for (HashtableIterator<ZGPeerID, LossReport> iter(_lossReports); iter.HasData(); iter++)
+      if (now >= iter.GetValue().GetReceiveTime()+PZG_FEC_LOSS_REPORT_MAX_AGE_MICROS) (void) _lossReports.Remove(iter.GetKey());
+
+   (void) _lossReports.Put(reporterPeerID, LossReport(muscleClamp(lossRate, 0.0f, 1.0f), now));
+}
+
+float PZGFECPacketDataIO :: GetReportedLossRate(uint64 now) const
+{
+   // We protect against the worst loss rate any receiver is seeing, since every receiver gets the same packets from us
+   float ret = 0.0f;
+   for (ConstHashtableIterator<ZGPeerID, LossReport> iter(_lossReports); iter.HasData(); iter++)
+   {
+      const LossReport & lr = iter.GetValue();
+      if (now < lr.GetReceiveTime()+PZG_FEC_LOSS_REPORT_MAX_AGE_MICROS) ret = muscleMax(ret, lr.GetLossRate());
+   }
+   return ret;
+}
+
+void PZGFECPacketDataIO :: GetAndResetLossStatistics(uint32 & retNumExpected, uint32 & retNumLost)
+{
+   retNumExpected = _numExpectedPackets;
+   retNumLost     = _numLostPackets;
+   _numExpectedPackets = _numLostPackets = 0;
+}
+
+io_status_t PZGFECPacketDataIO :: ReadFrom(void * buffer, uint32 size, IPAddressAndPort & retPacketSource)
+{
+   RecoveredPacket rp;
+   if (_recoveredPackets.RemoveHead(rp).IsOK()) return ReturnPayload(rp.GetPayload()()->GetBuffer(), rp.GetPayload()()->GetNumBytes(), rp.GetSource(), buffer, size, retPacketSource);
+
+   // Our headers are added on top of whatever our sender's PacketTunnelIOGateway considered to be a full-size packet, so leave room for them
+   const uint32 readBufSize = _childIO()->GetMaximumPacketSize()+PZG_FEC_PARITY_HEADER_SIZE;
+   while(1)
+   {
+      MRETURN_ON_ERROR(_scratchBuf.SetNumBytes(readBufSize, false));
+
+      IPAddressAndPort source;
+      const io_status_t numBytesRead = _childIO()->ReadFrom(_scratchBuf.GetBuffer(), _scratchBuf.GetNumBytes(), source);
+      if (numBytesRead.GetByteCount() <= 0) return numBytesRead;
+
+      const uint32 numBytes = numBytesRead.GetByteCount();
+      if (numBytes < PZG_FEC_HEADER_SIZE) continue;  // too short to be one of ours
+
+      const uint8 * p           = _scratchBuf.GetBuffer();
+      const uint8 indexOrCount  = p[1];
+      const uint16 groupID      = DefaultEndianConverter::Import<uint16>(p+sizeof(uint16));
+      const ReceiveSourceKey sourceKey(source, DefaultEndianConverter::Import<uint32>(p+(2*sizeof(uint16))));
+      const uint8 * payload     = p+PZG_FEC_HEADER_SIZE;
+      const uint32 payloadSize  = numBytes-PZG_FEC_HEADER_SIZE;
+      switch(p[0])
+      {
+         case PZG_FEC_PACKET_TYPE_UNPROTECTED:
+            return ReturnPayload(payload, payloadSize, source, buffer, size, retPacketSource);
+
+         case PZG_FEC_PACKET_TYPE_DATA:
+            if (indexOrCount < PZG_FEC_MAX_GROUP_SIZE)
+            {
+               ReceiveGroup * group = GetReceiveGroup(sourceKey, groupID);
+               if (group == NULL) return ReturnPayload(payload, payloadSize, source, buffer, size, retPacketSource);  // out of memory?  Then we just can't protect this one
+               if (group->HasDataPacket(indexOrCount) == false)  // if we already have it (e.g. because we recovered it), then this is a duplicate
+               {
+                  if ((group->HasParityPacket())&&(_numLostPackets > 0)) _numLostPackets--;  // it was counted as lost when the parity packet arrived, but it was only late
+                  group->DataPacketReceived(indexOrCount, payload, payloadSize);
+                  RecoverMissingPacketIfPossible(source, *group);
+                  return ReturnPayload(payload, payloadSize, source, buffer, size, retPacketSource);
+               }
+            }
+         break;
+
+         case PZG_FEC_PACKET_TYPE_PARITY:
+            if ((numBytes >= PZG_FEC_PARITY_HEADER_SIZE)&&(indexOrCount > 0)&&(indexOrCount <= PZG_FEC_MAX_GROUP_SIZE))
+            {
+               ReceiveGroup * group = GetReceiveGroup(sourceKey, groupID);
+               if ((group)&&(group->HasParityPacket() == false))
+               {
+                  group->ParityPacketReceived(indexOrCount, DefaultEndianConverter::Import<uint16>(payload), p+PZG_FEC_PARITY_HEADER_SIZE, numBytes-PZG_FEC_PARITY_HEADER_SIZE);
+                  _numExpectedPackets += group->GetNumDataPackets();
+                  _numLostPackets     += group->GetNumDataPackets()-muscleMin(group->GetNumOriginalsReceived(), group->GetNumDataPackets());
+
+                  RecoverMissingPacketIfPossible(source, *group);
+                  if (_recoveredPackets.RemoveHead(rp).IsOK()) return ReturnPayload(rp.GetPayload()()->GetBuffer(), rp.GetPayload()()->GetNumBytes(), rp.GetSource(), buffer, size, retPacketSource);
+               }
+            }
+         break;
+
+         default:
+            // empty -- not a packet of ours, so we'll just ignore it
+         break;
+      }
+   }
+}
+
+io_status_t PZGFECPacketDataIO :: ReturnPayload(const uint8 * payload, uint32 payloadSize, const IPAddressAndPort & source, void * buffer, uint32 size, IPAddressAndPort & retPacketSource)
+{
+   const uint32 numBytesToCopy = muscleMin(payloadSize, size);  // as with any datagram socket, a too-small read-buffer truncates the packet
+   memcpy(buffer, payload, numBytesToCopy);
+   retPacketSource = _sourceOfLastReadPacket = source;
+   return numBytesToCopy;
+}
+
+PZGFECPacketDataIO::ReceiveGroup * PZGFECPacketDataIO :: GetReceiveGroup(const ReceiveSourceKey & sourceKey, uint16 groupID)
+{
+   Hashtable<uint16, ReceiveGroup> * groups = _sources.Get(sourceKey);
+   if (groups) (void) _sources.MoveToBack(sourceKey);  // so that the least-recently-heard sources are at the front
+   else
+   {
+      while(_sources.GetNumItems() >= PZG_FEC_MAX_SOURCES) (void) _sources.RemoveFirst();
+      groups = _sources.GetOrPut(sourceKey);
+      if (groups == NULL) return NULL;
+   }
+
+   ReceiveGroup * group = groups->Get(groupID);
+   if (group == NULL)
+   {
+      while(groups->GetNumItems() >= PZG_FEC_MAX_GROUPS_PER_SOURCE) (void) groups->RemoveFirst();  // the oldest groups are too old to be worth repairing anyway
+      group = groups->GetOrPut(groupID);
+   }
+   return group;
+}
+
+void PZGFECPacketDataIO :: RecoverMissingPacketIfPossible(const IPAddressAndPort & source, ReceiveGroup & group)
+{
+   ByteBufferRef recoveredBuf = group.RecoverMissingPacket();
+   if ((recoveredBuf())&&(_recoveredPackets.AddTail(RecoveredPacket(recoveredBuf, source)).IsOK())) _numRecoveredPackets++;
+}
+
+void PZGFECPacketDataIO :: ReceiveGroup :: DataPacketReceived(uint32 index, const uint8 * payload, uint32 payloadSize)
+{
+   _receivedMask |= (((uint32)1)<<index);
+   _numOriginalsReceived++;
+   _lengthXor ^= (uint16) payloadSize;
+   FoldPayload(payload, payloadSize);
+}
+
+void PZGFECPacketDataIO :: ReceiveGroup :: ParityPacketReceived(uint32 numDataPackets, uint16 lengthXor, const uint8 * payload, uint32 payloadSize)
+{
+   _parityReceived = true;
+   _numDataPackets = numDataPackets;
+   _lengthXor     ^= lengthXor;
+   FoldPayload(payload, payloadSize);
+}
+
+void PZGFECPacketDataIO :: ReceiveGroup :: FoldPayload(const uint8 * payload, uint32 payloadSize)
+{
+   uint32 xorSize = _payloadXor.GetNumBytes();
+   if (XorIntoBuffer(_payloadXor, xorSize, payload, payloadSize).IsError()) _xorIsValid = false;  // out of memory?  Then we mustn't try to recover anything from this group
+}
+
+ByteBufferRef PZGFECPacketDataIO :: ReceiveGroup :: RecoverMissingPacket()
+{
+   if ((_parityReceived == false)||(_xorIsValid == false)||(_numDataPackets == 0)) return ByteBufferRef();
+
+   const uint32 groupMask   = (uint32) ((((uint64)1)<<_numDataPackets)-1);
+   const uint32 missingMask = groupMask & ~_receivedMask;
+   if ((missingMask == 0)||((missingMask & (missingMask-1)) != 0)) return ByteBufferRef();  // we can only recover a group that's missing exactly one data packet
+
+   // With every other packet XOR'd back out, what remains in our XOR buffers is the missing packet and its length
+   if (_lengthXor > _payloadXor.GetNumBytes()) return ByteBufferRef();  // paranoia:  corrupt parity packet?
+
+   ByteBufferRef ret = GetByteBufferFromPool(_lengthXor, _payloadXor.GetBuffer());
+   if (ret()) _receivedMask |= missingMask;
+   return ret;
+}
+
+}  // end namespace zg_private
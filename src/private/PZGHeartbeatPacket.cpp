@@ -14,16 +14,17 @@ PZGHeartbeatPacket :: PZGHeartbeatPacket()
    , _peerType(0)
    , _peerUptimeSeconds(0)
    , _isFullyAttached(false)
+   , _isCaughtUp(false)
 {
    // empty
 }
 
-PZGHeartbeatPacket :: PZGHeartbeatPacket(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, uint32 packetID)
+PZGHeartbeatPacket :: PZGHeartbeatPacket(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, bool isCaughtUp, uint32 packetID)
 {
-   Initialize(hbSettings, uptimeSeconds, isFullyAttached, packetID);
+   Initialize(hbSettings, uptimeSeconds, isFullyAttached, isCaughtUp, packetID);
 }
 
-void PZGHeartbeatPacket :: Initialize(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, uint32 packetID)
+void PZGHeartbeatPacket :: Initialize(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, bool isCaughtUp, uint32 packetID)
 {
    _heartbeatPacketID     = packetID;
    _versionCode           = hbSettings.GetVersionCode();
@@ -34,14 +35,18 @@ void PZGHeartbeatPacket :: Initialize(const PZGHeartbeatSettings & hbSettings, u
    _peerUptimeSeconds     = uptimeSeconds;
    _sourcePeerID          = hbSettings.GetLocalPeerID();
    _isFullyAttached       = isFullyAttached;
+   _isCaughtUp            = isCaughtUp;
    _peerAttributesBuf     = hbSettings.GetPeerAttributesByteBuffer();
+   _seniorDatabaseIndices.Clear();  // our owner will fill these in, if there are any
 }
 
 uint32 PZGHeartbeatPacket :: CalculateChecksum() const
 {
    // _networkSendTimeMicros is deliberately not part of our checksum as it will be sent separately for better accuracy
-   uint32 ret = _heartbeatPacketID + _versionCode + CalculatePODChecksum(_systemKey) + _tcpAcceptPort + _peerUptimeSeconds + (_isFullyAttached?666:0) + _sourcePeerID.CalculateChecksum() + _peerType;
+   uint32 ret = _heartbeatPacketID + _versionCode + CalculatePODChecksum(_systemKey) + _tcpAcceptPort + _peerUptimeSeconds + (_isFullyAttached?666:0) + (_isCaughtUp?777:0) + _sourcePeerID.CalculateChecksum() + _peerType;
    for (uint32 i=0; i<_orderedPeersList.GetNumItems(); i++) ret += (i+1)*(_orderedPeersList[i]()->CalculateChecksum());
+   for (uint32 i=0; i<GetNumObserverTimingRepliesToSend(); i++) ret += (i+3)*(_observerTimingReplies[i]()->CalculateChecksum());
+   for (uint32 i=0; i<GetNumSeniorDatabaseIndicesToSend(); i++) ret += (i+5)*(_seniorDatabaseIndices[i]+1);
    if (_peerAttributesBuf()) ret += _peerAttributesBuf()->CalculateChecksum();
    /* deliberately not including _peerAttributesMsg in the checksum since it is redundant with _peerAttributesBuf */
    return ret;
@@ -60,7 +65,7 @@ uint32 PZGHeartbeatPacket :: FlattenedSizeNotIncludingVariableLengthData() const
         + sizeof(_peerType)              // also includes _isFullyAttached
         + sizeof(uint16)                 // for _orderedPeersList.GetNumItems()  (sent as a uint16)
         + sizeof(uint16)                 // for _peerAttributesBuf()->GetNumBytes() (sent as a uint16)
-        + sizeof(uint16);                // reserved, for now
+        + sizeof(uint16);                // for _isCaughtUp, the has-senior-databases bit, and _observerTimingReplies.GetNumItems() (the other bits are reserved, for now)
 }
 
 uint32 PZGHeartbeatPacket :: FlattenedSize() const
@@ -68,6 +73,8 @@ uint32 PZGHeartbeatPacket :: FlattenedSize() const
    uint32 ret = FlattenedSizeNotIncludingVariableLengthData();
    for (uint32 i=0; i<_orderedPeersList.GetNumItems(); i++) ret += _orderedPeersList[i]()->FlattenedSize();
    if (_peerAttributesBuf()) ret += _peerAttributesBuf()->FlattenedSize();
+   for (uint32 i=0; i<GetNumObserverTimingRepliesToSend(); i++) ret += _observerTimingReplies[i]()->FlattenedSize();
+   if (_seniorDatabaseIndices.HasItems()) ret += sizeof(uint16)*(1+GetNumSeniorDatabaseIndicesToSend());
 
    /** Deliberately not including _peerAttributesMsg in the size as we send _peerAttributesBuf instead */
    return ret;
@@ -77,6 +84,8 @@ void PZGHeartbeatPacket :: Flatten(DataFlattener flat) const
 {
    const uint32 opListItemCount = _orderedPeersList.GetNumItems();
    const uint32 attribBufSize   = _peerAttributesBuf() ? _peerAttributesBuf()->GetNumBytes() : 0;
+   const uint32 numOTRs         = GetNumObserverTimingRepliesToSend();
+   const uint32 numSDIs         = GetNumSeniorDatabaseIndicesToSend();
 
    flat.WriteInt32(PZG_HEARTBEAT_PACKET_TYPE_CODE);
    flat.WriteInt32(_heartbeatPacketID);
@@ -89,9 +98,15 @@ void PZGHeartbeatPacket :: Flatten(DataFlattener flat) const
    flat.WriteInt16(_peerType|(_isFullyAttached?0x8000:0));
    flat.WriteInt16((uint16) opListItemCount);  // yes, 16 bits is correct!
    flat.WriteInt16((uint16) attribBufSize);    // yes, 16 bits is correct!
-   flat.WriteInt16(0); /* reserved, for now */
+   flat.WriteInt16((uint16)((_isCaughtUp?0x0001:0)|((numSDIs>0)?0x0002:0)|(numOTRs<<8)));  // the other bits are reserved, for now
    for (uint32 i=0; i<opListItemCount; i++) flat.WriteFlat(*_orderedPeersList[i]());  // receiver will figure out the lengths from the restored PeerInfo objects
    if (attribBufSize > 0) flat.WriteBytes(*_peerAttributesBuf());
+   for (uint32 i=0; i<numOTRs; i++) flat.WriteFlat(*_observerTimingReplies[i]());  // after the attributes, so that older peers (which don't know about them) will just ignore them
+   if (numSDIs > 0)
+   {
+      flat.WriteInt16((uint16) numSDIs);
+      for (uint32 i=0; i<numSDIs; i++) flat.WriteInt16((uint16) _seniorDatabaseIndices[i]);  // last, for the same reason
+   }
    /** Deliberately not flattening _peerAttributesMsg as it is redundant with _peerAttributesBuf */
 }
 
@@ -122,17 +137,12 @@ status_t PZGHeartbeatPacket :: Unflatten(DataUnflattener & unflat)
    _isFullyAttached              = ((_peerType & 0x8000) != 0); _peerType &= ~(0x8000);
    const uint32 opListItemCount  = unflat.ReadInt16();
    const uint32 attribBufSize    = unflat.ReadInt16();
-   (void)                          unflat.ReadInt16();   /* skip the currently-unused reserved field, for now */
+   const uint16 flags            = unflat.ReadInt16();
+   _isCaughtUp                   = ((flags & 0x0001) != 0);
+   const bool hasSDIs            = ((flags & 0x0002) != 0);
+   const uint32 numOTRs          = (flags >> 8);   // the other bits are reserved, for now
 
-   _orderedPeersList.Clear();
-   MRETURN_ON_ERROR(_orderedPeersList.EnsureSize(opListItemCount));
-   for (uint32 i=0; i<opListItemCount; i++)
-   {
-       PZGHeartbeatPeerInfoRef newPIRef = GetPZGHeartbeatPeerInfoFromPool();
-       MRETURN_OOM_ON_NULL(newPIRef());
-       MRETURN_ON_ERROR(unflat.ReadFlat(*newPIRef()));
-       MRETURN_ON_ERROR(_orderedPeersList.AddTail(newPIRef));
-   }
+   MRETURN_ON_ERROR(UnflattenPeerInfos(unflat, opListItemCount, _orderedPeersList));
 
    if (attribBufSize > 0)
    {
@@ -150,9 +160,37 @@ status_t PZGHeartbeatPacket :: Unflatten(DataUnflattener & unflat)
 
    _peerAttributesMsg.Reset();  // this can be demand-allocated later, if necessary
 
+   MRETURN_ON_ERROR(UnflattenPeerInfos(unflat, numOTRs, _observerTimingReplies));
+
+   _seniorDatabaseIndices.Clear();
+   if (hasSDIs)
+   {
+      const uint32 numSDIs = unflat.ReadInt16();
+      if ((numSDIs*sizeof(uint16)) > unflat.GetNumBytesAvailable())
+      {
+         LogTime(MUSCLE_LOG_ERROR, "PZGHeartbeatPacket::Unflatten():  Too many senior-database indices! (" UINT32_FORMAT_SPEC ")\n", numSDIs);
+         return B_BAD_DATA;
+      }
+      MRETURN_ON_ERROR(_seniorDatabaseIndices.EnsureSize(numSDIs));
+      for (uint32 i=0; i<numSDIs; i++) MRETURN_ON_ERROR(_seniorDatabaseIndices.AddTail(unflat.ReadInt16()));
+   }
    return unflat.GetStatus();
 }
 
+status_t PZGHeartbeatPacket :: UnflattenPeerInfos(DataUnflattener & unflat, uint32 numPeerInfos, Queue<ConstPZGHeartbeatPeerInfoRef> & retPeerInfos)
+{
+   retPeerInfos.Clear();
+   MRETURN_ON_ERROR(retPeerInfos.EnsureSize(numPeerInfos));
+   for (uint32 i=0; i<numPeerInfos; i++)
+   {
+       PZGHeartbeatPeerInfoRef newPIRef = GetPZGHeartbeatPeerInfoFromPool();
+       MRETURN_OOM_ON_NULL(newPIRef());
+       MRETURN_ON_ERROR(unflat.ReadFlat(*newPIRef()));
+       MRETURN_ON_ERROR(retPeerInfos.AddTail(newPIRef));
+   }
+   return B_NO_ERROR;
+}
+
 status_t PZGHeartbeatPacket :: CopyFromImplementation(const Flattenable & copyFrom)
 {
    const PZGHeartbeatPacket * p = dynamic_cast<const PZGHeartbeatPacket *>(&copyFrom);
@@ -163,7 +201,7 @@ status_t PZGHeartbeatPacket :: CopyFromImplementation(const Flattenable & copyFr
 String PZGHeartbeatPacket :: ToString() const
 {
    char buf[1024];
-   muscleSprintf(buf, "Heartbeat:  PacketID=" UINT32_FORMAT_SPEC " cversion=[%s] sysKey=" UINT64_FORMAT_SPEC " netSendTime=" UINT64_FORMAT_SPEC " tcpPort=%u peerType=%u isFullyAttached=%i uptimeSeconds=" UINT32_FORMAT_SPEC " sourcePeerID=[%s] attrSize=" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC, _heartbeatPacketID, CompatibilityVersionCodeToString(_versionCode)(), _systemKey, _networkSendTimeMicros, _tcpAcceptPort, _peerType, _isFullyAttached, _peerUptimeSeconds, _sourcePeerID.ToString()(), _peerAttributesBuf()?_peerAttributesBuf()->GetNumBytes():666, _peerAttributesBuf()?_peerAttributesBuf()->CalculateChecksum():666);
+   muscleSprintf(buf, "Heartbeat:  PacketID=" UINT32_FORMAT_SPEC " cversion=[%s] sysKey=" UINT64_FORMAT_SPEC " netSendTime=" UINT64_FORMAT_SPEC " tcpPort=%u peerType=%u isFullyAttached=%i isCaughtUp=%i uptimeSeconds=" UINT32_FORMAT_SPEC " sourcePeerID=[%s] attrSize=" UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC, _heartbeatPacketID, CompatibilityVersionCodeToString(_versionCode)(), _systemKey, _networkSendTimeMicros, _tcpAcceptPort, _peerType, _isFullyAttached, _isCaughtUp, _peerUptimeSeconds, _sourcePeerID.ToString()(), _peerAttributesBuf()?_peerAttributesBuf()->GetNumBytes():666, _peerAttributesBuf()?_peerAttributesBuf()->CalculateChecksum():666);
 
    String ret = buf;
    for (uint32 i=0; i<_orderedPeersList.GetNumItems(); i++)
@@ -172,6 +210,21 @@ String PZGHeartbeatPacket :: ToString() const
       ret += buf;
       ret += _orderedPeersList[i]()->ToString();
    }
+   for (uint32 i=0; i<_observerTimingReplies.GetNumItems(); i++)
+   {
+      muscleSprintf(buf, "\n   OTR #" UINT32_FORMAT_SPEC ": ", i);
+      ret += buf;
+      ret += _observerTimingReplies[i]()->ToString();
+   }
+   if (_seniorDatabaseIndices.HasItems())
+   {
+      ret += "\n   SeniorDBs:";
+      for (uint32 i=0; i<_seniorDatabaseIndices.GetNumItems(); i++)
+      {
+         muscleSprintf(buf, " " UINT32_FORMAT_SPEC, _seniorDatabaseIndices[i]);
+         ret += buf;
+      }
+   }
 
    ConstMessageRef attribMsg = GetPeerAttributesAsMessage();
    if (attribMsg())
@@ -223,8 +276,8 @@ PZGHeartbeatPacketWithMetaData :: PZGHeartbeatPacketWithMetaData()
    // empty
 }
 
-PZGHeartbeatPacketWithMetaData :: PZGHeartbeatPacketWithMetaData(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, uint32 packetID)
-   : PZGHeartbeatPacket(hbSettings, uptimeSeconds, isFullyAttached, packetID)
+PZGHeartbeatPacketWithMetaData :: PZGHeartbeatPacketWithMetaData(const PZGHeartbeatSettings & hbSettings, uint32 uptimeSeconds, bool isFullyAttached, bool isCaughtUp, uint32 packetID)
+   : PZGHeartbeatPacket(hbSettings, uptimeSeconds, isFullyAttached, isCaughtUp, packetID)
    , _localReceiveTimeMicros(0)
    , _sourceTag(0)
    , _haveSentTimingReply(false)
@@ -86,6 +86,9 @@ void PZGHeartbeatSession :: MessageReceivedFromInternalThread(const MessageRef &
 
          const ZGPeerID & newSeniorPeerID = GetSeniorPeerID();
          if (newSeniorPeerID != oldSeniorPeerID) _master->SeniorPeerChanged(oldSeniorPeerID, newSeniorPeerID);
+
+         // Last, let our master re-evaluate anything that depends on the peers' current heartbeat-info (e.g. which peers are caught up)
+         _master->PeersListUpdated();
       }
       break;
 
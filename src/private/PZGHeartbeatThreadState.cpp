@@ -26,7 +26,9 @@ static PZGHeartbeatPacketWithMetaDataRef GetHeartbeatPacketWithMetaDataFromPool(
    return PZGHeartbeatPacketWithMetaDataRef(_heartbeatPool.ObtainObject());
 }
 
-PZGHeartbeatThreadState :: PZGHeartbeatThreadState() : _zlibCodec(9)
+PZGHeartbeatThreadState :: PZGHeartbeatThreadState()
+   : _mainThreadIsCaughtUp(false)
+   , _zlibCodec(9)
 {
    // empty
 }
@@ -54,6 +56,7 @@ void PZGHeartbeatThreadState :: Initialize(const ConstPZGHeartbeatSettingsRef &
    _updateOfficialPeersListPending    = false;
    _forceOfficialPeersUpdate          = false;
    _heartbeatSourceTagCounter         = 0;
+   _nextObserverTimingReplyIndex      = 0;
    _mdioKeys.Clear();
 }
 
@@ -138,12 +141,15 @@ void PZGHeartbeatThreadState :: Pulse(Queue<MessageRef> & messagesForOwnerThread
 
       // Update the main-thread-accessible latencies table, just so we don't have to lock our own data structures all the time
       DECLARE_MUTEXGUARD(_mainThreadLatenciesLock);
-      for (ConstHashtableIterator<ZGPeerID, Queue<IPAddressAndPort> > iter(_peerIDToIPAddresses); iter.HasData(); iter++)
+      for (uint32 i=0; i<2; i++)
       {
-         const ZGPeerID & peerID = iter.GetKey();
-         const Queue<IPAddressAndPort> & sourceQ = iter.GetValue();
-         PZGHeartbeatSourceState * hss = sourceQ.HasItems() ? _onlineSources[PZGHeartbeatSourceKey(sourceQ.Head(), peerID)]() : NULL;
-         (void) _mainThreadLatencies.Put(peerID, ((hss)&&(hss->GetHeartbeatPacket()() != NULL)) ? hss->GetPreferredAverageValue(0) : MUSCLE_TIME_NEVER);
+         for (ConstHashtableIterator<ZGPeerID, Queue<IPAddressAndPort> > iter((i==0)?_peerIDToIPAddresses:_observerPeerIDToIPAddresses); iter.HasData(); iter++)
+         {
+            const ZGPeerID & peerID = iter.GetKey();
+            const Queue<IPAddressAndPort> & sourceQ = iter.GetValue();
+            PZGHeartbeatSourceState * hss = sourceQ.HasItems() ? _onlineSources[PZGHeartbeatSourceKey(sourceQ.Head(), peerID)]() : NULL;
+            (void) _mainThreadLatencies.Put(peerID, ((hss)&&(hss->GetHeartbeatPacket()() != NULL)) ? hss->GetPreferredAverageValue(0) : MUSCLE_TIME_NEVER);
+         }
       }
    }
 
@@ -165,9 +171,13 @@ status_t PZGHeartbeatThreadState :: SendHeartbeatPackets()
    PZGHeartbeatPacketWithMetaDataRef hbRef = GetHeartbeatPacketWithMetaDataFromPool();
    MRETURN_OOM_ON_NULL(hbRef());
 
-   if (hbRef()) hbRef()->Initialize(*_hbSettings(), (uint32) MicrosToSeconds(_now-_heartbeatThreadStateBirthdate), IsFullyAttached(), ++_hbSettings()->_outgoingHeartbeatPacketIDCounter);
+   if (hbRef()) hbRef()->Initialize(*_hbSettings(), (uint32) MicrosToSeconds(_now-_heartbeatThreadStateBirthdate), IsFullyAttached(), _mainThreadIsCaughtUp.load(), ++_hbSettings()->_outgoingHeartbeatPacketIDCounter);
 
    PZGHeartbeatPacketWithMetaData & hb = *hbRef();
+   {
+      DECLARE_MUTEXGUARD(_mainThreadSeniorDatabaseIndicesLock);
+      hb.GetSeniorDatabaseIndices() = _mainThreadSeniorDatabaseIndices;
+   }
    if ((_hbSettings()->GetPeerType() == PEER_TYPE_FULL_PEER)&&(_now >= _halfAttachedTime))
    {
       const Queue<ZGPeerID> pids = CalculateOrderedPeersList();
@@ -179,6 +189,7 @@ status_t PZGHeartbeatThreadState :: SendHeartbeatPackets()
          if (hpiRef()) (void) hpis.AddTail(hpiRef);
                   else LogTime(MUSCLE_LOG_ERROR, "GetPZGHeartbeatPeerInfoRefFor() returned a NULL reference for peer [%s]\n", pids[i].ToString()());
       }
+      if (IAmTheSeniorPeer()) AddObserverTimingReplies(hb);
    }
 
    MRETURN_ON_ERROR(_rawScratchBuf.SetNumBytes(hb.FlattenedSize(), false));
@@ -224,6 +235,25 @@ status_t PZGHeartbeatThreadState :: SendHeartbeatPackets()
    return B_NO_ERROR;
 }
 
+// Junior-only peers aren't included in our ordered-peers-list (so that adding lots of them won't bloat every full peer's
+// heartbeats), but they still need timing replies from the senior peer in order to synchronize their network-time clocks.
+// So the senior peer includes timing replies for a few of them in each heartbeat, round-robin style.
+void PZGHeartbeatThreadState :: AddObserverTimingReplies(PZGHeartbeatPacketWithMetaData & hb)
+{
+   static const uint32 PZG_MAX_OBSERVER_TIMING_REPLIES_PER_HEARTBEAT = 4;
+
+   const uint32 numObservers = _observerPeerIDToIPAddresses.GetNumItems();
+   const uint32 numReplies   = muscleMin(numObservers, PZG_MAX_OBSERVER_TIMING_REPLIES_PER_HEARTBEAT);
+   if (numReplies == 0) return;
+
+   Queue<ConstPZGHeartbeatPeerInfoRef> & otrs = hb.GetObserverTimingReplies();
+   (void) otrs.EnsureSize(numReplies);
+   for (uint32 i=0; i<numReplies; i++)
+   {
+      ConstPZGHeartbeatPeerInfoRef hpiRef = GetPZGHeartbeatPeerInfoRefFor(_now, _observerPeerIDToIPAddresses.GetKeyAtWithDefault((_nextObserverTimingReplyIndex++)%numObservers));
+      if ((hpiRef())&&(hpiRef()->GetTimingInfos().HasItems())) (void) otrs.AddTail(hpiRef);  // no point sending a reply with nothing in it
+   }
+}
 
 void PZGHeartbeatThreadState :: PrintTimeSynchronizationDeltas() const
 {
@@ -250,7 +280,8 @@ void PZGHeartbeatThreadState :: UpdateToNetworkTimeOffset()
          const PZGHeartbeatPacketWithMetaData * seniorHB = hss ? hss->GetHeartbeatPacket()() : NULL;
          if (seniorHB)
          {
-            const uint64 roundTripTimeMicros = hss->GetPreferredAverageValue(_now-_heartbeatExpirationTimeMicros);
+            // Junior-only peers get timing replies from the senior peer only every so often (see AddObserverTimingReplies()), so they'll accept older measurements
+            const uint64 roundTripTimeMicros = hss->GetPreferredAverageValue((_hbSettings()->GetPeerType() == PEER_TYPE_FULL_PEER) ? (_now-_heartbeatExpirationTimeMicros) : 0);
             const uint64 seniorNetTime = seniorHB->GetNetworkSendTimeMicros();
             const uint64 localRecvTime = seniorHB->GetLocalReceiveTimeMicros();
             _mainThreadToNetworkTimeOffset = _toNetworkTimeOffset = seniorNetTime-(localRecvTime-(roundTripTimeMicros/2));
@@ -261,6 +292,7 @@ void PZGHeartbeatThreadState :: UpdateToNetworkTimeOffset()
 }
 
 // Returns true iff the ZGPeerIDs in (idQ) are the same as the keys in our own _peerIDToIPAddresses list (ordering doesn't matter)
+// Note that junior-only peers are never included in either list.
 bool PZGHeartbeatThreadState :: PeersListMatchesIgnoreOrdering(const Queue<ConstPZGHeartbeatPeerInfoRef> & infoQ) const
 {
    if (infoQ.GetNumItems() != _peerIDToIPAddresses.GetNumItems()) return false;
@@ -275,6 +307,8 @@ ZGPeerID PZGHeartbeatThreadState :: GetKingmakerPeerID() const
    for (ConstHashtableIterator<PZGHeartbeatSourceKey, PZGHeartbeatSourceStateRef> iter(_onlineSources); iter.HasData(); iter++)
    {
       const PZGHeartbeatPacketWithMetaData & hbPacket = *iter.GetValue()()->GetHeartbeatPacket()();
+      if (hbPacket.GetPeerType() != PEER_TYPE_FULL_PEER) continue;  // junior-only peers don't take part in the election
+
       const ZGPeerID & nextPID = hbPacket.GetSourcePeerID();
       if (((minPeerID.IsValid() == false)||(nextPID < minPeerID))&&(PeersListMatchesIgnoreOrdering(hbPacket.GetOrderedPeersList()))) minPeerID = nextPID;
    }
@@ -290,6 +324,8 @@ PZGHeartbeatSourceKey PZGHeartbeatThreadState :: GetKingmakerPeerSource() const
    for (ConstHashtableIterator<PZGHeartbeatSourceKey, PZGHeartbeatSourceStateRef> iter(_onlineSources); iter.HasData(); iter++)
    {
       const PZGHeartbeatPacketWithMetaData & hbPacket = *iter.GetValue()()->GetHeartbeatPacket()();
+      if (hbPacket.GetPeerType() != PEER_TYPE_FULL_PEER) continue;  // junior-only peers don't take part in the election
+
       const ZGPeerID & nextPID = hbPacket.GetSourcePeerID();
       if (((minPeerID.IsValid() == false)||(nextPID < minPeerID))&&(PeersListMatchesIgnoreOrdering(hbPacket.GetOrderedPeersList())))
       {
@@ -393,7 +429,7 @@ ConstPZGHeartbeatPeerInfoRef PZGHeartbeatThreadState :: GetPZGHeartbeatPeerInfoR
 
    ret()->SetPeerID(peerID);
 
-   const Queue<IPAddressAndPort> * sources = _peerIDToIPAddresses.Get(peerID);
+   const Queue<IPAddressAndPort> * sources = GetPeerSources(peerID);
    if ((sources)&&(sources->HasItems()))
    {
       for (uint32 i=0; i<sources->GetNumItems(); i++)
@@ -512,27 +548,24 @@ void PZGHeartbeatThreadState :: ReceiveMulticastTraffic(PacketDataIO & dio)
             if (newHB()->GetSystemKey() == _hbSettings()->GetSystemKey())
             {
                // See if we can use this heartbeat to compute an estimate of the multicast-packet-round-trip time (from us to him to us)
-               const Queue<ConstPZGHeartbeatPeerInfoRef> & opq = newHB()->GetOrderedPeersList();
-               for (uint32 i=0; i<opq.GetNumItems(); i++)
+               // If we're a junior-only peer, our timing info (if any) will be in the observer-timing-replies list instead
+               const PZGHeartbeatPeerInfo * pi = GetLocalPeerInfo(newHB()->GetOrderedPeersList());
+               if (pi == NULL) pi = GetLocalPeerInfo(newHB()->GetObserverTimingReplies());
+               if (pi)
                {
-                  const PZGHeartbeatPeerInfo & pi = *opq[i]();
-                  if (pi.GetPeerID() == _hbSettings()->GetLocalPeerID())
+                  const Queue<PZGHeartbeatPeerInfo::PZGTimingInfo> & tis = pi->GetTimingInfos();
+                  for (uint32 j=0; j<tis.GetNumItems(); j++)
                   {
-                     const Queue<PZGHeartbeatPeerInfo::PZGTimingInfo> & tis = pi.GetTimingInfos();
-                     for (uint32 j=0; j<tis.GetNumItems(); j++)
+                     const PZGHeartbeatPeerInfo::PZGTimingInfo & ti = tis[j];
+                     const IPAddressAndPort * multicastIAP = _heartbeatSourceTagToDest.Get(ti.GetSourceTag());  // an ff12::blah multicast address
+                     if (multicastIAP)
                      {
-                        const PZGHeartbeatPeerInfo::PZGTimingInfo & ti = tis[j];
-                        const IPAddressAndPort * multicastIAP = _heartbeatSourceTagToDest.Get(ti.GetSourceTag());  // an ff12::blah multicast address
-                        if (multicastIAP)
-                        {
-                           const uint32 dwellTime = ti.GetDwellTimeMicros();
-                           const uint64 * packetLocalSendTime = (dwellTime == MUSCLE_NO_LIMIT) ? NULL : _recentlySentHeartbeatLocalSendTimes.Get(ti.GetSourceHeartbeatPacketID());
-                           PZGHeartbeatSourceStateRef * sourceInfo = packetLocalSendTime ? _onlineSources.Get(source) : NULL;
-                           if (sourceInfo) (void) sourceInfo->GetItemPointer()->AddMeasurement(*multicastIAP, localReceiveTimeMicros-(*packetLocalSendTime+dwellTime), _now);
-                           break;
-                        }
+                        const uint32 dwellTime = ti.GetDwellTimeMicros();
+                        const uint64 * packetLocalSendTime = (dwellTime == MUSCLE_NO_LIMIT) ? NULL : _recentlySentHeartbeatLocalSendTimes.Get(ti.GetSourceHeartbeatPacketID());
+                        PZGHeartbeatSourceStateRef * sourceInfo = packetLocalSendTime ? _onlineSources.Get(source) : NULL;
+                        if (sourceInfo) (void) sourceInfo->GetItemPointer()->AddMeasurement(*multicastIAP, localReceiveTimeMicros-(*packetLocalSendTime+dwellTime), _now);
+                        break;
                      }
-                     break;
                   }
                }
 
@@ -547,6 +580,12 @@ void PZGHeartbeatThreadState :: ReceiveMulticastTraffic(PacketDataIO & dio)
                   // When a peer becomes fully attached we'll force a resend because we don't tell the main thread about non-fully-attached peers
                   if (oldHB()->IsFullyAttached() != newHB()->IsFullyAttached()) ScheduleUpdateOfficialPeersList(true);
 
+                  // Ditto when a peer becomes caught up, since that may make it eligible to be the senior peer of some databases
+                  if (oldHB()->IsCaughtUp() != newHB()->IsCaughtUp()) ScheduleUpdateOfficialPeersList(true);
+
+                  // And when a peer takes on (or gives up) a database, so that everyone will agree on who that database's senior peer is
+                  if (oldHB()->GetSeniorDatabaseIndices() != newHB()->GetSeniorDatabaseIndices()) ScheduleUpdateOfficialPeersList(true);
+
                   oldSource()->SetHeartbeatPacket(newHB, localExpirationTimeMicros);
                }
                else
@@ -566,11 +605,20 @@ void PZGHeartbeatThreadState :: ReceiveMulticastTraffic(PacketDataIO & dio)
    }
 }
 
+const PZGHeartbeatPeerInfo * PZGHeartbeatThreadState :: GetLocalPeerInfo(const Queue<ConstPZGHeartbeatPeerInfoRef> & infoQ) const
+{
+   for (uint32 i=0; i<infoQ.GetNumItems(); i++) if (infoQ[i]()->GetPeerID() == _hbSettings()->GetLocalPeerID()) return infoQ[i]();
+   return NULL;
+}
+
 MessageRef PZGHeartbeatThreadState :: UpdateOfficialPeersList(bool forceUpdate)
 {
    MessageRef ret;
 
-   const Queue<ZGPeerID> idQ = CalculateOrderedPeersList();
+   // Junior-only peers go at the end of the list, after all of the full peers; since they aren't part of the
+   // election, we just list them in peer-ID order, so that every peer will list them in the same order
+   Queue<ZGPeerID> idQ = CalculateOrderedPeersList();
+   if (idQ.EnsureSize(idQ.GetNumItems()+_observerPeerIDToIPAddresses.GetNumItems()).IsOK()) for (ConstHashtableIterator<ZGPeerID, Queue<IPAddressAndPort> > iter(_observerPeerIDToIPAddresses); iter.HasData(); iter++) (void) idQ.AddTail(iter.GetKey());
 
    // Convert the list of ZGPeerIDs into the equivalent list of ConstPZGHeartbeatPacketWithMetaDataRef's
    // note that a given ZGPeerID may have more than one ConstPZGHeartbeatPacketWithMetaDataRef, if we
@@ -579,7 +627,7 @@ MessageRef PZGHeartbeatThreadState :: UpdateOfficialPeersList(bool forceUpdate)
    for (uint32 i=0; i<idQ.GetNumItems(); i++)
    {
       const ZGPeerID & pid = idQ[i];
-      const Queue<IPAddressAndPort> * q = _peerIDToIPAddresses.Get(pid);
+      const Queue<IPAddressAndPort> * q = GetPeerSources(pid);
       if (q) for (uint32 j=0; j<q->GetNumItems(); j++) (void) newPeers.PutWithDefault(PZGHeartbeatSourceKey((*q)[j], pid));
    }
 
@@ -611,11 +659,13 @@ void PZGHeartbeatThreadState :: ExpireSource(const PZGHeartbeatSourceKey & sourc
    {
       LogTime(MUSCLE_LOG_DEBUG, "Source [%s] is now offline [%s].\n", source.ToString()(), sourceInfo()->GetHeartbeatPacket()()->ToString()());
 
-      const ZGPeerID & pid = sourceInfo()->GetHeartbeatPacket()()->GetSourcePeerID();
-      Queue<IPAddressAndPort> * q = _peerIDToIPAddresses.Get(pid);
+      const PZGHeartbeatPacketWithMetaData & hb = *sourceInfo()->GetHeartbeatPacket()();
+      const ZGPeerID & pid = hb.GetSourcePeerID();
+      Hashtable<ZGPeerID, Queue<IPAddressAndPort> > & table = GetPeerTableForType(hb.GetPeerType());
+      Queue<IPAddressAndPort> * q = table.Get(pid);
       if ((q)&&(q->RemoveFirstInstanceOf(source.GetIPAddressAndPort()).IsOK())&&(q->IsEmpty()))
       {
-         (void) _peerIDToIPAddresses.Remove(pid);
+         (void) table.Remove(pid);
 
          DECLARE_MUTEXGUARD(_mainThreadLatenciesLock);
          (void) _mainThreadLatencies.Remove(pid);
@@ -635,14 +685,24 @@ void PZGHeartbeatThreadState :: IntroduceSource(const PZGHeartbeatSourceKey & so
    {
       const ZGPeerID & pid = newHB()->GetSourcePeerID();
 
-      Queue<IPAddressAndPort> * q = _peerIDToIPAddresses.GetOrPut(pid);
+      Hashtable<ZGPeerID, Queue<IPAddressAndPort> > & table = GetPeerTableForType(newHB()->GetPeerType());
+      const bool isNewPeer = (table.ContainsKey(pid) == false);
+      Queue<IPAddressAndPort> * q = table.GetOrPut(pid);
       if (q) (void) q->AddTail(source.GetIPAddressAndPort());
+      if ((isNewPeer)&&(newHB()->GetPeerType() != PEER_TYPE_FULL_PEER)) (void) table.SortByKey();  // keep the observers in peer-ID order
 
       ScheduleUpdateOfficialPeersList(true);
       LogTime(MUSCLE_LOG_DEBUG, "Source [%s] is now online [%s].\n", source.ToString()(), newHB()->ToString()());
    }
 }
 
+// This method is called by the main thread!  Hence the MutexGuard
+void PZGHeartbeatThreadState :: MainThreadSetSeniorDatabaseIndices(const Queue<uint32> & seniorDatabaseIndices)
+{
+   DECLARE_MUTEXGUARD(_mainThreadSeniorDatabaseIndicesLock);
+   _mainThreadSeniorDatabaseIndices = seniorDatabaseIndices;
+}
+
 // This method may be called by the main thread!  Hence the MutexGuard
 uint64 PZGHeartbeatThreadState :: GetEstimatedLatencyToPeer(const ZGPeerID & peerID) const
 {
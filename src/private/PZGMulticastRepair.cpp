@@ -0,0 +1,240 @@
+#include "zg/ZGConstants.h"  // for GetRandomNumber()
+#include "zg/private/PZGMulticastRepair.h"
+
+namespace zg_private
+{
+
+enum {
+   PZG_MULTICAST_COMMAND_NACK = 1886282091 // 'pnak'
+};
+
+static const String PZG_MULTICAST_NAME_SEQUENCE_NUMBER  = "msq";  // uint32:  sequence number of a sequenced multicast Message
+static const String PZG_MULTICAST_NAME_LAST_SENT_SEQNUM = "lsq";  // uint32:  sequence number of the sender's most recent sequenced Message (added to beacons)
+static const String PZG_MULTICAST_NAME_NACK_SOURCE      = "nks";  // ZGPeerID:  the peer whose Messages are being NACK-ed
+static const String PZG_MULTICAST_NAME_NACK_RANGE       = "nkr";  // uint32 pairs:  (first, last) sequence numbers of each NACK-ed range
+
+static bool IsInNackRanges(const Message & nackMsg, uint32 seqNum)
+{
+   uint32 first, last;
+   for (uint32 i=0; ((nackMsg.FindInt32(PZG_MULTICAST_NAME_NACK_RANGE, i*2, first).IsOK())&&(nackMsg.FindInt32(PZG_MULTICAST_NAME_NACK_RANGE, (i*2)+1, last).IsOK())); i++)
+      if ((seqNum >= first)&&(seqNum <= last)) return true;
+   return false;
+}
+
+PZGMulticastRepair :: PZGMulticastRepair()
+   : _lastSentSeqNum(0)
+   , _lastWrittenSeqNum(0)
+   , _retransmitTime(MUSCLE_TIME_NEVER)
+   , _randomSeed((unsigned int) (GetRunTime64()+GetCurrentTime64()+(uintptr)this))
+{
+   // empty
+}
+
+bool PZGMulticastRepair :: IsNackMessage(const Message & msg)
+{
+   return (msg.what == PZG_MULTICAST_COMMAND_NACK);
+}
+
+bool PZGMulticastRepair :: IsNackAddressedTo(const Message & nackMsg, const ZGPeerID & peerID)
+{
+   ZGPeerID sourcePeerID;
+   return ((IsNackMessage(nackMsg))&&(nackMsg.FindFlat(PZG_MULTICAST_NAME_NACK_SOURCE, sourcePeerID).IsOK())&&(sourcePeerID == peerID));
+}
+
+uint32 PZGMulticastRepair :: GetSequenceNumber(const Message & msg)
+{
+   return msg.GetInt32(PZG_MULTICAST_NAME_SEQUENCE_NUMBER);
+}
+
+status_t PZGMulticastRepair :: MessageSent(const MessageRef & msg)
+{
+   const uint32 seqNum = _lastSentSeqNum+1;
+   MRETURN_ON_ERROR(msg()->ReplaceInt32(true, PZG_MULTICAST_NAME_SEQUENCE_NUMBER, seqNum));
+   _lastSentSeqNum = seqNum;  // even if we can't buffer the Message, the receivers should know that it was sent
+
+   const status_t ret = _retransmitBuffer.Put(seqNum, SentMessageInfo(msg));
+   TrimRetransmitBuffer(GetRunTime64());
+   return ret;
+}
+
+void PZGMulticastRepair :: MessagesWritten(uint32 firstUnwrittenSeqNum, uint64 now)
+{
+   const uint32 lastWritten = muscleMin(firstUnwrittenSeqNum-1, _lastSentSeqNum);
+   if ((firstUnwrittenSeqNum == 0)||(lastWritten <= _lastWrittenSeqNum)) return;
+
+   // Messages age out of our retransmit buffer based on when they were written, not on when they were queued
+   for (uint32 seqNum=_lastWrittenSeqNum+1; seqNum<=lastWritten; seqNum++)
+   {
+      SentMessageInfo * smi = _retransmitBuffer.Get(seqNum);
+      if (smi) smi->SetSendTime(now);
+   }
+   _lastWrittenSeqNum = lastWritten;
+}
+
+void PZGMulticastRepair :: NackReceived(const Message & nackMsg, uint64 now)
+{
+   if (_retransmitBuffer.IsEmpty()) return;
+
+   const uint32 firstBuffered = *_retransmitBuffer.GetFirstKey();  // guaranteed non-NULL, since the buffer isn't empty
+   uint32 first, last;
+   for (uint32 i=0; ((nackMsg.FindInt32(PZG_MULTICAST_NAME_NACK_RANGE, i*2, first).IsOK())&&(nackMsg.FindInt32(PZG_MULTICAST_NAME_NACK_RANGE, (i*2)+1, last).IsOK())); i++)
+   {
+      last = muscleMin(last, _lastWrittenSeqNum);  // paranoia:  don't let a bogus range make us loop for a long time (and Messages that are still queued will be sent anyway)
+      for (uint32 seqNum=muscleMax(first, firstBuffered); seqNum<=last; seqNum++)
+      {
+         // If we retransmitted this Message very recently, this NACK probably crossed paths with our retransmission, so we won't send it again yet
+         const SentMessageInfo * smi = _retransmitBuffer.Get(seqNum);
+         if ((smi)&&((smi->GetLastRetransmitTime() == 0)||(now >= smi->GetLastRetransmitTime()+(PZG_MULTICAST_NACK_RETRY_MICROS/2)))) (void) _pendingRetransmits.PutWithDefault(seqNum);
+      }
+   }
+
+   // We wait a little while before retransmitting, so that NACKs from other receivers for the same Messages can be answered by the same retransmission
+   if ((_pendingRetransmits.HasItems())&&(_retransmitTime == MUSCLE_TIME_NEVER)) _retransmitTime = now+PZG_MULTICAST_RETRANSMIT_HOLDOFF_MICROS;
+}
+
+void PZGMulticastRepair :: GetMessagesToRetransmit(uint64 now, Queue<MessageRef> & retMsgs)
+{
+   if (now < _retransmitTime) return;
+
+   TrimRetransmitBuffer(now);
+   _pendingRetransmits.SortByKey();
+   for (ConstHashtableIterator<uint32, Void> iter(_pendingRetransmits); iter.HasData(); iter++)
+   {
+      SentMessageInfo * smi = _retransmitBuffer.Get(iter.GetKey());
+      if ((smi)&&(retMsgs.AddTail(smi->GetSentMessage()).IsOK())) smi->SetLastRetransmitTime(now);
+   }
+   _pendingRetransmits.Clear();
+   _retransmitTime = MUSCLE_TIME_NEVER;
+}
+
+void PZGMulticastRepair :: TrimRetransmitBuffer(uint64 now)
+{
+   // Note that Messages that haven't been written yet (i.e. whose send time is still 0) don't age out
+   while((_retransmitBuffer.GetNumItems() > PZG_MULTICAST_RETRANSMIT_BUFFER_SIZE)||((_retransmitBuffer.HasItems())&&(_retransmitBuffer.GetFirstValue()->GetSendTime() > 0)&&(now > _retransmitBuffer.GetFirstValue()->GetSendTime()+PZG_MULTICAST_RETRANSMIT_BUFFER_MAX_AGE))) (void) _retransmitBuffer.RemoveFirst();
+}
+
+void PZGMulticastRepair :: MessageReceived(const ZGPeerID & sourcePeerID, const Message & msg, uint64 now)
+{
+   uint32 seqNum;
+   if (msg.FindInt32(PZG_MULTICAST_NAME_SEQUENCE_NUMBER, seqNum).IsOK()) SequenceNumberSeen(sourcePeerID, seqNum, true, now);
+}
+
+void PZGMulticastRepair :: BeaconReceived(const ZGPeerID & sourcePeerID, const Message & beaconMsg, uint64 now)
+{
+   uint32 lastSentSeqNum;
+   if (beaconMsg.FindInt32(PZG_MULTICAST_NAME_LAST_SENT_SEQNUM, lastSentSeqNum).IsOK()) SequenceNumberSeen(sourcePeerID, lastSentSeqNum, false, now);
+}
+
+status_t PZGMulticastRepair :: AddLastSentSequenceNumberToBeacon(Message & beaconMsg) const
+{
+   return (_lastSentSeqNum > 0) ? beaconMsg.ReplaceInt32(true, PZG_MULTICAST_NAME_LAST_SENT_SEQNUM, _lastSentSeqNum) : B_NO_ERROR;
+}
+
+void PZGMulticastRepair :: SequenceNumberSeen(const ZGPeerID & sourcePeerID, uint32 seqNum, bool isMessageReceived, uint64 now)
+{
+   if (seqNum == 0) return;  // paranoia
+
+   SourceState * ss = _sources.GetOrPut(sourcePeerID);
+   if (ss == NULL) return;  // out of memory?
+
+   ss->SetLastHeardTime(now);
+
+   Hashtable<uint32, MissingMessageInfo> & missing = ss->GetMissingMessages();
+   const uint32 highestSeqNum = ss->GetHighestSequenceNumber();
+   if (highestSeqNum == 0) ss->SetHighestSequenceNumber(seqNum);  // first we've heard from this source; anything it sent earlier is the catch-up mechanism's business
+   else if (seqNum > highestSeqNum)
+   {
+      // Every sequence number between the highest one we had and this one is missing.  They all get the same
+      // NACK time, so that they'll be NACK-ed together.  (If (seqNum) came from a beacon rather than from
+      // a received Message, then we're missing (seqNum) itself as well)
+      const uint32 lastMissing = isMessageReceived ? (seqNum-1) : seqNum;
+      if (lastMissing > highestSeqNum)
+      {
+         const uint32 firstMissing = muscleMax(highestSeqNum+1, (lastMissing >= PZG_MULTICAST_MAX_TRACKED_GAP) ? (lastMissing-PZG_MULTICAST_MAX_TRACKED_GAP+1) : (uint32)1);
+         const uint64 nackTime     = GetRandomNackTime(now);
+         for (uint32 i=firstMissing; i<=lastMissing; i++) (void) missing.Put(i, MissingMessageInfo(nackTime));
+         while(missing.GetNumItems() > PZG_MULTICAST_MAX_TRACKED_GAP) (void) missing.RemoveFirst();  // the oldest ones will have to be back-ordered
+      }
+      ss->SetHighestSequenceNumber(seqNum);
+   }
+   else if (isMessageReceived) (void) missing.Remove(seqNum);  // a late arrival, or a retransmission
+}
+
+uint64 PZGMulticastRepair :: GetRandomNackTime(uint64 now)
+{
+   // The random jitter makes it likely that one receiver's NACK goes out (and is overheard by the others) before the others send theirs
+   return now+PZG_MULTICAST_NACK_DELAY_MICROS+(((uint64)GetRandomNumber(&_randomSeed))%(PZG_MULTICAST_NACK_DELAY_MICROS+1));
+}
+
+void PZGMulticastRepair :: NackOverheard(const Message & nackMsg, uint64 now)
+{
+   ZGPeerID sourcePeerID;
+   if ((IsNackMessage(nackMsg) == false)||(nackMsg.FindFlat(PZG_MULTICAST_NAME_NACK_SOURCE, sourcePeerID).IsError())) return;
+
+   SourceState * ss = _sources.Get(sourcePeerID);
+   if (ss == NULL) return;
+
+   for (HashtableIterator<uint32, MissingMessageInfo> iter(ss->GetMissingMessages()); iter.HasData(); iter++)
+      if (IsInNackRanges(nackMsg, iter.GetKey())) iter.GetValue().NackOverheard(now);
+}
+
+void PZGMulticastRepair :: GetNacksToSend(uint64 now, Queue<MessageRef> & retMsgs)
+{
+   ExpireIdleSources(now);
+
+   for (HashtableIterator<ZGPeerID, SourceState> iter(_sources); iter.HasData(); iter++)
+   {
+      Hashtable<uint32, MissingMessageInfo> & missing = iter.GetValue().GetMissingMessages();
+
+      // (missing) is sorted by sequence number, so consecutive due sequence numbers can be NACK-ed as a single range
+      MessageRef nackMsg;
+      uint32 numRanges = 0, rangeFirst = 0, rangeLast = 0;
+      for (HashtableIterator<uint32, MissingMessageInfo> mIter(missing); mIter.HasData(); mIter++)
+      {
+         const uint32 seqNum = mIter.GetKey();
+         MissingMessageInfo & mmi = mIter.GetValue();
+         if (now < mmi.GetNextNackTime()) continue;
+         if (mmi.GetNumNacksSent() >= PZG_MULTICAST_MAX_NACKS_PER_MESSAGE)
+         {
+            (void) missing.Remove(seqNum);  // the sender apparently can't help us with this one, so we'll leave it to the back-order mechanism
+            continue;
+         }
+
+         if ((numRanges > 0)&&(seqNum == rangeLast+1)) rangeLast = seqNum;
+         else
+         {
+            if (numRanges > 0)
+            {
+               if (numRanges == PZG_MULTICAST_MAX_NACK_RANGES_PER_MESSAGE) break;  // the rest will go out in the next NACK
+               if ((nackMsg()->AddInt32(PZG_MULTICAST_NAME_NACK_RANGE, rangeFirst).IsError())||(nackMsg()->AddInt32(PZG_MULTICAST_NAME_NACK_RANGE, rangeLast).IsError())) break;
+            }
+            else
+            {
+               nackMsg = GetMessageFromPool(PZG_MULTICAST_COMMAND_NACK);
+               if ((nackMsg() == NULL)||(nackMsg()->AddFlat(PZG_MULTICAST_NAME_NACK_SOURCE, iter.GetKey()).IsError())) return;  // out of memory?
+            }
+            numRanges++;
+            rangeFirst = rangeLast = seqNum;
+         }
+         mmi.NackSent(now);
+      }
+
+      if ((nackMsg())&&(nackMsg()->AddInt32(PZG_MULTICAST_NAME_NACK_RANGE, rangeFirst).IsOK())&&(nackMsg()->AddInt32(PZG_MULTICAST_NAME_NACK_RANGE, rangeLast).IsOK())) (void) retMsgs.AddTail(nackMsg);
+   }
+}
+
+void PZGMulticastRepair :: ExpireIdleSources(uint64 now)
+{
+   for (HashtableIterator<ZGPeerID, SourceState> iter(_sources); iter.HasData(); iter++)
+      if (now > iter.GetValue().GetLastHeardTime()+PZG_MULTICAST_SOURCE_EXPIRATION_MICROS) (void) _sources.Remove(iter.GetKey());
+}
+
+uint64 PZGMulticastRepair :: GetNextWakeupTime() const
+{
+   uint64 ret = _retransmitTime;
+   for (ConstHashtableIterator<ZGPeerID, SourceState> iter(_sources); iter.HasData(); iter++)
+      for (ConstHashtableIterator<uint32, MissingMessageInfo> mIter(iter.GetValue().GetMissingMessages()); mIter.HasData(); mIter++) ret = muscleMin(ret, mIter.GetValue().GetNextNackTime());
+   return ret;
+}
+
+}  // end namespace zg_private
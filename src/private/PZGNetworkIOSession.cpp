@@ -4,15 +4,19 @@
 
 #include "zg/ZGConstants.h"
 #include "zg/private/PZGConstants.h"
+#include "zg/private/PZGFECPacketDataIO.h"
+#include "zg/private/PZGMulticastRepair.h"
 #include "zg/private/PZGNetworkIOSession.h"
+#include "zg/private/PZGPacedPacketDataIO.h"
 
 namespace zg_private
 {
 
 enum {
-   PZG_NETWORK_COMMAND_SET_SENIOR_PEER_ID = 1886283124, // 'pnet'
+   PZG_NETWORK_COMMAND_SET_SENIOR_PEER_IDS = 1886283124, // 'pnet'
    PZG_NETWORK_COMMAND_SET_BEACON_DATA,
-   PZG_NETWORK_COMMAND_INVALIDATE_LAST_RECEIVED_BEACON_DATA
+   PZG_NETWORK_COMMAND_INVALIDATE_LAST_RECEIVED_BEACON_DATA,
+   PZG_NETWORK_COMMAND_FEC_LOSS_REPORT
 };
 
 static const String PZG_NETWORK_NAME_PEER_ID           = "pid";
@@ -20,6 +24,7 @@ static const String PZG_NETWORK_NAME_BEACON_DATA       = "bcd";
 static const String PZG_NETWORK_NAME_DATABASE_UPDATE   = "dbu";
 static const String PZG_NETWORK_NAME_MULTICAST_MESSAGE = "mms";
 static const String PZG_NETWORK_NAME_MULTICAST_TAG     = "mgt";
+static const String PZG_NETWORK_NAME_LOSS_RATE         = "lsr";
 
 enum {
    PZG_MULTICAST_MESSAGE_TAG_TYPE = 1886219636 // 'pmmt'
@@ -129,6 +134,32 @@ static MessageRef CreateBeaconDataMessage(const ConstPZGBeaconDataRef & beaconDa
    return msg;
 }
 
+// Returns a Message containing a delta beacon that will bring junior peers that have (oldBeaconData) up to (newBeaconData),
+// or a NULL reference if a full beacon should be sent instead (because there's nothing to build on, or every database changed)
+static MessageRef CreateDeltaBeaconDataMessage(const ConstPZGBeaconDataRef & oldBeaconData, const ConstPZGBeaconDataRef & newBeaconData, const PZGMulticastMessageTag & sourceTag)
+{
+   if ((oldBeaconData() == NULL)||(newBeaconData() == NULL)) return MessageRef();
+
+   PZGBeaconDataRef deltaRef = GetBeaconDataFromPool();
+   if ((deltaRef() == NULL)||(deltaRef()->SetToDelta(*oldBeaconData(), *newBeaconData()).IsError())) return MessageRef();
+   if (deltaRef()->GetDatabaseStateInfos().GetNumItems() >= newBeaconData()->GetDatabaseStateInfos().GetNumItems()) return MessageRef();  // the full beacon would be smaller
+
+   return CreateBeaconDataMessage(AddConstToRef(deltaRef), true, sourceTag);
+}
+
+// Returns a copy of (baseBeaconData) with the delta beacon (deltaBeaconData) applied to it, or a NULL reference
+// if we have no full beacon-data to apply the delta to (in which case we'll have to wait for the next full beacon)
+static ConstPZGBeaconDataRef GetBeaconDataWithDeltaApplied(const ConstPZGBeaconDataRef & baseBeaconData, const ConstPZGBeaconDataRef & deltaBeaconData)
+{
+   if (baseBeaconData() == NULL) return ConstPZGBeaconDataRef();
+
+   PZGBeaconDataRef ret = GetBeaconDataFromPool();
+   if (ret() == NULL) return ConstPZGBeaconDataRef();
+
+   *ret() = *baseBeaconData();
+   return ret()->ApplyDelta(*deltaBeaconData()).IsOK() ? AddConstToRef(ret) : ConstPZGBeaconDataRef();
+}
+
 // Given a Message previously created by CreateBeaconDataMessage(), tries to
 // retrieve and return the PZGBeaconDataRef from the Message.  Returns NULL ref on failure.
 static ConstPZGBeaconDataRef GetBeaconDataFromMessage(const MessageRef & msg)
@@ -142,11 +173,42 @@ static ConstPZGBeaconDataRef GetBeaconDataFromMessage(const MessageRef & msg)
    return AddConstToRef(beaconRef);
 }
 
+// Places (msg) ahead of any Messages that are still waiting in (gateway)'s outgoing-Message queue (e.g. because our output is being
+// paced), so that time-sensitive traffic like NACKs and retransmissions doesn't have to wait behind a large backlog of database updates.
+// New database updates are never sent this way, since the junior peers would see updates that overtake each other as lost updates.
+// Beacons aren't either, since their sequence number and database state IDs describe the updates that were queued before them.
+static status_t AddPriorityOutgoingMessage(PacketTunnelIOGateway & gateway, const MessageRef & msg)
+{
+   return gateway.GetOutgoingMessageQueue().AddHead(msg);
+}
+
+// Returns the sequence number of the oldest database update in (gateway)'s outgoing-Message queue that hasn't been written
+// to the network yet, or (repair.GetLastSentSequenceNumber()+1) if there isn't one.  Retransmissions (which are always of
+// updates that were already written) are skipped over.
+static uint32 GetFirstUnwrittenSequenceNumber(const PacketTunnelIOGateway & gateway, const PZGMulticastRepair & repair)
+{
+   const Queue<MessageRef> & q = gateway.GetOutgoingMessageQueue();
+   for (uint32 i=0; i<q.GetNumItems(); i++)
+   {
+      const Message & msg = *q[i]();
+      if (msg.what == PZG_PEER_COMMAND_UPDATE_JUNIOR_DATABASE)
+      {
+         const uint32 seqNum = PZGMulticastRepair::GetSequenceNumber(msg);
+         if (seqNum > repair.GetLastWrittenSequenceNumber()) return seqNum;
+      }
+   }
+   return repair.GetLastSentSequenceNumber()+1;
+}
+
 PZGNetworkIOSession :: PZGNetworkIOSession(const ZGPeerSettings & peerSettings, const ZGPeerID & localPeerID, ZGPeerSession * master)
    : _peerSettings(peerSettings)
    , _localPeerID(localPeerID)
    , _beaconIntervalMicros(SecondsToMicros(1)/muscleMax((uint32)1, peerSettings.GetBeaconsPerSecond()))
+   , _minBeaconIntervalMicros(muscleMin(peerSettings.GetMinimumBeaconInterval(), _beaconIntervalMicros))
+   , _maxBeaconIntervalMicros(muscleMax(peerSettings.GetMaximumBeaconInterval(), _beaconIntervalMicros))
    , _master(master)
+   , _nextSnapshotID(1)
+   , _localPeerIsCaughtUp(false)
    , _computerIsAsleep(false)
    , _hbSessionPtr(NULL)
 {
@@ -160,10 +222,10 @@ void PZGNetworkIOSession :: MessageReceivedFromInternalThread(const MessageRef &
    {
       if (msg()->what == PZG_NETWORK_COMMAND_SET_BEACON_DATA)
       {
-         if (tag.GetPeerID() == _seniorPeerID)
+         if (_beaconSourcePeerIDs.ContainsKey(tag.GetPeerID()))
          {
             ConstPZGBeaconDataRef beaconData = GetBeaconDataFromMessage(msg);
-            if (beaconData()) _master->BeaconDataChanged(beaconData);
+            if (beaconData()) _master->BeaconDataChanged(tag.GetPeerID(), beaconData);
                          else LogTime(MUSCLE_LOG_ERROR, "PZGNetworkIOSession:  Unable to get beacon data from internal thread Message\n");
          }
          else
@@ -201,6 +263,15 @@ status_t PZGNetworkIOSession :: AttachedToServer()
 
    if (SetupHeartbeatSession().IsError(ret)) {ShutdownChildSessions(); return ret;}
 
+   PZGSnapshotFlattenerSessionRef sfSessionRef(new PZGSnapshotFlattenerSession(this));
+   if (AddNewSession(sfSessionRef).IsError(ret))
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGNetworkIOSession::AttachedToServer():  Couldn't add snapshot flattener session! [%s]\n", ret());
+      ShutdownChildSessions();
+      return ret;
+   }
+   _snapshotFlattenerSession = sfSessionRef;
+
    return PZGThreadedSession::AttachedToServer();
 }
 
@@ -215,6 +286,8 @@ status_t PZGNetworkIOSession :: SetupHeartbeatSession()
       return ret;
    }
    _hbSession = hbSessionRef;
+   _hbSession()->MainThreadSetIsCaughtUp(_localPeerIsCaughtUp);
+   _hbSession()->MainThreadSetSeniorDatabaseIndices(_localSeniorDatabaseIndices);
 
    DECLARE_MUTEXGUARD(_hbSessionPtrMutex);
    _hbSessionPtr = _hbSession();
@@ -262,6 +335,12 @@ void PZGNetworkIOSession :: ShutdownChildSessions()
       _dnccSession.Reset();
    }
 
+   if (_snapshotFlattenerSession())
+   {
+      _snapshotFlattenerSession()->EndSession();  // blocks until the helper thread has exited
+      _snapshotFlattenerSession.Reset();
+   }
+
    ClearHeartbeatSession();
    ClearAllUnicastSessions();
 
@@ -329,12 +408,44 @@ void PZGNetworkIOSession :: SeniorPeerChanged(const ZGPeerID & oldSeniorPeerID,
    if (newSeniorPeerID != _seniorPeerID)
    {
       _seniorPeerID = newSeniorPeerID;
-      if (_master) _master->SeniorPeerChanged(oldSeniorPeerID, newSeniorPeerID);
+      if (_master) _master->SeniorPeerChanged(oldSeniorPeerID, newSeniorPeerID);  // which will call SetDatabaseSeniorPeerIDs() for us
+   }
+}
+
+void PZGNetworkIOSession :: PeersListUpdated()
+{
+   if (_master) _master->UpdateDatabaseSeniorPeerIDs();
+}
+
+void PZGNetworkIOSession :: SetDatabaseSeniorPeerIDs(const Queue<ZGPeerID> & databaseSeniorPeerIDs)
+{
+   Hashtable<ZGPeerID, Void> newSources;
+   for (uint32 i=0; i<databaseSeniorPeerIDs.GetNumItems(); i++) if (databaseSeniorPeerIDs[i].IsValid()) (void) newSources.PutWithDefault(databaseSeniorPeerIDs[i]);
+   if (newSources == _beaconSourcePeerIDs) return;
+
+   _beaconSourcePeerIDs.SwapContents(newSources);
 
-      // Let's tell the internal thread what the senior peer ID is too, so he
-      // can know which beacon datas to send us and which to ignore
-      MessageRef msg = GetMessageFromPool(PZG_NETWORK_COMMAND_SET_SENIOR_PEER_ID);
-      if ((msg() == NULL)||(msg()->AddFlat(PZG_NETWORK_NAME_PEER_ID, _seniorPeerID).IsError())||(SendMessageToInternalThread(msg).IsError())) LogTime(MUSCLE_LOG_ERROR, "PZGNetworkSession::SeniorPeerChanged:  Couldn't inform multicast thread!\n");
+   // Let's tell the internal thread what the senior peer IDs are too, so he
+   // can know which beacon datas to send us and which to ignore
+   status_t ret;
+   MessageRef msg = GetMessageFromPool(PZG_NETWORK_COMMAND_SET_SENIOR_PEER_IDS);
+   if (msg() == NULL) ret = B_OUT_OF_MEMORY;
+   for (ConstHashtableIterator<ZGPeerID, Void> iter(_beaconSourcePeerIDs); ((ret.IsOK())&&(iter.HasData())); iter++) ret = msg()->AddFlat(PZG_NETWORK_NAME_PEER_ID, iter.GetKey());
+   if ((ret.IsError())||(SendMessageToInternalThread(msg).IsError(ret))) LogTime(MUSCLE_LOG_ERROR, "PZGNetworkSession::SetDatabaseSeniorPeerIDs:  Couldn't inform multicast thread! [%s]\n", ret());
+}
+
+void PZGNetworkIOSession :: SetLocalPeerIsCaughtUp(bool isCaughtUp)
+{
+   _localPeerIsCaughtUp = isCaughtUp;
+   if (_hbSession()) _hbSession()->MainThreadSetIsCaughtUp(isCaughtUp);
+}
+
+void PZGNetworkIOSession :: SetLocalSeniorDatabaseIndices(const Queue<uint32> & seniorDatabaseIndices)
+{
+   if (seniorDatabaseIndices != _localSeniorDatabaseIndices)
+   {
+      _localSeniorDatabaseIndices = seniorDatabaseIndices;
+      if (_hbSession()) _hbSession()->MainThreadSetSeniorDatabaseIndices(seniorDatabaseIndices);
    }
 }
 
@@ -345,15 +456,22 @@ void PZGNetworkIOSession :: InternalThreadEntry()
 
    uint32 outgoingMulticastMessageTagCounter = 0; // tagging our outgoing Messages with a unique ID allows us to do de-duplication more easily
    Queue<PacketDataIORef> dios;
+   Queue<PZGPacedPacketDataIORef> pacedDIOs;      // one per DataIO in (dios); limits the rate at which we send multicast packets
+   Queue<PZGFECPacketDataIORef> fecDIOs;          // one per DataIO in (dios); adds forward-error-correction parity packets to our multicast traffic
    Queue<PacketTunnelIOGatewayRef> ptGateways; // our mechanism for transporting Message objects by packing them into UDP packets
    QueueGatewayMessageReceiver messageReceiver;   // a place that the ptGateways can store incoming/received Messages for us to collect
    Hashtable<PZGMulticastMessageTag, Void> recentlyReceived;  // PZGMulticastMessageTags that we have received recently
-
-   ZGPeerID seniorPeerID;
-   MessageRef outgoingBeaconMsg;
-   ConstPZGBeaconDataRef outgoingBeaconData;     // should be non-NULL only when when we are the senior peer
-   ConstPZGBeaconDataRef lastReceivedBeaconData;
-   uint64 nextBeaconSendTime = MUSCLE_TIME_NEVER;
+   PZGMulticastRepair repair;                     // sequence numbers, gap detection, NACKs and retransmissions for our multicast database updates
+
+   Hashtable<ZGPeerID, ConstPZGBeaconDataRef> lastReceivedBeaconDatas;  // senior peer ID -> most recent beacon-data received from that peer (or NULL if none yet)
+   MessageRef outgoingBeaconMsg;                 // cached full-beacon Message for (outgoingBeaconData)
+   ConstPZGBeaconDataRef outgoingBeaconData;     // should be non-NULL only when when we are the senior peer of at least one database
+   ConstPZGBeaconDataRef lastSentBeaconData;     // the beacon-data that the junior peers will have after receiving our most recent beacon
+   uint64 nextBeaconSendTime   = MUSCLE_TIME_NEVER;
+   uint64 lastBeaconSendTime   = 0;
+   uint64 beaconIntervalMicros = _beaconIntervalMicros;  // doubles after each beacon, while our beacon-data isn't changing
+   bool beaconDataChanged      = false;                  // true iff (outgoingBeaconData) has changed since we last sent a beacon
+   uint64 nextLossReportTime   = GetRunTime64()+PZG_FEC_LOSS_REPORT_INTERVAL_MICROS;
 
    // Multicast-data I/O thread's main event loop
    while(1)
@@ -371,6 +489,8 @@ void PZGNetworkIOSession :: InternalThreadEntry()
             (void) UnregisterInternalThreadSocket(dio()->GetWriteSelectSocket(), SOCKET_SET_WRITE);
          }
          dios.Clear();
+         pacedDIOs.Clear();
+         fecDIOs.Clear();
          ptGateways.Clear();
 
          // Install the new DataIO
@@ -382,25 +502,40 @@ void PZGNetworkIOSession :: InternalThreadEntry()
                PacketDataIORef & dio = dios[i];
                if (RegisterInternalThreadSocket(dio()->GetReadSelectSocket(), SOCKET_SET_READ).IsError()) LogTime(MUSCLE_LOG_ERROR, "PZGNetworkIOSession:  Couldn't register DataIO # " UINT32_FORMAT_SPEC " for input!\n", i);
 
+               // The pacing goes underneath the FEC layer, so that the parity packets are paced too
+               PZGPacedPacketDataIORef pacedRef(new PZGPacedPacketDataIO(dio, _peerSettings.GetMulticastPacingBytesPerSecond(), _peerSettings.GetMulticastPacingPacketsPerSecond()));
+               PZGFECPacketDataIORef fecRef(new PZGFECPacketDataIO(pacedRef, _peerSettings.GetMulticastFECGroupSize(), GetLocalPeerID().HashCode()));
                PacketTunnelIOGatewayRef ptRef(new PacketTunnelIOGateway);
-               if (ptGateways.AddTail(ptRef).IsOK()) ptRef()->SetDataIO(dio);
+               if ((pacedDIOs.AddTail(pacedRef).IsOK())&&(fecDIOs.AddTail(fecRef).IsOK())&&(ptGateways.AddTail(ptRef).IsOK())) ptRef()->SetDataIO(fecRef);
             }
          }
          else LogTime(MUSCLE_LOG_ERROR, "PZGNetworkIOSession:  Couldn't create Multicast DataIOs!\n");
       }
 
       // Figure out if we need to wake up as soon as we can send data, or not
-      for (uint32 i=0; i<dios.GetNumItems(); i++)
+      uint64 wakeupTime = muscleMin(nextBeaconSendTime, repair.GetNextWakeupTime(), nextLossReportTime);
       {
-         PacketDataIO & dio = *dios[i]();  // guaranteed non-NULL
-         const bool hasBytesToOutput = ptGateways[i]()->HasBytesToOutput();
-         if (hasBytesToOutput) (void)   RegisterInternalThreadSocket(dio.GetWriteSelectSocket(), SOCKET_SET_WRITE);
-                          else (void) UnregisterInternalThreadSocket(dio.GetWriteSelectSocket(), SOCKET_SET_WRITE);
+         const uint64 waitStartTime = GetRunTime64();
+         for (uint32 i=0; i<dios.GetNumItems(); i++)
+         {
+            PacketDataIO & dio = *dios[i]();  // guaranteed non-NULL
+            const uint64 parityFlushTime = fecDIOs[i]()->GetParityFlushTime();
+            const bool hasBytesToOutput  = ((ptGateways[i]()->HasBytesToOutput())||(parityFlushTime <= waitStartTime));
+            const uint64 nextSendTime    = pacedDIOs[i]()->GetNextSendTime(waitStartTime);
+            if ((hasBytesToOutput)&&(nextSendTime <= waitStartTime)) (void) RegisterInternalThreadSocket(dio.GetWriteSelectSocket(), SOCKET_SET_WRITE);
+            else
+            {
+               // While we're being paced, there's no point waking up when the socket has buffer space; we'll wake up when we're allowed to send again instead
+               (void) UnregisterInternalThreadSocket(dio.GetWriteSelectSocket(), SOCKET_SET_WRITE);
+               if (hasBytesToOutput) wakeupTime = muscleMin(wakeupTime, nextSendTime);
+            }
+            if (parityFlushTime > waitStartTime) wakeupTime = muscleMin(wakeupTime, parityFlushTime);
+         }
       }
 
       // Wait until there is data to receive (or until there is buffer space to send, if we need to send anything), or until we get a Message from the main thread
       MessageRef msgFromOwner;
-      if (WaitForNextMessageFromOwner(msgFromOwner, nextBeaconSendTime).IsOK())
+      if (WaitForNextMessageFromOwner(msgFromOwner, wakeupTime).IsOK())
       {
          if (msgFromOwner())
          {
@@ -413,28 +548,51 @@ void PZGNetworkIOSession :: InternalThreadEntry()
                }
                break;
 
-               case PZG_PEER_COMMAND_UPDATE_JUNIOR_DATABASE: case PZG_PEER_COMMAND_USER_MESSAGE:
+               case PZG_PEER_COMMAND_UPDATE_JUNIOR_DATABASE: case PZG_PEER_COMMAND_USER_MESSAGE: case PZG_PEER_COMMAND_CATCH_UP_OFFER:
                   if (msgFromOwner()->AddFlat(PZG_NETWORK_NAME_MULTICAST_TAG, PZGMulticastMessageTag(GetLocalPeerID(), _hbSettings()->GetCompatibilityVersionCode(), ++outgoingMulticastMessageTagCounter)).IsOK())
                   {
+                     // Database updates are sequenced, so that the junior peers can NACK any that they miss
+                     if ((msgFromOwner()->what == PZG_PEER_COMMAND_UPDATE_JUNIOR_DATABASE)&&(repair.MessageSent(msgFromOwner).IsError())) LogTime(MUSCLE_LOG_ERROR, "Network I/O multicast thread:  Unable to buffer outgoing database update for retransmission!\n");
+
                      for (uint32 i=0; i<ptGateways.GetNumItems(); i++)
                         (void) ptGateways[i]()->AddOutgoingMessage(msgFromOwner);
                   }
                break;
 
-               case PZG_NETWORK_COMMAND_SET_SENIOR_PEER_ID:
-                  if (msgFromOwner()->FindFlat(PZG_NETWORK_NAME_PEER_ID, seniorPeerID).IsError()) LogTime(MUSCLE_LOG_ERROR, "Multicast I/O thread:  Couldn't get senior peer ID from Message!\n");
+               case PZG_NETWORK_COMMAND_SET_SENIOR_PEER_IDS:
+               {
+                  // We keep the last beacon-data of any peer that is still a senior peer, since its delta beacons are relative to that
+                  Hashtable<ZGPeerID, ConstPZGBeaconDataRef> newLastReceived;
+                  ZGPeerID pid;
+                  for (uint32 i=0; msgFromOwner()->FindFlat(PZG_NETWORK_NAME_PEER_ID, i, pid).IsOK(); i++) (void) newLastReceived.Put(pid, lastReceivedBeaconDatas.GetWithDefault(pid));
+                  lastReceivedBeaconDatas.SwapContents(newLastReceived);
+               }
                break;
 
                case PZG_NETWORK_COMMAND_SET_BEACON_DATA:
                {
-                  outgoingBeaconMsg.Reset();  // will be demand-allocated next time we send
-                  outgoingBeaconData = GetBeaconDataFromMessage(msgFromOwner);
-                  nextBeaconSendTime = (outgoingBeaconData() == NULL) ? MUSCLE_TIME_NEVER : 0;
+                  ConstPZGBeaconDataRef newBeaconData = GetBeaconDataFromMessage(msgFromOwner);
+                  if (newBeaconData() == NULL)
+                  {
+                     outgoingBeaconMsg.Reset();
+                     outgoingBeaconData.Reset();
+                     lastSentBeaconData.Reset();
+                     nextBeaconSendTime = MUSCLE_TIME_NEVER;
+                  }
+                  else if ((outgoingBeaconData() == NULL)||(*newBeaconData() != *outgoingBeaconData()))
+                  {
+                     outgoingBeaconMsg.Reset();  // will be demand-allocated next time we send a full beacon
+                     outgoingBeaconData = newBeaconData;
+                     beaconDataChanged  = true;
+
+                     // Let the junior peers know about the change right away, but not more often than the rate-limit allows
+                     nextBeaconSendTime = muscleMin(nextBeaconSendTime, muscleMax(GetRunTime64(), lastBeaconSendTime+_minBeaconIntervalMicros));
+                  }
                }
                break;
 
                case PZG_NETWORK_COMMAND_INVALIDATE_LAST_RECEIVED_BEACON_DATA:
-                  lastReceivedBeaconData.Reset();  // so that we'll resend to the owner thread when that happens
+                  for (HashtableIterator<ZGPeerID, ConstPZGBeaconDataRef> iter(lastReceivedBeaconDatas); iter.HasData(); iter++) iter.GetValue().Reset();  // so that we'll resend to the owner thread when that happens
                break;
 
                default:
@@ -450,22 +608,77 @@ void PZGNetworkIOSession :: InternalThreadEntry()
       {
          if (outgoingBeaconData())
          {
-            nextBeaconSendTime = now + _beaconIntervalMicros;
             if ((_computerIsAsleep.load() == false)&&(_master->IAmFullyAttached()))
             {
-               // demand-construct a Beacon Message (and cache it so we don't have to do it again every time)
                // The tag will be handled specially by the receiver so it's okay that the tag ID isn't increasing with each send
-               if (outgoingBeaconMsg() == NULL) outgoingBeaconMsg = CreateBeaconDataMessage(outgoingBeaconData, true, PZGMulticastMessageTag(GetLocalPeerID(), _hbSettings()->GetCompatibilityVersionCode(), 0));
-               if (outgoingBeaconMsg())
+               const PZGMulticastMessageTag beaconTag(GetLocalPeerID(), _hbSettings()->GetCompatibilityVersionCode(), 0);
+
+               // A change-triggered beacon only needs to describe the databases that changed since our previous beacon
+               MessageRef beaconMsg = beaconDataChanged ? CreateDeltaBeaconDataMessage(lastSentBeaconData, outgoingBeaconData, beaconTag) : MessageRef();
+               if (beaconMsg() == NULL)
                {
-                  for (uint32 i=0; i<ptGateways.GetNumItems(); i++) if (ptGateways[i]()->AddOutgoingMessage(outgoingBeaconMsg).IsError()) LogTime(MUSCLE_LOG_ERROR, "Unable to add outgoing beacon to gateway # " UINT32_FORMAT_SPEC "!\n", i);
+                  // demand-construct a full Beacon Message (and cache it so we don't have to do it again every time)
+                  if (outgoingBeaconMsg() == NULL) outgoingBeaconMsg = CreateBeaconDataMessage(outgoingBeaconData, true, beaconTag);
+
+                  // We send a copy, since a previous beacon might still be waiting in an outgoing-Message queue, and its sequence number mustn't change
+                  if (outgoingBeaconMsg()) beaconMsg = GetMessageFromPool(*outgoingBeaconMsg());
+               }
+
+               if ((beaconMsg())&&(repair.AddLastSentSequenceNumberToBeacon(*beaconMsg()).IsOK()))
+               {
+                  // The beacon goes behind any paced database updates, since it tells the junior peers that they should have received those updates by now
+                  for (uint32 i=0; i<ptGateways.GetNumItems(); i++) if (ptGateways[i]()->AddOutgoingMessage(beaconMsg).IsError()) LogTime(MUSCLE_LOG_ERROR, "Unable to add outgoing beacon to gateway # " UINT32_FORMAT_SPEC "!\n", i);
+                  lastSentBeaconData = outgoingBeaconData;
                }
                else LogTime(MUSCLE_LOG_ERROR, "Unable to create Outgoing Beacon Message!\n");
             }
+
+            // After a change, the next (full) beacon goes out one regular interval later, in case the change-triggered
+            // beacon was lost; after that, we back off exponentially for as long as nothing changes
+            beaconIntervalMicros = beaconDataChanged ? _beaconIntervalMicros : muscleMin(beaconIntervalMicros*2, _maxBeaconIntervalMicros);
+            beaconDataChanged    = false;
+            lastBeaconSendTime   = now;
+            nextBeaconSendTime   = now + beaconIntervalMicros;
          }
          else nextBeaconSendTime = MUSCLE_TIME_NEVER;
       }
 
+      // Send any NACKs and retransmissions that are due
+      {
+         Queue<MessageRef> repairMsgs;
+         repair.GetMessagesToRetransmit(now, repairMsgs);  // these are already tagged, so the receivers will de-duplicate them as usual
+
+         Queue<MessageRef> nackMsgs;
+         repair.GetNacksToSend(now, nackMsgs);
+         for (uint32 i=0; i<nackMsgs.GetNumItems(); i++)
+         {
+            // As with beacons, NACKs are handled specially by the receiver, so their tag ID doesn't need to be unique
+            const MessageRef & nackMsg = nackMsgs[i];
+            if (nackMsg()->AddFlat(PZG_NETWORK_NAME_MULTICAST_TAG, PZGMulticastMessageTag(GetLocalPeerID(), _hbSettings()->GetCompatibilityVersionCode(), 0)).IsOK()) (void) repairMsgs.AddTail(nackMsg);
+         }
+
+         // Retransmissions fill gaps the junior peers are already waiting on, so they jump the queue too (in reverse, so they'll end up in order)
+         for (int32 i=((int32)repairMsgs.GetNumItems())-1; i>=0; i--)
+            for (uint32 j=0; j<ptGateways.GetNumItems(); j++)
+               (void) AddPriorityOutgoingMessage(*ptGateways[j](), repairMsgs[i]);
+      }
+
+      // Let the senders know how much of their multicast traffic we're losing on each interface, so that they can adjust their parity overhead
+      if (now >= nextLossReportTime)
+      {
+         for (uint32 i=0; i<fecDIOs.GetNumItems(); i++)
+         {
+            uint32 numExpected, numLost;
+            fecDIOs[i]()->GetAndResetLossStatistics(numExpected, numLost);
+            if (numExpected > 0)  // we can only measure loss on parity-protected traffic
+            {
+               MessageRef reportMsg = GetMessageFromPool(PZG_NETWORK_COMMAND_FEC_LOSS_REPORT);
+               if ((reportMsg())&&(reportMsg()->AddFloat(PZG_NETWORK_NAME_LOSS_RATE, ((float)numLost)/numExpected).IsOK())&&(reportMsg()->AddFlat(PZG_NETWORK_NAME_MULTICAST_TAG, PZGMulticastMessageTag(GetLocalPeerID(), _hbSettings()->GetCompatibilityVersionCode(), 0)).IsOK())) (void) AddPriorityOutgoingMessage(*ptGateways[i](), reportMsg);
+            }
+         }
+         nextLossReportTime = now+PZG_FEC_LOSS_REPORT_INTERVAL_MICROS;
+      }
+
       for (uint32 i=0; i<dios.GetNumItems(); i++)
       {
          PacketDataIORef & dio = dios[i];
@@ -479,32 +692,49 @@ void PZGNetworkIOSession :: InternalThreadEntry()
                {
                   // no point in forwarding-to-owner a dup Message, or a Message that came from us, or a Message from an incompatibile peer
                   PZGMulticastMessageTag tag;
-                  if ((msg()->FindFlat(PZG_NETWORK_NAME_MULTICAST_TAG, tag).IsOK())&&(tag.GetCompatibilityVersionCode() == _hbSettings()->GetCompatibilityVersionCode())&&(tag.GetPeerID() != GetLocalPeerID())&&((msg()->what == PZG_NETWORK_COMMAND_SET_BEACON_DATA)||((recentlyReceived.ContainsKey(tag) == false)&&(recentlyReceived.PutWithDefault(tag).IsOK()))))
+                  const bool isNack = PZGMulticastRepair::IsNackMessage(*msg());
+                  if ((msg()->FindFlat(PZG_NETWORK_NAME_MULTICAST_TAG, tag).IsOK())&&(tag.GetCompatibilityVersionCode() == _hbSettings()->GetCompatibilityVersionCode())&&(tag.GetPeerID() != GetLocalPeerID())&&((isNack)||(msg()->what == PZG_NETWORK_COMMAND_SET_BEACON_DATA)||(msg()->what == PZG_NETWORK_COMMAND_FEC_LOSS_REPORT)||((recentlyReceived.ContainsKey(tag) == false)&&(recentlyReceived.PutWithDefault(tag).IsOK()))))
                   {
-                     if (msg()->what == PZG_NETWORK_COMMAND_SET_BEACON_DATA)
+                     if (isNack)
+                     {
+                        // NACKs for our own updates get answered with retransmissions; NACKs for other peers' updates tell us that we needn't send the same NACK ourselves
+                        if (PZGMulticastRepair::IsNackAddressedTo(*msg(), GetLocalPeerID())) repair.NackReceived(*msg(), GetRunTime64());
+                                                                                          else repair.NackOverheard(*msg(), GetRunTime64());
+                     }
+                     else if (msg()->what == PZG_NETWORK_COMMAND_FEC_LOSS_REPORT)
+                     {
+                        float lossRate;
+                        if (msg()->FindFloat(PZG_NETWORK_NAME_LOSS_RATE, lossRate).IsOK()) fecDIOs[i]()->LossReportReceived(tag.GetPeerID(), lossRate, GetRunTime64());
+                     }
+                     else if (msg()->what == PZG_NETWORK_COMMAND_SET_BEACON_DATA)
                      {
-                        if (seniorPeerID.IsValid())  // no point trying to handle beacon data until we know who the senior peer is!
+                        repair.BeaconReceived(tag.GetPeerID(), *msg(), GetRunTime64());
+                        if (lastReceivedBeaconDatas.HasItems())  // no point trying to handle beacon data until we know who the senior peers are!
                         {
-                           if (tag.GetPeerID() == seniorPeerID)
+                           ConstPZGBeaconDataRef * lastReceivedBeaconData = lastReceivedBeaconDatas.Get(tag.GetPeerID());
+                           if (lastReceivedBeaconData)
                            {
                               ConstPZGBeaconDataRef incomingBeaconData = GetBeaconDataFromMessage(msg);
+                              const bool isDelta = ((incomingBeaconData())&&(incomingBeaconData()->IsDelta()));
+                              if (isDelta) incomingBeaconData = GetBeaconDataWithDeltaApplied(*lastReceivedBeaconData, incomingBeaconData);
                               if (incomingBeaconData())
                               {
                                  // we'll only notify the main thread if the beacon data actually changed
-                                 if ((lastReceivedBeaconData() == NULL)||(*incomingBeaconData() != *lastReceivedBeaconData()))
+                                 if (((*lastReceivedBeaconData)() == NULL)||(*incomingBeaconData() != *(*lastReceivedBeaconData)()))
                                  {
-                                    lastReceivedBeaconData = incomingBeaconData;
+                                    *lastReceivedBeaconData = incomingBeaconData;
                                     if (SendMessageToOwner(CreateBeaconDataMessage(incomingBeaconData, false, tag)).IsError()) LogTime(MUSCLE_LOG_ERROR, "Multicast thread:  Unable to send beacon data to main thread!\n");
                                  }
                               }
-                              else LogTime(MUSCLE_LOG_ERROR, "Multicast thread:  Unable to retrieve beacon data from incoming multicast Message!\n");
+                              else if (isDelta == false) LogTime(MUSCLE_LOG_ERROR, "Multicast thread:  Unable to retrieve beacon data from incoming multicast Message!\n");
                            }
-                           else if (_master->IAmFullyAttached()) LogTime(MUSCLE_LOG_WARNING, "Multicast thread received beacon data from peer [%s], but peer [%s] is the senior peer.  Multiple senior peers present?\n", tag.GetPeerID().ToString()(), seniorPeerID.ToString()());
+                           else if (_master->IAmFullyAttached()) LogTime(MUSCLE_LOG_WARNING, "Multicast thread received beacon data from peer [%s], but that peer isn't the senior peer of any database.  Multiple senior peers present?\n", tag.GetPeerID().ToString()());
                         }
                      }
                      else
                      {
                         (void) recentlyReceived.MoveToBack(tag);  // might as well use the full LRU semantics
+                        repair.MessageReceived(tag.GetPeerID(), *msg(), GetRunTime64());
                         if (SendMessageToOwner(msg).IsError()) LogTime(MUSCLE_LOG_ERROR, "Multicast thread:  Unable to send Message to main thread!\n");
                         while(recentlyReceived.GetNumItems() > 1000) (void) recentlyReceived.RemoveFirst();  // don't let our cache get too large
                      }
@@ -515,18 +745,31 @@ void PZGNetworkIOSession :: InternalThreadEntry()
 
          if (IsInternalThreadSocketReady(dio()->GetWriteSelectSocket(), SOCKET_SET_WRITE))
             while(ptGateways[i]()->DoOutput().GetByteCount() > 0) {/* empty */} // Write outgoing multicast data
+
+         // Make sure the last few packets of a burst get their parity packet too, rather than waiting for the next burst
+         PZGFECPacketDataIO & fecDIO = *fecDIOs[i]();
+         if (GetRunTime64() >= fecDIO.GetParityFlushTime()) fecDIO.FlushParity();  // if we're being paced, it may have to wait a bit longer
+      }
+
+      // Our database updates can only be retransmitted (and age out of the retransmit buffer) once they've been written on every interface
+      if (ptGateways.HasItems())
+      {
+         uint32 firstUnwrittenSeqNum = repair.GetLastSentSequenceNumber()+1;
+         for (uint32 i=0; i<ptGateways.GetNumItems(); i++) firstUnwrittenSeqNum = muscleMin(firstUnwrittenSeqNum, GetFirstUnwrittenSequenceNumber(*ptGateways[i](), repair));
+         repair.MessagesWritten(firstUnwrittenSeqNum, GetRunTime64());
       }
    }
 }
 
 uint64 PZGNetworkIOSession :: GetPulseTime(const PulseArgs & args)
 {
-   return _messagesSentToSelf.HasItems() ? 0 : PZGThreadedSession::GetPulseTime(args);
+   return _messagesSentToSelf.HasItems() ? 0 : muscleMin(GetNextSnapshotExpirationTime(), PZGThreadedSession::GetPulseTime(args));
 }
 
 void PZGNetworkIOSession :: Pulse(const PulseArgs & args)
 {
    PZGThreadedSession::Pulse(args);
+   if (args.GetScheduledTime() >= GetNextSnapshotExpirationTime()) ExpireIdleSnapshots();
 
    ConstMessageRef nextMsgToSelf;
    while(_messagesSentToSelf.RemoveHead(nextMsgToSelf).IsOK()) UnicastMessageReceivedFromPeer(GetLocalPeerID(), CastAwayConstFromRef(nextMsgToSelf));
@@ -618,6 +861,9 @@ void PZGNetworkIOSession :: ComputerIsAboutToSleep()
    ClearHeartbeatSession();
    ClearAllUnicastSessions();
 
+   // our databases will have to catch up again after we wake up, before we can be made the senior peer of any of them
+   SetLocalPeerIsCaughtUp(false);
+
    // because we don't know who it will be when we re-awake
    SeniorPeerChanged(_seniorPeerID, ZGPeerID());
 
@@ -643,7 +889,7 @@ void PZGNetworkIOSession :: UnicastMessageReceivedFromPeer(const ZGPeerID & remo
    if (_master) _master->PrivateMessageReceivedFromPeer(remotePeerID, msg);
 }
 
-status_t PZGNetworkIOSession :: RequestBackOrderFromSeniorPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError)
+status_t PZGNetworkIOSession :: RequestBackOrderFromPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError)
 {
    if (_hbSettings() == NULL) return B_BAD_OBJECT;  // paranoia
 
@@ -651,14 +897,26 @@ status_t PZGNetworkIOSession :: RequestBackOrderFromSeniorPeer(const PZGUpdateBa
    if (peerID == GetLocalPeerID())
    {
       // I don't think there is any reason to ever want to do this, so I'm not going to implement it for now --jaf
-      LogTime(MUSCLE_LOG_ERROR, "PZGNetworkIOSession::RequestBackOrderFromSeniorPeer:  Requesting a back order from myself isn't implemented, and shouldn't be necessary.\n");
+      LogTime(MUSCLE_LOG_ERROR, "PZGNetworkIOSession::RequestBackOrderFromPeer:  Requesting a back order from myself isn't implemented, and shouldn't be necessary.\n");
       return B_UNIMPLEMENTED;
    }
    else
    {
       PZGUnicastSessionRef usRef = GetUnicastSessionForPeerID(peerID, true);
-      return usRef() ? usRef()->RequestBackOrderFromSeniorPeer(ubok, dueToChecksumError) : B_DATA_NOT_FOUND;
+      return usRef() ? usRef()->RequestBackOrderFromPeer(ubok, dueToChecksumError) : B_DATA_NOT_FOUND;
+   }
+}
+
+uint32 PZGNetworkIOSession :: GetCatchUpLoad() const
+{
+   uint32 ret = 0;
+   for (ConstHashtableIterator<PZGUnicastSessionRef, Void> iter(_registeredUnicastSessions); iter.HasData(); iter++)
+   {
+      const AbstractMessageIOGateway * gw = iter.GetKey()()->GetGateway()();
+      if (gw) ret += gw->GetOutgoingMessageQueue().GetNumItems();
    }
+   for (ConstHashtableIterator<uint64, PZGOutgoingSnapshotRef> iter(_outgoingSnapshots); iter.HasData(); iter++) if (iter.GetValue()()->IsReady() == false) ret++;
+   return ret;
 }
 
 void PZGNetworkIOSession :: BackOrderResultReceived(const PZGUpdateBackOrderKey & ubok, const ConstPZGDatabaseUpdateRef & optDBUp)
@@ -671,11 +929,134 @@ ConstPZGDatabaseUpdateRef PZGNetworkIOSession :: GetDatabaseUpdateByID(uint32 wh
    return _master ? _master->GetDatabaseUpdateByID(whichDB, updateID) : ConstPZGDatabaseUpdateRef();
 }
 
+ConstPZGDatabaseUpdateRef PZGNetworkIOSession :: GetFullDatabaseUpdate(uint32 whichDB)
+{
+   bool canFlattenAsynchronously;  // unused, since our caller sends the update right away
+   return _master ? _master->GetFullDatabaseUpdateForTransfer(whichDB, canFlattenAsynchronously) : ConstPZGDatabaseUpdateRef();
+}
+
+void PZGNetworkIOSession :: BackOrderLookupCompleted(uint32 whichDB, bool wasInUpdateLog)
+{
+   if (_master) _master->BackOrderLookupCompleted(whichDB, wasInUpdateLog);
+}
+
 void PZGNetworkIOSession :: VerifyOrFixLocalDatabaseChecksum(uint32 whichDB)
 {
    if (_master) _master->VerifyOrFixLocalDatabaseChecksum(whichDB);
 }
 
+PZGOutgoingSnapshotRef PZGNetworkIOSession :: GetOutgoingSnapshot(uint32 whichDB, uint64 snapshotID, bool dueToChecksumError)
+{
+   if (_master == NULL) return B_BAD_OBJECT;
+
+   // If the junior peer is resuming a download, we'll keep sending it the snapshot it started with
+   const PZGOutgoingSnapshotRef * existing = _outgoingSnapshots.Get(snapshotID);
+   if ((existing)&&(existing->GetItemPointer()->GetDatabaseIndex() == whichDB))
+   {
+      if (existing->GetItemPointer()->HasFailed())
+      {
+         // Our caller will report the failure; we evict the snapshot so that the junior peer's next request gets a fresh attempt
+         const PZGOutgoingSnapshotRef ret = *existing;
+         (void) _outgoingSnapshots.Remove(snapshotID);
+         return ret;
+      }
+
+      existing->GetItemPointer()->Touch();
+      return *existing;
+   }
+
+   if (dueToChecksumError) VerifyOrFixLocalDatabaseChecksum(whichDB);  // so we can recover if the checksum has gone wrong
+   else
+   {
+      // Otherwise, if we already have a snapshot of the database's current state, we can share it rather than making another one
+      const uint64 curStateID = _master->GetCurrentDatabaseStateID(whichDB);
+      for (HashtableIterator<uint64, PZGOutgoingSnapshotRef> iter(_outgoingSnapshots, HTIT_FLAG_BACKWARDS); iter.HasData(); iter++)
+      {
+         PZGOutgoingSnapshot * snap = iter.GetValue()();
+         if (snap->HasFailed()) (void) _outgoingSnapshots.Remove(iter.GetKey());  // no point keeping (or sharing) a snapshot that couldn't be flattened
+         else if ((snap->GetDatabaseIndex() == whichDB)&&(snap->GetDatabaseStateID() == curStateID))
+         {
+            snap->Touch();
+            return iter.GetValue();
+         }
+      }
+   }
+
+   bool canFlattenAsynchronously;
+   ConstPZGDatabaseUpdateRef dbUp = _master->GetFullDatabaseUpdateForTransfer(whichDB, canFlattenAsynchronously);
+   MRETURN_ON_ERROR(dbUp);
+
+   // If the database gave us a snapshot, our helper thread can do the (potentially expensive) compressing and flattening
+   // of it while we go on handling updates; chunk-requests for this snapshot will be deferred until it's ready.
+   const bool flattenInHelperThread = ((canFlattenAsynchronously)&&(_snapshotFlattenerSession()));
+   ConstByteBufferRef flatBuf;
+   if (flattenInHelperThread == false)
+   {
+      flatBuf = dbUp()->FlattenToByteBuffer();
+      MRETURN_ON_ERROR(flatBuf);
+   }
+
+   PZGOutgoingSnapshotRef snapRef(new PZGOutgoingSnapshot(_nextSnapshotID++, whichDB, dbUp()->GetUpdateID(), flatBuf));
+   MRETURN_OOM_ON_NULL(snapRef());
+   if (flattenInHelperThread) MRETURN_ON_ERROR(_snapshotFlattenerSession()->FlattenSnapshot(snapRef()->GetSnapshotID(), dbUp));
+   MRETURN_ON_ERROR(_outgoingSnapshots.Put(snapRef()->GetSnapshotID(), snapRef));
+   InvalidatePulseTime();  // so that we'll expire it later on
+   return snapRef;
+}
+
+void PZGNetworkIOSession :: OutgoingSnapshotFlattened(uint64 snapshotID, const ConstByteBufferRef & optFlattenedUpdate)
+{
+   const PZGOutgoingSnapshotRef * snap = _outgoingSnapshots.Get(snapshotID);
+   if (snap == NULL) return;  // nobody is waiting for it anymore
+
+   snap->GetItemPointer()->SetFlattenedUpdate(optFlattenedUpdate);
+   InvalidatePulseTime();  // since it can expire now
+
+   // Let our unicast sessions handle any chunk-requests they had to defer until the snapshot was ready
+   for (ConstHashtableIterator<PZGUnicastSessionRef, Void> iter(_registeredUnicastSessions); iter.HasData(); iter++) iter.GetKey()()->HandleDeferredSnapshotChunkRequests();
+}
+
+PZGIncomingSnapshotRef PZGNetworkIOSession :: GetIncomingSnapshot(const PZGUpdateBackOrderKey & ubok, bool allocIfNecessary)
+{
+   const PZGIncomingSnapshotRef * existing = _incomingSnapshots.Get(ubok);
+   if (existing) return *existing;
+   if (allocIfNecessary == false) return B_DATA_NOT_FOUND;
+
+   PZGIncomingSnapshotRef snapRef(new PZGIncomingSnapshot);
+   MRETURN_OOM_ON_NULL(snapRef());
+   MRETURN_ON_ERROR(_incomingSnapshots.Put(ubok, snapRef));
+   InvalidatePulseTime();  // so that we'll expire it later on, if the download gets abandoned
+   return snapRef;
+}
+
+uint64 PZGNetworkIOSession :: GetNextSnapshotExpirationTime() const
+{
+   uint64 ret = MUSCLE_TIME_NEVER;
+   for (ConstHashtableIterator<uint64, PZGOutgoingSnapshotRef> iter(_outgoingSnapshots); iter.HasData(); iter++)
+      if (iter.GetValue()()->IsReady()) ret = muscleMin(ret, iter.GetValue()()->GetLastAccessTime()+PZG_SNAPSHOT_TRANSFER_TIMEOUT_MICROS);
+   for (ConstHashtableIterator<PZGUpdateBackOrderKey, PZGIncomingSnapshotRef> iter(_incomingSnapshots); iter.HasData(); iter++)
+      if (iter.GetValue()()->GetNumRequestsInFlight() == 0) ret = muscleMin(ret, iter.GetValue()()->GetLastAccessTime()+PZG_SNAPSHOT_TRANSFER_TIMEOUT_MICROS);
+   return ret;
+}
+
+void PZGNetworkIOSession :: ExpireIdleSnapshots()
+{
+   const uint64 now = GetRunTime64();
+   // Snapshots that our helper thread is still flattening don't expire, since there may be requests waiting on them
+   for (HashtableIterator<uint64, PZGOutgoingSnapshotRef> iter(_outgoingSnapshots); iter.HasData(); iter++)
+   {
+      const PZGOutgoingSnapshot * snap = iter.GetValue()();
+      if ((snap->IsReady())&&(now >= snap->GetLastAccessTime()+PZG_SNAPSHOT_TRANSFER_TIMEOUT_MICROS)) (void) _outgoingSnapshots.Remove(iter.GetKey());
+   }
+
+   // Downloads that still have requests outstanding are in progress, so those don't expire
+   for (HashtableIterator<PZGUpdateBackOrderKey, PZGIncomingSnapshotRef> iter(_incomingSnapshots); iter.HasData(); iter++)
+   {
+      const PZGIncomingSnapshot * snap = iter.GetValue()();
+      if ((snap->GetNumRequestsInFlight() == 0)&&(now >= snap->GetLastAccessTime()+PZG_SNAPSHOT_TRANSFER_TIMEOUT_MICROS)) (void) _incomingSnapshots.Remove(iter.GetKey());
+   }
+}
+
 uint64 PZGNetworkIOSession :: GetEstimatedLatencyToPeer(const ZGPeerID & peerID) const
 {
    return _hbSession() ? _hbSession()->GetEstimatedLatencyToPeer(peerID) : MUSCLE_TIME_NEVER;
@@ -0,0 +1,61 @@
+#include "zg/private/PZGPacedPacketDataIO.h"
+
+namespace zg_private
+{
+
+static const double PZG_PACING_MICROS_PER_SECOND = (double) SecondsToMicros(1);
+
+PZGPacedPacketDataIO :: PZGPacedPacketDataIO(const PacketDataIORef & childIO, uint64 maxBytesPerSecond, uint32 maxPacketsPerSecond)
+   : _childIO(childIO)
+   , _maxBytesPerSecond(maxBytesPerSecond)
+   , _maxPacketsPerSecond(maxPacketsPerSecond)
+   , _maxByteTokens(muscleMax(((double)maxBytesPerSecond)*PZG_PACING_BURST_MICROS/PZG_PACING_MICROS_PER_SECOND, (double)PZG_PACING_MIN_BURST_BYTES))
+   , _maxPacketTokens(muscleMax(((double)maxPacketsPerSecond)*PZG_PACING_BURST_MICROS/PZG_PACING_MICROS_PER_SECOND, 1.0))
+   , _byteTokens(_maxByteTokens)
+   , _packetTokens(_maxPacketTokens)
+   , _lastRefillTime(GetRunTime64())
+{
+   // empty
+}
+
+void PZGPacedPacketDataIO :: RefillTokens(uint64 now)
+{
+   if (now > _lastRefillTime)
+   {
+      const double elapsedSeconds = ((double)(now-_lastRefillTime))/PZG_PACING_MICROS_PER_SECOND;
+      if (_maxBytesPerSecond   > 0) _byteTokens   = muscleMin(_byteTokens  +(elapsedSeconds*_maxBytesPerSecond),   _maxByteTokens);
+      if (_maxPacketsPerSecond > 0) _packetTokens = muscleMin(_packetTokens+(elapsedSeconds*_maxPacketsPerSecond), _maxPacketTokens);
+      _lastRefillTime = now;
+   }
+}
+
+uint64 PZGPacedPacketDataIO :: GetNextSendTime(uint64 now)
+{
+   if (IsPacingEnabled() == false) return now;
+
+   RefillTokens(now);
+
+   // A bucket that has gone into debt (because of a large packet) must be refilled past zero before the next packet can go
+   uint64 ret = now;
+   if ((_maxBytesPerSecond   > 0)&&(_byteTokens   <= 0.0)) ret = muscleMax(ret, now+1+(uint64)((-_byteTokens*PZG_PACING_MICROS_PER_SECOND)/_maxBytesPerSecond));
+   if ((_maxPacketsPerSecond > 0)&&(_packetTokens <  1.0)) ret = muscleMax(ret, now+1+(uint64)(((1.0-_packetTokens)*PZG_PACING_MICROS_PER_SECOND)/_maxPacketsPerSecond));
+   return ret;
+}
+
+io_status_t PZGPacedPacketDataIO :: WriteTo(const void * buffer, uint32 size, const IPAddressAndPort & packetDest)
+{
+   if (IsPacingEnabled() == false) return _childIO()->WriteTo(buffer, size, packetDest);
+
+   const uint64 now = GetRunTime64();
+   if (GetNextSendTime(now) > now) return 0;  // out of tokens; our caller should hold on to the packet and try again later
+
+   const io_status_t ret = _childIO()->WriteTo(buffer, size, packetDest);
+   if (ret.GetByteCount() > 0)
+   {
+      if (_maxBytesPerSecond   > 0) _byteTokens -= ret.GetByteCount();
+      if (_maxPacketsPerSecond > 0) _packetTokens -= 1.0;
+   }
+   return ret;
+}
+
+}  // end namespace zg_private
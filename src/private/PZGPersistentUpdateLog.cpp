@@ -0,0 +1,329 @@
+#include "zlib/ZLibUtilityFunctions.h"
+#include "zg/private/PZGPersistentUpdateLog.h"
+
+#ifdef WIN32
+# include <io.h>      // for _commit()
+#else
+# include <unistd.h>  // for fsync()
+#endif
+
+namespace zg_private
+{
+
+enum {
+   PZG_UPDATE_LOG_RECORD_MAGIC = 2053598322, // 'zglr'
+   PZG_SNAPSHOT_FILE_MAGIC     = 2053600110, // 'zgsn'
+};
+
+static const uint32 PZG_UPDATE_LOG_RECORD_HEADER_SIZE = 16;  // magic (4 bytes), record-data-size (4 bytes), update ID (8 bytes)
+static const uint32 PZG_SNAPSHOT_FILE_HEADER_SIZE     = 24;  // magic (4 bytes), payload size (4 bytes), state ID (8 bytes), DB checksum (8 bytes)
+static const uint32 PZG_UPDATE_LOG_RECORD_ALIGNMENT   = 8;   // every log record starts at a file offset that is a multiple of this
+static const uint32 PZG_UPDATE_LOG_MAX_RECORD_SIZE    = 256*1024*1024;  // records claiming to be larger than this are considered corrupt
+static const uint32 PZG_SNAPSHOT_FILE_MAX_PAYLOAD     = 0x7FFFFFFF;     // ditto for the (compressed) contents of a snapshot file
+
+static uint32 GetNumPaddingBytes(uint32 numDataBytes) {return (PZG_UPDATE_LOG_RECORD_ALIGNMENT-(numDataBytes%PZG_UPDATE_LOG_RECORD_ALIGNMENT))%PZG_UPDATE_LOG_RECORD_ALIGNMENT;}
+
+// Makes sure that everything we've written to (f) so far is actually on the disk
+static status_t SyncFileToDisk(FILE * f)
+{
+   if (fflush(f) != 0) return B_IO_ERROR;
+#ifdef WIN32
+   return (_commit(_fileno(f)) == 0) ? B_NO_ERROR : B_IO_ERROR;
+#else
+   return (fsync(fileno(f)) == 0) ? B_NO_ERROR : B_IO_ERROR;
+#endif
+}
+
+static void ExportUint32(uint8 * p, uint32 v) {v = B_HOST_TO_LENDIAN_INT32(v); memcpy(p, &v, sizeof(v));}
+static void ExportUint64(uint8 * p, uint64 v) {v = B_HOST_TO_LENDIAN_INT64(v); memcpy(p, &v, sizeof(v));}
+static uint32 ImportUint32(const uint8 * p) {uint32 v; memcpy(&v, p, sizeof(v)); return B_LENDIAN_TO_HOST_INT32(v);}
+static uint64 ImportUint64(const uint8 * p) {uint64 v; memcpy(&v, p, sizeof(v)); return B_LENDIAN_TO_HOST_INT64(v);}
+
+static status_t WriteBytes(FILE * f, const void * bytes, uint32 numBytes)
+{
+   return ((numBytes == 0)||(fwrite(bytes, 1, numBytes, f) == numBytes)) ? B_NO_ERROR : B_IO_ERROR;
+}
+
+// Returns the number of bytes in (f) after the current read position, or 0 if that can't be determined
+static uint64 GetNumBytesLeftInFile(FILE * f)
+{
+   const long curPos = ftell(f);
+   if ((curPos < 0)||(fseek(f, 0, SEEK_END) != 0)) return 0;
+   const long endPos = ftell(f);
+   return ((fseek(f, curPos, SEEK_SET) == 0)&&(endPos > curPos)) ? (uint64)(endPos-curPos) : 0;
+}
+
+static bool FileExists(const char * path)
+{
+   FILE * f = fopen(path, "rb");
+   if (f == NULL) return false;
+   (void) fclose(f);
+   return true;
+}
+
+// Reads in the records of the log file at (filePath), appending the ones with update IDs greater than (afterUpdateID) to (retUpdates)
+static status_t LoadLogRecordsFromFile(const String & filePath, uint64 afterUpdateID, Queue<PZGDatabaseUpdateRef> & retUpdates, bool & retLogIsClean)
+{
+   FILE * f = fopen(filePath(), "rb");
+   if (f == NULL) return B_NO_ERROR;  // no log file means no updates to replay
+
+   status_t ret;
+   uint8 header[PZG_UPDATE_LOG_RECORD_HEADER_SIZE];
+   while(1)
+   {
+      const size_t numHeaderBytesRead = fread(header, 1, sizeof(header), f);
+      if (numHeaderBytesRead == 0) break;  // clean end of log
+      if (numHeaderBytesRead != sizeof(header)) {retLogIsClean = false; break;}  // torn header
+
+      const uint32 magic        = ImportUint32(&header[0]);
+      const uint32 numDataBytes = ImportUint32(&header[4]);
+      const uint64 updateID     = ImportUint64(&header[8]);
+      if (magic != PZG_UPDATE_LOG_RECORD_MAGIC) {retLogIsClean = false; break;}  // corrupt header
+
+      // A bogus size field mustn't make us allocate a huge buffer (or seek past the end of the file)
+      if (numDataBytes > PZG_UPDATE_LOG_MAX_RECORD_SIZE) {retLogIsClean = false; break;}  // corrupt header
+      const uint32 numRecordBytes = numDataBytes+GetNumPaddingBytes(numDataBytes);
+      if (numRecordBytes > GetNumBytesLeftInFile(f)) {retLogIsClean = false; break;}  // torn record
+
+      if (updateID <= afterUpdateID)
+      {
+         // No need to read in records that are already reflected in our snapshot; just skip past them
+         if (fseek(f, numRecordBytes, SEEK_CUR) != 0) {retLogIsClean = false; break;}
+         continue;
+      }
+
+      ByteBufferRef dataBuf = GetByteBufferFromPool(numRecordBytes);
+      if (dataBuf() == NULL) {ret = B_OUT_OF_MEMORY; break;}
+      if (fread(dataBuf()->GetBuffer(), 1, numRecordBytes, f) != numRecordBytes) {retLogIsClean = false; break;}  // torn record
+
+      PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool();
+      if (dbUp() == NULL) {ret = B_OUT_OF_MEMORY; break;}
+      if ((dbUp()->UnflattenFromBytes(dataBuf()->GetBuffer(), numDataBytes).IsError())||(dbUp()->GetUpdateID() != updateID)) {retLogIsClean = false; break;}  // corrupt record
+      if (retUpdates.AddTail(dbUp).IsError(ret)) break;
+   }
+
+   (void) fclose(f);
+   return ret;
+}
+
+PZGPersistentUpdateLog :: PZGPersistentUpdateLog(const String & dirPath, uint32 whichDatabase)
+   : _logFilePath(dirPath.AppendWord(String("zg_database_%1.log").Arg(whichDatabase), "/"))
+   , _prevLogFilePath(_logFilePath + ".prev")
+   , _snapshotFilePath(dirPath.AppendWord(String("zg_database_%1.snapshot").Arg(whichDatabase), "/"))
+   , _logFile(NULL)
+   , _numUpdatesSinceSnapshot(0)
+{
+   // empty
+}
+
+PZGPersistentUpdateLog :: ~PZGPersistentUpdateLog()
+{
+   Close();
+}
+
+void PZGPersistentUpdateLog :: Close()
+{
+   if (_logFile)
+   {
+      (void) fclose(_logFile);
+      _logFile = NULL;
+   }
+}
+
+status_t PZGPersistentUpdateLog :: OpenLogFile()
+{
+   Close();
+
+   _logFile = fopen(_logFilePath(), "ab");
+   if (_logFile == NULL)
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGPersistentUpdateLog:  Unable to open update-log file [%s] for writing!\n", _logFilePath());
+      return B_IO_ERROR;
+   }
+   return B_NO_ERROR;
+}
+
+status_t PZGPersistentUpdateLog :: AppendUpdate(const PZGDatabaseUpdate & dbUp)
+{
+   if (_logFile == NULL) return B_BAD_OBJECT;
+
+   const ConstByteBufferRef & dataBuf = dbUp.GetWireImage();  // shared with the multicast and back-order paths, so usually no re-flattening is necessary
+   MRETURN_ON_ERROR(dataBuf);
+
+   const uint32 numDataBytes = dataBuf()->GetNumBytes();
+   uint8 header[PZG_UPDATE_LOG_RECORD_HEADER_SIZE];
+   ExportUint32(&header[0], PZG_UPDATE_LOG_RECORD_MAGIC);
+   ExportUint32(&header[4], numDataBytes);
+   ExportUint64(&header[8], dbUp.GetUpdateID());
+
+   const uint8 padding[PZG_UPDATE_LOG_RECORD_ALIGNMENT] = {0};
+   MRETURN_ON_ERROR(WriteBytes(_logFile, header, sizeof(header)));
+   MRETURN_ON_ERROR(WriteBytes(_logFile, dataBuf()->GetBuffer(), numDataBytes));
+   MRETURN_ON_ERROR(WriteBytes(_logFile, padding, GetNumPaddingBytes(numDataBytes)));
+   if (fflush(_logFile) != 0) return B_IO_ERROR;
+
+   _numUpdatesSinceSnapshot++;
+   return B_NO_ERROR;
+}
+
+status_t PZGPersistentUpdateLog :: LoadLogRecords(uint64 afterUpdateID, Queue<PZGDatabaseUpdateRef> & retUpdates, bool & retLogIsClean) const
+{
+   retLogIsClean = true;
+
+   // If we crashed while a snapshot was being written, the records it would have covered are still in the previous-log file
+   MRETURN_ON_ERROR(LoadLogRecordsFromFile(_prevLogFilePath, afterUpdateID, retUpdates, retLogIsClean));
+   return retLogIsClean ? LoadLogRecordsFromFile(_logFilePath, afterUpdateID, retUpdates, retLogIsClean) : B_NO_ERROR;
+}
+
+status_t PZGPersistentUpdateLog :: LoadSnapshot(uint64 & retStateID, uint64 & retDBChecksum, MessageRef & retDBStateMsg) const
+{
+   FILE * f = fopen(_snapshotFilePath(), "rb");
+   if (f == NULL) return B_FILE_NOT_FOUND;
+
+   status_t ret;
+   uint8 header[PZG_SNAPSHOT_FILE_HEADER_SIZE];
+   if (fread(header, 1, sizeof(header), f) == sizeof(header))
+   {
+      const uint32 magic           = ImportUint32(&header[0]);
+      const uint32 numPayloadBytes = ImportUint32(&header[4]);
+      if ((magic == PZG_SNAPSHOT_FILE_MAGIC)&&(numPayloadBytes <= PZG_SNAPSHOT_FILE_MAX_PAYLOAD)&&(numPayloadBytes <= GetNumBytesLeftInFile(f)))
+      {
+         ByteBufferRef payloadBuf = GetByteBufferFromPool(numPayloadBytes);
+         if (payloadBuf())
+         {
+            if (fread(payloadBuf()->GetBuffer(), 1, numPayloadBytes, f) == numPayloadBytes)
+            {
+               MessageRef msg = GetMessageFromPool(InflateByteBuffer(payloadBuf));
+               if (msg())
+               {
+                  retStateID    = ImportUint64(&header[8]);
+                  retDBChecksum = ImportUint64(&header[16]);
+                  retDBStateMsg = msg;
+               }
+               else ret = B_BAD_DATA;
+            }
+            else ret = B_IO_ERROR;
+         }
+         else ret = B_OUT_OF_MEMORY;
+      }
+      else ret = B_BAD_DATA;
+   }
+   else ret = B_IO_ERROR;
+
+   (void) fclose(f);
+   if (ret.IsError()) LogTime(MUSCLE_LOG_ERROR, "PZGPersistentUpdateLog:  Unable to load snapshot file [%s] [%s]\n", _snapshotFilePath(), ret());
+   return ret;
+}
+
+status_t PZGPersistentUpdateLog :: WriteSnapshot(uint64 stateID, uint64 dbChecksum, const ConstMessageRef & dbStateMsg)
+{
+   if (dbStateMsg() == NULL) return B_BAD_ARGUMENT;
+
+   ConstByteBufferRef flatDBState = dbStateMsg()->FlattenToByteBuffer();
+   MRETURN_ON_ERROR(flatDBState);
+
+   status_t ret = BeginSnapshot();
+   if (ret.IsOK()) ret = WriteSnapshotFile(_snapshotFilePath, stateID, dbChecksum, flatDBState);
+   EndSnapshot(ret.IsOK());
+   return ret;
+}
+
+status_t PZGPersistentUpdateLog :: BeginSnapshot()
+{
+   // A previous snapshot that failed (or that was interrupted by a crash) may have left its previous-log file behind
+   MRETURN_ON_ERROR(MergePreviousLogFile());
+
+   Close();
+   if (rename(_logFilePath(), _prevLogFilePath()) != 0)
+   {
+      if (FileExists(_logFilePath()))
+      {
+         LogTime(MUSCLE_LOG_ERROR, "PZGPersistentUpdateLog:  Unable to rename update-log file [%s] to [%s]!\n", _logFilePath(), _prevLogFilePath());
+         (void) OpenLogFile();  // so that we can keep appending to it, at least
+         return B_IO_ERROR;
+      }
+      // otherwise there was no log file to rename, which is fine
+   }
+
+   _numUpdatesSinceSnapshot = 0;
+   return OpenLogFile();  // the records that come after the snapshot go into a fresh log file
+}
+
+status_t PZGPersistentUpdateLog :: WriteSnapshotFile(const String & snapshotFilePath, uint64 stateID, uint64 dbChecksum, const ConstByteBufferRef & flatDBState)
+{
+   ByteBufferRef payloadBuf = DeflateByteBuffer(flatDBState, 6);
+   MRETURN_ON_ERROR(payloadBuf);
+
+   uint8 header[PZG_SNAPSHOT_FILE_HEADER_SIZE];
+   ExportUint32(&header[0], PZG_SNAPSHOT_FILE_MAGIC);
+   ExportUint32(&header[4], payloadBuf()->GetNumBytes());
+   ExportUint64(&header[8], stateID);
+   ExportUint64(&header[16], dbChecksum);
+
+   const String tempFilePath = snapshotFilePath + ".tmp";
+   FILE * f = fopen(tempFilePath(), "wb");
+   if (f == NULL)
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGPersistentUpdateLog:  Unable to open snapshot file [%s] for writing!\n", tempFilePath());
+      return B_IO_ERROR;
+   }
+
+   status_t ret = WriteBytes(f, header, sizeof(header));
+   if (ret.IsOK()) ret = WriteBytes(f, payloadBuf()->GetBuffer(), payloadBuf()->GetNumBytes());
+   if (ret.IsOK()) ret = SyncFileToDisk(f);  // the snapshot must be fully on disk before it replaces the old one
+   (void) fclose(f);
+
+#ifdef WIN32
+   if (ret.IsOK()) (void) remove(snapshotFilePath());  // Windows' rename() won't replace an existing file
+#endif
+   if ((ret.IsOK())&&(rename(tempFilePath(), snapshotFilePath()) != 0)) ret = B_IO_ERROR;
+   if (ret.IsError())
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGPersistentUpdateLog:  Unable to write snapshot file [%s] [%s]\n", snapshotFilePath(), ret());
+      (void) remove(tempFilePath());
+   }
+   return ret;
+}
+
+void PZGPersistentUpdateLog :: EndSnapshot(bool snapshotWritten)
+{
+   // Now that the snapshot reflects all of the records in our previous-log file, we don't need them anymore
+   if ((snapshotWritten)&&(remove(_prevLogFilePath()) == 0)) return;
+
+   status_t ret;
+   if (MergePreviousLogFile().IsError(ret)) LogTime(MUSCLE_LOG_ERROR, "PZGPersistentUpdateLog:  Unable to merge update-log file [%s] back into [%s] [%s]\n", _prevLogFilePath(), _logFilePath(), ret());
+}
+
+status_t PZGPersistentUpdateLog :: MergePreviousLogFile()
+{
+   if (FileExists(_prevLogFilePath()) == false) return (_logFile) ? B_NO_ERROR : OpenLogFile();
+
+   // Append our log file's records to the previous-log file's, and then put the combined file back in place as our log file
+   Close();
+   status_t ret;
+   FILE * prevFile = fopen(_prevLogFilePath(), "ab");
+   if (prevFile)
+   {
+      FILE * logFile = fopen(_logFilePath(), "rb");
+      if (logFile)
+      {
+         uint8 buf[16*1024];
+         size_t numBytesRead;
+         while((numBytesRead = fread(buf, 1, sizeof(buf), logFile)) > 0) if (WriteBytes(prevFile, buf, (uint32) numBytesRead).IsError(ret)) break;
+         if (ferror(logFile)) ret = B_IO_ERROR;
+         (void) fclose(logFile);
+      }
+      if (fclose(prevFile) != 0) ret |= B_IO_ERROR;
+   }
+   else ret = B_IO_ERROR;
+
+#ifdef WIN32
+   if (ret.IsOK()) (void) remove(_logFilePath());  // Windows' rename() won't replace an existing file
+#endif
+   if ((ret.IsOK())&&(rename(_prevLogFilePath(), _logFilePath()) != 0)) ret = B_IO_ERROR;
+
+   const status_t openRet = OpenLogFile();  // even if the merge failed, we should keep appending to our log file
+   return ret | openRet;
+}
+
+}  // end namespace zg_private
@@ -0,0 +1,72 @@
+#include "zg/private/PZGSnapshotFlattenerSession.h"
+#include "zg/private/PZGNetworkIOSession.h"
+
+namespace zg_private
+{
+
+static const String PZG_SNAPSHOT_FLATTENER_NAME_SNAPSHOT_ID = "sid";
+static const String PZG_SNAPSHOT_FLATTENER_NAME_UPDATE      = "upd";
+static const String PZG_SNAPSHOT_FLATTENER_NAME_BUFFER      = "buf";
+static const String PZG_SNAPSHOT_FLATTENER_NAME_STATUS      = "err";
+
+PZGSnapshotFlattenerSession :: PZGSnapshotFlattenerSession(PZGNetworkIOSession * master) : _master(master)
+{
+   // empty
+}
+
+void PZGSnapshotFlattenerSession :: EndSession()
+{
+   PZGThreadedSession::EndSession();  // this will block until the helper thread has exited
+   _master = NULL;
+}
+
+status_t PZGSnapshotFlattenerSession :: FlattenSnapshot(uint64 snapshotID, const ConstPZGDatabaseUpdateRef & dbUp)
+{
+   MessageRef jobMsg = GetMessageFromPool();
+   MRETURN_ON_ERROR(jobMsg);
+   MRETURN_ON_ERROR(jobMsg()->AddInt64(PZG_SNAPSHOT_FLATTENER_NAME_SNAPSHOT_ID, snapshotID));
+   MRETURN_ON_ERROR(jobMsg()->AddFlat(PZG_SNAPSHOT_FLATTENER_NAME_UPDATE, CastAwayConstFromRef(dbUp)));
+   return SendMessageToInternalThread(jobMsg);
+}
+
+void PZGSnapshotFlattenerSession :: InternalThreadEntry()
+{
+   while(1)
+   {
+      MessageRef jobMsg;
+      if (WaitForNextMessageFromOwner(jobMsg).IsError()) break;
+      if (jobMsg() == NULL) break;  // NULL jobMsg means it is time for this thread to exit!
+
+      MessageRef resultMsg = GetMessageFromPool();
+      if (resultMsg() == NULL) {MWARN_OUT_OF_MEMORY; continue;}
+
+      status_t ret;
+      PZGDatabaseUpdateRef dbUp;
+      if ((resultMsg()->AddInt64(PZG_SNAPSHOT_FLATTENER_NAME_SNAPSHOT_ID, jobMsg()->GetInt64(PZG_SNAPSHOT_FLATTENER_NAME_SNAPSHOT_ID)).IsOK(ret))
+        &&(jobMsg()->FindFlat(PZG_SNAPSHOT_FLATTENER_NAME_UPDATE, dbUp).IsOK(ret)))
+      {
+         ConstByteBufferRef buf = dbUp()->FlattenToByteBuffer();  // this is where the expensive compress-and-flatten happens
+         ret = buf() ? resultMsg()->AddFlat(PZG_SNAPSHOT_FLATTENER_NAME_BUFFER, CastAwayConstFromRef(buf)) : (buf.GetStatus()|B_OUT_OF_MEMORY);
+      }
+      if (ret.IsError()) (void) resultMsg()->AddString(PZG_SNAPSHOT_FLATTENER_NAME_STATUS, ret());
+
+      if (SendMessageToOwner(resultMsg).IsError()) LogTime(MUSCLE_LOG_ERROR, "Snapshot flattener thread:  Unable to send result to main thread!\n");
+   }
+}
+
+void PZGSnapshotFlattenerSession :: MessageReceivedFromInternalThread(const MessageRef & msg, uint32 /*numLeft*/)
+{
+   if (_master == NULL) return;
+
+   const uint64 snapshotID = msg()->GetInt64(PZG_SNAPSHOT_FLATTENER_NAME_SNAPSHOT_ID);
+
+   ByteBufferRef buf;
+   if (msg()->FindFlat(PZG_SNAPSHOT_FLATTENER_NAME_BUFFER, buf).IsOK()) _master->OutgoingSnapshotFlattened(snapshotID, buf);
+   else
+   {
+      LogTime(MUSCLE_LOG_ERROR, "Snapshot flattener thread:  Unable to flatten snapshot #" UINT64_FORMAT_SPEC " [%s]\n", snapshotID, msg()->GetString(PZG_SNAPSHOT_FLATTENER_NAME_STATUS)());
+      _master->OutgoingSnapshotFlattened(snapshotID, ConstByteBufferRef());
+   }
+}
+
+}  // end namespace zg_private
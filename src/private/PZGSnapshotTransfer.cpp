@@ -0,0 +1,87 @@
+#include "zg/private/PZGSnapshotTransfer.h"
+
+namespace zg_private
+{
+
+PZGIncomingSnapshot :: PZGIncomingSnapshot()
+   : _snapshotID(0)
+   , _numBytesReceived(0)
+   , _nextRequestOffset(0)
+   , _numRequestsInFlight(0)
+   , _lastAccessTime(GetRunTime64())
+{
+   // empty
+}
+
+void PZGIncomingSnapshot :: Reset()
+{
+   _snapshotID = 0;
+   _buf.Reset();
+   _numBytesReceived = 0;
+   ConnectionReset();
+}
+
+void PZGIncomingSnapshot :: ConnectionReset()
+{
+   _numRequestsInFlight = 0;
+   _nextRequestOffset   = _numBytesReceived;
+   _lastAccessTime      = GetRunTime64();
+}
+
+bool PZGIncomingSnapshot :: GetNextChunkRequestOffset(uint32 & retOffset)
+{
+   if (_numRequestsInFlight >= PZG_MAX_SNAPSHOT_CHUNKS_IN_FLIGHT) return false;
+   if (_snapshotID == 0)
+   {
+      if (_numRequestsInFlight > 0) return false;  // we don't know how big the snapshot is until we get our first reply back
+      retOffset = 0;
+   }
+   else if (_nextRequestOffset < GetTotalNumBytes()) retOffset = _nextRequestOffset;
+   else return false;  // everything has already been requested
+
+   _nextRequestOffset = retOffset+PZG_SNAPSHOT_CHUNK_SIZE;
+   _numRequestsInFlight++;
+   _lastAccessTime = GetRunTime64();
+   return true;
+}
+
+status_t PZGIncomingSnapshot :: ChunkReceived(uint64 snapshotID, uint32 offset, uint32 totalNumBytes, const uint8 * data, uint32 numBytes)
+{
+   if (_numRequestsInFlight > 0) _numRequestsInFlight--;
+   _lastAccessTime = GetRunTime64();
+
+   if ((snapshotID == 0)||(totalNumBytes == 0)||(offset > totalNumBytes)||(numBytes > (totalNumBytes-offset))) return B_BAD_DATA;
+
+   if ((snapshotID != _snapshotID)||(totalNumBytes != GetTotalNumBytes()))
+   {
+      // The senior peer is sending us a different snapshot than the one we were receiving (e.g. because the old
+      // one expired while we were disconnected), so we'll have to start over with the new one.
+      _buf = GetByteBufferFromPool(totalNumBytes);
+      MRETURN_ON_ERROR(_buf);
+      _snapshotID        = snapshotID;
+      _numBytesReceived  = 0;
+      _nextRequestOffset = 0;
+   }
+
+   // Chunks are requested in order and TCP keeps them in order, so anything other than the next chunk we need is a leftover we can ignore
+   if ((offset == _numBytesReceived)&&(numBytes > 0))
+   {
+      memcpy(_buf()->GetBuffer()+offset, data, numBytes);
+      _numBytesReceived += numBytes;
+   }
+
+   if ((_numRequestsInFlight == 0)||(_nextRequestOffset < _numBytesReceived)) _nextRequestOffset = _numBytesReceived;
+   return B_NO_ERROR;
+}
+
+PZGDatabaseUpdateRef PZGIncomingSnapshot :: GetReceivedUpdate() const
+{
+   if (IsComplete() == false) return B_BAD_OBJECT;
+
+   PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool();
+   MRETURN_ON_ERROR(dbUp);
+   MRETURN_ON_ERROR(dbUp()->UnflattenFromBytes(_buf()->GetBuffer(), _buf()->GetNumBytes()));
+   return dbUp;
+}
+
+}  // end namespace zg_private
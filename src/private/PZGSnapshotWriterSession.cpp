@@ -0,0 +1,69 @@
+#include "zg/private/PZGSnapshotWriterSession.h"
+#include "zg/private/PZGDatabaseState.h"
+
+namespace zg_private
+{
+
+static const String PZG_SNAPSHOT_WRITER_NAME_PATH     = "pth";
+static const String PZG_SNAPSHOT_WRITER_NAME_STATE_ID = "sid";
+static const String PZG_SNAPSHOT_WRITER_NAME_CHECKSUM = "chk";
+static const String PZG_SNAPSHOT_WRITER_NAME_STATE    = "sta";
+static const String PZG_SNAPSHOT_WRITER_NAME_STATUS   = "err";
+
+PZGSnapshotWriterSession :: PZGSnapshotWriterSession(PZGDatabaseState * dbState) : _dbState(dbState)
+{
+   // empty
+}
+
+void PZGSnapshotWriterSession :: EndSession()
+{
+   PZGThreadedSession::EndSession();  // this will block until the helper thread has exited (after writing any snapshots it was given)
+   _dbState = NULL;
+}
+
+status_t PZGSnapshotWriterSession :: WriteSnapshot(const String & snapshotFilePath, uint64 stateID, uint64 dbChecksum, const ConstByteBufferRef & flatDBState)
+{
+   MessageRef jobMsg = GetMessageFromPool();
+   MRETURN_ON_ERROR(jobMsg);
+   MRETURN_ON_ERROR(jobMsg()->AddString(PZG_SNAPSHOT_WRITER_NAME_PATH,     snapshotFilePath));
+   MRETURN_ON_ERROR(jobMsg()->AddInt64( PZG_SNAPSHOT_WRITER_NAME_STATE_ID, stateID));
+   MRETURN_ON_ERROR(jobMsg()->AddInt64( PZG_SNAPSHOT_WRITER_NAME_CHECKSUM, dbChecksum));
+   MRETURN_ON_ERROR(jobMsg()->AddFlat(  PZG_SNAPSHOT_WRITER_NAME_STATE,    CastAwayConstFromRef(flatDBState)));
+   return SendMessageToInternalThread(jobMsg);
+}
+
+void PZGSnapshotWriterSession :: InternalThreadEntry()
+{
+   while(1)
+   {
+      MessageRef jobMsg;
+      if (WaitForNextMessageFromOwner(jobMsg).IsError()) break;
+      if (jobMsg() == NULL) break;  // NULL jobMsg means it is time for this thread to exit!
+
+      MessageRef resultMsg = GetMessageFromPool();
+      if (resultMsg() == NULL) {MWARN_OUT_OF_MEMORY; continue;}
+
+      status_t ret;
+      ByteBufferRef flatDBState;
+      const uint64 stateID = jobMsg()->GetInt64(PZG_SNAPSHOT_WRITER_NAME_STATE_ID);
+      if ((resultMsg()->AddInt64(PZG_SNAPSHOT_WRITER_NAME_STATE_ID, stateID).IsOK(ret))&&(jobMsg()->FindFlat(PZG_SNAPSHOT_WRITER_NAME_STATE, flatDBState).IsOK(ret)))
+      {
+         // this is where the expensive compress-and-fsync happens
+         ret = PZGPersistentUpdateLog::WriteSnapshotFile(jobMsg()->GetString(PZG_SNAPSHOT_WRITER_NAME_PATH), stateID, jobMsg()->GetInt64(PZG_SNAPSHOT_WRITER_NAME_CHECKSUM), flatDBState);
+      }
+      if (ret.IsError()) (void) resultMsg()->AddString(PZG_SNAPSHOT_WRITER_NAME_STATUS, ret());
+
+      if (SendMessageToOwner(resultMsg).IsError()) LogTime(MUSCLE_LOG_ERROR, "Snapshot writer thread:  Unable to send result to main thread!\n");
+   }
+}
+
+void PZGSnapshotWriterSession :: MessageReceivedFromInternalThread(const MessageRef & msg, uint32 /*numLeft*/)
+{
+   if (_dbState == NULL) return;
+
+   const uint64 stateID = msg()->GetInt64(PZG_SNAPSHOT_WRITER_NAME_STATE_ID);
+   const String * errStr = msg()->GetStringPointer(PZG_SNAPSHOT_WRITER_NAME_STATUS);
+   _dbState->PersistentSnapshotWritten(stateID, errStr ? status_t((*errStr)()) : B_NO_ERROR);
+}
+
+}  // end namespace zg_private
@@ -12,10 +12,20 @@ namespace zg_private
 enum {
    PZG_UNICAST_COMMAND_ANNOUNCE_UNICAST_PEER_ID = 1970170211,   // 'unic'
    PZG_UNICAST_COMMAND_REQUEST_BACK_ORDER,
-   PZG_UNICAST_COMMAND_REPLY_BACK_ORDER
+   PZG_UNICAST_COMMAND_REPLY_BACK_ORDER,
+   PZG_UNICAST_COMMAND_REQUEST_SNAPSHOT_CHUNK,
+   PZG_UNICAST_COMMAND_REPLY_SNAPSHOT_CHUNK,
+   PZG_UNICAST_COMMAND_REPLY_BACK_ORDER_RANGE
 };
 
-static const String PZG_UNICAST_NAME_PEER_ID = "pid";
+static const String PZG_UNICAST_NAME_PEER_ID        = "pid";
+static const String PZG_UNICAST_NAME_SNAPSHOT_ID    = "sid";  // uint64:  ID of the senior peer's snapshot (or 0 if the junior peer doesn't know it yet)
+static const String PZG_UNICAST_NAME_CHUNK_OFFSET   = "off";  // uint32:  offset of the chunk within the flattened snapshot
+static const String PZG_UNICAST_NAME_SNAPSHOT_SIZE  = "tot";  // uint32:  total number of bytes in the flattened snapshot
+static const String PZG_UNICAST_NAME_CHUNK_DATA     = "dat";  // raw bytes:  the chunk's data (absent if the senior peer couldn't supply it)
+static const String PZG_UNICAST_NAME_FINAL_BATCH    = "fin";  // bool:  present in the last batch-Message of a reply to a range back-order
+
+static const uint32 PZG_BACK_ORDER_BATCH_SIZE = 64*1024;  // a range back-order reply is sent as a series of Messages holding roughly this many bytes of updates each
 
 PZGUnicastSession :: PZGUnicastSession(PZGNetworkIOSession * master, const ZGPeerID & remotePeerID)
    : _remotePeerID(remotePeerID)
@@ -87,12 +97,24 @@ void PZGUnicastSession :: MessageReceivedFromGateway(const MessageRef & msg, voi
             return;
          }
 
+         if (ubok.IsRange())
+         {
+            BackOrderRangeRequestReceived(ubok);
+            return;
+         }
+
          const uint32 whichDB  = ubok.GetDatabaseIndex();
          const uint64 updateID = ubok.GetDatabaseUpdateID();
          if ((updateID == DATABASE_UPDATE_ID_FULL_UPDATE)&&(msg()->HasName(PZG_PEER_NAME_CHECKSUM_MISMATCH))) _master->VerifyOrFixLocalDatabaseChecksum(whichDB);  // so we can recover if the checksum has gone wrong
 
-         ConstPZGDatabaseUpdateRef dbUp = _master->GetDatabaseUpdateByID(whichDB, updateID);
-         if ((dbUp() == NULL)||(msg()->AddFlat(PZG_PEER_NAME_DATABASE_UPDATE, *dbUp()).IsError())) LogTime(MUSCLE_LOG_ERROR, "PZGUnicastSession::MessageReceivedFromGateway()():  Database #" UINT32_FORMAT_SPEC " doesn't have requested back-order " UINT64_FORMAT_SPEC " to send back to junior peer [%s]\n", whichDB, updateID, _remotePeerID.ToString()());
+         ConstPZGDatabaseUpdateRef dbUp;
+         if (updateID == DATABASE_UPDATE_ID_FULL_UPDATE) dbUp = _master->GetFullDatabaseUpdate(whichDB);  // for this special value we send our full current database state
+         else
+         {
+            dbUp = _master->GetDatabaseUpdateByID(whichDB, updateID);
+            _master->BackOrderLookupCompleted(whichDB, dbUp() != NULL);
+         }
+         if ((dbUp() == NULL)||(msg()->AddFlat(PZG_PEER_NAME_DATABASE_UPDATE, FlatCountableRef(CastAwayConstFromRef(dbUp))).IsError())) LogTime(MUSCLE_LOG_ERROR, "PZGUnicastSession::MessageReceivedFromGateway()():  Database #" UINT32_FORMAT_SPEC " doesn't have requested back-order " UINT64_FORMAT_SPEC " to send back to junior peer [%s]\n", whichDB, updateID, _remotePeerID.ToString()());
 
          msg()->what = PZG_UNICAST_COMMAND_REPLY_BACK_ORDER;  // we're going to send this Message right back as our reply
          if (AddOutgoingMessage(msg).IsError())
@@ -124,6 +146,10 @@ void PZGUnicastSession :: MessageReceivedFromGateway(const MessageRef & msg, voi
       }
       break;
 
+      case PZG_UNICAST_COMMAND_REPLY_BACK_ORDER_RANGE: BackOrderRangeReplyReceived(msg);  break;
+      case PZG_UNICAST_COMMAND_REQUEST_SNAPSHOT_CHUNK: SnapshotChunkRequestReceived(msg); break;
+      case PZG_UNICAST_COMMAND_REPLY_SNAPSHOT_CHUNK:   SnapshotChunkReplyReceived(msg);   break;
+
       default:
          _master->UnicastMessageReceivedFromPeer(_remotePeerID, msg);
       break;
@@ -140,7 +166,20 @@ void PZGUnicastSession :: UnregisterMyself(bool forGood)
    if (_master)
    {
       // If we have any back-orders outstanding, make sure the master knows they aren't going to happen
-      for (ConstHashtableIterator<PZGUpdateBackOrderKey, Void> iter(_backorders); iter.HasData(); iter++) _master->BackOrderResultReceived(iter.GetKey(), ConstPZGDatabaseUpdateRef());
+      for (ConstHashtableIterator<PZGUpdateBackOrderKey, uint64> iter(_backorders); iter.HasData(); iter++)
+      {
+         if (iter.GetKey().IsRange())
+         {
+            RangeBackOrderResultReceived(iter.GetKey(), iter.GetKey().GetLastDatabaseUpdateID(), ConstPZGDatabaseUpdateRef());
+            continue;
+         }
+
+         // Partially-downloaded snapshots are kept, so that the download can be resumed when the back-order is requested again
+         PZGIncomingSnapshotRef snap = _master->GetIncomingSnapshot(iter.GetKey(), false);
+         if (snap()) snap()->ConnectionReset();
+
+         _master->BackOrderResultReceived(iter.GetKey(), ConstPZGDatabaseUpdateRef());
+      }
    }
    _backorders.Clear();
 
@@ -151,16 +190,245 @@ void PZGUnicastSession :: UnregisterMyself(bool forGood)
    }
 }
 
-status_t PZGUnicastSession :: RequestBackOrderFromSeniorPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError)
+status_t PZGUnicastSession :: RequestBackOrderFromPeer(const PZGUpdateBackOrderKey & ubok, bool dueToChecksumError)
 {
    if (_backorders.ContainsKey(ubok)) return B_NO_ERROR;  // semi-paranoia:  if it's already on back-order, no need to ask again
 
+   if (ubok.GetDatabaseUpdateID() == DATABASE_UPDATE_ID_FULL_UPDATE)
+   {
+      // The full database state could be huge, so rather than getting it in a single Message, we download it in chunks
+      PZGIncomingSnapshotRef snap = _master->GetIncomingSnapshot(ubok, true);
+      MRETURN_ON_ERROR(snap);
+
+      if (dueToChecksumError) snap()->Reset();  // the senior peer will need to verify its checksum and make a new snapshot, so we can't resume the old one
+                         else snap()->ConnectionReset();
+      MRETURN_ON_ERROR(SendSnapshotChunkRequests(ubok, *snap(), dueToChecksumError));
+      return _backorders.PutWithDefault(ubok);
+   }
+
    MessageRef msg = GetMessageFromPool(PZG_UNICAST_COMMAND_REQUEST_BACK_ORDER);
    MRETURN_OOM_ON_NULL(msg());
    MRETURN_ON_ERROR(msg()->AddFlat(PZG_PEER_NAME_BACK_ORDER,         ubok));
    MRETURN_ON_ERROR(msg()->CAddBool(PZG_PEER_NAME_CHECKSUM_MISMATCH, dueToChecksumError));
    MRETURN_ON_ERROR(AddOutgoingMessage(msg));
-   return _backorders.PutWithDefault(ubok);
+   return _backorders.Put(ubok, ubok.GetDatabaseUpdateID());
+}
+
+static MessageRef CreateBackOrderRangeReplyMessage(const PZGUpdateBackOrderKey & ubok)
+{
+   MessageRef msg = GetMessageFromPool(PZG_UNICAST_COMMAND_REPLY_BACK_ORDER_RANGE);
+   MRETURN_OOM_ON_NULL(msg());
+   MRETURN_ON_ERROR(msg()->AddFlat(PZG_PEER_NAME_BACK_ORDER, ubok));
+   return msg;
+}
+
+void PZGUnicastSession :: BackOrderRangeRequestReceived(const PZGUpdateBackOrderKey & ubok)
+{
+   // We reply with a stream of batch-Messages, each holding as many of the requested updates as fit into PZG_BACK_ORDER_BATCH_SIZE bytes.
+   // Any requested updates that are no longer in our update-log are omitted; the junior peer will notice that they're missing.
+   const uint32 whichDB = ubok.GetDatabaseIndex();
+   status_t ret;
+   MessageRef batchMsg;
+   uint32 batchNumBytes = 0;
+   for (uint64 updateID=ubok.GetDatabaseUpdateID(); updateID<=ubok.GetLastDatabaseUpdateID(); updateID++)
+   {
+      ConstPZGDatabaseUpdateRef dbUp = _master->GetDatabaseUpdateByID(whichDB, updateID);
+      _master->BackOrderLookupCompleted(whichDB, dbUp() != NULL);
+      if (dbUp() == NULL) continue;
+
+      if (batchMsg() == NULL)
+      {
+         batchMsg = CreateBackOrderRangeReplyMessage(ubok);
+         if (batchMsg() == NULL) {ret = batchMsg.GetStatus(); break;}
+      }
+      if (batchMsg()->AddFlat(PZG_PEER_NAME_DATABASE_UPDATE, CastAwayConstFromRef(dbUp)).IsError(ret)) break;  // the update will be flattened only when the batch is sent
+
+      batchNumBytes += dbUp()->FlattenedSize();
+      if (batchNumBytes >= PZG_BACK_ORDER_BATCH_SIZE)
+      {
+         if (AddOutgoingMessage(batchMsg).IsError(ret)) break;
+         batchMsg.Reset();
+         batchNumBytes = 0;
+      }
+   }
+
+   // The last batch (which may not contain any updates) tells the junior peer that the reply is complete
+   if ((ret.IsOK())&&(batchMsg() == NULL))
+   {
+      batchMsg = CreateBackOrderRangeReplyMessage(ubok);
+      if (batchMsg() == NULL) ret = batchMsg.GetStatus();
+   }
+   if ((ret.IsError())||(batchMsg()->AddBool(PZG_UNICAST_NAME_FINAL_BATCH, true).IsError(ret))||(AddOutgoingMessage(batchMsg).IsError(ret)))
+   {
+      LogTime(MUSCLE_LOG_ERROR, "Unable to send range back-order reply (%s) back to junior peer [%s] [%s]\n", ubok.ToString()(), _remotePeerID.ToString()(), ret());
+      EndSession();  // semi-paranoia:  might as well terminate the connection, so that at least the remote peer won't wait forever for his reply
+   }
+}
+
+void PZGUnicastSession :: BackOrderRangeReplyReceived(const MessageRef & msg)
+{
+   status_t ret;
+   PZGUpdateBackOrderKey ubok;
+   if (msg()->FindFlat(PZG_PEER_NAME_BACK_ORDER, ubok).IsError(ret))
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZG_UNICAST_COMMAND_REPLY_BACK_ORDER_RANGE:  Couldn't get PZGUpdateBackOrderKey from Message!  [%s]\n", ret());
+      return;
+   }
+
+   if (_backorders.ContainsKey(ubok) == false)
+   {
+      LogTime(MUSCLE_LOG_WARNING, "PZGUnicastSession:  Got a range back-order reply that I don't remember asking for (%s)\n", ubok.ToString()());
+      return;
+   }
+
+   for (uint32 i=0; ; i++)
+   {
+      PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool();
+      if ((dbUp() == NULL)||(msg()->FindFlat(PZG_PEER_NAME_DATABASE_UPDATE, i, *dbUp()).IsError())) break;
+      RangeBackOrderResultReceived(ubok, dbUp()->GetUpdateID(), dbUp);
+   }
+
+   if (msg()->HasName(PZG_UNICAST_NAME_FINAL_BATCH))
+   {
+      RangeBackOrderResultReceived(ubok, ubok.GetLastDatabaseUpdateID(), ConstPZGDatabaseUpdateRef());  // anything the serving peer didn't send us, it doesn't have
+      (void) _backorders.Remove(ubok);
+   }
+}
+
+void PZGUnicastSession :: RangeBackOrderResultReceived(const PZGUpdateBackOrderKey & rangeKey, uint64 updateID, const ConstPZGDatabaseUpdateRef & optDBUp)
+{
+   const uint64 * nextUpdateID = _backorders.Get(rangeKey);
+   if ((nextUpdateID == NULL)||(updateID < *nextUpdateID)||(updateID > rangeKey.GetLastDatabaseUpdateID())) return;  // not an update we're still waiting for
+
+   // Updates arrive in ascending order, so any we skipped over in the range weren't available from the serving peer
+   const uint64 firstUpdateID = *nextUpdateID;
+   (void) _backorders.Put(rangeKey, updateID+1);  // done before calling out, since the callbacks below might modify (_backorders)
+   for (uint64 id=firstUpdateID; ((id<=updateID)&&(_master)); id++) _master->BackOrderResultReceived(PZGUpdateBackOrderKey(rangeKey.GetTargetPeerID(), rangeKey.GetDatabaseIndex(), id), (id == updateID) ? optDBUp : ConstPZGDatabaseUpdateRef());
+}
+
+status_t PZGUnicastSession :: SendSnapshotChunkRequests(const PZGUpdateBackOrderKey & ubok, PZGIncomingSnapshot & snap, bool dueToChecksumError)
+{
+   uint32 offset;
+   while(snap.GetNextChunkRequestOffset(offset))
+   {
+      MessageRef msg = GetMessageFromPool(PZG_UNICAST_COMMAND_REQUEST_SNAPSHOT_CHUNK);
+      MRETURN_OOM_ON_NULL(msg());
+      MRETURN_ON_ERROR(msg()->AddFlat(PZG_PEER_NAME_BACK_ORDER,         ubok));
+      MRETURN_ON_ERROR(msg()->AddInt64(PZG_UNICAST_NAME_SNAPSHOT_ID,    snap.GetSnapshotID()));
+      MRETURN_ON_ERROR(msg()->AddInt32(PZG_UNICAST_NAME_CHUNK_OFFSET,   offset));
+      MRETURN_ON_ERROR(msg()->CAddBool(PZG_PEER_NAME_CHECKSUM_MISMATCH, dueToChecksumError));
+      MRETURN_ON_ERROR(AddOutgoingMessage(msg));
+   }
+   return B_NO_ERROR;
+}
+
+void PZGUnicastSession :: SnapshotChunkRequestReceived(const MessageRef & msg)
+{
+   status_t ret;
+   PZGUpdateBackOrderKey ubok;
+   if (msg()->FindFlat(PZG_PEER_NAME_BACK_ORDER, ubok).IsError(ret))
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZG_UNICAST_COMMAND_REQUEST_SNAPSHOT_CHUNK:  Couldn't get PZGUpdateBackOrderKey from Message!  [%s]\n", ret());
+      return;
+   }
+
+   const uint32 whichDB    = ubok.GetDatabaseIndex();
+   const uint64 snapshotID = (uint64) msg()->GetInt64(PZG_UNICAST_NAME_SNAPSHOT_ID);
+   PZGOutgoingSnapshotRef snap = _master->GetOutgoingSnapshot(whichDB, snapshotID, msg()->HasName(PZG_PEER_NAME_CHECKSUM_MISMATCH));
+   if ((snap())&&(snap()->IsReady() == false))
+   {
+      // Our helper thread is still flattening this snapshot, so we'll hold on to the request until it's done.
+      // The request is rewritten to refer to the new snapshot, so that it will be served from its beginning.
+      if ((snap()->GetSnapshotID() == snapshotID)
+        ||((msg()->ReplaceInt64(true, PZG_UNICAST_NAME_SNAPSHOT_ID, snap()->GetSnapshotID()).IsOK(ret))&&(msg()->ReplaceInt32(true, PZG_UNICAST_NAME_CHUNK_OFFSET, 0).IsOK(ret))))
+      {
+         if (_deferredSnapshotChunkRequests.AddTail(msg).IsOK(ret)) return;
+      }
+      LogTime(MUSCLE_LOG_ERROR, "PZGUnicastSession:  Unable to defer snapshot chunk request for database #" UINT32_FORMAT_SPEC " [%s]\n", whichDB, ret());
+   }
+   else if ((snap())&&(snap()->GetFlattenedUpdate()() == NULL))
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGUnicastSession:  Database #" UINT32_FORMAT_SPEC " couldn't flatten a snapshot to send back to junior peer [%s]\n", whichDB, _remotePeerID.ToString()());
+   }
+   else if (snap())
+   {
+      // If we're sending a different snapshot than the junior peer asked for, it will have to start over at the beginning
+      const uint32 totalNumBytes = snap()->GetTotalNumBytes();
+      const uint32 offset        = (snap()->GetSnapshotID() == snapshotID) ? muscleMin((uint32) msg()->GetInt32(PZG_UNICAST_NAME_CHUNK_OFFSET), totalNumBytes) : 0;
+      const uint32 numBytes      = muscleMin(totalNumBytes-offset, PZG_SNAPSHOT_CHUNK_SIZE);
+      if ((msg()->ReplaceInt64(true, PZG_UNICAST_NAME_SNAPSHOT_ID,  snap()->GetSnapshotID()).IsError(ret))
+        ||(msg()->ReplaceInt32(true, PZG_UNICAST_NAME_CHUNK_OFFSET, offset).IsError(ret))
+        ||(msg()->AddInt32(PZG_UNICAST_NAME_SNAPSHOT_SIZE, totalNumBytes).IsError(ret))
+        ||(msg()->AddData(PZG_UNICAST_NAME_CHUNK_DATA, B_RAW_TYPE, snap()->GetFlattenedUpdate()()->GetBuffer()+offset, numBytes).IsError(ret))) LogTime(MUSCLE_LOG_ERROR, "PZGUnicastSession:  Unable to prepare snapshot chunk for database #" UINT32_FORMAT_SPEC " [%s]\n", whichDB, ret());
+   }
+   else LogTime(MUSCLE_LOG_ERROR, "PZGUnicastSession:  Database #" UINT32_FORMAT_SPEC " couldn't create a snapshot to send back to junior peer [%s] [%s]\n", whichDB, _remotePeerID.ToString()(), snap.GetStatus()());
+
+   msg()->what = PZG_UNICAST_COMMAND_REPLY_SNAPSHOT_CHUNK;  // we're going to send this Message right back as our reply
+   if (AddOutgoingMessage(msg).IsError())
+   {
+      LogTime(MUSCLE_LOG_ERROR, "Unable to send snapshot chunk back to junior peer [%s]\n", _remotePeerID.ToString()());
+      EndSession();  // semi-paranoia:  might as well terminate the connection, so that at least the remote peer won't wait forever for his reply
+   }
+}
+
+void PZGUnicastSession :: HandleDeferredSnapshotChunkRequests()
+{
+   Queue<MessageRef> requests;
+   requests.SwapContents(_deferredSnapshotChunkRequests);  // any requests that still aren't ready will be re-deferred
+
+   MessageRef msg;
+   while(requests.RemoveHead(msg).IsOK()) SnapshotChunkRequestReceived(msg);
+}
+
+void PZGUnicastSession :: SnapshotChunkReplyReceived(const MessageRef & msg)
+{
+   status_t ret;
+   PZGUpdateBackOrderKey ubok;
+   if (msg()->FindFlat(PZG_PEER_NAME_BACK_ORDER, ubok).IsError(ret))
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZG_UNICAST_COMMAND_REPLY_SNAPSHOT_CHUNK:  Couldn't get PZGUpdateBackOrderKey from Message!  [%s]\n", ret());
+      return;
+   }
+
+   if (_backorders.ContainsKey(ubok) == false)
+   {
+      LogTime(MUSCLE_LOG_WARNING, "PZGUnicastSession:  Got a snapshot chunk that I don't remember asking for (%s)\n", ubok.ToString()());
+      return;
+   }
+
+   PZGIncomingSnapshotRef snap = _master->GetIncomingSnapshot(ubok, false);
+   if (snap() == NULL) ret = snap.GetStatus();
+
+   const void * data = NULL;
+   uint32 numBytes = 0;
+   if ((snap())&&(msg()->FindData(PZG_UNICAST_NAME_CHUNK_DATA, B_RAW_TYPE, &data, &numBytes).IsOK(ret))
+     &&(snap()->ChunkReceived((uint64) msg()->GetInt64(PZG_UNICAST_NAME_SNAPSHOT_ID), (uint32) msg()->GetInt32(PZG_UNICAST_NAME_CHUNK_OFFSET), (uint32) msg()->GetInt32(PZG_UNICAST_NAME_SNAPSHOT_SIZE), static_cast<const uint8 *>(data), numBytes).IsOK(ret)))
+   {
+      if (snap()->IsComplete())
+      {
+         PZGDatabaseUpdateRef dbUp = snap()->GetReceivedUpdate();
+         _master->RemoveIncomingSnapshot(ubok);  // we're done with it now
+         if (dbUp() == NULL) LogTime(MUSCLE_LOG_ERROR, "PZGUnicastSession:  Unable to unflatten snapshot of database #" UINT32_FORMAT_SPEC " [%s]\n", ubok.GetDatabaseIndex(), dbUp.GetStatus()());
+         SnapshotTransferFinished(ubok, dbUp);
+      }
+      else if (SendSnapshotChunkRequests(ubok, *snap(), false).IsError(ret))
+      {
+         LogTime(MUSCLE_LOG_ERROR, "PZGUnicastSession:  Unable to request more snapshot chunks for database #" UINT32_FORMAT_SPEC " [%s]\n", ubok.GetDatabaseIndex(), ret());
+         snap()->ConnectionReset();  // so we can resume from here later
+         SnapshotTransferFinished(ubok, ConstPZGDatabaseUpdateRef());
+      }
+   }
+   else
+   {
+      LogTime(MUSCLE_LOG_ERROR, "PZGUnicastSession:  Snapshot download of database #" UINT32_FORMAT_SPEC " from [%s] failed [%s]\n", ubok.GetDatabaseIndex(), _remotePeerID.ToString()(), ret());
+      _master->RemoveIncomingSnapshot(ubok);
+      SnapshotTransferFinished(ubok, ConstPZGDatabaseUpdateRef());
+   }
+}
+
+void PZGUnicastSession :: SnapshotTransferFinished(const PZGUpdateBackOrderKey & ubok, const ConstPZGDatabaseUpdateRef & optDBUp)
+{
+   if (_backorders.Remove(ubok).IsOK()) _master->BackOrderResultReceived(ubok, optDBUp);
 }
 
 }  // end namespace zg_private
@@ -0,0 +1,131 @@
+#include "zg/private/PZGUpdateLog.h"
+
+namespace zg_private
+{
+
+status_t PZGUpdateLog :: Put(uint64 updateID, const ConstPZGDatabaseUpdateRef & dbUp)
+{
+   if (dbUp() == NULL) return B_BAD_ARGUMENT;
+
+   if ((_ring.IsEmpty())||(updateID >= GetRingEndID()))
+   {
+      if ((_ring.HasItems())&&((updateID-GetRingEndID()) > PZG_UPDATE_LOG_MAX_GAP)) return _overflow.Put(updateID, dbUp);  // too far ahead of the ring to store it there (for now)
+
+      MRETURN_ON_ERROR(AppendToRing(updateID, dbUp));
+      AbsorbOverflowUpdates();
+   }
+   else if (updateID < _firstID)
+   {
+      // This is typically a back-ordered update, and the updates between it and our first update are
+      // on back-order as well, so the empty slots we add here will be filled in soon enough.  But an update
+      // from far before our first update would cost us a huge number of empty slots, so we won't store that one.
+      const uint64 numNewSlots = _firstID-updateID;
+      if ((numNewSlots > PZG_UPDATE_LOG_MAX_GAP)||(numNewSlots > (uint64)(MUSCLE_NO_LIMIT-_ring.GetNumItems()))) return B_RESOURCE_LIMIT;
+      MRETURN_ON_ERROR(_ring.EnsureSize(_ring.GetNumItems()+(uint32)numNewSlots));
+
+      for (uint64 i=1; i<numNewSlots; i++) (void) _ring.AddHead(ConstPZGDatabaseUpdateRef());  // can't fail, since we've preallocated the space
+      (void) _ring.AddHead(dbUp);
+      _firstID = updateID;
+      _numItemsInRing++;
+   }
+   else
+   {
+      ConstPZGDatabaseUpdateRef & slot = _ring[(uint32)(updateID-_firstID)];
+      if (slot() == NULL) _numItemsInRing++;
+      slot = dbUp;
+   }
+   return B_NO_ERROR;
+}
+
+status_t PZGUpdateLog :: Remove(uint64 updateID, ConstPZGDatabaseUpdateRef & retRemoved)
+{
+   if ((updateID >= _firstID)&&(updateID < GetRingEndID()))
+   {
+      ConstPZGDatabaseUpdateRef & slot = _ring[(uint32)(updateID-_firstID)];
+      if (slot() == NULL) return B_DATA_NOT_FOUND;
+
+      retRemoved = slot;
+      slot.Reset();
+      _numItemsInRing--;
+      TrimEmptyRingSlots();
+
+      if ((_ring.IsEmpty())&&(_overflow.HasItems()))
+      {
+         // Our ring is empty, so the oldest overflow update becomes the start of the new ring
+         ConstPZGDatabaseUpdateRef firstOverflow;
+         const uint64 firstOverflowID = *_overflow.GetFirstKey();
+         if ((_overflow.Remove(firstOverflowID, firstOverflow).IsOK())&&(AppendToRing(firstOverflowID, firstOverflow).IsOK())) AbsorbOverflowUpdates();
+      }
+      return B_NO_ERROR;
+   }
+   return _overflow.Remove(updateID, retRemoved);
+}
+
+void PZGUpdateLog :: Clear()
+{
+   _ring.Clear();
+   _overflow.Clear();
+   _firstID        = 0;
+   _numItemsInRing = 0;
+}
+
+uint64 PZGUpdateLog :: GetFirstKeyOfRunEndingAt(uint64 updateID) const
+{
+   if (ContainsKey(updateID) == false) return (uint64)-1;
+
+   if ((updateID >= _firstID)&&(updateID < GetRingEndID()))
+   {
+      if (_numItemsInRing == _ring.GetNumItems()) return _firstID;  // no empty slots, so the run goes all the way back to our first update
+
+      uint64 ret = updateID;
+      while((ret > _firstID)&&(_ring[(uint32)(ret-1-_firstID)]())) ret--;
+      return ret;
+   }
+   else
+   {
+      uint64 ret = updateID;  // overflow updates are never adjacent to the ring, so we needn't look there
+      while(_overflow.ContainsKey(ret-1)) ret--;
+      return ret;
+   }
+}
+
+void PZGUpdateLog :: Print(const OutputPrinter & p) const
+{
+   for (uint32 i=0; i<_ring.GetNumItems(); i++) if (_ring[i]()) p.printf("  %s\n", _ring[i]()->ToString()());
+   for (ConstHashtableIterator<uint64, ConstPZGDatabaseUpdateRef> iter(_overflow); iter.HasData(); iter++) p.printf("  %s\n", iter.GetValue()()->ToString()());
+}
+
+status_t PZGUpdateLog :: AppendToRing(uint64 updateID, const ConstPZGDatabaseUpdateRef & dbUp)
+{
+   if (_ring.IsEmpty()) _firstID = updateID;
+
+   const uint32 numNewSlots = (uint32) (updateID-GetRingEndID())+1;  // our caller guarantees this is at most (PZG_UPDATE_LOG_MAX_GAP+1)
+   MRETURN_ON_ERROR(_ring.EnsureSize(_ring.GetNumItems()+numNewSlots));
+
+   for (uint32 i=1; i<numNewSlots; i++) (void) _ring.AddTail(ConstPZGDatabaseUpdateRef());  // can't fail, since we've preallocated the space
+   (void) _ring.AddTail(dbUp);
+   _numItemsInRing++;
+   return B_NO_ERROR;
+}
+
+void PZGUpdateLog :: TrimEmptyRingSlots()
+{
+   while((_ring.HasItems())&&(_ring.Head()() == NULL)) {(void) _ring.RemoveHead(); _firstID++;}
+   while((_ring.HasItems())&&(_ring.Tail()() == NULL)) (void) _ring.RemoveTail();
+   if (_ring.IsEmpty()) _firstID = 0;
+}
+
+void PZGUpdateLog :: AbsorbOverflowUpdates()
+{
+   // Any overflow updates that are now close enough to the end of the ring get moved into it
+   while(_overflow.HasItems())
+   {
+      const uint64 overflowID = *_overflow.GetFirstKey();
+      if ((overflowID-GetRingEndID()) > PZG_UPDATE_LOG_MAX_GAP) break;
+
+      if (AppendToRing(overflowID, *_overflow.GetFirstValue()).IsError()) break;  // out of memory?  Then it'll just have to stay where it is
+      (void) _overflow.Remove(overflowID);
+   }
+}
+
+}  // end namespace zg_private
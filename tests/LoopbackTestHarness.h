@@ -0,0 +1,249 @@
+#ifndef LoopbackTestHarness_h
+#define LoopbackTestHarness_h
+
+#include "reflector/ReflectServer.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+
+#include "zg/ZGPeerSession.h"
+
+// Shared plumbing for the tests that run several ZG peers inside one process (and one ReflectServer), and
+// have one of those peers poll the others until the behavior under test has been verified or the test times out.
+
+namespace zg
+{
+
+static const uint64 LOOPBACK_TEST_TIMEOUT_MICROS = SecondsToMicros(30);  ///< how long a loopback test may run before it is considered failed
+static const uint64 LOOPBACK_TEST_POLL_MICROS    = MillisToMicros(10);   ///< default interval at which the test-running peer calls CheckTestProgress()
+
+/** A peer session that takes part in a loopback test.  If it is the peer that runs the test, it will call
+  * CheckTestProgress() periodically until EndTest() is called, or fail the test if LOOPBACK_TEST_TIMEOUT_MICROS
+  * pass first.  The test's state is a subclass-defined value that starts out at zero.
+  * @tparam PeerSessionBase the ZGPeerSession subclass that the test exercises
+  */
+template<class PeerSessionBase> class LoopbackTestPeerSession : public PeerSessionBase
+{
+public:
+   /** Constructor
+     * @param peerSettings the settings to pass to our PeerSessionBase
+     * @param runsTest true iff this peer is the one that runs the test (i.e. whose CheckTestProgress() should be called)
+     * @param pollIntervalMicros how often to call CheckTestProgress(), if (runsTest) is true
+     */
+   LoopbackTestPeerSession(const ZGPeerSettings & peerSettings, bool runsTest, uint64 pollIntervalMicros = LOOPBACK_TEST_POLL_MICROS)
+      : PeerSessionBase(peerSettings)
+      , _runsTest(runsTest)
+      , _pollIntervalMicros(pollIntervalMicros)
+      , _testDeadline(GetRunTime64()+LOOPBACK_TEST_TIMEOUT_MICROS)
+      , _testState(0)
+      , _testDone(false)
+      , _exitCode(10)
+   {/* empty */}
+
+   virtual uint64 GetPulseTime(const PulseArgs & args)
+   {
+      const uint64 ret = PeerSessionBase::GetPulseTime(args);
+      return IsTestRunning() ? muscleMin(ret, GetRunTime64()+_pollIntervalMicros) : ret;
+   }
+
+   virtual void Pulse(const PulseArgs & args)
+   {
+      PeerSessionBase::Pulse(args);
+      if (IsTestRunning() == false) return;
+
+      if (GetRunTime64() >= _testDeadline)
+      {
+         TestTimedOut();
+         EndTest(10);
+      }
+      else CheckTestProgress();
+   }
+
+   /** Returns the process exit code that the test ended with (10 if it never ended) */
+   MUSCLE_NODISCARD int GetExitCode() const {return _exitCode;}
+
+protected:
+   /** Called periodically on the peer that runs the test, until the test ends.  Should check on the test's
+     * progress, advance its state as appropriate, and call EndTest() once the test has passed or failed.
+     */
+   virtual void CheckTestProgress() = 0;
+
+   /** Called when the test has run out of time, just before it is ended with a failure.  Default implementation logs the test's state. */
+   virtual void TestTimedOut() {LogTime(MUSCLE_LOG_CRITICALERROR, "Test timed out in state %i!\n", _testState);}
+
+   /** Returns the test's current state (initially zero) */
+   MUSCLE_NODISCARD int GetTestState() const {return _testState;}
+
+   /** Sets the test's current state
+     * @param testState the new state
+     */
+   void SetTestState(int testState) {_testState = testState;}
+
+   /** Ends the test, and the ReflectServer's event loop along with it
+     * @param exitCode the process exit code to report:  0 if the test passed, or 10 if it failed
+     */
+   void EndTest(int exitCode)
+   {
+      _exitCode = exitCode;
+      _testDone = true;
+      this->EndServer();
+   }
+
+private:
+   MUSCLE_NODISCARD bool IsTestRunning() const {return ((_runsTest)&&(_testDone == false));}
+
+   const bool _runsTest;
+   const uint64 _pollIntervalMicros;
+   const uint64 _testDeadline;
+   int _testState;
+   bool _testDone;
+   int _exitCode;
+};
+
+enum {
+   VALUE_LIST_TEST_COMMAND_APPEND = 1818391670, // 'lbtv' -- appends the specified value to our database's list of values
+};
+
+static const String VALUE_LIST_TEST_NAME_VALUE = "val";
+
+/** A loopback-test peer session whose one database is a list of int32 values, which update-requests append to.
+  * Each value's contribution to the database checksum depends on its position in the list, so that executing
+  * the updates out of order would result in a different checksum.
+  */
+class ValueListTestPeerSession : public LoopbackTestPeerSession<ZGPeerSession>
+{
+public:
+   /** Constructor
+     * @param peerSettings the settings to pass to our ZGPeerSession
+     * @param runsTest true iff this peer is the one that runs the test
+     */
+   ValueListTestPeerSession(const ZGPeerSettings & peerSettings, bool runsTest) : LoopbackTestPeerSession<ZGPeerSession>(peerSettings, runsTest) {/* empty */}
+
+   /** Returns our database's contents */
+   MUSCLE_NODISCARD const Queue<int32> & GetValues() const {return _values;}
+
+protected:
+   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & seniorDoMsg)
+   {
+      return HandleUpdate(whichDatabase, dbChecksum, seniorDoMsg).IsOK() ? seniorDoMsg : ConstMessageRef();
+   }
+
+   virtual status_t JuniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & juniorDoMsg)
+   {
+      return HandleUpdate(whichDatabase, dbChecksum, juniorDoMsg);
+   }
+
+   virtual void ResetLocalDatabaseToDefault(uint32 /*whichDatabase*/, uint64 & dbChecksum)
+   {
+      _values.Clear();
+      dbChecksum = 0;
+   }
+
+   virtual MessageRef SaveLocalDatabaseToMessage(uint32 /*whichDatabase*/) const
+   {
+      MessageRef ret = GetMessageFromPool(VALUE_LIST_TEST_COMMAND_APPEND);
+      MRETURN_OOM_ON_NULL(ret());
+      for (uint32 i=0; i<_values.GetNumItems(); i++) MRETURN_ON_ERROR(ret()->AddInt32(VALUE_LIST_TEST_NAME_VALUE, _values[i]));
+      return ret;
+   }
+
+   virtual status_t SetLocalDatabaseFromMessage(uint32 /*whichDatabase*/, uint64 & dbChecksum, const ConstMessageRef & newDBStateMsg)
+   {
+      _values.Clear();
+      int32 val;
+      for (uint32 i=0; newDBStateMsg()->FindInt32(VALUE_LIST_TEST_NAME_VALUE, i, val).IsOK(); i++) MRETURN_ON_ERROR(_values.AddTail(val));
+      dbChecksum = CalculateLocalDatabaseChecksum(0);
+      return B_NO_ERROR;
+   }
+
+   virtual uint64 CalculateLocalDatabaseChecksum(uint32 /*whichDatabase*/) const
+   {
+      uint64 ret = 0;
+      for (uint32 i=0; i<_values.GetNumItems(); i++) ret += CalculateValueChecksum(i, _values[i]);
+      return ret;
+   }
+
+   /** Returns a new update-request Message that will append (val) to the database's list of values
+     * @param val the value to append
+     */
+   static MessageRef GetAppendMessage(int32 val)
+   {
+      MessageRef msg = GetMessageFromPool(VALUE_LIST_TEST_COMMAND_APPEND);
+      MRETURN_OOM_ON_NULL(msg());
+      MRETURN_ON_ERROR(msg()->AddInt32(VALUE_LIST_TEST_NAME_VALUE, val));
+      return msg;
+   }
+
+   /** Requests that (val) be appended to the database's list of values
+     * @param val the value to append
+     */
+   status_t RequestAppend(int32 val)
+   {
+      const MessageRef msg = GetAppendMessage(val);
+      MRETURN_ON_ERROR(msg);
+      return RequestUpdateDatabaseState(0, msg);
+   }
+
+private:
+   MUSCLE_NODISCARD static uint64 CalculateValueChecksum(uint32 idx, int32 val) {return (((uint64)idx)+1)*(((uint64)val)+7);}
+
+   status_t HandleUpdate(uint32 /*whichDatabase*/, uint64 & dbChecksum, const ConstMessageRef & msg)
+   {
+      int32 val;
+      MRETURN_ON_ERROR(msg()->FindInt32(VALUE_LIST_TEST_NAME_VALUE, val));
+      MRETURN_ON_ERROR(_values.AddTail(val));
+      dbChecksum += CalculateValueChecksum(_values.GetNumItems()-1, val);
+      return B_NO_ERROR;
+   }
+
+   Queue<int32> _values;  // our database's contents
+};
+
+/** Returns a system name for a run of the specified test that no other run will share, so that concurrent runs don't see each other's peers
+  * @param testName the name of the test program, e.g. "update_ack_test"
+  */
+inline String GetLoopbackTestSystemName(const String & testName) {return String("%1_%2").Arg(testName).Arg(GetCurrentTime64());}
+
+/** Returns the ZGPeerSettings that a loopback test's peer should start with.  If the command-line arguments
+  * include "multicast=sim", the peers will use simulated multicast (unicast) instead of real multicast.
+  * @param args the test program's parsed command-line arguments
+  * @param testName the name of the test program, e.g. "update_ack_test"; used as the peers' signature
+  * @param systemName the system name that the test's peers share (see GetLoopbackTestSystemName())
+  * @param numDatabases how many databases each peer has
+  * @param peerType the type of peer (e.g. PEER_TYPE_FULL_PEER or PEER_TYPE_JUNIOR_ONLY)
+  */
+inline ZGPeerSettings GetLoopbackTestPeerSettings(const Message & args, const String & testName, const String & systemName, uint8 numDatabases, uint16 peerType = PEER_TYPE_FULL_PEER)
+{
+   ZGPeerSettings s(testName, systemName, numDatabases, true, peerType);
+
+   String multicastMode;
+   if ((args.FindString("multicast", multicastMode).IsOK())&&(multicastMode.ContainsIgnoreCase("sim"))) s.SetMulticastBehavior(ZG_MULTICAST_BEHAVIOR_SIMULATED_ONLY);
+
+   return s;
+}
+
+/** Runs a ReflectServer event loop containing the specified peers, until the test ends.  Returns the test's exit code.
+  * @param peers an array of pointers to the test's peers
+  * @param numPeers the number of pointers in (peers)
+  * @param testRunner the peer that runs the test (which should also be in (peers))
+  */
+template<class PeerSessionType> int RunLoopbackTest(PeerSessionType * const peers[], uint32 numPeers, const PeerSessionType & testRunner)
+{
+   int exitCode = 10;
+   status_t ret;
+   ReflectServer server;
+
+   for (uint32 i=0; i<numPeers; i++) if (server.AddNewSession(DummyZGPeerSessionRef(*peers[i])).IsError(ret)) break;
+   if (ret.IsOK())
+   {
+      if (server.ServerProcessLoop().IsOK(ret)) exitCode = testRunner.GetExitCode();
+                                           else LogTime(MUSCLE_LOG_CRITICALERROR, "Event loop aborted! [%s]\n", ret());
+   }
+   else LogTime(MUSCLE_LOG_CRITICALERROR, "Couldn't add test peer sessions! [%s]\n", ret());
+
+   server.Cleanup();
+   return exitCode;
+}
+
+}  // end namespace zg
+
+#endif
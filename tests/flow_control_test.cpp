@@ -0,0 +1,152 @@
+#include "LoopbackTestHarness.h"
+
+using namespace zg;
+
+// This program runs a senior peer and a junior-only peer in the same process, with a small maximum junior-lag
+// (see ZGPeerSettings::SetMaximumJuniorLagForDatabase()), and has the senior peer issue a burst of update-requests.
+// It verifies that the senior peer defers some of the requests while the junior peer lags behind, and that every
+// deferred request is eventually released and executed, in order, once the junior peer catches up.  It does this
+// once without group-commit mode and once with it, since group-commits change when the senior peer's state advances.
+//
+// Optional command-line arguments:
+//    updates=N      -- how many update-requests to issue in the burst (defaults to 100)
+//    maxlag=N       -- the maximum number of updates the junior peer may lag by (defaults to 2)
+//    multicast=sim  -- use simulated multicast (unicast) instead of real multicast
+
+enum {
+   TEST_STATE_WAIT_FOR_PEERS = 0,
+   TEST_STATE_WARM_UP,
+   TEST_STATE_BURST
+};
+
+class FlowControlTestPeerSession : public ValueListTestPeerSession
+{
+public:
+   FlowControlTestPeerSession(const ZGPeerSettings & peerSettings, FlowControlTestPeerSession * optJuniorPeer, uint32 numUpdates)
+      : ValueListTestPeerSession(peerSettings, (optJuniorPeer != NULL))
+      , _juniorPeer(optJuniorPeer)
+      , _numUpdates(numUpdates)
+      , _warmUpStateID(0)
+      , _maxDeferred(0)
+   {/* empty */}
+
+   virtual const char * GetTypeName() const {return "FlowControlTestPeer";}
+
+protected:
+   virtual void TestTimedOut()
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Test timed out in state %i, with " UINT32_FORMAT_SPEC " update-requests still deferred!\n", GetTestState(), GetNumDeferredUpdateRequests(0));
+   }
+
+private:
+   // Returns true iff the junior peer has executed everything we have, and we have nothing left to execute
+   MUSCLE_NODISCARD bool IsJuniorCaughtUp() const
+   {
+      return ((GetNumDeferredUpdateRequests(0) == 0)&&(_juniorPeer->IAmFullyAttached())&&(_juniorPeer->GetCurrentDatabaseStateID(0) == GetCurrentDatabaseStateID(0)));
+   }
+
+   // Returns true iff both peers' databases hold exactly the values 1 through (numValues), in order
+   bool VerifyValues(uint32 numValues) const
+   {
+      const FlowControlTestPeerSession * peers[] = {this, _juniorPeer};
+      for (uint32 p=0; p<ARRAYITEMS(peers); p++)
+      {
+         const Queue<int32> & values = peers[p]->GetValues();
+         bool ok = (values.GetNumItems() == numValues);
+         for (uint32 i=0; ((ok)&&(i<numValues)); i++) ok = (values[i] == (int32)(i+1));
+         if (ok == false)
+         {
+            LogTime(MUSCLE_LOG_CRITICALERROR, "The %s peer's database holds " UINT32_FORMAT_SPEC " values, expected 1 through " UINT32_FORMAT_SPEC " in order!\n", (p==0)?"senior":"junior", values.GetNumItems(), numValues);
+            return false;
+         }
+      }
+      return true;
+   }
+
+   virtual void CheckTestProgress()
+   {
+      switch(GetTestState())
+      {
+         case TEST_STATE_WAIT_FOR_PEERS:
+            if ((IAmFullyAttached())&&(IAmTheSeniorPeer())&&(_juniorPeer->GetSeniorPeerID() == GetLocalPeerID())&&(IsJuniorCaughtUp()))
+            {
+               // One update first, so that the junior peer will have sent us an applied-state report before the burst starts
+               _warmUpStateID = GetCurrentDatabaseStateID(0);
+               if (RequestAppend(1).IsOK()) SetTestState(TEST_STATE_WARM_UP);
+                                       else EndTest(10);
+            }
+         break;
+
+         case TEST_STATE_WARM_UP:
+            if ((GetCurrentDatabaseStateID(0) > _warmUpStateID)&&(IsJuniorCaughtUp()))
+            {
+               LogTime(MUSCLE_LOG_INFO, "Peers are in sync; issuing " UINT32_FORMAT_SPEC " update-requests at once...\n", _numUpdates);
+               for (uint32 i=0; i<_numUpdates; i++)
+               {
+                  if (RequestAppend(i+2).IsError()) {LogTime(MUSCLE_LOG_CRITICALERROR, "Update-request #" UINT32_FORMAT_SPEC " failed!\n", i); EndTest(10); return;}
+               }
+               SetTestState(TEST_STATE_BURST);
+            }
+         break;
+
+         case TEST_STATE_BURST:
+            _maxDeferred = muscleMax(_maxDeferred, GetNumDeferredUpdateRequests(0));
+            if ((GetValues().GetNumItems() == _numUpdates+1)&&(IsJuniorCaughtUp()))
+            {
+               LogTime(MUSCLE_LOG_INFO, "All updates executed; at most " UINT32_FORMAT_SPEC " update-requests were deferred at once.\n", _maxDeferred);
+
+               bool ok = VerifyValues(_numUpdates+1);
+               if (_maxDeferred == 0) {LogTime(MUSCLE_LOG_CRITICALERROR, "No update-requests were ever deferred!\n"); ok = false;}
+               EndTest(ok ? 0 : 10);
+            }
+         break;
+
+         default:
+            // empty
+         break;
+      }
+   }
+
+   FlowControlTestPeerSession * _juniorPeer;  // non-NULL only on the senior peer, which runs the test
+   const uint32 _numUpdates;
+   uint64 _warmUpStateID;
+   uint32 _maxDeferred;
+};
+
+static ZGPeerSettings GetTestPeerSettings(const Message & args, const String & systemName, uint16 peerType, uint64 maxLagUpdates, uint64 groupCommitWindowMicros)
+{
+   ZGPeerSettings s = GetLoopbackTestPeerSettings(args, "flow_control_test", systemName, 1, peerType);
+   s.SetMaximumJuniorLagForDatabase(0, maxLagUpdates);
+   s.SetGroupCommitWindowForDatabase(0, groupCommitWindowMicros);
+   return s;
+}
+
+static int RunTest(const char * desc, const Message & args, uint32 numUpdates, uint64 maxLagUpdates, uint64 groupCommitWindowMicros)
+{
+   LogTime(MUSCLE_LOG_INFO, "%s:\n", desc);
+
+   const String systemName = GetLoopbackTestSystemName("flow_control_test");
+   FlowControlTestPeerSession juniorPeer(GetTestPeerSettings(args, systemName, PEER_TYPE_JUNIOR_ONLY, maxLagUpdates, groupCommitWindowMicros), NULL,        numUpdates);
+   FlowControlTestPeerSession seniorPeer(GetTestPeerSettings(args, systemName, PEER_TYPE_FULL_PEER,   maxLagUpdates, groupCommitWindowMicros), &juniorPeer, numUpdates);
+
+   FlowControlTestPeerSession * peers[] = {&seniorPeer, &juniorPeer};
+   return RunLoopbackTest(peers, ARRAYITEMS(peers), seniorPeer);
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   const char * s;
+   const uint32 numUpdates    = (args.FindString("updates", &s).IsOK()) ? (uint32) atol(s) : 100;
+   const uint64 maxLagUpdates = (args.FindString("maxlag",  &s).IsOK()) ? (uint64) Atoull(s) : 2;
+
+   if (RunTest("Group-commit disabled", args, numUpdates, maxLagUpdates, MUSCLE_TIME_NEVER) != 0) return 10;
+   if (RunTest("Group-commit enabled",  args, numUpdates, maxLagUpdates, 0)                 != 0) return 10;
+
+   LogTime(MUSCLE_LOG_INFO, "Test passed.\n");
+   return 0;
+}
@@ -0,0 +1,167 @@
+#include "reflector/ReflectServer.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+
+#include "zg/ZGPeerSession.h"
+
+using namespace zg;
+
+// This program measures how many database-updates per second a lone senior peer can commit,
+// first with group-commit mode disabled and then with it enabled, so the two can be compared.
+//
+// Optional command-line arguments:
+//    updates=N   -- how many update-requests to commit in each run (defaults to 50000)
+//    burst=N     -- how many update-requests to issue per event-loop iteration (defaults to 100)
+//    window=N    -- the group-commit window (in microseconds) to use for the second run (defaults to 0)
+
+enum {
+   BENCHMARK_COMMAND_INCREMENT = 1651401576, // 'bnch' -- adds the specified value to our counter
+};
+
+static const String BENCHMARK_NAME_VALUE = "val";
+
+static ZGPeerSettings GetBenchmarkPeerSettings(uint64 groupCommitWindowMicros)
+{
+   // Our own system name, so that we won't interact with any other peers that might be running on this host
+   ZGPeerSettings s("group_commit_benchmark", String("benchmark_%1").Arg(GetRunTime64()), 1, true);
+   s.SetGroupCommitWindowForDatabase(0, groupCommitWindowMicros);
+   return s;
+}
+
+class BenchmarkPeerSession : public ZGPeerSession
+{
+public:
+   BenchmarkPeerSession(uint64 groupCommitWindowMicros, uint32 numUpdates, uint32 burstSize)
+      : ZGPeerSession(GetBenchmarkPeerSettings(groupCommitWindowMicros))
+      , _numUpdates(numUpdates)
+      , _burstSize(muscleMax(burstSize, (uint32)1))
+      , _numRequested(0)
+      , _numExecuted(0)
+      , _startTime(0)
+      , _elapsedMicros(0)
+      , _numDatabaseUpdates(0)
+      , _counter(0)
+   {/* empty */}
+
+   virtual const char * GetTypeName() const {return "BenchmarkPeer";}
+
+   virtual uint64 GetPulseTime(const PulseArgs & args) {return IAmFullyAttached() ? 0 : ZGPeerSession::GetPulseTime(args);}
+
+   virtual void Pulse(const PulseArgs & args)
+   {
+      ZGPeerSession::Pulse(args);
+      if ((IAmFullyAttached() == false)||(IAmTheSeniorPeer() == false)) return;
+
+      if (_startTime == 0) _startTime = GetRunTime64();
+
+      if (_numExecuted < _numUpdates)
+      {
+         for (uint32 i=0; ((i<_burstSize)&&(_numRequested<_numUpdates)); i++)
+         {
+            MessageRef msg = GetMessageFromPool(BENCHMARK_COMMAND_INCREMENT);
+            if ((msg())&&(msg()->AddInt32(BENCHMARK_NAME_VALUE, _numRequested+1).IsOK())&&(RequestUpdateDatabaseState(0, msg).IsOK())) _numRequested++;
+                                                                                                                                   else break;
+         }
+      }
+      else if (GetCurrentDatabaseStateID(0) == _numDatabaseUpdates)
+      {
+         // The database-state-ID stayed the same for a full event-loop iteration, so any pending group has been committed
+         _elapsedMicros = GetRunTime64()-_startTime;
+         EndServer();
+      }
+      else _numDatabaseUpdates = GetCurrentDatabaseStateID(0);
+   }
+
+   MUSCLE_NODISCARD uint32 GetNumExecuted()         const {return _numExecuted;}
+   MUSCLE_NODISCARD uint64 GetElapsedMicros()       const {return _elapsedMicros;}
+   MUSCLE_NODISCARD uint64 GetNumDatabaseUpdates()  const {return _numDatabaseUpdates;}
+
+protected:
+   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & seniorDoMsg)
+   {
+      return HandleUpdate(whichDatabase, dbChecksum, seniorDoMsg).IsOK() ? seniorDoMsg : ConstMessageRef();
+   }
+
+   virtual status_t JuniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & juniorDoMsg)
+   {
+      return HandleUpdate(whichDatabase, dbChecksum, juniorDoMsg);
+   }
+
+   virtual void ResetLocalDatabaseToDefault(uint32 /*whichDatabase*/, uint64 & dbChecksum)
+   {
+      _counter   = 0;
+      dbChecksum = 0;
+   }
+
+   virtual MessageRef SaveLocalDatabaseToMessage(uint32 /*whichDatabase*/) const
+   {
+      MessageRef ret = GetMessageFromPool(BENCHMARK_COMMAND_INCREMENT);
+      if ((ret())&&(ret()->AddInt64(BENCHMARK_NAME_VALUE, _counter).IsError())) return MessageRef();
+      return ret;
+   }
+
+   virtual status_t SetLocalDatabaseFromMessage(uint32 /*whichDatabase*/, uint64 & dbChecksum, const ConstMessageRef & newDBStateMsg)
+   {
+      _counter   = newDBStateMsg()->GetInt64(BENCHMARK_NAME_VALUE);
+      dbChecksum = (uint64) _counter;
+      return B_NO_ERROR;
+   }
+
+   virtual uint64 CalculateLocalDatabaseChecksum(uint32 /*whichDatabase*/) const {return (uint64) _counter;}
+
+private:
+   status_t HandleUpdate(uint32 /*whichDatabase*/, uint64 & dbChecksum, const ConstMessageRef & msg)
+   {
+      int32 val;
+      MRETURN_ON_ERROR(msg()->FindInt32(BENCHMARK_NAME_VALUE, val));
+
+      _counter  += val;
+      dbChecksum = (uint64) _counter;
+      _numExecuted++;
+      return B_NO_ERROR;
+   }
+
+   const uint32 _numUpdates;
+   const uint32 _burstSize;
+   uint32 _numRequested;
+   uint32 _numExecuted;
+   uint64 _startTime;
+   uint64 _elapsedMicros;
+   uint64 _numDatabaseUpdates;
+   int64 _counter;
+};
+
+static status_t RunBenchmark(const char * desc, uint64 groupCommitWindowMicros, uint32 numUpdates, uint32 burstSize)
+{
+   BenchmarkPeerSession peerSession(groupCommitWindowMicros, numUpdates, burstSize);
+
+   ReflectServer server;
+   status_t ret;
+   if ((server.AddNewSession(DummyZGPeerSessionRef(peerSession)).IsOK(ret))&&(server.ServerProcessLoop().IsOK(ret)))
+   {
+      const double secs = ((double)peerSession.GetElapsedMicros())/1000000.0;
+      LogTime(MUSCLE_LOG_INFO, "%s:  " UINT32_FORMAT_SPEC " updates committed as " UINT64_FORMAT_SPEC " database-updates in %s (%.0f updates/sec)\n", desc, peerSession.GetNumExecuted(), peerSession.GetNumDatabaseUpdates(), GetHumanReadableUnsignedTimeIntervalString(peerSession.GetElapsedMicros())(), (secs>0.0)?(((double)peerSession.GetNumExecuted())/secs):0.0);
+   }
+   else LogTime(MUSCLE_LOG_ERROR, "%s:  Benchmark run failed! [%s]\n", desc, ret());
+
+   server.Cleanup();
+   return ret;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   const char * s;
+   const uint32 numUpdates   = (args.FindString("updates", &s).IsOK()) ? (uint32) atol(s) : 50000;
+   const uint32 burstSize    = (args.FindString("burst",   &s).IsOK()) ? (uint32) atol(s) : 100;
+   const uint64 windowMicros = (args.FindString("window",  &s).IsOK()) ? (uint64) Atoull(s) : 0;
+
+   LogTime(MUSCLE_LOG_INFO, "Committing " UINT32_FORMAT_SPEC " updates, " UINT32_FORMAT_SPEC " requests per event-loop iteration...\n", numUpdates, burstSize);
+   if (RunBenchmark("Group-commit disabled", MUSCLE_TIME_NEVER, numUpdates, burstSize).IsError()) return 10;
+   if (RunBenchmark(String("Group-commit enabled (%1uS window)").Arg(windowMicros)(), windowMicros, numUpdates, burstSize).IsError()) return 10;
+   return 0;
+}
@@ -0,0 +1,182 @@
+#include "iogateway/PacketTunnelIOGateway.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+
+#include "zg/ZGConstants.h"  // for GetRandomNumber()
+#include "zg/private/PZGFECPacketDataIO.h"
+
+using namespace zg_private;
+
+// This program sends a series of Messages through a PacketTunnelIOGateway and a simulated lossy multicast
+// network, first without forward-error-correction and then with PZGFECPacketDataIO's parity packets, and
+// reports how many of the Messages didn't make it through (i.e. how many database-updates a junior peer
+// would have had to NACK or back-order).  The receiver's loss reports are fed back to the sender, as the
+// network I/O thread does, so that the parity groups adapt to the simulated loss rate.  It then does the
+// same for sparse traffic (small Messages, each sent on its own), where every parity group holds just one
+// packet, to verify that the sender still turns on parity for that case once loss is reported.
+//
+// Optional command-line arguments:
+//    messages=N  -- how many Messages to send (defaults to 20000)
+//    loss=N      -- percentage of packets to drop (defaults to 2)
+//    group=N     -- maximum number of data packets per parity packet (defaults to 16)
+//    burst=N     -- number of Messages to send between parity flushes (defaults to 10)
+
+// A PacketDataIO that delivers every packet written to it back to its reader, except for a (pseudo-random) fraction of them
+class LossyLoopbackDataIO : public PacketDataIO
+{
+public:
+   LossyLoopbackDataIO(uint32 lossPercent)
+      : _lossPercent(lossPercent)
+      , _source(localhostIP, 9999)
+      , _randomSeed(12345)  // so that each run drops the same packets
+      , _numPacketsSent(0)
+      , _numPacketsDropped(0)
+   {/* empty */}
+
+   virtual io_status_t Read(void * buffer, uint32 size) {IPAddressAndPort junk; return ReadFrom(buffer, size, junk);}
+   virtual io_status_t ReadFrom(void * buffer, uint32 size, IPAddressAndPort & retPacketSource)
+   {
+      ByteBufferRef buf;
+      if (_packets.RemoveHead(buf).IsError()) return 0;  // nothing to read right now
+
+      const uint32 numBytes = muscleMin(buf()->GetNumBytes(), size);
+      memcpy(buffer, buf()->GetBuffer(), numBytes);
+      retPacketSource = _source;
+      return numBytes;
+   }
+
+   virtual io_status_t Write(const void * buffer, uint32 size) {return WriteTo(buffer, size, _source);}
+   virtual io_status_t WriteTo(const void * buffer, uint32 size, const IPAddressAndPort & /*packetDest*/)
+   {
+      _numPacketsSent++;
+      if ((((uint32)GetRandomNumber(&_randomSeed))%100) < _lossPercent) _numPacketsDropped++;
+      else
+      {
+         ByteBufferRef buf = GetByteBufferFromPool(size, (const uint8 *) buffer);
+         MRETURN_ON_ERROR(_packets.AddTail(buf));
+      }
+      return size;
+   }
+
+   virtual void FlushOutput() {/* empty */}
+   virtual void Shutdown() {_packets.Clear();}
+   MUSCLE_NODISCARD virtual const ConstSocketRef & GetReadSelectSocket()  const {return _nullSocket;}
+   MUSCLE_NODISCARD virtual const ConstSocketRef & GetWriteSelectSocket() const {return _nullSocket;}
+   MUSCLE_NODISCARD virtual uint32 GetMaximumPacketSize() const {return MUSCLE_MAX_PAYLOAD_BYTES_PER_UDP_ETHERNET_PACKET;}
+   MUSCLE_NODISCARD virtual const IPAddressAndPort & GetSourceOfLastReadPacket() const {return _source;}
+   MUSCLE_NODISCARD virtual const IPAddressAndPort & GetPacketSendDestination() const {return _source;}
+   virtual status_t SetPacketSendDestination(const IPAddressAndPort & /*iap*/) {return B_NO_ERROR;}
+
+   MUSCLE_NODISCARD uint32 GetNumPacketsSent() const {return _numPacketsSent;}
+   MUSCLE_NODISCARD uint32 GetNumPacketsDropped() const {return _numPacketsDropped;}
+
+private:
+   const uint32 _lossPercent;
+   const IPAddressAndPort _source;
+   const ConstSocketRef _nullSocket;
+   unsigned int _randomSeed;
+   Queue<ByteBufferRef> _packets;
+   uint32 _numPacketsSent;
+   uint32 _numPacketsDropped;
+};
+
+static const String TEST_NAME_INDEX   = "idx";
+static const String TEST_NAME_PAYLOAD = "pay";
+
+static const uint32 TEST_LOSS_REPORT_INTERVAL = 100;  // Messages sent per simulated loss report (i.e. roughly one second's worth of updates)
+
+// Returns the number of Messages that didn't arrive, or -1 on error
+static int32 RunTest(uint32 numMessages, uint32 lossPercent, uint32 maxGroupSize, uint32 burstSize, uint32 maxPayloadSize)
+{
+   LossyLoopbackDataIO * loopback = new LossyLoopbackDataIO(lossPercent);
+   PacketDataIORef loopbackRef(loopback);
+
+   PZGFECPacketDataIORef senderFEC(new PZGFECPacketDataIO(loopbackRef, maxGroupSize, 1));
+   PZGFECPacketDataIORef receiverFEC(new PZGFECPacketDataIO(loopbackRef, 0, 2));
+
+   PacketTunnelIOGateway sender;   sender.SetDataIO(senderFEC);
+   PacketTunnelIOGateway receiver; receiver.SetDataIO(receiverFEC);
+
+   QueueGatewayMessageReceiver messageReceiver;
+   Hashtable<uint32, Void> receivedIndices;
+   unsigned int payloadSeed = 54321;
+
+   for (uint32 i=0; i<numMessages; i++)
+   {
+      // Database updates vary in size, and some of them will be fragmented across several packets
+      MessageRef msg = GetMessageFromPool(i);
+      if ((msg() == NULL)||(msg()->AddInt32(TEST_NAME_INDEX, i).IsError())||(msg()->AddString(TEST_NAME_PAYLOAD, String().Pad(((uint32)GetRandomNumber(&payloadSeed))%maxPayloadSize)).IsError())||(sender.AddOutgoingMessage(msg).IsError())) return -1;
+      while(sender.DoOutput().GetByteCount() > 0) {/* empty */}
+
+      if ((((i+1)%burstSize) == 0)||(i+1 == numMessages))
+      {
+         // Simulates the network I/O thread's parity-flush timer going off at the end of a burst
+         senderFEC()->FlushParity();
+
+         while(receiver.DoInput(messageReceiver).GetByteCount() > 0) {/* empty */}
+
+         MessageRef rMsg;
+         while(messageReceiver.RemoveHead(rMsg).IsOK())
+         {
+            uint32 idx;
+            if (rMsg()->FindInt32(TEST_NAME_INDEX, idx).IsOK()) (void) receivedIndices.PutWithDefault(idx);
+         }
+      }
+
+      if (((i+1)%TEST_LOSS_REPORT_INTERVAL) == 0)
+      {
+         // Simulates the receiver's periodic loss reports
+         uint32 numExpected, numLost;
+         receiverFEC()->GetAndResetLossStatistics(numExpected, numLost);
+         if (numExpected > 0) senderFEC()->LossReportReceived(ZGPeerID(), ((float)numLost)/numExpected, GetRunTime64());
+      }
+   }
+
+   const uint32 numMissing = numMessages-receivedIndices.GetNumItems();
+   LogTime(MUSCLE_LOG_INFO, "Max group size " UINT32_FORMAT_SPEC ":  " UINT32_FORMAT_SPEC " packets sent, " UINT32_FORMAT_SPEC " dropped, " UINT64_FORMAT_SPEC " recovered from parity; " UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " Messages lost (%.2f%% would need to be back-ordered)\n", maxGroupSize, loopback->GetNumPacketsSent(), loopback->GetNumPacketsDropped(), receiverFEC()->GetNumRecoveredPackets(), numMissing, numMessages, (numMessages>0)?((100.0*numMissing)/numMessages):0.0);
+   return numMissing;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   const char * s;
+   const uint32 numMessages  = (args.FindString("messages", &s).IsOK()) ? (uint32) atol(s) : 20000;
+   const uint32 lossPercent  = (args.FindString("loss",     &s).IsOK()) ? (uint32) atol(s) : 2;
+   const uint32 maxGroupSize = (args.FindString("group",    &s).IsOK()) ? (uint32) atol(s) : 16;
+   const uint32 burstSize    = (args.FindString("burst",    &s).IsOK()) ? muscleMax((uint32) atol(s), (uint32)1) : 10;
+
+   LogTime(MUSCLE_LOG_INFO, "Sending " UINT32_FORMAT_SPEC " Messages with " UINT32_FORMAT_SPEC "%% simulated packet loss...\n", numMessages, lossPercent);
+   const int32 missingWithoutFEC = RunTest(numMessages, lossPercent, 0, burstSize, 2500);
+   const int32 missingWithFEC    = RunTest(numMessages, lossPercent, maxGroupSize, burstSize, 2500);
+
+   // Sparse traffic:  every Message fits in one packet and is flushed on its own, so every parity group holds just one packet
+   LogTime(MUSCLE_LOG_INFO, "Sending " UINT32_FORMAT_SPEC " small Messages one at a time...\n", numMessages);
+   const int32 sparseMissingWithoutFEC = RunTest(numMessages, lossPercent, 0, 1, 500);
+   const int32 sparseMissingWithFEC    = RunTest(numMessages, lossPercent, maxGroupSize, 1, 500);
+
+   if ((missingWithoutFEC < 0)||(missingWithFEC < 0)||(sparseMissingWithoutFEC < 0)||(sparseMissingWithFEC < 0))
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Test failed to run!\n");
+      return 10;
+   }
+
+   if ((maxGroupSize > 0)&&(missingWithoutFEC > 0)&&(missingWithFEC >= missingWithoutFEC))
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Forward error correction didn't reduce the number of lost Messages!\n");
+      return 10;
+   }
+
+   if ((maxGroupSize > 0)&&(sparseMissingWithoutFEC > 0)&&(sparseMissingWithFEC >= sparseMissingWithoutFEC))
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Forward error correction didn't reduce the number of lost Messages for sparse (one-packet-per-group) traffic!\n");
+      return 10;
+   }
+
+   LogTime(MUSCLE_LOG_INFO, "Test passed.\n");
+   return 0;
+}
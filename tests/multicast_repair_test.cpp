@@ -0,0 +1,372 @@
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+
+#include "zg/private/PZGMulticastRepair.h"
+
+using namespace zg_private;
+
+// This program exercises PZGMulticastRepair's sender-side and receiver-side logic directly, with no network
+// involved:  each scenario sends a series of sequenced Messages from one PZGMulticastRepair object to one or
+// more others, "loses" some of them, and passes the resulting NACKs and retransmissions back and forth by hand,
+// with simulated timestamps.  It checks sequence numbering, gap detection (including gaps found via beacons),
+// NACK batching, retries and give-ups, NACK suppression by overheard NACKs, retransmit hold-off, the aging and
+// size-limiting of the retransmit buffer, and that Messages aren't retransmitted before they've been written.
+//
+// This program takes no command-line arguments (other than the standard daemon arguments).
+
+static const ZGPeerID TEST_SENDER_PEER_ID(0x1234, 0x5678);
+static const ZGPeerID TEST_OTHER_PEER_ID( 0x8765, 0x4321);
+
+static const uint64 TEST_NACK_DUE_MICROS = 2*PZG_MULTICAST_NACK_DELAY_MICROS;  // by this long after a gap is noticed, its NACK is due no matter what the random jitter was
+
+// Logs an error and returns false if (ok) is false
+static bool Check(const char * testName, bool ok, const char * desc)
+{
+   if (ok == false) LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  check failed:  %s\n", testName, desc);
+   return ok;
+}
+
+// Sends (numMessages) new sequenced Messages from (sender), appending them to (retSent)
+static status_t SendMessages(PZGMulticastRepair & sender, uint32 numMessages, Queue<MessageRef> & retSent)
+{
+   for (uint32 i=0; i<numMessages; i++)
+   {
+      MessageRef msg = GetMessageFromPool(retSent.GetNumItems());
+      MRETURN_OOM_ON_NULL(msg());
+      MRETURN_ON_ERROR(sender.MessageSent(msg));
+      MRETURN_ON_ERROR(retSent.AddTail(msg));
+   }
+   return B_NO_ERROR;
+}
+
+// Delivers every Message in (msgs) to (receiver), except for the ones whose sequence numbers are in (dropSeqNums)
+static void DeliverMessages(PZGMulticastRepair & receiver, const Queue<MessageRef> & msgs, const Hashtable<uint32, Void> & dropSeqNums, uint64 now)
+{
+   for (uint32 i=0; i<msgs.GetNumItems(); i++)
+   {
+      const Message & msg = *msgs[i]();
+      if (dropSeqNums.ContainsKey(PZGMulticastRepair::GetSequenceNumber(msg)) == false) receiver.MessageReceived(TEST_SENDER_PEER_ID, msg, now);
+   }
+}
+
+// Returns the sequence numbers of (msgs) as a comma-separated String, e.g. "4,7,8"
+static String GetSequenceNumbersString(const Queue<MessageRef> & msgs)
+{
+   String ret;
+   for (uint32 i=0; i<msgs.GetNumItems(); i++) ret = ret.WithAppendedWord(String("%1").Arg(PZGMulticastRepair::GetSequenceNumber(*msgs[i]())), ",");
+   return ret;
+}
+
+// Passes (nacks) to (sender), and returns what (sender) retransmits once its hold-off period is over
+static Queue<MessageRef> GetRetransmissions(PZGMulticastRepair & sender, const Queue<MessageRef> & nacks, uint64 now)
+{
+   for (uint32 i=0; i<nacks.GetNumItems(); i++) if (PZGMulticastRepair::IsNackAddressedTo(*nacks[i](), TEST_SENDER_PEER_ID)) sender.NackReceived(*nacks[i](), now);
+
+   Queue<MessageRef> ret;
+   sender.GetMessagesToRetransmit(now, ret);
+   if (ret.HasItems()) return Queue<MessageRef>();  // nothing should be retransmitted before the hold-off period is over
+
+   sender.GetMessagesToRetransmit(now+PZG_MULTICAST_RETRANSMIT_HOLDOFF_MICROS, ret);
+   return ret;
+}
+
+static Hashtable<uint32, Void> GetSequenceNumberSet(const uint32 * seqNums, uint32 numSeqNums)
+{
+   Hashtable<uint32, Void> ret;
+   for (uint32 i=0; i<numSeqNums; i++) (void) ret.PutWithDefault(seqNums[i]);
+   return ret;
+}
+
+// Lost Messages are NACK-ed (together, once their NACK delay has passed) and retransmitted in order
+static bool TestGapRepair(uint64 t)
+{
+   const char * testName = "Gap repair";
+   bool ok = true;
+
+   PZGMulticastRepair sender, receiver;
+   Queue<MessageRef> sent;
+   if (SendMessages(sender, 10, sent).IsError()) return Check(testName, false, "couldn't send Messages");
+   ok &= Check(testName, sender.GetLastSentSequenceNumber()    == 10, "last-sent sequence number should be 10");
+   ok &= Check(testName, sender.GetLastWrittenSequenceNumber() == 0,  "no Messages should count as written yet");
+   ok &= Check(testName, GetSequenceNumbersString(sent) == "1,2,3,4,5,6,7,8,9,10", "Messages should be numbered consecutively, starting at 1");
+
+   sender.MessagesWritten(sender.GetLastSentSequenceNumber()+1, t);
+   ok &= Check(testName, sender.GetLastWrittenSequenceNumber() == 10, "all Messages should count as written");
+
+   const uint32 dropped[] = {4, 7, 8};
+   DeliverMessages(receiver, sent, GetSequenceNumberSet(dropped, ARRAYITEMS(dropped)), t);
+
+   const uint64 wakeupTime = receiver.GetNextWakeupTime();
+   ok &= Check(testName, (wakeupTime >= t+PZG_MULTICAST_NACK_DELAY_MICROS)&&(wakeupTime <= t+TEST_NACK_DUE_MICROS), "receiver should want to wake up after the NACK delay");
+
+   Queue<MessageRef> nacks;
+   receiver.GetNacksToSend(t, nacks);
+   ok &= Check(testName, nacks.IsEmpty(), "receiver shouldn't NACK before the NACK delay has passed");
+
+   t += TEST_NACK_DUE_MICROS;
+   receiver.GetNacksToSend(t, nacks);
+   if (Check(testName, nacks.GetNumItems() == 1, "receiver should send exactly one NACK for all of its gaps") == false) return false;
+
+   const Message & nackMsg = *nacks.Head()();
+   ok &= Check(testName, PZGMulticastRepair::IsNackMessage(nackMsg), "NACK should be recognized as a NACK");
+   ok &= Check(testName, PZGMulticastRepair::IsNackAddressedTo(nackMsg, TEST_SENDER_PEER_ID), "NACK should be addressed to the sender");
+   ok &= Check(testName, PZGMulticastRepair::IsNackAddressedTo(nackMsg, TEST_OTHER_PEER_ID) == false, "NACK shouldn't be addressed to any other peer");
+   ok &= Check(testName, PZGMulticastRepair::IsNackMessage(*sent[0]()) == false, "a sequenced Message shouldn't be recognized as a NACK");
+
+   const Queue<MessageRef> retransmitted = GetRetransmissions(sender, nacks, t);
+   ok &= Check(testName, GetSequenceNumbersString(retransmitted) == "4,7,8", "sender should retransmit exactly the lost Messages, in order");
+
+   // A NACK that crosses paths with our retransmission shouldn't cause a second retransmission right away...
+   t += PZG_MULTICAST_RETRANSMIT_HOLDOFF_MICROS;
+   ok &= Check(testName, GetRetransmissions(sender, nacks, t+1).IsEmpty(), "sender shouldn't retransmit again right after a retransmission");
+
+   // ... but a later one should
+   ok &= Check(testName, GetSequenceNumbersString(GetRetransmissions(sender, nacks, t+(PZG_MULTICAST_NACK_RETRY_MICROS/2))) == "4,7,8", "sender should retransmit again once the retry interval has half-passed");
+
+   DeliverMessages(receiver, retransmitted, Hashtable<uint32, Void>(), t);
+   ok &= Check(testName, receiver.GetNextWakeupTime() == MUSCLE_TIME_NEVER, "receiver should have nothing left to NACK after the retransmissions arrive");
+
+   nacks.Clear();
+   receiver.GetNacksToSend(t+SecondsToMicros(1), nacks);
+   ok &= Check(testName, nacks.IsEmpty(), "receiver shouldn't NACK anything after the retransmissions arrive");
+   return ok;
+}
+
+// An unanswered NACK is repeated after the retry interval, up to the maximum number of times, after which the gap is given up on
+static bool TestNackRetries(uint64 t)
+{
+   const char * testName = "NACK retries";
+   bool ok = true;
+
+   PZGMulticastRepair sender, receiver;
+   Queue<MessageRef> sent;
+   if (SendMessages(sender, 3, sent).IsError()) return Check(testName, false, "couldn't send Messages");
+
+   const uint32 dropped[] = {2};
+   DeliverMessages(receiver, sent, GetSequenceNumberSet(dropped, ARRAYITEMS(dropped)), t);
+
+   t += TEST_NACK_DUE_MICROS;
+   uint32 numNacks = 0;
+   for (uint32 i=0; i<PZG_MULTICAST_MAX_NACKS_PER_MESSAGE+2; i++)
+   {
+      Queue<MessageRef> nacks;
+      receiver.GetNacksToSend(t, nacks);
+      numNacks += nacks.GetNumItems();
+
+      if (i < PZG_MULTICAST_MAX_NACKS_PER_MESSAGE)
+      {
+         ok &= Check(testName, nacks.GetNumItems() == 1, "receiver should repeat an unanswered NACK after each retry interval");
+
+         nacks.Clear();
+         receiver.GetNacksToSend(t+PZG_MULTICAST_NACK_RETRY_MICROS-1, nacks);
+         ok &= Check(testName, nacks.IsEmpty(), "receiver shouldn't repeat a NACK before the retry interval has passed");
+      }
+      t += PZG_MULTICAST_NACK_RETRY_MICROS;
+   }
+
+   ok &= Check(testName, numNacks == PZG_MULTICAST_MAX_NACKS_PER_MESSAGE, "receiver should give up after the maximum number of NACKs");
+   ok &= Check(testName, receiver.GetNextWakeupTime() == MUSCLE_TIME_NEVER, "receiver should forget about a gap it has given up on");
+   return ok;
+}
+
+// Beacons let a receiver detect the loss of a sender's most recent Messages, but a receiver doesn't NACK what was sent before it first heard from the sender
+static bool TestBeacons(uint64 t)
+{
+   const char * testName = "Beacons";
+   bool ok = true;
+
+   PZGMulticastRepair sender, receiver;
+
+   Message beaconMsg;
+   ok &= Check(testName, sender.AddLastSentSequenceNumberToBeacon(beaconMsg).IsOK(), "couldn't add sequence number to beacon");
+   receiver.BeaconReceived(TEST_SENDER_PEER_ID, beaconMsg, t);
+   ok &= Check(testName, receiver.GetNextWakeupTime() == MUSCLE_TIME_NEVER, "a beacon from a sender that hasn't sent anything shouldn't cause a NACK");
+
+   Queue<MessageRef> sent;
+   if (SendMessages(sender, 3, sent).IsError()) return Check(testName, false, "couldn't send Messages");
+   sender.MessagesWritten(sender.GetLastSentSequenceNumber()+1, t);
+
+   const uint32 dropped[] = {3};
+   DeliverMessages(receiver, sent, GetSequenceNumberSet(dropped, ARRAYITEMS(dropped)), t);
+   ok &= Check(testName, receiver.GetNextWakeupTime() == MUSCLE_TIME_NEVER, "receiver can't know about a lost last Message before the next beacon");
+
+   ok &= Check(testName, sender.AddLastSentSequenceNumberToBeacon(beaconMsg).IsOK(), "couldn't add sequence number to beacon");
+   receiver.BeaconReceived(TEST_SENDER_PEER_ID, beaconMsg, t);
+
+   t += TEST_NACK_DUE_MICROS;
+   Queue<MessageRef> nacks;
+   receiver.GetNacksToSend(t, nacks);
+   ok &= Check(testName, GetSequenceNumbersString(GetRetransmissions(sender, nacks, t)) == "3", "a beacon should reveal the loss of the sender's last Message");
+
+   // A receiver that first hears from the sender part-way through its sequence shouldn't NACK the Messages it never saw
+   PZGMulticastRepair lateReceiver;
+   lateReceiver.MessageReceived(TEST_SENDER_PEER_ID, *sent.Tail()(), t);
+   lateReceiver.BeaconReceived(TEST_SENDER_PEER_ID, beaconMsg, t);
+   ok &= Check(testName, lateReceiver.GetNextWakeupTime() == MUSCLE_TIME_NEVER, "a receiver shouldn't NACK Messages sent before it first heard from the sender");
+   return ok;
+}
+
+// A receiver that overhears another receiver's NACK for the same Messages holds off on sending its own
+static bool TestOverheardNacks(uint64 t)
+{
+   const char * testName = "Overheard NACKs";
+   bool ok = true;
+
+   PZGMulticastRepair sender, receiver1, receiver2;
+   Queue<MessageRef> sent;
+   if (SendMessages(sender, 6, sent).IsError()) return Check(testName, false, "couldn't send Messages");
+
+   const uint32 dropped[] = {5};
+   const Hashtable<uint32, Void> droppedSet = GetSequenceNumberSet(dropped, ARRAYITEMS(dropped));
+   DeliverMessages(receiver1, sent, droppedSet, t);
+   DeliverMessages(receiver2, sent, droppedSet, t);
+
+   t += TEST_NACK_DUE_MICROS;
+   Queue<MessageRef> nacks1;
+   receiver1.GetNacksToSend(t, nacks1);
+   if (Check(testName, nacks1.GetNumItems() == 1, "first receiver should NACK the lost Message") == false) return false;
+
+   receiver2.NackOverheard(*nacks1.Head()(), t);
+
+   Queue<MessageRef> nacks2;
+   receiver2.GetNacksToSend(t+PZG_MULTICAST_NACK_RETRY_MICROS-1, nacks2);
+   ok &= Check(testName, nacks2.IsEmpty(), "second receiver shouldn't NACK what it overheard another receiver NACK");
+
+   receiver2.GetNacksToSend(t+PZG_MULTICAST_NACK_RETRY_MICROS, nacks2);
+   ok &= Check(testName, nacks2.GetNumItems() == 1, "second receiver should NACK on its own once the overheard NACK has had time to be answered");
+   return ok;
+}
+
+// Messages that are still queued (i.e. not yet written to the network) are never retransmitted, and don't age out of the retransmit buffer
+static bool TestUnwrittenMessages(uint64 t)
+{
+   const char * testName = "Unwritten Messages";
+   bool ok = true;
+
+   PZGMulticastRepair sender, receiver;
+   Queue<MessageRef> sent;
+   if (SendMessages(sender, 6, sent).IsError()) return Check(testName, false, "couldn't send Messages");
+
+   sender.MessagesWritten(3, t);  // only Messages #1 and #2 have been written so far
+   ok &= Check(testName, sender.GetLastWrittenSequenceNumber() == 2, "last-written sequence number should be 2");
+
+   sender.MessagesWritten(2, t);
+   sender.MessagesWritten(0, t);
+   ok &= Check(testName, sender.GetLastWrittenSequenceNumber() == 2, "last-written sequence number should never go backwards");
+
+   const uint32 dropped[] = {2, 3, 4, 5};
+   DeliverMessages(receiver, sent, GetSequenceNumberSet(dropped, ARRAYITEMS(dropped)), t);
+
+   t += TEST_NACK_DUE_MICROS;
+   Queue<MessageRef> nacks;
+   receiver.GetNacksToSend(t, nacks);
+   const Queue<MessageRef> retransmitted = GetRetransmissions(sender, nacks, t);
+   ok &= Check(testName, GetSequenceNumbersString(retransmitted) == "2", "sender should retransmit only the Messages that have been written");
+   DeliverMessages(receiver, retransmitted, Hashtable<uint32, Void>(), t);
+
+   // Long after the others have aged out, the Messages that were still queued are written, and should still be retransmittable
+   t += PZG_MULTICAST_RETRANSMIT_BUFFER_MAX_AGE+1;
+   sender.MessagesWritten(sender.GetLastSentSequenceNumber()+1, t);
+
+   nacks.Clear();
+   receiver.GetNacksToSend(t, nacks);
+   ok &= Check(testName, GetSequenceNumbersString(GetRetransmissions(sender, nacks, t)) == "3,4,5", "Messages should age out based on when they were written, not when they were queued");
+   return ok;
+}
+
+// Written Messages age out of the retransmit buffer after the maximum age, and only the most recent ones are kept
+static bool TestRetransmitBufferLimits(uint64 t)
+{
+   const char * testName = "Retransmit buffer limits";
+   bool ok = true;
+
+   {
+      PZGMulticastRepair sender, receiver;
+      Queue<MessageRef> sent;
+      if (SendMessages(sender, 4, sent).IsError()) return Check(testName, false, "couldn't send Messages");
+      sender.MessagesWritten(sender.GetLastSentSequenceNumber()+1, t);
+
+      // Messages #2 and #3 are lost, and the receiver doesn't find out until after they've aged out
+      const uint32 dropped[] = {2, 3, 4};
+      DeliverMessages(receiver, sent, GetSequenceNumberSet(dropped, ARRAYITEMS(dropped)), t);
+
+      const uint64 lateTime = t+PZG_MULTICAST_RETRANSMIT_BUFFER_MAX_AGE+1;
+      receiver.MessageReceived(TEST_SENDER_PEER_ID, *sent.Tail()(), lateTime);
+
+      Queue<MessageRef> nacks;
+      receiver.GetNacksToSend(lateTime+TEST_NACK_DUE_MICROS, nacks);
+      ok &= Check(testName, nacks.GetNumItems() == 1, "receiver should NACK the lost Messages");
+      ok &= Check(testName, GetRetransmissions(sender, nacks, lateTime+TEST_NACK_DUE_MICROS).IsEmpty(), "sender shouldn't retransmit Messages older than the maximum age");
+   }
+
+   {
+      PZGMulticastRepair sender, receiver;
+      Queue<MessageRef> sent;
+      if (SendMessages(sender, PZG_MULTICAST_RETRANSMIT_BUFFER_SIZE+10, sent).IsError()) return Check(testName, false, "couldn't send Messages");
+      sender.MessagesWritten(sender.GetLastSentSequenceNumber()+1, t);
+
+      // The receiver gets only the first and last Messages, so it NACKs (up to PZG_MULTICAST_MAX_TRACKED_GAP of) the ones in between
+      receiver.MessageReceived(TEST_SENDER_PEER_ID, *sent.Head()(), t);
+      receiver.MessageReceived(TEST_SENDER_PEER_ID, *sent.Tail()(), t);
+
+      Queue<MessageRef> nacks;
+      receiver.GetNacksToSend(t+TEST_NACK_DUE_MICROS, nacks);
+      const Queue<MessageRef> retransmitted = GetRetransmissions(sender, nacks, t+TEST_NACK_DUE_MICROS);
+
+      const uint32 firstBuffered = sender.GetLastSentSequenceNumber()-PZG_MULTICAST_RETRANSMIT_BUFFER_SIZE+1;
+      ok &= Check(testName, retransmitted.HasItems(), "sender should retransmit the Messages it still has");
+      ok &= Check(testName, (retransmitted.HasItems())&&(PZGMulticastRepair::GetSequenceNumber(*retransmitted.Head()()) == firstBuffered), "sender should keep only its most recent Messages");
+      ok &= Check(testName, (retransmitted.HasItems())&&(PZGMulticastRepair::GetSequenceNumber(*retransmitted.Tail()()) == sender.GetLastSentSequenceNumber()-1), "sender should retransmit up to the last lost Message");
+   }
+   return ok;
+}
+
+// A receiver forgets about a sender it hasn't heard from in a long time, along with any gaps it was still waiting to NACK
+static bool TestIdleSourceExpiration(uint64 t)
+{
+   const char * testName = "Idle source expiration";
+
+   PZGMulticastRepair sender, receiver;
+   Queue<MessageRef> sent;
+   if (SendMessages(sender, 3, sent).IsError()) return Check(testName, false, "couldn't send Messages");
+
+   const uint32 dropped[] = {2};
+   DeliverMessages(receiver, sent, GetSequenceNumberSet(dropped, ARRAYITEMS(dropped)), t);
+
+   Queue<MessageRef> nacks;
+   receiver.GetNacksToSend(t+PZG_MULTICAST_SOURCE_EXPIRATION_MICROS+1, nacks);
+
+   bool ok = true;
+   ok &= Check(testName, nacks.IsEmpty(), "receiver shouldn't NACK a sender that has gone idle");
+   ok &= Check(testName, receiver.GetNextWakeupTime() == MUSCLE_TIME_NEVER, "receiver should forget about a sender that has gone idle");
+   return ok;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   // Simulated time starts now, so that it's never behind the real clock that PZGMulticastRepair::MessageSent() trims with
+   const uint64 t = GetRunTime64();
+
+   bool ok = true;
+   ok &= TestGapRepair(t);
+   ok &= TestNackRetries(t);
+   ok &= TestBeacons(t);
+   ok &= TestOverheardNacks(t);
+   ok &= TestUnwrittenMessages(t);
+   ok &= TestRetransmitBufferLimits(t);
+   ok &= TestIdleSourceExpiration(t);
+
+   if (ok == false)
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Test failed!\n");
+      return 10;
+   }
+
+   LogTime(MUSCLE_LOG_INFO, "Test passed.\n");
+   return 0;
+}
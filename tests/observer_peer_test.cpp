@@ -0,0 +1,160 @@
+#include "LoopbackTestHarness.h"
+
+using namespace zg;
+
+// This program runs one full peer and two junior-only (observer) peers in the same process, and verifies that the
+// observers work as junior peers:  they see the full peer as their senior peer, their update-requests are executed
+// and every peer's updates reach them, and they synchronize their network-time clocks (via the timing-replies that
+// the senior peer sends them, since observers aren't in its ordered-peers-list).  It then takes the full peer offline,
+// and verifies that neither observer ever becomes the senior peer, even when no full peer is left to be senior.
+//
+// Optional command-line arguments:
+//    multicast=sim  -- use simulated multicast (unicast) instead of real multicast
+
+static const int64  TEST_MAX_CLOCK_OFFSET_MICROS = MillisToMicros(100);  // since all of our peers share one clock, their network-time offsets should all be close to zero
+static const uint64 TEST_SENIORLESS_MICROS       = SecondsToMicros(2);    // how long we watch the observers after they notice that the full peer is gone
+
+enum {
+   TEST_STATE_WAIT_FOR_PEERS = 0,
+   TEST_STATE_UPDATES,
+   TEST_STATE_CLOCK_SYNC,
+   TEST_STATE_FULL_PEER_GONE,
+   TEST_STATE_SENIORLESS
+};
+
+class ObserverTestPeerSession : public ValueListTestPeerSession
+{
+public:
+   ObserverTestPeerSession(const ZGPeerSettings & peerSettings, bool runsTest)
+      : ValueListTestPeerSession(peerSettings, runsTest)
+      , _fullPeer(NULL)
+      , _otherObserver(NULL)
+      , _seniorlessEndTime(MUSCLE_TIME_NEVER)
+   {/* empty */}
+
+   virtual const char * GetTypeName() const {return "ObserverTestPeer";}
+
+   // Called on the observer that runs the test
+   void SetOtherPeers(ObserverTestPeerSession * fullPeer, ObserverTestPeerSession * otherObserver) {_fullPeer = fullPeer; _otherObserver = otherObserver;}
+
+private:
+   // Returns true iff (observer) is fully attached, follows the full peer, and has the same database state as the full peer
+   MUSCLE_NODISCARD bool IsObserverInSync(const ObserverTestPeerSession * observer) const
+   {
+      return ((observer->IAmFullyAttached())
+            &&(observer->GetSeniorPeerID() == _fullPeer->GetLocalPeerID())
+            &&(observer->IsPeerOnline(_fullPeer->GetLocalPeerID()))
+            &&(_fullPeer->IsPeerOnline(observer->GetLocalPeerID()))
+            &&(observer->GetCurrentDatabaseStateID(0) == _fullPeer->GetCurrentDatabaseStateID(0)));
+   }
+
+   MUSCLE_NODISCARD bool IsObserverClockSynced(const ObserverTestPeerSession * observer) const {return (observer->GetToNetworkTimeOffset() != INVALID_TIME_OFFSET);}
+
+   bool VerifyClockOffset(const ObserverTestPeerSession * observer) const
+   {
+      const int64 offset = observer->GetToNetworkTimeOffset();
+      LogTime(MUSCLE_LOG_INFO, "Observer [%s]'s network-time offset is " INT64_FORMAT_SPEC " microseconds\n", observer->GetLocalPeerID().ToString()(), offset);
+      if (muscleAbs(offset) <= TEST_MAX_CLOCK_OFFSET_MICROS) return true;
+
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Observer [%s]'s network-time offset is too large!\n", observer->GetLocalPeerID().ToString()());
+      return false;
+   }
+
+   virtual void CheckTestProgress()
+   {
+      if ((IAmTheSeniorPeer())||(_otherObserver->IAmTheSeniorPeer()))
+      {
+         LogTime(MUSCLE_LOG_CRITICALERROR, "An observer peer became the senior peer in test state %i!\n", GetTestState());
+         EndTest(10);
+         return;
+      }
+
+      status_t ret;
+      switch(GetTestState())
+      {
+         case TEST_STATE_WAIT_FOR_PEERS:
+            if ((_fullPeer->IAmFullyAttached())&&(_fullPeer->IAmTheSeniorPeer())&&(IsObserverInSync(this))&&(IsObserverInSync(_otherObserver)))
+            {
+               LogTime(MUSCLE_LOG_INFO, "All peers are online; sending updates from an observer and from the full peer...\n");
+               if ((RequestAppend(1).IsOK(ret))&&(_fullPeer->RequestAppend(2).IsOK(ret))) SetTestState(TEST_STATE_UPDATES);
+            }
+         break;
+
+         case TEST_STATE_UPDATES:
+            if ((_fullPeer->GetValues().GetNumItems() == 2)&&(IsObserverInSync(this))&&(IsObserverInSync(_otherObserver)))
+            {
+               if (((GetValues() == _fullPeer->GetValues()) == false)||((_otherObserver->GetValues() == _fullPeer->GetValues()) == false))
+               {
+                  LogTime(MUSCLE_LOG_CRITICALERROR, "Observers' databases don't match the full peer's database!\n");
+                  EndTest(10);
+                  return;
+               }
+
+               LogTime(MUSCLE_LOG_INFO, "Updates reached every peer; waiting for the observers' network-time clocks to be synchronized...\n");
+               SetTestState(TEST_STATE_CLOCK_SYNC);
+            }
+         break;
+
+         case TEST_STATE_CLOCK_SYNC:
+            if ((IsObserverClockSynced(this))&&(IsObserverClockSynced(_otherObserver)))
+            {
+               if ((VerifyClockOffset(this) == false)||(VerifyClockOffset(_otherObserver) == false)) {EndTest(10); return;}
+
+               LogTime(MUSCLE_LOG_INFO, "Taking the full peer offline...\n");
+               _fullPeer->EndSession();
+               SetTestState(TEST_STATE_FULL_PEER_GONE);
+            }
+         break;
+
+         case TEST_STATE_FULL_PEER_GONE:
+            if ((GetSeniorPeerID().IsValid() == false)&&(_otherObserver->GetSeniorPeerID().IsValid() == false))
+            {
+               LogTime(MUSCLE_LOG_INFO, "Both observers noticed that the full peer is gone; making sure neither of them becomes the senior peer...\n");
+               _seniorlessEndTime = GetRunTime64()+TEST_SENIORLESS_MICROS;
+               SetTestState(TEST_STATE_SENIORLESS);
+            }
+         break;
+
+         case TEST_STATE_SENIORLESS:
+            if (GetRunTime64() >= _seniorlessEndTime)
+            {
+               LogTime(MUSCLE_LOG_INFO, "Test passed.\n");
+               EndTest(0);
+            }
+         break;
+
+         default:
+            // empty
+         break;
+      }
+
+      if (ret.IsError())
+      {
+         LogTime(MUSCLE_LOG_CRITICALERROR, "Couldn't request update in test state %i! [%s]\n", GetTestState(), ret());
+         EndTest(10);
+      }
+   }
+
+   // These are set only on the observer that runs the test
+   ObserverTestPeerSession * _fullPeer;
+   ObserverTestPeerSession * _otherObserver;
+
+   uint64 _seniorlessEndTime;
+};
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   const String systemName = GetLoopbackTestSystemName("observer_peer_test");
+   ObserverTestPeerSession fullPeer( GetLoopbackTestPeerSettings(args, "observer_peer_test", systemName, 1, PEER_TYPE_FULL_PEER),   false);
+   ObserverTestPeerSession observer1(GetLoopbackTestPeerSettings(args, "observer_peer_test", systemName, 1, PEER_TYPE_JUNIOR_ONLY), true);
+   ObserverTestPeerSession observer2(GetLoopbackTestPeerSettings(args, "observer_peer_test", systemName, 1, PEER_TYPE_JUNIOR_ONLY), false);
+   observer1.SetOtherPeers(&fullPeer, &observer2);
+
+   ObserverTestPeerSession * peers[] = {&fullPeer, &observer1, &observer2};
+   return RunLoopbackTest(peers, ARRAYITEMS(peers), observer1);
+}
@@ -0,0 +1,233 @@
+#include "LoopbackTestHarness.h"
+
+#include "zg/messagetree/server/MessageTreeDatabasePeerSession.h"
+#include "zg/messagetree/server/MessageTreeDatabaseObject.h"
+
+using namespace zg;
+
+// This program runs a senior peer and a junior-only peer in the same process, and verifies that the junior peer's
+// speculative updates (see ZGDatabasePeerSession::RequestSpeculativeUpdateDatabaseState()) are reconciled correctly
+// with the senior peer's authoritative updates.  Each of the junior peer's updates is requested from inside one of
+// the senior peer's own updates, so the junior peer always speculates on a state that the senior peer has already
+// moved past.  The first speculative update (a new node) is executed by the senior peer after the senior peer's own
+// update, so the junior peer has to roll it back and re-apply it in the authoritative order; the second one is
+// rejected by the senior peer, so the junior peer has to roll it back (and remove the node it created) for good.
+// Both roll-backs must be done by undoing the speculative updates, not by restoring a saved copy of the database.
+//
+// Optional command-line arguments:
+//    multicast=sim  -- use simulated multicast (unicast) instead of real multicast
+
+static const uint32 TEST_MAX_LIST_SIZE = 3;  // our database objects reject any update while the "list" node has this many children
+static const uint64 TEST_POLL_MICROS   = MillisToMicros(50);
+
+// A MessageTreeDatabaseObject that keeps track of how its speculative updates get rolled back
+class TestDatabaseObject : public MessageTreeDatabaseObject
+{
+public:
+   TestDatabaseObject(MessageTreeDatabasePeerSession * session, int32 dbIndex)
+      : MessageTreeDatabaseObject(session, dbIndex, GetEmptyString())
+      , _numRestores(0)
+      , _numRejections(0)
+   {/* empty */}
+
+   virtual status_t SetFromArchive(const ConstMessageRef & archive)
+   {
+      _numRestores++;
+      return MessageTreeDatabaseObject::SetFromArchive(archive);
+   }
+
+   status_t UploadListEntry(const String & name)
+   {
+      MessageRef payload = GetMessageFromPool();
+      MRETURN_OOM_ON_NULL(payload());
+      return UploadNodeValue("list/"+name, payload, TreeGatewayFlags(TREE_GATEWAY_FLAG_INDEXED), GetEmptyString(), GetEmptyString());
+   }
+
+   // Returns the names of the "list" node's children, in index order (e.g. "S1,J1")
+   String GetListContents() const
+   {
+      String ret;
+      const DataNode * listNode = GetDataNode("list");
+      const Queue<DataNodeRef> * index = listNode ? listNode->GetIndex() : NULL;
+      if (index) for (uint32 i=0; i<index->GetNumItems(); i++) ret = ret.WithAppendedWord((*index)[i]()->GetNodeName(), ",");
+      return ret;
+   }
+
+   MUSCLE_NODISCARD uint32 GetListSize() const
+   {
+      const DataNode * listNode = GetDataNode("list");
+      return listNode ? listNode->GetNumChildren() : 0;
+   }
+
+   MUSCLE_NODISCARD bool HasNode(const String & path) const {return (GetDataNode(path) != NULL);}
+   MUSCLE_NODISCARD uint32 GetNumRestores()   const {return _numRestores;}
+   MUSCLE_NODISCARD uint32 GetNumRejections() const {return _numRejections;}
+
+protected:
+   virtual ConstMessageRef SeniorUpdate(const ConstMessageRef & seniorDoMsg)
+   {
+      // Simulates an application-level constraint, so that the senior peer has a reason to reject an update
+      if (GetListSize() >= TEST_MAX_LIST_SIZE) return B_RESOURCE_LIMIT;
+      return MessageTreeDatabaseObject::SeniorUpdate(seniorDoMsg);
+   }
+
+   virtual void SpeculativeUpdateRejected(const ConstMessageRef & seniorDoMsg, status_t why)
+   {
+      LogTime(MUSCLE_LOG_INFO, "Speculative update was rejected by the senior peer [%s]\n", why());
+      _numRejections++;
+      MessageTreeDatabaseObject::SpeculativeUpdateRejected(seniorDoMsg, why);
+   }
+
+private:
+   uint32 _numRestores;
+   uint32 _numRejections;
+};
+
+enum {
+   TEST_STATE_WAIT_FOR_PEERS = 0,
+   TEST_STATE_REORDERED_UPDATE,
+   TEST_STATE_REJECTED_UPDATE
+};
+
+class TestPeerSession : public LoopbackTestPeerSession<MessageTreeDatabasePeerSession>
+{
+public:
+   TestPeerSession(const ZGPeerSettings & peerSettings, TestPeerSession * optSeniorPeer)
+      : LoopbackTestPeerSession<MessageTreeDatabasePeerSession>(peerSettings, (optSeniorPeer != NULL), TEST_POLL_MICROS)
+      , _seniorPeer(optSeniorPeer)
+      , _pendingJuniorPeer(NULL)
+      , _numRestoresAtStart(0)
+   {/* empty */}
+
+   virtual const char * GetTypeName() const {return "SpeculativeUpdateTestPeer";}
+
+   MUSCLE_NODISCARD TestDatabaseObject * GetTestDatabaseObject() const {return static_cast<TestDatabaseObject *>(GetDatabaseObject(0));}
+
+protected:
+   virtual IDatabaseObjectRef CreateDatabaseObject(uint32 whichDatabase)
+   {
+      TestDatabaseObject * dbObj = new TestDatabaseObject(this, whichDatabase);
+      dbObj->SetSpeculativeUpdatesEnabled(true);  // only matters on the junior peer, since the senior peer's updates are never speculative
+      return IDatabaseObjectRef(dbObj);
+   }
+
+   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & seniorDoMsg)
+   {
+      const ConstMessageRef ret = MessageTreeDatabasePeerSession::SeniorUpdateLocalDatabase(whichDatabase, dbChecksum, seniorDoMsg);
+      if ((ret())&&(_pendingJuniorPeer))
+      {
+         // The junior peer can't have seen the update we just executed yet, so its speculative update will be based on our previous state
+         TestPeerSession * junior = _pendingJuniorPeer;
+         _pendingJuniorPeer = NULL;
+         _juniorRequestResult  = junior->GetTestDatabaseObject()->UploadListEntry(_pendingJuniorEntry);
+         _juniorSpeculativeContents = junior->GetTestDatabaseObject()->GetListContents();
+      }
+      return ret;
+   }
+
+private:
+   // Called on the senior peer:  adds (seniorEntry) to the list, and (juniorEntry) to the junior peer's list while doing so
+   status_t StartTestUpdates(TestPeerSession * junior, const String & seniorEntry, const String & juniorEntry)
+   {
+      _pendingJuniorPeer  = junior;
+      _pendingJuniorEntry = juniorEntry;
+      _juniorRequestResult = B_NO_ERROR;
+      _juniorSpeculativeContents.Clear();
+      return GetTestDatabaseObject()->UploadListEntry(seniorEntry);
+   }
+
+   // Returns true iff the senior peer has acted on our request and our database now matches the senior peer's
+   MUSCLE_NODISCARD bool IsCaughtUp() const
+   {
+      return ((_seniorPeer->_pendingJuniorPeer == NULL)
+            &&(HasSpeculativeUpdates(0) == false)
+            &&(GetCurrentDatabaseStateID(0) == _seniorPeer->GetCurrentDatabaseStateID(0))
+            &&(GetTestDatabaseObject()->GetListContents() == _seniorPeer->GetTestDatabaseObject()->GetListContents()));
+   }
+
+   // Returns true iff the senior peer's speculative-update result, and our database's contents and checksums, are all as expected
+   bool VerifyResults(const char * desc, const String & expectedSpeculativeContents, const String & expectedContents, uint32 expectedRejections) const
+   {
+      const TestDatabaseObject * juniorDB = GetTestDatabaseObject();
+      const TestDatabaseObject * seniorDB = _seniorPeer->GetTestDatabaseObject();
+      const String contents = juniorDB->GetListContents();
+
+      LogTime(MUSCLE_LOG_INFO, "%s:  junior peer's list was [%s] while speculating, and is now [%s] (senior peer's is [%s])\n", desc, _seniorPeer->_juniorSpeculativeContents(), contents(), seniorDB->GetListContents()());
+
+      bool ret = true;
+      if (_seniorPeer->_juniorRequestResult.IsError()) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  speculative update request failed [%s]\n", desc, _seniorPeer->_juniorRequestResult()); ret = false;}
+      if (_seniorPeer->_juniorSpeculativeContents != expectedSpeculativeContents) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  speculative update wasn't visible right away, expected [%s]\n", desc, expectedSpeculativeContents()); ret = false;}
+      if (contents != expectedContents) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  expected final list [%s]\n", desc, expectedContents()); ret = false;}
+      if (juniorDB->GetCurrentChecksum() != seniorDB->GetCurrentChecksum()) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  junior peer's checksum " XINT64_FORMAT_SPEC " doesn't match senior peer's checksum " XINT64_FORMAT_SPEC "\n", desc, juniorDB->GetCurrentChecksum(), seniorDB->GetCurrentChecksum()); ret = false;}
+      if (juniorDB->GetCurrentChecksum() != juniorDB->CalculateChecksum()) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  junior peer's running checksum " XINT64_FORMAT_SPEC " doesn't match its contents' checksum " XINT64_FORMAT_SPEC "\n", desc, juniorDB->GetCurrentChecksum(), juniorDB->CalculateChecksum()); ret = false;}
+      if (juniorDB->GetNumRejections() != expectedRejections) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  expected " UINT32_FORMAT_SPEC " rejected updates, got " UINT32_FORMAT_SPEC "\n", desc, expectedRejections, juniorDB->GetNumRejections()); ret = false;}
+      if (juniorDB->GetNumRestores() != _numRestoresAtStart) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  speculative updates were rolled back by restoring the whole database\n", desc); ret = false;}
+      return ret;
+   }
+
+   virtual void CheckTestProgress()
+   {
+      switch(GetTestState())
+      {
+         case TEST_STATE_WAIT_FOR_PEERS:
+            if ((IAmFullyAttached())&&(_seniorPeer->IAmFullyAttached())&&(_seniorPeer->IAmTheSeniorPeer())&&(GetSeniorPeerID() == _seniorPeer->GetLocalPeerID())&&(IsCaughtUp()))
+            {
+               LogTime(MUSCLE_LOG_INFO, "Both peers are online; testing a speculative update that the senior peer executes after one of its own...\n");
+               _numRestoresAtStart = GetTestDatabaseObject()->GetNumRestores();
+               if (_seniorPeer->StartTestUpdates(this, "S1", "J1").IsOK()) SetTestState(TEST_STATE_REORDERED_UPDATE);
+                                                                      else EndTest(10);
+            }
+         break;
+
+         case TEST_STATE_REORDERED_UPDATE:
+            if (IsCaughtUp())
+            {
+               if (VerifyResults("Re-ordered update", "J1", "S1,J1", 0) == false) {EndTest(10); return;}
+
+               LogTime(MUSCLE_LOG_INFO, "Testing a speculative update that the senior peer rejects...\n");
+               if (_seniorPeer->StartTestUpdates(this, "S2", "J2").IsOK()) SetTestState(TEST_STATE_REJECTED_UPDATE);
+                                                                      else EndTest(10);
+            }
+         break;
+
+         case TEST_STATE_REJECTED_UPDATE:
+            if ((IsCaughtUp())&&(GetTestDatabaseObject()->GetNumRejections() > 0))
+            {
+               bool ok = VerifyResults("Rejected update", "S1,J1,J2", "S1,J1,S2", 1);
+               if (GetTestDatabaseObject()->HasNode("list/J2")) {LogTime(MUSCLE_LOG_CRITICALERROR, "Rejected update:  speculatively-created node is still present!\n"); ok = false;}
+               if (ok) LogTime(MUSCLE_LOG_INFO, "Test passed.\n");
+               EndTest(ok ? 0 : 10);
+            }
+         break;
+
+         default:
+            // empty
+         break;
+      }
+   }
+
+   TestPeerSession * _seniorPeer;  // non-NULL only on the junior peer, which runs the test
+
+   // These are used only on the senior peer
+   TestPeerSession * _pendingJuniorPeer;
+   String _pendingJuniorEntry;
+   status_t _juniorRequestResult;
+   String _juniorSpeculativeContents;
+
+   uint32 _numRestoresAtStart;
+};
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   const String systemName = GetLoopbackTestSystemName("speculative_update_test");
+   TestPeerSession seniorPeer(GetLoopbackTestPeerSettings(args, "speculative_update_test", systemName, 1, PEER_TYPE_FULL_PEER),   NULL);
+   TestPeerSession juniorPeer(GetLoopbackTestPeerSettings(args, "speculative_update_test", systemName, 1, PEER_TYPE_JUNIOR_ONLY), &seniorPeer);
+
+   TestPeerSession * peers[] = {&seniorPeer, &juniorPeer};
+   return RunLoopbackTest(peers, ARRAYITEMS(peers), juniorPeer);
+}
@@ -0,0 +1,293 @@
+#include "LoopbackTestHarness.h"
+
+#include "zg/messagetree/server/MessageTreeDatabasePeerSession.h"
+#include "zg/messagetree/server/MessageTreeDatabaseObject.h"
+
+using namespace zg;
+
+// This program runs a single peer with two message-tree databases, and repairs the second database (the "copy") from
+// the first one (the "original") using MessageTreeDatabaseObject's repair conversation, which compares the two trees
+// using each database's cache of per-node subtree checksums.  Between repairs it changes the original database, first
+// by deleting a subtree and re-creating it (whose new nodes will likely reuse the addresses of the deleted ones) and
+// changing a deeply-nested node, and then by restoring the original database from an archive via SetFromArchive().
+// If either change left any stale entries in the subtree-checksum cache, the repair would miss a difference, and the
+// copy would no longer match the original afterwards.
+//
+// Optional command-line arguments:
+//    multicast=sim  -- use simulated multicast (unicast) instead of real multicast
+
+enum {
+   TEST_COMMAND_POPULATE = 1937007475, // 'stcs' -- fills in our database's tree with the (TEST_NAME_VARIANT) version of its contents
+   TEST_COMMAND_MODIFY,                //        -- replaces one of our subtrees, and changes one of our leaf nodes
+   TEST_COMMAND_RESTORE,               //        -- restores our database from the archive passed to SetArchiveToRestore()
+   TEST_COMMAND_REPAIR,                //        -- repairs our database so that it matches our repair-source database
+};
+
+static const String TEST_NAME_VARIANT = "var";
+static const String TEST_NAME_VALUE   = "val";
+
+static const uint32 TEST_NUM_DIRS     = 8;
+static const uint32 TEST_NUM_LEAVES   = 100;  // more than a repair will list individually, so that the per-bucket checksums get used too
+static const uint32 TEST_MODIFIED_DIR = 3;
+
+// A MessageTreeDatabaseObject that knows how to carry out our test steps as (senior) database updates
+class TestDatabaseObject : public MessageTreeDatabaseObject
+{
+public:
+   TestDatabaseObject(MessageTreeDatabasePeerSession * session, int32 dbIndex, const String & rootNodePath, const TestDatabaseObject * optRepairSource)
+      : MessageTreeDatabaseObject(session, dbIndex, rootNodePath)
+      , _repairSource(optRepairSource)
+      , _numRepairRounds(0)
+   {/* empty */}
+
+   status_t RequestTestCommand(uint32 whatCode, int32 variant = 0)
+   {
+      MessageRef msg = GetMessageFromPool(whatCode);
+      MRETURN_OOM_ON_NULL(msg());
+      MRETURN_ON_ERROR(msg()->AddInt32(TEST_NAME_VARIANT, variant));
+      return RequestUpdateDatabaseState(msg);
+   }
+
+   void SetArchiveToRestore(const ConstMessageRef & archive) {_archiveToRestore = archive;}
+
+   MUSCLE_NODISCARD uint32 GetNumRepairRounds() const {return _numRepairRounds;}
+
+protected:
+   virtual ConstMessageRef SeniorUpdate(const ConstMessageRef & seniorDoMsg)
+   {
+      status_t ret;
+      switch(seniorDoMsg()->what)
+      {
+         case TEST_COMMAND_POPULATE: ret = Populate(TEST_NUM_DIRS, seniorDoMsg()->GetInt32(TEST_NAME_VARIANT)); break;
+         case TEST_COMMAND_MODIFY:   ret = Modify();                                                          break;
+         case TEST_COMMAND_RESTORE:  ret = _archiveToRestore() ? SetFromArchive(_archiveToRestore) : B_BAD_OBJECT; break;
+         case TEST_COMMAND_REPAIR:   ret = _repairSource ? RepairFrom(*_repairSource) : B_BAD_OBJECT;         break;
+         default:                    return MessageTreeDatabaseObject::SeniorUpdate(seniorDoMsg);
+      }
+
+      if (ret.IsError())
+      {
+         LogTime(MUSCLE_LOG_CRITICALERROR, "Test command " UINT32_FORMAT_SPEC " failed on database [%s]! [%s]\n", seniorDoMsg()->what, GetRootPathWithoutSlash()(), ret());
+         return ret;
+      }
+
+      // An empty batch, just so that our superclass hands back the junior-message it assembled for the changes we made above
+      MessageRef emptyBatchMsg = GetMessageFromPool(PR_COMMAND_BATCH);
+      MRETURN_OOM_ON_NULL(emptyBatchMsg());
+      return MessageTreeDatabaseObject::SeniorUpdate(emptyBatchMsg);
+   }
+
+private:
+   static ConstMessageRef GetLeafPayload(int32 variant, uint32 dir, uint32 leaf)
+   {
+      MessageRef payload = GetMessageFromPool();
+      MRETURN_OOM_ON_NULL(payload());
+      MRETURN_ON_ERROR(payload()->AddInt32(TEST_NAME_VALUE, (variant*1000000)+(dir*1000)+leaf));
+      return AddConstToRef(payload);
+   }
+
+   static String GetLeafPath(uint32 dir, uint32 leaf) {return String("dir%1/leaf%2").Arg(dir).Arg(leaf);}
+
+   status_t PopulateDir(uint32 dir, int32 variant)
+   {
+      for (uint32 i=0; i<TEST_NUM_LEAVES; i++)
+      {
+         const ConstMessageRef payload = GetLeafPayload(variant, dir, i);
+         MRETURN_ON_ERROR(payload);
+         MRETURN_ON_ERROR(SetDataNode(GetLeafPath(dir, i), payload));
+      }
+      return B_NO_ERROR;
+   }
+
+   status_t Populate(uint32 numDirs, int32 variant)
+   {
+      for (uint32 i=0; i<numDirs; i++) MRETURN_ON_ERROR(PopulateDir(i, variant));
+      return B_NO_ERROR;
+   }
+
+   status_t Modify()
+   {
+      // Re-creating the subtree right after deleting it gives its new nodes a good chance of recycling the old nodes' memory
+      MRETURN_ON_ERROR(RemoveDataNodes(String("dir%1").Arg(TEST_MODIFIED_DIR)));
+      MRETURN_ON_ERROR(PopulateDir(TEST_MODIFIED_DIR, 1));
+
+      const ConstMessageRef payload = GetLeafPayload(2, TEST_NUM_DIRS-1, TEST_NUM_LEAVES/2);
+      MRETURN_ON_ERROR(payload);
+      return SetDataNode(GetLeafPath(TEST_NUM_DIRS-1, TEST_NUM_LEAVES/2), payload);
+   }
+
+   // Runs the whole junior/senior repair conversation locally, with (source) playing the senior peer's part
+   status_t RepairFrom(const TestDatabaseObject & source)
+   {
+      _numRepairRounds = 0;
+
+      MessageRef requestMsg;
+      MRETURN_ON_ERROR(JuniorRepair(ConstMessageRef(), requestMsg));
+      while(requestMsg())
+      {
+         const ConstMessageRef replyMsg = source.SeniorRepair(AddConstToRef(requestMsg));
+         MRETURN_ON_ERROR(replyMsg);
+
+         _numRepairRounds++;
+         MRETURN_ON_ERROR(JuniorRepair(replyMsg, requestMsg));
+      }
+      return B_NO_ERROR;
+   }
+
+   const TestDatabaseObject * _repairSource;
+   ConstMessageRef _archiveToRestore;
+   uint32 _numRepairRounds;
+};
+
+enum {
+   TEST_STATE_WAIT_FOR_SENIORITY = 0,
+   TEST_STATE_POPULATE,
+   TEST_STATE_INITIAL_REPAIR,
+   TEST_STATE_MODIFY,
+   TEST_STATE_MODIFIED_REPAIR,
+   TEST_STATE_RESTORE,
+   TEST_STATE_RESTORED_REPAIR
+};
+
+class TestPeerSession : public LoopbackTestPeerSession<MessageTreeDatabasePeerSession>
+{
+public:
+   TestPeerSession(const ZGPeerSettings & peerSettings)
+      : LoopbackTestPeerSession<MessageTreeDatabasePeerSession>(peerSettings, true)
+      , _archivedChecksum(0)
+   {
+      for (uint32 i=0; i<ARRAYITEMS(_awaitedStateIDs); i++) _awaitedStateIDs[i] = 0;
+   }
+
+   virtual const char * GetTypeName() const {return "SubtreeChecksumTestPeer";}
+
+protected:
+   virtual IDatabaseObjectRef CreateDatabaseObject(uint32 whichDatabase)
+   {
+      // Both root nodes have the same name, since a node's name is part of its checksum
+      return IDatabaseObjectRef((whichDatabase == 0) ? new TestDatabaseObject(this, whichDatabase, "original/db", NULL) : new TestDatabaseObject(this, whichDatabase, "copy/db", GetTestDatabaseObject(0)));
+   }
+
+private:
+   MUSCLE_NODISCARD TestDatabaseObject * GetTestDatabaseObject(uint32 whichDB) const {return static_cast<TestDatabaseObject *>(GetDatabaseObject(whichDB));}
+
+   status_t RequestTestCommand(uint32 whichDB, uint32 whatCode, int32 variant = 0)
+   {
+      _awaitedStateIDs[whichDB] = GetCurrentDatabaseStateID(whichDB)+1;
+      return GetTestDatabaseObject(whichDB)->RequestTestCommand(whatCode, variant);
+   }
+
+   // Returns true iff all of our requested test commands have been executed
+   MUSCLE_NODISCARD bool AreTestCommandsDone() const
+   {
+      for (uint32 i=0; i<ARRAYITEMS(_awaitedStateIDs); i++) if (GetCurrentDatabaseStateID(i) < _awaitedStateIDs[i]) return false;
+      return true;
+   }
+
+   // Returns true iff both databases' running checksums are correct, and the copy matches the original (or not, as specified)
+   bool VerifyDatabases(const char * desc, bool expectMatch) const
+   {
+      bool ret = true;
+      for (uint32 i=0; i<ARRAYITEMS(_awaitedStateIDs); i++)
+      {
+         const TestDatabaseObject * db = GetTestDatabaseObject(i);
+         if (db->GetCurrentChecksum() != db->CalculateChecksum()) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  database [%s]'s running checksum " XINT64_FORMAT_SPEC " doesn't match its contents' checksum " XINT64_FORMAT_SPEC "\n", desc, db->GetRootPathWithoutSlash()(), db->GetCurrentChecksum(), db->CalculateChecksum()); ret = false;}
+      }
+
+      const uint64 originalChecksum = GetTestDatabaseObject(0)->CalculateChecksum();
+      const uint64 copyChecksum     = GetTestDatabaseObject(1)->CalculateChecksum();
+      LogTime(MUSCLE_LOG_INFO, "%s:  original's checksum is " XINT64_FORMAT_SPEC ", copy's checksum is " XINT64_FORMAT_SPEC "\n", desc, originalChecksum, copyChecksum);
+      if ((originalChecksum == copyChecksum) != expectMatch) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  expected the copy %s the original!\n", desc, expectMatch ? "to match" : "to differ from"); ret = false;}
+      return ret;
+   }
+
+   // Called after each repair
+   bool VerifyRepair(const char * desc) const
+   {
+      LogTime(MUSCLE_LOG_INFO, "%s:  repair took " UINT32_FORMAT_SPEC " rounds\n", desc, GetTestDatabaseObject(1)->GetNumRepairRounds());
+      return VerifyDatabases(desc, true);
+   }
+
+   virtual void CheckTestProgress()
+   {
+      if ((GetTestState() == TEST_STATE_WAIT_FOR_SENIORITY) ? ((IAmFullyAttached() == false)||(IAmTheSeniorPeer() == false)) : (AreTestCommandsDone() == false)) return;
+
+      status_t ret;
+      switch(GetTestState())
+      {
+         case TEST_STATE_WAIT_FOR_SENIORITY:
+            LogTime(MUSCLE_LOG_INFO, "We're the senior peer; populating both databases...\n");
+            if ((RequestTestCommand(0, TEST_COMMAND_POPULATE).IsOK(ret))&&(RequestTestCommand(1, TEST_COMMAND_POPULATE).IsOK(ret))) SetTestState(TEST_STATE_POPULATE);
+         break;
+
+         case TEST_STATE_POPULATE:
+            // This first repair finds nothing to fix, but it fills in both databases' subtree-checksum caches
+            if (VerifyDatabases("Populated", true) == false) {EndTest(10); return;}
+            if (RequestTestCommand(1, TEST_COMMAND_REPAIR).IsOK(ret)) SetTestState(TEST_STATE_INITIAL_REPAIR);
+         break;
+
+         case TEST_STATE_INITIAL_REPAIR:
+            if (VerifyRepair("Initial repair") == false) {EndTest(10); return;}
+
+            _archive          = GetTestDatabaseObject(0)->SaveToSnapshot();
+            _archivedChecksum = GetTestDatabaseObject(0)->GetCurrentChecksum();
+            if ((_archive.IsOK(ret))&&(RequestTestCommand(0, TEST_COMMAND_MODIFY).IsOK(ret))) SetTestState(TEST_STATE_MODIFY);
+         break;
+
+         case TEST_STATE_MODIFY:
+            if (VerifyDatabases("Re-created a subtree in the original", false) == false) {EndTest(10); return;}
+            if (RequestTestCommand(1, TEST_COMMAND_REPAIR).IsOK(ret)) SetTestState(TEST_STATE_MODIFIED_REPAIR);
+         break;
+
+         case TEST_STATE_MODIFIED_REPAIR:
+            if (VerifyRepair("Repair after re-creating a subtree") == false) {EndTest(10); return;}
+
+            GetTestDatabaseObject(0)->SetArchiveToRestore(_archive);
+            if (RequestTestCommand(0, TEST_COMMAND_RESTORE).IsOK(ret)) SetTestState(TEST_STATE_RESTORE);
+         break;
+
+         case TEST_STATE_RESTORE:
+            if (VerifyDatabases("Restored the original from an archive", false) == false) {EndTest(10); return;}
+            if (RequestTestCommand(1, TEST_COMMAND_REPAIR).IsOK(ret)) SetTestState(TEST_STATE_RESTORED_REPAIR);
+         break;
+
+         case TEST_STATE_RESTORED_REPAIR:
+         {
+            bool ok = VerifyRepair("Repair after restoring from an archive");
+            if (GetTestDatabaseObject(1)->GetCurrentChecksum() != _archivedChecksum) {LogTime(MUSCLE_LOG_CRITICALERROR, "The copy's checksum " XINT64_FORMAT_SPEC " doesn't match the archived checksum " XINT64_FORMAT_SPEC "!\n", GetTestDatabaseObject(1)->GetCurrentChecksum(), _archivedChecksum); ok = false;}
+            if (ok) LogTime(MUSCLE_LOG_INFO, "Test passed.\n");
+            EndTest(ok ? 0 : 10);
+         }
+         return;
+
+         default:
+            // empty
+         return;
+      }
+
+      if (ret.IsError())
+      {
+         LogTime(MUSCLE_LOG_CRITICALERROR, "Couldn't start test step %i! [%s]\n", GetTestState(), ret());
+         EndTest(10);
+      }
+   }
+
+   uint64 _awaitedStateIDs[2];  // per database, the state ID that our most recently requested test command will produce
+
+   ConstMessageRef _archive;
+   uint64 _archivedChecksum;
+};
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   const String systemName = GetLoopbackTestSystemName("subtree_checksum_test");
+   TestPeerSession peer(GetLoopbackTestPeerSettings(args, "subtree_checksum_test", systemName, 2));
+
+   TestPeerSession * peers[] = {&peer};
+   return RunLoopbackTest(peers, ARRAYITEMS(peers), peer);
+}
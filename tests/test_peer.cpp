@@ -3,6 +3,7 @@
 #include "util/MiscUtilityFunctions.h"
 #include "util/StringTokenizer.h"
 
+#include "zg/ZGChecksumUtilityFunctions.h"
 #include "zg/ZGConstants.h"  // for GetRandomNumber()
 #include "zg/ZGPeerSession.h"
 #include "zg/ZGStdinSession.h"
@@ -182,19 +183,19 @@ public:
    }
 
 protected:
-   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & seniorDoMsg)
+   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & seniorDoMsg)
    {
       SchedulePrintDB();
       return HandleUpdate(seniorDoMsg()->what, whichDatabase, dbChecksum, seniorDoMsg).IsOK() ? seniorDoMsg : ConstMessageRef();
    }
 
-   virtual status_t JuniorUpdateLocalDatabase(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & juniorDoMsg)
+   virtual status_t JuniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & juniorDoMsg)
    {
       SchedulePrintDB();
       return HandleUpdate(juniorDoMsg()->what, whichDatabase, dbChecksum, juniorDoMsg);
    }
 
-   virtual void ResetLocalDatabaseToDefault(uint32 whichDatabase, uint32 & dbChecksum)
+   virtual void ResetLocalDatabaseToDefault(uint32 whichDatabase, uint64 & dbChecksum)
    {
       SchedulePrintDB();
       _toyDatabases[whichDatabase].Clear();
@@ -212,7 +213,7 @@ protected:
       return ret;
    }
 
-   virtual status_t SetLocalDatabaseFromMessage(uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & newDBStateMsg)
+   virtual status_t SetLocalDatabaseFromMessage(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & newDBStateMsg)
    {
       SchedulePrintDB();
       if (newDBStateMsg()->what != TOY_DB_COMMAND_SET_DB_STATE) return B_TYPE_MISMATCH;
@@ -221,9 +222,9 @@ protected:
       return HandleUpdate(TOY_DB_COMMAND_PUT_STRINGS, whichDatabase, dbChecksum, newDBStateMsg);
    }
 
-   virtual uint32 CalculateLocalDatabaseChecksum(uint32 whichDatabase) const
+   virtual uint64 CalculateLocalDatabaseChecksum(uint32 whichDatabase) const
    {
-      uint32 ret = 0;
+      uint64 ret = 0;
       for (ConstHashtableIterator<String, String> iter(_toyDatabases[whichDatabase]); iter.HasData(); iter++) ret += CalculateKeyValueChecksum(iter.GetKey(), iter.GetValue());
       return ret;
    }
@@ -304,7 +305,7 @@ private:
       return ret;
    }
 
-   status_t HandleUpdate(uint32 cmdWhat, uint32 whichDatabase, uint32 & dbChecksum, const ConstMessageRef & cmdMsg)
+   status_t HandleUpdate(uint32 cmdWhat, uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & cmdMsg)
    {
       Hashtable<String, String> & toyDB = _toyDatabases[whichDatabase];
 
@@ -375,7 +376,7 @@ private:
    }
 
    // Returns the incremental checksum value representing a single key-value pair
-   uint32 CalculateKeyValueChecksum(const String & keyStr, const String & valStr) const {return ((keyStr.CalculateChecksum()*5) + valStr.CalculateChecksum());}
+   uint64 CalculateKeyValueChecksum(const String & keyStr, const String & valStr) const {return ((CalculateChecksum64(keyStr)*5) + CalculateChecksum64(valStr));}
 
    Hashtable<String, String> _toyDatabases[NUM_TOY_DATABASES];
 
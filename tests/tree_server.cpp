@@ -75,6 +75,13 @@ static ZGPeerSettings GetTestTreeZGPeerSettings(const Message & args)
       else LogTime(MUSCLE_LOG_WARNING, "maxlogsizebytes argument didn't contain a value greater than zero, ignoring it.\n");
    }
 
+   String recordDir;
+   if (args.FindString("recorddir", recordDir).IsOK())
+   {
+      LogTime(MUSCLE_LOG_INFO, "Recording applied database-updates into directory [%s] (replay them with update_replay_benchmark)\n", recordDir());
+      s.SetUpdateRecordingDirectory(recordDir);
+   }
+
    return s;
 }
 
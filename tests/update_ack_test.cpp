@@ -0,0 +1,221 @@
+#include "LoopbackTestHarness.h"
+
+using namespace zg;
+
+// This program runs two peers in the same process, with update-acknowledgements enabled (see
+// ZGPeerSettings::SetUpdateAcknowledgementsEnabled()), and checks the acknowledgements that
+// RequestUpdateDatabaseStateWithAcknowledgement() leads to.  The junior peer requests an update that only the senior peer needs
+// to apply, then one that every peer needs to apply, then one that the senior peer rejects; then the senior peer requests one that
+// every peer needs to apply.  Each time, it verifies that DatabaseUpdateAcknowledged() is called exactly once, on the requesting
+// peer only, with the expected result, and that by the time it is called the update has really been applied on as many peers as
+// were asked for.
+//
+// Optional command-line arguments:
+//    multicast=sim  -- use simulated multicast (unicast) instead of real multicast
+
+static const int32 TEST_REJECTED_VALUE = -1;  // the senior peer refuses to append this value
+
+enum {
+   TEST_STATE_WAIT_FOR_PEERS = 0,
+   TEST_STATE_SENIOR_ONLY_ACK,
+   TEST_STATE_ALL_PEERS_ACK,
+   TEST_STATE_REJECTED_ACK,
+   TEST_STATE_SENIOR_REQUESTED_ACK
+};
+
+class UpdateAckTestPeerSession : public ValueListTestPeerSession
+{
+public:
+   UpdateAckTestPeerSession(const ZGPeerSettings & peerSettings, bool runsTest)
+      : ValueListTestPeerSession(peerSettings, runsTest)
+      , _otherPeer(NULL)
+      , _senior(NULL)
+      , _junior(NULL)
+      , _expectedAckID(0)
+      , _numAcksAtRequest(0)
+      , _otherNumAcksAtRequest(0)
+      , _numAcks(0)
+      , _lastAckID(0)
+      , _lastAckUpdateID(0)
+      , _lastAckNumPeersApplied(0)
+      , _lastAckNumPeersThatHadApplied(0)
+   {/* empty */}
+
+   virtual const char * GetTypeName() const {return "UpdateAckTestPeer";}
+
+   void SetOtherPeer(UpdateAckTestPeerSession * otherPeer) {_otherPeer = otherPeer;}
+
+protected:
+   virtual void DatabaseUpdateAcknowledged(uint32 whichDatabase, uint64 ackID, uint64 updateID, uint32 numPeersApplied, status_t result)
+   {
+      ValueListTestPeerSession::DatabaseUpdateAcknowledged(whichDatabase, ackID, updateID, numPeersApplied, result);
+
+      LogTime(MUSCLE_LOG_INFO, "Peer [%s] got acknowledgement #" UINT64_FORMAT_SPEC " for update #" UINT64_FORMAT_SPEC ":  applied on " UINT32_FORMAT_SPEC " peers [%s]\n", GetLocalPeerID().ToString()(), ackID, updateID, numPeersApplied, result());
+      _numAcks++;
+      _lastAckID              = ackID;
+      _lastAckUpdateID        = updateID;
+      _lastAckNumPeersApplied = numPeersApplied;
+      _lastAckResult          = result;
+
+      // The whole point of the acknowledgement is that we don't have to check this ourselves, so we'll check it right now
+      _lastAckNumPeersThatHadApplied = 0;
+      if ((updateID > 0)&&(GetCurrentDatabaseStateID(0) >= updateID)) _lastAckNumPeersThatHadApplied++;
+      if ((updateID > 0)&&(_otherPeer->GetCurrentDatabaseStateID(0) >= updateID)) _lastAckNumPeersThatHadApplied++;
+   }
+
+   virtual ConstMessageRef SeniorUpdateLocalDatabase(uint32 whichDatabase, uint64 & dbChecksum, const ConstMessageRef & seniorDoMsg)
+   {
+      // Simulates an application-level constraint, so that the senior peer has a reason to reject an update
+      if (seniorDoMsg()->GetInt32(VALUE_LIST_TEST_NAME_VALUE) == TEST_REJECTED_VALUE) return B_BAD_ARGUMENT;
+      return ValueListTestPeerSession::SeniorUpdateLocalDatabase(whichDatabase, dbChecksum, seniorDoMsg);
+   }
+
+private:
+   // Called on the peer that is to make the request
+   status_t RequestAcknowledgedAppend(int32 val, uint32 numPeers)
+   {
+      const MessageRef msg = GetAppendMessage(val);
+      MRETURN_ON_ERROR(msg);
+
+      // Recorded first, in case the acknowledgement arrives before RequestUpdateDatabaseStateWithAcknowledgement() returns
+      _numAcksAtRequest      = _numAcks;
+      _otherNumAcksAtRequest = _otherPeer->_numAcks;
+      return RequestUpdateDatabaseStateWithAcknowledgement(0, msg, numPeers, &_expectedAckID);
+   }
+
+   MUSCLE_NODISCARD bool IsAckReceived() const {return (_numAcks > _numAcksAtRequest);}
+
+   // Called on the peer that made the request, after its acknowledgement has arrived
+   bool VerifyAck(const char * desc, bool expectSuccess, uint32 expectedNumPeers) const
+   {
+      bool ret = true;
+      if (_numAcks != _numAcksAtRequest+1) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  expected exactly one acknowledgement, got " UINT32_FORMAT_SPEC "\n", desc, _numAcks-_numAcksAtRequest); ret = false;}
+      if (_otherPeer->_numAcks != _otherNumAcksAtRequest) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  the peer that didn't request the update was acknowledged too\n", desc); ret = false;}
+      if (_lastAckID != _expectedAckID) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  acknowledgement ID was " UINT64_FORMAT_SPEC ", expected " UINT64_FORMAT_SPEC "\n", desc, _lastAckID, _expectedAckID); ret = false;}
+
+      if (expectSuccess)
+      {
+         if (_lastAckResult.IsError()) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  update failed [%s]\n", desc, _lastAckResult()); ret = false;}
+         if (_lastAckUpdateID == 0) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  acknowledgement didn't include the update's state ID\n", desc); ret = false;}
+         if (_lastAckNumPeersApplied < expectedNumPeers) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  acknowledgement says the update was applied on " UINT32_FORMAT_SPEC " peers, expected at least " UINT32_FORMAT_SPEC "\n", desc, _lastAckNumPeersApplied, expectedNumPeers); ret = false;}
+         if (_lastAckNumPeersThatHadApplied < expectedNumPeers) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  when acknowledged, the update had actually been applied on only " UINT32_FORMAT_SPEC " peers, expected at least " UINT32_FORMAT_SPEC "\n", desc, _lastAckNumPeersThatHadApplied, expectedNumPeers); ret = false;}
+      }
+      else
+      {
+         if (_lastAckResult.IsOK()) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  update should have been reported as failed\n", desc); ret = false;}
+         if (_lastAckUpdateID != 0) {LogTime(MUSCLE_LOG_CRITICALERROR, "%s:  failed update's acknowledgement included state ID " UINT64_FORMAT_SPEC "\n", desc, _lastAckUpdateID); ret = false;}
+      }
+      return ret;
+   }
+
+   virtual void CheckTestProgress()
+   {
+      status_t ret;
+      switch(GetTestState())
+      {
+         case TEST_STATE_WAIT_FOR_PEERS:
+            if ((IAmFullyAttached())&&(_otherPeer->IAmFullyAttached())&&(GetSeniorPeerID().IsValid())&&(GetSeniorPeerID() == _otherPeer->GetSeniorPeerID())&&(GetCurrentDatabaseStateID(0) == _otherPeer->GetCurrentDatabaseStateID(0)))
+            {
+               _senior = IAmTheSeniorPeer() ? this : _otherPeer;
+               _junior = IAmTheSeniorPeer() ? _otherPeer : this;
+
+               LogTime(MUSCLE_LOG_INFO, "Both peers are online; junior peer requests an update that only the senior peer needs to apply...\n");
+               if (_junior->RequestAcknowledgedAppend(1, 1).IsOK(ret)) SetTestState(TEST_STATE_SENIOR_ONLY_ACK);
+            }
+         break;
+
+         case TEST_STATE_SENIOR_ONLY_ACK:
+            if (_junior->IsAckReceived())
+            {
+               if (_junior->VerifyAck("Senior-only update", true, 1) == false) {EndTest(10); return;}
+
+               LogTime(MUSCLE_LOG_INFO, "Junior peer requests an update that every peer needs to apply...\n");
+               if (_junior->RequestAcknowledgedAppend(2, ZG_ALL_PEERS).IsOK(ret)) SetTestState(TEST_STATE_ALL_PEERS_ACK);
+            }
+         break;
+
+         case TEST_STATE_ALL_PEERS_ACK:
+            if (_junior->IsAckReceived())
+            {
+               if (_junior->VerifyAck("All-peers update", true, 2) == false) {EndTest(10); return;}
+
+               LogTime(MUSCLE_LOG_INFO, "Junior peer requests an update that the senior peer rejects...\n");
+               if (_junior->RequestAcknowledgedAppend(TEST_REJECTED_VALUE, ZG_ALL_PEERS).IsOK(ret)) SetTestState(TEST_STATE_REJECTED_ACK);
+            }
+         break;
+
+         case TEST_STATE_REJECTED_ACK:
+            if (_junior->IsAckReceived())
+            {
+               if (_junior->VerifyAck("Rejected update", false, 0) == false) {EndTest(10); return;}
+
+               LogTime(MUSCLE_LOG_INFO, "Senior peer requests an update that every peer needs to apply...\n");
+               if (_senior->RequestAcknowledgedAppend(3, ZG_ALL_PEERS).IsOK(ret)) SetTestState(TEST_STATE_SENIOR_REQUESTED_ACK);
+            }
+         break;
+
+         case TEST_STATE_SENIOR_REQUESTED_ACK:
+            if (_senior->IsAckReceived())
+            {
+               bool ok = _senior->VerifyAck("Senior-requested update", true, 2);
+               if ((_senior->GetValues().GetNumItems() != 3)||((_junior->GetValues() == _senior->GetValues()) == false)) {LogTime(MUSCLE_LOG_CRITICALERROR, "Peers' databases don't hold the expected values!\n"); ok = false;}
+               if (ok) LogTime(MUSCLE_LOG_INFO, "Test passed.\n");
+               EndTest(ok ? 0 : 10);
+            }
+         return;
+
+         default:
+            // empty
+         return;
+      }
+
+      if (ret.IsError())
+      {
+         LogTime(MUSCLE_LOG_CRITICALERROR, "Couldn't request update in test state %i! [%s]\n", GetTestState(), ret());
+         EndTest(10);
+      }
+   }
+
+   UpdateAckTestPeerSession * _otherPeer;
+
+   // These are used only on the peer that runs the test
+   UpdateAckTestPeerSession * _senior;
+   UpdateAckTestPeerSession * _junior;
+
+   // These are used on the peer that requested the update being tested
+   uint64 _expectedAckID;
+   uint32 _numAcksAtRequest;
+   uint32 _otherNumAcksAtRequest;
+
+   // These are recorded by DatabaseUpdateAcknowledged()
+   uint32 _numAcks;
+   uint64 _lastAckID;
+   uint64 _lastAckUpdateID;
+   uint32 _lastAckNumPeersApplied;
+   uint32 _lastAckNumPeersThatHadApplied;  // how many peers had actually applied the update when we were told about it
+   status_t _lastAckResult;
+};
+
+static ZGPeerSettings GetTestPeerSettings(const Message & args, const String & systemName)
+{
+   ZGPeerSettings s = GetLoopbackTestPeerSettings(args, "update_ack_test", systemName, 1);
+   s.SetUpdateAcknowledgementsEnabled(true);
+   return s;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   const String systemName = GetLoopbackTestSystemName("update_ack_test");
+   UpdateAckTestPeerSession peerA(GetTestPeerSettings(args, systemName), true);
+   UpdateAckTestPeerSession peerB(GetTestPeerSettings(args, systemName), false);
+   peerA.SetOtherPeer(&peerB);
+   peerB.SetOtherPeer(&peerA);
+
+   UpdateAckTestPeerSession * peers[] = {&peerA, &peerB};
+   return RunLoopbackTest(peers, ARRAYITEMS(peers), peerA);
+}
@@ -0,0 +1,107 @@
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+
+#include "zg/private/PZGUpdateLog.h"
+
+using namespace zg_private;
+
+// This program measures how quickly a database's update-log can append, look up, and trim updates,
+// first using the ring-buffer-based PZGUpdateLog and then using a plain OrderedKeysHashtable, so the two can be compared.
+//
+// Optional command-line arguments:
+//    updates=N   -- how many updates to place into the log (defaults to 1000000)
+
+typedef OrderedKeysHashtable<uint64, ConstPZGDatabaseUpdateRef> HashtableUpdateLog;
+
+static void LogResult(const char * desc, const char * op, uint32 numUpdates, uint64 elapsedMicros)
+{
+   const double secs = ((double)elapsedMicros)/1000000.0;
+   LogTime(MUSCLE_LOG_INFO, "%s:  " UINT32_FORMAT_SPEC " %s in %s (%.0f per second)\n", desc, numUpdates, op, GetHumanReadableUnsignedTimeIntervalString(elapsedMicros)(), (secs>0.0)?(((double)numUpdates)/secs):0.0);
+}
+
+template <class LogType> static status_t Append(LogType & log, const Queue<ConstPZGDatabaseUpdateRef> & updates)
+{
+   for (uint32 i=0; i<updates.GetNumItems(); i++) MRETURN_ON_ERROR(log.Put(updates[i]()->GetUpdateID(), updates[i]));
+   return B_NO_ERROR;
+}
+
+static uint32 Lookup(const PZGUpdateLog & log, uint64 firstID, uint32 numUpdates)
+{
+   uint32 numFound = 0;
+   for (uint32 i=0; i<numUpdates; i++) if (log.Get(firstID+i)) numFound++;
+   return numFound;
+}
+
+static uint32 Lookup(const HashtableUpdateLog & log, uint64 firstID, uint32 numUpdates)
+{
+   uint32 numFound = 0;
+   for (uint32 i=0; i<numUpdates; i++) if (log.Get(firstID+i)) numFound++;
+   return numFound;
+}
+
+static void Trim(PZGUpdateLog & log)
+{
+   ConstPZGDatabaseUpdateRef temp;
+   while((log.HasItems())&&(log.Remove(log.GetFirstKeyWithDefault(), temp).IsOK())) {/* empty */}
+}
+
+static void Trim(HashtableUpdateLog & log)
+{
+   while((log.HasItems())&&(log.Remove(*log.GetFirstKey()).IsOK())) {/* empty */}
+}
+
+template <class LogType> static status_t RunBenchmark(const char * desc, const Queue<ConstPZGDatabaseUpdateRef> & updates)
+{
+   const uint32 numUpdates = updates.GetNumItems();
+   const uint64 firstID    = updates.HasItems() ? updates.Head()()->GetUpdateID() : 0;
+
+   LogType log;
+
+   uint64 startTime = GetRunTime64();
+   status_t ret;
+   if (Append(log, updates).IsError(ret))
+   {
+      LogTime(MUSCLE_LOG_ERROR, "%s:  Appending updates failed! [%s]\n", desc, ret());
+      return ret;
+   }
+   LogResult(desc, "appends", numUpdates, GetRunTime64()-startTime);
+
+   startTime = GetRunTime64();
+   const uint32 numFound = Lookup(log, firstID, numUpdates);
+   LogResult(desc, "lookups", numUpdates, GetRunTime64()-startTime);
+   if (numFound != numUpdates)
+   {
+      LogTime(MUSCLE_LOG_ERROR, "%s:  Only " UINT32_FORMAT_SPEC "/" UINT32_FORMAT_SPEC " updates were found!\n", desc, numFound, numUpdates);
+      return B_LOGIC_ERROR;
+   }
+
+   startTime = GetRunTime64();
+   Trim(log);
+   LogResult(desc, "trims", numUpdates, GetRunTime64()-startTime);
+   return B_NO_ERROR;
+}
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   const char * s;
+   const uint32 numUpdates = (args.FindString("updates", &s).IsOK()) ? (uint32) atol(s) : 1000000;
+
+   // Create all the updates up front, so that we're only timing the update-logs themselves
+   Queue<ConstPZGDatabaseUpdateRef> updates;
+   if (updates.EnsureSize(numUpdates).IsError()) {MWARN_OUT_OF_MEMORY; return 10;}
+   for (uint32 i=0; i<numUpdates; i++)
+   {
+      PZGDatabaseUpdateRef dbUp = GetPZGDatabaseUpdateFromPool(PZG_DATABASE_UPDATE_TYPE_NOOP, 0, i+1, ZGPeerID(), 0);
+      if ((dbUp() == NULL)||(updates.AddTail(dbUp).IsError())) {MWARN_OUT_OF_MEMORY; return 10;}
+   }
+
+   LogTime(MUSCLE_LOG_INFO, "Benchmarking update-logs of " UINT32_FORMAT_SPEC " updates...\n", numUpdates);
+   if (RunBenchmark<PZGUpdateLog>("PZGUpdateLog", updates).IsError()) return 10;
+   if (RunBenchmark<HashtableUpdateLog>("OrderedKeysHashtable", updates).IsError()) return 10;
+   return 0;
+}
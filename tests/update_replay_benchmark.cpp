@@ -0,0 +1,136 @@
+#include "reflector/ReflectServer.h"
+#include "system/SetupSystem.h"
+#include "util/MiscUtilityFunctions.h"
+
+#include "zg/messagetree/server/MessageTreeDatabasePeerSession.h"
+#include "zg/messagetree/server/MessageTreeDatabaseObject.h"
+
+using namespace zg;
+
+// This program replays a recording of the database-updates that a tree_server peer applied
+// (as recorded by running tree_server with the recorddir=<path> argument) into a headless
+// MessageTreeDatabasePeerSession, as fast as possible, and reports how quickly the updates were applied.
+// Since the recording is replayed the same way every time, this is useful as a performance regression test
+// for MessageTreeDatabaseObject (or any other JuniorUpdateLocalDatabase() implementation).
+//
+// Command-line arguments:
+//    dir=path    -- the directory the recording was written into (required)
+//    db=N        -- index of the database to replay (defaults to replaying all of them)
+//    verify=N    -- recalculate and verify each database's checksum after every N updates (defaults to 0, meaning only at the end)
+
+// These must match the database layout used by tree_server, since that's where the recordings come from
+enum {
+   TREE_DATABASE_DEFAULT = 0,
+   TREE_DATABASE_SERVERINFO,
+   TREE_DATABASE_CLIENTINFO,
+   TREE_DATABASE_LOG,
+   NUM_TREE_DATABASES
+};
+
+static String GetDatabaseRootPath(uint32 whichDB)
+{
+   switch(whichDB)
+   {
+      case TREE_DATABASE_DEFAULT:    return GetEmptyString();
+      case TREE_DATABASE_SERVERINFO: return "srv";
+      case TREE_DATABASE_CLIENTINFO: return "cli";
+      case TREE_DATABASE_LOG:        return "log";
+      default:                       return "???";
+   }
+}
+
+static ZGPeerSettings GetReplayPeerSettings()
+{
+   // Our own system name, so that we won't interact with any other peers that might be running on this host
+   return ZGPeerSettings("update_replay_benchmark", String("replay_%1").Arg(GetRunTime64()), NUM_TREE_DATABASES, true);
+}
+
+class ReplayPeerSession : public MessageTreeDatabasePeerSession
+{
+public:
+   ReplayPeerSession(const String & recordingDir, int32 whichDB, uint32 verifyInterval)
+      : MessageTreeDatabasePeerSession(GetReplayPeerSettings())
+      , _recordingDir(recordingDir)
+      , _whichDB(whichDB)
+      , _verifyInterval(verifyInterval)
+   {/* empty */}
+
+   virtual const char * GetTypeName() const {return "ReplayPeer";}
+
+   virtual status_t AttachedToServer()
+   {
+      MRETURN_ON_ERROR(MessageTreeDatabasePeerSession::AttachedToServer());
+
+      // Our databases exist now, so we can do the whole replay right here and then exit
+      status_t ret;
+      for (uint32 i=0; i<NUM_TREE_DATABASES; i++)
+      {
+         if ((_whichDB >= 0)&&(i != (uint32)_whichDB)) continue;
+
+         ZGUpdateReplayStats dbStats;
+         if (ReplayUpdateRecording(i, _recordingDir, _verifyInterval, dbStats).IsError(ret))
+         {
+            LogTime(MUSCLE_LOG_ERROR, "Replay of database #" UINT32_FORMAT_SPEC " failed! [%s]\n", i, ret());
+            break;
+         }
+
+         LogTime(MUSCLE_LOG_INFO, "Database #" UINT32_FORMAT_SPEC " replayed to state #" UINT64_FORMAT_SPEC ":\n", i, GetCurrentDatabaseStateID(i));
+         dbStats.Print(stdout);
+         _totalStats.Merge(dbStats);
+      }
+
+      _result = ret;
+      EndServer();
+      return B_NO_ERROR;
+   }
+
+   MUSCLE_NODISCARD const ZGUpdateReplayStats & GetTotalStats() const {return _totalStats;}
+   MUSCLE_NODISCARD status_t GetResult() const {return _result;}
+
+protected:
+   virtual IDatabaseObjectRef CreateDatabaseObject(uint32 whichDatabase)
+   {
+      return IDatabaseObjectRef(new MessageTreeDatabaseObject(this, whichDatabase, GetDatabaseRootPath(whichDatabase)));
+   }
+
+private:
+   const String _recordingDir;
+   const int32 _whichDB;
+   const uint32 _verifyInterval;
+   ZGUpdateReplayStats _totalStats;
+   status_t _result;
+};
+
+int main(int argc, char ** argv)
+{
+   CompleteSetupSystem css;
+
+   Message args; (void) ParseArgs(argc, argv, args);
+   HandleStandardDaemonArgs(args);
+
+   const String recordingDir = args.GetString("dir");
+   if (recordingDir.IsEmpty())
+   {
+      LogTime(MUSCLE_LOG_CRITICALERROR, "Usage:  update_replay_benchmark dir=<recording directory> [db=N] [verify=N]\n");
+      return 10;
+   }
+
+   const char * s;
+   const int32 whichDB        = (args.FindString("db",     &s).IsOK()) ? (int32)  atol(s) : -1;
+   const uint32 verifyInterval = (args.FindString("verify", &s).IsOK()) ? (uint32) atol(s) : 0;
+
+   ReplayPeerSession peerSession(recordingDir, whichDB, verifyInterval);
+
+   ReflectServer server;
+   status_t ret;
+   if ((server.AddNewSession(DummyZGPeerSessionRef(peerSession)).IsOK(ret))&&(server.ServerProcessLoop().IsOK(ret))) ret = peerSession.GetResult();
+   if (ret.IsOK())
+   {
+      LogTime(MUSCLE_LOG_INFO, "Replay complete:\n");
+      peerSession.GetTotalStats().Print(stdout);
+   }
+   else LogTime(MUSCLE_LOG_ERROR, "Replay failed! [%s]\n", ret());
+
+   server.Cleanup();
+   return ret.IsOK() ? 0 : 10;
+}